@@ -1,19 +1,224 @@
 #include <Lemon/Graphics/Graphics.h>
+#include <Lemon/Graphics/PixelKernels.h>
 #include <Lemon/Graphics/Surface.h>
 #include <Lemon/GUI/Window.h>
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <time.h>
 
 Surface imageSurf;
 
+// Terminal sized block of text, drawn a line at a time
+const char* benchmarkText = "The quick brown fox jumps over the lazy dog 0123456789 !\"#$%&'()*+,-./:;<=>?@[]^_`{|}~";
+const int benchmarkLines = 48;
+const int benchmarkPasses = 50;
+
+long ElapsedUs(const timespec& start) {
+    timespec end;
+    clock_gettime(CLOCK_BOOTTIME, &end);
+
+    long us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    return us > 0 ? us : 1;
+}
+
+// Draw the benchmark text benchmarkPasses times, returns glyphs per second
+long MeasureText(Surface* surface, Lemon::Graphics::Font* font, bool cold) {
+    long glyphs = 0;
+    long us = 0;
+    for (int pass = 0; pass < benchmarkPasses; pass++) {
+        if (cold) {
+            Lemon::Graphics::ClearGlyphCache(font); // Every glyph has to be rendered again
+        }
+
+        timespec start;
+        clock_gettime(CLOCK_BOOTTIME, &start);
+
+        for (int i = 0; i < benchmarkLines; i++) {
+            Lemon::Graphics::DrawString(benchmarkText, 0, i * font->lineHeight, 255, 255, 255, surface, font);
+        }
+
+        us += ElapsedUs(start);
+        glyphs += strlen(benchmarkText) * benchmarkLines;
+    }
+
+    return glyphs * 1000000 / us;
+}
+
+int TextBenchmark() {
+    Lemon::Graphics::Font* font = Lemon::Graphics::DefaultFont();
+    if (!font) {
+        printf("No font loaded!\n");
+        return 1;
+    }
+
+    Surface surface;
+    surface.width = 1024;
+    surface.height = benchmarkLines * font->lineHeight;
+    surface.buffer = new uint8_t[surface.BufferSize()];
+    memset(surface.buffer, 0, surface.BufferSize());
+
+    printf("Text (cold): %ld glyphs/s\n", MeasureText(&surface, font, true));
+    printf("Text (warm): %ld glyphs/s\n", MeasureText(&surface, font, false));
+
+    delete[] surface.buffer;
+    return 0;
+}
+
+using Lemon::Graphics::PixelKernels;
+
+const int kernelWidth = 1024;
+const int kernelHeight = 768;
+const int kernelPasses = 20;
+
+// Runs a kernel over kernelWidth x kernelHeight pixels, returns the amount of pixels drawn
+struct KernelBenchmark {
+    const char* name;
+    long (*run)(const PixelKernels& kernels, uint32_t* dest, const uint32_t* src);
+};
+
+const KernelBenchmark kernelBenchmarks[] = {
+    {"blend",
+     [](const PixelKernels& k, uint32_t* dest, const uint32_t* src) -> long {
+         for (int i = 0; i < kernelHeight; i++) {
+             k.blend(dest + i * kernelWidth, src + i * kernelWidth, kernelWidth);
+         }
+         return kernelWidth * kernelHeight;
+     }},
+    {"blend fill",
+     [](const PixelKernels& k, uint32_t* dest, const uint32_t*) -> long {
+         for (int i = 0; i < kernelHeight; i++) {
+             k.blendFill(dest + i * kernelWidth, 0x80408060, kernelWidth);
+         }
+         return kernelWidth * kernelHeight;
+     }},
+    {"fill",
+     [](const PixelKernels& k, uint32_t* dest, const uint32_t*) -> long {
+         for (int i = 0; i < kernelHeight; i++) {
+             k.fill(dest + i * kernelWidth, 0xff408060, kernelWidth);
+         }
+         return kernelWidth * kernelHeight;
+     }},
+    {"blit",
+     [](const PixelKernels& k, uint32_t* dest, const uint32_t* src) -> long {
+         // Clipped to an unaligned region of the source
+         const int width = kernelWidth - 7;
+         for (int i = 0; i < kernelHeight - 5; i++) {
+             k.copy(dest + i * kernelWidth, src + (i + 5) * kernelWidth + 7, width);
+         }
+         return width * (kernelHeight - 5);
+     }},
+    {"gradient",
+     [](const PixelKernels& k, uint32_t* dest, const uint32_t*) -> long {
+         for (int i = 0; i < kernelHeight; i++) {
+             k.gradient(dest + i * kernelWidth, 0xff102030, 0xffe0c0a0, 0, kernelWidth, kernelWidth);
+         }
+         return kernelWidth * kernelHeight;
+     }},
+    {"bilinear",
+     [](const PixelKernels& k, uint32_t* dest, const uint32_t* src) -> long {
+         // Enlarge three quarters of the source to the whole surface
+         k.scaleBilinear(dest, kernelWidth, kernelWidth, kernelHeight, src, kernelWidth, kernelWidth * 3 / 4,
+                         kernelHeight * 3 / 4, 0xc000, 0xc000);
+         return kernelWidth * kernelHeight;
+     }},
+    {"box",
+     [](const PixelKernels& k, uint32_t* dest, const uint32_t* src) -> long {
+         // Shrink by three
+         k.scaleBox(dest, kernelWidth, kernelWidth / 3, kernelHeight / 3, src, kernelWidth, kernelWidth, kernelHeight,
+                    0x30000, 0x30000);
+         return (kernelWidth / 3) * (kernelHeight / 3);
+     }},
+};
+
+// Random pixels, a quarter are transparent and a quarter opaque so every blend path gets used
+void RandomPixels(uint32_t* pixels, int count, bool opaque) {
+    for (int i = 0; i < count; i++) {
+        uint32_t p = (rand() & 0xffff) | (static_cast<uint32_t>(rand()) << 16);
+        switch (rand() % 4) {
+        case 0:
+            p &= 0x00ffffff;
+            break;
+        case 1:
+            p |= 0xff000000;
+            break;
+        }
+
+        pixels[i] = opaque ? (p | 0xff000000) : p;
+    }
+}
+
+int KernelsBenchmark() {
+    const int pixelCount = kernelWidth * kernelHeight;
+    uint32_t* src = new uint32_t[pixelCount];
+    uint32_t* initial = new uint32_t[pixelCount];
+    uint32_t* expected = new uint32_t[pixelCount];
+    uint32_t* dest = new uint32_t[pixelCount];
+
+    RandomPixels(src, pixelCount, false);
+
+    // Mostly opaque with some translucent rows, like a window being drawn
+    RandomPixels(initial, pixelCount, true);
+    RandomPixels(initial + 64 * kernelWidth, 16 * kernelWidth, false);
+
+    const PixelKernels* scalar = Lemon::Graphics::GetKernels(Lemon::Graphics::SIMDScalar);
+
+    int failed = 0;
+    for (int level = 0; level < Lemon::Graphics::SIMDLevelCount; level++) {
+        const PixelKernels* kernels = Lemon::Graphics::GetKernels(static_cast<Lemon::Graphics::SIMDLevel>(level));
+        if (!kernels) {
+            break; // Not supported by the CPU
+        }
+
+        for (const KernelBenchmark& benchmark : kernelBenchmarks) {
+            // Check against the scalar kernel first
+            memcpy(expected, initial, pixelCount * sizeof(uint32_t));
+            memcpy(dest, initial, pixelCount * sizeof(uint32_t));
+            benchmark.run(*scalar, expected, src);
+            benchmark.run(*kernels, dest, src);
+
+            if (memcmp(expected, dest, pixelCount * sizeof(uint32_t))) {
+                printf("%-8s %-12s does not match scalar!\n", kernels->name, benchmark.name);
+                failed++;
+                continue;
+            }
+
+            long pixels = 0;
+            timespec start;
+            clock_gettime(CLOCK_BOOTTIME, &start);
+
+            for (int pass = 0; pass < kernelPasses; pass++) {
+                pixels += benchmark.run(*kernels, dest, src);
+            }
+
+            long mpixTenths = pixels * 10 / ElapsedUs(start); // Pixels per us is megapixels per second
+            printf("%-8s %-12s %ld.%ld MPix/s\n", kernels->name, benchmark.name, mpixTenths / 10, mpixTenths % 10);
+        }
+    }
+
+    printf("Using %s kernels\n", Lemon::Graphics::Kernels().name);
+
+    delete[] src;
+    delete[] initial;
+    delete[] expected;
+    delete[] dest;
+    return failed ? 1 : 0;
+}
+
 void OnPaint(surface_t* surface){
     memset(surface->buffer, 0, surface->width * surface->height * 4);
     surface->Blit(&imageSurf, {0, 0});
 }
 
-int main(){
+int main(int argc, char** argv){
+    if(argc > 1 && !strcmp(argv[1], "text")){
+        return TextBenchmark();
+    } else if(argc > 1 && !strcmp(argv[1], "kernels")){
+        return KernelsBenchmark();
+    }
+
     Lemon::Graphics::LoadImage("/system/lemon/resources/alphatest.png", &imageSurf);
 
     Lemon::GUI::Window* win = new Lemon::GUI::Window("Test Window", {imageSurf.width, imageSurf.height}, WINDOW_FLAGS_TRANSPARENT, Lemon::GUI::WindowType::Basic);
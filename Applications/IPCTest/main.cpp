@@ -1,5 +1,6 @@
 #include <stdio.h> 
 #include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <string.h>
@@ -9,6 +10,10 @@
 
 #include <lemon/syscall.h>
 
+#include <Lemon/IPC/Ring.h>
+#include <Lemon/System/IPC.h>
+#include <Lemon/System/KernelObject.h>
+
 const int msgCount = 8000;
 long avgTime = 0;
 
@@ -56,60 +61,166 @@ void* UDSThread(void* n){
     return nullptr;
 }
 
-void* LemonIPCThread(void* n){
-    long endpHandle = syscall(SYS_INTERFACE_CONNECT, "lemon.testservice/testif", 0, 0, 0, 0);
-    if(endpHandle <= 0){
-        printf("Failed to connect to interface %s!", "lemon.testservice/testif");
-        return nullptr;
+// Lemon IPC messages either go through the kernel on every send and receive,
+// or through the endpoint's shared memory rings like Lemon::Endpoint
+const char* echoInterfacePath = "lemon.testservice/testif";
+const uint16_t echoMessageSize = 512; // Same as most of the system's interfaces
+const uint16_t echoPayloadSize = 64;
+
+const int roundTrips = 20000;
+const int streamMessages = 100000;
+
+enum {
+    MessageEcho = 1, // Sent straight back
+    MessageStream = 2, // No reply
+    MessageStreamEnd = 3,
+    MessageQuit = 4,
+};
+
+struct Channel{
+    handle_t handle;
+    bool useRing;
+    Lemon::EndpointRing ring;
+
+    long Send(uint64_t id, const uint8_t* data, uint16_t size){
+        if(useRing && ring.Write(handle, id, data, size)){
+            return 0;
+        }
+
+        return Lemon::EndpointQueue(handle, id, size, reinterpret_cast<uintptr_t>(data));
     }
-    
-    char buf[64];
-    uint64_t id;
-    uint32_t size;
 
-    avgTime = 0;
+    // Blocks until there is a message
+    long Receive(uint64_t& id, uint16_t& size, uint8_t* data){
+        for(;;){
+            long ret = useRing ? ring.Read(handle, id, size, data) : Lemon::EndpointDequeue(handle, &id, &size, data);
+            if(ret){
+                return ret;
+            }
 
-    for(int i = 0; i < msgCount; i++){
-        long ret = syscall(SYS_ENDPOINT_DEQUEUE, endpHandle, &id, &size, buf, 0);
-        while(!ret){
-            ret = syscall(SYS_ENDPOINT_DEQUEUE, endpHandle, &id, &size, buf, 0);
+            Lemon::WaitForKernelObject(handle, -1);
         }
+    }
+};
 
-        if(ret <= 0){
-            printf("Error on endpoint dequeue!\n");
-            return nullptr;
-        }
+void* EchoThread(void* arg){
+    Channel* channel = reinterpret_cast<Channel*>(arg);
+    uint8_t buf[echoMessageSize];
 
-        clock_gettime(CLOCK_BOOTTIME, &newTimer[i]);
+    uint64_t id;
+    uint16_t size;
+    while(channel->Receive(id, size, buf) > 0 && id != MessageQuit){
+        if(id == MessageEcho || id == MessageStreamEnd){
+            channel->Send(id, buf, size);
+        }
     }
 
-    int low = newTimer[0] - timer[0];
-    int high = 0;
-    for(int i = 0; i < msgCount; i++){
-        int diff = (newTimer[i] - timer[i]);
-        if(diff / 1000 < low){
-            low = diff / 1000;
+    return nullptr;
+}
+
+long MicrosecondsSince(const timespec& start){
+    timespec end;
+    clock_gettime(CLOCK_BOOTTIME, &end);
+
+    long us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    return us > 0 ? us : 1;
+}
+
+// Returns the average round trip in nanoseconds or -1 on failure
+long MeasureRoundTrip(Channel& client){
+    uint8_t buf[echoMessageSize];
+    memset(buf, 0xAB, echoPayloadSize);
+
+    timespec start;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+
+    for(int i = 0; i < roundTrips; i++){
+        uint64_t id;
+        uint16_t size;
+        if(client.Send(MessageEcho, buf, echoPayloadSize) || client.Receive(id, size, buf) <= 0 || id != MessageEcho || size != echoPayloadSize){
+            printf("Round trip %d failed!\n", i);
+            return -1;
         }
+    }
 
-        if(diff / 1000 > high){
-            high = diff / 1000;
+    return MicrosecondsSince(start) * 1000 / roundTrips;
+}
+
+// Returns messages per second or -1 on failure
+long MeasureThroughput(Channel& client){
+    uint8_t buf[echoMessageSize];
+    memset(buf, 0xCD, echoPayloadSize);
+
+    timespec start;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+
+    for(int i = 0; i < streamMessages; i++){
+        if(client.Send(MessageStream, buf, echoPayloadSize)){
+            printf("Failed to send message %d!\n", i);
+            return -1;
         }
+    }
 
-        avgTime += diff;
+    // The echo thread has read everything once it replies to this
+    uint64_t id;
+    uint16_t size;
+    if(client.Send(MessageStreamEnd, buf, echoPayloadSize) || client.Receive(id, size, buf) <= 0 || id != MessageStreamEnd){
+        printf("Failed to finish stream!\n");
+        return -1;
     }
-    avgTime = avgTime / msgCount / 1000;
 
-    printf("Recieved messagees: avg time: %ldus, low: %dus, high %dus\n", avgTime, low, high);
+    return static_cast<long>(streamMessages) * 1000000 / MicrosecondsSince(start);
+}
 
-    return nullptr;
+int RunEndpointBenchmark(handle_t interface, bool useRing){
+    Channel client = {Lemon::InterfaceConnect(echoInterfacePath), useRing, {}};
+    if(client.handle <= 0){
+        printf("Failed to connect to interface %s!\n", echoInterfacePath);
+        return 1;
+    }
+
+    Channel server = {0, useRing, {}};
+    while(!(server.handle = Lemon::InterfaceAccept(interface))){
+        sched_yield();
+    }
+
+    if(server.handle < 0){
+        printf("Error accepting connection on interface!\n");
+        return 1;
+    }
+
+    if(useRing && (client.ring.Map(client.handle) || server.ring.Map(server.handle))){
+        printf("Failed to map endpoint rings!\n");
+        return 1;
+    }
+
+    pthread_t echoThread;
+    if(pthread_create(&echoThread, nullptr, EchoThread, &server)){
+        printf("Failed to create echo thread!\n");
+        return 1;
+    }
+
+    long roundTrip = MeasureRoundTrip(client);
+    long throughput = (roundTrip < 0) ? -1 : MeasureThroughput(client);
+
+    client.Send(MessageQuit, nullptr, 0);
+    pthread_join(echoThread, nullptr);
+
+    Lemon::DestroyKObject(client.handle);
+    Lemon::DestroyKObject(server.handle);
+
+    if(throughput < 0){
+        return 1;
+    }
+
+    printf("%s: %ld messages/s, %ld.%03ldus round trip\n", useRing ? "Shared ring" : "Kernel queue", throughput, roundTrip / 1000, roundTrip % 1000);
+    return 0;
 }
 
 pthread_t t1;
-pthread_t t2;
 
 long svcHandle;
 long ifHandle;
-long endpHandle;
 
 int udsListener;
 int main(){
@@ -145,30 +256,16 @@ int main(){
         return 1;
     }
 
-    ifHandle = syscall(SYS_CREATE_INTERFACE, svcHandle, "testif", 64, 0, 0);
-    if(svcHandle <= 0){
+    ifHandle = syscall(SYS_CREATE_INTERFACE, svcHandle, "testif", echoMessageSize, 0, 0);
+    if(ifHandle <= 0){
         printf("Failed to create interface!");
         return 1;
     }
 
-    pthread_create(&t2, nullptr, LemonIPCThread, nullptr);
-
-    long endpHandle = syscall(SYS_INTERFACE_ACCEPT, ifHandle, 0, 0, 0, 0);
-    while(!endpHandle){
-        endpHandle = syscall(SYS_INTERFACE_ACCEPT, ifHandle, 0, 0, 0, 0);
-    }
-
-    if(endpHandle <= 0){
-        printf("Error accepting connection on interface!");
-        return 0;
-    }
-
-    for(int i = 0; i < msgCount; i++){
-        clock_gettime(CLOCK_BOOTTIME, &timer[i]);
-        syscall(SYS_ENDPOINT_QUEUE, endpHandle, 0xDEADBEEF, 64, msg, 0);
+    printf("Lemon IPC, %d round trips and %d one way messages of %u bytes:\n", roundTrips, streamMessages, echoPayloadSize);
+    if(RunEndpointBenchmark(ifHandle, false) || RunEndpointBenchmark(ifHandle, true)){
+        return 1;
     }
 
-    pthread_join(t2, nullptr);
-
     return 0;
 }
\ No newline at end of file
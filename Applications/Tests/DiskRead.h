@@ -0,0 +1,214 @@
+#pragma once
+
+#include "Test.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <Lemon/System/ABI/Disk.h>
+
+#include <vector>
+
+namespace DiskReadTest {
+
+const char* diskPath = "/dev/hd0";
+const size_t bytesPerRun = 32 * 1024 * 1024;
+const size_t requestSizes[] = {512, 4096, 64 * 1024, 1024 * 1024};
+
+// Read bytesPerRun sequentially from the start of the disk, returns bandwidth in KB/s or -1 on failure
+long MeasureSequentialRead(int fd, uint8_t* buffer, size_t requestSize) {
+    timespec start, end;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+
+    for (size_t offset = 0; offset < bytesPerRun; offset += requestSize) {
+        if (pread(fd, buffer, requestSize, offset) != static_cast<ssize_t>(requestSize)) {
+            perror("pread");
+            return -1;
+        }
+    }
+
+    clock_gettime(CLOCK_BOOTTIME, &end);
+
+    long us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    if (us <= 0) {
+        us = 1;
+    }
+
+    return static_cast<long>(bytesPerRun / 1024 * 1000000 / us);
+}
+
+// Random reads are spread over this much of the disk
+const size_t randomReadSpan = 64 * 1024 * 1024;
+const size_t randomReadSize = 4096;
+const int randomReadsPerRun = 8192;
+const int queueDepths[] = {1, 32};
+
+struct RandomReadThread {
+    pthread_t thread;
+    int fd;
+    int readCount;
+    unsigned seed;
+    bool failed;
+};
+
+void* RandomReadThreadEntry(void* arg) {
+    RandomReadThread* t = reinterpret_cast<RandomReadThread*>(arg);
+    uint8_t* buffer = reinterpret_cast<uint8_t*>(malloc(randomReadSize));
+
+    for (int i = 0; i < t->readCount; i++) {
+        // Simple LCG so every run reads the same blocks
+        t->seed = t->seed * 1103515245 + 12345;
+        off_t offset = static_cast<off_t>(t->seed % (randomReadSpan / randomReadSize)) * randomReadSize;
+
+        if (pread(t->fd, buffer, randomReadSize, offset) != static_cast<ssize_t>(randomReadSize)) {
+            perror("pread");
+            t->failed = true;
+            break;
+        }
+    }
+
+    free(buffer);
+    return nullptr;
+}
+
+// One thread per outstanding request so the disk driver gets queueDepth commands at once,
+// returns reads per second or -1 on failure
+long MeasureRandomRead(int fd, int queueDepth) {
+    std::vector<RandomReadThread> threads(queueDepth);
+
+    timespec start, end;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+
+    for (int i = 0; i < queueDepth; i++) {
+        threads[i] = {0, fd, randomReadsPerRun / queueDepth, static_cast<unsigned>(i * 7919 + 1), false};
+        if (pthread_create(&threads[i].thread, nullptr, RandomReadThreadEntry, &threads[i])) {
+            printf("Failed to create thread %d!\n", i);
+            for (int j = 0; j < i; j++) {
+                pthread_join(threads[j].thread, nullptr);
+            }
+            return -1;
+        }
+    }
+
+    bool failed = false;
+    for (RandomReadThread& t : threads) {
+        pthread_join(t.thread, nullptr);
+        failed |= t.failed;
+    }
+
+    clock_gettime(CLOCK_BOOTTIME, &end);
+    if (failed) {
+        return -1;
+    }
+
+    long us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    if (us <= 0) {
+        us = 1;
+    }
+
+    return static_cast<long>(randomReadsPerRun) * 1000000 / us;
+}
+
+void PrintQueueStats(int fd) {
+    lemon_disk_queue_stats_t stats;
+    if (ioctl(fd, IoCtlDiskGetQueueStats, &stats)) {
+        return; // Not going through a block queue
+    }
+
+    printf("    %lu requests, %lu commands, %lu merges, %lu deadline misses\n    Latency (us):", stats.requests,
+           stats.dispatched, stats.merges, stats.expired);
+    for (int i = 0; i < LEMON_DISK_LATENCY_BUCKETS; i++) {
+        if (stats.latency[i]) {
+            printf(" [%lu+]: %lu", i ? (1UL << i) : 0, stats.latency[i]);
+        }
+    }
+    printf("\n");
+}
+
+}; // namespace DiskReadTest
+
+int RunDiskReadBenchmark() {
+    using namespace DiskReadTest;
+
+    int fd = open(diskPath, O_RDONLY);
+    if (fd < 0) {
+        perror(diskPath);
+        return 1;
+    }
+
+    uint8_t* buffer = reinterpret_cast<uint8_t*>(malloc(requestSizes[sizeof(requestSizes) / sizeof(size_t) - 1]));
+    if (!buffer) {
+        close(fd);
+        return 1;
+    }
+
+    int ret = 0;
+    printf("Sequential read of %lu MB from %s:\n", bytesPerRun / 1024 / 1024, diskPath);
+    for (size_t requestSize : requestSizes) {
+        long bandwidth = MeasureSequentialRead(fd, buffer, requestSize);
+        if (bandwidth < 0) {
+            ret = 2;
+            break;
+        }
+
+        printf("%8lu byte requests: %ld KB/s\n", requestSize, bandwidth);
+    }
+
+    free(buffer);
+    close(fd);
+    return ret;
+}
+
+static Test diskReadTest = {
+    .func = RunDiskReadBenchmark,
+    .prettyName = "Disk Sequential Read",
+};
+
+// Compare a single outstanding request against a full NCQ queue
+int RunDiskQueueDepthBenchmark() {
+    using namespace DiskReadTest;
+
+    int fd = open(diskPath, O_RDONLY);
+    if (fd < 0) {
+        perror(diskPath);
+        return 1;
+    }
+
+    lemon_disk_queue_stats_t initialStats = {};
+    ioctl(fd, IoCtlDiskGetQueueStats, &initialStats);
+
+    int ret = 0;
+    printf("Random %lu byte reads over the first %lu MB of %s:\n", randomReadSize, randomReadSpan / 1024 / 1024,
+           diskPath);
+    for (int queueDepth : queueDepths) {
+        // Let the block queue give the driver as many commands as we have threads
+        ioctl(fd, IoCtlDiskSetQueueDepth, queueDepth);
+        ioctl(fd, IoCtlDiskResetQueueStats);
+
+        long iops = MeasureRandomRead(fd, queueDepth);
+        if (iops < 0) {
+            ret = 2;
+            break;
+        }
+
+        printf("Queue depth %2d: %ld reads/s, %ld KB/s\n", queueDepth, iops, iops * (randomReadSize / 1024));
+        PrintQueueStats(fd);
+    }
+
+    if (initialStats.queueDepth) {
+        ioctl(fd, IoCtlDiskSetQueueDepth, initialStats.queueDepth);
+    }
+
+    close(fd);
+    return ret;
+}
+
+static Test diskQueueDepthTest = {
+    .func = RunDiskQueueDepthBenchmark,
+    .prettyName = "Disk Queue Depth",
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "Test.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace ELFLoadTest {
+
+const char elfPath[] = "/tmp/elfloadtest";
+
+const uint64_t segmentFileOffset = 0x80;
+const uint64_t segmentMemSize = 0x2000; // The .bss crosses into the next page
+const int expectedExitCode = 42;
+
+// Exits with the byte after the code plus the first and last bytes of the .bss,
+// which must be zero. Position independent so any load address works.
+const uint8_t program[] = {
+    0x0f, 0xb6, 0x3d, 0x1b, 0x00, 0x00, 0x00, // movzx edi, byte [rip + 0x1b] (marker)
+    0x0f, 0xb6, 0x05, 0x15, 0x00, 0x00, 0x00, // movzx eax, byte [rip + 0x15] (first .bss byte)
+    0x01, 0xc7,                               // add edi, eax
+    0x0f, 0xb6, 0x05, 0xe8, 0x1f, 0x00, 0x00, // movzx eax, byte [rip + 0x1fe8] (last .bss byte)
+    0x01, 0xc7,                               // add edi, eax
+    0xb8, 0x01, 0x00, 0x00, 0x00,             // mov eax, SYS_EXIT
+    0xcd, 0x69,                               // int 0x69
+    0xeb, 0xfe,                               // jmp $
+    expectedExitCode,                         // marker
+};
+
+// Write a static executable with a single PT_LOAD segment at vaddr
+int WriteELF(uint64_t vaddr) {
+    uint8_t image[segmentFileOffset + sizeof(program)];
+    memset(image, 0, sizeof(image));
+
+    Elf64_Ehdr* ehdr = reinterpret_cast<Elf64_Ehdr*>(image);
+    memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+    ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr->e_type = ET_EXEC;
+    ehdr->e_machine = EM_X86_64;
+    ehdr->e_version = EV_CURRENT;
+    ehdr->e_entry = vaddr;
+    ehdr->e_phoff = sizeof(Elf64_Ehdr);
+    ehdr->e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr->e_phentsize = sizeof(Elf64_Phdr);
+    ehdr->e_phnum = 1;
+
+    Elf64_Phdr* phdr = reinterpret_cast<Elf64_Phdr*>(image + sizeof(Elf64_Ehdr));
+    phdr->p_type = PT_LOAD;
+    phdr->p_flags = PF_R | PF_X;
+    phdr->p_offset = segmentFileOffset;
+    phdr->p_vaddr = vaddr;
+    phdr->p_paddr = vaddr;
+    phdr->p_filesz = sizeof(program);
+    phdr->p_memsz = segmentMemSize;
+    phdr->p_align = 0x1000;
+
+    memcpy(image + segmentFileOffset, program, sizeof(program));
+
+    int fd = open(elfPath, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (fd < 0) {
+        perror("Failed to create test executable");
+        return 1;
+    }
+
+    int ret = 0;
+    if (write(fd, image, sizeof(image)) != static_cast<ssize_t>(sizeof(image))) {
+        perror("Failed to write test executable");
+        ret = 1;
+    }
+
+    close(fd);
+    return ret;
+}
+
+int RunELF(uint64_t vaddr, const char* description) {
+    if (WriteELF(vaddr)) {
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (!pid) {
+        char* argv[] = {const_cast<char*>(elfPath), nullptr};
+        char* envp[] = {nullptr};
+        execve(elfPath, argv, envp);
+        _exit(127);
+    } else if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != expectedExitCode) {
+        printf("%s segment: expected exit code %d, got status %x\n", description, expectedExitCode, status);
+        return 1;
+    }
+
+    return 0;
+}
+
+}; // namespace ELFLoadTest
+
+int RunELFLoadTest() {
+    using namespace ELFLoadTest;
+
+    // Same offset within the page as in the file, mapped from the page cache
+    int ret = RunELF(0x400000 + segmentFileOffset, "Aligned");
+    // Different offset within the page, so the kernel has to copy the segment in
+    if (!ret) {
+        ret = RunELF(0x400010, "Misaligned");
+    }
+
+    unlink(elfPath);
+    return ret;
+}
+
+static Test elfLoadTest = {
+    .func = RunELFLoadTest,
+    .prettyName = "ELF Segment Loading",
+};
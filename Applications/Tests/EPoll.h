@@ -0,0 +1,123 @@
+#pragma once
+
+#include "Test.h"
+
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+namespace EPollTest {
+
+const int idleCounts[] = {10, 1000, 10000};
+const int wakeupsPerRun = 10000;
+
+// Register idleCount fds which never become ready alongside one pipe which gets written to,
+// returns the average time from the write to epoll_wait returning in nanoseconds or -1 on failure
+long MeasureWaitLatency(int idleCount) {
+    int idle[2];
+    int active[2];
+    if (pipe(idle) || pipe(active)) {
+        perror("pipe");
+        return -1;
+    }
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    long ret = -1;
+    std::vector<int> idleFds;
+
+    // Every duplicate is registered separately, the pipe is never written to
+    for (int i = 0; i < idleCount; i++) {
+        int fd = dup(idle[0]);
+        if (fd < 0) {
+            perror("dup");
+            goto cleanup;
+        }
+
+        idleFds.push_back(fd);
+
+        epoll_event ev = {.events = EPOLLIN, .data = {.fd = fd}};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            perror("epoll_ctl");
+            goto cleanup;
+        }
+    }
+
+    {
+        epoll_event ev = {.events = EPOLLIN, .data = {.fd = active[0]}};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, active[0], &ev)) {
+            perror("epoll_ctl");
+            goto cleanup;
+        }
+
+        long totalNs = 0;
+        for (int i = 0; i < wakeupsPerRun; i++) {
+            timespec start, end;
+            clock_gettime(CLOCK_BOOTTIME, &start);
+
+            char c = 'e';
+            if (write(active[1], &c, 1) != 1) {
+                perror("write");
+                goto cleanup;
+            }
+
+            epoll_event events[8];
+            int n = epoll_wait(epfd, events, 8, -1);
+
+            clock_gettime(CLOCK_BOOTTIME, &end);
+
+            if (n != 1 || events[0].data.fd != active[0]) {
+                printf("epoll_wait: Expected only the active fd to be ready (got %d events)\n", n);
+                goto cleanup;
+            }
+
+            if (read(active[0], &c, 1) != 1) {
+                perror("read");
+                goto cleanup;
+            }
+
+            totalNs += (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+        }
+
+        ret = totalNs / wakeupsPerRun;
+    }
+
+cleanup:
+    for (int fd : idleFds) {
+        close(fd);
+    }
+
+    close(epfd);
+    close(idle[0]);
+    close(idle[1]);
+    close(active[0]);
+    close(active[1]);
+    return ret;
+}
+
+int RunEPollWaitLatency() {
+    for (int idleCount : idleCounts) {
+        long ns = MeasureWaitLatency(idleCount);
+        if (ns < 0) {
+            return 1;
+        }
+
+        printf("epoll_wait with %d idle fds: %ld.%03ldus\n", idleCount, ns / 1000, ns % 1000);
+    }
+
+    return 0;
+}
+
+}; // namespace EPollTest
+
+static Test epollTest = {
+    .func = EPollTest::RunEPollWaitLatency,
+    .prettyName = "epoll_wait Latency",
+};
@@ -0,0 +1,199 @@
+#pragma once
+
+#include "Test.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace FileMappingTest {
+
+const char* testFilePath = "/tmp/mmaptest";
+const size_t testFileSize = 64 * 1024 + 123; // Make sure the last page is partial
+
+// Large file on disk to time cold and warm reads of
+const char* readBenchmarkPath = "/system/lib/libc.so";
+
+uint8_t PatternByte(size_t offset) { return static_cast<uint8_t>(offset * 7 + (offset >> 12)); }
+
+int CreateTestFile() {
+    int fd = open(testFilePath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    uint8_t buffer[4096];
+    for (size_t offset = 0; offset < testFileSize; offset += sizeof(buffer)) {
+        size_t count = testFileSize - offset < sizeof(buffer) ? testFileSize - offset : sizeof(buffer);
+        for (size_t i = 0; i < count; i++) {
+            buffer[i] = PatternByte(offset + i);
+        }
+
+        if (write(fd, buffer, count) != static_cast<ssize_t>(count)) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+// Mapped data should match what was written, and the rest of the last page should be zero
+int CheckMappingContents(const uint8_t* map) {
+    for (size_t i = 0; i < testFileSize; i++) {
+        if (map[i] != PatternByte(i)) {
+            printf("Mapping differs from file at offset %lu\n", i);
+            return 1;
+        }
+    }
+
+    size_t mappedSize = (testFileSize + 4095) & ~4095UL;
+    for (size_t i = testFileSize; i < mappedSize; i++) {
+        if (map[i]) {
+            printf("Mapping is not zeroed past the end of the file (offset %lu)\n", i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int RunSharedMappingCheck(int fd) {
+    uint8_t* map = reinterpret_cast<uint8_t*>(mmap(nullptr, testFileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    if (map == MAP_FAILED) {
+        perror("mmap (MAP_SHARED)");
+        return 1;
+    }
+
+    if (CheckMappingContents(map)) {
+        return 1;
+    }
+
+    // Writes to the mapping should be seen by read()
+    map[5000] = 0xAB;
+
+    uint8_t value = 0;
+    if (pread(fd, &value, 1, 5000) != 1 || value != 0xAB) {
+        printf("Write through shared mapping not visible to read() (%x)\n", value);
+        return 1;
+    }
+
+    // Writes with write() should be seen by the mapping
+    value = 0xCD;
+    if (pwrite(fd, &value, 1, 6000) != 1 || map[6000] != 0xCD) {
+        printf("write() not visible through shared mapping (%x)\n", map[6000]);
+        return 1;
+    }
+
+    munmap(map, testFileSize);
+
+    // Restore the pattern for the private mapping check
+    uint8_t original[2] = {PatternByte(5000), PatternByte(6000)};
+    pwrite(fd, &original[0], 1, 5000);
+    pwrite(fd, &original[1], 1, 6000);
+    return 0;
+}
+
+int RunPrivateMappingCheck(int fd) {
+    uint8_t* map = reinterpret_cast<uint8_t*>(mmap(nullptr, testFileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0));
+    if (map == MAP_FAILED) {
+        perror("mmap (MAP_PRIVATE)");
+        return 1;
+    }
+
+    if (CheckMappingContents(map)) {
+        return 1;
+    }
+
+    // Writes to a private mapping must not reach the file
+    map[100] = ~PatternByte(100);
+
+    uint8_t value = 0;
+    if (pread(fd, &value, 1, 100) != 1 || value != PatternByte(100)) {
+        printf("Write through private mapping reached the file\n");
+        return 1;
+    }
+
+    munmap(map, testFileSize);
+    return 0;
+}
+
+long TimeRead(int fd, uint8_t* buffer, size_t size) {
+    timespec start, end;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+    pread(fd, buffer, size, 0);
+    clock_gettime(CLOCK_BOOTTIME, &end);
+
+    return (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+// The second read should be served from the page cache
+int RunReadBenchmark() {
+    int fd = open(readBenchmarkPath, O_RDONLY);
+    if (fd < 0) {
+        perror(readBenchmarkPath);
+        return 1;
+    }
+
+    off_t size = lseek(fd, 0, SEEK_END);
+    uint8_t* buffer = new uint8_t[size];
+
+    long first = TimeRead(fd, buffer, size);
+    long second = TimeRead(fd, buffer, size);
+
+    timespec start, end;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+    volatile uint8_t* map = reinterpret_cast<uint8_t*>(mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0));
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    for (off_t i = 0; i < size; i += 4096) {
+        (void)map[i];
+    }
+    clock_gettime(CLOCK_BOOTTIME, &end);
+    long mapped = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+
+    printf("%s (%ld bytes): first read %ld us, second read %ld us, mapped and touched %ld us\n", readBenchmarkPath,
+           size, first, second, mapped);
+
+    munmap(const_cast<uint8_t*>(map), size);
+    delete[] buffer;
+    close(fd);
+    return 0;
+}
+
+}; // namespace FileMappingTest
+
+int RunFileMappingTest() {
+    using namespace FileMappingTest;
+
+    int fd = CreateTestFile();
+    if (fd < 0) {
+        return 1;
+    }
+
+    if (RunSharedMappingCheck(fd)) {
+        return 2;
+    }
+
+    if (RunPrivateMappingCheck(fd)) {
+        return 3;
+    }
+
+    close(fd);
+    unlink(testFilePath);
+
+    return RunReadBenchmark();
+}
+
+static Test fileMappingTest = {
+    .func = RunFileMappingTest,
+    .prettyName = "File Mapping",
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "Test.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+namespace FileReadTest {
+
+// Lots of files on the root filesystem, like a build reading headers and libraries
+const char* readDirectory = "/system/lib";
+const size_t readSize = 4096; // Small reads like cat, so the block cache and readahead do the work
+const int threadCounts[] = {1, 2, 4};
+
+struct ReaderThread {
+    pthread_t thread;
+    const std::vector<std::string>* files;
+    size_t bytesRead;
+    bool failed;
+};
+
+void* ReaderThreadEntry(void* arg) {
+    ReaderThread* t = reinterpret_cast<ReaderThread*>(arg);
+    uint8_t* buffer = reinterpret_cast<uint8_t*>(malloc(readSize));
+
+    for (const std::string& path : *t->files) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            perror(path.c_str());
+            t->failed = true;
+            break;
+        }
+
+        ssize_t r;
+        while ((r = read(fd, buffer, readSize)) > 0) {
+            t->bytesRead += r;
+        }
+
+        if (r < 0) {
+            perror("read");
+            t->failed = true;
+        }
+
+        close(fd);
+    }
+
+    free(buffer);
+    return nullptr;
+}
+
+// Every thread reads every file, returns the total bandwidth in KB/s or -1 on failure
+long MeasureParallelRead(const std::vector<std::string>& files, int threadCount) {
+    std::vector<ReaderThread> threads(threadCount);
+
+    timespec start, end;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+
+    for (int i = 0; i < threadCount; i++) {
+        threads[i] = {0, &files, 0, false};
+        if (pthread_create(&threads[i].thread, nullptr, ReaderThreadEntry, &threads[i])) {
+            printf("Failed to create thread %d!\n", i);
+            for (int j = 0; j < i; j++) {
+                pthread_join(threads[j].thread, nullptr);
+            }
+            return -1;
+        }
+    }
+
+    bool failed = false;
+    size_t bytesRead = 0;
+    for (ReaderThread& t : threads) {
+        pthread_join(t.thread, nullptr);
+        failed |= t.failed;
+        bytesRead += t.bytesRead;
+    }
+
+    clock_gettime(CLOCK_BOOTTIME, &end);
+    if (failed) {
+        return -1;
+    }
+
+    long us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    if (us <= 0) {
+        us = 1;
+    }
+
+    return static_cast<long>(bytesRead / 1024 * 1000000 / us);
+}
+
+}; // namespace FileReadTest
+
+int RunFileReadBenchmark() {
+    using namespace FileReadTest;
+
+    DIR* dir = opendir(readDirectory);
+    if (!dir) {
+        perror(readDirectory);
+        return 1;
+    }
+
+    std::vector<std::string> files;
+    while (dirent* ent = readdir(dir)) {
+        if (ent->d_type == DT_REG) {
+            files.push_back(std::string(readDirectory) + "/" + ent->d_name);
+        }
+    }
+    closedir(dir);
+
+    printf("Reading %lu files from %s in %lu byte reads:\n", files.size(), readDirectory, readSize);
+
+    // Fill the caches so every run is measuring the same thing
+    if (MeasureParallelRead(files, 1) < 0) {
+        return 2;
+    }
+
+    for (int threadCount : threadCounts) {
+        long bandwidth = MeasureParallelRead(files, threadCount);
+        if (bandwidth < 0) {
+            return 2;
+        }
+
+        printf("%d threads: %ld KB/s\n", threadCount, bandwidth);
+    }
+
+    return 0;
+}
+
+static Test fileReadTest = {
+    .func = RunFileReadBenchmark,
+    .prettyName = "Parallel File Read",
+};
@@ -6,15 +6,36 @@
 #include <unistd.h>
 
 #include "Audio.h"
+#include "DiskRead.h"
+#include "ELFLoad.h"
+#include "EPoll.h"
+#include "FileMapping.h"
+#include "FileRead.h"
+#include "PageFault.h"
 #include "Pipe.h"
+#include "Scheduler.h"
+#include "Socket.h"
+#include "Spawn.h"
 #include "Terminal.h"
 #include "Syscall.h"
+#include "Timer.h"
 
 const std::unordered_map<std::string, Test> tests = {
     {"pipe", pipeTest},
     {"terminal", termTest},
     {"audio", audioTest},
     {"syscall", syscallTest},
+    {"scheduler", schedulerTest},
+    {"timer", timerTest},
+    {"pagefault", pageFaultTest},
+    {"spawn", spawnTest},
+    {"mmap", fileMappingTest},
+    {"diskread", diskReadTest},
+    {"diskqd", diskQueueDepthTest},
+    {"fsread", fileReadTest},
+    {"epoll", epollTest},
+    {"udpbatch", udpBatchTest},
+    {"elfload", elfLoadTest},
 };
 
 void ExecuteTest(const Test& test) {
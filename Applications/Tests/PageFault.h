@@ -0,0 +1,125 @@
+#pragma once
+
+#include "Test.h"
+
+#include <Lemon/System/Info.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+namespace PageFaultTest {
+
+const int threadCounts[] = {1, 2, 4, 8, 16};
+const size_t pagesPerRound = 32768; // 128MB split between the threads
+const size_t pageSize = 4096;
+
+struct FaultRegion {
+    volatile uint8_t* base;
+    size_t pageCount;
+};
+
+volatile bool startTouching = false;
+
+// Every page of the region is fresh anonymous memory so each write is a page fault
+void* TouchThread(void* arg) {
+    FaultRegion* region = reinterpret_cast<FaultRegion*>(arg);
+
+    while (!startTouching) {
+        sched_yield();
+    }
+
+    for (size_t i = 0; i < region->pageCount; i++) {
+        region->base[i * pageSize] = 1;
+    }
+
+    return nullptr;
+}
+
+uint64_t TotalCacheHits(const lemon_meminfo_t& info) {
+    uint64_t hits = 0;
+    for (unsigned i = 0; i < info.cpuCount; i++) {
+        hits += info.cpus[i].hits;
+    }
+    return hits;
+}
+
+int RunFaultBenchmark(int threadCount) {
+    size_t pagesPerThread = pagesPerRound / threadCount;
+
+    std::vector<FaultRegion> regions(threadCount);
+    std::vector<pthread_t> threads(threadCount);
+    for (int i = 0; i < threadCount; i++) {
+        void* mapping = mmap(nullptr, pagesPerThread * pageSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (mapping == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+
+        regions[i] = {reinterpret_cast<volatile uint8_t*>(mapping), pagesPerThread};
+    }
+
+    startTouching = false;
+    for (int i = 0; i < threadCount; i++) {
+        if (pthread_create(&threads[i], nullptr, TouchThread, &regions[i])) {
+            printf("Failed to create thread %d!\n", i);
+            return 1;
+        }
+    }
+
+    lemon_meminfo_t before = Lemon::MemoryInfo();
+
+    timespec start, end;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+    startTouching = true;
+
+    for (int i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+    clock_gettime(CLOCK_BOOTTIME, &end);
+
+    lemon_meminfo_t after = Lemon::MemoryInfo();
+
+    long ns = (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+    size_t faults = pagesPerThread * threadCount;
+
+    printf("%3d threads: %lu faults in %ld us, %lu faults/s, %lu page cache hits\n", threadCount, faults, ns / 1000,
+           faults * 1000000000 / (ns ? ns : 1), TotalCacheHits(after) - TotalCacheHits(before));
+
+    for (auto& region : regions) {
+        munmap(const_cast<uint8_t*>(region.base), region.pageCount * pageSize);
+    }
+
+    return 0;
+}
+
+}; // namespace PageFaultTest
+
+int RunPageFaultBenchmark() {
+    using namespace PageFaultTest;
+
+    printf("Anonymous memory page fault throughput:\n");
+    for (int count : threadCounts) {
+        if (RunFaultBenchmark(count)) {
+            return 1;
+        }
+    }
+
+    lemon_meminfo_t info = Lemon::MemoryInfo();
+    for (unsigned i = 0; i < info.zoneCount; i++) {
+        printf("Zone %u [%lx-%lx]: %lu/%lu pages free, %lu allocations, %lu failed\n", i, info.zones[i].base,
+               info.zones[i].end, info.zones[i].freePages, info.zones[i].totalPages, info.zones[i].allocations,
+               info.zones[i].failedAllocations);
+    }
+
+    return 0;
+}
+
+static Test pageFaultTest = {
+    .func = RunPageFaultBenchmark,
+    .prettyName = "Page Fault Benchmark",
+};
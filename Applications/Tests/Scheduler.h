@@ -0,0 +1,189 @@
+#pragma once
+
+#include "Test.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+namespace SchedulerTest {
+
+const int threadCounts[] = {1, 4, 16, 64, 256, 1024};
+const int yieldsPerRound = 20000;
+const int pingPongCount = 2000;
+const int idleThreadCounts[] = {0, 10, 100, 1000, 5000};
+
+inline long NanosecondsSince(const timespec& start) {
+    timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+
+    return (now.tv_sec - start.tv_sec) * 1000000000 + (now.tv_nsec - start.tv_nsec);
+}
+
+volatile bool startYielding = false;
+
+void* YieldThread(void* yieldCount) {
+    while (!startYielding) {
+        sched_yield();
+    }
+
+    for (long i = 0; i < reinterpret_cast<long>(yieldCount); i++) {
+        sched_yield();
+    }
+
+    return nullptr;
+}
+
+// Threads blocked on a pipe that is never written to until the end of the test
+void* IdleThread(void* pipeFd) {
+    char c;
+    read(static_cast<int>(reinterpret_cast<long>(pipeFd)), &c, 1);
+    return nullptr;
+}
+
+void* PongThread(void* fds) {
+    int* pipes = reinterpret_cast<int*>(fds);
+
+    char c;
+    for (int i = 0; i < pingPongCount; i++) {
+        if (read(pipes[0], &c, 1) != 1 || write(pipes[3], &c, 1) != 1) {
+            break;
+        }
+    }
+
+    return nullptr;
+}
+
+// Every yield forces a pass through the scheduler,
+// so total yields over time gives context switch throughput
+int RunYieldBenchmark(int threadCount) {
+    std::vector<pthread_t> threads(threadCount);
+    long yieldCount = yieldsPerRound / threadCount;
+
+    startYielding = false;
+    for (int i = 0; i < threadCount; i++) {
+        if (pthread_create(&threads[i], nullptr, YieldThread, reinterpret_cast<void*>(yieldCount))) {
+            printf("Failed to create thread %d!\n", i);
+            startYielding = true;
+            for (int j = 0; j < i; j++) {
+                pthread_join(threads[j], nullptr);
+            }
+            return 1;
+        }
+    }
+
+    timespec start;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+    startYielding = true;
+
+    for (int i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+
+    long ns = NanosecondsSince(start);
+    long switches = yieldCount * threadCount;
+
+    printf("%5d threads: %ld switches in %ld us, %ld switches/s, %ld ns/switch\n", threadCount, switches, ns / 1000,
+           switches * 1000000000 / (ns ? ns : 1), ns / switches);
+    return 0;
+}
+
+// Round trip between two threads over pipes whilst other threads sit blocked.
+// The latency should not grow with the number of blocked threads.
+int RunPingPongBenchmark(int idleCount) {
+    int idlePipe[2];
+    int pipes[4];
+    if (pipe(idlePipe) || pipe(pipes) || pipe(pipes + 2)) {
+        perror("pipe");
+        return 1;
+    }
+
+    std::vector<pthread_t> idleThreads(idleCount);
+    int created = 0;
+    for (; created < idleCount; created++) {
+        if (pthread_create(&idleThreads[created], nullptr, IdleThread, reinterpret_cast<void*>(static_cast<long>(idlePipe[0])))) {
+            printf("Only created %d idle threads\n", created);
+            break;
+        }
+    }
+
+    int ret = 0;
+    char c = 'p';
+    long ns = 0;
+
+    pthread_t pong;
+    if (pthread_create(&pong, nullptr, PongThread, pipes)) {
+        printf("Failed to create thread!\n");
+        ret = 1;
+    } else {
+        timespec start;
+        clock_gettime(CLOCK_BOOTTIME, &start);
+        for (int i = 0; i < pingPongCount; i++) {
+            if (write(pipes[1], &c, 1) != 1 || read(pipes[2], &c, 1) != 1) {
+                printf("Ping pong failed!\n");
+                ret = 1;
+                break;
+            }
+        }
+        ns = NanosecondsSince(start);
+
+        close(pipes[1]); // Let the pong thread see EOF if we stopped early
+        pipes[1] = -1;
+        pthread_join(pong, nullptr);
+    }
+
+    // Wake up and reap the idle threads
+    for (int i = 0; i < created; i++) {
+        write(idlePipe[1], &c, 1);
+    }
+
+    for (int i = 0; i < created; i++) {
+        pthread_join(idleThreads[i], nullptr);
+    }
+
+    for (int fd : idlePipe) {
+        close(fd);
+    }
+
+    for (int fd : pipes) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    if (!ret) {
+        printf("%5d blocked threads: round trip avg %ld ns\n", created, ns / pingPongCount);
+    }
+    return ret;
+}
+
+}; // namespace SchedulerTest
+
+int RunSchedulerBenchmark() {
+    using namespace SchedulerTest;
+
+    printf("Context switch throughput (sched_yield):\n");
+    for (int count : threadCounts) {
+        if (RunYieldBenchmark(count)) {
+            return 1;
+        }
+    }
+
+    printf("Context switch latency (pipe ping pong):\n");
+    for (int count : idleThreadCounts) {
+        if (RunPingPongBenchmark(count)) {
+            return 2;
+        }
+    }
+
+    return 0;
+}
+
+static Test schedulerTest = {
+    .func = RunSchedulerBenchmark,
+    .prettyName = "Scheduler Benchmark",
+};
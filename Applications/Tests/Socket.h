@@ -0,0 +1,249 @@
+#pragma once
+
+#include "Test.h"
+
+#include <lemon/syscall.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace SocketTest {
+
+const int batchSize = 16;
+const int batchesPerRun = 1000;
+const uint16_t testPort = 5301;
+const size_t splitAt = 10; // Received datagrams are scattered across two iovecs split here
+
+// Receive count datagrams into msgs, giving the loopback adapter up to a second to deliver each batch
+bool ReceiveAll(int fd, mmsghdr* msgs, int count) {
+    int received = 0;
+    while (received < count) {
+        pollfd p = {.fd = fd, .events = POLLIN, .revents = 0};
+        if (poll(&p, 1, 1000) <= 0) {
+            printf("Timed out after %d of %d datagrams\n", received, count);
+            return false;
+        }
+
+        long r = syscall(SYS_RECVMMSG, fd, msgs + received, count - received, MSG_DONTWAIT, nullptr);
+        if (r < 0) {
+            printf("recvmmsg: %s\n", strerror(-r));
+            return false;
+        }
+
+        received += r;
+    }
+
+    return true;
+}
+
+// Send a batch gathered from two iovecs each and check it comes back out intact when scattered across two more
+bool CheckBatch(int tx, int rx, const sockaddr_in& address) {
+    uint8_t payload[batchSize + 64];
+    for (unsigned i = 0; i < sizeof(payload); i++) {
+        payload[i] = i * 7;
+    }
+
+    uint8_t indices[batchSize];
+    iovec sendIov[batchSize][2];
+    mmsghdr sendMsgs[batchSize] = {};
+    for (int i = 0; i < batchSize; i++) {
+        indices[i] = i;
+        sendIov[i][0] = {.iov_base = &indices[i], .iov_len = 1};
+        sendIov[i][1] = {.iov_base = payload + i, .iov_len = 64u + i};
+
+        sendMsgs[i].msg_hdr.msg_name = const_cast<sockaddr_in*>(&address);
+        sendMsgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        sendMsgs[i].msg_hdr.msg_iov = sendIov[i];
+        sendMsgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    long sent = syscall(SYS_SENDMMSG, tx, sendMsgs, batchSize, 0);
+    if (sent != batchSize) {
+        printf("sendmmsg: Expected %d messages to be sent, got %ld\n", batchSize, sent);
+        return false;
+    }
+
+    uint8_t buffers[batchSize][1500];
+    sockaddr_in sources[batchSize];
+    iovec receiveIov[batchSize][2];
+    mmsghdr receiveMsgs[batchSize] = {};
+    for (int i = 0; i < batchSize; i++) {
+        receiveIov[i][0] = {.iov_base = buffers[i], .iov_len = splitAt};
+        receiveIov[i][1] = {.iov_base = buffers[i] + splitAt, .iov_len = sizeof(buffers[i]) - splitAt};
+
+        receiveMsgs[i].msg_hdr.msg_name = &sources[i];
+        receiveMsgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        receiveMsgs[i].msg_hdr.msg_iov = receiveIov[i];
+        receiveMsgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    if (!ReceiveAll(rx, receiveMsgs, batchSize)) {
+        return false;
+    }
+
+    for (int i = 0; i < batchSize; i++) {
+        if (sendMsgs[i].msg_len != 65u + i || receiveMsgs[i].msg_len != sendMsgs[i].msg_len) {
+            printf("Datagram %d: Sent %u bytes and received %u, expected %d\n", i, sendMsgs[i].msg_len,
+                   receiveMsgs[i].msg_len, 65 + i);
+            return false;
+        }
+
+        // Datagrams arrive in order over loopback
+        if (buffers[i][0] != i || memcmp(buffers[i] + 1, payload + i, 64 + i)) {
+            printf("Datagram %d: Received unexpected data\n", i);
+            return false;
+        }
+
+        if (receiveMsgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            printf("Datagram %d: Unexpectedly truncated\n", i);
+            return false;
+        }
+
+        if (sources[i].sin_family != AF_INET || sources[i].sin_addr.s_addr != htonl(INADDR_LOOPBACK)) {
+            printf("Datagram %d: Unexpected source address\n", i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// A datagram larger than the iovecs is cut short, MSG_TRUNC asks for its real length
+bool CheckTruncation(int tx, int rx, const sockaddr_in& address) {
+    uint8_t data[100] = {};
+    if (sendto(tx, data, sizeof(data), 0, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) !=
+        sizeof(data)) {
+        perror("sendto");
+        return false;
+    }
+
+    pollfd p = {.fd = rx, .events = POLLIN, .revents = 0};
+    if (poll(&p, 1, 1000) <= 0) {
+        printf("Timed out waiting for the datagram\n");
+        return false;
+    }
+
+    uint8_t buffer[10];
+    iovec iov = {.iov_base = buffer, .iov_len = sizeof(buffer)};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    long r = syscall(SYS_RECVMSG, rx, &msg, MSG_TRUNC);
+    if (r != sizeof(data) || !(msg.msg_flags & MSG_TRUNC)) {
+        printf("recvmsg: Expected the full length (%lu) and MSG_TRUNC, got %ld (flags %x)\n", sizeof(data), r,
+               msg.msg_flags);
+        return false;
+    }
+
+    return true;
+}
+
+long ElapsedNs(const timespec& start, const timespec& end) {
+    return (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+}
+
+// Average time to send and receive a datagram in nanoseconds, one syscall per datagram or per batch
+long MeasureDatagramCost(int tx, int rx, const sockaddr_in& address, bool batched) {
+    uint8_t data[64] = {};
+    uint8_t buffers[batchSize][64];
+
+    iovec sendIov = {.iov_base = data, .iov_len = sizeof(data)};
+    iovec receiveIov[batchSize];
+    mmsghdr sendMsgs[batchSize] = {};
+    mmsghdr receiveMsgs[batchSize] = {};
+    for (int i = 0; i < batchSize; i++) {
+        sendMsgs[i].msg_hdr.msg_name = const_cast<sockaddr_in*>(&address);
+        sendMsgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        sendMsgs[i].msg_hdr.msg_iov = &sendIov;
+        sendMsgs[i].msg_hdr.msg_iovlen = 1;
+
+        receiveIov[i] = {.iov_base = buffers[i], .iov_len = sizeof(buffers[i])};
+        receiveMsgs[i].msg_hdr.msg_iov = &receiveIov[i];
+        receiveMsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    timespec start, end;
+    clock_gettime(CLOCK_BOOTTIME, &start);
+
+    // Only one batch is in flight at a time so the receive queue never overflows
+    for (int b = 0; b < batchesPerRun; b++) {
+        if (batched) {
+            if (syscall(SYS_SENDMMSG, tx, sendMsgs, batchSize, 0) != batchSize) {
+                printf("sendmmsg: Batch was not sent\n");
+                return -1;
+            }
+
+            if (!ReceiveAll(rx, receiveMsgs, batchSize)) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        for (int i = 0; i < batchSize; i++) {
+            if (sendto(tx, data, sizeof(data), 0, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) !=
+                sizeof(data)) {
+                perror("sendto");
+                return -1;
+            }
+        }
+
+        for (int i = 0; i < batchSize; i++) {
+            if (recv(rx, buffers[i], sizeof(buffers[i]), 0) != sizeof(data)) {
+                perror("recv");
+                return -1;
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_BOOTTIME, &end);
+    return ElapsedNs(start, end) / (batchesPerRun * batchSize);
+}
+
+int RunUDPBatchTest() {
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(testPort);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int tx = socket(AF_INET, SOCK_DGRAM, 0);
+    int rx = socket(AF_INET, SOCK_DGRAM, 0);
+    if (tx < 0 || rx < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    if (bind(rx, reinterpret_cast<sockaddr*>(&address), sizeof(address))) {
+        perror("bind");
+        return 1;
+    }
+
+    int ret = 1;
+    if (CheckBatch(tx, rx, address) && CheckTruncation(tx, rx, address)) {
+        long single = MeasureDatagramCost(tx, rx, address, false);
+        long batched = MeasureDatagramCost(tx, rx, address, true);
+        if (single >= 0 && batched >= 0) {
+            printf("sendto/recv: %ld.%03ldus per datagram, sendmmsg/recvmmsg (%d at a time): %ld.%03ldus\n",
+                   single / 1000, single % 1000, batchSize, batched / 1000, batched % 1000);
+            ret = 0;
+        }
+    }
+
+    close(tx);
+    close(rx);
+    return ret;
+}
+
+}; // namespace SocketTest
+
+static Test udpBatchTest = {
+    .func = SocketTest::RunUDPBatchTest,
+    .prettyName = "Batched and Vectored UDP Sockets",
+};
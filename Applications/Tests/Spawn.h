@@ -0,0 +1,139 @@
+#pragma once
+
+#include "Test.h"
+
+#include <Lemon/System/Spawn.h>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char** environ;
+
+namespace SpawnTest {
+
+const int spawnsPerMethod = 100;
+const size_t largeHeapSize = 64 * 1024 * 1024; // Dirty heap a shell could plausibly have
+
+char spawnPath[] = "/system/bin/echo";
+char* spawnArgv[] = {spawnPath, nullptr};
+
+pid_t ForkExec() {
+    pid_t pid = fork();
+    if (!pid) {
+        execve(spawnPath, spawnArgv, environ);
+        _exit(127);
+    }
+    return pid;
+}
+
+pid_t PosixSpawn() {
+    pid_t pid;
+    if (posix_spawn(&pid, spawnPath, nullptr, nullptr, spawnArgv, environ)) {
+        return -1;
+    }
+    return pid;
+}
+
+// The child flag lets us wait on the process
+pid_t LemonSpawn() { return lemon_spawn(spawnPath, 1, spawnArgv, EXEC_CHILD, environ); }
+
+struct SpawnMethod {
+    const char* name;
+    pid_t (*spawn)();
+};
+
+const SpawnMethod methods[] = {
+    {"fork+exec", ForkExec},
+    {"posix_spawn", PosixSpawn},
+    {"lemon_spawn", LemonSpawn},
+};
+
+// Measures the time from starting the child to it having exited
+int MeasureSpawnLatency(const SpawnMethod& method, const char* heapDescription) {
+    long total = 0;
+    long worst = 0;
+
+    // The children are not meant to be seen
+    int savedStdout = dup(STDOUT_FILENO);
+    int nullFd = open("/dev/null", O_WRONLY);
+    if (savedStdout < 0 || nullFd < 0) {
+        perror("Failed to redirect stdout");
+        return 1;
+    }
+    dup2(nullFd, STDOUT_FILENO);
+
+    int failures = 0;
+    for (int i = 0; i < spawnsPerMethod; i++) {
+        timespec start, end;
+        clock_gettime(CLOCK_BOOTTIME, &start);
+
+        pid_t pid = method.spawn();
+        int status = 0;
+        if (pid <= 0 || waitpid(pid, &status, 0) != pid || WEXITSTATUS(status)) {
+            failures++;
+            continue;
+        }
+
+        clock_gettime(CLOCK_BOOTTIME, &end);
+
+        long ns = (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+        total += ns;
+        if (ns > worst) {
+            worst = ns;
+        }
+    }
+
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+    close(nullFd);
+
+    if (failures) {
+        printf("%s: %d/%d spawns of %s failed!\n", method.name, failures, spawnsPerMethod, spawnPath);
+        return 1;
+    }
+
+    printf("%12s (%s): avg %ld us, worst %ld us\n", method.name, heapDescription, total / spawnsPerMethod / 1000,
+           worst / 1000);
+    return 0;
+}
+
+}; // namespace SpawnTest
+
+int RunSpawnBenchmark() {
+    using namespace SpawnTest;
+
+    printf("Spawn latency of %s:\n", spawnPath);
+    for (const SpawnMethod& method : methods) {
+        if (MeasureSpawnLatency(method, "small heap")) {
+            return 1;
+        }
+    }
+
+    // With copy-on-write the cost of fork should not grow with the amount of memory touched
+    void* heap = malloc(largeHeapSize);
+    if (!heap) {
+        printf("Failed to allocate %lu bytes!\n", largeHeapSize);
+        return 2;
+    }
+    memset(heap, 1, largeHeapSize);
+
+    for (const SpawnMethod& method : methods) {
+        if (MeasureSpawnLatency(method, "64MB heap")) {
+            return 1;
+        }
+    }
+
+    free(heap);
+    return 0;
+}
+
+static Test spawnTest = {
+    .func = RunSpawnBenchmark,
+    .prettyName = "Spawn Latency",
+};
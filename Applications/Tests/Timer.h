@@ -0,0 +1,89 @@
+#pragma once
+
+#include "Test.h"
+
+#include <stdio.h>
+#include <time.h>
+
+namespace TimerTest {
+
+const long sleepDurations[] = {50000, 100000, 500000, 1000000, 10000000}; // In nanoseconds
+const int sleepsPerDuration = 100;
+
+// Sleep for requested ns and return how long we actually slept
+long MeasureSleep(long requested) {
+    timespec start, end;
+    timespec duration = {.tv_sec = requested / 1000000000, .tv_nsec = requested % 1000000000};
+
+    clock_gettime(CLOCK_BOOTTIME, &start);
+    nanosleep(&duration, nullptr);
+    clock_gettime(CLOCK_BOOTTIME, &end);
+
+    return (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+}
+
+// Checks that sleeps are not cut short and reports how late they wake up.
+// With one shot timers the overshoot should not be a multiple of the tick period.
+int RunSleepAccuracy(long requested) {
+    long total = 0;
+    long worst = 0;
+    for (int i = 0; i < sleepsPerDuration; i++) {
+        long slept = MeasureSleep(requested);
+        if (slept < requested) {
+            printf("Requested %ld ns sleep, only slept %ld ns!\n", requested, slept);
+            return 1;
+        }
+
+        long overshoot = slept - requested;
+        total += overshoot;
+        if (overshoot > worst) {
+            worst = overshoot;
+        }
+    }
+
+    printf("%8ld ns sleep: avg overshoot %ld ns, worst %ld ns\n", requested, total / sleepsPerDuration, worst);
+    return 0;
+}
+
+// The uptime clock should never go backwards, even between CPUs
+int RunMonotonicCheck() {
+    timespec last;
+    clock_gettime(CLOCK_BOOTTIME, &last);
+
+    for (int i = 0; i < 1000000; i++) {
+        timespec now;
+        clock_gettime(CLOCK_BOOTTIME, &now);
+
+        if (now.tv_sec < last.tv_sec || (now.tv_sec == last.tv_sec && now.tv_nsec < last.tv_nsec)) {
+            printf("Clock went backwards!\n");
+            return 1;
+        }
+        last = now;
+    }
+
+    return 0;
+}
+
+}; // namespace TimerTest
+
+int RunTimerTest() {
+    using namespace TimerTest;
+
+    if (RunMonotonicCheck()) {
+        return 1;
+    }
+
+    printf("nanosleep accuracy:\n");
+    for (long duration : sleepDurations) {
+        if (RunSleepAccuracy(duration)) {
+            return 2;
+        }
+    }
+
+    return 0;
+}
+
+static Test timerTest = {
+    .func = RunTimerTest,
+    .prettyName = "Timer Accuracy",
+};
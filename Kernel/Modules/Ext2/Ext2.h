@@ -3,6 +3,7 @@
 #include <Fs/FsVolume.h>
 #include <Hash.h>
 #include <Lock.h>
+#include <Objects/Process.h>
 #include <String.h>
 #include <Vector.h>
 
@@ -45,8 +46,21 @@
 #define EXT2_DOUBLY_INDIRECT_INDEX 13
 #define EXT2_TRIPLY_INDIRECT_INDEX 14
 
-// When block cache reaches 96MB, use existing cached blocks
-#define EXT2_BLOCKCACHE_LIMIT 96 * 1024 * 1024
+// The block caches of all volumes can grow into half of the free memory,
+// but no further than 1/EXT2_BLOCKCACHE_MEMORY_FRACTION of RAM
+#define EXT2_BLOCKCACHE_MEMORY_FRACTION 4
+#define EXT2_BLOCKCACHE_MIN_SIZE (4 * 1024 * 1024)
+// Blocks are spread over the shards by block number so threads rarely wait on the same lock
+#define EXT2_BLOCKCACHE_SHARDS 32
+
+#define EXT2_WRITEBACK_INTERVAL 2000000 // Microseconds between flushes of dirty blocks
+#define EXT2_WRITEBACK_MAX_RUN 64 // Most adjacent blocks written back with one request
+// Writers flush dirty blocks themselves once more than 1/EXT2_DIRTY_LIMIT_FRACTION of the cache is dirty
+#define EXT2_DIRTY_LIMIT_FRACTION 4
+
+// Readahead window in blocks, doubles with every sequential read
+#define EXT2_READAHEAD_MIN 4
+#define EXT2_READAHEAD_MAX 64
 
 //#define EXT2_NO_CACHE
 
@@ -217,6 +231,11 @@ public:
         // Cache directory entries
         HashMap<String, uint32_t> directoryCache;
 
+        // Sequential read detection
+        uint32_t nextReadBlock = 0;   // Block following the last read
+        uint32_t readaheadBlocks = 0; // Current readahead window
+        uint32_t readaheadEnd = 0;    // Block following the last block read ahead
+
     public:
         Ext2Node(Ext2Volume* vol, ext2_inode_t& ino, ino_t inode);
 
@@ -234,6 +253,8 @@ public:
 
         void Close();
         void Sync();
+
+        ALWAYS_INLINE bool UsePageCache() const override { return (flags & FS_NODE_TYPE) == FS_NODE_FILE; }
     };
 
     class Ext2Volume : public FsVolume {
@@ -260,32 +281,91 @@ public:
         uint32_t inodeSize = 128;
 
         lock_t m_inodesLock = 0;
-        lock_t m_blocksLock = 0;
         HashMap<uint32_t, Ext2Node*> inodeCache;
 
         struct CachedBlock {
-            // When last accessed
-            uint64_t timestamp = 0;
-            uint32_t block = 0;
-
             CachedBlock* prev = nullptr;
             CachedBlock* next = nullptr;
 
+            uint32_t block = 0;
+            unsigned refCount = 1; // The shard holds a reference whilst the block is cached
+            uint32_t sequence = 0; // Odd whilst the data is being written, readers retry if it changes
+            lock_t writeLock = 0;
+
+            bool referenced = true; // Accessed since the clock hand last passed
+            bool dirty = false;     // Not yet written back to disk
+
             // Block data
             uint8_t data[];
         };
 
-        CachedBlock* AllocateCachedBlock() {
-            CachedBlock* cb = (CachedBlock*)kmalloc(sizeof(CachedBlock) + blocksize);
-            
-            new (cb) CachedBlock();
-            return cb;
-        }
+        // Lookups only take the lock of the shard the block hashes to, the data itself is copied without locking
+        struct CacheShard {
+            lock_t lock = 0;
+            HashMap<uint32_t, CachedBlock*> blocks = HashMap<uint32_t, CachedBlock*>(128);
+
+            FastList<CachedBlock*> clock; // CLOCK replacement, blocks are given a second chance if referenced
+            CachedBlock* hand = nullptr;
+        };
+
+        CacheShard m_cacheShards[EXT2_BLOCKCACHE_SHARDS];
+        unsigned m_dirtyBlocks = 0;
+
+        // Held across disk writes, so waiters sleep rather than spin
+        class WritebackLock final : public Semaphore {
+        public:
+            WritebackLock() : Semaphore(1) {}
+
+            // Returns true if interrupted, in which case the lock is not held.
+            // Semaphore::Wait keeps the count it took when interrupted, so give it back here
+            [[nodiscard]] bool Acquire() {
+                if (!Wait()) {
+                    return false;
+                }
+
+                acquireLock(&lock);
+                __sync_fetch_and_add(&value, 1);
+
+                // If Signal chose us just as we were interrupted, hand the lock to the next waiter instead
+                if (blocked.get_length() && value + static_cast<int>(blocked.get_length()) > 0) {
+                    blocked.get_front()->Unblock();
+                }
+                releaseLock(&lock);
+                return true;
+            }
+
+            ALWAYS_INLINE void Release() { Signal(); }
+        } m_writebackLock;
 
-        HashMap<uint32_t, CachedBlock*> blockCache = HashMap<uint32_t, CachedBlock*>(1024);
-        FastList<CachedBlock*> cachedBlockList;
         HashMap<uint32_t, uint8_t*> bitmapCache = HashMap<uint32_t, uint8_t*>(256);
-        unsigned blockCacheMemoryUsage = 0;
+
+        ALWAYS_INLINE CacheShard& ShardOf(uint32_t block) { return m_cacheShards[block % EXT2_BLOCKCACHE_SHARDS]; }
+
+        CachedBlock* AllocateCachedBlock(uint32_t block);
+        void FreeCachedBlock(CachedBlock* cachedBlock);
+
+        // Find a cached block and take a reference to it, returns nullptr if it is not cached
+        CachedBlock* AcquireCachedBlock(uint32_t block);
+        // Same as AcquireCachedBlock, but a clean block nobody else is using is also removed from the cache
+        CachedBlock* TakeCachedBlock(uint32_t block);
+        void ReleaseCachedBlock(CachedBlock* cachedBlock);
+        // Add a block to the cache, evicting others if the cache is full.
+        // Returns a reference to the existing block if it is already cached
+        CachedBlock* InsertCachedBlock(CachedBlock* cachedBlock);
+        // Evict clean blocks, starting with the given shard, until the cache is back under its limit
+        void TrimCache(unsigned firstShard);
+        // Expects the shard lock to be held
+        CachedBlock* EvictCachedBlock(CacheShard& shard);
+        void RemoveCachedBlock(CacheShard& shard, CachedBlock* cachedBlock);
+        // Drop a freed block from the cache without writing it back
+        void InvalidateCachedBlock(uint32_t block);
+        bool IsBlockCached(uint32_t block);
+
+        void CopyCachedBlock(CachedBlock* cachedBlock, void* buffer);
+        void UpdateCachedBlock(CachedBlock* cachedBlock, const void* buffer);
+
+        // Read any blocks which are not cached into the cache
+        void PrefetchBlocks(const Vector<uint32_t>& blocks);
 
         inline uint32_t LocationToBlock(uint64_t l) { return (l >> super.logBlockSize) >> 10; }
         inline uint32_t BlockToLocation(uint64_t b) { return (b << super.logBlockSize) << 10; }
@@ -310,6 +390,8 @@ public:
 
         int ReadBlock(uint32_t block, void* buffer);
         int ReadBlockCached(uint32_t block, void* buffer);
+        // Read a block without leaving it in the cache, for file data held by the page cache
+        int ReadBlockUncached(uint32_t block, void* buffer);
 
         int WriteBlock(uint32_t block, void* buffer);
         int WriteBlockCached(uint32_t block, void* buffer);
@@ -343,11 +425,18 @@ public:
         void SyncNode(Ext2Node* node);
         void CleanNode(Ext2Node* node);
 
+        /////////////////////////////
+        /// \brief Write dirty cached blocks back to disk
+        ///
+        /// \return 0 on success, otherwise an error code
+        /////////////////////////////
+        int WritebackBlocks();
+
         int Error() { return error; }
     };
 
 public:
-    unsigned totalBlockCacheMemoryUsage = 0;
+    size_t totalBlockCacheMemoryUsage = 0;
 
     Ext2();
     ~Ext2() override;
@@ -361,7 +450,15 @@ public:
     static Ext2& Instance();
 
 private:
+    // Periodically writes back the dirty blocks of every volume
+    [[noreturn]] static void FlusherThread();
+
     List<FsVolume*> m_extVolumes;
+    lock_t m_volumesLock = 0;
+
+    FancyRefPtr<Process> m_flusher;
+    bool m_stopFlusher = false;
+    bool m_flusherStopped = false;
 
     static lock_t m_instanceLock;
     static Ext2* m_instance;
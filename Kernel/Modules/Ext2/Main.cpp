@@ -5,6 +5,10 @@
 #include <Logging.h>
 #include <Math.h>
 #include <Module.h>
+#include <OnCleanup.h>
+#include <Paging.h>
+#include <PhysicalAllocator.h>
+#include <Scheduler.h>
 
 #include <Debug.h>
 
@@ -31,8 +35,51 @@ DECLARE_MODULE("ext2fs", "Ext2 Filesystem Driver", ModuleInit, ModuleExit);
 lock_t Ext2::m_instanceLock = 0;
 Ext2* Ext2::m_instance = nullptr;
 
-Ext2::Ext2() { fs::RegisterDriver(this); }
-Ext2::~Ext2() { fs::UnregisterDriver(this); }
+Ext2::Ext2() {
+    fs::RegisterDriver(this);
+
+    m_flusher = Process::CreateKernelProcess((void*)FlusherThread, "ext2flush", nullptr);
+    m_flusher->Start();
+}
+
+Ext2::~Ext2() {
+    fs::UnregisterDriver(this);
+
+    // Make sure the flusher is gone before the module is
+    __atomic_store_n(&m_stopFlusher, true, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&m_flusherStopped, __ATOMIC_ACQUIRE)) {
+        Thread::Current()->Sleep(EXT2_WRITEBACK_INTERVAL / 10);
+    }
+
+    for (FsVolume* vol : m_extVolumes) {
+        static_cast<Ext2Volume*>(vol)->WritebackBlocks();
+    }
+}
+
+void Ext2::FlusherThread() {
+    Ext2& ext2 = Instance();
+
+    for (;;) {
+        Thread::Current()->Sleep(EXT2_WRITEBACK_INTERVAL);
+
+        if (__atomic_load_n(&ext2.m_stopFlusher, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&ext2.m_flusherStopped, true, __ATOMIC_RELEASE);
+            Scheduler::GetCurrentProcess()->Die();
+        }
+
+        Vector<Ext2Volume*> volumes;
+        {
+            ScopedSpinLock lockVolumes(ext2.m_volumesLock);
+            for (FsVolume* vol : ext2.m_extVolumes) {
+                volumes.add_back(static_cast<Ext2Volume*>(vol));
+            }
+        }
+
+        for (Ext2Volume* vol : volumes) {
+            vol->WritebackBlocks();
+        }
+    }
+}
 
 Ext2& Ext2::Instance() {
     if (m_instance) {
@@ -55,6 +102,7 @@ FsVolume* Ext2::Mount(FsNode* device, const char* name) {
         return nullptr; // Error mounting volume
     }
 
+    ScopedSpinLock lockVolumes(m_volumesLock);
     m_extVolumes.add_back(vol);
     return vol;
 }
@@ -465,51 +513,249 @@ int Ext2::Ext2Volume::WriteBlock(uint32_t block, void* buffer) {
     return 0;
 }
 
-int Ext2::Ext2Volume::ReadBlockCached(uint32_t block, void* buffer) {
-    if (block > super.blockCount)
-        return -EINVAL;
+// The block caches can grow into half of the free memory, up to 1/EXT2_BLOCKCACHE_MEMORY_FRACTION of RAM
+static size_t BlockCacheLimit() {
+    size_t cacheSize = __atomic_load_n(&Ext2::Instance().totalBlockCacheMemoryUsage, __ATOMIC_RELAXED);
+    size_t freeMemory = 0;
+    if (Memory::maxPhysicalBlocks > Memory::usedPhysicalBlocks) {
+        freeMemory = (Memory::maxPhysicalBlocks - Memory::usedPhysicalBlocks) << PAGE_SHIFT_4K;
+    }
 
-#ifndef EXT2_NO_CACHE
-    ScopedSpinLock lockBlockCache(m_blocksLock);
+    size_t limit = MIN(cacheSize + freeMemory / 2,
+                       (Memory::maxPhysicalBlocks << PAGE_SHIFT_4K) / EXT2_BLOCKCACHE_MEMORY_FRACTION);
+    return MAX(limit, static_cast<size_t>(EXT2_BLOCKCACHE_MIN_SIZE));
+}
+
+Ext2::Ext2Volume::CachedBlock* Ext2::Ext2Volume::AllocateCachedBlock(uint32_t block) {
+    CachedBlock* cachedBlock = (CachedBlock*)kmalloc(sizeof(CachedBlock) + blocksize);
+
+    new (cachedBlock) CachedBlock();
+    cachedBlock->block = block;
+
+    __atomic_add_fetch(&Ext2::Instance().totalBlockCacheMemoryUsage, blocksize, __ATOMIC_RELAXED);
+    return cachedBlock;
+}
+
+void Ext2::Ext2Volume::FreeCachedBlock(CachedBlock* cachedBlock) {
+    __atomic_sub_fetch(&Ext2::Instance().totalBlockCacheMemoryUsage, blocksize, __ATOMIC_RELAXED);
+    kfree(cachedBlock);
+}
+
+Ext2::Ext2Volume::CachedBlock* Ext2::Ext2Volume::AcquireCachedBlock(uint32_t block) {
+    CacheShard& shard = ShardOf(block);
+    ScopedSpinLock lockShard(shard.lock);
 
     CachedBlock* cachedBlock;
-    if (blockCache.get(block, cachedBlock)) {
-        cachedBlock->timestamp = Timer::UsecondsSinceBoot();
-        memcpy(buffer, cachedBlock->data, blocksize);
+    if (!shard.blocks.get(block, cachedBlock)) {
+        return nullptr;
+    }
+
+    __atomic_add_fetch(&cachedBlock->refCount, 1, __ATOMIC_RELAXED);
+    cachedBlock->referenced = true;
+    return cachedBlock;
+}
+
+Ext2::Ext2Volume::CachedBlock* Ext2::Ext2Volume::TakeCachedBlock(uint32_t block) {
+    CacheShard& shard = ShardOf(block);
+    ScopedSpinLock lockShard(shard.lock);
 
-        // Move block to the end of the list
-        cachedBlockList.remove(cachedBlock);
-        cachedBlockList.add_back(cachedBlock);
+    CachedBlock* cachedBlock;
+    if (!shard.blocks.get(block, cachedBlock)) {
+        return nullptr;
+    }
+
+    if (cachedBlock->dirty || __atomic_load_n(&cachedBlock->refCount, __ATOMIC_RELAXED) > 1) {
+        __atomic_add_fetch(&cachedBlock->refCount, 1, __ATOMIC_RELAXED);
+        cachedBlock->referenced = true;
     } else {
-        if(blockCacheMemoryUsage >= EXT2_BLOCKCACHE_LIMIT) {
-            // Remove cached blocks until we are at the trim value
-            cachedBlock = cachedBlockList.remove_at(0);
+        RemoveCachedBlock(shard, cachedBlock); // The caller gets the reference held by the shard
+    }
+
+    return cachedBlock;
+}
 
-            assert(blockCache.find(cachedBlock->block));
-            blockCache.remove(cachedBlock->block);
+void Ext2::Ext2Volume::ReleaseCachedBlock(CachedBlock* cachedBlock) {
+    // Whoever drops the last reference frees the block, be it the shard or a reader
+    if (__atomic_sub_fetch(&cachedBlock->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+        FreeCachedBlock(cachedBlock);
+    }
+}
+
+Ext2::Ext2Volume::CachedBlock* Ext2::Ext2Volume::InsertCachedBlock(CachedBlock* cachedBlock) {
+    unsigned shardIndex = cachedBlock->block % EXT2_BLOCKCACHE_SHARDS;
+    CacheShard& shard = m_cacheShards[shardIndex];
+    {
+        ScopedSpinLock lockShard(shard.lock);
+
+        CachedBlock* existing;
+        if (shard.blocks.get(cachedBlock->block, existing)) {
+            // Another thread read the block in before us
+            __atomic_add_fetch(&existing->refCount, 1, __ATOMIC_RELAXED);
+            existing->referenced = true;
+            return existing;
+        }
+
+        shard.blocks.insert(cachedBlock->block, cachedBlock);
+
+        // Place the block behind the hand so it is the last to be looked at
+        if (shard.hand) {
+            shard.clock.insert(cachedBlock, shard.hand);
         } else {
-            cachedBlock = AllocateCachedBlock();
+            shard.clock.add_back(cachedBlock);
+        }
+    }
+
+    TrimCache(shardIndex);
+    return nullptr;
+}
+
+void Ext2::Ext2Volume::TrimCache(unsigned firstShard) {
+    // Only one shard lock is held at a time, so inserts into different shards cannot deadlock
+    for (unsigned i = 0; i < EXT2_BLOCKCACHE_SHARDS; i++) {
+        CacheShard& shard = m_cacheShards[(firstShard + i) % EXT2_BLOCKCACHE_SHARDS];
+
+        while (__atomic_load_n(&Ext2::Instance().totalBlockCacheMemoryUsage, __ATOMIC_RELAXED) > BlockCacheLimit()) {
+            CachedBlock* evicted;
+            {
+                ScopedSpinLock lockShard(shard.lock);
+                evicted = EvictCachedBlock(shard);
+            }
 
-            blockCacheMemoryUsage += blocksize;
-            Ext2::Instance().totalBlockCacheMemoryUsage += blocksize;
+            if (!evicted) {
+                break; // Everything left in this shard is dirty or in use
+            }
+
+            ReleaseCachedBlock(evicted);
         }
+    }
+}
 
-        cachedBlock->block = block;
-        cachedBlock->timestamp = Timer::UsecondsSinceBoot();
+Ext2::Ext2Volume::CachedBlock* Ext2::Ext2Volume::EvictCachedBlock(CacheShard& shard) {
+    // Every block gets a second chance, so two trips around the clock at most
+    unsigned count = shard.clock.get_length() * 2;
+    for (unsigned i = 0; i < count; i++) {
+        CachedBlock* cachedBlock = shard.hand ? shard.hand : shard.clock.get_front();
+        shard.hand = shard.clock.next(cachedBlock);
 
-        if (int e = fs::Read(m_device, BlockToLocation(block), blocksize, cachedBlock->data); e != blocksize) {
-            Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
-            
-            // Since we didnt end up using this block, place it at the front of the list
-            // so it gets reused first
-            cachedBlockList.add_front(cachedBlock);
-            return e;
+        if (cachedBlock->referenced) {
+            cachedBlock->referenced = false;
+            continue;
+        }
+
+        // Dirty blocks are left for writeback, and blocks in use cannot be reused
+        if (cachedBlock->dirty || __atomic_load_n(&cachedBlock->refCount, __ATOMIC_RELAXED) > 1) {
+            continue;
+        }
+
+        RemoveCachedBlock(shard, cachedBlock);
+        return cachedBlock;
+    }
+
+    return nullptr; // Everything is dirty or in use, let the cache go over its limit for now
+}
+
+void Ext2::Ext2Volume::RemoveCachedBlock(CacheShard& shard, CachedBlock* cachedBlock) {
+    if (shard.hand == cachedBlock) {
+        shard.hand = shard.clock.next(cachedBlock);
+    }
+
+    shard.clock.remove(cachedBlock);
+    shard.blocks.remove(cachedBlock->block);
+}
+
+void Ext2::Ext2Volume::InvalidateCachedBlock(uint32_t block) {
+    CacheShard& shard = ShardOf(block);
+
+    CachedBlock* cachedBlock;
+    {
+        ScopedSpinLock lockShard(shard.lock);
+        if (!shard.blocks.get(block, cachedBlock)) {
+            return;
+        }
+
+        RemoveCachedBlock(shard, cachedBlock);
+    }
+
+    // The block has been freed, so there is no need to write it back
+    acquireLock(&cachedBlock->writeLock);
+    if (cachedBlock->dirty) {
+        cachedBlock->dirty = false;
+        __atomic_sub_fetch(&m_dirtyBlocks, 1, __ATOMIC_RELAXED);
+    }
+    releaseLock(&cachedBlock->writeLock);
+
+    ReleaseCachedBlock(cachedBlock);
+}
+
+bool Ext2::Ext2Volume::IsBlockCached(uint32_t block) {
+    CacheShard& shard = ShardOf(block);
+    ScopedSpinLock lockShard(shard.lock);
+
+    return shard.blocks.find(block);
+}
+
+void Ext2::Ext2Volume::CopyCachedBlock(CachedBlock* cachedBlock, void* buffer) {
+    for (;;) {
+        uint32_t sequence = __atomic_load_n(&cachedBlock->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) {
+            continue; // Being written to
         }
-        
-        cachedBlockList.add_back(cachedBlock);
-        blockCache.insert(block, cachedBlock);
 
         memcpy(buffer, cachedBlock->data, blocksize);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&cachedBlock->sequence, __ATOMIC_RELAXED) == sequence) {
+            return;
+        }
+    }
+}
+
+void Ext2::Ext2Volume::UpdateCachedBlock(CachedBlock* cachedBlock, const void* buffer) {
+    acquireLock(&cachedBlock->writeLock);
+
+    __atomic_store_n(&cachedBlock->sequence, cachedBlock->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(cachedBlock->data, buffer, blocksize);
+
+    __atomic_store_n(&cachedBlock->sequence, cachedBlock->sequence + 1, __ATOMIC_RELEASE);
+
+    if (!cachedBlock->dirty) {
+        cachedBlock->dirty = true;
+        __atomic_add_fetch(&m_dirtyBlocks, 1, __ATOMIC_RELAXED);
+    }
+
+    releaseLock(&cachedBlock->writeLock);
+}
+
+int Ext2::Ext2Volume::ReadBlockCached(uint32_t block, void* buffer) {
+    if (block > super.blockCount)
+        return -EINVAL;
+
+#ifndef EXT2_NO_CACHE
+    if (CachedBlock* cachedBlock = AcquireCachedBlock(block)) {
+        CopyCachedBlock(cachedBlock, buffer);
+        ReleaseCachedBlock(cachedBlock);
+        return 0;
+    }
+
+    // Read the block without holding any locks so other threads can carry on using the cache
+    CachedBlock* cachedBlock = AllocateCachedBlock(block);
+    if (int e = fs::Read(m_device, BlockToLocation(block), blocksize, cachedBlock->data); e != blocksize) {
+        Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
+
+        FreeCachedBlock(cachedBlock);
+        return e;
+    }
+
+    memcpy(buffer, cachedBlock->data, blocksize);
+
+    if (CachedBlock* existing = InsertCachedBlock(cachedBlock)) {
+        // The cached copy may have been written to since
+        FreeCachedBlock(cachedBlock);
+
+        CopyCachedBlock(existing, buffer);
+        ReleaseCachedBlock(existing);
     }
 #else
     if (int e = fs::Read(m_device, BlockToLocation(block), blocksize, buffer); e != blocksize) {
@@ -520,28 +766,207 @@ int Ext2::Ext2Volume::ReadBlockCached(uint32_t block, void* buffer) {
     return 0;
 }
 
+int Ext2::Ext2Volume::ReadBlockUncached(uint32_t block, void* buffer) {
+    if (block > super.blockCount)
+        return -EINVAL;
+
+#ifndef EXT2_NO_CACHE
+    // The cache may hold a newer copy than the disk, or the block may have been read ahead
+    if (CachedBlock* cachedBlock = TakeCachedBlock(block)) {
+        CopyCachedBlock(cachedBlock, buffer);
+        ReleaseCachedBlock(cachedBlock);
+        return 0;
+    }
+#endif
+
+    return ReadBlock(block, buffer);
+}
+
 int Ext2::Ext2Volume::WriteBlockCached(uint32_t block, void* buffer) {
     if (block > super.blockCount)
         return -EINVAL;
 
 #ifndef EXT2_NO_CACHE
-    ScopedSpinLock lockBlockCache(m_blocksLock);
-    
-    CachedBlock* cachedBlock;
-    if ((blockCache.get(block, cachedBlock))) {
+    if (CachedBlock* cachedBlock = AcquireCachedBlock(block)) {
+        UpdateCachedBlock(cachedBlock, buffer);
+        ReleaseCachedBlock(cachedBlock);
+    } else {
+        cachedBlock = AllocateCachedBlock(block);
         memcpy(cachedBlock->data, buffer, blocksize);
-        cachedBlock->timestamp = Timer::UsecondsSinceBoot();
+        cachedBlock->dirty = true;
+
+        // Count the block before it can be seen by the flusher
+        __atomic_add_fetch(&m_dirtyBlocks, 1, __ATOMIC_RELAXED);
+
+        if (CachedBlock* existing = InsertCachedBlock(cachedBlock)) {
+            __atomic_sub_fetch(&m_dirtyBlocks, 1, __ATOMIC_RELAXED);
+            FreeCachedBlock(cachedBlock);
+
+            UpdateCachedBlock(existing, buffer);
+            ReleaseCachedBlock(existing);
+        }
     }
-#endif
 
+    // Rather than let dirty blocks take over the cache, make the writer flush them
+    if (__atomic_load_n(&m_dirtyBlocks, __ATOMIC_RELAXED) >
+        BlockCacheLimit() / blocksize / EXT2_DIRTY_LIMIT_FRACTION) {
+        // If we are interrupted waiting on another writeback the block is still cached and dirty
+        if (int e = WritebackBlocks(); e != -EINTR) {
+            return e;
+        }
+    }
+#else
     if (int e = fs::Write(m_device, BlockToLocation(block), blocksize, buffer); e != blocksize) {
         Log::Error("[Ext2] Disk error (%d) reading block %d (blocksize: %d)", e, block, blocksize);
         return e;
     }
+#endif
 
     return 0;
 }
 
+int Ext2::Ext2Volume::WritebackBlocks() {
+    if (!__atomic_load_n(&m_dirtyBlocks, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    // Only one writeback at a time, so an older copy of a block can never be written after a newer one
+    if (m_writebackLock.Acquire()) {
+        return -EINTR;
+    }
+    OnCleanup releaseWriteback([this]() { m_writebackLock.Release(); });
+
+    Vector<CachedBlock*> dirtyBlocks;
+    for (CacheShard& shard : m_cacheShards) {
+        ScopedSpinLock lockShard(shard.lock);
+        for (CachedBlock* cachedBlock = shard.clock.get_front(); cachedBlock;
+             cachedBlock = shard.clock.next(cachedBlock)) {
+            if (cachedBlock->dirty) {
+                __atomic_add_fetch(&cachedBlock->refCount, 1, __ATOMIC_RELAXED);
+                dirtyBlocks.add_back(cachedBlock);
+            }
+        }
+    }
+
+    // Sort by block number so that adjacent blocks can be written with a single request
+    for (size_t gap = dirtyBlocks.size() / 2; gap > 0; gap /= 2) {
+        for (size_t i = gap; i < dirtyBlocks.size(); i++) {
+            CachedBlock* cachedBlock = dirtyBlocks[i];
+
+            size_t j = i;
+            for (; j >= gap && dirtyBlocks[j - gap]->block > cachedBlock->block; j -= gap) {
+                dirtyBlocks[j] = dirtyBlocks[j - gap];
+            }
+            dirtyBlocks[j] = cachedBlock;
+        }
+    }
+
+    uint8_t* buffer = (uint8_t*)kmalloc(EXT2_WRITEBACK_MAX_RUN * blocksize);
+
+    int status = 0;
+    size_t i = 0;
+    while (i < dirtyBlocks.size()) {
+        uint32_t firstBlock = 0;
+        unsigned runLength = 0;
+        for (; i < dirtyBlocks.size() && runLength < EXT2_WRITEBACK_MAX_RUN; i++) {
+            CachedBlock* cachedBlock = dirtyBlocks[i];
+            if (runLength && cachedBlock->block != firstBlock + runLength) {
+                break;
+            }
+
+            // Writers are held off whilst we take a copy, if they write again the block gets marked dirty again
+            acquireLock(&cachedBlock->writeLock);
+            bool dirty = cachedBlock->dirty;
+            if (dirty) {
+                memcpy(buffer + runLength * blocksize, cachedBlock->data, blocksize);
+
+                cachedBlock->dirty = false;
+                __atomic_sub_fetch(&m_dirtyBlocks, 1, __ATOMIC_RELAXED);
+            }
+            releaseLock(&cachedBlock->writeLock);
+
+            if (!dirty) {
+                continue; // Freed since
+            }
+
+            if (!runLength) {
+                firstBlock = cachedBlock->block;
+            }
+            runLength++;
+        }
+
+        if (!runLength) {
+            continue;
+        }
+
+        size_t runSize = runLength * blocksize;
+        if (ssize_t e = fs::Write(m_device, BlockToLocation(firstBlock), runSize, buffer);
+            e != static_cast<ssize_t>(runSize)) {
+            Log::Error("[Ext2] Disk error (%d) writing back blocks %u-%u", e, firstBlock, firstBlock + runLength - 1);
+
+            error = DiskWriteError;
+            status = (e < 0) ? e : -EIO;
+        }
+    }
+
+    kfree(buffer);
+
+    for (CachedBlock* cachedBlock : dirtyBlocks) {
+        ReleaseCachedBlock(cachedBlock);
+    }
+
+    return status;
+}
+
+void Ext2::Ext2Volume::PrefetchBlocks(const Vector<uint32_t>& blocks) {
+    uint8_t* buffer = nullptr;
+
+    unsigned i = 0;
+    while (i < blocks.size()) {
+        uint32_t block = blocks[i];
+        if (!block || block > super.blockCount || IsBlockCached(block)) {
+            i++;
+            continue; // Sparse or already cached
+        }
+
+        // Read runs of adjacent blocks with one request
+        unsigned runLength = 1;
+        while (i + runLength < blocks.size() && blocks[i + runLength] == block + runLength &&
+               block + runLength <= super.blockCount && !IsBlockCached(block + runLength)) {
+            runLength++;
+        }
+
+        if (!buffer) {
+            buffer = (uint8_t*)kmalloc(blocks.size() * blocksize);
+        }
+
+        size_t runSize = runLength * blocksize;
+        if (ssize_t e = fs::Read(m_device, BlockToLocation(block), runSize, buffer);
+            e != static_cast<ssize_t>(runSize)) {
+            break; // Readahead is only a hint, whoever actually wants the blocks will find out about the error
+        }
+
+        for (unsigned j = 0; j < runLength; j++) {
+            CachedBlock* cachedBlock = AllocateCachedBlock(block + j);
+            memcpy(cachedBlock->data, buffer + j * blocksize, blocksize);
+
+            // Blocks which are never read get evicted first
+            cachedBlock->referenced = false;
+
+            if (CachedBlock* existing = InsertCachedBlock(cachedBlock)) {
+                FreeCachedBlock(cachedBlock);
+                ReleaseCachedBlock(existing);
+            }
+        }
+
+        i += runLength;
+    }
+
+    if (buffer) {
+        kfree(buffer);
+    }
+}
+
 uint32_t Ext2::Ext2Volume::AllocateBlock() {
     for (unsigned i = 0; i < blockGroupCount; i++) {
         ext2_blockgrp_desc_t& group = blockGroups[i];
@@ -644,6 +1069,8 @@ int Ext2::Ext2Volume::FreeBlock(uint32_t block) {
         return -1;
     }
 
+    InvalidateCachedBlock(block);
+
     super.freeBlockCount++;
     blockGroups[block / super.blocksPerGroup].freeBlockCount++;
 
@@ -749,9 +1176,6 @@ int Ext2::Ext2Volume::EraseInode(ext2_inode_t& e2inode, uint32_t inode) {
     for (unsigned i = 0; i < e2inode.blockCount * (blocksize / 512); i++) {
         uint32_t block = GetInodeBlock(i, e2inode);
         FreeBlock(block);
-        if (blockCache.find(block)) {
-            blockCache.remove(block);
-        }
     }
 
     if (e2inode.blocks[EXT2_SINGLY_INDIRECT_INDEX]) {
@@ -767,9 +1191,6 @@ int Ext2::Ext2Volume::EraseInode(ext2_inode_t& e2inode, uint32_t inode) {
 
             for (unsigned i = 0; i < (blocksize / sizeof(uint32_t)) && blockPointers[i] != 0; i++) {
                 FreeBlock(blockPointers[i]);
-                if (blockCache.find(blockPointers[i])) {
-                    blockCache.remove(blockPointers[i]);
-                }
             }
 
             FreeBlock(e2inode.blocks[EXT2_DOUBLY_INDIRECT_INDEX]);
@@ -1205,7 +1626,7 @@ FsNode* Ext2::Ext2Volume::FindDir(Ext2Node* node, const char* name) {
 }
 
 ssize_t Ext2::Ext2Volume::Read(Ext2Node* node, size_t offset, size_t size, uint8_t* buffer) {
-    if (offset >= node->size)
+    if (offset >= node->size || !size)
         return 0;
     if (offset + size > node->size)
         size = node->size - offset;
@@ -1223,23 +1644,61 @@ ssize_t Ext2::Ext2Volume::Read(Ext2Node* node, size_t offset, size_t size, uint8
     long blktv1 = Timer::UsecondsSinceBoot();
 #endif
 
+    // Data of files read through the page cache is held by the page cache,
+    // so there is no point keeping a second copy in the block cache
+    bool keepCached = !node->UsePageCache();
+    auto readBlock = [&](uint32_t block, void* buffer) -> int {
+        return keepCached ? ReadBlockCached(block, buffer) : ReadBlockUncached(block, buffer);
+    };
+
     ssize_t ret = size;
     Vector<uint32_t> blocks = GetInodeBlocks(blockIndex, blockLimit - blockIndex + 1, node->e2inode);
     assert(blocks.size() == (blockLimit - blockIndex + 1));
 
+#ifndef EXT2_NO_CACHE
+    // Reads carrying on from where the last one finished are treated as sequential.
+    // Small sequential reads have the blocks after them read into the cache with the same request,
+    // larger reads already reach the disk as large requests.
+    uint32_t lastBlock = LocationToBlock(offset + size - 1);
+    if (blockIndex != node->nextReadBlock) {
+        node->readaheadBlocks = 0;
+        node->readaheadEnd = 0;
+    } else if (lastBlock - blockIndex + 1 < EXT2_READAHEAD_MAX) {
+        node->readaheadBlocks = MIN(MAX(node->readaheadBlocks * 2, EXT2_READAHEAD_MIN), EXT2_READAHEAD_MAX);
+
+        // Read ahead again once the reader gets within half a window of the end of the last readahead
+        if (lastBlock + node->readaheadBlocks / 2 >= node->readaheadEnd) {
+            uint32_t fileBlocks = LocationToBlock(node->size + blocksize - 1);
+            uint32_t readaheadEnd = MIN(lastBlock + 1 + node->readaheadBlocks, fileBlocks);
+
+            if (readaheadEnd > lastBlock + 1) {
+                // Include the blocks being read, any which are not cached get read along with the readahead
+                Vector<uint32_t> readaheadBlocks =
+                    GetInodeBlocks(blockIndex, readaheadEnd - blockIndex, node->e2inode);
+                PrefetchBlocks(readaheadBlocks);
+            }
+
+            node->readaheadEnd = readaheadEnd;
+        }
+    }
+
+    node->nextReadBlock = LocationToBlock(offset + size);
+#endif
+
 #ifdef EXT2_ENABLE_TIMER
     long blktv2 = Timer::UsecondsSinceBoot();
     long readtv1 = Timer::UsecondsSinceBoot();
 #endif
 
-    for (uint32_t block : blocks) {
+    for (unsigned i = 0; i < blocks.size(); i++) {
+        uint32_t block = blocks[i];
         if (size <= 0)
             break;
 
         // Check if offset is a full block
         long offsetRemainder = offset & (blocksize - 1);
         if (offsetRemainder) {
-            if (int e = ReadBlockCached(block, blockBuffer); e) {
+            if (int e = readBlock(block, blockBuffer); e) {
                 Log::Info("[Ext2] Error %i reading block %u", e, block);
                 error = DiskReadError;
                 return e;
@@ -1256,7 +1715,57 @@ ssize_t Ext2::Ext2Volume::Read(Ext2Node* node, size_t offset, size_t size, uint8
             buffer += readSize;
             offset += readSize;
         } else if (size >= blocksize) {
-            if (int e = ReadBlockCached(block, buffer); e) {
+            // Read runs of contiguous blocks as a single request so the block queue hands
+            // the driver one large command rather than a command per block
+            unsigned runLength = 1;
+            while (block && i + runLength < blocks.size() && blocks[i + runLength] == block + runLength &&
+                   (runLength + 1) * blocksize <= size) {
+                runLength++;
+            }
+
+            if (runLength > 1) {
+                // Cached blocks (including any read ahead) are the latest copy, so take those from the cache
+                // and only go to the disk for the runs of blocks in between
+                unsigned j = 0;
+                while (j < runLength) {
+                    if (CachedBlock* cachedBlock =
+                            keepCached ? AcquireCachedBlock(block + j) : TakeCachedBlock(block + j)) {
+                        CopyCachedBlock(cachedBlock, buffer + j * blocksize);
+                        ReleaseCachedBlock(cachedBlock);
+                        j++;
+                        continue;
+                    }
+
+                    unsigned uncached = 1;
+                    while (j + uncached < runLength && !IsBlockCached(block + j + uncached)) {
+                        uncached++;
+                    }
+
+                    size_t readSize = uncached * blocksize;
+                    if (ssize_t e = fs::Read(m_device, BlockToLocation(block + j), readSize, buffer + j * blocksize);
+                        e != static_cast<ssize_t>(readSize)) {
+                        Log::Info("[Ext2] Error %i reading blocks %u-%u", e, block + j, block + j + uncached - 1);
+                        error = DiskReadError;
+                        break;
+                    }
+
+                    j += uncached;
+                }
+
+                size_t runSize = j * blocksize;
+                size -= runSize;
+                buffer += runSize;
+                offset += runSize;
+
+                if (j < runLength) {
+                    break;
+                }
+
+                i += runLength - 1;
+                continue;
+            }
+
+            if (int e = readBlock(block, buffer); e) {
                 Log::Info("[Ext2] Error %i reading block %u", e, block);
                 error = DiskReadError;
                 break;
@@ -1265,7 +1774,7 @@ ssize_t Ext2::Ext2Volume::Read(Ext2Node* node, size_t offset, size_t size, uint8
             buffer += blocksize;
             offset += blocksize;
         } else {
-            if (int e = ReadBlockCached(block, blockBuffer); e) {
+            if (int e = readBlock(block, blockBuffer); e) {
                 Log::Info("[Ext2] Error %i reading block %u", e, block);
                 error = DiskReadError;
                 break;
@@ -1809,12 +2318,25 @@ int Ext2::Ext2Node::Truncate(off_t length) {
     return ret;
 }
 
-void Ext2::Ext2Node::Sync() { vol->SyncNode(this); }
+void Ext2::Ext2Node::Sync() {
+    if (HasPageCache()) {
+        m_pageCache->Writeback(); // Pages written to through shared mappings
+    }
+
+    vol->SyncNode(this);
+    vol->WritebackBlocks();
+}
 
 void Ext2::Ext2Node::Close() {
     handleCount--;
 
     if (handleCount == 0) {
+        if (e2inode.linkCount && HasPageCache() && m_pageCache->ResidentPages()) {
+            // Keep the node around for its cached pages,
+            // FilePageCache::Reclaim closes it again once they have been dropped
+            return;
+        }
+
         vol->CleanNode(this); // Remove from the cache
         return;
     }
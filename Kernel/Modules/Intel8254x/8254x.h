@@ -81,7 +81,8 @@ class Intel8254x final : public Network::NetworkAdapter, private PCIDevice {
 public:
     Intel8254x(const PCIInfo& device);
 
-    void SendPacket(void* data, size_t len);
+    // Frames are copied into the TX descriptor buffers, the NetBuffer is released straight away
+    void Transmit(NetBuffer* buffer);
 
 private:
     typedef struct {
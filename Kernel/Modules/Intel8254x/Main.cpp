@@ -115,18 +115,19 @@ void Intel8254x::OnInterrupt() {
 
             rxDescriptors[rxTail].status = 0;
 
-            if (rxDescriptors[rxTail].length <= ETHERNET_MAX_PACKET_SIZE && cache.get_length()) {
-                NetworkPacket* pkt = cache.remove_at(0);
-
-                pkt->length = rxDescriptors[rxTail].length;
-                memcpy(pkt->data, rxDescriptorsVirt[rxTail], pkt->length);
-
-                queue.add_back(pkt);
+            uint16_t length = rxDescriptors[rxTail].length;
+            if (length > ETHERNET_MAX_PACKET_SIZE) {
+                Network::CountDrop(NetLayerDriver);
+            } else if (NetBuffer* buffer = Network::AllocateBuffer(NetLayerDriver); buffer) {
+                // The descriptor buffers are reused so the frame has to be copied out
+                memcpy(buffer->Put(length), rxDescriptorsVirt[rxTail], length);
+                Network::CountCopy(NetLayerDriver, length);
+                buffer->adapter = this;
+
+                queue.add_back(buffer);
                 packetSemaphore.Signal();
                 Network::packetQueueSemaphore.Signal();
-            } else {
-                // TODO: Do something that isn't dropping the packet when the cache is empty
-            }
+            } // Otherwise the pool is empty and AllocateBuffer has counted the drop
 
             WriteMem32(I8254_REGISTER_RDESC_TAIL, rxTail);
         } while (1);
@@ -306,20 +307,18 @@ Intel8254x::Intel8254x(const PCIInfo& device)
 
     dState = DriverState::OK;
 
-    maxCache = 256;
-    for (unsigned i = 0; i < maxCache; i++) {
-        cache.add_back(new NetworkPacket()); // Fill the cache
-    }
-
     WriteMem32(I8254_REGISTER_INT_MASK, 0x1F6DF); // Set the interrupt mask to enable all interrupts
     UpdateLink();
 }
 
-void Intel8254x::SendPacket(void* data, size_t len) {
+void Intel8254x::Transmit(NetBuffer* buffer) {
+    size_t len = buffer->length;
+
     asm("cli");
     t_desc_t* txd = &(txDescriptors[txTail]);
 
-    memcpy(txDescriptorsVirt[txTail], data, len);
+    memcpy(txDescriptorsVirt[txTail], buffer->data, len);
+    Network::CountCopy(NetLayerDriver, len);
     txd->length = len;
     txd->cmd = TCMD_EOP | TCMD_IFCS | TCMD_RS;
 
@@ -327,4 +326,6 @@ void Intel8254x::SendPacket(void* data, size_t len) {
 
     WriteMem32(I8254_REGISTER_TDESC_TAIL, txTail);
     asm("sti");
+
+    Network::ReleaseBuffer(buffer);
 }
\ No newline at end of file
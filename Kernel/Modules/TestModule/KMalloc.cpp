@@ -0,0 +1,108 @@
+#include <MM/KMalloc.h>
+
+#include <CString.h>
+#include <Logging.h>
+#include <Objects/Process.h>
+#include <SMP.h>
+#include <Scheduler.h>
+#include <Timer.h>
+
+#define KMALLOC_STRESS_ITERATIONS 200000
+#define KMALLOC_STRESS_SLOTS 128 // Allocations each thread keeps around
+
+// Mostly small objects, with the odd one too large for the size classes
+static const size_t stressSizes[] = {8, 16, 24, 48, 64, 100, 128, 256, 500, 1024, 2048, 4096, 8192};
+
+static unsigned threadsRunning = 0;
+static unsigned threadsFailed = 0;
+static unsigned nextSeed = 1;
+
+static void StressThread() {
+    unsigned seed = __atomic_fetch_add(&nextSeed, 7919, __ATOMIC_RELAXED);
+
+    uint8_t* slots[KMALLOC_STRESS_SLOTS] = {nullptr};
+    uint8_t slotValues[KMALLOC_STRESS_SLOTS];
+
+    bool failed = false;
+    for (unsigned i = 0; i < KMALLOC_STRESS_ITERATIONS; i++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned slot = (seed >> 8) % KMALLOC_STRESS_SLOTS;
+
+        if (uint8_t* p = slots[slot]) {
+            // Another thread being handed the same object would have overwritten it
+            if (p[0] != slotValues[slot]) {
+                failed = true;
+            }
+
+            kfree(p);
+            slots[slot] = nullptr;
+        } else {
+            size_t size = stressSizes[(seed >> 16) % (sizeof(stressSizes) / sizeof(size_t))];
+            slots[slot] = reinterpret_cast<uint8_t*>(kmalloc(size));
+            slotValues[slot] = static_cast<uint8_t>(seed >> 24);
+
+            memset(slots[slot], slotValues[slot], size);
+        }
+    }
+
+    for (uint8_t* p : slots) {
+        kfree(p);
+    }
+
+    if (failed) {
+        __atomic_add_fetch(&threadsFailed, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_sub_fetch(&threadsRunning, 1, __ATOMIC_RELEASE);
+    Scheduler::GetCurrentProcess()->Die();
+}
+
+// Returns the amount of microseconds taken by threadCount threads
+static uint64_t RunStressThreads(unsigned threadCount) {
+    threadsRunning = threadCount;
+
+    uint64_t start = Timer::UsecondsSinceBoot();
+    for (unsigned i = 0; i < threadCount; i++) {
+        FancyRefPtr<Process> proc = Process::CreateKernelProcess((void*)StressThread, "kmallocstress", nullptr);
+        proc->Start();
+    }
+
+    while (__atomic_load_n(&threadsRunning, __ATOMIC_ACQUIRE)) {
+        Scheduler::Yield();
+    }
+
+    return Timer::UsecondsSinceBoot() - start;
+}
+
+int KMallocTest() {
+    Log::Info("[TestModule] Running KMalloc Test...");
+
+    // Each thread does the same amount of work, so with perfect scaling the time stays the same
+    uint64_t single = RunStressThreads(1);
+    uint64_t parallel = RunStressThreads(SMP::processorCount);
+
+    if (threadsFailed) {
+        Log::Warning("[TestModule] %u threads were given objects which were still in use", threadsFailed);
+        return 1;
+    }
+
+    if (!parallel) {
+        parallel = 1;
+    }
+
+    Log::Info("[TestModule] %u kmalloc/kfree per thread: 1 thread %u us, %u threads %u us (%u.%u times the throughput)",
+              KMALLOC_STRESS_ITERATIONS, single, SMP::processorCount, parallel,
+              single * SMP::processorCount / parallel, (single * SMP::processorCount * 10 / parallel) % 10);
+
+    for (unsigned i = 0; i < KMALLOC_CLASS_COUNT; i++) {
+        KMallocClassStats stats;
+        GetKMallocClassStats(i, stats);
+
+        Log::Info("[TestModule] %u byte class: %u allocations, %u KB in use, %u KB peak, %u KB reserved, %u refills, "
+                  "%u drains",
+                  stats.size, stats.allocations, stats.bytes / 1024, stats.peakBytes / 1024, stats.reservedBytes / 1024,
+                  stats.refills, stats.drains);
+    }
+
+    return 0;
+}
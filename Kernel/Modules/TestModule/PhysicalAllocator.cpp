@@ -0,0 +1,56 @@
+#include <PhysicalAllocator.h>
+
+#include <Logging.h>
+#include <Timer.h>
+
+#define ALLOCATION_BENCHMARK_COUNT 8192
+
+int PhysicalAllocatorTest() {
+    Log::Info("[TestModule] Running Physical Allocator Test...");
+
+    // Runs must be aligned to their size
+    for (unsigned order = 0; order <= PHYSALLOC_MAX_ORDER; order++) {
+        uint64_t addr = Memory::AllocatePhysicalMemoryBlocks(order);
+        if (!addr) {
+            Log::Warning("Failed to allocate order %u run", order);
+            continue;
+        }
+
+        if (addr & ((PHYSALLOC_BLOCK_SIZE << order) - 1)) {
+            Log::Warning("Order %u run at %x is misaligned", order, addr);
+            return 1;
+        }
+
+        Memory::FreePhysicalMemoryBlocks(addr, order);
+    }
+
+    // Restricting the zone must keep memory below 4GB
+    uint64_t runs[4];
+    for (uint64_t& run : runs) {
+        run = Memory::AllocatePhysicalMemoryBlocks(2, Memory::PhysicalZoneDMA32);
+        if (!run || run >= 0x100000000ULL) {
+            Log::Warning("Failed to allocate from DMA32 zone (%x)", run);
+            return 2;
+        }
+    }
+
+    for (uint64_t run : runs) {
+        Memory::FreePhysicalMemoryBlocks(run, 2);
+    }
+
+    // Single blocks should mostly come from the CPU's cache
+    static uint64_t blocks[ALLOCATION_BENCHMARK_COUNT];
+
+    uint64_t start = Timer::UsecondsSinceBoot();
+    for (uint64_t& block : blocks) {
+        block = Memory::AllocatePhysicalMemoryBlock();
+    }
+
+    for (uint64_t block : blocks) {
+        Memory::FreePhysicalMemoryBlock(block);
+    }
+    uint64_t elapsed = Timer::UsecondsSinceBoot() - start;
+
+    Log::Info("[TestModule] %u block allocations and frees took %u us", ALLOCATION_BENCHMARK_COUNT, elapsed);
+    return 0;
+}
@@ -0,0 +1,585 @@
+#include "VirtIONet.h"
+
+#include <Module.h>
+
+#include <CPU.h>
+#include <IDT.h>
+#include <Logging.h>
+#include <Math.h>
+#include <Net/Net.h>
+#include <PCI.h>
+#include <Paging.h>
+#include <PhysicalAllocator.h>
+#include <Vector.h>
+
+static Vector<VirtIONet*>* adapters = nullptr;
+static int ModuleInit() {
+    adapters = new Vector<VirtIONet*>();
+
+    auto probe = [](const PCIInfo& dev) -> void {
+        VirtIONet* card = new VirtIONet(dev);
+
+        if (card->dState == VirtIONet::DriverState::OK) {
+            Network::NetFS::GetInstance()->RegisterAdapter(card);
+            adapters->add_back(card);
+        } else {
+            delete card;
+        }
+    };
+
+    PCI::EnumeratePCIDevices(VIRTIO_NET_TRANSITIONAL_DEVICE_ID, VIRTIO_VENDOR_ID, probe);
+    PCI::EnumeratePCIDevices(VIRTIO_NET_DEVICE_ID, VIRTIO_VENDOR_ID, probe);
+
+    if (adapters->get_length() == 0) {
+        return 1; // We haven't found or successfully initialized any cards so let the kernel unload us
+    }
+
+    return 0;
+}
+
+static int ModuleExit() {
+    for (const auto& card : *adapters) {
+        Network::NetFS::GetInstance()->RemoveAdapter(card);
+        delete card;
+    }
+
+    delete adapters;
+
+    return 0;
+}
+
+DECLARE_MODULE("virtionet", "VirtIO Network Adapter Driver", ModuleInit, ModuleExit);
+
+// Allocate physically contiguous, zeroed memory the device can access
+static void* AllocateDMABuffer(size_t size, uintptr_t& phys) {
+    unsigned pages = PAGE_COUNT_4K(size);
+    unsigned order = 0;
+    while ((1U << order) < pages) {
+        order++;
+    }
+
+    phys = Memory::AllocatePhysicalMemoryBlocks(order);
+    if (!phys) {
+        return nullptr;
+    }
+
+    void* virt = Memory::KernelAllocate4KPages(1U << order);
+    Memory::KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(virt), 1U << order);
+
+    memset(virt, 0, PAGE_SIZE_4K << order);
+    return virt;
+}
+
+namespace VirtIO {
+bool Virtqueue::Allocate(uint16_t idx, uint16_t sz, bool useEventIdx) {
+    assert(sz && !(sz & (sz - 1)));
+
+    index = idx;
+    size = sz;
+    eventIdx = useEventIdx;
+
+    descriptors = reinterpret_cast<VirtqDescriptor*>(AllocateDMABuffer(sizeof(VirtqDescriptor) * size, descriptorsPhys));
+    avail = reinterpret_cast<VirtqAvail*>(
+        AllocateDMABuffer(sizeof(VirtqAvail) + sizeof(uint16_t) * (size + 1), availPhys));
+    used = reinterpret_cast<VirtqUsed*>(
+        AllocateDMABuffer(sizeof(VirtqUsed) + sizeof(VirtqUsedElement) * size + sizeof(uint16_t), usedPhys));
+
+    return descriptors && avail && used;
+}
+
+void Virtqueue::Kick() {
+    uint16_t old = lastKicked;
+    lastKicked = availIdx;
+
+    // avail->idx must be visible before we check whether the device wants a notification,
+    // otherwise the device could go idle between the two
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    bool needsKick;
+    if (eventIdx) {
+        uint16_t event = AvailEvent();
+        // Only kick if avail->idx moved past the index the device asked to be notified at
+        needsKick = static_cast<uint16_t>(availIdx - event - 1) < static_cast<uint16_t>(availIdx - old);
+    } else {
+        needsKick = !(used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    if (needsKick) {
+        *notify = index;
+    }
+}
+
+void Virtqueue::DisableInterrupts() {
+    avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    if (eventIdx) {
+        // The device only interrupts once the used index passes usedEvent,
+        // which will not happen until it wraps around
+        UsedEvent() = lastUsed - 1;
+    }
+}
+
+bool Virtqueue::EnableInterrupts() {
+    avail->flags = 0;
+    if (eventIdx) {
+        UsedEvent() = lastUsed;
+    }
+
+    // Check for used buffers after interrupts have been enabled
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return HasUsed();
+}
+} // namespace VirtIO
+
+void VirtIONet::InterruptHandler(VirtIONet* card, RegisterContext* r) { card->OnInterrupt(); }
+
+void VirtIONet::OnInterrupt() {
+    if (!msix) {
+        uint8_t isr = *isrStatus; // Reading clears the status
+        if (!(isr & VIRTIO_ISR_QUEUE)) {
+            return; // Someone else's interrupt or a configuration change, link state is read when asked for
+        }
+    }
+
+    {
+        ScopedSpinLock<true> lock{rxLock};
+        // The network thread polls the RX queue until it is empty then enables interrupts again
+        rxQueue.DisableInterrupts();
+    }
+
+    {
+        // TX interrupts are only enabled while packets are waiting for descriptors
+        ScopedSpinLock<true> lock{txLock};
+        ReclaimTx();
+        FlushTxBacklog();
+    }
+
+    packetSemaphore.Signal();
+    Network::packetQueueSemaphore.Signal();
+}
+
+void* VirtIONet::MapCapability(uint8_t bar, uint32_t offset, uint32_t length) {
+    if (bar > 5 || BarIsIOPort(bar)) {
+        return nullptr;
+    }
+
+    uintptr_t base = GetBaseAddressRegister(bar) + offset;
+    size_t pageCount = PAGE_COUNT_4K((base & (PAGE_SIZE_4K - 1)) + length);
+
+    uintptr_t virt = reinterpret_cast<uintptr_t>(Memory::KernelAllocate4KPages(pageCount));
+    Memory::KernelMapVirtualMemory4K(base & ~static_cast<uintptr_t>(PAGE_SIZE_4K - 1), virt, pageCount,
+                                     PAGE_PRESENT | PAGE_WRITABLE | PAGE_CACHE_DISABLED | PAGE_WRITETHROUGH);
+
+    return reinterpret_cast<void*>(virt + (base & (PAGE_SIZE_4K - 1)));
+}
+
+bool VirtIONet::FindCapabilities() {
+    if (!(Status() & PCI_STATUS_CAPABILITIES)) {
+        return false;
+    }
+
+    uint8_t ptr = PCI::ConfigReadByte(Bus(), Slot(), Func(), PCICapabilitiesPointer) & 0xFC;
+    while (ptr) {
+        uint8_t capID = PCI::ConfigReadByte(Bus(), Slot(), Func(), ptr);
+        if (capID == PCICapabilityIDs::PCICapVendorSpecific) {
+            uint8_t cfgType = PCI::ConfigReadByte(Bus(), Slot(), Func(), ptr + offsetof(VirtIO::PCICapability, cfgType));
+            uint8_t bar = PCI::ConfigReadByte(Bus(), Slot(), Func(), ptr + offsetof(VirtIO::PCICapability, bar));
+            uint32_t offset =
+                PCI::ConfigReadDword(Bus(), Slot(), Func(), ptr + offsetof(VirtIO::PCICapability, offset));
+            uint32_t length =
+                PCI::ConfigReadDword(Bus(), Slot(), Func(), ptr + offsetof(VirtIO::PCICapability, length));
+
+            // Devices can have more than one of each structure, use the first we can map
+            if (cfgType == VIRTIO_PCI_CAP_COMMON_CFG && !common) {
+                common = reinterpret_cast<VirtIO::CommonConfig*>(MapCapability(bar, offset, length));
+            } else if (cfgType == VIRTIO_PCI_CAP_NOTIFY_CFG && !notifyBase) {
+                notifyBase = reinterpret_cast<uintptr_t>(MapCapability(bar, offset, length));
+                // The notify capability is followed by the multiplier for queueNotifyOff
+                notifyMultiplier = PCI::ConfigReadDword(Bus(), Slot(), Func(), ptr + sizeof(VirtIO::PCICapability));
+            } else if (cfgType == VIRTIO_PCI_CAP_ISR_CFG && !isrStatus) {
+                isrStatus = reinterpret_cast<uint8_t*>(MapCapability(bar, offset, length));
+            } else if (cfgType == VIRTIO_PCI_CAP_DEVICE_CFG && !deviceConfig) {
+                deviceConfig = reinterpret_cast<VirtIO::NetConfig*>(MapCapability(bar, offset, length));
+            }
+        }
+
+        ptr = PCI::ConfigReadByte(Bus(), Slot(), Func(), ptr + 1) & 0xFC;
+    }
+
+    return common && notifyBase && isrStatus && deviceConfig;
+}
+
+bool VirtIONet::NegotiateFeatures() {
+    common->deviceFeatureSelect = 0;
+    uint64_t deviceFeatures = common->deviceFeature;
+    common->deviceFeatureSelect = 1;
+    deviceFeatures |= static_cast<uint64_t>(common->deviceFeature) << 32;
+
+    if (!(deviceFeatures & VIRTIO_F_VERSION_1)) {
+        Log::Error("[virtio-net] Device is not virtio 1.0 compliant");
+        return false;
+    }
+
+    // No offloads, every buffer holds a whole frame
+    features = deviceFeatures & (VIRTIO_F_VERSION_1 | VIRTIO_F_EVENT_IDX | VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS);
+
+    common->driverFeatureSelect = 0;
+    common->driverFeature = features & 0xFFFFFFFF;
+    common->driverFeatureSelect = 1;
+    common->driverFeature = features >> 32;
+
+    common->deviceStatus = common->deviceStatus | VIRTIO_STATUS_FEATURES_OK;
+    if (!(common->deviceStatus & VIRTIO_STATUS_FEATURES_OK)) {
+        Log::Error("[virtio-net] Device did not accept features %x", features);
+        return false;
+    }
+
+    return true;
+}
+
+bool VirtIONet::InitializeQueue(VirtIO::Virtqueue& queue, uint16_t index, uint16_t msixVector) {
+    common->queueSelect = index;
+
+    uint16_t maxSize = common->queueSize;
+    if (!maxSize) {
+        Log::Error("[virtio-net] Queue %u is not available", index);
+        return false;
+    }
+
+    uint16_t size = 1;
+    while (size * 2 <= MIN(maxSize, VIRTIO_NET_MAX_QUEUE_SIZE)) {
+        size *= 2;
+    }
+
+    if (!queue.Allocate(index, size, features & VIRTIO_F_EVENT_IDX)) {
+        Log::Error("[virtio-net] Failed to allocate queue %u", index);
+        return false;
+    }
+
+    common->queueSize = size;
+    common->queueDescLow = queue.descriptorsPhys & 0xFFFFFFFF;
+    common->queueDescHigh = queue.descriptorsPhys >> 32;
+    common->queueDriverLow = queue.availPhys & 0xFFFFFFFF;
+    common->queueDriverHigh = queue.availPhys >> 32;
+    common->queueDeviceLow = queue.usedPhys & 0xFFFFFFFF;
+    common->queueDeviceHigh = queue.usedPhys >> 32;
+
+    common->queueMSIXVector = msixVector;
+    if (common->queueMSIXVector != msixVector) {
+        Log::Error("[virtio-net] Failed to set MSI-X vector for queue %u", index);
+        return false;
+    }
+
+    queue.notify = reinterpret_cast<uint16_t*>(notifyBase + common->queueNotifyOff * notifyMultiplier);
+
+    common->queueEnable = 1;
+    return true;
+}
+
+void VirtIONet::PostRxBuffer(uint16_t n, NetBuffer* buffer) {
+    rxBuffers[n] = buffer;
+
+    // The device writes the NetHeader into the headroom, so the frame lands at buffer->data
+    VirtIO::VirtqDescriptor& desc = rxQueue.descriptors[n];
+    desc.addr = buffer->PhysicalAddress(buffer->data - sizeof(VirtIO::NetHeader));
+    desc.length = sizeof(VirtIO::NetHeader) + ETHERNET_MAX_PACKET_SIZE;
+    desc.flags = VIRTQ_DESC_F_WRITE;
+    desc.next = 0;
+
+    rxQueue.Push(n);
+}
+
+bool VirtIONet::InitializeRx() {
+    if (!InitializeQueue(rxQueue, VIRTIO_NET_QUEUE_RX, msix ? 0 : VIRTIO_MSI_NO_VECTOR)) {
+        return false;
+    }
+
+    rxBuffers = new NetBuffer*[rxQueue.size]();
+    for (unsigned i = 0; i < rxQueue.size; i++) {
+        NetBuffer* buffer = Network::AllocateBuffer(NetLayerDriver);
+        if (!buffer) {
+            Log::Error("[virtio-net] Failed to allocate RX buffers");
+            return false;
+        }
+
+        PostRxBuffer(i, buffer);
+    }
+
+    rxQueue.Publish();
+    return true;
+}
+
+bool VirtIONet::InitializeTx() {
+    if (!InitializeQueue(txQueue, VIRTIO_NET_QUEUE_TX, VIRTIO_MSI_NO_VECTOR)) {
+        return false;
+    }
+
+    txBuffers = new NetBuffer*[txQueue.size]();
+    txFree = new uint16_t[txQueue.size];
+    for (unsigned i = 0; i < txQueue.size; i++) {
+        VirtIO::VirtqDescriptor& desc = txQueue.descriptors[i];
+        desc.flags = 0;
+        desc.next = 0;
+
+        txFree[txFreeCount++] = i;
+    }
+
+    // Finished descriptors are reclaimed when sending
+    txQueue.DisableInterrupts();
+    return true;
+}
+
+VirtIONet::VirtIONet(const PCIInfo& device)
+    : NetworkAdapter(NetworkAdapterEthernet), PCIDevice(device.bus, device.slot, device.func) {
+    assert(device.vendorID == VIRTIO_VENDOR_ID);
+
+    if (!FindCapabilities()) {
+        Log::Error("[virtio-net] Missing virtio 1.0 PCI capabilities (legacy only device?)");
+        dState = DriverState::Error;
+        return;
+    }
+
+    EnableMemorySpace();
+    EnableBusMastering();
+
+    // Reset the device
+    common->deviceStatus = 0;
+    while (common->deviceStatus)
+        asm volatile("pause");
+
+    common->deviceStatus = VIRTIO_STATUS_ACKNOWLEDGE;
+    common->deviceStatus = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+
+    if (!NegotiateFeatures()) {
+        common->deviceStatus = VIRTIO_STATUS_FAILED;
+        dState = DriverState::Error;
+        return;
+    }
+
+    // Only the RX queue interrupts
+    if (MSIXCapable()) {
+        irq = AllocateMSIXVector(0, GetCPULocal()->id);
+        msix = (irq != 0xFF);
+    }
+
+    if (!msix) {
+        irq = AllocateVector(PCIVectorAny);
+        EnableInterrupts();
+    }
+
+    if (irq == 0xFF) {
+        Log::Error("[virtio-net] Failed to allocate an interrupt");
+        common->deviceStatus = VIRTIO_STATUS_FAILED;
+        dState = DriverState::Error;
+        return;
+    }
+    common->msixConfig = VIRTIO_MSI_NO_VECTOR;
+
+    if (!InitializeRx() || !InitializeTx()) {
+        common->deviceStatus = VIRTIO_STATUS_FAILED;
+        dState = DriverState::Error;
+        return;
+    }
+
+    if (features & VIRTIO_NET_F_MAC) {
+        for (int i = 0; i < 6; i++) {
+            mac[i] = deviceConfig->mac.data[i];
+        }
+    } else {
+        // Locally administered address
+        uint8_t macAddr[6] = {0x52, 0x54, 0x00, 0x4C, Bus(), Slot()};
+        mac = macAddr;
+    }
+
+    Log::Info("[virtio-net] MAC Address: %x:%x:%x:%x:%x:%x, IRQ: %d (%s), RX queue: %u, TX queue: %u", mac[0], mac[1],
+              mac[2], mac[3], mac[4], mac[5], irq, msix ? "MSI-X" : "shared", rxQueue.size, txQueue.size);
+
+    char tempName[NAME_MAX];
+    char busS[16];
+    char slotS[16];
+
+    itoa(Bus(), busS, 10);
+    itoa(Slot(), slotS, 10);
+
+    strcpy(tempName, "vnet");
+    strcat(tempName, busS);
+    strcat(tempName, "s");
+    strcat(tempName, slotS);
+
+    SetInstanceName(tempName); // Name format: vnet%pciBus%s%pciSlot%
+    SetDeviceName("VirtIO Network Adapter");
+
+    IDT::RegisterInterruptHandler(irq, reinterpret_cast<isr_t>(&VirtIONet::InterruptHandler), this);
+
+    common->deviceStatus = common->deviceStatus | VIRTIO_STATUS_DRIVER_OK;
+    rxQueue.Kick();
+
+    dState = DriverState::OK;
+    linkState = GetLink();
+}
+
+VirtIONet::~VirtIONet() {
+    if (common) {
+        common->deviceStatus = 0; // Reset the device so it stops using our buffers
+    }
+
+    for (unsigned i = 0; rxBuffers && i < rxQueue.size; i++) {
+        if (rxBuffers[i]) {
+            Network::ReleaseBuffer(rxBuffers[i]);
+        }
+    }
+
+    for (unsigned i = 0; txBuffers && i < txQueue.size; i++) {
+        if (txBuffers[i]) {
+            Network::ReleaseBuffer(txBuffers[i]);
+        }
+    }
+
+    while (txBacklog.get_length()) {
+        Network::ReleaseBuffer(txBacklog.remove_at(0));
+    }
+
+    delete[] rxBuffers;
+    delete[] txBuffers;
+    delete[] txFree;
+}
+
+int VirtIONet::GetLink() const {
+    if (!(features & VIRTIO_NET_F_STATUS)) {
+        return LinkUp; // Link is assumed to always be up
+    }
+
+    return (deviceConfig->status & VIRTIO_NET_S_LINK_UP) ? LinkUp : LinkDown;
+}
+
+NetBuffer* VirtIONet::Dequeue() {
+    ScopedSpinLock<true> lock{rxLock};
+
+    for (;;) {
+        while (rxQueue.HasUsed()) {
+            VirtIO::VirtqUsedElement e = rxQueue.PopUsed();
+            if (e.id >= rxQueue.size) {
+                Log::Warning("[virtio-net] Device used invalid RX descriptor %u", e.id);
+                continue;
+            }
+
+            NetBuffer* buffer = rxBuffers[e.id];
+
+            // Swap a new buffer into the ring before handing this one up. If the pool is empty
+            // the packet is dropped and the buffer reused, so the ring never runs dry.
+            NetBuffer* replacement = nullptr;
+            if (e.length > sizeof(VirtIO::NetHeader)) {
+                replacement = Network::AllocateBuffer(NetLayerDriver);
+            }
+
+            PostRxBuffer(e.id, replacement ? replacement : buffer);
+            rxQueue.Publish();
+            rxQueue.Kick();
+
+            if (!replacement) {
+                continue;
+            }
+
+            buffer->length = MIN(e.length - sizeof(VirtIO::NetHeader), ETHERNET_MAX_PACKET_SIZE);
+            buffer->adapter = this;
+            return buffer;
+        }
+
+        // The queue is empty, wait for an interrupt again
+        if (!rxQueue.EnableInterrupts()) {
+            return nullptr;
+        }
+
+        rxQueue.DisableInterrupts();
+    }
+}
+
+NetBuffer* VirtIONet::DequeueBlocking() {
+    for (;;) {
+        if (NetBuffer* buffer = Dequeue(); buffer) {
+            return buffer;
+        }
+
+        if (packetSemaphore.Wait()) {
+            return nullptr; // We were interrupted
+        }
+    }
+}
+
+void VirtIONet::ReclaimTx() {
+    while (txQueue.HasUsed()) {
+        VirtIO::VirtqUsedElement e = txQueue.PopUsed();
+        if (e.id < txQueue.size && txBuffers[e.id]) {
+            Network::ReleaseBuffer(txBuffers[e.id]);
+            txBuffers[e.id] = nullptr;
+
+            txFree[txFreeCount++] = e.id;
+        }
+    }
+}
+
+void VirtIONet::Transmit(NetBuffer* buffer) {
+    if (buffer->length > ETHERNET_MAX_PACKET_SIZE) {
+        Log::Warning("[virtio-net] Dropping oversized packet (%u bytes)", buffer->length);
+        Network::CountDrop(NetLayerDriver);
+        Network::ReleaseBuffer(buffer);
+        return;
+    }
+
+    // No offloads, so the header is all zeroes
+    memset(buffer->Push(sizeof(VirtIO::NetHeader)), 0, sizeof(VirtIO::NetHeader));
+
+    ScopedSpinLock<true> lock{txLock};
+
+    ReclaimTx();
+    FlushTxBacklog();
+
+    if (txFreeCount && !txBacklog.get_length()) {
+        PostTxBuffer(buffer);
+        txQueue.Publish();
+        txQueue.Kick();
+        return;
+    }
+
+    // Never wait for the device with interrupts off,
+    // hold on to the packet until the TX interrupt says descriptors are free
+    if (txBacklog.get_length() >= VIRTIO_NET_TX_BACKLOG_MAX) {
+        Log::Warning("[virtio-net] TX queue full, dropping packet");
+        Network::CountDrop(NetLayerDriver);
+        Network::ReleaseBuffer(buffer);
+        return;
+    }
+
+    txBacklog.add_back(buffer);
+    if (txQueue.EnableInterrupts()) {
+        // The device finished with some descriptors before interrupts were enabled
+        ReclaimTx();
+        FlushTxBacklog();
+    }
+}
+
+void VirtIONet::PostTxBuffer(NetBuffer* buffer) {
+    uint16_t desc = txFree[--txFreeCount];
+    txBuffers[desc] = buffer;
+
+    txQueue.descriptors[desc].addr = buffer->PhysicalAddress(buffer->data);
+    txQueue.descriptors[desc].length = buffer->length;
+
+    txQueue.Push(desc);
+}
+
+void VirtIONet::FlushTxBacklog() {
+    if (!txBacklog.get_length()) {
+        return;
+    }
+
+    while (txFreeCount && txBacklog.get_length()) {
+        PostTxBuffer(txBacklog.remove_at(0));
+    }
+
+    txQueue.Publish();
+    txQueue.Kick();
+
+    if (!txBacklog.get_length()) {
+        txQueue.DisableInterrupts();
+    }
+}
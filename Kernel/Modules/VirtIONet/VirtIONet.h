@@ -0,0 +1,246 @@
+#pragma once
+
+#include <Compiler.h>
+#include <List.h>
+#include <Net/Adapter.h>
+#include <PCI.h>
+
+#define VIRTIO_VENDOR_ID 0x1AF4
+#define VIRTIO_NET_TRANSITIONAL_DEVICE_ID 0x1000
+#define VIRTIO_NET_DEVICE_ID 0x1041
+
+// Configuration structure types of the virtio PCI capabilities
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG 3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+#define VIRTIO_STATUS_ACKNOWLEDGE (1 << 0)
+#define VIRTIO_STATUS_DRIVER (1 << 1)
+#define VIRTIO_STATUS_DRIVER_OK (1 << 2)
+#define VIRTIO_STATUS_FEATURES_OK (1 << 3)
+#define VIRTIO_STATUS_NEEDS_RESET (1 << 6)
+#define VIRTIO_STATUS_FAILED (1 << 7)
+
+#define VIRTIO_NET_F_MAC (1ULL << 5)      // Device has a MAC address
+#define VIRTIO_NET_F_STATUS (1ULL << 16)  // Link status is available
+#define VIRTIO_F_EVENT_IDX (1ULL << 29)   // used_event and avail_event suppress notifications
+#define VIRTIO_F_VERSION_1 (1ULL << 32)   // Virtio 1.0 compliant
+
+#define VIRTIO_NET_S_LINK_UP (1 << 0)
+
+#define VIRTIO_ISR_QUEUE (1 << 0)
+#define VIRTIO_ISR_CONFIG (1 << 1)
+
+#define VIRTIO_MSI_NO_VECTOR 0xFFFF
+
+#define VIRTQ_DESC_F_NEXT (1 << 0)  // Buffer continues in the next field
+#define VIRTQ_DESC_F_WRITE (1 << 1) // Buffer is write only for the device
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT (1 << 0)
+#define VIRTQ_USED_F_NO_NOTIFY (1 << 0)
+
+#define VIRTIO_NET_QUEUE_RX 0
+#define VIRTIO_NET_QUEUE_TX 1
+
+#define VIRTIO_NET_MAX_QUEUE_SIZE 1024 // Most descriptors we use per virtqueue
+#define VIRTIO_NET_TX_BACKLOG_MAX 256  // Packets held back while the TX queue is full before dropping
+
+namespace VirtIO {
+struct PCICapability {
+    uint8_t capID; // PCICapVendorSpecific
+    uint8_t nextCap;
+    uint8_t capLength;
+    uint8_t cfgType; // Configuration structure type
+    uint8_t bar;     // BAR containing the structure
+    uint8_t padding[3];
+    uint32_t offset; // Offset of the structure within the BAR
+    uint32_t length; // Length of the structure
+} __attribute__((packed));
+
+struct CommonConfig {
+    uint32_t deviceFeatureSelect;
+    uint32_t deviceFeature; // Feature bits (32 * deviceFeatureSelect) to (32 * deviceFeatureSelect + 31)
+    uint32_t driverFeatureSelect;
+    uint32_t driverFeature;
+    uint16_t msixConfig; // MSI-X vector for configuration changes
+    uint16_t numQueues;
+    uint8_t deviceStatus;
+    uint8_t configGeneration;
+
+    // Everything below is for the queue selected by queueSelect
+    uint16_t queueSelect;
+    uint16_t queueSize; // Maximum size on reset, the driver may make it smaller
+    uint16_t queueMSIXVector;
+    uint16_t queueEnable;
+    uint16_t queueNotifyOff;
+    uint32_t queueDescLow;
+    uint32_t queueDescHigh;
+    uint32_t queueDriverLow; // Available ring
+    uint32_t queueDriverHigh;
+    uint32_t queueDeviceLow; // Used ring
+    uint32_t queueDeviceHigh;
+} __attribute__((packed));
+static_assert(sizeof(CommonConfig) == 56);
+
+struct NetConfig {
+    MACAddress mac;
+    uint16_t status;
+    uint16_t maxVirtqueuePairs;
+    uint16_t mtu;
+} __attribute__((packed));
+
+// Prepended to every packet, all zeroes when checksum and segmentation offloads are not used
+struct NetHeader {
+    uint8_t flags;
+    uint8_t gsoType;
+    uint16_t headerLength;
+    uint16_t gsoSize;
+    uint16_t csumStart;
+    uint16_t csumOffset;
+    uint16_t numBuffers;
+} __attribute__((packed));
+static_assert(sizeof(NetHeader) == 12);
+
+struct VirtqDescriptor {
+    uint64_t addr; // Physical address of the buffer
+    uint32_t length;
+    uint16_t flags;
+    uint16_t next; // Next descriptor in the chain if VIRTQ_DESC_F_NEXT is set
+} __attribute__((packed));
+
+struct VirtqAvail {
+    uint16_t flags;
+    uint16_t idx; // Where the driver will put the next entry
+    uint16_t ring[];
+    // uint16_t usedEvent follows the ring
+} __attribute__((packed));
+
+struct VirtqUsedElement {
+    uint32_t id;     // Head of the completed descriptor chain
+    uint32_t length; // Bytes written into the buffer by the device
+} __attribute__((packed));
+
+struct VirtqUsed {
+    uint16_t flags;
+    uint16_t idx; // Where the device will put the next entry
+    VirtqUsedElement ring[];
+    // uint16_t availEvent follows the ring
+} __attribute__((packed));
+
+// Split virtqueue, descriptors are set up by the owner and handed to the device through Push
+class Virtqueue {
+public:
+    VirtqDescriptor* descriptors = nullptr;
+    uint16_t size = 0;
+
+    // Allocate the rings for a queue with sz descriptors (a power of two)
+    bool Allocate(uint16_t idx, uint16_t sz, bool useEventIdx);
+
+    // Make the chain starting at head available, the device will not see it until Publish
+    ALWAYS_INLINE void Push(uint16_t head) {
+        avail->ring[availIdx & (size - 1)] = head;
+        availIdx++;
+    }
+
+    ALWAYS_INLINE void Publish() { __atomic_store_n(&avail->idx, availIdx, __ATOMIC_RELEASE); }
+
+    // Notify the device of new buffers, unless it has told us it does not need to know
+    void Kick();
+
+    ALWAYS_INLINE bool HasUsed() const { return __atomic_load_n(&used->idx, __ATOMIC_ACQUIRE) != lastUsed; }
+    ALWAYS_INLINE VirtqUsedElement PopUsed() {
+        volatile VirtqUsedElement& entry = used->ring[lastUsed & (size - 1)];
+        VirtqUsedElement e = {entry.id, entry.length};
+        lastUsed++;
+        return e;
+    }
+
+    void DisableInterrupts();
+    // Returns true if buffers were used whilst interrupts were disabled,
+    // in which case the device may not interrupt for them
+    bool EnableInterrupts();
+
+    uintptr_t descriptorsPhys = 0;
+    uintptr_t availPhys = 0;
+    uintptr_t usedPhys = 0;
+
+    volatile uint16_t* notify = nullptr; // Notification address
+    uint16_t index = 0;
+
+private:
+    ALWAYS_INLINE volatile uint16_t& UsedEvent() { return *reinterpret_cast<volatile uint16_t*>(&avail->ring[size]); }
+    ALWAYS_INLINE volatile uint16_t& AvailEvent() { return *reinterpret_cast<volatile uint16_t*>(&used->ring[size]); }
+
+    volatile VirtqAvail* avail = nullptr;
+    volatile VirtqUsed* used = nullptr;
+
+    uint16_t availIdx = 0;  // Our copy of avail->idx
+    uint16_t lastKicked = 0; // avail->idx at the last notification
+    uint16_t lastUsed = 0;   // Next used ring entry to process
+
+    bool eventIdx = false;
+};
+} // namespace VirtIO
+
+class VirtIONet final : public Network::NetworkAdapter, private PCIDevice {
+public:
+    VirtIONet(const PCIInfo& device);
+    ~VirtIONet();
+
+    // The device reads the frame straight out of the buffer, with the NetHeader pushed in front of it
+    void Transmit(NetBuffer* buffer);
+
+    int GetLink() const;
+
+    // Received buffers are handed out straight from the RX ring and replaced with new ones from the pool
+    NetBuffer* Dequeue();
+    NetBuffer* DequeueBlocking();
+
+private:
+    volatile VirtIO::CommonConfig* common = nullptr;
+    volatile VirtIO::NetConfig* deviceConfig = nullptr;
+    volatile uint8_t* isrStatus = nullptr;
+    uintptr_t notifyBase = 0;
+    uint32_t notifyMultiplier = 0;
+
+    uint64_t features = 0;
+
+    uint8_t irq = 0xFF;
+    bool msix = false; // If false we share a legacy interrupt or MSI and have to check the ISR status
+
+    VirtIO::Virtqueue rxQueue;
+    VirtIO::Virtqueue txQueue;
+
+    // RX descriptor n holds rxBuffers[n], the device writes the NetHeader into its headroom
+    NetBuffer** rxBuffers = nullptr;
+    lock_t rxLock = 0;
+
+    // TX descriptor n points into txBuffers[n] until the device is finished with it
+    NetBuffer** txBuffers = nullptr;
+    uint16_t* txFree = nullptr; // Stack of free TX descriptors
+    unsigned txFreeCount = 0;
+    // Packets waiting for a free TX descriptor, sent from the TX interrupt as the device finishes with others
+    FastList<NetBuffer*> txBacklog;
+    lock_t txLock = 0;
+
+    // Hand buffer to the device through RX descriptor n
+    void PostRxBuffer(uint16_t n, NetBuffer* buffer);
+
+    void* MapCapability(uint8_t bar, uint32_t offset, uint32_t length);
+    bool FindCapabilities();
+    bool NegotiateFeatures();
+    bool InitializeQueue(VirtIO::Virtqueue& queue, uint16_t index, uint16_t msixVector);
+    bool InitializeRx();
+    bool InitializeTx();
+
+    // Give TX descriptors the device has finished with back to the free stack and release their buffers
+    void ReclaimTx();
+    // Hand buffer to the device through a free TX descriptor, txLock must be held
+    void PostTxBuffer(NetBuffer* buffer);
+    // Move backlogged packets onto free TX descriptors, txLock must be held
+    void FlushTxBacklog();
+
+    void OnInterrupt();
+    static void InterruptHandler(VirtIONet* card, RegisterContext* r);
+};
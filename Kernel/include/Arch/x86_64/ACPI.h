@@ -65,6 +65,15 @@ typedef struct PCIMCFG {
   PCIMCFGBaseAddress baseAddresses[];
 } __attribute__ ((packed)) pci_mcfg_table_t;
 
+typedef struct HPET {
+  acpi_header_t header;
+  uint32_t eventTimerBlockID; // Hardware revision, comparator count and vendor
+  acpi_gas_t address; // Address of the HPET registers
+  uint8_t hpetNumber;
+  uint16_t minimumTick; // Minimum clock ticks for periodic mode
+  uint8_t pageProtection;
+} __attribute__ ((packed)) acpi_hpet_t;
+
 namespace ACPI{
   extern uint8_t processors[];
   extern int processorCount;
@@ -74,6 +83,7 @@ namespace ACPI{
 	extern acpi_xsdp_t* desc;
 	extern acpi_rsdt_t* rsdtHeader;
   extern pci_mcfg_table_t* mcfg;
+  extern acpi_hpet_t* hpet;
 
 	void Init();
   void SetRSDP(acpi_xsdp_t* p);
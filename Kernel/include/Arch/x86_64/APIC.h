@@ -30,6 +30,12 @@
 
 #define LOCAL_APIC_BASE 0xFFFFFFFFFF000
 
+#define LOCAL_APIC_LVT_MASKED (1 << 16)
+#define LOCAL_APIC_TIMER_MODE_ONE_SHOT (0 << 17)
+#define LOCAL_APIC_TIMER_MODE_PERIODIC (1 << 17)
+#define LOCAL_APIC_TIMER_MODE_TSC_DEADLINE (2 << 17)
+#define LOCAL_APIC_TIMER_DIVIDE_16 0x3
+
 #define ICR_VECTOR(x) (x & 0xFF)
 #define ICR_MESSAGE_TYPE_FIXED 0
 #define ICR_MESSAGE_TYPE_LOW_PRIORITY (1 << 8)
@@ -62,6 +68,11 @@ namespace APIC{
         void Enable();
 
         void SendIPI(uint8_t apicID, uint32_t dsh, uint32_t type, uint8_t vector);
+
+        // Set the timer LVT entry, the timer is stopped until the count or deadline is set
+        void SetTimerMode(uint8_t vector, uint32_t mode);
+        void SetTimerInitialCount(uint32_t count);
+        uint32_t GetTimerCurrentCount();
     }
 
     namespace IO{
@@ -6,7 +6,14 @@
 
 class Process;
 struct Thread;
-template <typename T> class FastList;
+class RunQueue;
+struct TraceBuffer;
+struct ProfileBuffer;
+struct NetBufferCache;
+
+namespace Timer {
+class TimerQueue;
+}
 
 typedef struct {
     uint16_t limit;
@@ -34,7 +41,11 @@ struct CPU {
     Thread* idleThread = nullptr;
     Process* idleProcess;
     volatile int runQueueLock = 0;
-    FastList<Thread*>* runQueue;
+    RunQueue* runQueue;
+    Timer::TimerQueue* timerQueue = nullptr; // Pending timer events for this CPU
+    TraceBuffer* traceBuffer = nullptr; // Allocated once tracing is first enabled
+    ProfileBuffer* profileBuffer = nullptr; // Allocated once the profiler is first started
+    NetBufferCache* netBufferCache = nullptr; // Free packet buffers, allocated when the network stack starts
 } __attribute__((packed));
 
 #define CPU_LOCAL_SELF 0x0
@@ -71,6 +82,7 @@ enum {
     CPUID_ECX_x2APIC = 1 << 21,
     CPUID_ECX_MOVBE = 1 << 22,
     CPUID_ECX_POPCNT = 1 << 23,
+    CPUID_ECX_TSC_DEADLINE = 1 << 24,
     CPUID_ECX_AES = 1 << 25,
     CPUID_ECX_XSAVE = 1 << 26,
     CPUID_ECX_OSXSAVE = 1 << 27,
@@ -178,6 +190,14 @@ ALWAYS_INLINE uintptr_t GetCR3() {
     return val;
 }
 
+ALWAYS_INLINE uint64_t ReadTSC() {
+    uint32_t low;
+    uint32_t high;
+
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
 static ALWAYS_INLINE void SetCPULocal(CPU* val) {
     val->self = val;
     asm volatile("wrmsr" ::"a"((uintptr_t)val & 0xFFFFFFFF) /*Value low*/,
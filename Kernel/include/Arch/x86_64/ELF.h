@@ -79,6 +79,8 @@ typedef struct ELFInfo {
 	uint64_t phNum;
 
 	char* linkerPath;
+
+	int error; // Negative error code if loading failed
 } elf_info_t;
 
 #define ELF64_R_SYM(i) ((i) >> 32) // Relocation info to symbol table index
@@ -124,6 +126,11 @@ typedef struct ELFInfo {
 #define PT_SHLIB 5
 #define PT_PHDR 6
 
+// Segment Flags
+#define PF_X 1 // Execute
+#define PF_W 2 // Write
+#define PF_R 4 // Read
+
 // Section Types
 #define SHT_NULL 0 // Unused
 #define SHT_PROGBITS 1 // Information defined by the program
@@ -177,7 +184,9 @@ using ELFSection = ELF64Section;
 using ELFRelocation = ELF64Relocation;
 using ELFRelocationA = ELF64RelocationA;
 
+class FsNode;
 class Process;
 
 int VerifyELF(void* elf);
-elf_info_t LoadELFSegments(Process* proc, void* elf, uintptr_t base);
\ No newline at end of file
+// Map the segments of the ELF file into the address space of proc, pages are read in as they are accessed
+elf_info_t LoadELFSegments(Process* proc, FsNode* node, uintptr_t base);
\ No newline at end of file
@@ -8,6 +8,8 @@
 #define IPI_HALT 0xFE
 #define IPI_SCHEDULE 0xFD
 
+#define INTERRUPT_LOCAL_TIMER 0xFC // Local APIC timer
+
 typedef struct {
     uint16_t base_low;
     uint16_t sel;
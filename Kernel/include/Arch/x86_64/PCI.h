@@ -75,6 +75,13 @@
 #define PCI_CAP_MSI_CONTROL_MMC(x) ((x >> 1) & 0x7) // Multiple Message Capable
 #define PCI_CAP_MSI_CONTROL_ENABLE (1 << 0) // MSI Enable
 
+#define PCI_CAP_MSIX_CONTROL_TABLE_SIZE(x) (((x) & 0x7FF) + 1) // Table size is 0's based
+#define PCI_CAP_MSIX_CONTROL_FUNCTION_MASK (1 << 14) // Mask all vectors
+#define PCI_CAP_MSIX_CONTROL_ENABLE (1 << 15) // MSI-X Enable
+#define PCI_CAP_MSIX_TABLE_BIR(x) ((x) & 0x7) // BAR containing the table
+#define PCI_CAP_MSIX_TABLE_OFFSET(x) ((x) & ~0x7U) // Offset of the table in the BAR
+#define PCI_MSIX_VECTOR_MASKED (1 << 0)
+
 enum PCIConfigRegisters{
 	PCIDeviceID = 0x2,
 	PCIVendorID = 0x0,
@@ -107,6 +114,8 @@ enum PCIConfigRegisters{
 
 enum PCICapabilityIDs{
 	PCICapMSI = 0x5,
+	PCICapVendorSpecific = 0x9,
+	PCICapMSIX = 0x11,
 };
 
 enum PCIVectors{
@@ -164,6 +173,14 @@ struct PCIMSICapability{
 	}
 } __attribute__((packed));
 
+struct PCIMSIXTableEntry{
+	uint32_t addressLow; // Message Address Low
+	uint32_t addressHigh; // Message Address High
+	uint32_t data; // Message Data
+	uint32_t vectorControl; // Bit 0 masks the vector
+};
+static_assert(sizeof(PCIMSIXTableEntry) == 16);
+
 struct PCIInfo{
 	uint16_t deviceID;
 	uint16_t vendorID;
@@ -216,7 +233,7 @@ public:
 
 		uintptr_t bar = PCI::ConfigReadDword(bus, slot, func, PCIBAR0 + (idx * sizeof(uint32_t)));
 		if(!(bar & 0x1) /* Not IO */ && bar & 0x4 /* 64-bit */ && idx < 5){
-			bar |= static_cast<uintptr_t>(PCI::ConfigReadDword(bus, slot, func, PCIBAR0 + ((bar + 1) * sizeof(uint32_t)))) << 32;
+			bar |= static_cast<uintptr_t>(PCI::ConfigReadDword(bus, slot, func, PCIBAR0 + ((idx + 1) * sizeof(uint32_t)))) << 32;
 		}
 
 		return (bar & 0x1) ? (bar & 0xFFFFFFFFFFFFFFFC) : (bar & 0xFFFFFFFFFFFFFFF0);
@@ -248,6 +265,13 @@ public:
 	inline uint16_t VendorID() { return vendorID; }
 
 	uint8_t AllocateVector(PCIVectors type);
+
+	// Allocate an interrupt for MSI-X table entry 'entry' routed to the CPU with local APIC ID 'apicID',
+	// MSI-X gets enabled on first use. Returns 0xFF on failure
+	uint8_t AllocateMSIXVector(uint16_t entry, uint8_t apicID);
+
+	inline bool MSIXCapable() const { return msixCapable; }
+	inline uint16_t MSIXTableSize() const { return msixTableSize; }
 private:
 	uint16_t deviceID = 0xffff;
 	uint16_t vendorID = 0xffff;
@@ -265,4 +289,9 @@ private:
 	uint8_t msiPtr;
 	PCIMSICapability msiCap;
 	bool msiCapable = false;
+
+	uint8_t msixPtr;
+	uint16_t msixTableSize = 0;
+	volatile PCIMSIXTableEntry* msixTable = nullptr; // Mapped on first use
+	bool msixCapable = false;
 };
\ No newline at end of file
@@ -5,6 +5,7 @@
 
 #define KERNEL_VIRTUAL_BASE 0xFFFFFFFF80000000ULL
 #define IO_VIRTUAL_BASE (KERNEL_VIRTUAL_BASE - 0x100000000ULL) // KERNEL_VIRTUAL_BASE - 4GB
+#define KERNEL_HEAP_VIRTUAL_BASE (KERNEL_VIRTUAL_BASE + 0x40000000ULL) // Last GB of the address space
 
 #define PML4_GET_INDEX(addr) (((addr) >> 39) & 0x1FF)
 #define PDPT_GET_INDEX(addr) (((addr) >> 30) & 0x1FF)
@@ -8,22 +8,58 @@
 // The size of a block in phyiscal memory
 #define PHYSALLOC_BLOCK_SIZE 4096
 #define PHYSALLOC_BLOCK_SHIFT 12
-// The amount of blocks in a byte
-#define PHYSALLOC_BLOCKS_PER_BYTE 8
 
-// The size of the memory bitmap in dwords
-#define PHYSALLOC_BITMAP_SIZE_DWORDS 524488 // 64GB
+// Maximum amount of physical memory that can be managed in blocks
+#define PHYSALLOC_MAX_BLOCKS (1ULL << 24) // 64GB
+
+// Largest block size is 2^PHYSALLOC_MAX_ORDER blocks (4MB)
+#define PHYSALLOC_MAX_ORDER 10
+#define PHYSALLOC_ORDER_COUNT (PHYSALLOC_MAX_ORDER + 1)
+
+// Order of a 2MB block
+#define PHYSALLOC_LARGE_ORDER 9
+
+// Amount of free blocks each CPU can keep to itself
+#define PHYSALLOC_CACHE_SIZE 64
+// Amount of blocks moved between a CPU's cache and its zone at once
+#define PHYSALLOC_CACHE_BATCH_ORDER 5
+#define PHYSALLOC_CACHE_BATCH (1 << PHYSALLOC_CACHE_BATCH_ORDER)
+
+// Share counts are kept in chunks, only allocated once a block in the chunk is shared
+#define PHYSALLOC_SHARE_CHUNK_SIZE 1024
 
 extern void* kernel_end;
 
 namespace Memory {
 
+enum PhysicalZone {
+    PhysicalZoneDMA32, // Below 4GB, can be accessed through the IO mapping and by 32-bit DMA
+    PhysicalZoneHigh,  // Everything above 4GB
+    PhysicalZoneCount,
+};
+
+struct PhysicalZoneStats {
+    uint64_t base; // Physical address range of the zone
+    uint64_t end;
+
+    uint64_t totalBlocks; // Blocks of usable memory within the zone
+    uint64_t freeBlocks;  // Blocks not allocated or held in a CPU cache
+    uint64_t freeLists[PHYSALLOC_ORDER_COUNT]; // Amount of free 2^n block runs
+
+    uint64_t allocations;       // Requests served from the zone
+    uint64_t failedAllocations; // Contiguous allocations which could not be satisfied
+};
+
+struct PhysicalCacheStats {
+    uint64_t cachedBlocks;
+    uint64_t hits;    // Allocations served straight from the cache
+    uint64_t refills; // Times the cache was refilled from a zone
+    uint64_t drains;  // Times the cache was full and returned blocks to a zone
+};
+
 // Initialize the physical page allocator
 void InitializePhysicalAllocator(memory_info_t* mem_info);
 
-// Finds the first free block in physical memory
-uint64_t GetFirstFreeMemoryBlock();
-
 // Marks a region in physical memory as being used
 void MarkMemoryRegionUsed(uint64_t base, size_t size);
 
@@ -33,13 +69,54 @@ void MarkMemoryRegionFree(uint64_t base, size_t size);
 // Allocates a block of physical memory
 uint64_t AllocatePhysicalMemoryBlock();
 
+/////////////////////////////
+/// \brief Allocate 2^order contiguous blocks of physical memory
+///
+/// The blocks are aligned to their size (e.g. an order 9 allocation is 2MB aligned).
+/// Single blocks are taken from the current CPU's cache where possible.
+///
+/// \param order Order of the allocation, at most PHYSALLOC_MAX_ORDER
+/// \param highestZone Highest zone the memory may be taken from
+///
+/// \return Physical address of the first block, 0 if there is no free run large enough
+/////////////////////////////
+uint64_t AllocatePhysicalMemoryBlocks(unsigned order, PhysicalZone highestZone = PhysicalZoneHigh);
+
 // Allocates a 2MB block of physical memory
 uint64_t AllocateLargePhysicalMemoryBlock();
 
 // Frees a block of physical memory
 void FreePhysicalMemoryBlock(uint64_t addr);
 
+/////////////////////////////
+/// \brief Free blocks allocated with AllocatePhysicalMemoryBlocks
+///
+/// \param order Must be the same as the order passed to AllocatePhysicalMemoryBlocks
+/////////////////////////////
+void FreePhysicalMemoryBlocks(uint64_t addr, unsigned order);
+
+// Frees a 2MB block of physical memory
+void FreeLargePhysicalMemoryBlock(uint64_t addr);
+
+/////////////////////////////
+/// \brief Add an owner to a block of physical memory
+///
+/// Allocated blocks have a single owner. Every owner added with SharePhysicalMemoryBlock
+/// must drop its reference with ReleasePhysicalMemoryBlock before the block is freed.
+/// Used by copy-on-write VMObjects to share pages between address spaces.
+/////////////////////////////
+void SharePhysicalMemoryBlock(uint64_t addr);
+
+// Returns true if the block has more than one owner
+bool IsPhysicalMemoryBlockShared(uint64_t addr);
+
+// Drops an owner of the block, freeing it if it was the last one
+void ReleasePhysicalMemoryBlock(uint64_t addr);
+
+void GetPhysicalZoneStats(PhysicalZone zone, PhysicalZoneStats& stats);
+void GetPhysicalCacheStats(unsigned cpu, PhysicalCacheStats& stats);
+
 // Used Blocks of Memory
 extern uint64_t usedPhysicalBlocks;
 extern uint64_t maxPhysicalBlocks;
-} // namespace Memory
\ No newline at end of file
+} // namespace Memory
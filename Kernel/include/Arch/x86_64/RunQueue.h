@@ -0,0 +1,111 @@
+#pragma once
+
+#include <Compiler.h>
+#include <List.h>
+#include <Thread.h>
+
+#include <stdint.h>
+
+#define RUN_QUEUE_PRIORITY_LEVELS 8
+#define RUN_QUEUE_MAX_PRIORITY_BONUS 2 // How far a thread can move from its base priority
+
+static_assert(RUN_QUEUE_PRIORITY_LEVELS <= 32, "Priority bitmap is 32 bits wide");
+
+/////////////////////////////
+/// \brief Per-CPU queue of runnable threads
+///
+/// Only threads which are ready to run and not currently executing are kept in the run queue.
+/// Each priority level has its own list and a bitmap of non-empty levels is kept,
+/// so picking the next thread does not depend on the number of threads.
+///
+/// Threads which have used up their time slice are placed in the expired array,
+/// which gets swapped with the active array once the active array is empty,
+/// so lower priority threads cannot be starved.
+///
+/// A thread's level is its base priority adjusted by how it has been behaving,
+/// so threads which mostly block (e.g. waiting on input) get ahead of threads using up the CPU.
+///
+/// The owning CPU's runQueueLock must be held for all operations.
+/////////////////////////////
+class RunQueue final {
+public:
+    RunQueue() = default;
+    RunQueue(const RunQueue&) = delete;
+    RunQueue& operator=(const RunQueue&) = delete;
+
+    /////////////////////////////
+    /// \brief Add a thread to the run queue
+    ///
+    /// \param thread Runnable thread, must not already be queued
+    /// \param expired Whether the thread has used up its time slice
+    /////////////////////////////
+    void Enqueue(Thread* thread, bool expired);
+
+    /////////////////////////////
+    /// \brief Remove the highest priority runnable thread
+    ///
+    /// \return Next thread to run, nullptr if the queue is empty
+    /////////////////////////////
+    Thread* Dequeue();
+
+    /////////////////////////////
+    /// \brief Remove a thread for another CPU to run
+    ///
+    /// Prefers threads from the expired array as they are least likely to be cache hot.
+    ///
+    /// \return Thread to migrate, nullptr if the queue is empty
+    /////////////////////////////
+    Thread* Steal();
+
+    /////////////////////////////
+    /// \brief Remove a queued thread
+    /////////////////////////////
+    void Remove(Thread* thread);
+
+    /////////////////////////////
+    /// \brief Remove all queued threads belonging to a process
+    /////////////////////////////
+    void RemoveProcessThreads(Process* process);
+
+    ALWAYS_INLINE unsigned Count() const { return m_count; }
+
+    /////////////////////////////
+    /// \brief Adjust the priority bonus of a thread being switched out
+    ///
+    /// Must not be called whilst the thread is queued, as its level would change.
+    ///
+    /// \param usedTimeSlice Whether the thread ran until its time slice was used up
+    /// \param blocked Whether the thread is blocking
+    /////////////////////////////
+    ALWAYS_INLINE static void UpdatePriorityBonus(Thread* thread, bool usedTimeSlice, bool blocked) {
+        assert(thread->runQueueArray < 0);
+
+        if (usedTimeSlice && thread->priorityBonus < RUN_QUEUE_MAX_PRIORITY_BONUS) {
+            thread->priorityBonus++;
+        } else if (blocked && thread->priorityBonus > -RUN_QUEUE_MAX_PRIORITY_BONUS) {
+            thread->priorityBonus--;
+        }
+    }
+
+private:
+    struct PriorityArray {
+        uint32_t bitmap = 0; // Bit n is set when queues[n] is not empty
+        FastList<Thread*> queues[RUN_QUEUE_PRIORITY_LEVELS];
+    };
+
+    ALWAYS_INLINE static unsigned PriorityLevel(const Thread* thread) {
+        int level = thread->priority + thread->priorityBonus;
+        if (level < 0) {
+            return 0;
+        }
+
+        return level < RUN_QUEUE_PRIORITY_LEVELS ? level : RUN_QUEUE_PRIORITY_LEVELS - 1;
+    }
+
+    Thread* TakeFront(int arrayIndex);
+
+    PriorityArray m_arrays[2];
+    int m_active = 0; // Index of the active array, the other is expired
+
+    unsigned m_count = 0;
+};
@@ -51,7 +51,14 @@ pid_t GetNextPID();
 FancyRefPtr<Process> FindProcessByPID(pid_t pid);
 pid_t GetNextProcessPID(pid_t pid);
 void InsertNewThreadIntoQueue(Thread* thread);
-void BalanceRunQueues();
+
+/////////////////////////////
+/// \brief Place a runnable thread back on its CPU's run queue
+///
+/// Does nothing if the thread is blocked, already queued or still executing.
+/// Interrupts must be disabled.
+/////////////////////////////
+void Wake(Thread* thread);
 
 void Initialize();
 void Tick(RegisterContext* r);
@@ -64,8 +64,6 @@ struct Thread {
     
     uint32_t timeSlice = THREAD_TIMESLICE_DEFAULT;
     uint32_t timeSliceDefault = THREAD_TIMESLICE_DEFAULT;
-    uint32_t ticksSinceBalance = 0; // Ticks since run queue rebalance
-    uint32_t ticksGivenSinceBalance = 0;
     RegisterContext registers;   // Registers
     struct {
         RegisterContext regs; // Last system call
@@ -74,11 +72,15 @@ struct Thread {
     void* fxState;               // State of the extended registers
 
     int cpu = -1; // CPU the thread is scheduled on
+    bool onCPU = false; // Thread is currently executing on cpu
+    int8_t runQueueArray = -1; // Run queue priority array the thread is in, -1 if not queued
 
     Thread* next = nullptr; // Next thread in queue
     Thread* prev = nullptr; // Previous thread in queue
 
-    uint8_t priority = 0;               // Thread priority
+    uint8_t priority = 0;               // Thread priority, lower values are scheduled first
+    int8_t priorityBonus = 0;           // Added to priority, raised for threads using their whole time slice
+                                        // and lowered for threads which block, see RunQueue::PriorityLevel
     uint8_t state = ThreadStateRunning; // Thread state
 
     uint64_t fsBase = 0;
@@ -12,6 +12,7 @@ static inline bool operator<(timeval l, timeval r){
 }
 
 namespace Timer{
+    uint64_t NanosecondsSinceBoot();
     uint64_t GetSystemUptime();
     uint64_t UsecondsSinceBoot();
     uint32_t GetFrequency();
@@ -25,6 +26,28 @@ namespace Timer{
 
     // Initialize
     void Initialize(uint32_t freq);
+
+    /////////////////////////////
+    /// \brief Calibrate the TSC and local APIC timer and switch the BSP over from the PIT
+    ///
+    /// The local APIC must be enabled.
+    /////////////////////////////
+    void InitializeLocalTimers();
+
+    /////////////////////////////
+    /// \brief Start the local APIC timer on the current CPU
+    /////////////////////////////
+    void EnableLocalTimer();
+
+    /////////////////////////////
+    /// \brief Make sure the current CPU's timer will fire for the next scheduler tick
+    ///
+    /// Called when switching threads. Idle CPUs do not need a tick
+    /// and only get woken by timer events and IPIs.
+    ///
+    /// \param preempt Whether the thread being switched to can be preempted
+    /////////////////////////////
+    void RearmLocalTimer(bool preempt);
 }
 
 inline long operator-(const timeval& l, const timeval& r){
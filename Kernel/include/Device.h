@@ -3,6 +3,7 @@
 #include <stdint.h>
 
 #include <Fs/Filesystem.h>
+#include <Storage/BlockQueue.h>
 
 #include <CString.h>
 #include <List.h>
@@ -109,11 +110,16 @@ public:
     virtual ssize_t Read(size_t off, size_t size, uint8_t* buffer);
     virtual ssize_t Write(size_t off, size_t size, uint8_t* buffer);
 
+    int Ioctl(uint64_t cmd, uint64_t arg) override;
+
     virtual ~DiskDevice();
 
     List<PartitionDevice*> partitions;
     int blocksize = 512;
 
+    // Reads and writes from filesystems and userspace go through the queue to the driver
+    BlockQueue queue;
+
 private:
 };
 
@@ -3,14 +3,47 @@
 #include <ABI/EPoll.h>
 #include <Fs/Filesystem.h>
 #include <List.h>
-#include <Pair.h>
+#include <Vector.h>
 
 namespace fs {
 
+class EPoll;
+
+/////////////////////////////
+/// \brief File registered with an epoll instance
+///
+/// Stays registered with the file's node, which signals it whenever the file may have become ready.
+/// Signalling only queues the item on the epoll ready list, the events are checked in epoll_wait.
+/////////////////////////////
+class EPollItem final : public FilesystemWatcher {
+    friend class EPoll;
+    friend class FastList<EPollItem*>;
+
+public:
+    EPollItem(EPoll* epoll, int fd, UNIXOpenFile* file, const epoll_event& event);
+
+    void Signal() override;
+
+    EPoll* const epoll;
+    const int fd;
+    UNIXOpenFile* const file; // Not referenced, the item is removed once the file has been closed
+
+    epoll_event event;
+    bool queued = false;   // On the ready list
+    bool disabled = false; // EPOLLONESHOT and an event has been reported since the last EPOLL_CTL_MOD
+
+    EPollItem* fileNext = nullptr; // Next item watching the same file
+
+private:
+    EPollItem* next = nullptr;
+    EPollItem* prev = nullptr;
+};
+
 class EPoll :
     public FsNode {
 public:
     EPoll() = default;
+    ~EPoll();
 
     void Close() override {
         handleCount--;
@@ -24,8 +57,57 @@ public:
         return true;
     }
 
-    List<Pair<int, epoll_event>> fds;
+    // Items are indexed by fd, check the file as the fd may have been reused
+    inline EPollItem* GetItem(int fd) {
+        if(fd < 0 || static_cast<size_t>(fd) >= items.get_length()){
+            return nullptr;
+        }
+
+        return items[fd];
+    }
+
+    /////////////////////////////
+    /// \brief Start watching a file
+    ///
+    /// fileItemsLock and epLock must be held.
+    ///
+    /// \return 0 on success, negative error code on failure
+    /////////////////////////////
+    int AddItem(int fd, UNIXOpenFile* file, const epoll_event& event);
+
+    /////////////////////////////
+    /// \brief Change the events of a watched file and rearm it
+    ///
+    /// epLock must be held.
+    /////////////////////////////
+    void ModifyItem(EPollItem* item, const epoll_event& event);
+
+    /////////////////////////////
+    /// \brief Stop watching a file
+    ///
+    /// fileItemsLock and epLock must be held.
+    /////////////////////////////
+    void RemoveItem(EPollItem* item);
+
+    // Put an item on the ready list and wake a thread waiting in epoll_wait
+    void QueueItem(EPollItem* item, bool wake = true);
+    // Take the item at the front of the ready list, nullptr if empty
+    EPollItem* DequeueItem();
+    // Wake a single thread waiting in epoll_wait
+    void WakeWaiter();
+
+    inline bool HasReadyItems() const { return ready.get_length(); }
+    inline unsigned ReadyCount() const { return ready.get_length(); }
+
+    // Protects the item lists of open files, always acquired before epLock
+    static lock_t fileItemsLock;
     lock_t epLock = 0;
+
+private:
+    Vector<EPollItem*> items;
+
+    lock_t readyLock = 0;
+    FastList<EPollItem*> ready;
 };
 
 }
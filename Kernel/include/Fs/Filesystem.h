@@ -10,6 +10,7 @@
 #include <String.h>
 #include <Types.h>
 #include <Objects/KObject.h>
+#include <Fs/PageCache.h>
 
 #include <abi-bits/fcntl.h>
 #include <abi-bits/uid_t.h>
@@ -46,6 +47,7 @@
 #define FS_NODE_SYMLINK S_IFLNK   
 #define FS_NODE_CHARDEVICE S_IFCHR
 #define FS_NODE_SOCKET S_IFSOCK   
+#define FS_NODE_FIFO S_IFIFO
 
 #define POLLIN 0x01
 #define POLLOUT 0x02
@@ -129,6 +131,10 @@ static inline void FD_SET(int fd, fd_set_t* fds) {
 class FilesystemWatcher;
 class DirectoryEntry;
 
+namespace fs {
+class EPollItem;
+}
+
 class UNIXOpenFile : public KernelObject {
     DECLARE_KOBJECT(UNIXOpenFile);
 public:
@@ -139,6 +145,8 @@ public:
     class FsNode* node = nullptr;
     off_t pos = 0;
     mode_t mode = 0;
+
+    fs::EPollItem* epollItems = nullptr; // epoll instances watching the file, removed once it is closed
 };
 
 class FsNode {
@@ -215,14 +223,30 @@ public:
     virtual inline bool IsSymlink() { return (flags & FS_NODE_TYPE) == FS_NODE_SYMLINK; }
     virtual inline bool IsCharDevice() { return (flags & FS_NODE_TYPE) == FS_NODE_CHARDEVICE; }
     virtual inline bool IsSocket() { return (flags & FS_NODE_TYPE) == FS_NODE_SOCKET; }
+    virtual inline bool IsFIFO() { return (flags & FS_NODE_TYPE) == FS_NODE_FIFO; }
     virtual inline bool IsEPoll() const { return false; }
 
     void UnblockAll();
 
+    /////////////////////////////
+    /// \brief Get the page cache of the node, creating it if it does not exist
+    ///
+    /// The page cache is shared between fs::Read and mappings of the file.
+    /////////////////////////////
+    FancyRefPtr<FilePageCache> GetPageCache();
+    ALWAYS_INLINE bool HasPageCache() const { return m_pageCache.get(); }
+
+    // Whether reads should be served from the page cache, filesystems backed by a disk should return true
+    virtual bool UsePageCache() const { return false; }
+
     FsNode* link;
     FsNode* parent;
 
     FilesystemLock nodeLock; // Lock on FsNode info
+
+protected:
+    lock_t m_pageCacheLock = 0;
+    FancyRefPtr<FilePageCache> m_pageCache;
 };
 
 class DirectoryEntry {
@@ -256,6 +280,9 @@ public:
         case FS_NODE_SOCKET:
             flags = DT_SOCK;
             break;
+        case FS_NODE_FIFO:
+            flags = DT_FIFO;
+            break;
         case FS_NODE_SYMLINK:
             flags = DT_LNK;
             break;
@@ -275,6 +302,14 @@ class FilesystemWatcher : public Semaphore {
 public:
     FilesystemWatcher() : Semaphore(0) {}
 
+    // Called by the node when it is ready
+    virtual void Signal() { Semaphore::Signal(); }
+
+    // Out of all exclusive watchers of a node only one gets signalled for each event (EPOLLEXCLUSIVE)
+    bool exclusive = false;
+    // Persistent watchers stay registered after being signalled until they unwatch the node (epoll)
+    bool persistent = false;
+
     inline void WatchNode(FsNode* node, int events) {
         ErrorOr<UNIXOpenFile*> desc = node->Open(0);
         assert(!desc.HasError() && desc.Value());
@@ -285,7 +320,7 @@ public:
         watching.add_back(f);
     }
 
-    ~FilesystemWatcher() {
+    virtual ~FilesystemWatcher() {
         for (auto& fd : watching) {
             fd->node->Unwatch(*this);
 
@@ -467,6 +502,19 @@ ssize_t Read(FsNode* node, size_t offset, size_t size, void* buffer);
 /// \return Bytes written or if negative an error code
 /////////////////////////////
 ssize_t Write(FsNode* node, size_t offset, size_t size, void* buffer);
+
+/////////////////////////////
+/// \brief Change the size of a filesystem node
+///
+/// Every change to the size of a node should go through here so pages cached past the new end are cleared.
+///
+/// \param node Pointer to node to truncate
+/// \param length New size of the node
+///
+/// \return 0 on success or if negative an error code
+/////////////////////////////
+int Truncate(FsNode* node, off_t length);
+
 ErrorOr<UNIXOpenFile*> Open(FsNode* node, uint32_t flags = 0);
 void Close(FsNode* node);
 void Close(UNIXOpenFile* openFile);
@@ -484,6 +532,24 @@ int Unlink(FsNode*, DirectoryEntry*, bool unlinkDirectories = false);
 int Ioctl(const FancyRefPtr<UNIXOpenFile>& handle, uint64_t cmd, uint64_t arg);
 
 int Rename(FsNode* olddir, const char* oldpath, FsNode* newdir, const char* newpath);
+
+/////////////////////////////
+/// \brief Signal the watchers of a node
+///
+/// Every watcher signalled is removed from watching unless it is persistent.
+/// Only the first exclusive watcher is signalled, the others are kept for the next event.
+/// The caller is expected to hold the lock protecting watching.
+/////////////////////////////
+void SignalWatchers(List<FilesystemWatcher*>& watching);
+
+// Stop any epoll instances watching a file which is being closed
+void RemoveEPollItems(UNIXOpenFile* openFile);
 } // namespace fs
 
-ALWAYS_INLINE UNIXOpenFile::~UNIXOpenFile() { fs::Close(this); }
+ALWAYS_INLINE UNIXOpenFile::~UNIXOpenFile() {
+    if (epollItems) {
+        fs::RemoveEPollItems(this);
+    }
+
+    fs::Close(this);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <Compiler.h>
+#include <List.h>
+#include <Spinlock.h>
+#include <Types.h>
+#include <Vector.h>
+
+class FsNode;
+
+/////////////////////////////
+/// \brief Cached pages of a file
+///
+/// Pages are read in from the FsNode when first needed, then shared between fs::Read
+/// and every mapping of the file. Pages of files which are not mapped are dropped
+/// when the page cache grows past its limit.
+/////////////////////////////
+class FilePageCache final {
+public:
+    FilePageCache(FsNode* node);
+    ~FilePageCache();
+
+    /////////////////////////////
+    /// \brief Get a page of the file, reading it in if it is not resident
+    ///
+    /// The page will stay resident until the cache is destroyed as long as the cache is mapped.
+    ///
+    /// \param index Index of the page within the file
+    ///
+    /// \return Physical address of the page, 0 on failure
+    /////////////////////////////
+    uintptr_t GetPage(size_t index);
+
+    // Mark a page as written to through a shared mapping
+    void MarkDirty(size_t index);
+
+    /////////////////////////////
+    /// \brief Read file data through the cache
+    ///
+    /// \return Bytes read or if negative an error code
+    /////////////////////////////
+    ssize_t Read(size_t offset, size_t size, uint8_t* buffer);
+
+    // Copy data which has been written to the node into any resident pages
+    void Update(size_t offset, size_t size, const uint8_t* buffer);
+
+    // Zero resident pages past the new end of the file
+    void Truncate(size_t length);
+
+    // Write dirty pages back to the node
+    void Writeback();
+
+    // Called when a mapping of the file is created or destroyed
+    void AddMapping();
+    void RemoveMapping();
+
+    ALWAYS_INLINE size_t ResidentPages() const { return m_residentPages; }
+
+    /////////////////////////////
+    /// \brief Drop clean pages of unmapped files
+    ///
+    /// Nodes with no open handles are closed again once their last page is dropped,
+    /// so filesystems keeping them around for their pages can free them.
+    ///
+    /// \param target Amount of pages to try to free
+    ///
+    /// \return Amount of pages freed
+    /////////////////////////////
+    static size_t Reclaim(size_t target);
+
+    // Total amount of pages held by all file caches
+    static size_t TotalResidentPages();
+
+private:
+    struct CachedPage {
+        uint32_t block = 0; // Physical block number, 0 if not resident
+        bool dirty = false;
+    };
+
+    // Allocate a block and read a page of the node into it
+    uintptr_t ReadPage(size_t index);
+
+    // Free every clean page, expects m_lock to be held and the cache to be unused
+    size_t DropCleanPages();
+
+    FsNode* m_node;
+
+    lock_t m_lock = 0;
+    Vector<CachedPage> m_pages;
+    size_t m_residentPages = 0;
+
+    unsigned m_generation = 0; // Incremented when the node is written to so stale reads are never cached
+    unsigned m_readers = 0;    // Threads copying out of the pages
+    unsigned m_mappings = 0;   // FileVMObjects mapping the pages
+};
@@ -4,6 +4,8 @@
 #include <RefPtr.h>
 #include <Stream.h>
 
+#define PIPE_BUF 4096 // Writes of up to this many bytes are never split up, DATASTREAM_BUFSIZE_MIN at most
+
 class UNIXPipe final : public FsNode {
 public:
     UNIXPipe(int end, FancyRefPtr<DataStream> stream);
@@ -11,13 +13,82 @@ public:
     ssize_t Read(size_t off, size_t size, uint8_t* buffer);
     ssize_t Write(size_t off, size_t size, uint8_t* buffer);
 
+    // With nonBlock -EAGAIN is returned rather than waiting for data or space (O_NONBLOCK)
+    ssize_t Read(size_t size, uint8_t* buffer, bool nonBlock);
+    ssize_t Write(size_t size, uint8_t* buffer, bool nonBlock);
+
+    int Ioctl(uint64_t cmd, uint64_t arg);
+
+    bool CanRead();
+    bool CanWrite();
+
     void Watch(FilesystemWatcher& watcher, int events);
     void Unwatch(FilesystemWatcher& watcher);
 
     void Close();
 
+    ALWAYS_INLINE bool IsReadEnd() const { return end == ReadEnd; }
+    ALWAYS_INLINE bool IsWriteEnd() const { return end == WriteEnd; }
+    // Whether both are ends of the same pipe
+    ALWAYS_INLINE bool SharesBufferWith(const UNIXPipe* other) const { return stream == other->stream; }
+
+    /////////////////////////////
+    /// \brief Move data from the pipe to a file
+    ///
+    /// Data is written to the file straight from the pipe buffer without going through userspace.
+    /// The read end is claimed for the duration, so other readers wait rather than take the data from under us.
+    ///
+    /// \param out File to write to
+    /// \param offset Offset to write at, if null the file position is used
+    /// \param size Maximum amount of bytes to move
+    /// \param nonBlock Return -EAGAIN instead of waiting for data
+    ///
+    /// \return Bytes moved or if negative an error code
+    /////////////////////////////
+    ssize_t SpliceTo(const FancyRefPtr<UNIXOpenFile>& out, off_t* offset, size_t size, bool nonBlock);
+
+    /////////////////////////////
+    /// \brief Move data from a file into the pipe
+    ///
+    /// The file is read straight into the pipe buffer without going through userspace.
+    /// The write end is claimed for the duration, so other writers wait rather than write over the data.
+    ///
+    /// \param in File to read from
+    /// \param offset Offset to read from, if null the file position is used
+    /// \param size Maximum amount of bytes to move
+    /// \param nonBlock Return -EAGAIN instead of waiting for space
+    ///
+    /// \return Bytes moved or if negative an error code
+    /////////////////////////////
+    ssize_t SpliceFrom(const FancyRefPtr<UNIXOpenFile>& in, off_t* offset, size_t size, bool nonBlock);
+
+    /////////////////////////////
+    /// \brief Copy data from the pipe to another pipe without consuming it
+    ///
+    /// \param out Write end of the other pipe
+    /// \param size Maximum amount of bytes to copy
+    /// \param nonBlock Return -EAGAIN instead of waiting for data or space
+    ///
+    /// \return Bytes copied or if negative an error code
+    /////////////////////////////
+    ssize_t Tee(UNIXPipe* out, size_t size, bool nonBlock);
+
     static void CreatePipe(UNIXPipe*& read, UNIXPipe*& write);
 protected:
+    // Whether there is data on the read end or at least space bytes free on the write end
+    bool IsReady(size_t space = 1);
+    // Wait for data on the read end or space on the write end
+    ssize_t WaitUntilReady(bool nonBlock, size_t space = 1);
+    // Wake anything waiting on the other end after data was read or written
+    void WakeOtherEnd();
+
+    // Take this end so nothing else uses its side of the buffer. Drain and Fill work on the buffer in place
+    // whilst the file I/O sleeps, so a sleeping claim is used rather than the open file's dataLock
+    ssize_t Claim(bool nonBlock);
+    void Release();
+    // Wait for data or space, then claim the end once there still is some
+    ssize_t WaitAndClaim(bool nonBlock, size_t space = 1);
+
     enum {
         InvalidPipe,
         ReadEnd,
@@ -25,10 +96,11 @@ protected:
     } end = InvalidPipe;
 
     bool widowed = false;
+    bool claimed = false;
     UNIXPipe* otherEnd = nullptr;
 
     FancyRefPtr<DataStream> stream;
     
     List<FilesystemWatcher*> watching;
     lock_t watchingLock = 0;
-};
\ No newline at end of file
+};
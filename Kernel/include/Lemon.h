@@ -6,6 +6,48 @@ typedef struct {
 	uint16_t cpuCount;
 } lemon_sysinfo_t;
 
+#define LEMON_MEMINFO_ORDER_COUNT 11
+#define LEMON_MEMINFO_MAX_ZONES 4
+#define LEMON_MEMINFO_MAX_CPUS 64
+#define LEMON_MEMINFO_MAX_KMALLOC_CLASSES 16
+
+typedef struct {
+	uint64_t base; // Physical address range of the zone
+	uint64_t end;
+	uint64_t totalPages;
+	uint64_t freePages;
+	uint64_t freeRuns[LEMON_MEMINFO_ORDER_COUNT]; // Free runs of 2^n pages
+	uint64_t allocations;
+	uint64_t failedAllocations;
+} lemon_memzone_info_t;
+
+typedef struct {
+	uint64_t cachedPages;
+	uint64_t hits;
+	uint64_t refills;
+	uint64_t drains;
+} lemon_pagecache_info_t;
+
+typedef struct {
+	uint64_t size; // Object size of the kmalloc size class
+	uint64_t allocations;
+	uint64_t frees;
+	uint64_t bytes;     // Allocated and not yet freed
+	uint64_t peakBytes; // Most memory held by CPUs at once, including their cached objects
+	uint64_t reservedBytes;
+	uint64_t refills;
+	uint64_t drains;
+} lemon_kmalloc_class_info_t;
+
+typedef struct {
+	uint16_t zoneCount;
+	uint16_t cpuCount;
+	lemon_memzone_info_t zones[LEMON_MEMINFO_MAX_ZONES];
+	lemon_pagecache_info_t cpus[LEMON_MEMINFO_MAX_CPUS]; // Per-CPU free page caches
+	uint16_t kmallocClassCount;
+	lemon_kmalloc_class_info_t kmallocClasses[LEMON_MEMINFO_MAX_KMALLOC_CLASSES];
+} lemon_meminfo_t;
+
 namespace Lemon{
 	extern char* versionString;
 }
\ No newline at end of file
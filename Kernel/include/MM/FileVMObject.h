@@ -0,0 +1,57 @@
+#pragma once
+
+#include <Fs/Filesystem.h>
+#include <Fs/PageCache.h>
+#include <MM/VMObject.h>
+
+/////////////////////////////
+/// \brief VMObject mapping part of a file
+///
+/// Pages come from the FilePageCache of the file, so they are shared with fs::Read and other mappings.
+/// Shared mappings write straight to the cached pages, private mappings copy a page on the first write to it.
+/// Private mappings can also be only partly backed by the file (e.g. ELF .data followed by .bss),
+/// the rest of the mapping is zero filled.
+/////////////////////////////
+class FileVMObject final : public VMObject {
+public:
+    /////////////////////////////
+    /// \param file Open file to map, keeps the node alive whilst mapped
+    /// \param fileOffset Offset into the file of the mapping, must be page aligned
+    /// \param size Size of the mapping
+    /// \param shared Whether writes should be visible to the file and other mappings
+    /// \param writable Whether the mapping can be written to at all
+    /// \param fileLength Amount of bytes of the mapping backed by the file, only private mappings can be shorter than size
+    /////////////////////////////
+    FileVMObject(FancyRefPtr<UNIXOpenFile> file, size_t fileOffset, size_t size, bool shared, bool writable = true,
+                 size_t fileLength = SIZE_MAX);
+    ~FileVMObject();
+
+    int Hit(uintptr_t base, uintptr_t offset, PageMap* pMap) override;
+    int CopyOnWriteHit(uintptr_t base, uintptr_t offset, PageMap* pMap) override;
+    void MapAllocatedBlocks(uintptr_t base, PageMap* pMap) override;
+
+    VMObject* Clone() override;
+
+    size_t UsedPhysicalMemory() const override;
+
+protected:
+    FileVMObject(const FileVMObject& other);
+
+    // Index of the page within the file, -1 if past the end of the file
+    long FilePageIndex(uintptr_t offset) const;
+
+    // Create a private copy of the page at offset, returns 0 on failure
+    uintptr_t CreatePrivateBlock(uintptr_t offset);
+    // Expects m_lock to be held, returns the block that ended up in use
+    uintptr_t InstallPrivateBlock(unsigned blockIndex, uintptr_t phys);
+
+    FancyRefPtr<UNIXOpenFile> m_file;
+    FancyRefPtr<FilePageCache> m_cache;
+    size_t m_fileOffset;
+    size_t m_fileLength;
+    bool m_writable;
+
+    // Copies of pages which have been written to, only used by private mappings
+    uint32_t* m_privateBlocks = nullptr;
+    lock_t m_lock = 0;
+};
@@ -1,7 +1,32 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+
+// Allocations up to KMALLOC_MAX_CLASS_SIZE are served from per-CPU caches of power of two size classes
+#define KMALLOC_MIN_CLASS_SHIFT 4 // 16 bytes
+#define KMALLOC_MAX_CLASS_SHIFT 12
+#define KMALLOC_MAX_CLASS_SIZE (1UL << KMALLOC_MAX_CLASS_SHIFT)
+#define KMALLOC_CLASS_COUNT (KMALLOC_MAX_CLASS_SHIFT - KMALLOC_MIN_CLASS_SHIFT + 1)
+
+// Amount of free objects of each size class a CPU can keep to itself
+#define KMALLOC_MAGAZINE_SIZE 32
+// Amount of objects moved between a CPU's cache and its size class at once
+#define KMALLOC_MAGAZINE_BATCH 16
+
+struct KMallocClassStats {
+    uint64_t size;        // Size of objects in the class
+    uint64_t allocations; // Summed over every CPU
+    uint64_t frees;
+    uint64_t bytes;         // Allocated and not yet freed
+    uint64_t peakBytes;     // Most memory handed out to CPUs at once, including objects in their caches
+    uint64_t reservedBytes; // Memory set aside for the class
+    uint64_t refills;       // Times a CPU cache was refilled from the class
+    uint64_t drains;        // Times a CPU cache was full and returned objects to the class
+};
 
 void* kmalloc(size_t);
 void kfree(void*);
 void* krealloc(void*, size_t);
+
+void GetKMallocClassStats(unsigned sizeClass, KMallocClassStats& stats);
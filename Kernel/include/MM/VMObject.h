@@ -6,6 +6,7 @@
 #include <Compiler.h>
 #include <Lock.h>
 #include <Paging.h>
+#include <PhysicalAllocator.h>
 #include <RefPtr.h>
 
 #define PHYS_BLOCK_MAX (0xffffffff << PAGE_SHIFT_4K)
@@ -18,6 +19,8 @@ public:
     virtual ~VMObject() = default;
 
     virtual int Hit(uintptr_t base, uintptr_t offset, PageMap* pMap);
+    // Called on a write to a copy-on-write page, gives the VMObject its own copy of the page
+    virtual int CopyOnWriteHit(uintptr_t base, uintptr_t offset, PageMap* pMap);
     virtual void MapAllocatedBlocks(uintptr_t base, PageMap* pMap) = 0;
 
     virtual VMObject* Clone() = 0;
@@ -51,23 +54,43 @@ public:
     virtual ~PhysicalVMObject();
 
     int Hit(uintptr_t base, uintptr_t offset, PageMap* pMap) final;
+    int CopyOnWriteHit(uintptr_t base, uintptr_t offset, PageMap* pMap) override;
     void ForceAllocate(); // Force allocate all blocks
     virtual void MapAllocatedBlocks(uintptr_t base, PageMap* pMap);
 
+    /////////////////////////////
+    /// \brief Create a copy-on-write duplicate of the VMObject
+    ///
+    /// No memory is copied, the physical blocks are shared between both VMObjects
+    /// and only copied when either one is written to.
+    /////////////////////////////
     virtual VMObject* Clone();
 
     virtual size_t UsedPhysicalMemory() const;
 
 protected:
+    PhysicalVMObject(const PhysicalVMObject& other);
+
+    // Whether the block at index can be mapped as writable
+    ALWAYS_INLINE bool IsBlockWritable(unsigned index) const {
+        return !copyOnWrite ||
+               !Memory::IsPhysicalMemoryBlockShared(static_cast<uintptr_t>(physicalBlocks[index]) << PAGE_SHIFT_4K);
+    }
+
     uint32_t* physicalBlocks = nullptr; // A bit of an optimization, since one physical block is 4KB, we can shift by 12
+    lock_t copyLock = 0; // Prevents two threads from copying the same block
 };
 
 class ProcessImageVMObject final : public PhysicalVMObject {
 public:
     ProcessImageVMObject(uintptr_t base, size_t size, bool write);
 
+    int CopyOnWriteHit(uintptr_t base, uintptr_t offset, PageMap* pMap) override;
     void MapAllocatedBlocks(uintptr_t base, PageMap* pMap);
+    VMObject* Clone();
 protected:
+    ProcessImageVMObject(const ProcessImageVMObject& other);
+
     bool write : 1 = true;
 
     uintptr_t base;
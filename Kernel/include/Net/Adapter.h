@@ -38,14 +38,17 @@ namespace Network{
 
         virtual int Ioctl(uint64_t cmd, uint64_t arg);
         
-        virtual void SendPacket(void* data, size_t len);
+        // Send the frame in buffer, the adapter takes ownership and releases it once sent
+        virtual void Transmit(NetBuffer* buffer);
 
         virtual int GetLink() const;
         virtual int QueueSize() const;
 
-        virtual NetworkPacket* Dequeue();
-        virtual NetworkPacket* DequeueBlocking();
-        virtual void CachePacket(NetworkPacket* pkt);
+        // Received frames, the caller releases them once handled
+        virtual NetBuffer* Dequeue();
+        virtual NetBuffer* DequeueBlocking();
+
+        inline AdapterType Type() const { return type; }
 
         void BindToSocket(IPSocket* sock);
         void UnbindSocket(IPSocket* sock);
@@ -55,16 +58,13 @@ namespace Network{
 
     protected:
         static int nextDeviceNumber;
-        unsigned maxCache = 256; // Maximum amount of cached packets, NIC drivers are free to change this
     
         int linkState = LinkDown;
 
-        FastList<NetworkPacket*> cache;
-        FastList<NetworkPacket*> queue;
+        FastList<NetBuffer*> queue;
 
         Semaphore packetSemaphore = Semaphore(0);
 
-        lock_t cacheLock = 0;
         lock_t queueLock = 0;
 
         lock_t threadLock = 0;
@@ -75,5 +75,18 @@ namespace Network{
         List<class ::IPSocket*> boundSockets; // If an adapter is destroyed, we need to know what sockets are bound to it
     };
 
+    // Packets sent through lo (127.0.0.0/8) are queued straight back onto the receive path.
+    // There is no ARP and checksums are neither calculated nor checked.
+    class LoopbackAdapter final : public NetworkAdapter {
+    public:
+        LoopbackAdapter();
+
+        void Transmit(NetBuffer* buffer);
+
+        inline uint64_t Dropped() const { return dropped; }
+    private:
+        uint64_t dropped = 0; // Packets dropped as the queue was full
+    };
+
     void AddAdapter(NetworkAdapter* a);
 }
\ No newline at end of file
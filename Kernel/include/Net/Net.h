@@ -1,6 +1,7 @@
 #pragma once
 
 #include <Net/If.h>
+#include <Net/NetBuffer.h>
 
 #include <CString.h>
 #include <Device.h>
@@ -21,19 +22,26 @@ class Socket;
 
 #define TCP_RETRY_MIN 200000   // 200 ms minimum retry period
 #define TCP_RETRY_MAX 32000000 // 32s
+#define TCP_RTO_INITIAL 1000000 // Retransmission timeout before the first RTT sample (RFC 6298)
+#define TCP_MAX_RETRANSMITS 12  // Consecutive retransmission timeouts before the connection is dropped
+
+#define TCP_DELAYED_ACK 40000      // Longest an ACK is held back waiting for a second segment, 40 ms
+#define TCP_TIME_WAIT 60000000     // 2 * MSL
+#define TCP_TIMER_TICK 10000       // Granularity of the TCP timer wheel, 10 ms
+#define TCP_TIMER_WHEEL_SIZE 256   // Slots in the timer wheel, timers further out than this take several turns
+
+#define TCP_MSS 1460        // Maximum segment size we advertise
+#define TCP_DEFAULT_MSS 536 // Assumed when the peer does not send the MSS option
+#define TCP_INITIAL_WINDOW 10 // Initial congestion window in segments (RFC 6928)
+
+#define TCP_SEND_BUFFER_SIZE 0x40000    // 256 KiB
+#define TCP_RECEIVE_BUFFER_SIZE 0x40000 // 256 KiB, advertised with window scaling
+#define TCP_SACK_BLOCKS_MAX 4           // Most SACK blocks that fit in the option space
+#define TCP_SACK_SCOREBOARD_SIZE 8      // Most SACKed ranges the sender remembers
 
 namespace Network {
 class NetworkAdapter;
 }
-struct NetworkPacket {
-    size_t length;
-    uint8_t data[1518];
-
-    Network::NetworkAdapter* adapter;
-
-    NetworkPacket* next;
-    NetworkPacket* prev;
-};
 
 struct IPv4Address {
     union {
@@ -205,6 +213,15 @@ struct TCPHeader {
 } __attribute__((packed));
 static_assert(!(sizeof(TCPHeader) & (sizeof(uint32_t) - 1)));
 
+enum TCPOptionKind {
+    TCPOptionEnd = 0,
+    TCPOptionNoOperation = 1,
+    TCPOptionMSS = 2,           // Maximum segment size, SYN only
+    TCPOptionWindowScale = 3,   // Shift applied to the window field, SYN only (RFC 7323)
+    TCPOptionSACKPermitted = 4, // SYN only (RFC 2018)
+    TCPOptionSACK = 5,          // Blocks of data received out of order
+};
+
 struct ICMPHeader {
     uint8_t type;
     uint8_t code;
@@ -272,16 +289,20 @@ int Route(const IPv4Address& local, const IPv4Address& dest, MACAddress& mac, Ne
 
 void InitializeNetworkThread();
 
+// Copy a frame into a buffer and transmit it
 void Send(void* data, size_t length, NetworkAdapter* adapter = nullptr);
-int SendIPv4(void* data, size_t length, IPv4Address& source, IPv4Address& destination, uint8_t protocol,
+// Prepend the IPv4 and Ethernet headers to the transport segment in buffer and transmit it.
+// Takes ownership of the buffer, even on failure.
+int SendIPv4(NetBuffer* buffer, IPv4Address& source, IPv4Address& destination, uint8_t protocol,
              NetworkAdapter* adapter = nullptr);
 
 namespace UDP {
 class UDPSocket;
 
-int SendUDP(void* data, size_t length, IPv4Address& source, IPv4Address& destination, BigEndian<uint16_t> sourcePort,
+// Prepend the UDP header to the payload in buffer and send it, takes ownership of the buffer
+int SendUDP(NetBuffer* buffer, IPv4Address& source, IPv4Address& destination, BigEndian<uint16_t> sourcePort,
             BigEndian<uint16_t> destinationPort, NetworkAdapter* adapter = nullptr);
-void OnReceiveUDP(IPv4Header& ipHeader, void* data, size_t length);
+void OnReceiveUDP(IPv4Header& ipHeader, NetBuffer* buffer);
 } // namespace UDP
 
 namespace TCP {
@@ -289,8 +310,9 @@ class TCPSocket;
 
 BigEndian<uint16_t> CalculateTCPChecksum(const IPv4Address& src, const IPv4Address& dest, void* data, uint16_t size);
 
-int SendTCP(void* data, size_t length, IPv4Address& source, IPv4Address& destination, BigEndian<uint16_t> sourcePort,
-            BigEndian<uint16_t> destinationPort, NetworkAdapter* adapter = nullptr);
-void OnReceiveTCP(IPv4Header& ipHeader, void* data, size_t length);
+void OnReceiveTCP(IPv4Header& ipHeader, NetBuffer* buffer);
+
+// Run the handlers of expired retransmit, delayed ACK and TIME-WAIT timers, called from the network thread
+void ProcessTimers();
 } // namespace TCP
 } // namespace Network
\ No newline at end of file
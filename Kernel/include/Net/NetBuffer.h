@@ -0,0 +1,107 @@
+#pragma once
+
+#include <ABI/Net.h>
+
+#include <Assert.h>
+#include <Compiler.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NET_BUFFER_SIZE 2048          // Two buffers to a page, so a buffer never crosses a page boundary
+#define NET_BUFFER_HEADROOM 64        // Space in front of the data for the virtio-net, Ethernet and IPv4 headers
+#define NET_BUFFER_CPU_CACHE 64       // Free buffers each CPU keeps before handing half back to the shared pool
+#define NET_BUFFER_POOL_INITIAL 1024  // Buffers allocated when the network stack starts
+#define NET_BUFFER_POOL_MAX 16384     // The pool never grows past this (32 MiB)
+
+class Device;
+
+namespace Network {
+class NetworkAdapter;
+}
+
+// A packet, passed between the layers of the network stack without being copied.
+// Headers are stripped with Pull on the way up and prepended with Push on the way down.
+// Receive handlers borrow the buffer, anything which holds on to it must take a reference.
+struct NetBuffer {
+    NetBuffer* next;
+    NetBuffer* prev;
+
+    uint8_t* data;   // Start of the packet
+    uint32_t length; // Bytes of packet after data
+    uint32_t refCount;
+
+    uintptr_t physical; // Physical address of the buffer, for DMA
+    Network::NetworkAdapter* adapter; // Adapter the packet was received on
+
+    uint8_t* network;   // IPv4 header, set on receive
+    uint8_t* transport; // UDP or TCP header, set on receive
+
+    uint8_t storage[];
+
+    ALWAYS_INLINE size_t Headroom() const { return data - storage; }
+    ALWAYS_INLINE size_t Tailroom() const {
+        return reinterpret_cast<const uint8_t*>(this) + NET_BUFFER_SIZE - (data + length);
+    }
+
+    // Prepend len bytes, returns the new start of the packet
+    ALWAYS_INLINE uint8_t* Push(size_t len) {
+        assert(len <= Headroom());
+
+        data -= len;
+        length += len;
+        return data;
+    }
+
+    // Strip len bytes from the front, returns the new start of the packet
+    ALWAYS_INLINE uint8_t* Pull(size_t len) {
+        assert(len <= length);
+
+        data += len;
+        length -= len;
+        return data;
+    }
+
+    // Append len bytes, returns where they go
+    ALWAYS_INLINE uint8_t* Put(size_t len) {
+        assert(len <= Tailroom());
+
+        uint8_t* tail = data + length;
+        length += len;
+        return tail;
+    }
+
+    // Cut the packet down to len bytes, used to drop link layer padding
+    ALWAYS_INLINE void Trim(size_t len) {
+        if (len < length) {
+            length = len;
+        }
+    }
+
+    ALWAYS_INLINE uintptr_t PhysicalAddress(const uint8_t* ptr) const {
+        return physical + (ptr - reinterpret_cast<const uint8_t*>(this));
+    }
+};
+
+namespace Network {
+// Fill the pool and create /dev/net/stats
+void InitializeBuffers();
+
+// Take an empty buffer from the pool with NET_BUFFER_HEADROOM in front of data.
+// Returns nullptr (and counts a drop against layer) if the pool is empty and cannot grow,
+// it only grows with interrupts enabled so interrupt handlers get what is already there.
+NetBuffer* AllocateBuffer(NetLayer layer);
+
+ALWAYS_INLINE NetBuffer* ReferenceBuffer(NetBuffer* buffer) {
+    __atomic_add_fetch(&buffer->refCount, 1, __ATOMIC_RELAXED);
+    return buffer;
+}
+
+// Drop a reference, the buffer goes back to the pool with the last one
+void ReleaseBuffer(NetBuffer* buffer);
+
+void CountCopy(NetLayer layer, size_t bytes);
+void CountDrop(NetLayer layer);
+
+// The /dev/net/stats node, a lemon_net_stats_t
+Device* StatisticsDevice();
+} // namespace Network
@@ -5,8 +5,10 @@
 #include <Net/If.h>
 #include <Net/Net.h>
 
+#include <CString.h>
 #include <List.h>
 #include <Lock.h>
+#include <Math.h>
 #include <Stream.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -17,8 +19,9 @@
 #include <abi-bits/socklen_t.h>
 
 #define CONNECTION_BACKLOG 128
-
-#define STREAM_MAX_BUFSIZE 0x20000 // 128 KB
+#define UDP_RECEIVE_QUEUE_MAX 256 // Datagrams waiting to be read before we start dropping them
+#define SOCKET_IOV_MAX 1024       // Most iovecs in a message, and messages in one sendmmsg or recvmmsg
+#define SOCKET_DATAGRAM_MAX 65536 // Largest datagram the default SendMsg and ReceiveMsg flatten from an iovec array
 
 struct rtentry {
     unsigned long rt_pad1;
@@ -53,6 +56,53 @@ struct sockaddr_un {
     char sun_path[108];     /* Pathname */
 };
 
+// Entry in the array passed to sendmmsg and recvmmsg
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len; // Bytes sent or received for this message
+};
+
+// Total length of an iovec array, the syscall layer checks that it cannot overflow
+inline size_t IovecLength(const iovec* iov, size_t count) {
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++) {
+        length += iov[i].iov_len;
+    }
+
+    return length;
+}
+
+// Copy each iovec in turn to buffer, which must have space for IovecLength bytes
+inline void GatherIovecs(uint8_t* buffer, const iovec* iov, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        memcpy(buffer, iov[i].iov_base, iov[i].iov_len);
+        buffer += iov[i].iov_len;
+    }
+}
+
+// Copy up to length bytes from buffer across an iovec array, returns the number of bytes copied
+inline size_t ScatterIovecs(const iovec* iov, size_t count, const uint8_t* buffer, size_t length) {
+    size_t copied = 0;
+    for (size_t i = 0; i < count && copied < length; i++) {
+        size_t chunk = MIN(iov[i].iov_len, (length - copied));
+        memcpy(iov[i].iov_base, buffer + copied, chunk);
+        copied += chunk;
+    }
+
+    return copied;
+}
+
+// Describe a single flat buffer as a message, for sockets whose SendTo and ReceiveFrom go through SendMsg and ReceiveMsg
+inline msghdr SingleBufferMessage(iovec* iov, void* name, socklen_t nameLength) {
+    msghdr msg = {};
+    msg.msg_name = name;
+    msg.msg_namelen = nameLength;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+
+    return msg;
+}
+
 struct poll {
     int fd;
     short events;
@@ -113,6 +163,12 @@ class Socket : public FsNode {
     virtual int64_t Send(void* buffer, size_t len, int flags);
     virtual ssize_t Write(size_t offset, size_t size, uint8_t* buffer);
 
+    // Send one message gathered from msg_iov. The default keeps a datagram in one piece by
+    // flattening it into a kernel buffer, and hands each iovec of a stream to SendTo in turn.
+    virtual int64_t SendMsg(const msghdr* msg, int flags);
+    // Receive one message scattered across msg_iov, updating msg_namelen and msg_flags
+    virtual int64_t ReceiveMsg(msghdr* msg, int flags);
+
     virtual int SetSocketOptions(int level, int opt, const void* optValue, socklen_t optLength);
     virtual int GetSocketOptions(int level, int opt, void* optValue, socklen_t* optLength);
 
@@ -181,6 +237,9 @@ class LocalSocket final : public Socket {
         else
             return false;
     }
+
+  private:
+    void SignalPeer(); // Signal anything watching the peer once we have written to it or made space for it
 };
 
 class IPSocket : public Socket {
@@ -205,6 +264,9 @@ class IPSocket : public Socket {
 
     void Close();
 
+    void Watch(FilesystemWatcher& watcher, int events);
+    void Unwatch(FilesystemWatcher& watcher);
+
     virtual int64_t ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen,
                                 const void* ancillary = nullptr, size_t ancillaryLen = 0);
     virtual int64_t SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen,
@@ -219,12 +281,15 @@ class IPSocket : public Socket {
 
     bool pktInfo = false; // Check for packet info field?
 
-    List<NetworkPacket> pQueue;
+    lock_t m_watcherLock = 0;
+    List<FilesystemWatcher*> m_watching;
 
     virtual unsigned short AllocatePort() = 0;
     virtual int AcquirePort(uint16_t port) = 0;
     virtual int ReleasePort() = 0;
     int64_t OnReceive(void* buffer, size_t len);
+
+    void NotifyWatchers(); // Signal poll/epoll once data has arrived or the state has changed
 };
 
 namespace Network::UDP {
@@ -234,6 +299,7 @@ class UDPSocket final : public IPSocket {
     ~UDPSocket();
 
     int IsConnected() { return false; } // UDP sockets are connection less
+    bool CanRead() { return packets.get_length(); }
 
     Socket* Accept(sockaddr* addr, socklen_t* addrlen, int mode);
     int Bind(const sockaddr* addr, socklen_t addrlen);
@@ -245,28 +311,42 @@ class UDPSocket final : public IPSocket {
     int64_t SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen,
                    const void* ancillary = nullptr, size_t ancillaryLen = 0);
 
-  protected:
-    friend void OnReceiveUDP(IPv4Header& ipHeader, void* data, size_t length);
+    // Gathers the iovecs straight into a packet buffer and scatters a datagram back out of one
+    int64_t SendMsg(const msghdr* msg, int flags);
+    int64_t ReceiveMsg(msghdr* msg, int flags);
 
-    struct UDPPacket {
-        IPv4Address sourceIP;
-        BigEndian<uint16_t> sourcePort;
-        size_t length;
-        uint8_t* data;
-    };
+  protected:
+    friend void OnReceiveUDP(IPv4Header& ipHeader, NetBuffer* buffer);
 
+    // Received datagrams with the headers pulled, the source is read from the headers
     lock_t packetsLock = 0;
-    List<UDPPacket> packets;
+    FastList<NetBuffer*> packets;
 
     unsigned short AllocatePort();
     int AcquirePort(uint16_t port);
     int ReleasePort();
 
-    int64_t OnReceive(IPv4Address& sourceIP, BigEndian<uint16_t> sourcePort, void* buffer, size_t len);
+    void OnReceive(NetBuffer* buffer);
 };
 } // namespace Network::UDP
 
 namespace Network::TCP {
+class TCPSocket;
+
+// Entry in the timer wheel shared by all TCP sockets, handlers are run on the network thread
+struct TCPTimer {
+    TCPTimer* next = nullptr;
+    TCPTimer* prev = nullptr;
+
+    TCPSocket* socket;
+    void (TCPSocket::*handler)();
+
+    uint64_t expiry = 0; // Wheel tick at which the timer fires
+    bool armed = false;
+
+    TCPTimer(TCPSocket* sock, void (TCPSocket::*h)()) : socket(sock), handler(h) {}
+};
+
 class TCPSocket final : public IPSocket {
   public:
     TCPSocket(int type, int protocol);
@@ -282,41 +362,101 @@ class TCPSocket final : public IPSocket {
     int64_t SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen,
                    const void* ancillary = nullptr, size_t ancillaryLen = 0);
 
+    // Copies every iovec into the send buffer before sending, so they go out in full segments
+    int64_t SendMsg(const msghdr* msg, int flags);
+    int64_t ReceiveMsg(msghdr* msg, int flags);
+
     int SetSocketOptions(int level, int opt, const void* optValue, socklen_t optLength);
     int GetSocketOptions(int level, int opt, void* optValue, socklen_t* optLength);
 
     int IsConnected() { return state == TCPStateEstablished; }
-    bool CanWrite() { return IsConnected(); }
+    bool CanRead() {
+        if (state == TCPStateListen) {
+            return pending.get_length(); // Connections waiting to be accepted
+        }
+
+        return m_inboundData.Pos() || m_finReceived || m_error;
+    }
+    bool CanWrite() { return (state == TCPStateEstablished || state == TCPStateCloseWait) && m_outboundData.Space(); }
 
     void Close();
 
   protected:
     bool m_fileClosed = false;
-    bool m_noDelay = false;   // Disable 'Nagle's algorithm', we don't actualy implement this yet
+
+    TCPSocket* m_listener = nullptr; // Listen socket a connection still in the handshake counts against
+    unsigned m_halfOpen = 0;         // Connections in the handshake, the listen socket is not freed whilst any are
+    bool m_noDelay = false;   // Disable Nagle's algorithm, small writes are sent even when data is in flight
     bool m_keepAlive = false; // We haven't implmented this yet
 
-    friend void OnReceiveTCP(IPv4Header& ipHeader, void* data, size_t length);
+    friend void OnReceiveTCP(IPv4Header& ipHeader, NetBuffer* buffer);
+
+    void OnReceive(const IPv4Address& source, const IPv4Address& dest, NetBuffer* buffer);
 
-    void OnReceive(const IPv4Address& source, const IPv4Address& dest, uint8_t* data, size_t length);
+    // Passive open, create a socket for the connection and answer the SYN with a SYN-ACK
+    void OnConnectionRequest(const IPv4Address& source, const IPv4Address& dest, TCPHeader* header);
+    // Queue a connection which has completed the handshake for Accept, false if it was refused
+    bool QueueConnection(TCPSocket* sock);
+    // Stop counting this connection against the listen socket's backlog once it leaves SYN-RECEIVED
+    void ReleaseListener();
+    void Disconnect(); // Start closing the connection once nothing has a handle to the socket
+
+    // Fill in the header and options of a segment, returns the length of the header including options.
+    // Expects m_lock to be held.
+    size_t BuildHeader(uint8_t* buffer, uint32_t sequence, uint16_t flags);
+    // Checksum and send a segment built with BuildHeader, takes ownership of the buffer.
+    // Must not be called with m_lock held.
+    int SendSegment(NetBuffer* buffer);
 
     int Synchronize(uint32_t seqNumber); // TCP SYN (Establish a connection to the server)
-    int Acknowledge(uint32_t ackNumber); // TCP ACK (Acknowledge connection)
+    int Acknowledge();                   // TCP ACK (Acknowledge everything received so far)
     int SynchronizeAcknowledge(
         uint32_t seqNumber,
         uint32_t ackNumber); // TCP SYN-ACK (Establish connection to client and acknowledge the connection)
-    int Finish();            // TCP FIN (Last packet from sender)
-    int FinishAcknowledge(uint32_t ackNumber); // TCP FIN-ACK (Last packet from sender, acknowledge)
-    int Reset();                               // TCP RST (Abort connection)
+    int Reset();             // TCP RST (Abort connection)
+
+    // Send whatever the congestion and peer windows allow from the send buffer,
+    // followed by our FIN once it has been queued and any ACK that is due
+    void Output();
+
+    void ParseOptions(TCPHeader* header, bool syn);
+    // Returns true if a writer was waiting for the data acknowledged to leave the send buffer
+    bool ProcessAcknowledgement(TCPHeader* header, size_t dataLength);
+    // Returns true if any data was added to the receive buffer, buffer holds the segment's data
+    bool ReceiveData(uint32_t sequence, NetBuffer* buffer, bool fin);
+    void UpdateRoundTripTime(long sample);
+
+    void AddSACKBlock(uint32_t start, uint32_t end); // Merge a SACK block into the scoreboard
+    uint32_t Pipe();                                 // Estimate of the bytes still in the network (RFC 6675)
+    // Find the next hole below the SACKed data which has not been retransmitted in this recovery
+    bool NextHole(uint32_t& sequence, uint32_t& length, uint32_t maxLength);
+
+    void EnterTimeWait();
+    void Abort(int error); // Drop the connection, expects m_lock to be held
+    bool ShouldFree();     // Whether the file has been closed and the connection is gone, expects m_lock to be held
+    void Free();
+
+    void OnRetransmitTimeout();
+    void OnDelayedAckTimeout();
+    void OnTimeWaitTimeout();
 
     unsigned short AllocatePort();
     int AcquirePort(uint16_t port);
     int ReleasePort();
 
-    struct TCPPacket {
-        TCPHeader header;
-        uint32_t sequenceNumber;
+    // Segment received ahead of RCV.NXT, waiting for the gap before it to be filled.
+    // Holds a reference to the buffer it arrived in rather than a copy of the data.
+    struct TCPSegment {
+        TCPSegment* next;
+        uint32_t sequence;
         uint32_t length;
-        uint8_t* data;
+        bool fin;
+        NetBuffer* buffer;
+    };
+
+    struct SequenceRange {
+        uint32_t start;
+        uint32_t end; // Sequence number after the last byte
     };
 
     // As per RFC 793
@@ -329,18 +469,82 @@ class TCPSocket final : public IPSocket {
         TCPStateFinWait1,    // Waiting for an ACK or FIN-ACK after our FIN
         TCPStateFinWait2,    // Waiting for the peer to send FIN
         TCPStateCloseWait,   // Waiting for the last process to close the socket
+        TCPStateClosing,     // Both ends sent FIN at the same time, waiting for the ACK of ours
         TCPStateLastAck,     // Waiting for a final ACK after our FIN
         TCPStateTimeWait,    // Waiting to ensure that the peer recieved its ACK
     };
 
     State state = TCPStateUnknown;
-    uint32_t m_sequenceNumber;
-    uint32_t m_lastAcknowledged; // Last acknowledged sequence number
-
-    uint32_t m_remoteSequenceNumber; // Sequence number of the remote endpoint
-
-    lock_t m_unacknowledgedPacketsLock = 0;
-    List<TCPPacket> m_unacknowledgedPackets; // Unacknowledged outbound packets
-    DataStream m_inboundData = DataStream(512);
+    int m_error = 0; // Set when the connection is reset or times out
+    unsigned m_backlog = CONNECTION_BACKLOG; // Most connections waiting to be accepted
+
+    lock_t m_lock = 0; // Protects the sequence, window and congestion state below
+
+    // Send sequence space. The send buffer holds everything from SND.UNA onwards,
+    // including data which has not been sent yet.
+    uint32_t m_sequenceNumber;   // SND.NXT, next sequence number to send
+    uint32_t m_lastAcknowledged; // SND.UNA, last acknowledged sequence number
+    uint32_t m_highestSent;      // SND.MAX, lower than SND.NXT after a timeout until the data is sent again
+    uint32_t m_windowUpdateSequence = 0; // SND.WL1 and SND.WL2, the segment last used to update the send window
+    uint32_t m_windowUpdateAck = 0;
+    uint32_t m_sendWindow = 0; // Receive window of the peer (scaled)
+    uint16_t m_maxSegmentSize = TCP_DEFAULT_MSS; // Largest payload the peer accepts
+
+    bool m_windowScaling = false; // Both ends sent the window scale option
+    uint8_t m_sendWindowShift = 0;
+    uint8_t m_receiveWindowShift = 0;
+    bool m_sackPermitted = false;
+
+    bool m_finQueued = false; // Our FIN goes out after the send buffer
+    bool m_finAcknowledged = false;
+    bool m_finReceived = false;
+    bool m_writerWaiting = false;
+
+    // Congestion control (NewReno, RFC 5681 and RFC 6582, using SACK information when we have it)
+    uint32_t m_congestionWindow = 0;
+    uint32_t m_slowStartThreshold = UINT32_MAX;
+    uint32_t m_bytesAcked = 0; // Counted towards the next congestion window increase in congestion avoidance
+    uint32_t m_recover = 0;    // SND.MAX when fast recovery was entered
+    uint32_t m_retransmitNext = 0; // Where to look for the next hole to retransmit in fast recovery
+    unsigned m_duplicateAcks = 0;
+    bool m_fastRecovery = false;
+    bool m_retransmitNow = false; // Retransmit the segment at SND.UNA regardless of the congestion window
+    bool m_probeWindow = false;   // Send a byte into a zero window
+
+    // Ranges above SND.UNA the peer has told us it has, sorted by sequence number
+    SequenceRange m_sacked[TCP_SACK_SCOREBOARD_SIZE];
+    unsigned m_sackedCount = 0;
+
+    // Round trip time estimation (RFC 6298), in microseconds
+    long m_smoothedRTT = 0; // 0 until the first sample
+    long m_rttVariance = 0;
+    long m_retransmitTimeout = TCP_RTO_INITIAL;
+    unsigned m_retransmits = 0; // Consecutive retransmission timeouts
+    bool m_rttTiming = false;   // A segment is being timed, never a retransmitted one (Karn's algorithm)
+    uint32_t m_timedSequence = 0;
+    uint64_t m_timedSince = 0;
+
+    // Receive sequence space
+    uint32_t m_remoteSequenceNumber; // RCV.NXT, sequence number of the remote endpoint
+    uint32_t m_advertisedEdge = 0;   // RCV.NXT + RCV.WND when we last sent a window
+    unsigned m_unacknowledgedSegments = 0; // Segments received since we last sent an ACK
+    bool m_ackNow = false;                 // Output should send an ACK even with no data
+
+    TCPSegment* m_outOfOrder = nullptr; // Sorted by sequence number
+    size_t m_outOfOrderBytes = 0;       // Counted in whole buffers, so tiny segments cannot pin down the pool
+    uint32_t m_lastOutOfOrder = 0; // Sequence number of the latest segment received out of order, reported first in SACKs
+
+    TCPTimer m_retransmitTimer = TCPTimer(this, &TCPSocket::OnRetransmitTimeout);
+    TCPTimer m_delayedAckTimer = TCPTimer(this, &TCPSocket::OnDelayedAckTimeout);
+    TCPTimer m_timeWaitTimer = TCPTimer(this, &TCPSocket::OnTimeWaitTimeout);
+
+    DataStream m_outboundData = DataStream(TCP_SEND_BUFFER_SIZE);
+    DataStream m_inboundData = DataStream(TCP_RECEIVE_BUFFER_SIZE);
+
+    // Free space in the receive buffer advertised to the peer, scaled once window scaling is in use
+    ALWAYS_INLINE uint16_t ReceiveWindow() const {
+        size_t window = m_inboundData.Space() >> m_receiveWindowShift;
+        return (window > UINT16_MAX) ? UINT16_MAX : window;
+    }
 };
 } // namespace Network::TCP
@@ -8,12 +8,53 @@
 #include <Lock.h>
 #include <RingBuffer.h>
 
+#include <MM/VMObject.h>
 #include <Objects/KObject.h>
 
+#include <ABI/IPC.h>
+
+class Process;
+
 struct MessageEndpointInfo{
     uint16_t msgSize;
 };
 
+/////////////////////////////
+/// \brief Memory shared by the rings of an endpoint pair
+///
+/// Mapped into the kernel so that messages sent through the syscalls can go through the rings too
+/////////////////////////////
+class EndpointRingVMObject final : public VMObject{
+public:
+    EndpointRingVMObject(uint16_t msgSize);
+    ~EndpointRingVMObject();
+
+    void MapAllocatedBlocks(uintptr_t base, PageMap* pMap) override;
+    [[noreturn]] VMObject* Clone() override;
+
+    ALWAYS_INLINE bool CanMunmap() const override { return true; }
+
+    ALWAYS_INLINE lemon_endpoint_ring_t* Ring(int index){
+        return reinterpret_cast<lemon_endpoint_ring_t*>(mapping + index * LEMON_ENDPOINT_RING_HEADER_SIZE);
+    }
+
+    ALWAYS_INLINE lemon_endpoint_ring_slot_t* Slot(int index, uint64_t n){
+        return reinterpret_cast<lemon_endpoint_ring_slot_t*>(mapping + DataOffset(index) + (n & (slotCount - 1)) * slotSize);
+    }
+
+    ALWAYS_INLINE uint64_t DataOffset(int index) const { return PAGE_SIZE_4K + index * ringSize; }
+    ALWAYS_INLINE uint32_t SlotCount() const { return slotCount; }
+    ALWAYS_INLINE uint32_t SlotSize() const { return slotSize; }
+
+private:
+    uint8_t* mapping; // Kernel mapping
+    uintptr_t* pages; // Physical address of each page
+
+    uint32_t slotCount;
+    uint32_t slotSize;
+    size_t ringSize; // Size of the slots of one ring, page aligned
+};
+
 class MessageEndpoint final : public KernelObject{
     DECLARE_KOBJECT(MessageEndpoint);
 
@@ -27,6 +68,8 @@ public:
         endpoint1->peer = endpoint2.get();
         endpoint2->peer = endpoint1.get();
 
+        endpoint2->ringIndex = 1;
+
         return {endpoint1, endpoint2};
     }
 
@@ -52,7 +95,8 @@ public:
     /// \brief Send a message and return the response
     ///
     /// Sends a message to the peer and blocks until it receives a reply or the timeout period is expired.
-    /// Useful for RPC
+    /// Useful for RPC. Replies the peer writes straight into our ring are not seen,
+    /// so once the ring is mapped the caller has to wait for the reply itself.
     ///
     /// \param id ID of the message to be sent
     /// \param size Size of the message to be sent
@@ -81,9 +125,38 @@ public:
     /////////////////////////////
     int64_t Write(uint64_t id, uint16_t size, uint64_t data);
 
+    /////////////////////////////
+    /// \brief Map the rings shared with the peer
+    ///
+    /// Maps the rings into the address space of the process, creating them if the peer has not already.
+    /// Once mapped we read messages from the ring, including those sent by a peer using Write.
+    ///
+    /// \param proc Process to map the rings into
+    /// \param info Ring information to be populated
+    ///
+    /// \return 0 on success, negative error code on failure
+    /////////////////////////////
+    int64_t MapRing(Process* proc, lemon_endpoint_ring_info_t& info);
+
+    /////////////////////////////
+    /// \brief Unmap the rings from a process
+    ///
+    /// Called when the process closes its handle to the endpoint
+    /////////////////////////////
+    void UnmapRing(Process* proc);
+
+    /////////////////////////////
+    /// \brief Wake anything waiting on the peer
+    ///
+    /// Used by a process writing to the ring when the ring was empty
+    ///
+    /// \return 0 on success, negative error code on failure
+    /////////////////////////////
+    int64_t Notify();
+
     void Watch(KernelObjectWatcher& watcher, int events) override {
         acquireLock(&waitingLock);
-        if(queue.Empty()){
+        if(queue.Empty() && !RingHasMessages()){
             waiting.add_back(&watcher);
         } else {
             watcher.Signal();
@@ -98,24 +171,38 @@ public:
     inline uint16_t GetMaxMessageSize() const { return maxMessageSize; }
 
 private:
-    struct Response{
-        uint64_t id;
-        uint16_t* size;
-        uint8_t** buffer;
-    };
-
     struct Message{
         uint64_t id;
         uint16_t size;
         uint8_t data[];
     };
 
+    struct Response{
+        uint64_t id;
+        Message* message; // Allocated by the caller, so replies need no allocation
+    };
+
     inline Message* AllocateMessage(){
         void* m = kmalloc(sizeof(Message) + maxMessageSize);
 
         return reinterpret_cast<Message*>(m);
     }
 
+    ALWAYS_INLINE bool RingHasMessages(){
+        if(!__atomic_load_n(&ringAttached, __ATOMIC_ACQUIRE)){
+            return false;
+        }
+
+        lemon_endpoint_ring_t* r = ring->Ring(ringIndex);
+        return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    }
+
+    int64_t ReadRing(uint64_t* id, uint16_t* size, uint8_t* data);
+    int64_t WriteRing(uint64_t id, uint16_t size, uint64_t data);
+
+    // Wakes anything waiting on the endpoint
+    void SignalWaiting();
+
     friend Pair<FancyRefPtr<MessageEndpoint>,FancyRefPtr<MessageEndpoint>> CreatePair();
     uint16_t maxMessageSize = 8;
     uint16_t messageQueueLimit = 128;
@@ -128,9 +215,17 @@ private:
 
     MessageEndpoint* peer;
 
+    FancyRefPtr<EndpointRingVMObject> ring = nullptr; // Shared with the peer
+    int ringIndex = 0; // The ring we read from, the peer reads from the other
+    bool ringAttached = false; // Messages for us are written to the ring
+
+    // Where the ring was last mapped into a process, most likely the one holding the endpoint
+    uintptr_t ringMappingBase = 0;
+
     List<KernelObjectWatcher*> waiting;
     List<Pair<Semaphore*, Response>> waitingResponse;
 
     lock_t waitingLock = 0;
     lock_t waitingResponseLock = 0;
+    lock_t ringMappingLock = 0;
 };
\ No newline at end of file
@@ -35,7 +35,7 @@ public:
 
     static FancyRefPtr<Process> CreateIdleProcess(const char* name);
     static FancyRefPtr<Process> CreateKernelProcess(void* entry, const char* name, Process* parent);
-    static FancyRefPtr<Process> CreateELFProcess(void* elf, const Vector<String>& argv, const Vector<String>& envp,
+    static FancyRefPtr<Process> CreateELFProcess(FsNode* node, const Vector<String>& argv, const Vector<String>& envp,
                                                  const char* execPath, Process* parent);
     ALWAYS_INLINE static Process* Current() {
         return Thread::Current()->parent;
@@ -82,9 +82,19 @@ public:
     /// Clones this process and forks the AddressSpace
     /// with copy-on-write (COW)
     ///
+    /// \param borrowAddressSpace Share our AddressSpace with the child instead of forking it (vfork).
+    /// The child must exec or exit before the AddressSpace is used by the parent again.
+    ///
     /// \return Pointer to new process
     /////////////////////////////
-    FancyRefPtr<Process> Fork();
+    FancyRefPtr<Process> Fork(bool borrowAddressSpace = false);
+
+    /////////////////////////////
+    /// \brief Wait for a child created with Fork(true) to exec or exit
+    ///
+    /// \return true if interrupted
+    /////////////////////////////
+    ALWAYS_INLINE bool WaitForAddressSpaceRelease() { return m_addressSpaceReleased.Wait(); }
 
     /////////////////////////////
     /// \brief Load ELF into the process' address space
@@ -381,6 +391,8 @@ public:
     FancyRefPtr<UNIXOpenFile> workingDir;
     char workingDirPath[PATH_MAX + 1];
 
+    char executablePath[PATH_MAX + 1] = ""; // Absolute path of the ELF last loaded, for symbolising
+
     // POSIX permissions
     int32_t euid = 0; // Effective UID
     int32_t uid = 0;
@@ -420,6 +432,9 @@ private:
 
     MappedRegion* m_signalTrampoline = nullptr;
 
+    bool m_borrowsAddressSpace = false; // Created by vfork, addressSpace belongs to the parent
+    Semaphore m_addressSpaceReleased = Semaphore(0); // Signalled once the parent can use its AddressSpace again
+
     int m_state = Process_Running;
     bool m_isIdleProcess = false;
 
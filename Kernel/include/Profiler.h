@@ -0,0 +1,29 @@
+#pragma once
+
+#include <ABI/Profiler.h>
+
+#include <stdint.h>
+
+struct RegisterContext;
+
+namespace Profiler {
+
+extern bool enabled;
+extern uint64_t samplePeriodNs;
+
+/////////////////////////////
+/// \brief Sample the thread interrupted by the local timer
+///
+/// Records the instruction pointer and walks the frame pointers of
+/// the kernel stack then the user stack. Must be called with interrupts disabled.
+///
+/// \param r Registers of the interrupted code
+/////////////////////////////
+void Sample(RegisterContext* r);
+
+/////////////////////////////
+/// \brief Create /dev/profiler
+/////////////////////////////
+void Initialize();
+
+} // namespace Profiler
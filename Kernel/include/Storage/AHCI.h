@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <Lock.h>
 #include <Device.h>
+#include <Thread.h>
 
 enum
 {
@@ -310,6 +311,7 @@ typedef struct tagHBA_CMD_TBL
 #define AHCI_CAP_SSC (1 << 14) // Slumber state capable?
 #define AHCI_CAP_PSC (1 << 13) // Partial state capable
 #define AHCI_CAP_SALP (1 << 26) // Supports aggressive link power management
+#define AHCI_CAP_NCS(x) ((((x) >> 8) & 0x1f) + 1) // Number of command slots
 
 #define AHCI_CAP2_NVMHCI (1 << 1) // NVMHCI Present
 #define AHCI_CAP2_BOHC (1 << 0) // BIOS/OS Handoff
@@ -332,12 +334,34 @@ typedef struct tagHBA_CMD_TBL
 #define HBA_PxCMD_ICC 	(0xf << 28)
 #define HBA_PxCMD_ICC_ACTIVE (1 << 28)
 
+#define HBA_PxIS_DHRS (1 << 0) // Device to host register FIS received
+#define HBA_PxIS_PSS (1 << 1) // PIO setup FIS received
+#define HBA_PxIS_DSS (1 << 2) // DMA setup FIS received
+#define HBA_PxIS_SDBS (1 << 3) // Set device bits FIS received, signals NCQ completions
+#define HBA_PxIS_DPS (1 << 5) // Descriptor processed
+#define HBA_PxIS_IFS (1 << 27) // Interface fatal error
+#define HBA_PxIS_HBDS (1 << 28) // Host bus data error
+#define HBA_PxIS_HBFS (1 << 29) // Host bus fatal error
+#define HBA_PxIS_TFES (1 << 30) // Task file error
+#define HBA_PxIS_ERROR (HBA_PxIS_IFS | HBA_PxIS_HBDS | HBA_PxIS_HBFS | HBA_PxIS_TFES)
+#define HBA_PxIE_DEFAULT (HBA_PxIS_DHRS | HBA_PxIS_PSS | HBA_PxIS_DSS | HBA_PxIS_SDBS | HBA_PxIS_ERROR)
+
 #define HBA_PORT_IPM_ACTIVE 1
 
 #define HBA_PxSSTS_DET 0xfULL
 #define HBA_PxSSTS_DET_INIT 1
 #define HBA_PxSSTS_DET_PRESENT 3
 
+#define AHCI_MAX_COMMAND_SLOTS 32
+#define AHCI_MAX_TRANSFER_SIZE (512U * 1024U) // Largest single command
+#define AHCI_MAX_PRDT_ENTRIES (AHCI_MAX_TRANSFER_SIZE / PAGE_SIZE_4K + 1) // An unaligned transfer spans one more page
+#define AHCI_PRD_MAX_BYTES (4U * 1024U * 1024U) // Largest region a single PRDT entry can describe
+#define AHCI_BOUNCE_BUFFER_SIZE (1024U * 1024U) // Used for buffers the HBA cannot access
+
+#define ATA_IDENTIFY_QUEUE_DEPTH 75 // Word 75, bits 0-4 are the maximum queue depth - 1
+#define ATA_IDENTIFY_SATA_CAPABILITIES 76 // Word 76
+#define ATA_SATA_CAP_NCQ (1 << 8) // Supports Native Command Queuing
+
 namespace AHCI{
 	enum AHCIStatus{
 		Uninitialized = 0,
@@ -345,6 +369,29 @@ namespace AHCI{
 		Active = 2,
 	};
 
+	class Port;
+
+	// A command which has been issued to a port,
+	// the thread which issued it blocks until the command completes
+	class AHCIRequest final : public ThreadBlocker {
+		friend class Port;
+	public:
+		int status = 0; // 0 on success, otherwise an error code
+
+		// The command has already been issued to the HBA so the thread cannot stop waiting
+		void Interrupt() {}
+
+		__attribute__((always_inline)) inline bool IsComplete() { return __atomic_load_n(&complete, __ATOMIC_ACQUIRE); }
+	private:
+		// Called by the port when the request gets issued, requests can be reused
+		void Reset();
+		// Called by the port (usually from the interrupt handler) when the command completes
+		void Complete(int status);
+
+		Thread* waiter = nullptr;
+		bool complete = false;
+	};
+
 	class Port : public DiskDevice{
 	public:
 		Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem);
@@ -352,6 +399,12 @@ namespace AHCI{
 		int ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer);
 		int WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer);
 
+		// Complete every finished command and recover from errors, called from the interrupt handler
+		void ProcessCompletions();
+
+		// Wait for completion interrupts instead of polling, called once the port is registered with the controller
+		__attribute__((always_inline)) inline void EnableInterrupts() { polling = false; }
+
         int blocksize = 512;
 		AHCIStatus status = AHCIStatus::Uninitialized;
 	private:
@@ -359,22 +412,52 @@ namespace AHCI{
 		void ReleaseBuffer(int index);
 
 		int FindCmdSlot();
-		int Access(uint64_t lba, uint32_t count, uintptr_t physBuffer, int write);
+		int AllocateSlot();
 		void Identify();
 
+		int Transfer(bool write, uint64_t lba, uint32_t count, uint8_t* buffer);
+		// Transfer whole blocks straight to or from a buffer on the kernel heap
+		int TransferDirect(bool write, uint64_t lba, uint32_t count, uint8_t* buffer);
+		// Transfer through one of the port's buffers, used for partial blocks
+		int TransferBuffered(bool write, uint64_t lba, uint32_t count, uint8_t* buffer);
+
+		///////////////////////////////
+		/// \brief Issue a read or write without waiting for it to complete
+		///
+		/// Blocks if every command slot is in use.
+		///
+		/// \param req Request to complete once the command finishes, must stay alive until then
+		/// \param write Write to the disk if true, otherwise read
+		/// \param lba Block to start at
+		/// \param size Size in bytes, a multiple of the block size and at most AHCI_MAX_TRANSFER_SIZE
+		/// \param buffer Word aligned buffer on the kernel heap
+		///////////////////////////////
+		void Submit(AHCIRequest& req, bool write, uint64_t lba, uint32_t size, uint8_t* buffer);
+
+		// Block until req completes
+		void Wait(AHCIRequest& req);
+
 		hba_port_t* registers;
 
 		hba_cmd_header_t* commandList; // Address Mapping of the Command List
 		hba_fis_t* fis; // Address Mapping of the FIS
 
-		hba_cmd_tbl_t* commandTables[8];
+		hba_cmd_tbl_t* commandTables[AHCI_MAX_COMMAND_SLOTS];
+
+		bool ncq = false; // Use READ/WRITE FPDMA QUEUED, otherwise one command at a time
+		bool polling = true; // No interrupts yet so poll for completions
+		unsigned slotCount = 1; // Amount of command slots used
+
+		lock_t slotLock = 0;
+		AHCIRequest* requests[AHCI_MAX_COMMAND_SLOTS]; // Request of each slot which has been issued
+		uint32_t issuedSlots = 0; // Bitmap of slots given to the HBA, protected by slotLock
+		uint32_t freeSlots = 0; // Bitmap of slots which are not in use
 
 		uint64_t physBuffers[8];
 		void* buffers[8];
 		lock_t bufferLocks[8];
 
 		Semaphore bufferSemaphore = Semaphore(8);
-		Semaphore portLock = Semaphore(1); // Binary semaphore for the AHCI port
 	};
 
 	int Init();
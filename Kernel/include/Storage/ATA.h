@@ -35,6 +35,8 @@
 
 #define ATA_CMD_READ_DMA_EX     0x25
 #define ATA_CMD_WRITE_DMA_EX    0x35
+#define ATA_CMD_READ_FPDMA_QUEUED   0x60 // Native Command Queuing
+#define ATA_CMD_WRITE_FPDMA_QUEUED  0x61
 #define ATA_CMD_IDENTIFY        0xec
 
 #define ATA_PRD_BUFFER(x) (x & 0xFFFFFFFF)
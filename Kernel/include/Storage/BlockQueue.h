@@ -0,0 +1,144 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ABI/Disk.h>
+
+#include <Compiler.h>
+#include <List.h>
+#include <Spinlock.h>
+#include <Thread.h>
+
+#define BLOCK_QUEUE_DEFAULT_DEPTH 4
+#define BLOCK_QUEUE_MAX_DEPTH 32
+#define BLOCK_QUEUE_MAX_MERGE_SIZE (1024U * 1024U) // Largest command made by merging requests
+#define BLOCK_QUEUE_READ_DEADLINE 50000 // Microseconds a read may wait before it skips the elevator
+#define BLOCK_QUEUE_WRITE_DEADLINE 500000
+
+class DiskDevice;
+class BlockQueue;
+
+/////////////////////////////
+/// \brief Read or write of a range of blocks
+///
+/// Either set a callback or call BlockQueue::Wait once the request has been submitted.
+/// The queue does not touch the request after calling the callback, so the callback may free it.
+/////////////////////////////
+class BlockRequest final : public ThreadBlocker {
+    friend class BlockQueue;
+
+public:
+    using Callback = void (*)(BlockRequest* req, void* data);
+
+    BlockRequest() = default;
+    BlockRequest(bool write, uint64_t lba, uint32_t size, uint8_t* buffer, Callback callback = nullptr,
+                 void* data = nullptr)
+        : write(write), lba(lba), size(size), buffer(buffer), callback(callback), data(data) {}
+
+    bool write = false;
+    uint64_t lba = 0;
+    uint32_t size = 0; // Size in bytes, only requests of whole blocks get merged
+    uint8_t* buffer = nullptr;
+
+    Callback callback = nullptr;
+    void* data = nullptr;
+
+    int status = 0; // 0 on success, set before the request completes
+
+    // The driver may still be using the buffer so the thread cannot stop waiting
+    void Interrupt() {}
+
+    ALWAYS_INLINE bool IsComplete() { return __atomic_load_n(&complete, __ATOMIC_ACQUIRE); }
+
+private:
+    void Reset();
+    void Complete(int status);
+
+    Thread* waiter = nullptr;
+    bool complete = false;
+
+    uint64_t submitTime = 0;
+    BlockRequest* nextMerged = nullptr; // Next request of the same command
+};
+
+/////////////////////////////
+/// \brief Request queue between filesystems and a disk driver
+///
+/// Requests for adjacent blocks get merged into a single command. Commands are given to the driver
+/// in ascending block order (C-LOOK), unless one has waited past its deadline.
+///
+/// There are no worker threads, whichever thread submits a request dispatches commands
+/// until the queue is empty or queueDepth commands are in flight, so requests from several
+/// threads still reach the driver at the same time.
+/////////////////////////////
+class BlockQueue final {
+public:
+    BlockQueue(DiskDevice* disk);
+    BlockQueue(const BlockQueue&) = delete;
+    BlockQueue& operator=(const BlockQueue&) = delete;
+
+    /////////////////////////////
+    /// \brief Queue requests then dispatch commands until the queue is empty
+    ///
+    /// Submitting all of the requests for a file extent at once gives them the chance to be merged.
+    /////////////////////////////
+    void Submit(BlockRequest** requests, unsigned count);
+    ALWAYS_INLINE void Submit(BlockRequest& request) {
+        BlockRequest* r = &request;
+        Submit(&r, 1);
+    }
+
+    // Block until a request without a callback completes
+    void Wait(BlockRequest& request);
+
+    /////////////////////////////
+    /// \brief Read or write and wait for it to complete
+    ///
+    /// \return 0 on success, otherwise an error code
+    /////////////////////////////
+    int Transfer(bool write, uint64_t lba, uint32_t size, uint8_t* buffer);
+
+    void GetStats(lemon_disk_queue_stats_t& stats);
+    void ResetStats();
+    void SetDepth(unsigned depth);
+
+private:
+    // Requests which become a single command
+    struct Command {
+        Command* next = nullptr;
+        Command* prev = nullptr;
+
+        bool write;
+        uint64_t lba;
+        uint32_t size;
+        uint64_t deadline;
+
+        BlockRequest* first; // Requests in block order
+        BlockRequest* last;
+        unsigned count;
+    };
+
+    // Merge a request into a pending command or queue a new one, expects m_lock to be held
+    void Enqueue(BlockRequest* request);
+    // Pick the command to dispatch next, expects m_lock to be held and the queue not to be empty
+    Command* NextCommand();
+    // Give the command to the driver and complete its requests
+    void Dispatch(Command* command);
+    // Dispatch commands until the queue is empty or enough are in flight
+    void Run();
+
+    // Only requests of whole blocks can be merged
+    bool Mergeable(const BlockRequest* request) const;
+
+    DiskDevice* m_disk;
+
+    lock_t m_lock = 0;
+    FastList<Command*> m_pending; // Sorted by block
+    uint64_t m_head = 0;          // Block following the last command dispatched
+
+    unsigned m_depth = BLOCK_QUEUE_DEFAULT_DEPTH;
+    unsigned m_inFlight = 0;
+
+    lemon_disk_queue_stats_t m_stats;
+};
@@ -5,6 +5,7 @@
 #include <PCI.h>
 #include <Device.h>
 #include <Assert.h>
+#include <Thread.h>
 
 #define NVME_CAP_CMBS (1 << 57) // Controller memory buffer supported
 #define NVME_CAP_PMRS (1 << 56) // Persistent memory region supported
@@ -42,6 +43,11 @@
 
 #define NVME_NSSR_RESET_VALUE 0x4E564D65 // "NVME", initiates a reset
 
+#define NVME_QUEUE_MAX_COMMANDS 32 // Commands in flight per I/O queue
+#define NVME_MAX_PRP_ENTRIES 512 // PRP 1 plus one page of PRP list entries
+#define NVME_MAX_TRANSFER_PAGES (NVME_MAX_PRP_ENTRIES - 1) // An unaligned transfer spans one more page
+#define NVME_BOUNCE_BUFFER_SIZE (1024U * 1024U) // Used for buffers the controller cannot access
+
 namespace NVMe{
 	struct NVMeIdentifyCommand{
 		enum{
@@ -172,6 +178,29 @@ namespace NVMe{
 	};
 	static_assert(sizeof(NVMeCompletion) == 16);
 
+	class NVMeQueue;
+
+	// A command which has been submitted to an I/O queue,
+	// the thread which submitted it blocks until the command completes
+	class NVMeRequest final : public ThreadBlocker {
+		friend class NVMeQueue;
+	public:
+		NVMeCompletion completion;
+
+		// The command has already been given to the controller so the thread cannot stop waiting
+		void Interrupt() {}
+
+		__attribute__((always_inline)) inline bool IsComplete() { return __atomic_load_n(&complete, __ATOMIC_ACQUIRE); }
+	private:
+		// Called by the queue when the request gets submitted, requests can be reused
+		void Reset();
+		// Called by the queue (usually from the interrupt handler) when the command completes
+		void Complete(const NVMeCompletion& c);
+
+		Thread* waiter = nullptr;
+		bool complete = false;
+	};
+
 	class NVMeQueue{
 		uint16_t queueID = 0;
 
@@ -191,13 +220,26 @@ namespace NVMe{
 		uint16_t sqCount = 0; // Amount of elements in SQ
 
 		lock_t queueLock = 0;
+		lock_t completionLock = 0;
 
 		uint16_t nextCommandID = 0;
+
+		// I/O queues only, the command ID of each in flight command is its slot
+		NVMeRequest* requests[NVME_QUEUE_MAX_COMMANDS];
+		uint64_t* prpLists[NVME_QUEUE_MAX_COMMANDS]; // Page of PRP entries for each slot
+		uintptr_t prpListsPhys[NVME_QUEUE_MAX_COMMANDS];
+		uint32_t freeSlots = 0; // Bitmap of slots which are not in use
+		// Counts the free slots, Wait signals it as the interrupt handler cannot
+		Semaphore slotAvailability = Semaphore(0);
+
+		int AllocateSlot();
 	public:
 		bool completionCycleState = true;
 		uint16_t cqHead = 0;
 		uint16_t sqTail = 0;
 
+		uint8_t irq = 0xFF; // Completion interrupt, 0xFF if the queue has to be polled
+
 		///////////////////////////////
 		/// \name NVMeQueue
 		///
@@ -212,11 +254,34 @@ namespace NVMe{
 		NVMeQueue(uint16_t qid, uintptr_t cqBase, uintptr_t sqBase, void* cq, void* sq, uint32_t* cqDB, uint32_t* sqDB, uint16_t csz, uint16_t ssz);
 		NVMeQueue() = default;
 
-		long Consume(NVMeCommand& cmd);
+		// Allocate the PRP lists and slots needed by Submit, only used for I/O queues
+		void InitializeSlots();
 
-		void Submit(NVMeCommand& cmd);
+		// Submit a command and spin until it completes, used for the admin queue
 		void SubmitWait(NVMeCommand& cmd, NVMeCompletion& complet);
 
+		///////////////////////////////
+		/// \brief Submit a command without waiting for it to complete
+		///
+		/// Blocks until a command completes if every slot of the queue is in use.
+		/// Every submitted request must be passed to Wait.
+		///
+		/// \param cmd Command, prp1 and prp2 get filled in
+		/// \param req Request to complete once the command finishes, must stay alive until then
+		/// \param prps Physical address of every page of the transfer, only the first may have an offset
+		/// \param prpCount Amount of PRP entries, at most NVME_MAX_PRP_ENTRIES
+		///
+		/// \return 0 on success, -EINTR if interrupted whilst waiting for a slot
+		///////////////////////////////
+		int Submit(NVMeCommand& cmd, NVMeRequest& req, const uint64_t* prps, unsigned prpCount);
+
+		// Block until req completes, then let Submit reuse its slot
+		void Wait(NVMeRequest& req);
+
+		// Complete every request with a new completion queue entry, called from the interrupt handler
+		void ProcessCompletions();
+
+		__attribute__((always_inline)) uint16_t ID() { return queueID; }
 		__attribute__((always_inline)) uint16_t CQSize() { return cqCount; }
 		__attribute__((always_inline)) uint16_t SQSize() { return sqCount; }
 		__attribute__((always_inline)) uintptr_t CQBase() { return completionBase; }
@@ -262,8 +327,13 @@ namespace NVMe{
 		long IdentifyController();
 		long GetNamespaceList();
 
-		NVMeQueue* AcquireIOQueue();
-		void ReleaseIOQueue(NVMeQueue* queue);
+		// I/O queue of the current CPU
+		NVMeQueue* GetIOQueue();
+
+		// Most blocks a single command can transfer
+		__attribute__((always_inline)) inline uint32_t MaxTransferSize() { return maxTransferSize; }
+
+		void OnInterrupt();
 
 		__attribute__((always_inline)) inline DriverStatus Status(){ return dStatus; }
 	private:
@@ -364,7 +434,8 @@ namespace NVMe{
 		Vector<uint32_t> namespaceIDs;
 		List<Namespace*> namespaces;
 
-		List<NVMeQueue*> ioQueues;
+		Vector<NVMeQueue*> ioQueues;
+		NVMeQueue* cpuQueues[256]; // I/O queue used by each CPU, indexed by local APIC ID
 		uint16_t nextQueueID = 1;
 		NVMeQueue adminQueue;
 
@@ -373,7 +444,8 @@ namespace NVMe{
 		uint16_t completionQueuesAllocated = 1;
 		uint16_t submissionQueuesAllocated = 1;
 
-		Semaphore queueAvailability = Semaphore(0);
+		uint8_t sharedIRQ = 0xFF; // Used by every queue when MSI-X is unavailable
+		uint32_t maxTransferSize = NVME_MAX_TRANSFER_PAGES * PAGE_SIZE_4K; // In bytes
 
 		#pragma region Controller Registers
 		// Capabilities
@@ -446,7 +518,7 @@ namespace NVMe{
 
 		uint16_t AllocateQueueID() { return nextQueueID++; }
 
-		long CreateIOQueue(NVMeQueue* qPtr);
+		long CreateIOQueue(NVMeQueue* qPtr, uint8_t apicID);
 		long SetNumberOfQueues(uint16_t num);
 	};
 
@@ -463,6 +535,12 @@ namespace NVMe{
 		int AcquireBuffer();
 		void ReleaseBuffer(int buffer);
 
+		int Transfer(uint8_t opcode, uint64_t lba, uint32_t count, uint8_t* buffer);
+		// Transfer straight to or from a buffer in the kernel heap, count must be a multiple of the block size
+		int TransferDirect(uint8_t opcode, uint64_t lba, uint32_t count, uint8_t* buffer);
+		// Transfer through the page sized bounce buffers, used for partial blocks
+		int TransferBuffered(uint8_t opcode, uint64_t lba, uint32_t count, uint8_t* buffer);
+
 	public:
 		enum NamespaceStatus{
 			Uninitialized = 0,
@@ -7,7 +7,9 @@
 #include <Lock.h>
 #include <Scheduler.h>
 
-#define DATASTREAM_BUFSIZE_DEFAULT 1024
+#define DATASTREAM_BUFSIZE_DEFAULT 0x10000 // 64 KiB
+#define DATASTREAM_BUFSIZE_MIN 0x1000
+#define DATASTREAM_BUFSIZE_MAX 0x100000 // 1 MiB
 
 typedef struct {
     uint8_t* data;
@@ -31,25 +33,186 @@ public:
     virtual ~Stream();
 };
 
+/////////////////////////////
+/// \brief Bounded byte stream
+///
+/// Data is kept in a ring buffer with a fixed capacity, which is only allocated on the first write.
+/// Writes never grow the buffer, anything which does not fit is left for the caller to retry once there is space.
+///
+/// Drain and Fill give direct access to the buffer so data can be moved to and from files without
+/// an intermediate copy. There can be at most one reader and one writer whilst either is in use.
+/////////////////////////////
 class DataStream final : public Stream {
     lock_t streamLock = 0;
 
-    size_t bufferSize = 0;
-    size_t bufferPos = 0;
+    size_t bufferSize = 0; // Capacity, always a power of two
+    size_t bufferPos = 0;  // Amount of unread data
+    size_t readPos = 0;    // Offset of the first unread byte in the buffer
+
+    unsigned activeSpans = 0; // Drains and fills in progress, the buffer cannot be resized while they are
 
     uint8_t* buffer = nullptr;
+
+    ALWAYS_INLINE size_t WritePos() const { return (readPos + bufferPos) & (bufferSize - 1); }
+    void AllocateBuffer();
+    size_t CopyOut(void* data, size_t len, size_t offset = 0); // Copy without consuming, expects streamLock to be held
+
 public:
-    DataStream(size_t bufSize);
+    DataStream(size_t bufSize = DATASTREAM_BUFSIZE_DEFAULT);
     ~DataStream();
 
     void Wait();
 
     int64_t Read(void* buffer, size_t len);
     int64_t Peek(void* buffer, size_t len);
+
+    /////////////////////////////
+    /// \brief Copy unread data starting offset bytes past the read position, without consuming it
+    ///
+    /// \return Bytes copied, 0 if offset is past the end of the unread data
+    /////////////////////////////
+    int64_t PeekAt(size_t offset, void* buffer, size_t len);
+
+    /////////////////////////////
+    /// \brief Discard up to len bytes of unread data
+    ///
+    /// \return Bytes discarded
+    /////////////////////////////
+    int64_t Skip(size_t len);
+
+    /////////////////////////////
+    /// \brief Write data to the stream
+    ///
+    /// \return Bytes written, which will be less than len once the buffer is full
+    /////////////////////////////
     int64_t Write(void* buffer, size_t len);
-    
+
     int64_t Pos() { return bufferPos; }
     virtual int64_t Empty();
+
+    ALWAYS_INLINE size_t Capacity() const { return bufferSize; }
+    ALWAYS_INLINE size_t Space() const { return bufferSize - bufferPos; }
+
+    /////////////////////////////
+    /// \brief Change the capacity of the stream
+    ///
+    /// \param size New capacity, rounded up to a power of two
+    ///
+    /// \return New capacity or if negative an error code (-EBUSY if the unread data does not fit)
+    /////////////////////////////
+    int64_t Resize(size_t size);
+
+    /////////////////////////////
+    /// \brief Pass unread data straight from the buffer to consumer
+    ///
+    /// consumer is called with each contiguous run of data (at most twice) and returns
+    /// the amount of bytes it used or a negative error code.
+    ///
+    /// \param len Maximum amount of bytes to pass
+    /// \param consume Whether the data used should be removed from the stream
+    ///
+    /// \return Bytes used, or if negative the error returned by consumer before anything was used
+    /////////////////////////////
+    template <typename F> int64_t Drain(size_t len, F&& consumer, bool consume = true) {
+        acquireLock(&streamLock);
+        if (len > bufferPos) {
+            len = bufferPos;
+        }
+
+        size_t offset = readPos;
+        activeSpans++;
+        releaseLock(&streamLock);
+
+        int64_t used = 0;
+        while (static_cast<size_t>(used) < len) {
+            size_t runLength = len - used;
+            if (runLength > bufferSize - offset) {
+                runLength = bufferSize - offset;
+            }
+
+            int64_t ret = consumer(buffer + offset, runLength);
+            if (ret < 0) {
+                if (!used) {
+                    used = ret;
+                }
+                break;
+            }
+
+            used += ret;
+            offset = (offset + ret) & (bufferSize - 1);
+
+            if (static_cast<size_t>(ret) < runLength) {
+                break;
+            }
+        }
+
+        acquireLock(&streamLock);
+        if (consume && used > 0) {
+            readPos = (readPos + used) & (bufferSize - 1);
+            bufferPos -= used;
+        }
+        activeSpans--;
+        releaseLock(&streamLock);
+
+        return used;
+    }
+
+    /////////////////////////////
+    /// \brief Let producer write straight into the free space of the buffer
+    ///
+    /// producer is called with each contiguous run of free space (at most twice) and returns
+    /// the amount of bytes it wrote or a negative error code. 0 is treated as end of data.
+    ///
+    /// \param len Maximum amount of bytes to write
+    ///
+    /// \return Bytes written, or if negative the error returned by producer before anything was written
+    /////////////////////////////
+    template <typename F> int64_t Fill(size_t len, F&& producer) {
+        acquireLock(&streamLock);
+        if (!buffer) {
+            AllocateBuffer();
+        }
+
+        if (len > bufferSize - bufferPos) {
+            len = bufferSize - bufferPos;
+        }
+
+        size_t offset = WritePos();
+        activeSpans++;
+        releaseLock(&streamLock);
+
+        int64_t written = 0;
+        while (static_cast<size_t>(written) < len) {
+            size_t runLength = len - written;
+            if (runLength > bufferSize - offset) {
+                runLength = bufferSize - offset;
+            }
+
+            int64_t ret = producer(buffer + offset, runLength);
+            if (ret < 0) {
+                if (!written) {
+                    written = ret;
+                }
+                break;
+            }
+
+            written += ret;
+            offset = (offset + ret) & (bufferSize - 1);
+
+            if (static_cast<size_t>(ret) < runLength) {
+                break;
+            }
+        }
+
+        acquireLock(&streamLock);
+        if (written > 0) {
+            bufferPos += written;
+        }
+        activeSpans--;
+        releaseLock(&streamLock);
+
+        return written;
+    }
 };
 
 class PacketStream final : public Stream {
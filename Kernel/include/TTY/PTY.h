@@ -110,6 +110,7 @@ public:
 private:
     int m_id;
 
+    lock_t m_watcherLock = 0; // Held whilst signalling so watchers are never signalled after unwatching
     List<FilesystemWatcher*> m_watchingSlave;
     List<FilesystemWatcher*> m_watchingMaster;
 };
@@ -1,37 +1,79 @@
 #pragma once
 
+#include <Compiler.h>
 #include <Spinlock.h>
-#include <List.h>
+
+#include <stdint.h>
 
 struct RegisterContext;
 
 namespace Timer{
+    class TimerQueue;
+
     using TimerCallback = void(*)(void*);
-    void Handler(void*, RegisterContext* r);
 
     class TimerEvent final {
-        friend void Timer::Handler(void*, RegisterContext* r);
-        friend class ::FastList<TimerEvent*>;
+        friend class TimerQueue;
     protected:
-        long ticks = 0;
+        uint64_t deadline = 0; // Nanoseconds since boot
         bool dispatched = false;
 
         lock_t lock = 0;
 
-        TimerEvent* next = nullptr;
-        TimerEvent* prev = nullptr;
+        TimerQueue* queue = nullptr; // Queue of the CPU the event was created on
+        unsigned heapIndex = 0;
 
         TimerCallback callback;
         void* data = nullptr; // Generic data pointer (Could be used to point to a class, etc.)
 
-        void Dispatch();
     public:
         TimerEvent(long _us, TimerCallback _callback, void* data);
         ~TimerEvent();
 
-        inline long GetTicks() const { return ticks; }
+        inline uint64_t GetDeadline() const { return deadline; }
 
         __attribute__((always_inline)) inline void Lock() { acquireLock(&lock); }
         __attribute__((always_inline)) inline void Unlock() { releaseLock(&lock); }
     };
+
+    /////////////////////////////
+    /// \brief Per-CPU binary min-heap of timer events ordered by deadline
+    ///
+    /// Events are always added to the queue of the CPU they are created on
+    /// so that CPU can program its own timer for the earliest deadline.
+    /// They can be removed from any CPU.
+    /////////////////////////////
+    class TimerQueue final {
+    public:
+        TimerQueue() = default;
+        TimerQueue(const TimerQueue&) = delete;
+        TimerQueue& operator=(const TimerQueue&) = delete;
+
+        void Insert(TimerEvent* event);
+        void Remove(TimerEvent* event);
+
+        /////////////////////////////
+        /// \brief Run the callbacks of all events past their deadline
+        /////////////////////////////
+        void DispatchExpired(uint64_t now);
+
+        /////////////////////////////
+        /// \brief Earliest deadline, UINT64_MAX if there are no events
+        /////////////////////////////
+        ALWAYS_INLINE uint64_t NextDeadline() const { return m_count ? m_heap[0]->deadline : UINT64_MAX; }
+
+        lock_t lock = 0;
+        uint64_t armedDeadline = UINT64_MAX; // When the CPU's timer is set to fire
+        uint64_t nextTick = 0; // When the next scheduler tick is due
+        uint64_t nextSample = 0; // When the profiler should next sample this CPU
+
+    private:
+        void SiftUp(unsigned index);
+        void SiftDown(unsigned index);
+        void Place(TimerEvent* event, unsigned index);
+
+        TimerEvent** m_heap = nullptr;
+        unsigned m_count = 0;
+        unsigned m_capacity = 0;
+    };
 }
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <ABI/Trace.h>
+
+#include <stdint.h>
+
+namespace Trace {
+
+extern bool enabled;
+
+/////////////////////////////
+/// \brief Record an event in the current CPU's trace buffer
+///
+/// Safe to call from interrupt handlers. Use TRACE_EVENT so that
+/// nothing is done whilst tracing is off.
+/////////////////////////////
+void Record(uint16_t type, uint64_t arg0 = 0, uint64_t arg1 = 0, uint64_t arg2 = 0);
+
+/////////////////////////////
+/// \brief Create /dev/trace
+///
+/// Events are only recorded once tracing has been enabled through the device.
+/////////////////////////////
+void Initialize();
+
+} // namespace Trace
+
+#define TRACE_EVENT(type, ...)                                                                                         \
+    ({                                                                                                                 \
+        if (__builtin_expect(__atomic_load_n(&Trace::enabled, __ATOMIC_RELAXED), 0)) {                                 \
+            Trace::Record(type, ##__VA_ARGS__);                                                                        \
+        }                                                                                                              \
+    })
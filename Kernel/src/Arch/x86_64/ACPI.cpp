@@ -26,6 +26,7 @@ acpi_rsdt_t* rsdtHeader;
 acpi_xsdt_t* xsdtHeader;
 acpi_fadt_t* fadt;
 pci_mcfg_table_t* mcfg = nullptr;
+acpi_hpet_t* hpet = nullptr;
 
 char oem[7];
 
@@ -184,6 +185,7 @@ success:
 
     ReadMADT();
     mcfg = reinterpret_cast<pci_mcfg_table_t*>(FindSDT("MCFG", 0)); // Attempt to find MCFG table for PCI
+    hpet = reinterpret_cast<acpi_hpet_t*>(FindSDT("HPET", 0)); // Used to calibrate the TSC and local APIC timer
 
     asm("sti");
 }
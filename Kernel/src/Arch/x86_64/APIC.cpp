@@ -59,9 +59,20 @@ void SendIPI(uint8_t destination, uint32_t dsh /* Destination Shorthand*/, uint3
     uint32_t high = ((uint32_t)destination) << 24;
     uint32_t low = dsh | type | ICR_VECTOR(vector);
 
+    // The scheduler may send IPIs from interrupt handlers, do not get interrupted between writes
+    InterruptDisabler disableInterrupts;
     APIC_WRITE(LOCAL_APIC_ICR_HIGH, high);
     APIC_WRITE(LOCAL_APIC_ICR_LOW, low);
 }
+
+void SetTimerMode(uint8_t vector, uint32_t mode) {
+    APIC_WRITE(LOCAL_APIC_TIMER_DIVIDE, LOCAL_APIC_TIMER_DIVIDE_16);
+    APIC_WRITE(LOCAL_APIC_LVT_TIMER, mode | vector);
+}
+
+void SetTimerInitialCount(uint32_t count) { APIC_WRITE(LOCAL_APIC_TIMER_INITIAL_COUNT, count); }
+
+uint32_t GetTimerCurrentCount() { return APIC_READ(LOCAL_APIC_TIMER_CURRENT_COUNT); }
 } // namespace Local
 
 namespace IO {
@@ -1,7 +1,9 @@
 #include <ELF.h>
 
 #include <CString.h>
+#include <Fs/Filesystem.h>
 #include <Logging.h>
+#include <MM/FileVMObject.h>
 #include <Math.h>
 #include <Paging.h>
 #include <PhysicalAllocator.h>
@@ -19,62 +21,118 @@ int VerifyELF(void* elf) {
         return 1;
 }
 
-elf_info_t LoadELFSegments(Process* proc, void* _elf, uintptr_t base) {
-    uint8_t* elf = reinterpret_cast<uint8_t*>(_elf);
+// Map a PT_LOAD segment straight out of the page cache of the file.
+// Pages of read only segments are shared by every process running the file,
+// writable segments get private copies of the pages written to.
+// Returns 0 on success or a negative error code.
+static int MapSegment(Process* proc, const FancyRefPtr<UNIXOpenFile>& file, const elf64_program_header_t& elfPHdr,
+                       uintptr_t base) {
+    assert(base + elfPHdr.vaddr);
+
+    if (elfPHdr.fileSize > elfPHdr.memSize) {
+        Log::Warning("ELF segment file size (%u) is larger than its memory size (%u)", elfPHdr.fileSize,
+                     elfPHdr.memSize);
+        return -ENOEXEC;
+    }
+
+    uintptr_t pageOffset = elfPHdr.vaddr & (PAGE_SIZE_4K - 1);
+    uintptr_t mapBase = (base + elfPHdr.vaddr) & ~static_cast<uintptr_t>(PAGE_SIZE_4K - 1);
+    size_t mapSize = (elfPHdr.memSize + pageOffset + PAGE_SIZE_4K - 1) & ~static_cast<uintptr_t>(PAGE_SIZE_4K - 1);
+
+    if ((elfPHdr.offset & (PAGE_SIZE_4K - 1)) == pageOffset) {
+        // Anything past the file data of the segment (e.g. .bss) gets zero filled
+        size_t fileLength = (elfPHdr.memSize > elfPHdr.fileSize) ? (pageOffset + elfPHdr.fileSize) : SIZE_MAX;
+
+        FancyRefPtr<VMObject> vmo = new FileVMObject(file, elfPHdr.offset - pageOffset, mapSize, false,
+                                                     elfPHdr.flags & PF_W, fileLength);
+        return proc->addressSpace->MapVMO(vmo, mapBase, true) ? 0 : -ENOMEM;
+    }
+
+    // The segment is not aligned in the file the same way as in memory,
+    // so it cannot come from the page cache and has to be copied in
+    proc->usedMemoryBlocks += mapSize >> PAGE_SHIFT_4K;
+    if (!proc->addressSpace->MapVMO(new ProcessImageVMObject(mapBase, mapSize, true), mapBase, true)) {
+        return -ENOMEM;
+    }
+
+    uint8_t* buffer = reinterpret_cast<uint8_t*>(kmalloc(elfPHdr.fileSize));
+    if (!buffer) {
+        Log::Warning("Failed to allocate %u bytes for ELF segment", elfPHdr.fileSize);
+        return -ENOMEM;
+    }
+
+    if (fs::Read(file->node, elfPHdr.offset, elfPHdr.fileSize, buffer) != static_cast<ssize_t>(elfPHdr.fileSize)) {
+        kfree(buffer);
+        return -EIO;
+    }
+
+    uintptr_t pml4Phys = Scheduler::GetCurrentProcess()->GetPageMap()->pml4Phys;
+    asm volatile("cli; mov %%rax, %%cr3" ::"a"(proc->GetPageMap()->pml4Phys) : "memory");
+    memset((void*)(base + elfPHdr.vaddr + elfPHdr.fileSize), 0, (elfPHdr.memSize - elfPHdr.fileSize));
+    memcpy((void*)(base + elfPHdr.vaddr), buffer, elfPHdr.fileSize);
+    asm volatile("mov %%rax, %%cr3; sti" ::"a"(pml4Phys) : "memory");
+
+    kfree(buffer);
+    return 0;
+}
+
+elf_info_t LoadELFSegments(Process* proc, FsNode* node, uintptr_t base) {
     elf_info_t elfInfo;
     memset(&elfInfo, 0, sizeof(elfInfo));
 
-    if (!VerifyELF(elf))
+    elf64_header_t elfHdr;
+    if (fs::Read(node, 0, sizeof(elfHdr), reinterpret_cast<uint8_t*>(&elfHdr)) != sizeof(elfHdr) ||
+        !VerifyELF(&elfHdr) || elfHdr.phEntrySize < sizeof(elf64_program_header_t))
         return elfInfo; // Invalid ELF Header
 
-    elf64_header_t elfHdr = *(elf64_header_t*)elf;
-
-    elfInfo.entry = base + elfHdr.entry;
-    elfInfo.phEntrySize = elfHdr.phEntrySize;
-    elfInfo.phNum = elfHdr.phNum;
+    // The mappings keep the file open
+    auto openFile = fs::Open(node);
+    if (openFile.HasError()) {
+        Log::Error("Failed to open ELF file");
+        return elfInfo;
+    }
+    FancyRefPtr<UNIXOpenFile> file = openFile.Value();
 
-    for (uint16_t i = 0; i < elfHdr.phNum; i++) {
-        elf64_program_header_t elfPHdr = *((elf64_program_header_t*)(elf + elfHdr.phOff + i * elfHdr.phEntrySize));
-
-        if (elfPHdr.memSize == 0 || elfPHdr.type != PT_LOAD)
-            continue;
-
-        assert(base + elfPHdr.vaddr);
-
-        proc->usedMemoryBlocks += (elfPHdr.memSize + (elfPHdr.vaddr & 0xFFF) + 0xFFF) >> 12;
-        if (!proc->addressSpace->MapVMO(new ProcessImageVMObject((base + elfPHdr.vaddr) & ~0xFFFUL,
-                                                                ((elfPHdr.memSize + (elfPHdr.vaddr & 0xFFF) + 0xFFF) &
-                                                                 ~static_cast<uintptr_t>(PAGE_SIZE_4K - 1)),
-                                                                true),
-                                       (elfPHdr.vaddr + base) & ~0xFFFUL, true)) {
-            Log::Error("Failed to map process image memory");
-            memset(&elfInfo, 0, sizeof(elfInfo));
-            return elfInfo;
-        }
+    size_t pHdrSize = elfHdr.phNum * elfHdr.phEntrySize;
+    uint8_t* pHdrs = reinterpret_cast<uint8_t*>(kmalloc(pHdrSize));
+    if (fs::Read(node, elfHdr.phOff, pHdrSize, pHdrs) != static_cast<ssize_t>(pHdrSize)) {
+        kfree(pHdrs);
+        return elfInfo;
     }
 
     char* linkPath = nullptr;
-    uintptr_t pml4Phys = Scheduler::GetCurrentProcess()->GetPageMap()->pml4Phys;
-    for (int i = 0; i < elfHdr.phNum; i++) {
-        elf64_program_header_t elfPHdr = *((elf64_program_header_t*)(elf + elfHdr.phOff + i * elfHdr.phEntrySize));
-
-        assert(elfPHdr.fileSize <= elfPHdr.memSize);
+    for (uint16_t i = 0; i < elfHdr.phNum; i++) {
+        elf64_program_header_t elfPHdr = *((elf64_program_header_t*)(pHdrs + i * elfHdr.phEntrySize));
 
         if (elfPHdr.type == PT_LOAD && elfPHdr.memSize > 0) {
-            asm volatile("cli; mov %%rax, %%cr3" ::"a"(proc->GetPageMap()->pml4Phys) : "memory");
-            memset((void*)(base + elfPHdr.vaddr + elfPHdr.fileSize), 0, (elfPHdr.memSize - elfPHdr.fileSize));
-            memcpy((void*)(base + elfPHdr.vaddr), (void*)(elf + elfPHdr.offset), elfPHdr.fileSize);
-            asm volatile("mov %%rax, %%cr3; sti" ::"a"(pml4Phys) : "memory");
+            if (int e = MapSegment(proc, file, elfPHdr, base); e) {
+                Log::Error("Failed to map process image memory (error %d)", e);
+
+                if (linkPath) {
+                    kfree(linkPath);
+                }
+                kfree(pHdrs);
+
+                memset(&elfInfo, 0, sizeof(elfInfo));
+                elfInfo.error = e;
+                return elfInfo;
+            }
         } else if (elfPHdr.type == PT_PHDR) {
             elfInfo.pHdrSegment = base + elfPHdr.vaddr;
-        } else if (elfPHdr.type == PT_INTERP) {
+        } else if (elfPHdr.type == PT_INTERP && !linkPath) {
             linkPath = (char*)kmalloc(elfPHdr.fileSize + 1);
-            strncpy(linkPath, (char*)(elf + elfPHdr.offset), elfPHdr.fileSize);
-            linkPath[elfPHdr.fileSize] = 0; // Null terminate the path
+
+            ssize_t read = fs::Read(node, elfPHdr.offset, elfPHdr.fileSize, (uint8_t*)linkPath);
+            linkPath[read > 0 ? read : 0] = 0; // Null terminate the path
 
             elfInfo.linkerPath = linkPath;
         }
     }
 
+    kfree(pHdrs);
+
+    elfInfo.entry = base + elfHdr.entry;
+    elfInfo.phEntrySize = elfHdr.phEntrySize;
+    elfInfo.phNum = elfHdr.phNum;
     return elfInfo;
-}
\ No newline at end of file
+}
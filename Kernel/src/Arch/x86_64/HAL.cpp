@@ -102,6 +102,8 @@ void InitExtra() {
     APIC::Initialize();
     Log::Write("OK");
 
+    Timer::InitializeLocalTimers();
+
     Log::Info("Initializing SMP...");
     SMP::Initialize();
     Log::Write("OK");
@@ -9,6 +9,7 @@
 #include <Scheduler.h>
 #include <StackTrace.h>
 #include <Syscalls.h>
+#include <Trace.h>
 
 idt_entry_t idt[256];
 
@@ -280,8 +281,10 @@ extern "C" void isr_handler(int intNum, RegisterContext* regs) {
     }
 }
 
+// The handler may switch threads and never return, so an IRQ is not always followed by an exit event
 extern "C" void irq_handler(int int_num, RegisterContext* regs) {
     LocalAPICEOI();
+    TRACE_EVENT(TraceEventIRQEntry, int_num);
 
     if (__builtin_expect(interruptHandlers[int_num].handler != 0, 1)) {
         ISRDataPair pair = interruptHandlers[int_num];
@@ -290,10 +293,13 @@ extern "C" void irq_handler(int int_num, RegisterContext* regs) {
         Log::Warning("Unhandled IRQ: ");
         Log::Write(int_num);
     }
+
+    TRACE_EVENT(TraceEventIRQExit, int_num);
 }
 
 extern "C" void ipi_handler(int int_num, RegisterContext* regs) {
     LocalAPICEOI();
+    TRACE_EVENT(TraceEventIRQEntry, int_num);
 
     if (__builtin_expect(interruptHandlers[int_num].handler != 0, 1)) {
         ISRDataPair pair = interruptHandlers[int_num];
@@ -302,4 +308,6 @@ extern "C" void ipi_handler(int int_num, RegisterContext* regs) {
         Log::Warning("Unhandled IPI: ");
         Log::Write(int_num);
     }
+
+    TRACE_EVENT(TraceEventIRQExit, int_num);
 }
\ No newline at end of file
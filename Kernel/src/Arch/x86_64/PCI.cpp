@@ -6,6 +6,7 @@
 #include <IDT.h>
 #include <IOPorts.h>
 #include <Logging.h>
+#include <Paging.h>
 #include <Vector.h>
 
 namespace PCI {
@@ -245,8 +246,8 @@ PCIDevice::PCIDevice(uint8_t _bus, uint8_t _slot, uint8_t _func) : bus(_bus), sl
     capabilities = new Vector<uint16_t>();
     if (Status() & PCI_STATUS_CAPABILITIES) {
         uint8_t ptr = PCI::ConfigReadWord(bus, slot, func, PCICapabilitiesPointer) & 0xFC;
-        uint16_t cap = PCI::ConfigReadDword(bus, slot, func, ptr);
-        do {
+        while (ptr) {
+            uint32_t cap = PCI::ConfigReadDword(bus, slot, func, ptr);
             if ((cap & 0xFF) == PCICapabilityIDs::PCICapMSI) {
                 msiPtr = ptr;
                 msiCapable = true;
@@ -259,13 +260,15 @@ PCIDevice::PCIDevice(uint8_t _bus, uint8_t _slot, uint8_t _func) : bus(_bus), sl
                 }
 
                 msiCap.register4 = PCI::ConfigReadDword(bus, slot, func, ptr + sizeof(uint32_t) * 3);
+            } else if ((cap & 0xFF) == PCICapabilityIDs::PCICapMSIX) {
+                msixPtr = ptr;
+                msixCapable = true;
+                msixTableSize = PCI_CAP_MSIX_CONTROL_TABLE_SIZE(cap >> 16);
             }
 
-            ptr = (cap >> 8);
-            cap = PCI::ConfigReadDword(bus, slot, func, ptr);
-
             capabilities->add_back(cap & 0xFF);
-        } while ((cap >> 8));
+            ptr = (cap >> 8) & 0xFC;
+        }
     }
 }
 
@@ -319,4 +322,48 @@ uint8_t PCIDevice::AllocateVector(PCIVectors type) {
 
     Log::Error("[PCIDevice] AllocateVector: Could not allocate interrupt (type %i)!", static_cast<int>(type));
     return 0xFF;
-}
\ No newline at end of file
+}
+
+uint8_t PCIDevice::AllocateMSIXVector(uint16_t entry, uint8_t apicID) {
+    if (!msixCapable || entry >= msixTableSize) {
+        Log::Error("[PCIDevice] AllocateMSIXVector: Invalid MSI-X entry %u (table size %u)!", entry, msixTableSize);
+        return 0xFF;
+    }
+
+    if (!msixTable) {
+        uint32_t tableInfo = PCI::ConfigReadDword(bus, slot, func, msixPtr + sizeof(uint32_t));
+
+        uintptr_t tableBase = GetBaseAddressRegister(PCI_CAP_MSIX_TABLE_BIR(tableInfo)) +
+                              PCI_CAP_MSIX_TABLE_OFFSET(tableInfo);
+        size_t pageCount = PAGE_COUNT_4K((tableBase & (PAGE_SIZE_4K - 1)) + msixTableSize * sizeof(PCIMSIXTableEntry));
+
+        uintptr_t virt = reinterpret_cast<uintptr_t>(Memory::KernelAllocate4KPages(pageCount));
+        Memory::KernelMapVirtualMemory4K(tableBase & ~static_cast<uintptr_t>(PAGE_SIZE_4K - 1), virt, pageCount,
+                                         PAGE_PRESENT | PAGE_WRITABLE | PAGE_CACHE_DISABLED | PAGE_WRITETHROUGH);
+
+        msixTable = reinterpret_cast<volatile PCIMSIXTableEntry*>(virt + (tableBase & (PAGE_SIZE_4K - 1)));
+
+        // Mask everything until it has been given a vector
+        for (unsigned i = 0; i < msixTableSize; i++) {
+            msixTable[i].vectorControl = msixTable[i].vectorControl | PCI_MSIX_VECTOR_MASKED;
+        }
+
+        uint16_t control = PCI::ConfigReadWord(bus, slot, func, msixPtr + 2);
+        control = (control | PCI_CAP_MSIX_CONTROL_ENABLE) & ~PCI_CAP_MSIX_CONTROL_FUNCTION_MASK;
+        PCI::ConfigWriteWord(bus, slot, func, msixPtr + 2, control);
+    }
+
+    uint8_t interrupt = IDT::ReserveUnusedInterrupt();
+    if (interrupt == 0xFF) {
+        Log::Error("[PCIDevice] AllocateMSIXVector: Could not reserve unused interrupt (no free interrupts?)!");
+        return interrupt;
+    }
+
+    volatile PCIMSIXTableEntry& tableEntry = msixTable[entry];
+    tableEntry.addressLow = PCI_CAP_MSI_ADDRESS_BASE | (static_cast<uint32_t>(apicID) << 12);
+    tableEntry.addressHigh = 0;
+    tableEntry.data = ICR_VECTOR(interrupt) | ICR_MESSAGE_TYPE_FIXED;
+    tableEntry.vectorControl = tableEntry.vectorControl & ~PCI_MSIX_VECTOR_MASKED;
+
+    return interrupt;
+}
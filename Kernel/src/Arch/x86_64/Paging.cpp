@@ -4,12 +4,14 @@
 #include <IDT.h>
 #include <Logging.h>
 #include <Memory.h>
+#include <OnCleanup.h>
 #include <Paging.h>
 #include <Panic.h>
 #include <PhysicalAllocator.h>
 #include <Scheduler.h>
 #include <StackTrace.h>
 #include <Syscalls.h>
+#include <Trace.h>
 #include <UserPointer.h>
 
 // extern uint32_t kernel_end;
@@ -43,7 +45,7 @@ uint64_t VirtualToPhysicalAddress(uint64_t addr) {
 
     } else { // From Kernel Address Space
         if (kernelHeapDir[pageDirIndex] & 0x80) {
-            address = (GetPageFrame(kernelHeapDir[pageDirIndex])) << 12;
+            address = ((GetPageFrame(kernelHeapDir[pageDirIndex])) << 12) + (addr & (PAGE_SIZE_2M - PAGE_SIZE_4K));
         } else {
             address = (GetPageFrame(kernelHeapDirTables[pageDirIndex][pageTableIndex])) << 12;
         }
@@ -67,7 +69,7 @@ uint64_t VirtualToPhysicalAddress(uint64_t addr, page_map_t* addressSpace) {
             return 0;
     } else { // From Kernel Address Space
         if (kernelHeapDir[pageDirIndex] & 0x80) {
-            address = (GetPageFrame(kernelHeapDir[pageDirIndex])) << 12;
+            address = ((GetPageFrame(kernelHeapDir[pageDirIndex])) << 12) + (addr & (PAGE_SIZE_2M - PAGE_SIZE_4K));
         } else {
             address = (GetPageFrame(kernelHeapDirTables[pageDirIndex][pageTableIndex])) << 12;
         }
@@ -639,6 +641,9 @@ void PageFaultHandler(void*, RegisterContext* regs) {
     uint64_t faultAddress;
     asm volatile("movq %%cr2, %0" : "=r"(faultAddress));
 
+    TRACE_EVENT(TraceEventPageFault, faultAddress, regs->err, regs->rip);
+    OnCleanup traceEnd([faultAddress]() { TRACE_EVENT(TraceEventPageFaultEnd, faultAddress); });
+
     int errorCode = regs->err;
     int present = !(errorCode & 0x1); // Page not present
     int rw = errorCode & 0x2;         // Attempted write to read only page
@@ -713,47 +718,15 @@ void PageFaultHandler(void*, RegisterContext* regs) {
         if (faultRegion &&
             faultRegion->vmObject.get()) { // If there is a corresponding VMO for the fault then this is not an error
             FancyRefPtr<VMObject> vmo = faultRegion->vmObject;
+            asm("sti");
+            int status;
             if (vmo->IsCopyOnWrite() && rw /* Attempted to write to read-only page */) {
-                if (vmo->refCount <= 1) { // Last reference, no need to clone
-                    vmo->copyOnWrite = false;
-                    vmo->MapAllocatedBlocks(
-                        faultRegion->Base(),
-                        addressSpace->GetPageMap()); // This should remap all allocated blocks as writable
-
-                    asm("sti");
-                    vmo->Hit(faultRegion->Base(), faultAddress - faultRegion->Base(),
-                             addressSpace->GetPageMap()); // In case the block was never allocated in the first place
-                    asm("cli");
-
-                    faultRegion->lock.ReleaseRead();
-                    if ((regs->cs & 0x3)) {
-                        releaseLock(&Thread::Current()->kernelLock);
-                    }
-                    return;
-                } else {
-                    asm("sti");
-                    VMObject* clone = vmo->Clone();
-
-                    vmo->refCount--;
-                    faultRegion->vmObject = clone;
-                    asm("cli");
-
-                    clone->MapAllocatedBlocks(faultRegion->Base(), addressSpace->GetPageMap());
-                    clone->Hit(faultRegion->Base(), faultAddress - faultRegion->Base(),
-                               addressSpace->GetPageMap()); // In case the block was never allocated in the first place
-
-                    faultRegion->lock.ReleaseRead();
-
-                    if ((regs->cs & 0x3)) {
-                        releaseLock(&Thread::Current()->kernelLock);
-                    }
-                    return;
-                }
+                // Only the page being written to gets copied
+                status = vmo->CopyOnWriteHit(faultRegion->Base(), faultAddress - faultRegion->Base(),
+                                             addressSpace->GetPageMap());
+            } else {
+                status = vmo->Hit(faultRegion->Base(), faultAddress - faultRegion->Base(), addressSpace->GetPageMap());
             }
-
-            asm("sti");
-            int status = faultRegion->vmObject->Hit(faultRegion->Base(), faultAddress - faultRegion->Base(),
-                                                    addressSpace->GetPageMap());
             faultRegion->lock.ReleaseRead();
 
             if (!status) {
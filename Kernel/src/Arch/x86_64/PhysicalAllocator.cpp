@@ -8,167 +8,582 @@
 #include <Panic.h>
 #include <Serial.h>
 
-namespace Memory {
-uint32_t physicalMemoryBitmap[PHYSALLOC_BITMAP_SIZE_DWORDS];
+#define PHYSALLOC_ZONE_DMA32_END (0x100000000ULL >> PHYSALLOC_BLOCK_SHIFT)
+
+#define PHYSALLOC_MAX_CPUS 256 // Caches are indexed by APIC ID
 
-uint64_t usedPhysicalBlocks = PHYSALLOC_BITMAP_SIZE_DWORDS * 32;
+namespace Memory {
+uint64_t usedPhysicalBlocks = PHYSALLOC_MAX_BLOCKS;
 uint64_t maxPhysicalBlocks = 0;
 
-uint64_t nextChunk = 1;
+constexpr size_t BitmapWords(size_t bits) { return (bits + 63) / 64; }
 
-lock_t allocatorLock = 0;
+// Words used by a FreeBlockBitmap and both of its summary levels
+constexpr size_t SummarisedBitmapWords(size_t bits) {
+    return BitmapWords(bits) + BitmapWords(BitmapWords(bits)) + BitmapWords(BitmapWords(BitmapWords(bits)));
+}
 
-// Initialize the physical page allocator
-void InitializePhysicalAllocator(memory_info_t* mem_info) {
-    memset(physicalMemoryBitmap, 0xFFFFFFFF, PHYSALLOC_BITMAP_SIZE_DWORDS * sizeof(uint32_t));
+constexpr size_t ZoneBitmapWords(size_t blocks) {
+    size_t words = 0;
+    for (unsigned order = 0; order <= PHYSALLOC_MAX_ORDER; order++) {
+        words += SummarisedBitmapWords(blocks >> order);
+    }
+    return words;
+}
 
-    maxPhysicalBlocks = PHYSALLOC_BITMAP_SIZE_DWORDS * 32;
-    usedPhysicalBlocks = maxPhysicalBlocks;
+static_assert(!(PHYSALLOC_ZONE_DMA32_END & ((1 << PHYSALLOC_MAX_ORDER) - 1)), "Zones must be aligned to the largest block size");
+
+// Storage for every zone's bitmaps, the allocator has to work before the kernel heap does
+uint64_t bitmapPool[ZoneBitmapWords(PHYSALLOC_ZONE_DMA32_END) +
+                    ZoneBitmapWords(PHYSALLOC_MAX_BLOCKS - PHYSALLOC_ZONE_DMA32_END)];
+
+/////////////////////////////
+/// \brief Bitmap of free blocks for one order
+///
+/// Each word of the bitmap has a bit in a summary bitmap which is set when the word is non-zero,
+/// which in turn has another summary level. Finding a free block only requires looking at
+/// a handful of words at the top level, rather than scanning every block.
+/////////////////////////////
+class FreeBlockBitmap final {
+public:
+    void Initialize(uint64_t*& pool, size_t bits) {
+        m_bits = bits;
+        m_words = pool;
+        pool += BitmapWords(bits);
+        m_summary = pool;
+        pool += BitmapWords(BitmapWords(bits));
+        m_top = pool;
+        m_topWords = BitmapWords(BitmapWords(BitmapWords(bits)));
+        pool += m_topWords;
+    }
+
+    ALWAYS_INLINE bool Test(size_t index) const {
+        return index < m_bits && (m_words[index >> 6] & (1ULL << (index & 63)));
+    }
+
+    ALWAYS_INLINE void Set(size_t index) {
+        m_words[index >> 6] |= 1ULL << (index & 63);
+        m_summary[index >> 12] |= 1ULL << ((index >> 6) & 63);
+        m_top[index >> 18] |= 1ULL << ((index >> 12) & 63);
+    }
+
+    ALWAYS_INLINE void Clear(size_t index) {
+        if ((m_words[index >> 6] &= ~(1ULL << (index & 63)))) {
+            return;
+        }
+
+        if ((m_summary[index >> 12] &= ~(1ULL << ((index >> 6) & 63)))) {
+            return;
+        }
+
+        m_top[index >> 18] &= ~(1ULL << ((index >> 12) & 63));
+    }
+
+    // Whether any bit in [index, index + count) is set
+    bool AnySet(size_t index, size_t count) const {
+        while (count) {
+            size_t bit = index & 63;
+            size_t n = (64 - bit < count) ? 64 - bit : count;
+            uint64_t mask = (n == 64) ? ~0ULL : ((1ULL << n) - 1) << bit;
+            if (m_words[index >> 6] & mask) {
+                return true;
+            }
+
+            index += n;
+            count -= n;
+        }
+
+        return false;
+    }
+
+    // Returns the index of the first set bit, -1 if there is none
+    long FindFirst() const {
+        for (size_t i = 0; i < m_topWords; i++) {
+            if (m_top[i]) {
+                size_t summaryIndex = i * 64 + __builtin_ctzll(m_top[i]);
+                size_t wordIndex = summaryIndex * 64 + __builtin_ctzll(m_summary[summaryIndex]);
+                return wordIndex * 64 + __builtin_ctzll(m_words[wordIndex]);
+            }
+        }
+
+        return -1;
+    }
+
+private:
+    uint64_t* m_words;
+    uint64_t* m_summary;
+    uint64_t* m_top;
+    size_t m_bits;
+    size_t m_topWords;
+};
+
+/////////////////////////////
+/// \brief Buddy allocator for a range of physical memory
+///
+/// A free run of 2^n blocks is tracked in the order n bitmap.
+/// When a run is freed and its buddy is also free, they are merged into one run of the next order.
+/////////////////////////////
+struct Zone {
+    uint64_t base; // First block in the zone
+    uint64_t end;
+
+    lock_t lock = 0;
+
+    FreeBlockBitmap freeBlocks[PHYSALLOC_ORDER_COUNT]; // Indexed relative to base
+
+    uint64_t totalBlocks = 0;
+    uint64_t freeBlockCount = 0;
+    uint64_t freeLists[PHYSALLOC_ORDER_COUNT] = {0};
+
+    uint64_t allocations = 0;
+    uint64_t failedAllocations = 0;
+};
+
+Zone zones[PhysicalZoneCount];
+
+// Free blocks held by each CPU, only touched by the owning CPU with interrupts disabled
+struct PageCache {
+    unsigned count = 0;
+    uint32_t blocks[PHYSALLOC_CACHE_SIZE];
+
+    uint64_t hits = 0;
+    uint64_t refills = 0;
+    uint64_t drains = 0;
+};
+
+PageCache pageCaches[PHYSALLOC_MAX_CPUS];
+
+ALWAYS_INLINE static Zone& ZoneOf(uint64_t block) {
+    return zones[block >= PHYSALLOC_ZONE_DMA32_END ? PhysicalZoneHigh : PhysicalZoneDMA32];
 }
 
-// Sets a bit in the physical memory bitmap
-__attribute__((always_inline)) inline void SetBit(uint64_t bit) { physicalMemoryBitmap[bit >> 5] |= (1 << (bit & 31)); }
+ALWAYS_INLINE static PageCache& LocalPageCache() {
+    assert(!CheckInterrupts());
 
-// Clears a bit in the physical memory bitmap
-__attribute__((always_inline)) inline void ClearBit(uint64_t bit) {
-    physicalMemoryBitmap[bit >> 5] &= (~(1 << (bit & 31)));
+    uint64_t id = GetCPULocal()->id;
+    assert(id < PHYSALLOC_MAX_CPUS);
+    return pageCaches[id];
 }
 
-// Tests a bit in the physical memory bitmap
-__attribute__((always_inline)) inline bool TestBit(uint64_t bit) {
-    return physicalMemoryBitmap[bit >> 5] & (1 << (bit & 31));
+// Takes a free run of 2^order blocks from the zone, returns 0 if there are none.
+// The zone lock must be held.
+static uint64_t BuddyAllocate(Zone& zone, unsigned order) {
+    for (unsigned o = order; o <= PHYSALLOC_MAX_ORDER; o++) {
+        long index = zone.freeBlocks[o].FindFirst();
+        if (index < 0) {
+            continue;
+        }
+
+        zone.freeBlocks[o].Clear(index);
+        zone.freeLists[o]--;
+
+        // Split the run, keeping the lower half
+        while (o > order) {
+            o--;
+            index <<= 1;
+
+            zone.freeBlocks[o].Set(index + 1);
+            zone.freeLists[o]++;
+        }
+
+        zone.freeBlockCount -= 1ULL << order;
+        zone.allocations++;
+        return zone.base + (static_cast<uint64_t>(index) << order);
+    }
+
+    return 0;
 }
 
-// Finds the first free block in physical memory
-uint64_t GetFirstFreeMemoryBlock() {
-    if (nextChunk == 0) {
-        nextChunk = 1;
+// Returns a run of 2^order blocks to the zone, merging it with its buddies.
+// The zone lock must be held.
+static void BuddyFree(Zone& zone, uint64_t block, unsigned order) {
+    uint64_t index = (block - zone.base) >> order;
+    assert(!zone.freeBlocks[order].Test(index)); // Double free
+
+    zone.freeBlockCount += 1ULL << order;
+
+    while (order < PHYSALLOC_MAX_ORDER) {
+        uint64_t buddy = index ^ 1;
+        if (!zone.freeBlocks[order].Test(buddy)) {
+            break;
+        }
+
+        zone.freeBlocks[order].Clear(buddy);
+        zone.freeLists[order]--;
+
+        index >>= 1;
+        order++;
     }
 
-    for (uint32_t i = nextChunk; i < (maxPhysicalBlocks >> 5); i++) {
-        if (physicalMemoryBitmap[i] != 0xffffffff) // If all 32 bits at the index are used then ignore them
-            for (uint32_t j = 0; j < 32; j++) {    // Test each bit in the dword
-                if (!(physicalMemoryBitmap[i] & (1 << j))) {
-                    nextChunk = i;
+    zone.freeBlocks[order].Set(index);
+    zone.freeLists[order]++;
+}
 
-#ifdef KERNEL_DEBUG
-                    uint64_t value = (i << 5) + j;
-                    assert(value > 0);
+// Frees the parts of a run of 2^order blocks which are not already free, returns the amount of blocks freed.
+// Regions in the firmware memory map can overlap, so boot can mark the same blocks free more than once.
+// The zone lock must be held.
+static uint64_t BuddyFreeUnused(Zone& zone, uint64_t block, unsigned order) {
+    uint64_t relative = block - zone.base;
 
-                    return value; // Make sure we don't return zero
-#else
-                    return (i << 5) + j;
-#endif
-                }
-            }
+    for (unsigned o = order; o <= PHYSALLOC_MAX_ORDER; o++) {
+        if (zone.freeBlocks[o].Test(relative >> o)) {
+            return 0; // Already free as part of a run at least this large
+        }
     }
 
-    for (uint32_t i = 1; i < (maxPhysicalBlocks >> 5); i++) { // Retry searching every chunk
-        if (physicalMemoryBitmap[i] != 0xffffffff)            // If all 32 bits at the index are used then ignore them
-            for (uint32_t j = 0; j < 32; j++) {               // Test each bit in the dword
-                if (!(physicalMemoryBitmap[i] & (1 << j))) {
-                    nextChunk = i;
+    bool partlyFree = false;
+    for (unsigned o = 0; o < order && !partlyFree; o++) {
+        partlyFree = zone.freeBlocks[o].AnySet(relative >> o, 1ULL << (order - o));
+    }
 
-#ifdef KERNEL_DEBUG
-                    uint64_t value = (i << 5) + j;
-                    assert(value > 0);
+    if (!partlyFree) {
+        BuddyFree(zone, block, order);
+        return 1ULL << order;
+    }
 
-                    return value; // Make sure we don't return zero
-#else
-                    return (i << 5) + j;
-#endif
-                }
-            }
+    // Only free the halves which are not already free
+    return BuddyFreeUnused(zone, block, order - 1) + BuddyFreeUnused(zone, block + (1ULL << (order - 1)), order - 1);
+}
+
+// Removes a run of 2^order blocks from the free lists, splitting any free run containing it.
+// Returns the amount of blocks which were free.
+static uint64_t BuddyClaim(Zone& zone, uint64_t block, unsigned order) {
+    uint64_t relative = block - zone.base;
+
+    for (unsigned o = order; o <= PHYSALLOC_MAX_ORDER; o++) {
+        uint64_t index = relative >> o;
+        if (!zone.freeBlocks[o].Test(index)) {
+            continue;
+        }
+
+        zone.freeBlocks[o].Clear(index);
+        zone.freeLists[o]--;
+
+        // Free the halves which do not contain the claimed run
+        while (o > order) {
+            o--;
+            index = (relative >> o) ^ 1;
+
+            zone.freeBlocks[o].Set(index);
+            zone.freeLists[o]++;
+        }
+
+        zone.freeBlockCount -= 1ULL << order;
+        return 1ULL << order;
     }
 
-    // The first block is always reserved
-    return 0;
+    if (!order) {
+        return 0; // Already in use
+    }
+
+    // Parts of the run may be free at lower orders
+    return BuddyClaim(zone, block, order - 1) + BuddyClaim(zone, block + (1ULL << (order - 1)), order - 1);
+}
+
+// Calls func for the largest naturally aligned runs covering [start, end)
+template <typename F> ALWAYS_INLINE static void ForEachAlignedRun(uint64_t start, uint64_t end, F func) {
+    while (start < end) {
+        unsigned order = start ? __builtin_ctzll(start) : PHYSALLOC_MAX_ORDER;
+        if (order > PHYSALLOC_MAX_ORDER) {
+            order = PHYSALLOC_MAX_ORDER;
+        }
+
+        while (start + (1ULL << order) > end) {
+            order--;
+        }
+
+        func(start, order);
+        start += 1ULL << order;
+    }
+}
+
+// Initialize the physical page allocator
+void InitializePhysicalAllocator(memory_info_t* mem_info) {
+    zones[PhysicalZoneDMA32].base = 0;
+    zones[PhysicalZoneDMA32].end = PHYSALLOC_ZONE_DMA32_END;
+    zones[PhysicalZoneHigh].base = PHYSALLOC_ZONE_DMA32_END;
+    zones[PhysicalZoneHigh].end = PHYSALLOC_MAX_BLOCKS;
+
+    memset(bitmapPool, 0, sizeof(bitmapPool));
+
+    uint64_t* pool = bitmapPool;
+    for (Zone& zone : zones) {
+        for (unsigned order = 0; order <= PHYSALLOC_MAX_ORDER; order++) {
+            zone.freeBlocks[order].Initialize(pool, (zone.end - zone.base) >> order);
+        }
+    }
+    assert(pool == bitmapPool + sizeof(bitmapPool) / sizeof(uint64_t));
+
+    maxPhysicalBlocks = PHYSALLOC_MAX_BLOCKS;
+    usedPhysicalBlocks = maxPhysicalBlocks;
 }
 
 // Marks a region in physical memory as being used
 void MarkMemoryRegionUsed(uint64_t base, size_t size) {
-    for (uint32_t blocks = (size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE,
-                  align = base / PHYSALLOC_BLOCK_SIZE;
-         blocks > 0; blocks--, usedPhysicalBlocks++)
-        SetBit(align++);
+    uint64_t start = base >> PHYSALLOC_BLOCK_SHIFT;
+    uint64_t end = (base + size + PHYSALLOC_BLOCK_SIZE - 1) >> PHYSALLOC_BLOCK_SHIFT;
+    if (end > PHYSALLOC_MAX_BLOCKS) {
+        end = PHYSALLOC_MAX_BLOCKS;
+    }
+
+    ForEachAlignedRun(start, end, [](uint64_t block, unsigned order) {
+        Zone& zone = ZoneOf(block);
+        ScopedSpinLock<true> lockZone(zone.lock);
+
+        usedPhysicalBlocks += BuddyClaim(zone, block, order);
+    });
 }
 
 // Marks a region in physical memory as being free
 void MarkMemoryRegionFree(uint64_t base, size_t size) {
-    for (uint32_t blocks = (size + (PHYSALLOC_BLOCK_SIZE - 1)) / PHYSALLOC_BLOCK_SIZE,
-                  align = base / PHYSALLOC_BLOCK_SIZE;
-         blocks > 0; blocks--, usedPhysicalBlocks--)
-        ClearBit(align++);
+    // Only hand out blocks which are entirely within the region
+    uint64_t start = (base + PHYSALLOC_BLOCK_SIZE - 1) >> PHYSALLOC_BLOCK_SHIFT;
+    uint64_t end = (base + size) >> PHYSALLOC_BLOCK_SHIFT;
+    if (end > PHYSALLOC_MAX_BLOCKS) {
+        end = PHYSALLOC_MAX_BLOCKS;
+    }
+
+    if (!start) {
+        start = 1; // The first block is always reserved
+    }
+
+    ForEachAlignedRun(start, end, [](uint64_t block, unsigned order) {
+        Zone& zone = ZoneOf(block);
+        ScopedSpinLock<true> lockZone(zone.lock);
+
+        uint64_t freed = BuddyFreeUnused(zone, block, order);
+        zone.totalBlocks += freed;
+        usedPhysicalBlocks -= freed;
+    });
+}
+
+// Moves a batch of blocks from the zones into the cache, lower zones are used first.
+static void RefillCache(PageCache& cache) {
+    cache.refills++;
+
+    for (Zone& zone : zones) {
+        acquireLock(&zone.lock);
+
+        // Prefer one contiguous run so the CPU ends up with neighbouring blocks
+        if (uint64_t run = BuddyAllocate(zone, PHYSALLOC_CACHE_BATCH_ORDER)) {
+            for (int i = PHYSALLOC_CACHE_BATCH - 1; i >= 0; i--) {
+                cache.blocks[cache.count++] = run + i;
+            }
+
+            releaseLock(&zone.lock);
+            return;
+        }
+
+        while (cache.count < PHYSALLOC_CACHE_BATCH) {
+            uint64_t block = BuddyAllocate(zone, 0);
+            if (!block) {
+                break;
+            }
+
+            cache.blocks[cache.count++] = block;
+        }
+
+        releaseLock(&zone.lock);
+
+        if (cache.count >= PHYSALLOC_CACHE_BATCH) {
+            return;
+        }
+    }
+}
+
+// Returns the least recently freed batch of blocks to their zones
+static void DrainCache(PageCache& cache) {
+    cache.drains++;
+
+    Zone* locked = nullptr;
+    for (unsigned i = 0; i < PHYSALLOC_CACHE_BATCH; i++) {
+        Zone& zone = ZoneOf(cache.blocks[i]);
+        if (&zone != locked) {
+            if (locked) {
+                releaseLock(&locked->lock);
+            }
+
+            locked = &zone;
+            acquireLock(&locked->lock);
+        }
+
+        BuddyFree(zone, cache.blocks[i], 0);
+    }
+    releaseLock(&locked->lock);
+
+    cache.count -= PHYSALLOC_CACHE_BATCH;
+    for (unsigned i = 0; i < cache.count; i++) {
+        cache.blocks[i] = cache.blocks[i + PHYSALLOC_CACHE_BATCH];
+    }
 }
 
 // Allocates a block of physical memory
 uint64_t AllocatePhysicalMemoryBlock() {
-    ScopedSpinLock<true> lock(allocatorLock);
+    InterruptDisabler disableInterrupts;
+
+    PageCache& cache = LocalPageCache();
+    if (__builtin_expect(!cache.count, 0)) {
+        RefillCache(cache);
 
-    uint64_t index = GetFirstFreeMemoryBlock();
-    if (!index) {
-        asm("cli");
-        Log::Error("Out of memory!");
-        KernelPanic("Out of memory!");
-        for (;;)
-            ;
+        if (!cache.count) {
+            Log::Error("Out of memory!");
+            KernelPanic("Out of memory!");
+            for (;;)
+                ;
+        }
+    } else {
+        cache.hits++;
     }
 
-    SetBit(index);
-    usedPhysicalBlocks++;
+    uint64_t block = cache.blocks[--cache.count];
+    __atomic_add_fetch(&usedPhysicalBlocks, 1, __ATOMIC_RELAXED);
 
-    return index << PHYSALLOC_BLOCK_SHIFT;
+    return block << PHYSALLOC_BLOCK_SHIFT;
 }
 
-// Allocates a block of 2MB physical memory
-/*uint64_t AllocateLargePhysicalMemoryBlock() {
-    uint64_t index = GetFirstFreeMemoryBlock();
-    uint64_t blockCount = 0x200000
-    uint64_t counter = 0;
-    while(counter < blockCount){
-        if(bit_test(index)){
-            index++;
-            counter = 0;
-            continue;
-        }
+uint64_t AllocatePhysicalMemoryBlocks(unsigned order, PhysicalZone highestZone) {
+    assert(order <= PHYSALLOC_MAX_ORDER);
 
-        index++;
-        counter++;
+    if (!order && highestZone == PhysicalZoneHigh) {
+        return AllocatePhysicalMemoryBlock();
     }
 
-    if (index == 0)
-        return 0;
+    for (int i = PhysicalZoneDMA32; i <= highestZone; i++) {
+        Zone& zone = zones[i];
+        ScopedSpinLock<true> lockZone(zone.lock);
 
-    uint64_t addr = index * PHYSALLOC_BLOCK_SIZE;
+        if (uint64_t block = BuddyAllocate(zone, order)) {
+            __atomic_add_fetch(&usedPhysicalBlocks, 1ULL << order, __ATOMIC_RELAXED);
+            return block << PHYSALLOC_BLOCK_SHIFT;
+        }
+    }
 
-    while(blockCount--)
-        bit_set(index++);
-    usedPhysicalBlocks += counter;
+    zones[highestZone].failedAllocations++;
+    return 0;
+}
 
-    return addr;
-}*/
+// Allocates a block of 2MB physical memory
+uint64_t AllocateLargePhysicalMemoryBlock() { return AllocatePhysicalMemoryBlocks(PHYSALLOC_LARGE_ORDER); }
 
 // Frees a block of physical memory
 void FreePhysicalMemoryBlock(uint64_t addr) {
-    uint64_t index = addr >> PHYSALLOC_BLOCK_SHIFT;
-    assert(index); // If memory < 4096 is getting freed we have a serious problem
+    uint64_t block = addr >> PHYSALLOC_BLOCK_SHIFT;
+    assert(block); // If memory < 4096 is getting freed we have a serious problem
+    assert(block < PHYSALLOC_MAX_BLOCKS);
+
+    InterruptDisabler disableInterrupts;
+
+    PageCache& cache = LocalPageCache();
+    if (__builtin_expect(cache.count >= PHYSALLOC_CACHE_SIZE, 0)) {
+        DrainCache(cache);
+    }
+
+    cache.blocks[cache.count++] = block;
+    __atomic_sub_fetch(&usedPhysicalBlocks, 1, __ATOMIC_RELAXED);
+}
 
-    uint64_t chunk = index >> 5;
+void FreePhysicalMemoryBlocks(uint64_t addr, unsigned order) {
+    assert(order <= PHYSALLOC_MAX_ORDER);
 
-    physicalMemoryBitmap[chunk] = physicalMemoryBitmap[chunk] & (~(1U << (index & 31)));
-    usedPhysicalBlocks--;
+    if (!order) {
+        FreePhysicalMemoryBlock(addr);
+        return;
+    }
+
+    uint64_t block = addr >> PHYSALLOC_BLOCK_SHIFT;
+    assert(block && block < PHYSALLOC_MAX_BLOCKS);
+    assert(!(block & ((1ULL << order) - 1))); // Must be aligned to its size
 
-    if (chunk < nextChunk) {
-        nextChunk = chunk;
+    Zone& zone = ZoneOf(block);
+    {
+        ScopedSpinLock<true> lockZone(zone.lock);
+        BuddyFree(zone, block, order);
     }
+
+    __atomic_sub_fetch(&usedPhysicalBlocks, 1ULL << order, __ATOMIC_RELAXED);
 }
 
-// Frees a block of physical memory
-void FreeLargePhysicalMemoryBlock(uint64_t addr) {
-    uint64_t index = addr / PHYSALLOC_BLOCK_SIZE;
-    uint64_t blockCount = 0x200000 /* 2MB */ / PHYSALLOC_BLOCK_SIZE;
-    usedPhysicalBlocks -= blockCount;
-    while (blockCount--)
-        ClearBit(index++);
-}
-} // namespace Memory
\ No newline at end of file
+// Frees a block of 2MB physical memory
+void FreeLargePhysicalMemoryBlock(uint64_t addr) { FreePhysicalMemoryBlocks(addr, PHYSALLOC_LARGE_ORDER); }
+
+// Amount of extra owners for each block, a block which is not shared has no entry.
+// Most memory is never shared so chunks are only allocated when needed.
+uint32_t* shareCounts[PHYSALLOC_MAX_BLOCKS / PHYSALLOC_SHARE_CHUNK_SIZE];
+
+static uint32_t* ShareCount(uint64_t block, bool create) {
+    assert(block < PHYSALLOC_MAX_BLOCKS);
+
+    uint32_t*& chunk = shareCounts[block / PHYSALLOC_SHARE_CHUNK_SIZE];
+    uint32_t* counts = __atomic_load_n(&chunk, __ATOMIC_ACQUIRE);
+    if (!counts) {
+        if (!create) {
+            return nullptr;
+        }
+
+        uint32_t* newCounts = new uint32_t[PHYSALLOC_SHARE_CHUNK_SIZE];
+        memset(newCounts, 0, sizeof(uint32_t) * PHYSALLOC_SHARE_CHUNK_SIZE);
+
+        // Another CPU may have beaten us to it
+        if (__atomic_compare_exchange_n(&chunk, &counts, newCounts, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            counts = newCounts;
+        } else {
+            delete[] newCounts;
+        }
+    }
+
+    return &counts[block % PHYSALLOC_SHARE_CHUNK_SIZE];
+}
+
+void SharePhysicalMemoryBlock(uint64_t addr) {
+    uint64_t block = addr >> PHYSALLOC_BLOCK_SHIFT;
+    assert(block);
+
+    __atomic_add_fetch(ShareCount(block, true), 1, __ATOMIC_RELAXED);
+}
+
+bool IsPhysicalMemoryBlockShared(uint64_t addr) {
+    uint32_t* count = ShareCount(addr >> PHYSALLOC_BLOCK_SHIFT, false);
+    return count && __atomic_load_n(count, __ATOMIC_ACQUIRE);
+}
+
+void ReleasePhysicalMemoryBlock(uint64_t addr) {
+    uint32_t* count = ShareCount(addr >> PHYSALLOC_BLOCK_SHIFT, false);
+    if (count) {
+        uint32_t owners = __atomic_load_n(count, __ATOMIC_ACQUIRE);
+        while (owners) {
+            // Someone else still holds the block
+            if (__atomic_compare_exchange_n(count, &owners, owners - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return;
+            }
+        }
+    }
+
+    FreePhysicalMemoryBlock(addr);
+}
+
+void GetPhysicalZoneStats(PhysicalZone zoneIndex, PhysicalZoneStats& stats) {
+    assert(zoneIndex < PhysicalZoneCount);
+    Zone& zone = zones[zoneIndex];
+
+    ScopedSpinLock<true> lockZone(zone.lock);
+
+    stats.base = zone.base << PHYSALLOC_BLOCK_SHIFT;
+    stats.end = zone.end << PHYSALLOC_BLOCK_SHIFT;
+    stats.totalBlocks = zone.totalBlocks;
+    stats.freeBlocks = zone.freeBlockCount;
+    memcpy(stats.freeLists, zone.freeLists, sizeof(stats.freeLists));
+    stats.allocations = zone.allocations;
+    stats.failedAllocations = zone.failedAllocations;
+}
+
+void GetPhysicalCacheStats(unsigned cpu, PhysicalCacheStats& stats) {
+    assert(cpu < PHYSALLOC_MAX_CPUS);
+
+    // Only the owning CPU modifies the cache, so these are just a snapshot
+    PageCache& cache = pageCaches[cpu];
+    stats.cachedBlocks = cache.count;
+    stats.hits = cache.hits;
+    stats.refills = cache.refills;
+    stats.drains = cache.drains;
+}
+} // namespace Memory
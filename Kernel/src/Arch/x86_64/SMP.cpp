@@ -8,6 +8,7 @@
 #include <IDT.h>
 #include <Logging.h>
 #include <Memory.h>
+#include <RunQueue.h>
 #include <TSS.h>
 #include <Timer.h>
 
@@ -58,7 +59,9 @@ void SMPEntry(uint16_t id) {
     TSS::InitializeTSS(&cpu->tss, cpu->gdt);
     APIC::Local::Enable();
 
-    cpu->runQueue = new FastList<Thread*>();
+    cpu->runQueue = new RunQueue();
+
+    Timer::EnableLocalTimer();
 
     doneInit = true;
 
@@ -127,7 +130,7 @@ void InitializeCPU0Context() {
 void Initialize() {
     assert(didInitializeCPU0);
     // Initialize rest of CPU 0
-    cpus[0]->runQueue = new FastList<Thread*>();
+    cpus[0]->runQueue = new RunQueue();
 
     if (HAL::disableSMP) {
         TSS::InitializeTSS(&cpus[0]->tss, cpus[0]->gdt);
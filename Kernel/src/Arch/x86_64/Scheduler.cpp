@@ -16,16 +16,111 @@
 #include <Paging.h>
 #include <Panic.h>
 #include <PhysicalAllocator.h>
+#include <RunQueue.h>
 #include <SMP.h>
 #include <Serial.h>
 #include <String.h>
 #include <TSS.h>
 #include <Timer.h>
+#include <Trace.h>
 
 extern "C" void IdleProcess();
 
 void KernelProcess();
 
+void RunQueue::Enqueue(Thread* thread, bool expired) {
+    assert(thread->runQueueArray < 0);
+
+    int arrayIndex = expired ? !m_active : m_active;
+    unsigned level = PriorityLevel(thread);
+
+    m_arrays[arrayIndex].queues[level].add_back(thread);
+    m_arrays[arrayIndex].bitmap |= (1U << level);
+
+    thread->runQueueArray = arrayIndex;
+    m_count++;
+}
+
+Thread* RunQueue::TakeFront(int arrayIndex) {
+    PriorityArray& array = m_arrays[arrayIndex];
+    assert(array.bitmap);
+
+    // Lowest set bit is the highest priority non-empty list
+    unsigned level = __builtin_ctz(array.bitmap);
+    Thread* thread = array.queues[level].get_front();
+    assert(thread);
+
+    Remove(thread);
+    return thread;
+}
+
+Thread* RunQueue::Dequeue() {
+    while (m_count) {
+        if (!m_arrays[m_active].bitmap) {
+            // Every active thread has had its time slice, start a new round
+            m_active = !m_active;
+        }
+
+        Thread* thread = TakeFront(m_active);
+        if (__builtin_expect(!(thread->state & ThreadStateBlocked), 1)) {
+            return thread;
+        }
+
+        // The thread was killed whilst queued, drop it
+    }
+
+    return nullptr;
+}
+
+Thread* RunQueue::Steal() {
+    Thread* thread = nullptr;
+    while (m_count && !thread) {
+        if (m_arrays[!m_active].bitmap) {
+            thread = TakeFront(!m_active);
+        } else {
+            thread = TakeFront(m_active);
+        }
+
+        if (thread->state & ThreadStateBlocked) {
+            thread = nullptr;
+        }
+    }
+
+    return thread;
+}
+
+void RunQueue::Remove(Thread* thread) {
+    assert(thread->runQueueArray >= 0);
+
+    PriorityArray& array = m_arrays[thread->runQueueArray];
+    unsigned level = PriorityLevel(thread);
+
+    array.queues[level].remove(thread);
+    if (!array.queues[level].get_length()) {
+        array.bitmap &= ~(1U << level);
+    }
+
+    thread->runQueueArray = -1;
+    m_count--;
+}
+
+void RunQueue::RemoveProcessThreads(Process* process) {
+    for (PriorityArray& array : m_arrays) {
+        for (FastList<Thread*>& queue : array.queues) {
+            Thread* thread = queue.get_front();
+            while (thread) {
+                // Get the next thread before removal clears the links
+                Thread* next = queue.next(thread);
+                if (thread->parent == process) {
+                    Remove(thread);
+                }
+
+                thread = next;
+            }
+        }
+    }
+}
+
 namespace Scheduler {
 int schedulerLock = 0;
 bool schedulerReady = false;
@@ -39,32 +134,131 @@ List<FancyRefPtr<Process>>* destroyedProcesses;
 unsigned processTableSize = 512;
 std::atomic<pid_t> nextPID = 1;
 
-// When the run queue was last balanced
-uint64_t nextBalanceDue = 0;
-
 void Schedule(void*, RegisterContext* r);
 
+// Tick passes the address of this to Schedule, IPI_SCHEDULE (e.g. from Yield) passes nullptr
+static int tickData;
+
+// Number of threads either running or waiting to run on the CPU
+ALWAYS_INLINE static unsigned CPULoad(CPU* cpu) {
+    return cpu->runQueue->Count() + (cpu->currentThread && cpu->currentThread != cpu->idleThread);
+}
+
+// Ask a CPU sitting in its idle thread to pick up new work queued on cpu.
+// Idle CPUs do not receive scheduler ticks, so if cpu is busy
+// another idle CPU gets kicked to steal the work instead.
+static void KickIdleCPU(CPU* cpu) {
+    if (cpu->currentThread != cpu->idleThread) {
+        CPU* idle = nullptr;
+        for (unsigned i = 1; i < SMP::processorCount; i++) {
+            CPU* other = SMP::cpus[(cpu->id + i) % SMP::processorCount];
+            if (other->currentThread == other->idleThread) {
+                idle = other;
+                break;
+            }
+        }
+
+        if (!idle) {
+            return; // Everyone is busy, the thread will run on the next tick
+        }
+        cpu = idle;
+    }
+
+    if (cpu == GetCPULocal()) {
+        // We must be in an interrupt handler, reschedule once it returns
+        APIC::Local::SendIPI(0, ICR_DSH_SELF, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+    } else {
+        APIC::Local::SendIPI(cpu->id, ICR_DSH_DEST, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+    }
+}
+
 void InsertNewThreadIntoQueue(Thread* thread) {
     CPU* cpu = SMP::cpus[0];
-    for (unsigned i = 1; i < SMP::processorCount; i++) {
-        // Pick the CPU with the most idle time since run queue balance
-        if (SMP::cpus[i]->idleProcess->GetMainThread()->ticksSinceBalance >
-            cpu->idleProcess->GetMainThread()->ticksSinceBalance) {
+    for (unsigned i = 1; i < SMP::processorCount && CPULoad(cpu); i++) {
+        // Pick the least busy CPU, the loads are only a hint so no locks are needed
+        if (CPULoad(SMP::cpus[i]) < CPULoad(cpu)) {
             cpu = SMP::cpus[i];
         }
-
-        // Pick a CPU with an empty run queue no matter what
-        if (!cpu->runQueue->get_length()) {
-            break;
-        }
     }
 
-    asm("sti");
-    acquireLockIntDisable(&cpu->runQueueLock);
-    cpu->runQueue->add_back(thread);
+    InterruptDisabler disableInterrupts;
+    acquireLock(&cpu->runQueueLock);
+
     thread->cpu = cpu->id;
+    thread->onCPU = false;
+    cpu->runQueue->Enqueue(thread, false);
+
     releaseLock(&cpu->runQueueLock);
-    asm("sti");
+
+    KickIdleCPU(cpu);
+}
+
+void Wake(Thread* thread) {
+    assert(!CheckInterrupts());
+
+    for (;;) {
+        int cpuID = thread->cpu;
+        if (cpuID < 0) {
+            return; // Thread has not been started
+        }
+
+        CPU* cpu = SMP::cpus[cpuID];
+        acquireLock(&cpu->runQueueLock);
+
+        if (__builtin_expect(thread->cpu != cpuID, 0)) {
+            // Thread was stolen by another CPU before we got the lock
+            releaseLock(&cpu->runQueueLock);
+            continue;
+        }
+
+        // If the thread is still executing, it will get requeued when it is switched out
+        bool enqueued = false;
+        if (!thread->onCPU && thread->runQueueArray < 0 && !(thread->state & ThreadStateBlocked)) {
+            cpu->runQueue->Enqueue(thread, false);
+            enqueued = true;
+        }
+
+        releaseLock(&cpu->runQueueLock);
+
+        if (enqueued) {
+            KickIdleCPU(cpu);
+        }
+        return;
+    }
+}
+
+// Take a thread from another CPU's run queue.
+// Only ever try-locks the other queue so at most two run queue locks are held at once
+// and we never wait on a busy CPU.
+static Thread* StealWork(CPU* cpu) {
+    for (unsigned i = 1; i < SMP::processorCount; i++) {
+        CPU* victim = SMP::cpus[(cpu->id + i) % SMP::processorCount];
+        if (!victim->runQueue->Count()) {
+            continue;
+        }
+
+        if (acquireTestLock(&victim->runQueueLock)) {
+            continue; // Busy, try the next CPU
+        }
+
+        Thread* thread = victim->runQueue->Steal();
+        if (thread) {
+            // Set these before releasing the victim's lock
+            // so Wake will not try to requeue the thread
+            thread->cpu = cpu->id;
+            thread->onCPU = true;
+        }
+
+        releaseLock(&victim->runQueueLock);
+
+        if (thread) {
+            Log::Debug(debugLevelScheduler, DebugLevelVerbose, "CPU %d took %s (tid %d) from CPU %d", cpu->id,
+                       thread->parent->name, thread->tid, victim->id);
+            return thread;
+        }
+    }
+
+    return nullptr;
 }
 
 void Initialize() {
@@ -80,7 +274,6 @@ void Initialize() {
     }
 
     for (unsigned i = 0; i < SMP::processorCount; i++) {
-        SMP::cpus[i]->runQueue->clear();
         releaseLock(&SMP::cpus[i]->runQueueLock);
     }
 
@@ -91,6 +284,10 @@ void Initialize() {
 
     cpu->currentThread = nullptr;
     schedulerReady = true;
+
+    // Get the other CPUs into their idle threads, from then on they only get interrupted when needed
+    APIC::Local::SendIPI(0, ICR_DSH_OTHER, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
+
     asm("sti; int $0xfd;"); // IPI_SCHEDULE
     assert(!"Failed to initiailze scheduler!");
 }
@@ -152,123 +349,10 @@ void Tick(RegisterContext* r) {
     if (!schedulerReady)
         return;
 
-    APIC::Local::SendIPI(0, ICR_DSH_OTHER, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
-
-    Schedule(nullptr, r);
+    Schedule(&tickData, r);
 }
 
-void BalanceRunQueues() {
-    assert(processesLock);
-    assert(!CheckInterrupts());
-
-    if(Timer::UsecondsSinceBoot() - nextBalanceDue > 1000000) {
-        Log::Warning("Exceeded run balance due time by %d", Timer::UsecondsSinceBoot() - nextBalanceDue);
-    }
-
-    long avgUtilization[SMP::processorCount];
-    long leastActive = 0;
-
-    FastList<Thread*> threadsToDistribute;
-
-    // Lock ALL run queues
-    for (unsigned i = 0; i < SMP::processorCount; i++) {
-        CPU* cpu = SMP::cpus[i];
-        if(cpu != GetCPULocal()) {
-            acquireLock(&cpu->runQueueLock);
-        }
-
-        if (!cpu->currentThread || cpu->currentThread == cpu->idleThread) {
-            avgUtilization[i] = 0;
-        } else {
-            // TODO: Move the thread even if the CPU was using it
-            // TODO: Consider leaving high utilization processes on the CPU
-            // as they have likely populated the CPU cache
-            if (cpu->currentThread->ticksGivenSinceBalance) {
-                avgUtilization[i] =
-                    cpu->currentThread->ticksSinceBalance * 100 / cpu->currentThread->ticksGivenSinceBalance;
-            } else {
-                avgUtilization[i] = 0;
-            }
-        }
-
-        if (cpu->runQueue->get_length()) {
-        retry:
-            Thread* it = cpu->runQueue->get_front();
-            do {
-                if (!it) {
-                    break;
-                }
-
-                if (it != cpu->currentThread) {
-                    // Save next thread as it will be overwritten by
-                    // intrusive list
-                    cpu->runQueue->remove(it);
-                    it->cpu = -1;
-
-                    if(it->state != ThreadStateDying) {
-                        threadsToDistribute.add_back(it);
-                    }
-
-                    goto retry; // The front may have changed
-                } else {
-                    it = it->next;
-                }
-            } while (it != cpu->runQueue->get_front());
-        }
-    }
-
-    Thread* nextThread;
-    while ((nextThread = threadsToDistribute.get_front())) {
-        CPU* cpu = SMP::cpus[leastActive];
-
-        threadsToDistribute.remove(nextThread);
-        cpu->runQueue->add_back(nextThread);
-        nextThread->cpu = cpu->id;
-
-        Log::Debug(debugLevelScheduler, DebugLevelVerbose, "Gave %s to CPU %d", nextThread->parent->name, leastActive);
-
-        if (nextThread->ticksGivenSinceBalance > 0) {
-            avgUtilization[leastActive] += nextThread->ticksSinceBalance * 100 / nextThread->ticksGivenSinceBalance;
-        }
-
-        if (!threadsToDistribute.get_front()) {
-            break; // Done distributing threads
-        }
-
-        for (unsigned i = 0; i < SMP::processorCount; i++) {
-            Log::Debug(debugLevelScheduler, DebugLevelVerbose, "util: %d, %d", i, avgUtilization[i]);
-
-            if (avgUtilization[i] < avgUtilization[leastActive]) {
-                leastActive = i;
-            }
-        }
-    }
-
-    // Unlock ALL run queues
-    for (unsigned i = 0; i < SMP::processorCount; i++) {
-        Thread* thread = SMP::cpus[i]->runQueue->get_front();
-        if (thread) {
-            do {
-                thread->ticksSinceBalance = 0;
-                thread->ticksGivenSinceBalance = 0;
-
-                Log::Debug(debugLevelScheduler, DebugLevelVerbose, "%d: resetting %s (pid %d tid %d)", i,
-                           thread->parent->name, thread->parent->PID(), thread->tid);
-                thread = thread->next;
-            } while (thread != SMP::cpus[i]->runQueue->get_front());
-        }
-
-        SMP::cpus[i]->idleThread->ticksSinceBalance = 0;
-
-        if(SMP::cpus[i] != GetCPULocal()) {
-            releaseLock(&SMP::cpus[i]->runQueueLock);
-        }
-    }
-
-    nextBalanceDue = Timer::UsecondsSinceBoot() + 1000000;
-}
-
-void Schedule(__attribute__((unused)) void* data, RegisterContext* r) {
+void Schedule(void* data, RegisterContext* r) {
     assert(!CheckInterrupts());
 
     CPU* cpu = GetCPULocal();
@@ -276,7 +360,6 @@ void Schedule(__attribute__((unused)) void* data, RegisterContext* r) {
     if (cpu->currentThread && !(cpu->currentThread->state & ThreadStateBlocked)) {
         cpu->currentThread->parent->activeTicks++;
         if (cpu->currentThread->timeSlice > 0) {
-            cpu->currentThread->ticksSinceBalance++;
             cpu->currentThread->timeSlice--;
             return;
         }
@@ -284,85 +367,49 @@ void Schedule(__attribute__((unused)) void* data, RegisterContext* r) {
 
     if(__builtin_expect(acquireTestLock(&cpu->runQueueLock), 0)) {
         // If the process should block wait, otherwise return
-        if(cpu->currentThread->state & ThreadStateBlocked) {
+        if(!cpu->currentThread || (cpu->currentThread->state & ThreadStateBlocked)) {
             acquireLock(&cpu->runQueueLock);
         } else return;
     }
 
-    if (SMP::processorCount > 1 && Timer::UsecondsSinceBoot() > nextBalanceDue) {
-        if(!__builtin_expect(acquireTestLock(&processesLock), 0)) {
-            if (Timer::UsecondsSinceBoot() > nextBalanceDue) {
-                BalanceRunQueues();
-            }
-            releaseLock(&processesLock);
+    // Another CPU may have cleared currentThread (when killing a process) so read it under the lock
+    Thread* current = cpu->currentThread;
+    if (current) {
+        if (__builtin_expect(current->state != ThreadStateDying, 1)) {
+            asm volatile("fxsave64 (%0)" ::"r"((uintptr_t)current->fxState) : "memory");
+            current->registers = *r;
         }
-    }
-
-    if (__builtin_expect(cpu->runQueue->get_length() <= 0 || !cpu->currentThread, 0)) {
-        cpu->currentThread = cpu->idleThread;
-    } else if (__builtin_expect(cpu->currentThread->state == ThreadStateDying, 0)) {
-        cpu->runQueue->remove(cpu->currentThread);
-        cpu->currentThread->cpu = -1;
-        cpu->currentThread = cpu->idleThread;
-    } else {
-        asm volatile("fxsave64 (%0)" ::"r"((uintptr_t)cpu->currentThread->fxState) : "memory");
-
-        if (__builtin_expect(cpu->currentThread->parent != cpu->idleProcess, 1)) {
-            cpu->currentThread->ticksGivenSinceBalance += cpu->currentThread->timeSliceDefault;
 
-            cpu->currentThread->registers = *r;
+        current->onCPU = false;
 
-            cpu->currentThread = cpu->currentThread->next;
-        } else {
-            cpu->currentThread->ticksGivenSinceBalance += cpu->currentThread->timeSliceDefault;
-            cpu->currentThread->registers = *r;
-            cpu->currentThread = cpu->runQueue->front;
+        if (current != cpu->idleThread) {
+            // Yield also leaves no time slice, so only count the thread as having used it up when preempted
+            bool usedTimeSlice = data == &tickData && !current->timeSlice && current->timeSliceDefault;
+            RunQueue::UpdatePriorityBonus(current, usedTimeSlice, current->state & ThreadStateBlocked);
         }
 
-        // Get the next thread that isnt blocked
-        if (cpu->currentThread->state & ThreadStateBlocked) {
-            Thread* first = cpu->currentThread;
-
-            do {
-                cpu->currentThread = cpu->currentThread->next;
-            } while ((cpu->currentThread->state & ThreadStateBlocked) && cpu->currentThread != first);
+        // Blocked threads are left off the run queue until they are woken
+        if (current != cpu->idleThread && !(current->state & ThreadStateBlocked)) {
+            // We only get here if the time slice was used up or given away
+            cpu->runQueue->Enqueue(current, true);
         }
+    }
 
-        // Check if we could find an unblocked thread
-        if (cpu->currentThread->state & ThreadStateBlocked) {
-                cpu->currentThread = cpu->idleThread;
-        } /*else if(SMP::processorCount > 1) {
-            // See if we can find a better thread
-            // where better is the thread w/ least CPU time
-            Thread* first = cpu->currentThread;
-            Thread* leastHungry = cpu->currentThread->next;
-
-            cpu->currentThread = leastHungry;
-            do {
-                if (leastHungry->state & ThreadStateBlocked) {
-                    Thread* first = leastHungry;
-
-                    do {
-                        leastHungry = leastHungry->next;
-                    } while ((leastHungry->state & ThreadStateBlocked) && leastHungry != first);
-
-                    if (leastHungry->state & ThreadStateBlocked) {
-                        cpu->currentThread = cpu->idleThread;
-                        break;
-                    }
-                }
-
-                if(leastHungry == first) {
-                    break;
-                }
+    Thread* next = cpu->runQueue->Dequeue();
+    if (!next && SMP::processorCount > 1) {
+        next = StealWork(cpu);
+    }
 
-                if(leastHungry->ticksSinceBalance < cpu->currentThread->ticksSinceBalance) {
-                    cpu->currentThread = leastHungry;
-                }
+    if (next) {
+        next->onCPU = true;
+        cpu->currentThread = next;
+    } else {
+        cpu->currentThread = cpu->idleThread;
+    }
 
-                leastHungry = leastHungry->next;
-            } while(leastHungry != first);
-        }*/
+    if (cpu->currentThread != current) {
+        TRACE_EVENT(TraceEventSchedSwitch, current ? current->parent->PID() : -1, current ? current->tid : -1,
+                    current ? current->state : 0);
     }
 
     releaseLock(&cpu->runQueueLock);
@@ -380,6 +427,8 @@ void DoSwitch(CPU* cpu) {
 
     cpu->currentThread->timeSlice = cpu->currentThread->timeSliceDefault;
 
+    Timer::RearmLocalTimer(cpu->currentThread != cpu->idleThread);
+
     // Check for a few things
     // - Process is in usermode
     // - Pending unmasked signals
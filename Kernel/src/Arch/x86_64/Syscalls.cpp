@@ -10,6 +10,8 @@
 #include <Lemon.h>
 #include <Lock.h>
 #include <Logging.h>
+#include <MM/FileVMObject.h>
+#include <MM/KMalloc.h>
 #include <Math.h>
 #include <Modules.h>
 #include <Net/Socket.h>
@@ -24,6 +26,7 @@
 #include <StackTrace.h>
 #include <TTY/PTY.h>
 #include <Timer.h>
+#include <Trace.h>
 #include <UserPointer.h>
 #include <Video/Video.h>
 
@@ -66,6 +69,8 @@ long SysEpollCreate(RegisterContext* r);
 long SysEPollCtl(RegisterContext* r);
 long SysEpollWait(RegisterContext* r);
 long SysPipe(RegisterContext* r);
+long SysSplice(RegisterContext* r);
+long SysTee(RegisterContext* r);
 long SysFChdir(RegisterContext* r);
 
 long SysExit(RegisterContext* r) {
@@ -145,18 +150,8 @@ long SysExec(RegisterContext* r) {
         kernelArgv.add_back(filepath); // Ensure at least argv[0] is set
     }
 
-    timeval tv = Timer::GetSystemUptimeStruct();
-    uint8_t* buffer = (uint8_t*)kmalloc(node->size);
-    size_t read = fs::Read(node, 0, node->size, buffer);
-    if (read != node->size) {
-        Log::Warning("Could not read file: %s", filepath);
-        return 0;
-    }
-    timeval tvnew = Timer::GetSystemUptimeStruct();
-    Log::Info("Done (took %d us)", Timer::TimeDifference(tvnew, tv));
-    FancyRefPtr<Process> proc = Process::CreateELFProcess((void*)buffer, kernelArgv, kernelEnvp, filepath,
+    FancyRefPtr<Process> proc = Process::CreateELFProcess(node, kernelArgv, kernelEnvp, filepath,
                                                           ((flags & EXEC_CHILD) ? currentProcess : nullptr));
-    kfree(buffer);
 
     if (!proc) {
         Log::Warning("SysExec: Proc is null!");
@@ -184,9 +179,27 @@ long SysExec(RegisterContext* r) {
     return proc->PID();
 }
 
+// Unmap the rings of an endpoint once the process has closed its last handle to it
+static void ReleaseEndpointRing(Process* process, handle_id_t id) {
+    Handle h = process->GetHandle(id);
+    if (!h || !h.ko->IsType(MessageEndpoint::TypeID())) {
+        return;
+    }
+
+    for (handle_id_t i = 0; i < static_cast<handle_id_t>(process->HandleCount()); i++) {
+        if (i != id && process->GetHandle(i).ko.get() == h.ko.get()) {
+            return;
+        }
+    }
+
+    reinterpret_cast<MessageEndpoint*>(h.ko.get())->UnmapRing(process);
+}
+
 long SysCloseHandle(RegisterContext* r) {
     Process* currentProcess = Scheduler::GetCurrentProcess();
 
+    ReleaseEndpointRing(currentProcess, SC_ARG0(r));
+
     int err = currentProcess->DestroyHandle(SC_ARG0(r));
     if (err) {
         return -EBADF;
@@ -259,15 +272,16 @@ long SysExecve(RegisterContext* r) {
         kernelArgv.add_back(filepath); // Ensure at least argv[0] is set
     }
 
-    timeval tv = Timer::GetSystemUptimeStruct();
-    uint8_t* buffer = (uint8_t*)kmalloc(node->size);
-    size_t read = fs::Read(node, 0, node->size, buffer);
-    if (read != node->size) {
-        Log::Warning("Could not read file: %s", filepath);
-        return -EIO;
+    // The segments are only mapped once the old address space is gone, so check the file beforehand
+    elf64_header_t header;
+    if (fs::Read(node, 0, sizeof(header), reinterpret_cast<uint8_t*>(&header)) != sizeof(header) ||
+        !VerifyELF(&header)) {
+        Log::Warning("SysExecve: %s is not a valid ELF", filepath);
+        return -ENOEXEC;
     }
-    timeval tvnew = Timer::GetSystemUptimeStruct();
-    Log::Info("Done (took %d us)", Timer::TimeDifference(tvnew, tv));
+
+    // Keep the file open whilst the old address space (which may be mapping it) gets destroyed
+    FancyRefPtr<UNIXOpenFile> elfFile = SC_TRY_OR_ERROR(fs::Open(node));
 
     Thread* currentThread = Thread::Current();
     ScopedSpinLock lockProcess(currentProcess->m_processLock);
@@ -291,16 +305,21 @@ long SysExecve(RegisterContext* r) {
     currentProcess->addressSpace = newSpace;
     asm volatile("mov %%rax, %%cr3; sti" ::"a"(newSpace->GetPageMap()->pml4Phys));
 
-    delete oldSpace;
+    if (currentProcess->m_borrowsAddressSpace) {
+        // Created by vfork, the AddressSpace belongs to our parent which can now continue
+        currentProcess->m_borrowsAddressSpace = false;
+        currentProcess->m_addressSpaceReleased.Signal();
+    } else {
+        delete oldSpace;
+    }
 
     currentProcess->MapSignalTrampoline();
 
     // Force the first 8KB to be allocated
     // TODO: PageMap race cond
 
-    elf_info_t elfInfo = LoadELFSegments(currentProcess, buffer, 0);
+    elf_info_t elfInfo = LoadELFSegments(currentProcess, node, 0);
     r->rip = currentProcess->LoadELF(&r->rsp, elfInfo, kernelArgv, kernelEnvp, filepath);
-    kfree(buffer);
 
     if (!r->rip) {
         // Its really important that we kill the process afterwards,
@@ -407,7 +426,7 @@ long SysReceiveMessage(RegisterContext* r) {
 long SysUptime(RegisterContext* r) {
     uint64_t* ns = (uint64_t*)SC_ARG0(r);
     if (ns) {
-        *ns = Timer::UsecondsSinceBoot() * 1000;
+        *ns = Timer::NanosecondsSinceBoot();
     }
     return 0;
 }
@@ -456,11 +475,25 @@ long SysSetFsBase(RegisterContext* r) {
     return 0;
 }
 
+/////////////////////////////
+/// \brief SysMmap(address, size, hint, flags, fd, offset) Map memory into the address space
+///
+/// \param address Pointer to store the address of the mapping
+/// \param size Size of the mapping
+/// \param hint Address to try to map at (or to map at with MAP_FIXED)
+/// \param flags MAP_ANON, MAP_PRIVATE, MAP_SHARED, MAP_FIXED
+/// \param fd File descriptor to map, ignored for MAP_ANON
+/// \param offset Page aligned offset into the file
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
 long SysMmap(RegisterContext* r) {
     uint64_t* address = (uint64_t*)SC_ARG0(r);
     size_t size = SC_ARG1(r);
     uintptr_t hint = SC_ARG2(r);
     uint64_t flags = SC_ARG3(r);
+    int fd = SC_ARG4(r);
+    uint64_t offset = SC_ARG5(r);
 
     if (!size) {
         return -EINVAL; // We do not accept 0-length mappings
@@ -470,10 +503,10 @@ long SysMmap(RegisterContext* r) {
 
     bool fixed = flags & MAP_FIXED;
     bool anon = flags & MAP_ANON;
-    // bool privateMapping = flags & MAP_PRIVATE;
+    bool sharedMapping = flags & MAP_SHARED;
 
-    uint64_t unknownFlags = flags & ~static_cast<uint64_t>(MAP_ANON | MAP_FIXED | MAP_PRIVATE);
-    if (unknownFlags || !anon) {
+    uint64_t unknownFlags = flags & ~static_cast<uint64_t>(MAP_ANON | MAP_FIXED | MAP_PRIVATE | MAP_SHARED);
+    if (unknownFlags || (anon && sharedMapping) || (!anon && !(sharedMapping ^ bool(flags & MAP_PRIVATE)))) {
         Log::Warning("SysMmap: Unsupported mmap flags %x", flags);
         return -EINVAL;
     }
@@ -485,7 +518,25 @@ long SysMmap(RegisterContext* r) {
         return -EINVAL;
     }
 
-    MappedRegion* region = proc->addressSpace->AllocateAnonymousVMObject(size, hint, fixed);
+    MappedRegion* region = nullptr;
+    if (anon) {
+        region = proc->addressSpace->AllocateAnonymousVMObject(size, hint, fixed);
+    } else {
+        FancyRefPtr<UNIXOpenFile> handle = SC_TRY_OR_ERROR(proc->GetHandleAs<UNIXOpenFile>(fd));
+        if (!handle) {
+            return -EBADF;
+        } else if (!handle->node->IsFile()) {
+            return -ENODEV; // Only regular files have a page cache
+        } else if (offset & (PAGE_SIZE_4K - 1)) {
+            return -EINVAL;
+        }
+
+        size = (size + PAGE_SIZE_4K - 1) & ~static_cast<size_t>(PAGE_SIZE_4K - 1);
+
+        FancyRefPtr<VMObject> vmo = new FileVMObject(std::move(handle), offset, size, sharedMapping);
+        region = proc->addressSpace->MapVMO(vmo, hint & ~static_cast<uintptr_t>(PAGE_SIZE_4K - 1), fixed);
+    }
+
     if (!region || !region->base) {
         IF_DEBUG((debugLevelSyscalls >= DebugLevelNormal), {
             Log::Error("SysMmap: Failed to map region (hint %x)!", hint);
@@ -590,6 +641,84 @@ long SysInfo(RegisterContext* r) {
     s->totalMem = HAL::mem_info.totalMemory / 1024;
     s->cpuCount = static_cast<uint16_t>(SMP::processorCount);
 
+    // Physical allocator statistics are optional
+    lemon_meminfo_t* memInfo = (lemon_meminfo_t*)SC_ARG1(r);
+    if (!memInfo) {
+        return 0;
+    }
+
+    static_assert(Memory::PhysicalZoneCount <= LEMON_MEMINFO_MAX_ZONES);
+    static_assert(PHYSALLOC_ORDER_COUNT == LEMON_MEMINFO_ORDER_COUNT);
+
+    uint16_t cpuCount = static_cast<uint16_t>(SMP::processorCount < LEMON_MEMINFO_MAX_CPUS ? SMP::processorCount
+                                                                                           : LEMON_MEMINFO_MAX_CPUS);
+    UserPointer<uint16_t> zoneCountPtr = reinterpret_cast<uintptr_t>(&memInfo->zoneCount);
+    UserPointer<uint16_t> cpuCountPtr = reinterpret_cast<uintptr_t>(&memInfo->cpuCount);
+    TRY_STORE_UMODE_VALUE(zoneCountPtr, static_cast<uint16_t>(Memory::PhysicalZoneCount));
+    TRY_STORE_UMODE_VALUE(cpuCountPtr, cpuCount);
+
+    UserBuffer<lemon_memzone_info_t> zones = reinterpret_cast<uintptr_t>(memInfo->zones);
+    for (int i = 0; i < Memory::PhysicalZoneCount; i++) {
+        Memory::PhysicalZoneStats stats;
+        Memory::GetPhysicalZoneStats(static_cast<Memory::PhysicalZone>(i), stats);
+
+        lemon_memzone_info_t zone;
+        zone.base = stats.base;
+        zone.end = stats.end;
+        zone.totalPages = stats.totalBlocks;
+        zone.freePages = stats.freeBlocks;
+        memcpy(zone.freeRuns, stats.freeLists, sizeof(zone.freeRuns));
+        zone.allocations = stats.allocations;
+        zone.failedAllocations = stats.failedAllocations;
+
+        if (zones.StoreValue(i, zone)) {
+            return -EFAULT;
+        }
+    }
+
+    UserBuffer<lemon_pagecache_info_t> caches = reinterpret_cast<uintptr_t>(memInfo->cpus);
+    for (unsigned i = 0; i < cpuCount; i++) {
+        Memory::PhysicalCacheStats stats;
+        Memory::GetPhysicalCacheStats(SMP::cpus[i]->id, stats);
+
+        lemon_pagecache_info_t cache = {
+            .cachedPages = stats.cachedBlocks,
+            .hits = stats.hits,
+            .refills = stats.refills,
+            .drains = stats.drains,
+        };
+
+        if (caches.StoreValue(i, cache)) {
+            return -EFAULT;
+        }
+    }
+
+    static_assert(KMALLOC_CLASS_COUNT <= LEMON_MEMINFO_MAX_KMALLOC_CLASSES);
+
+    UserPointer<uint16_t> classCountPtr = reinterpret_cast<uintptr_t>(&memInfo->kmallocClassCount);
+    TRY_STORE_UMODE_VALUE(classCountPtr, static_cast<uint16_t>(KMALLOC_CLASS_COUNT));
+
+    UserBuffer<lemon_kmalloc_class_info_t> classes = reinterpret_cast<uintptr_t>(memInfo->kmallocClasses);
+    for (unsigned i = 0; i < KMALLOC_CLASS_COUNT; i++) {
+        KMallocClassStats stats;
+        GetKMallocClassStats(i, stats);
+
+        lemon_kmalloc_class_info_t sizeClass = {
+            .size = stats.size,
+            .allocations = stats.allocations,
+            .frees = stats.frees,
+            .bytes = stats.bytes,
+            .peakBytes = stats.peakBytes,
+            .reservedBytes = stats.reservedBytes,
+            .refills = stats.refills,
+            .drains = stats.drains,
+        };
+
+        if (classes.StoreValue(i, sizeClass)) {
+            return -EFAULT;
+        }
+    }
+
     return 0;
 }
 
@@ -902,14 +1031,88 @@ long SysSetUID(RegisterContext* r) {
     return 0;
 }
 
+// A msghdr and its iovec array copied into kernel memory. The sockets only ever see this copy,
+// so another thread cannot swap the pointers or lengths in user memory once they have been checked
+struct KernelMessageHeader {
+    msghdr msg;
+    iovec inlineIov[4]; // Enough for most messages without going to the heap
+
+    KernelMessageHeader() { msg.msg_iov = inlineIov; }
+    ~KernelMessageHeader() {
+        if (msg.msg_iov != inlineIov) {
+            delete[] msg.msg_iov;
+        }
+    }
+};
+
+// Copy a msghdr and its iovecs then check the iovecs, name and control data of the copy,
+// the msghdr in user memory must already have been checked
+static long CopyMessageHeader(const msghdr* userMsg, KernelMessageHeader& kmsg, AddressSpace* addressSpace) {
+    msghdr& msg = kmsg.msg;
+
+    msg = *userMsg;
+    const iovec* userIov = msg.msg_iov;
+    msg.msg_iov = kmsg.inlineIov;
+
+    if (static_cast<size_t>(msg.msg_iovlen) > SOCKET_IOV_MAX) {
+        return -EMSGSIZE;
+    }
+
+    if (msg.msg_iovlen &&
+        !Memory::CheckUsermodePointer((uintptr_t)userIov, sizeof(iovec) * msg.msg_iovlen, addressSpace)) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal, { Log::Warning("CopyMessageHeader: Invalid iovec ptr"); });
+        return -EFAULT;
+    }
+
+    if (static_cast<size_t>(msg.msg_iovlen) > sizeof(kmsg.inlineIov) / sizeof(iovec)) {
+        msg.msg_iov = new iovec[msg.msg_iovlen];
+    }
+    memcpy(msg.msg_iov, userIov, sizeof(iovec) * msg.msg_iovlen);
+
+    size_t length = 0;
+    for (unsigned i = 0; i < msg.msg_iovlen; i++) {
+        if (!Memory::CheckUsermodePointer((uintptr_t)msg.msg_iov[i].iov_base, msg.msg_iov[i].iov_len, addressSpace)) {
+            IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal,
+                     { Log::Warning("CopyMessageHeader: Invalid iovec entry base"); });
+            return -EFAULT;
+        }
+
+        // The total has to fit in the return value
+        if (msg.msg_iov[i].iov_len > INT64_MAX - length) {
+            return -EINVAL;
+        }
+        length += msg.msg_iov[i].iov_len;
+    }
+
+    if (msg.msg_name && msg.msg_namelen &&
+        !Memory::CheckUsermodePointer((uintptr_t)msg.msg_name, msg.msg_namelen, addressSpace)) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal, { Log::Warning("CopyMessageHeader: Invalid name ptr"); });
+        return -EFAULT;
+    }
+
+    if (msg.msg_control && msg.msg_controllen &&
+        !Memory::CheckUsermodePointer((uintptr_t)msg.msg_control, msg.msg_controllen, addressSpace)) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal, { Log::Warning("CopyMessageHeader: Invalid control ptr"); });
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+// Hand what a socket wrote to the msghdr back to the caller
+static void CopyMessageHeaderOut(const KernelMessageHeader& kmsg, msghdr* userMsg) {
+    userMsg->msg_namelen = kmsg.msg.msg_namelen;
+    userMsg->msg_flags = kmsg.msg.msg_flags;
+}
+
 /*
- * SysSend (sockfd, msg, flags) - Send data through a socket
+ * SysSendMsg (sockfd, msg, flags) - Send data through a socket
  * sockfd - Socket file descriptor
  * msg - Message Header
  * flags - flags
  *
  * On Success - return amount of data sent
- * On Failure - return -1
+ * On Failure - return negative error code
  */
 long SysSendMsg(RegisterContext* r) {
     Process* proc = Scheduler::GetCurrentProcess();
@@ -922,7 +1125,11 @@ long SysSendMsg(RegisterContext* r) {
     }
 
     msghdr* msg = (msghdr*)SC_ARG1(r);
-    uint64_t flags = SC_ARG3(r);
+    int flags = SC_ARG2(r);
+
+    if (handle->mode & O_NONBLOCK) {
+        flags |= MSG_DONTWAIT; // Don't wait if socket marked as nonblock
+    }
 
     if ((handle->node->flags & FS_NODE_TYPE) != FS_NODE_SOCKET) {
 
@@ -937,46 +1144,13 @@ long SysSendMsg(RegisterContext* r) {
         return -EFAULT;
     }
 
-    if (!Memory::CheckUsermodePointer((uintptr_t)msg->msg_iov, sizeof(iovec) * msg->msg_iovlen, proc->addressSpace)) {
-
-        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal, { Log::Warning("SysSendMsg: msg: Invalid iovec ptr"); });
-        return -EFAULT;
-    }
-
-    if (msg->msg_name && msg->msg_namelen &&
-        !Memory::CheckUsermodePointer((uintptr_t)msg->msg_name, msg->msg_namelen, proc->addressSpace)) {
-        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal,
-                 { Log::Warning("SysSendMsg: msg: Invalid name ptr and name not null"); });
-        return -EFAULT;
-    }
-
-    if (msg->msg_control && msg->msg_controllen &&
-        !Memory::CheckUsermodePointer((uintptr_t)msg->msg_control, msg->msg_controllen, proc->addressSpace)) {
-        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal,
-                 { Log::Warning("SysSendMsg: msg: Invalid control ptr and control null"); });
-        return -EFAULT;
+    KernelMessageHeader kmsg;
+    if (long e = CopyMessageHeader(msg, kmsg, proc->addressSpace)) {
+        return e;
     }
 
-    long sent = 0;
     Socket* sock = (Socket*)handle->node;
-
-    for (unsigned i = 0; i < msg->msg_iovlen; i++) {
-        if (!Memory::CheckUsermodePointer((uintptr_t)msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len,
-                                          proc->addressSpace)) {
-            Log::Warning("SysSendMsg: msg: Invalid iovec entry base");
-            return -EFAULT;
-        }
-
-        long ret = sock->SendTo(msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len, flags, (sockaddr*)msg->msg_name,
-                                msg->msg_namelen, msg->msg_control, msg->msg_controllen);
-
-        if (ret < 0)
-            return ret;
-
-        sent += ret;
-    }
-
-    return sent;
+    return sock->SendMsg(&kmsg.msg, flags);
 }
 
 /*
@@ -986,7 +1160,7 @@ long SysSendMsg(RegisterContext* r) {
  * flags - flags
  *
  * On Success - return amount of data received
- * On Failure - return -1
+ * On Failure - return negative error code
  */
 long SysRecvMsg(RegisterContext* r) {
     Process* proc = Scheduler::GetCurrentProcess();
@@ -999,7 +1173,7 @@ long SysRecvMsg(RegisterContext* r) {
     }
 
     msghdr* msg = (msghdr*)SC_ARG1(r);
-    uint64_t flags = SC_ARG3(r);
+    int flags = SC_ARG2(r);
 
     if (handle->mode & O_NONBLOCK) {
         flags |= MSG_DONTWAIT; // Don't wait if socket marked as nonblock
@@ -1016,42 +1190,165 @@ long SysRecvMsg(RegisterContext* r) {
         return -EFAULT;
     }
 
-    if (!Memory::CheckUsermodePointer((uintptr_t)msg->msg_iov, sizeof(iovec) * msg->msg_iovlen, proc->addressSpace)) {
-        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal, { Log::Warning("SysRecvMsg: msg: Invalid iovec ptr"); });
-        return -EFAULT;
+    KernelMessageHeader kmsg;
+    if (long e = CopyMessageHeader(msg, kmsg, proc->addressSpace)) {
+        return e;
+    }
+
+    Socket* sock = (Socket*)handle->node;
+
+    kmsg.msg.msg_flags = 0;
+    long ret = sock->ReceiveMsg(&kmsg.msg, flags);
+    if (ret >= 0) {
+        CopyMessageHeaderOut(kmsg, msg);
     }
 
-    if (msg->msg_control && msg->msg_controllen &&
-        !Memory::CheckUsermodePointer((uintptr_t)msg->msg_control, msg->msg_controllen, proc->addressSpace)) {
+    return ret;
+}
+
+/////////////////////////////
+/// \brief SysSendMMsg (sockfd, msgvec, vlen, flags) - Send several messages through a socket in one call
+///
+/// \param sockfd Socket file descriptor
+/// \param msgvec Array of mmsghdr, msg_len is set to the bytes sent for each message
+/// \param vlen Length of msgvec, only the first SOCKET_IOV_MAX messages are sent
+/// \param flags Flags for every message
+///
+/// \return Number of messages sent, or negative error code if the first could not be sent
+/////////////////////////////
+long SysSendMMsg(RegisterContext* r) {
+    Process* proc = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<UNIXOpenFile> handle = SC_TRY_OR_ERROR(proc->GetHandleAs<UNIXOpenFile>(SC_ARG0(r)));
+    if (!handle) {
         IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal,
-                 { Log::Warning("SysRecvMsg: msg: Invalid control ptr and control null"); });
+                 { Log::Warning("SysSendMMsg: Invalid File Descriptor: %d", SC_ARG0(r)); });
+        return -EBADF;
+    }
+
+    mmsghdr* msgvec = (mmsghdr*)SC_ARG1(r);
+    unsigned vlen = MIN(SC_ARG2(r), SOCKET_IOV_MAX);
+    int flags = SC_ARG3(r);
+
+    if (handle->mode & O_NONBLOCK) {
+        flags |= MSG_DONTWAIT;
+    }
+
+    if ((handle->node->flags & FS_NODE_TYPE) != FS_NODE_SOCKET) {
+        return -ENOTSOCK;
+    }
+
+    if (!Memory::CheckUsermodePointer(SC_ARG1(r), sizeof(mmsghdr) * vlen, proc->addressSpace)) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal, { Log::Warning("SysSendMMsg: Invalid msgvec ptr"); });
         return -EFAULT;
     }
 
-    long read = 0;
     Socket* sock = (Socket*)handle->node;
 
-    for (unsigned i = 0; i < msg->msg_iovlen; i++) {
-        if (!Memory::CheckUsermodePointer((uintptr_t)msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len,
-                                          proc->addressSpace)) {
-            Log::Warning("SysRecvMsg: msg: Invalid iovec entry base");
+    unsigned sent = 0;
+    while (sent < vlen) {
+        KernelMessageHeader kmsg;
+
+        long ret = CopyMessageHeader(&msgvec[sent].msg_hdr, kmsg, proc->addressSpace);
+        if (!ret) {
+            ret = sock->SendMsg(&kmsg.msg, flags);
+        }
+
+        if (ret < 0) {
+            // As with Linux, an error after the first message is reported by returning less than vlen
+            return sent ? sent : ret;
+        }
+
+        msgvec[sent++].msg_len = ret;
+    }
+
+    return sent;
+}
+
+/////////////////////////////
+/// \brief SysRecvMMsg (sockfd, msgvec, vlen, flags, timeout) - Receive several messages from a socket in one call
+///
+/// With MSG_WAITFORONE only the first message is waited for.
+/// The timeout is checked after each message, like Linux it does not limit how long we block for a message.
+///
+/// \param sockfd Socket file descriptor
+/// \param msgvec Array of mmsghdr, msg_len is set to the bytes received for each message
+/// \param vlen Length of msgvec, at most SOCKET_IOV_MAX messages are received
+/// \param flags Flags for every message
+/// \param timeout (timespec) Stop receiving once this has passed, can be null
+///
+/// \return Number of messages received, or negative error code if none were
+/////////////////////////////
+long SysRecvMMsg(RegisterContext* r) {
+    Process* proc = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<UNIXOpenFile> handle = SC_TRY_OR_ERROR(proc->GetHandleAs<UNIXOpenFile>(SC_ARG0(r)));
+    if (!handle) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal,
+                 { Log::Warning("SysRecvMMsg: Invalid File Descriptor: %d", SC_ARG0(r)); });
+        return -EBADF;
+    }
+
+    mmsghdr* msgvec = (mmsghdr*)SC_ARG1(r);
+    unsigned vlen = MIN(SC_ARG2(r), SOCKET_IOV_MAX);
+    int flags = SC_ARG3(r);
+    timespec* timeout = (timespec*)SC_ARG4(r);
+
+    if (handle->mode & O_NONBLOCK) {
+        flags |= MSG_DONTWAIT;
+    }
+
+    if ((handle->node->flags & FS_NODE_TYPE) != FS_NODE_SOCKET) {
+        return -ENOTSOCK;
+    }
+
+    if (!Memory::CheckUsermodePointer(SC_ARG1(r), sizeof(mmsghdr) * vlen, proc->addressSpace)) {
+        IF_DEBUG(debugLevelSyscalls >= DebugLevelNormal, { Log::Warning("SysRecvMMsg: Invalid msgvec ptr"); });
+        return -EFAULT;
+    }
+
+    uint64_t deadline = 0;
+    if (timeout) {
+        if (!Memory::CheckUsermodePointer(SC_ARG4(r), sizeof(timespec), proc->addressSpace)) {
             return -EFAULT;
+        } else if (timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000) {
+            return -EINVAL;
         }
 
-        socklen_t len = msg->msg_namelen;
-        long ret =
-            sock->ReceiveFrom(msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len, flags,
-                              reinterpret_cast<sockaddr*>(msg->msg_name), &len, msg->msg_control, msg->msg_controllen);
-        msg->msg_namelen = len;
+        deadline = Timer::NanosecondsSinceBoot() + timeout->tv_sec * 1000000000ULL + timeout->tv_nsec;
+    }
+
+    Socket* sock = (Socket*)handle->node;
+
+    unsigned received = 0;
+    while (received < vlen) {
+        msghdr* msg = &msgvec[received].msg_hdr;
+        KernelMessageHeader kmsg;
+
+        long ret = CopyMessageHeader(msg, kmsg, proc->addressSpace);
+        if (!ret) {
+            kmsg.msg.msg_flags = 0;
+            ret = sock->ReceiveMsg(&kmsg.msg, flags);
+        }
 
         if (ret < 0) {
-            return ret;
+            return received ? received : ret;
+        }
+
+        CopyMessageHeaderOut(kmsg, msg);
+
+        msgvec[received++].msg_len = ret;
+
+        if (flags & MSG_WAITFORONE) {
+            flags |= MSG_DONTWAIT; // Take whatever else is already queued
         }
 
-        read += ret;
+        if (timeout && Timer::NanosecondsSinceBoot() >= deadline) {
+            break;
+        }
     }
 
-    return read;
+    return received;
 }
 
 /////////////////////////////
@@ -1639,6 +1936,51 @@ long SysEndpointInfo(RegisterContext* r) {
     return 0;
 }
 
+/////////////////////////////
+/// \brief SysEndpointMapRing (endpoint, info)
+///
+/// Map the shared memory rings of an endpoint pair.
+/// Once mapped, messages sent to the endpoint are written to the ring.
+///
+/// \param endpoint (handle_t) Endpoint handle
+/// \param info (lemon_endpoint_ring_info_t*) Ring information to be populated
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+long SysEndpointMapRing(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    UserPointer<lemon_endpoint_ring_info_t> info = SC_ARG1(r);
+
+    FancyRefPtr<MessageEndpoint> endpoint = SC_TRY_OR_ERROR(currentProcess->GetHandleAs<MessageEndpoint>(SC_ARG0(r)));
+
+    lemon_endpoint_ring_info_t ringInfo;
+    if (long ret = endpoint->MapRing(currentProcess, ringInfo); ret) {
+        return ret;
+    }
+
+    TRY_STORE_UMODE_VALUE(info, ringInfo);
+    return 0;
+}
+
+/////////////////////////////
+/// \brief SysEndpointNotify (endpoint)
+///
+/// Wake anything waiting on the peer of an endpoint.
+/// Used after writing a message to a ring that was empty.
+///
+/// \param endpoint (handle_t) Endpoint handle
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+long SysEndpointNotify(RegisterContext* r) {
+    Process* currentProcess = Scheduler::GetCurrentProcess();
+
+    FancyRefPtr<MessageEndpoint> endpoint = SC_TRY_OR_ERROR(currentProcess->GetHandleAs<MessageEndpoint>(SC_ARG0(r)));
+
+    return endpoint->Notify();
+}
+
 /////////////////////////////
 /// \brief SysKernelObjectWaitOne (object)
 ///
@@ -1759,6 +2101,8 @@ long SysKernelObjectDestroy(RegisterContext* r) {
     Log::Info("%x", r->rip);
     UserPrintStackTrace(r->rbp, currentProcess->addressSpace);
 
+    ReleaseEndpointRing(currentProcess, SC_ARG0(r));
+
     currentProcess->DestroyHandle(SC_ARG0(r));
     return 0;
 }
@@ -2020,19 +2364,12 @@ long SysUnloadKernelModule(RegisterContext* r) {
     return ModuleManager::UnloadModule(name);
 }
 
-/////////////////////////////
-/// \brief SysFork()
-///
-///	Clone's a process's address space (with copy-on-write), file descriptors and register state
-///
-/// \return Child PID to the calling process
-/// \return 0 to the newly forked child
-/////////////////////////////
-long SysFork(RegisterContext* r) {
+// Create a child of the current process which returns to the same place with a return value of 0
+static FancyRefPtr<Process> ForkCurrentProcess(RegisterContext* r, bool borrowAddressSpace) {
     Process* process = Scheduler::GetCurrentProcess();
     Thread* currentThread = Thread::Current();
 
-    FancyRefPtr<Process> newProcess = process->Fork();
+    FancyRefPtr<Process> newProcess = process->Fork(borrowAddressSpace);
     FancyRefPtr<Thread> thread = newProcess->GetMainThread();
     void* threadKStack = thread->kernelStack; // Save the allocated kernel stack
     void* threadKStackBase = thread->kernelStackBase;
@@ -2047,6 +2384,12 @@ long SysFork(RegisterContext* r) {
     thread->kernelLock = 0;
     thread->stateLock = 0;
 
+    // The copied scheduler state belongs to the current thread
+    thread->cpu = -1;
+    thread->onCPU = false;
+    thread->runQueueArray = -1;
+    thread->next = thread->prev = nullptr;
+
     thread->tid = 1;
 
     thread->blocker = nullptr;
@@ -2055,6 +2398,47 @@ long SysFork(RegisterContext* r) {
     thread->registers.rax = 0; // To the child we return 0
 
     newProcess->Start();
+    return newProcess;
+}
+
+/////////////////////////////
+/// \brief SysFork()
+///
+///	Clone's a process's address space (with copy-on-write), file descriptors and register state
+///
+/// \return Child PID to the calling process
+/// \return 0 to the newly forked child
+/////////////////////////////
+long SysFork(RegisterContext* r) {
+    return ForkCurrentProcess(r, false)->PID(); // Return PID to parent process
+}
+
+/////////////////////////////
+/// \brief SysVFork()
+///
+/// Creates a child which shares the address space of the calling process,
+/// the caller is suspended until the child calls execve or exits.
+/// Nothing gets copied, making this the fast path for a fork followed by exec (e.g. posix_spawn).
+///
+/// The other threads of a multithreaded process would keep running on the shared address space,
+/// so such processes get a regular fork instead, which POSIX allows.
+///
+/// \return Child PID to the calling process
+/// \return 0 to the newly forked child
+/////////////////////////////
+long SysVFork(RegisterContext* r) {
+    Process* process = Scheduler::GetCurrentProcess();
+    if (process->Threads().get_length() > 1) {
+        return SysFork(r);
+    }
+
+    FancyRefPtr<Process> newProcess = ForkCurrentProcess(r, true);
+    while (newProcess->WaitForAddressSpaceRelease()) {
+        if (process->State() != Process::Process_Running) {
+            break; // We are getting killed
+        }
+    }
+
     return newProcess->PID(); // Return PID to parent process
 }
 
@@ -2489,7 +2873,14 @@ syscall_t syscalls[NUM_SYSCALLS]{
     SysEpollCreate,
     SysEPollCtl,
     SysEpollWait, // 110
-    SysFChdir
+    SysFChdir,
+    SysVFork,
+    SysEndpointMapRing,
+    SysEndpointNotify,
+    SysSplice, // 115
+    SysTee,
+    SysSendMMsg,
+    SysRecvMMsg,
 };
 // clang-format on
 
@@ -2559,8 +2950,13 @@ extern "C" void SyscallHandler(RegisterContext* regs) {
     }
 #endif
 
+    uint64_t number = regs->rax;
+    TRACE_EVENT(TraceEventSyscallEntry, number);
+
     regs->rax = syscalls[regs->rax](regs); // Call syscall
 
+    TRACE_EVENT(TraceEventSyscallExit, number, regs->rax);
+
 #ifdef KERNEL_DEBUG
     if (debugLevelSyscalls >= DebugLevelNormal) {
         thread->lastSyscall.result = regs->rax;
@@ -56,62 +56,156 @@ long SysEPollCtl(RegisterContext* r) {
 
     fs::EPoll* epoll = (fs::EPoll*)epHandle->node;
 
-    ScopedSpinLock<true> lockEp(epoll->epLock);
+    struct epoll_event e;
+    if (op == EPOLL_CTL_ADD || op == EPOLL_CTL_MOD) {
+        TRY_GET_UMODE_VALUE(event, e);
+    }
+
+    ScopedSpinLock lockFiles(fs::EPoll::fileItemsLock);
+    ScopedSpinLock lockEp(epoll->epLock);
+
+    // The fd may have been closed and reused since it was added
+    fs::EPollItem* item = epoll->GetItem(fd);
+    if (item && item->file != handle.get()) {
+        item = nullptr;
+    }
 
     if (op == EPOLL_CTL_ADD) {
-        struct epoll_event e;
-        TRY_GET_UMODE_VALUE(event, e);
+        if ((e.events & EPOLLEXCLUSIVE) && (e.events & EPOLLONESHOT)) {
+            return -EINVAL; // EPOLLONESHOT cannot be combined with EPOLLEXCLUSIVE
+        }
+
+        return epoll->AddItem(fd, handle.get(), e);
+    } else if (op == EPOLL_CTL_DEL) {
+        if (!item) {
+            return -ENOENT;
+        }
 
+        epoll->RemoveItem(item);
+        return 0;
+    } else if (op == EPOLL_CTL_MOD) {
         if (e.events & EPOLLEXCLUSIVE) {
-            // Unsupported
-            Log::Warning("SysEPollCtl: EPOLLEXCLUSIVE unsupported!");
+            return -EINVAL; // EPOLLEXCLUSIVE can only be set on EPOLL_CTL_ADD
         }
 
-        if (e.events & EPOLLET) {
-            Log::Warning("SysEPollCtl: EPOLLET unsupported!");
+        if (!item) {
+            return -ENOENT; // fd not found
+        } else if (item->event.events & EPOLLEXCLUSIVE) {
+            return -EINVAL;
         }
 
-        for (const auto& pair : epoll->fds) {
-            if (pair.item1 == fd) {
-                return -EEXIST; // Already watching the fd
-            }
+        epoll->ModifyItem(item, e);
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+// Check which of the requested events a file is ready for
+static uint32_t GetEvents(UNIXOpenFile* handle, uint32_t requested) {
+    uint32_t ev = 0;
+    if (requested & EPOLLIN) {
+        if (handle->node->CanRead()) {
+            ev |= EPOLLIN;
         }
+    }
 
-        epoll->fds.add_back({fd, {e.events, e.data}});
-    } else if (op == EPOLL_CTL_DEL) {
-        for (auto it = epoll->fds.begin(); it != epoll->fds.end(); it++) {
-            if (it->item1 == fd) {
-                epoll->fds.remove(it);
-                return 0;
-            }
+    if (requested & EPOLLOUT) {
+        if (handle->node->CanWrite()) {
+            ev |= EPOLLOUT;
         }
+    }
 
-        return -ENOENT;
-    } else if (op == EPOLL_CTL_MOD) {
-        struct epoll_event* current = nullptr;
-        struct epoll_event e;
-        TRY_GET_UMODE_VALUE(event, e);
+    if (handle->node->IsSocket()) {
+        if (!((Socket*)handle->node)->IsConnected() && !((Socket*)handle->node)->IsListening()) {
+            ev |= EPOLLHUP;
+        }
 
-        if (e.events & EPOLLEXCLUSIVE) {
-            // Not that we support this flag yet,
-            // however for future it can only be
-            // enabled on EPOLL_CTL_ADD.
-            return -EINVAL;
+        if (((Socket*)handle->node)->PendingConnections() && (requested & EPOLLIN)) {
+            ev |= EPOLLIN;
+        }
+    }
+
+    return ev;
+}
+
+#define EPOLL_COLLECT_BATCH 32 // Events gathered under epLock before they are copied out
+
+struct CollectedEvent {
+    fs::EPollItem* item;
+    int fd;
+    epoll_event event;
+};
+
+// Put back items whose events could not be copied out, unless they were removed whilst epLock was dropped
+static void RequeueItems(fs::EPoll* epoll, const CollectedEvent* collected, int count) {
+    ScopedSpinLock lockEp(epoll->epLock);
+
+    for (int i = 0; i < count; i++) {
+        if (epoll->GetItem(collected[i].fd) == collected[i].item) {
+            collected[i].item->disabled = false; // The EPOLLONESHOT event was never reported
+            epoll->QueueItem(collected[i].item, false);
         }
+    }
+}
 
-        for (auto& pair : epoll->fds) {
-            if (pair.item1 == fd) {
-                current = &pair.item2;
-                break;
+// Report the events of ready items, only the items which were signalled get looked at.
+// Checking an item is quick and needs epLock to keep the item and its file alive,
+// but copying to the user buffer can fault and block so it is done with the lock dropped.
+static long CollectEvents(fs::EPoll* epoll, UserBuffer<struct epoll_event>& events, int maxevents) {
+    CollectedEvent collected[EPOLL_COLLECT_BATCH];
+
+    // Level triggered items get requeued behind the items which were ready on entry
+    unsigned remaining;
+    {
+        ScopedSpinLock lockEp(epoll->epLock);
+        remaining = epoll->ReadyCount();
+    }
+
+    int evCount = 0;
+    while (remaining && evCount < maxevents) {
+        int count = 0;
+        {
+            ScopedSpinLock lockEp(epoll->epLock);
+            while (remaining && count < EPOLL_COLLECT_BATCH && evCount + count < maxevents) {
+                remaining--;
+
+                fs::EPollItem* item = epoll->DequeueItem();
+                if (!item) {
+                    remaining = 0;
+                    break;
+                }
+
+                uint32_t ev = GetEvents(item->file, item->event.events);
+                if (!ev) {
+                    continue; // Nothing to report, the node will signal us again once it is ready
+                }
+
+                collected[count++] = {
+                    .item = item,
+                    .fd = item->fd,
+                    .event = {.events = ev, .data = item->event.data},
+                };
+
+                if (item->event.events & EPOLLONESHOT) {
+                    item->disabled = true; // Wait for EPOLL_CTL_MOD
+                } else if (!(item->event.events & EPOLLET)) {
+                    epoll->QueueItem(item, false); // Report again until it is no longer ready
+                }
             }
         }
 
-        if (!current) {
-            return -ENOENT; // fd not found
+        for (int i = 0; i < count; i++) {
+            if (events.StoreValue(evCount, collected[i].event)) {
+                RequeueItems(epoll, collected + i, count - i);
+                return -EFAULT;
+            }
+
+            evCount++;
         }
     }
 
-    return -EINVAL;
+    return evCount;
 }
 
 long SysEpollWait(RegisterContext* r) {
@@ -151,161 +245,35 @@ long SysEpollWait(RegisterContext* r) {
         }
     });
 
-    ScopedSpinLock lockEp(epoll->epLock);
-
-    Vector<int> removeFds; // Fds to unwatch
-    auto getEvents = [removeFds](FancyRefPtr<UNIXOpenFile>& handle, uint32_t requested, int& evCount) -> uint32_t {
-        uint32_t ev = 0;
-        if (requested & EPOLLIN) {
-            if (handle->node->CanRead()) {
-                ev |= EPOLLIN;
-            }
-        }
-
-        if (requested & EPOLLOUT) {
-            if (handle->node->CanWrite()) {
-                ev |= EPOLLOUT;
-            }
-        }
-
-        if (handle->node->IsSocket()) {
-            if (!((Socket*)handle->node)->IsConnected() && !((Socket*)handle->node)->IsListening()) {
-                ev |= EPOLLHUP;
-            }
-
-            if (((Socket*)handle->node)->PendingConnections() && (requested & EPOLLIN)) {
-                ev |= EPOLLIN;
-            }
-        }
-
-        if (ev) {
-            evCount++;
-        }
-
-        return ev;
-    };
-
-    auto epollToPollEvents = [](uint32_t ep) -> int {
-        int evs = 0;
-        if (ep & EPOLLIN) {
-            evs |= POLLIN;
-        }
-
-        if (ep & EPOLLOUT) {
-            evs |= POLLOUT;
-        }
-
-        if (ep & EPOLLHUP) {
-            evs |= POLLHUP;
-        }
-
-        if (ep & EPOLLRDHUP) {
-            evs |= POLLRDHUP;
-        }
-
-        if (ep & EPOLLERR) {
-            evs |= POLLERR;
-        }
-
-        if (ep & EPOLLPRI) {
-            evs |= POLLPRI;
-        }
-
-        return evs;
-    };
-
-    struct EPollFD {
-        FancyRefPtr<UNIXOpenFile> handle;
-        int fd;
-        struct epoll_event ev;
-    };
-
-    Vector<EPollFD> files;
-    int evCount = 0; // Amount of fds with events
-    for (const auto& pair : epoll->fds) {
-        auto result = proc->GetHandleAs<UNIXOpenFile>(pair.item1);
-        if (result.HasError()) {
-            continue; // Ignore closed fds
-        }
-
-        auto handle = std::move(result.Value());
-
-        if (uint32_t ev = getEvents(handle, pair.item2.events, evCount); ev) {
-            if (events.StoreValue(evCount - 1, {
-                                                   .events = ev,
-                                                   .data = pair.item2.data,
-                                               })) {
-                return -EFAULT;
-            }
-        }
-
-        if (evCount > 0) {
-            if (pair.item2.events & EPOLLONESHOT) {
-                removeFds.add_back(pair.item1);
+    for (;;) {
+        long evCount = CollectEvents(epoll, events, maxevents);
+        if (evCount) {
+            // Only one waiter gets woken for each event,
+            // pass on anything we did not take
+            if (epoll->HasReadyItems()) {
+                epoll->WakeWaiter();
             }
-        } else {
-            files.add_back(
-                {handle, pair.item1, pair.item2}); // We only need the handle for later if events were not found
-        }
 
-        if (evCount >= maxevents) {
-            goto done; // Reached max events/fds
+            return evCount;
+        } else if (!timeout) {
+            return 0;
         }
-    }
 
-    if (evCount > 0) {
-        goto done;
-    }
+        FilesystemBlocker bl(epoll);
 
-    if (!evCount && timeout) {
-        FilesystemWatcher fsWatcher;
-        for (auto& file : files) {
-            fsWatcher.WatchNode(file.handle->node, epollToPollEvents(file.ev.events));
+        // An item may have been queued before the blocker was added
+        if (epoll->HasReadyItems()) {
+            continue;
         }
 
-        while (!evCount) {
-            if (timeout > 0) {
-                if (fsWatcher.WaitTimeout(timeout)) {
-                    return -EINTR; // Interrupted
-                } else if (timeout <= 0) {
-                    return 0; // Timed out
-                }
-            } else if (fsWatcher.Wait()) {
+        if (timeout > 0) {
+            if (thread->Block(&bl, timeout)) {
                 return -EINTR; // Interrupted
+            } else if (timeout <= 0) {
+                return 0; // Timed out
             }
-
-            for (auto& handle : files) {
-                if (uint32_t ev = getEvents(handle.handle, handle.ev.events, evCount); ev) {
-                    if (events.StoreValue(evCount - 1, {
-                                                           .events = ev,
-                                                           .data = handle.ev.data,
-                                                       })) {
-                        return -EFAULT;
-                    }
-                }
-
-                if (evCount > 0) {
-                    if (handle.ev.events & EPOLLONESHOT) {
-                        removeFds.add_back(handle.fd);
-                    }
-                }
-
-                if (evCount >= maxevents) {
-                    goto done; // Reached max events/fds
-                }
-            }
+        } else if (thread->Block(&bl)) {
+            return -EINTR; // Interrupted
         }
     }
-
-done:
-    for (int fd : removeFds) {
-        for (auto it = epoll->fds.begin(); it != epoll->fds.end(); it++) {
-            if (it->item1 == fd) {
-                epoll->fds.remove(it);
-                break;
-            }
-        }
-    }
-
-    return evCount;
 }
@@ -2,6 +2,7 @@
 #include <Syscalls.h>
 
 #include <Fs/Pipe.h>
+#include <ABI/Pipe.h>
 #include <Net/Socket.h>
 
 #include <StackTrace.h>
@@ -115,7 +116,7 @@ open:
     }
 
     if (flags & O_TRUNC && ((flags & O_ACCESS) == O_RDWR || (flags & O_ACCESS) == O_WRONLY)) {
-        node->Truncate(0);
+        fs::Truncate(node, 0);
     }
 
     FancyRefPtr<UNIXOpenFile> handle = SC_TRY_OR_ERROR(fs::Open(node, SC_ARG1(r)));
@@ -292,6 +293,8 @@ long SysFStat(RegisterContext* r) {
         stat->st_mode |= S_IFLNK;
     if ((node->flags & FS_NODE_TYPE) == FS_NODE_SOCKET)
         stat->st_mode |= S_IFSOCK;
+    if ((node->flags & FS_NODE_TYPE) == FS_NODE_FIFO)
+        stat->st_mode |= S_IFIFO;
 
     stat->st_nlink = 0;
     stat->st_uid = node->uid;
@@ -1113,3 +1116,128 @@ long SysPipe(RegisterContext* r) {
 
     return 0;
 }
+
+/////////////////////////////
+/// \brief SysSplice(fdIn, offIn, fdOut, offOut, len, flags)
+///
+/// Move data between a pipe and another file without copying it through userspace.
+/// Either fdIn or fdOut must be a pipe.
+///
+/// \param fdIn File descriptor to read from
+/// \param offIn (off_t*) Offset to read from when fdIn is not a pipe, if null the file position is used
+/// \param fdOut File descriptor to write to
+/// \param offOut (off_t*) Offset to write at when fdOut is not a pipe, if null the file position is used
+/// \param len Maximum amount of bytes to move
+/// \param flags Can be any of SPLICE_F_MOVE and SPLICE_F_NONBLOCK
+///
+/// \return Bytes moved (0 on end of file) or negative error code
+/////////////////////////////
+long SysSplice(RegisterContext* r) {
+    Process* process = Process::Current();
+
+    FancyRefPtr<UNIXOpenFile> in = SC_TRY_OR_ERROR(process->GetHandleAs<UNIXOpenFile>(SC_ARG0(r)));
+    UserPointer<off_t> offIn = SC_ARG1(r);
+    FancyRefPtr<UNIXOpenFile> out = SC_TRY_OR_ERROR(process->GetHandleAs<UNIXOpenFile>(SC_ARG2(r)));
+    UserPointer<off_t> offOut = SC_ARG3(r);
+    size_t len = SC_ARG4(r);
+    int flags = SC_ARG5(r);
+
+    if (!in || !out) {
+        return -EBADF;
+    }
+
+    if (flags & ~(SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) {
+        return -EINVAL;
+    }
+
+    bool nonBlock = flags & SPLICE_F_NONBLOCK;
+    UNIXPipe* inPipe = in->node->IsFIFO() ? reinterpret_cast<UNIXPipe*>(in->node) : nullptr;
+    UNIXPipe* outPipe = out->node->IsFIFO() ? reinterpret_cast<UNIXPipe*>(out->node) : nullptr;
+
+    // Linux refuses to splice a pipe to itself, which could otherwise wait forever on a full pipe
+    if (in == out || (inPipe && outPipe && inPipe->SharesBufferWith(outPipe))) {
+        return -EINVAL;
+    }
+
+    ssize_t ret;
+    if (inPipe) {
+        if (offIn || !inPipe->IsReadEnd()) {
+            return -ESPIPE;
+        }
+
+        off_t offset;
+        if (offOut) {
+            TRY_GET_UMODE_VALUE(offOut, offset);
+        }
+
+        ret = inPipe->SpliceTo(out, offOut ? &offset : nullptr, len, nonBlock);
+
+        if (offOut && ret > 0) {
+            TRY_STORE_UMODE_VALUE(offOut, offset);
+        }
+    } else if (outPipe) {
+        if (offOut || !outPipe->IsWriteEnd()) {
+            return -ESPIPE;
+        }
+
+        off_t offset;
+        if (offIn) {
+            TRY_GET_UMODE_VALUE(offIn, offset);
+        }
+
+        ret = outPipe->SpliceFrom(in, offIn ? &offset : nullptr, len, nonBlock);
+
+        if (offIn && ret > 0) {
+            TRY_STORE_UMODE_VALUE(offIn, offset);
+        }
+    } else {
+        return -EINVAL;
+    }
+
+    return ret;
+}
+
+/////////////////////////////
+/// \brief SysTee(fdIn, fdOut, len, flags)
+///
+/// Copy data from one pipe to another without consuming it
+///
+/// \param fdIn Read end of a pipe
+/// \param fdOut Write end of another pipe
+/// \param len Maximum amount of bytes to copy
+/// \param flags Can be any of SPLICE_F_MOVE and SPLICE_F_NONBLOCK
+///
+/// \return Bytes copied (0 on end of file) or negative error code
+/////////////////////////////
+long SysTee(RegisterContext* r) {
+    Process* process = Process::Current();
+
+    FancyRefPtr<UNIXOpenFile> in = SC_TRY_OR_ERROR(process->GetHandleAs<UNIXOpenFile>(SC_ARG0(r)));
+    FancyRefPtr<UNIXOpenFile> out = SC_TRY_OR_ERROR(process->GetHandleAs<UNIXOpenFile>(SC_ARG1(r)));
+    size_t len = SC_ARG2(r);
+    int flags = SC_ARG3(r);
+
+    if (!in || !out) {
+        return -EBADF;
+    }
+
+    if (flags & ~(SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) {
+        return -EINVAL;
+    }
+
+    if (!in->node->IsFIFO() || !out->node->IsFIFO()) {
+        return -EINVAL;
+    }
+
+    UNIXPipe* inPipe = reinterpret_cast<UNIXPipe*>(in->node);
+    UNIXPipe* outPipe = reinterpret_cast<UNIXPipe*>(out->node);
+    if (!inPipe->IsReadEnd() || !outPipe->IsWriteEnd()) {
+        return -EBADF;
+    }
+
+    if (inPipe->SharesBufferWith(outPipe)) {
+        return -EINVAL;
+    }
+
+    return inPipe->Tee(outPipe, len, flags & SPLICE_F_NONBLOCK);
+}
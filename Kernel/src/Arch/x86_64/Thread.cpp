@@ -373,6 +373,9 @@ void Thread::Unblock() {
     if (state != ThreadStateZombie)
         state = ThreadStateRunning;
 
+    // Blocked threads are not kept in the run queue
+    Scheduler::Wake(this);
+
     releaseLock(&stateLock);
     if(intsWereEnabled)
         asm volatile("sti");
@@ -3,98 +3,280 @@
 
 #include <MiscHdr.h>
 
+#include <ACPI.h>
 #include <APIC.h>
 #include <CPU.h>
 #include <IDT.h>
-#include <List.h>
+#include <IOPorts.h>
 #include <Logging.h>
+#include <MM/KMalloc.h>
+#include <Paging.h>
+#include <Profiler.h>
 #include <Scheduler.h>
-#include <IOPorts.h>
+
+#define PIT_FREQUENCY 1193182
+
+#define HPET_REGISTER_CAPABILITIES 0x0
+#define HPET_REGISTER_CONFIGURATION 0x10
+#define HPET_REGISTER_MAIN_COUNTER 0xF0
+#define HPET_CONFIGURATION_ENABLE 0x1
+
+#define MSR_IA32_TSC_DEADLINE 0x6E0
+
+// Period over which the TSC and local APIC timer are measured
+#define TIMER_CALIBRATION_US 10000
 
 namespace Timer {
-int frequency = 1000;         // Timer frequency
-uint64_t ticks = 0; // System uptime in ticks since the timer was initialized
-uint64_t uptimeUs = 0; // System uptime in microseconds
-long pendingTicks = 0; // If the sleep queue is locked add ticks here
+int frequency = 1000;          // Scheduler tick frequency
+uint64_t tickPeriodNs = 1000000; // Scheduler tick period in nanoseconds
+
+// Until the TSC has been calibrated, time is kept by counting PIT interrupts
+uint64_t pitTicks = 0;
+uint64_t pitUptimeNs = 0;
+
+bool tscCalibrated = false;
+uint64_t tscBase = 0;           // TSC value when calibrated
+uint64_t tscBaseNs = 0;         // Uptime when calibrated
+uint64_t tscFrequency = 0;      // TSC ticks per second
+uint64_t tscToNsMultiplier = 0; // ns = (tsc * tscToNsMultiplier) >> 32
+uint64_t nsToTSCMultiplier = 0; // tsc = (ns * nsToTSCMultiplier) >> 24
+
+// Once set, each CPU programs its own local APIC timer and the PIT is no longer used
+bool localTimersEnabled = false;
+bool useTSCDeadline = false;
+uint64_t localTimerFrequency = 0;      // Local APIC timer ticks per second
+uint64_t nsToLocalTimerMultiplier = 0; // count = (ns * nsToLocalTimerMultiplier) >> 32
+
+ALWAYS_INLINE static uint64_t TSCToNs(uint64_t tsc) {
+    return static_cast<uint64_t>((static_cast<unsigned __int128>(tsc) * tscToNsMultiplier) >> 32);
+}
 
-lock_t sleepQueueLock = 0;
+ALWAYS_INLINE static uint64_t NsToTSC(uint64_t ns) {
+    return static_cast<uint64_t>((static_cast<unsigned __int128>(ns) * nsToTSCMultiplier) >> 24);
+}
 
-// In the sleep queue, all waiting threads have a counter as an offset from the previous waiting thread.
-// For example there are 2 threads, thread 1 is waiting for 10 ticks and thread 2 is waiting for 15 ticks.
-// Thread 1's ticks value will be 10, and as 15 - 10 is 5, thread 2's value will be 5 so it waits 5 ticks after thread 1
-FastList<TimerEvent*> sleeping;
+ALWAYS_INLINE static void WriteMSR(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" ::"a"(value & 0xFFFFFFFF), "d"(value >> 32), "c"(msr));
+}
 
-TimerEvent::TimerEvent(long _us, void (*_callback)(void*), void* _data)
-    : ticks(_us * frequency / 1000000), callback(_callback), data(_data) {
-    if (ticks <= 0) {
-        callback(data);
+// Program this CPU's timer to fire at deadline, UINT64_MAX stops the timer
+static void ProgramLocalTimer(TimerQueue* queue, uint64_t deadline) {
+    assert(!CheckInterrupts());
+
+    if (!localTimersEnabled) {
+        return; // The PIT is still in use
+    }
+
+    queue->armedDeadline = deadline;
+    if (deadline == UINT64_MAX) {
+        // Nothing to wait for, so do not interrupt the CPU at all
+        if (useTSCDeadline) {
+            WriteMSR(MSR_IA32_TSC_DEADLINE, 0);
+        } else {
+            APIC::Local::SetTimerInitialCount(0);
+        }
+        return;
+    }
+
+    if (useTSCDeadline) {
+        // A deadline from before the TSC was calibrated has passed, fire straight away
+        // rather than letting the subtraction wrap around to a deadline far in the future
+        if (deadline < tscBaseNs) {
+            deadline = tscBaseNs;
+        }
+
+        WriteMSR(MSR_IA32_TSC_DEADLINE, tscBase + NsToTSC(deadline - tscBaseNs));
         return;
     }
 
-    acquireLock(&sleepQueueLock);
+    uint64_t now = NanosecondsSinceBoot();
+    uint64_t count = 1;
+    if (deadline > now) {
+        count = static_cast<uint64_t>(
+            (static_cast<unsigned __int128>(deadline - now) * nsToLocalTimerMultiplier) >> 32);
+    }
 
-    TimerEvent* ev = sleeping.get_front();
-    while (ev) {
-        if (ev->ticks >= ticks) { // See if we need to insert in middle of queue
-            ev->ticks -= ticks;
-            sleeping.insert(this, ev); // Insert before
+    // If the count does not fit, the timer will fire early and get reprogrammed
+    if (count > UINT32_MAX) {
+        count = UINT32_MAX;
+    } else if (!count) {
+        count = 1;
+    }
+
+    APIC::Local::SetTimerInitialCount(count);
+}
+
+// Program the timer for the earliest of the next event and, if there is a thread to preempt, the next scheduler tick
+static void ArmLocalTimer(TimerQueue* queue, bool preempt) {
+    acquireLock(&queue->lock);
+    uint64_t deadline = queue->NextDeadline();
+    releaseLock(&queue->lock);
+
+    if (preempt && queue->nextTick < deadline) {
+        deadline = queue->nextTick;
+    }
+
+    // Idle CPUs are not sampled
+    if (preempt && __atomic_load_n(&Profiler::enabled, __ATOMIC_RELAXED) && queue->nextSample < deadline) {
+        deadline = queue->nextSample;
+    }
+
+    ProgramLocalTimer(queue, deadline);
+}
+
+void TimerQueue::Place(TimerEvent* event, unsigned index) {
+    m_heap[index] = event;
+    event->heapIndex = index;
+}
+
+void TimerQueue::SiftUp(unsigned index) {
+    TimerEvent* event = m_heap[index];
+    while (index > 0) {
+        unsigned parent = (index - 1) / 2;
+        if (m_heap[parent]->deadline <= event->deadline) {
+            break;
+        }
+
+        Place(m_heap[parent], index);
+        index = parent;
+    }
+
+    Place(event, index);
+}
 
-            releaseLock(&sleepQueueLock);
-            return;
+void TimerQueue::SiftDown(unsigned index) {
+    TimerEvent* event = m_heap[index];
+    for (;;) {
+        unsigned child = index * 2 + 1;
+        if (child >= m_count) {
+            break;
         }
 
-        ticks -= ev->ticks;
-        ev = ev->next;
+        if (child + 1 < m_count && m_heap[child + 1]->deadline < m_heap[child]->deadline) {
+            child++;
+        }
 
-        if (ev == sleeping.get_front()) {
+        if (event->deadline <= m_heap[child]->deadline) {
             break;
         }
+
+        Place(m_heap[child], index);
+        index = child;
     }
 
-    sleeping.add_back(this); // Add to back
-    releaseLock(&sleepQueueLock);
+    Place(event, index);
 }
 
-TimerEvent::~TimerEvent() {
-    acquireLock(&sleepQueueLock);
-    acquireLock(&lock);
+void TimerQueue::Insert(TimerEvent* event) {
+    if (m_count >= m_capacity) {
+        m_capacity = m_capacity ? m_capacity * 2 : 32;
+        m_heap = reinterpret_cast<TimerEvent**>(krealloc(m_heap, m_capacity * sizeof(TimerEvent*)));
+    }
 
-    if (!dispatched) {
-        dispatched = true;
+    event->queue = this;
+    Place(event, m_count);
+    SiftUp(m_count++);
+}
 
-        if (next) {
-            if (next && ticks >= 0 && next != sleeping.get_front()) { // Make sure not at end of list
-                next->ticks += ticks;
-            }
+void TimerQueue::Remove(TimerEvent* event) {
+    unsigned index = event->heapIndex;
+    assert(index < m_count && m_heap[index] == event);
 
-            sleeping.remove(this); // Remove from queue
-        }
+    TimerEvent* last = m_heap[--m_count];
+    if (last != event) {
+        // The last event could belong either above or below the removed event
+        Place(last, index);
+        SiftDown(index);
+        SiftUp(last->heapIndex);
     }
 
-    releaseLock(&sleepQueueLock);
-    releaseLock(&lock);
+    event->queue = nullptr;
 }
 
-void TimerEvent::Dispatch() {
+void TimerQueue::DispatchExpired(uint64_t now) {
     acquireLock(&lock);
-    if (!dispatched) {
-        dispatched = true;
-        sleeping.remove(this);
+    while (m_count && m_heap[0]->deadline <= now) {
+        TimerEvent* event = m_heap[0];
+
+        // Lock the event before it leaves the queue,
+        // the destructor will then wait for the callback to finish
+        event->Lock();
+        Remove(event);
+        event->dispatched = true;
+
+        releaseLock(&lock);
+        event->callback(event->data);
+        event->Unlock();
+
+        acquireLock(&lock);
+    }
+    releaseLock(&lock);
+}
 
+TimerEvent::TimerEvent(long _us, TimerCallback _callback, void* _data) : callback(_callback), data(_data) {
+    if (_us <= 0) {
         callback(data);
+        return;
     }
+
+    // Stay on this CPU until its timer has been programmed
+    InterruptDisabler disableInterrupts;
+
+    TimerQueue* cpuQueue = GetCPULocal()->timerQueue;
+    assert(cpuQueue);
+
+    deadline = NanosecondsSinceBoot() + static_cast<uint64_t>(_us) * 1000;
+
+    acquireLock(&cpuQueue->lock);
+    cpuQueue->Insert(this);
+    bool isNextEvent = (heapIndex == 0);
+    releaseLock(&cpuQueue->lock);
+
+    if (isNextEvent && deadline < cpuQueue->armedDeadline) {
+        ProgramLocalTimer(cpuQueue, deadline);
+    }
+}
+
+TimerEvent::~TimerEvent() {
+    InterruptDisabler disableInterrupts;
+
+    if (TimerQueue* q = queue) {
+        acquireLock(&q->lock);
+        if (queue == q) {
+            q->Remove(this); // Not yet dispatched
+        }
+        dispatched = true;
+        releaseLock(&q->lock);
+
+        // If the timer was programmed for this event it will fire early and be reprogrammed
+    }
+
+    // Wait for the callback if it is running
+    acquireLock(&lock);
     releaseLock(&lock);
 }
 
-uint64_t GetSystemUptime() { return uptimeUs / 1000000; }
-uint64_t UsecondsSinceBoot() { return uptimeUs; }
-uint64_t GetTicks() { return ticks; }
+uint64_t NanosecondsSinceBoot() {
+    if (__builtin_expect(tscCalibrated, 1)) {
+        uint64_t tsc = ReadTSC();
+        if (__builtin_expect(tsc < tscBase, 0)) {
+            return tscBaseNs; // This CPU's TSC is slightly behind the one used for calibration
+        }
 
-uint32_t GetFrequency() { return frequency; }
+        return tscBaseNs + TSCToNs(tsc - tscBase);
+    }
+
+    return __atomic_load_n(&pitUptimeNs, __ATOMIC_RELAXED);
+}
 
-inline uint64_t UsToTicks(long us) { return us * frequency / 1000000; }
+uint64_t GetSystemUptime() { return NanosecondsSinceBoot() / 1000000000; }
+uint64_t UsecondsSinceBoot() { return NanosecondsSinceBoot() / 1000; }
+
+uint32_t GetFrequency() { return frequency; }
 
 timeval GetSystemUptimeStruct() {
+    uint64_t uptimeUs = UsecondsSinceBoot();
+
     timeval tval;
     tval.tv_sec = uptimeUs / 1000000;
     tval.tv_usec = uptimeUs - tval.tv_sec * 1000000;
@@ -113,50 +295,219 @@ void SleepCurrentThread(timeval& time) { Thread::Current()->Sleep(time.tv_sec *
 void Wait(long ms) {
     assert(ms > 0);
 
-    ms = ms * 1000 + uptimeUs;
-    while (uptimeUs <= static_cast<unsigned long>(ms))
+    uint64_t end = NanosecondsSinceBoot() + ms * 1000000;
+    while (NanosecondsSinceBoot() <= end)
         asm volatile("pause");
 }
 
-// Timer handler
+// PIT handler, only used until the local APIC timers have been set up
 void Handler(void*, RegisterContext* r) {
-    ticks++;
-    __atomic_store_n(&uptimeUs, ticks * 1000000 / frequency, __ATOMIC_RELAXED);
-
-    pendingTicks++;
-    if (!(acquireTestLock(&sleepQueueLock))) {
-        while (sleeping.get_length() &&
-               pendingTicks-- >
-                   0) { // Make sure the queue has not changed inbetween checking the length and acquiring the lock
-            TimerEvent* cnt = sleeping.get_front();
-
-            assert(cnt);
-            cnt->ticks--;
-
-            if (cnt->ticks <= 0) {
-                sleeping.get_front()->Dispatch();
-
-                while (sleeping.get_length() && sleeping.get_front()->ticks <= 0) {
-                    sleeping.get_front()->Dispatch();
-                }
-            }
-        }
-        pendingTicks = 0;
+    if (localTimersEnabled) {
+        return;
+    }
+
+    pitTicks++;
+    __atomic_store_n(&pitUptimeNs, pitTicks * 1000000000 / frequency, __ATOMIC_RELAXED);
 
-        releaseLock(&sleepQueueLock);
+    if (TimerQueue* queue = GetCPULocal()->timerQueue) {
+        queue->DispatchExpired(NanosecondsSinceBoot());
     }
 
     Scheduler::Tick(r);
 }
 
+void LocalTimerHandler(void*, RegisterContext* r) {
+    CPU* cpu = GetCPULocal();
+    TimerQueue* queue = cpu->timerQueue;
+
+    queue->armedDeadline = UINT64_MAX; // One shot, so the timer is no longer armed
+
+    uint64_t now = NanosecondsSinceBoot();
+
+    // Sample before an event or the tick can switch threads
+    if (__atomic_load_n(&Profiler::enabled, __ATOMIC_RELAXED) && now >= queue->nextSample) {
+        Profiler::Sample(r);
+        queue->nextSample = now + Profiler::samplePeriodNs;
+    }
+
+    queue->DispatchExpired(now);
+
+    // The timer may have fired for an event rather than a tick
+    bool tickDue = now >= queue->nextTick;
+    if (tickDue) {
+        queue->nextTick = now + tickPeriodNs;
+    }
+
+    // Keep ticking whilst there is a thread to preempt, idle CPUs only wake for events
+    bool preempt = cpu->currentThread && cpu->currentThread != cpu->idleThread;
+    ArmLocalTimer(queue, preempt);
+
+    if (tickDue) {
+        Scheduler::Tick(r);
+    }
+}
+
+void RearmLocalTimer(bool preempt) {
+    assert(!CheckInterrupts());
+
+    // When switching to the idle thread, the tick stops after the next interrupt
+    if (!localTimersEnabled || !preempt) {
+        return;
+    }
+
+    TimerQueue* queue = GetCPULocal()->timerQueue;
+
+    uint64_t now = NanosecondsSinceBoot();
+    if (queue->nextTick <= now) {
+        queue->nextTick = now + tickPeriodNs; // We were idle, start ticking again
+    }
+
+    uint64_t deadline = queue->nextTick;
+    if (__atomic_load_n(&Profiler::enabled, __ATOMIC_RELAXED)) {
+        if (queue->nextSample <= now) {
+            queue->nextSample = now + Profiler::samplePeriodNs;
+        }
+
+        if (queue->nextSample < deadline) {
+            deadline = queue->nextSample;
+        }
+    }
+
+    if (queue->armedDeadline > deadline) {
+        ProgramLocalTimer(queue, deadline);
+    }
+}
+
+// Busy waits for TIMER_CALIBRATION_US and returns the time actually spent in nanoseconds,
+// the TSC and local APIC timer are sampled at either end
+static uint64_t CalibrationWait(uint64_t& tscStart, uint64_t& tscEnd, uint32_t& lapicEnd) {
+    if (ACPI::hpet && ACPI::hpet->address.address_space == 0 /* System memory */) {
+        volatile uint64_t* hpet = reinterpret_cast<volatile uint64_t*>(Memory::GetIOMapping(ACPI::hpet->address.base));
+
+        uint64_t period = hpet[HPET_REGISTER_CAPABILITIES / 8] >> 32; // Femtoseconds per tick
+        hpet[HPET_REGISTER_CONFIGURATION / 8] |= HPET_CONFIGURATION_ENABLE;
+
+        uint64_t waitTicks = TIMER_CALIBRATION_US * 1000000000ULL / period;
+
+        APIC::Local::SetTimerInitialCount(UINT32_MAX);
+        uint64_t start = hpet[HPET_REGISTER_MAIN_COUNTER / 8];
+        tscStart = ReadTSC();
+
+        uint64_t end;
+        while ((end = hpet[HPET_REGISTER_MAIN_COUNTER / 8]) - start < waitTicks)
+            asm volatile("pause");
+
+        tscEnd = ReadTSC();
+        lapicEnd = APIC::Local::GetTimerCurrentCount();
+
+        return (end - start) * period / 1000000;
+    }
+
+    // Fallback to PIT channel 2 in one shot mode, the gate is controlled through port 0x61
+    uint16_t count = static_cast<uint64_t>(PIT_FREQUENCY) * TIMER_CALIBRATION_US / 1000000;
+
+    outportb(0x61, (inportb(0x61) & ~0x02) | 0x01); // Disable speaker, enable gate
+    outportb(0x43, 0xB0);                           // Channel 2, lobyte/hibyte, mode 0
+    outportb(0x42, count & 0xFF);
+    outportb(0x42, count >> 8);
+
+    // Restart the count by toggling the gate
+    uint8_t gate = inportb(0x61) & ~0x01;
+    outportb(0x61, gate);
+
+    APIC::Local::SetTimerInitialCount(UINT32_MAX);
+    outportb(0x61, gate | 0x01);
+    tscStart = ReadTSC();
+
+    while (!(inportb(0x61) & 0x20)) // Wait for the output to go high
+        asm volatile("pause");
+
+    tscEnd = ReadTSC();
+    lapicEnd = APIC::Local::GetTimerCurrentCount();
+
+    return static_cast<uint64_t>(count) * 1000000000 / PIT_FREQUENCY;
+}
+
+void InitializeLocalTimers() {
+    InterruptDisabler disableInterrupts;
+
+    uint32_t edx;
+    asm volatile("cpuid" : "=d"(edx) : "a"(0x80000007) : "rbx", "rcx");
+    if (!(edx & (1 << 8))) {
+        Log::Warning("[Timer] TSC is not invariant, timekeeping may drift");
+    }
+
+    useTSCDeadline = CPUID().features_ecx & CPUID_ECX_TSC_DEADLINE;
+
+    APIC::Local::SetTimerMode(INTERRUPT_LOCAL_TIMER, LOCAL_APIC_TIMER_MODE_ONE_SHOT | LOCAL_APIC_LVT_MASKED);
+
+    uint64_t tscStart, tscEnd;
+    uint32_t lapicEnd;
+    uint64_t elapsedNs = CalibrationWait(tscStart, tscEnd, lapicEnd);
+
+    APIC::Local::SetTimerInitialCount(0);
+
+    tscFrequency = (tscEnd - tscStart) * 1000000000 / elapsedNs;
+    localTimerFrequency = static_cast<uint64_t>(UINT32_MAX - lapicEnd) * 1000000000 / elapsedNs;
+
+    tscToNsMultiplier = (1000000000ULL << 32) / tscFrequency;
+    nsToTSCMultiplier = (tscFrequency << 24) / 1000000000;
+    nsToLocalTimerMultiplier = (localTimerFrequency << 32) / 1000000000;
+
+    // Carry on from the time kept by the PIT
+    tscBaseNs = pitUptimeNs;
+    tscBase = ReadTSC();
+    tscCalibrated = true;
+
+    Log::Info("[Timer] TSC: %u kHz, Local APIC timer: %u kHz (%s), calibrated with %s", tscFrequency / 1000,
+              localTimerFrequency / 1000, useTSCDeadline ? "TSC deadline" : "one shot",
+              ACPI::hpet ? "HPET" : "PIT");
+
+    IDT::RegisterInterruptHandler(INTERRUPT_LOCAL_TIMER, LocalTimerHandler);
+
+    // Put the PIT into one shot mode so it stops interrupting
+    outportb(0x43, 0x30);
+    outportb(0x40, 0xFF);
+    outportb(0x40, 0xFF);
+
+    localTimersEnabled = true;
+    EnableLocalTimer();
+}
+
+void EnableLocalTimer() {
+    InterruptDisabler disableInterrupts;
+
+    CPU* cpu = GetCPULocal();
+    if (!cpu->timerQueue) {
+        cpu->timerQueue = new TimerQueue();
+    }
+
+    if (useTSCDeadline) {
+        APIC::Local::SetTimerMode(INTERRUPT_LOCAL_TIMER, LOCAL_APIC_TIMER_MODE_TSC_DEADLINE);
+        asm volatile("mfence" ::: "memory"); // Make sure the LVT write lands before the deadline MSR is written
+    } else {
+        APIC::Local::SetTimerMode(INTERRUPT_LOCAL_TIMER, LOCAL_APIC_TIMER_MODE_ONE_SHOT);
+    }
+
+    // Events may have been queued whilst the PIT was in use
+    acquireLock(&cpu->timerQueue->lock);
+    uint64_t deadline = cpu->timerQueue->NextDeadline();
+    releaseLock(&cpu->timerQueue->lock);
+
+    ProgramLocalTimer(cpu->timerQueue, deadline);
+}
+
 // Initialize
 void Initialize(uint32_t freq) {
     IDT::RegisterInterruptHandler(IRQ0, Handler);
 
-    new (&sleeping) FastList<TimerEvent*>();
-
     frequency = freq;
-    uint32_t divisor = 1193182 / freq;
+    tickPeriodNs = 1000000000 / freq;
+
+    // Events created before the local APIC timers are running are dispatched by the PIT handler
+    GetCPULocal()->timerQueue = new TimerQueue();
+
+    uint32_t divisor = PIT_FREQUENCY / freq;
 
     // Send the command byte.
     outportb(0x43, 0x36);
@@ -0,0 +1,171 @@
+#include <Fs/EPoll.h>
+
+#include <Assert.h>
+#include <Errno.h>
+
+namespace fs {
+
+lock_t EPoll::fileItemsLock = 0;
+
+static int EPollToPollEvents(uint32_t ep) {
+    int evs = 0;
+    if (ep & EPOLLIN) {
+        evs |= POLLIN;
+    }
+
+    if (ep & EPOLLOUT) {
+        evs |= POLLOUT;
+    }
+
+    if (ep & EPOLLRDHUP) {
+        evs |= POLLRDHUP;
+    }
+
+    if (ep & EPOLLPRI) {
+        evs |= POLLPRI;
+    }
+
+    return evs | POLLHUP | POLLERR;
+}
+
+EPollItem::EPollItem(EPoll* epoll, int fd, UNIXOpenFile* file, const epoll_event& event)
+    : epoll(epoll), fd(fd), file(file), event(event) {
+    persistent = true;
+    exclusive = event.events & EPOLLEXCLUSIVE;
+}
+
+void EPollItem::Signal() {
+    // Nodes signal whilst holding their watcher lock,
+    // so this never races with the item being removed
+    epoll->QueueItem(this);
+}
+
+EPoll::~EPoll() {
+    ScopedSpinLock lockFiles(fileItemsLock);
+    ScopedSpinLock lockEp(epLock);
+
+    for (EPollItem* item : items) {
+        if (item) {
+            RemoveItem(item);
+        }
+    }
+}
+
+int EPoll::AddItem(int fd, UNIXOpenFile* file, const epoll_event& event) {
+    if (EPollItem* item = GetItem(fd); item) {
+        if (item->file == file) {
+            return -EEXIST; // Already watching the fd
+        }
+
+        // The fd was closed and reused whilst another fd kept the old file open
+        RemoveItem(item);
+    }
+
+    if (static_cast<size_t>(fd) >= items.get_length()) {
+        items.resize(fd + 1);
+    }
+
+    EPollItem* item = new EPollItem(this, fd, file, event);
+    items[fd] = item;
+
+    item->fileNext = file->epollItems;
+    file->epollItems = item;
+
+    // The node will signal us straight away if it is already ready
+    file->node->Watch(*item, EPollToPollEvents(event.events));
+
+    // Not all nodes signal on Watch, let epoll_wait check
+    QueueItem(item);
+    return 0;
+}
+
+void EPoll::ModifyItem(EPollItem* item, const epoll_event& event) {
+    uint32_t oldEvents = item->event.events;
+    item->event = event;
+    item->event.events |= (oldEvents & EPOLLEXCLUSIVE);
+    item->disabled = false;
+
+    // Nodes may only signal for the events we asked for
+    item->file->node->Unwatch(*item);
+    item->file->node->Watch(*item, EPollToPollEvents(item->event.events));
+
+    QueueItem(item);
+}
+
+void EPoll::RemoveItem(EPollItem* item) {
+    assert(item->epoll == this);
+
+    // Once unwatched the node will not signal the item again
+    item->file->node->Unwatch(*item);
+
+    {
+        ScopedSpinLock<true> lockReady(readyLock);
+        if (item->queued) {
+            ready.remove(item);
+            item->queued = false;
+        }
+    }
+
+    items[item->fd] = nullptr;
+
+    for (EPollItem** it = &item->file->epollItems; *it; it = &(*it)->fileNext) {
+        if (*it == item) {
+            *it = item->fileNext;
+            break;
+        }
+    }
+
+    delete item;
+}
+
+void EPoll::QueueItem(EPollItem* item, bool wake) {
+    {
+        ScopedSpinLock<true> lockReady(readyLock);
+        if (item->queued || item->disabled) {
+            return;
+        }
+
+        item->queued = true;
+        ready.add_back(item);
+    }
+
+    if (wake) {
+        WakeWaiter();
+    }
+}
+
+EPollItem* EPoll::DequeueItem() {
+    ScopedSpinLock<true> lockReady(readyLock);
+    if (!ready.get_length()) {
+        return nullptr;
+    }
+
+    EPollItem* item = ready.get_front();
+    ready.remove(item);
+    item->queued = false;
+
+    return item;
+}
+
+void EPoll::WakeWaiter() {
+    // Each event only needs a single thread to handle it,
+    // a thread leaving epoll_wait with events left over wakes the next
+    acquireLock(&blockedLock);
+    if (blocked.get_length()) {
+        blocked.get_front()->Unblock();
+    }
+    releaseLock(&blockedLock);
+}
+
+void RemoveEPollItems(UNIXOpenFile* openFile) {
+    ScopedSpinLock lockFiles(EPoll::fileItemsLock);
+
+    while (EPollItem* item = openFile->epollItems) {
+        EPoll* epoll = item->epoll;
+
+        ScopedSpinLock lockEp(epoll->epLock);
+        epoll->RemoveItem(item);
+    }
+}
+
+} // namespace fs
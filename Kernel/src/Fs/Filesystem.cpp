@@ -2,6 +2,7 @@
 
 #include <Errno.h>
 #include <Fs/FsVolume.h>
+#include <Fs/Pipe.h>
 #include <Fs/VolumeManager.h>
 #include <Logging.h>
 #include <Panic.h>
@@ -66,6 +67,9 @@ DirectoryEntry::DirectoryEntry(FsNode* node, const char* name) : node(node) {
     case FS_NODE_SOCKET:
         flags = DT_SOCK;
         break;
+    case FS_NODE_FIFO:
+        flags = DT_FIFO;
+        break;
     case FS_NODE_SYMLINK:
         flags = DT_LNK;
         break;
@@ -417,13 +421,34 @@ FsNode* Root::FindDir(const char* name) {
 ssize_t Read(FsNode* node, size_t offset, size_t size, void* buffer) {
     assert(node);
 
+    // Once a file is mapped its pages are the latest copy of the data
+    if (node->IsFile() && (node->UsePageCache() || node->HasPageCache())) {
+        return node->GetPageCache()->Read(offset, size, reinterpret_cast<uint8_t*>(buffer));
+    }
+
     return node->Read(offset, size, reinterpret_cast<uint8_t*>(buffer));
 }
 
 ssize_t Write(FsNode* node, size_t offset, size_t size, void* buffer) {
     assert(node);
 
-    return node->Write(offset, size, reinterpret_cast<uint8_t*>(buffer));
+    ssize_t written = node->Write(offset, size, reinterpret_cast<uint8_t*>(buffer));
+    if (written > 0 && node->HasPageCache()) {
+        node->GetPageCache()->Update(offset, written, reinterpret_cast<uint8_t*>(buffer));
+    }
+
+    return written;
+}
+
+int Truncate(FsNode* node, off_t length) {
+    assert(node);
+
+    int ret = node->Truncate(length);
+    if (!ret && node->HasPageCache()) {
+        node->GetPageCache()->Truncate(length);
+    }
+
+    return ret;
 }
 
 ErrorOr<UNIXOpenFile*> Open(FsNode* node, uint32_t flags) { return node->Open(flags); }
@@ -471,6 +496,11 @@ FsNode* FindDir(FsNode* node, const char* name) {
 ssize_t Read(const FancyRefPtr<UNIXOpenFile>& handle, size_t size, uint8_t* buffer) {
     assert(handle->node);
 
+    if (handle->node->IsFIFO()) {
+        // Pipes have no position and may block, the pipe end is claimed instead of taking dataLock
+        return reinterpret_cast<UNIXPipe*>(handle->node)->Read(size, buffer, handle->mode & O_NONBLOCK);
+    }
+
     ScopedSpinLock lockOpenFile(handle->dataLock);
     ssize_t ret = Read(handle->node, handle->pos, size, buffer);
 
@@ -483,6 +513,10 @@ ssize_t Read(const FancyRefPtr<UNIXOpenFile>& handle, size_t size, uint8_t* buff
 
 ssize_t Write(const FancyRefPtr<UNIXOpenFile>& handle, size_t size, uint8_t* buffer) {
     assert(handle->node);
+
+    if (handle->node->IsFIFO()) {
+        return reinterpret_cast<UNIXPipe*>(handle->node)->Write(size, buffer, handle->mode & O_NONBLOCK);
+    }
     ScopedSpinLock lockOpenFile(handle->dataLock);
     off_t ret = Write(handle->node, handle->pos, size, buffer);
 
@@ -511,6 +545,26 @@ int Ioctl(const FancyRefPtr<UNIXOpenFile>& handle, uint64_t cmd, uint64_t arg) {
     return handle->node->Ioctl(cmd, arg);
 }
 
+void SignalWatchers(List<FilesystemWatcher*>& watching) {
+    bool signalledExclusive = false;
+
+    unsigned count = watching.get_length();
+    while (count--) {
+        FilesystemWatcher* w = watching.remove_at(0);
+        if (w->exclusive && signalledExclusive) {
+            watching.add_back(w); // Keep it for the next event
+            continue;
+        }
+
+        signalledExclusive |= w->exclusive;
+        w->Signal();
+
+        if (w->persistent) {
+            watching.add_back(w);
+        }
+    }
+}
+
 int Rename(FsNode* olddir, const char* oldpath, FsNode* newdir, const char* newpath) {
     assert(olddir && newdir);
 
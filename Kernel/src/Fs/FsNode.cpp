@@ -17,6 +17,15 @@ ssize_t FsNode::Write(size_t, size_t, uint8_t *){
     return -ENOSYS;
 }
 
+FancyRefPtr<FilePageCache> FsNode::GetPageCache(){
+    ScopedSpinLock lockPageCache(m_pageCacheLock);
+    if(!m_pageCache.get()){
+        m_pageCache = new FilePageCache(this);
+    }
+
+    return m_pageCache;
+}
+
 ErrorOr<UNIXOpenFile*> FsNode::Open(size_t flags){
     UNIXOpenFile* fDesc = new UNIXOpenFile;
 
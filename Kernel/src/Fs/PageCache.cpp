@@ -0,0 +1,361 @@
+#include <Fs/PageCache.h>
+
+#include <Fs/Filesystem.h>
+
+#include <Assert.h>
+#include <CString.h>
+#include <Errno.h>
+#include <Math.h>
+#include <Paging.h>
+#include <PhysicalAllocator.h>
+
+// Once the file caches hold more than 1/PAGE_CACHE_MEMORY_FRACTION of memory, unmapped files get dropped
+#define PAGE_CACHE_MEMORY_FRACTION 4
+
+static lock_t cacheListLock = 0;
+static List<FilePageCache*> caches;
+static size_t totalResidentPages = 0;
+
+FilePageCache::FilePageCache(FsNode* node) : m_node(node) {
+    ScopedSpinLock lockCaches(cacheListLock);
+    caches.add_back(this);
+}
+
+FilePageCache::~FilePageCache() {
+    {
+        ScopedSpinLock lockCaches(cacheListLock);
+        caches.remove(this);
+    }
+
+    assert(!m_mappings);
+    for (CachedPage& page : m_pages) {
+        if (page.block) {
+            Memory::FreePhysicalMemoryBlock(static_cast<uintptr_t>(page.block) << PAGE_SHIFT_4K);
+        }
+    }
+
+    __atomic_sub_fetch(&totalResidentPages, m_residentPages, __ATOMIC_RELAXED);
+}
+
+uintptr_t FilePageCache::GetPage(size_t index) {
+    uintptr_t phys = 0;
+    for (;;) {
+        unsigned generation;
+        {
+            ScopedSpinLock lockPages(m_lock);
+            if (index < m_pages.size() && m_pages[index].block) {
+                return static_cast<uintptr_t>(m_pages[index].block) << PAGE_SHIFT_4K;
+            }
+
+            generation = m_generation;
+        }
+
+        // Read the page in without holding the lock, the node may block
+        phys = ReadPage(index);
+        if (!phys) {
+            return 0;
+        }
+
+        ScopedSpinLock lockPages(m_lock);
+        if (index >= m_pages.size()) {
+            m_pages.resize(index + 1);
+        }
+
+        CachedPage& page = m_pages[index];
+        if (page.block) {
+            // Someone else read the page in before us
+            Memory::FreePhysicalMemoryBlock(phys);
+            return static_cast<uintptr_t>(page.block) << PAGE_SHIFT_4K;
+        } else if (generation != m_generation) {
+            // The node was written to whilst we were reading so our data may be stale
+            Memory::FreePhysicalMemoryBlock(phys);
+            continue;
+        }
+
+        page.block = phys >> PAGE_SHIFT_4K;
+        m_residentPages++;
+        break;
+    }
+
+    size_t limit = Memory::maxPhysicalBlocks / PAGE_CACHE_MEMORY_FRACTION;
+    if (size_t total = __atomic_add_fetch(&totalResidentPages, 1, __ATOMIC_RELAXED); total > limit) {
+        Reclaim(total - limit);
+    }
+
+    return phys;
+}
+
+uintptr_t FilePageCache::ReadPage(size_t index) {
+    uintptr_t phys = Memory::AllocatePhysicalMemoryBlock();
+    if (!phys) {
+        return 0;
+    }
+
+    uint8_t* mapping = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+    Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)mapping, 1);
+
+    size_t offset = index << PAGE_SHIFT_4K;
+    ssize_t read = 0;
+    if (offset < m_node->size) {
+        read = m_node->Read(offset, MIN(PAGE_SIZE_4K, m_node->size - offset), mapping);
+    }
+
+    if (read >= 0) {
+        memset(mapping + read, 0, PAGE_SIZE_4K - read); // Zero past the end of the file
+    }
+
+    Memory::KernelFree4KPages(mapping, 1);
+
+    if (read < 0) {
+        Memory::FreePhysicalMemoryBlock(phys);
+        return 0;
+    }
+
+    return phys;
+}
+
+void FilePageCache::MarkDirty(size_t index) {
+    ScopedSpinLock lockPages(m_lock);
+    assert(index < m_pages.size() && m_pages[index].block);
+
+    m_pages[index].dirty = true;
+}
+
+ssize_t FilePageCache::Read(size_t offset, size_t size, uint8_t* buffer) {
+    if (offset >= m_node->size) {
+        return 0;
+    }
+
+    if (offset + size > m_node->size) {
+        size = m_node->size - offset;
+    }
+
+    {
+        ScopedSpinLock lockPages(m_lock);
+        m_readers++; // Stop the pages from being reclaimed whilst we copy
+    }
+
+    uint8_t* mapping = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+
+    ssize_t read = 0;
+    while (read < static_cast<ssize_t>(size)) {
+        size_t pageOffset = (offset + read) & (PAGE_SIZE_4K - 1);
+        size_t count = MIN(PAGE_SIZE_4K - pageOffset, size - read);
+
+        uintptr_t phys = GetPage((offset + read) >> PAGE_SHIFT_4K);
+        if (!phys) {
+            if (!read) {
+                read = -EIO;
+            }
+            break;
+        }
+
+        Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)mapping, 1);
+        memcpy(buffer + read, mapping + pageOffset, count);
+
+        read += count;
+    }
+
+    Memory::KernelFree4KPages(mapping, 1);
+
+    ScopedSpinLock lockPages(m_lock);
+    m_readers--;
+
+    return read;
+}
+
+void FilePageCache::Update(size_t offset, size_t size, const uint8_t* buffer) {
+    uint8_t* mapping = nullptr;
+
+    size_t written = 0;
+    while (written < size) {
+        size_t pageOffset = (offset + written) & (PAGE_SIZE_4K - 1);
+        size_t count = MIN(PAGE_SIZE_4K - pageOffset, size - written);
+        size_t index = (offset + written) >> PAGE_SHIFT_4K;
+
+        uintptr_t phys = 0;
+        {
+            ScopedSpinLock lockPages(m_lock);
+            m_generation++;
+
+            if (index < m_pages.size()) {
+                phys = static_cast<uintptr_t>(m_pages[index].block) << PAGE_SHIFT_4K;
+            }
+        }
+
+        if (phys) {
+            if (!mapping) {
+                mapping = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+            }
+
+            Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)mapping, 1);
+            memcpy(mapping + pageOffset, buffer + written, count);
+        }
+
+        written += count;
+    }
+
+    if (mapping) {
+        Memory::KernelFree4KPages(mapping, 1);
+    }
+}
+
+void FilePageCache::Truncate(size_t length) {
+    size_t firstPage = length >> PAGE_SHIFT_4K;
+    size_t firstPageOffset = length & (PAGE_SIZE_4K - 1); // Only the end of the page the file now ends in is zeroed
+
+    uintptr_t partialPage = 0;
+    Vector<uintptr_t> pages;
+    {
+        ScopedSpinLock lockPages(m_lock);
+        m_generation++;
+
+        for (size_t i = firstPage; i < m_pages.size(); i++) {
+            if (!m_pages[i].block) {
+                continue;
+            }
+
+            uintptr_t phys = static_cast<uintptr_t>(m_pages[i].block) << PAGE_SHIFT_4K;
+            if (i == firstPage && firstPageOffset) {
+                partialPage = phys;
+            } else {
+                pages.add_back(phys);
+            }
+        }
+
+        if (!partialPage && !pages.size()) {
+            return;
+        }
+
+        m_readers++; // Stop the pages from being reclaimed whilst we zero them
+    }
+
+    // Pages may still be mapped so keep them around, but the old data must not reappear
+    uint8_t* mapping = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+    if (partialPage) {
+        Memory::KernelMapVirtualMemory4K(partialPage, (uintptr_t)mapping, 1);
+        memset(mapping + firstPageOffset, 0, PAGE_SIZE_4K - firstPageOffset);
+    }
+
+    for (uintptr_t phys : pages) {
+        Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)mapping, 1);
+        memset(mapping, 0, PAGE_SIZE_4K);
+    }
+    Memory::KernelFree4KPages(mapping, 1);
+
+    ScopedSpinLock lockPages(m_lock);
+    m_readers--;
+}
+
+void FilePageCache::Writeback() {
+    uint8_t* mapping = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+
+    for (size_t i = 0;; i++) {
+        uintptr_t phys;
+        {
+            ScopedSpinLock lockPages(m_lock);
+            if (i >= m_pages.size()) {
+                break;
+            }
+
+            if (!m_pages[i].dirty) {
+                continue;
+            }
+
+            // There is no way of knowing if a mapped page was written to again,
+            // so the page only becomes clean once it is no longer mapped
+            if (!m_mappings) {
+                m_pages[i].dirty = false;
+            }
+
+            phys = static_cast<uintptr_t>(m_pages[i].block) << PAGE_SHIFT_4K;
+        }
+
+        size_t offset = i << PAGE_SHIFT_4K;
+        if (offset >= m_node->size) {
+            continue; // Past the end of the file
+        }
+
+        Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)mapping, 1);
+        m_node->Write(offset, MIN(PAGE_SIZE_4K, m_node->size - offset), mapping);
+    }
+
+    Memory::KernelFree4KPages(mapping, 1);
+}
+
+void FilePageCache::AddMapping() {
+    ScopedSpinLock lockPages(m_lock);
+    m_mappings++;
+}
+
+void FilePageCache::RemoveMapping() {
+    {
+        ScopedSpinLock lockPages(m_lock);
+        assert(m_mappings);
+
+        if (--m_mappings) {
+            return;
+        }
+    }
+
+    Writeback(); // Last mapping is gone, write back and clean the dirty pages
+}
+
+size_t FilePageCache::DropCleanPages() {
+    size_t freed = 0;
+    for (CachedPage& page : m_pages) {
+        if (page.block && !page.dirty) {
+            Memory::FreePhysicalMemoryBlock(static_cast<uintptr_t>(page.block) << PAGE_SHIFT_4K);
+            page.block = 0;
+            freed++;
+        }
+    }
+
+    m_residentPages -= freed;
+    __atomic_sub_fetch(&totalResidentPages, freed, __ATOMIC_RELAXED);
+    return freed;
+}
+
+size_t FilePageCache::Reclaim(size_t target) {
+    if (acquireTestLock(&cacheListLock)) {
+        return 0; // Someone else is already reclaiming
+    }
+
+    // Nodes which were only kept around for their pages
+    Vector<FsNode*> emptied;
+
+    size_t freed = 0;
+    for (FilePageCache* cache : caches) {
+        if (freed >= target) {
+            break;
+        }
+
+        if (acquireTestLock(&cache->m_lock)) {
+            continue; // In use
+        }
+
+        if (!cache->m_mappings && !cache->m_readers) {
+            size_t dropped = cache->DropCleanPages();
+            freed += dropped;
+
+            // Hold a handle so the node cannot be freed once we release the list lock
+            if (dropped && !cache->m_residentPages && !cache->m_node->handleCount) {
+                __atomic_add_fetch(&cache->m_node->handleCount, 1, __ATOMIC_ACQUIRE);
+                emptied.add_back(cache->m_node);
+            }
+        }
+
+        releaseLock(&cache->m_lock);
+    }
+
+    releaseLock(&cacheListLock);
+
+    // Closing the last handle lets the filesystem free the node
+    for (FsNode* node : emptied) {
+        node->Close();
+    }
+
+    return freed;
+}
+
+size_t FilePageCache::TotalResidentPages() { return totalResidentPages; }
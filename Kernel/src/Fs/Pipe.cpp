@@ -1,66 +1,85 @@
 #include <Fs/Pipe.h>
 
+#include <Assert.h>
+
+#include <ABI/Pipe.h>
+
 #include <Move.h>
 #include <Errno.h>
 
 UNIXPipe::UNIXPipe(int _end, FancyRefPtr<DataStream> stream)
     : end(static_cast<decltype(end)>(_end)), stream(std::move(stream)){
+    flags = FS_NODE_FIFO;
 }
 
 ssize_t UNIXPipe::Read(size_t off, size_t size, uint8_t* buffer){
+    return Read(size, buffer, false);
+}
+
+ssize_t UNIXPipe::Write(size_t off, size_t size, uint8_t* buffer){
+    return Write(size, buffer, false);
+}
+
+ssize_t UNIXPipe::Read(size_t size, uint8_t* buffer, bool nonBlock){
     if(end != ReadEnd){
         return -ESPIPE;
     }
 
-    if(!widowed && size > stream->Pos()){
-        FilesystemBlocker bl(this, size);
-
-        if(Thread::Current()->Block(&bl)){
-            return -EINTR;
-        }
+    if(ssize_t ret = WaitAndClaim(nonBlock); ret <= 0){
+        return ret;
     }
 
-    if(size > stream->Pos()){
-        size = stream->Pos();
+    ssize_t ret = stream->Read(buffer, size);
+    Release();
+
+    if(ret > 0){
+        WakeOtherEnd();
     }
 
-    return stream->Read(buffer, size);
+    return ret;
 }
 
-ssize_t UNIXPipe::Write(size_t off, size_t size, uint8_t* buffer){
+ssize_t UNIXPipe::Write(size_t size, uint8_t* buffer, bool nonBlock){
     if(end != WriteEnd){
         return -ESPIPE;
-    } else if(widowed || !otherEnd){
-        Thread::Current()->Signal(SIGPIPE); // Send SIGPIPE on broken pipe
-        return -EPIPE;
     }
 
-    ssize_t ret = stream->Write(buffer, size);
-
-    {
-        ScopedSpinLock acq(otherEnd->watchingLock);
+    // Writes of up to PIPE_BUF bytes wait until they fit so they go in all at once,
+    // anything larger is written as space frees up
+    size_t space = (size <= PIPE_BUF) ? size : 1;
 
-        for(auto& w : otherEnd->watching){
-            w->Signal();
+    size_t written = 0;
+    while(written < size){
+        if(ssize_t ret = WaitAndClaim(nonBlock, space); ret <= 0){
+            return written ? written : ret;
         }
 
-        acquireLock(&otherEnd->blockedLock);
-        FilesystemBlocker* bl = otherEnd->blocked.get_front();
-        while(bl){
-            FilesystemBlocker* next = otherEnd->blocked.next(bl);
+        written += stream->Write(buffer + written, size - written);
+        Release();
 
-            if(bl->RequestedLength() <= stream->Pos()){
-                bl->Unblock();
-            }
+        WakeOtherEnd();
+    }
 
-            bl = next;
-        }
-        releaseLock(&otherEnd->blockedLock);
+    return written;
+}
 
-        otherEnd->watching.clear();
+int UNIXPipe::Ioctl(uint64_t cmd, uint64_t arg){
+    switch(cmd){
+    case IoCtlPipeSetSize:
+        return stream->Resize(arg);
+    case IoCtlPipeGetSize:
+        return stream->Capacity();
+    default:
+        return -EINVAL;
     }
+}
 
-    return ret;
+bool UNIXPipe::CanRead(){
+    return end == ReadEnd && (stream->Pos() || widowed);
+}
+
+bool UNIXPipe::CanWrite(){
+    return end == WriteEnd && (stream->Space() || widowed);
 }
 
 void UNIXPipe::Watch(FilesystemWatcher& watcher, int events){
@@ -79,18 +98,233 @@ void UNIXPipe::Close(){
     if(handleCount <= 0){
         if(otherEnd){
             otherEnd->widowed = true;
+            otherEnd->otherEnd = nullptr;
+
+            // Readers get EOF and writers get EPIPE
+            WakeOtherEnd();
         }
 
         delete this;
     }
 }
 
+ssize_t UNIXPipe::SpliceTo(const FancyRefPtr<UNIXOpenFile>& out, off_t* offset, size_t size, bool nonBlock){
+    assert(end == ReadEnd);
+
+    if(ssize_t ret = WaitAndClaim(nonBlock); ret <= 0){
+        return ret;
+    }
+
+    ssize_t ret = stream->Drain(size, [&](uint8_t* data, size_t len) -> int64_t {
+        if(!offset){
+            return fs::Write(out, len, data);
+        }
+
+        ssize_t written = fs::Write(out->node, *offset, len, data);
+        if(written > 0){
+            *offset += written;
+        }
+
+        return written;
+    });
+    Release();
+
+    if(ret > 0){
+        WakeOtherEnd();
+    }
+
+    return ret;
+}
+
+ssize_t UNIXPipe::SpliceFrom(const FancyRefPtr<UNIXOpenFile>& in, off_t* offset, size_t size, bool nonBlock){
+    assert(end == WriteEnd);
+
+    if(ssize_t ret = WaitAndClaim(nonBlock); ret <= 0){
+        return ret;
+    }
+
+    ssize_t ret = stream->Fill(size, [&](uint8_t* data, size_t len) -> int64_t {
+        if(!offset){
+            return fs::Read(in, len, data);
+        }
+
+        ssize_t read = fs::Read(in->node, *offset, len, data);
+        if(read > 0){
+            *offset += read;
+        }
+
+        return read;
+    });
+    Release();
+
+    if(ret > 0){
+        WakeOtherEnd();
+    }
+
+    return ret;
+}
+
+ssize_t UNIXPipe::Tee(UNIXPipe* out, size_t size, bool nonBlock){
+    assert(end == ReadEnd && out->end == WriteEnd);
+
+    if(SharesBufferWith(out)){
+        return -EINVAL;
+    }
+
+    // Claim the two ends in address order so that tees going opposite ways between two pipes cannot deadlock
+    UNIXPipe* first = (this < out) ? this : out;
+    UNIXPipe* second = (this < out) ? out : this;
+    for(;;){
+        if(ssize_t ret = WaitUntilReady(nonBlock); ret <= 0){
+            return ret;
+        }
+
+        if(ssize_t ret = out->WaitUntilReady(nonBlock); ret <= 0){
+            return ret;
+        }
+
+        if(ssize_t ret = first->Claim(nonBlock); ret <= 0){
+            return ret;
+        }
+
+        // Never sleep on the second claim whilst holding the first,
+        // as a splice from one pipe to the other holds one end whilst it waits on the other
+        if(second->Claim(true) <= 0){
+            first->Release();
+
+            // Wait for it to be free then start over
+            if(ssize_t ret = second->Claim(nonBlock); ret <= 0){
+                return ret;
+            }
+            second->Release();
+            continue;
+        }
+
+        if(CanRead() && out->CanWrite()){
+            break;
+        }
+
+        // Someone else got to the data or space first
+        second->Release();
+        first->Release();
+    }
+
+    // Only copy what fits so we never block on the other pipe whilst holding our buffer
+    if(size > out->stream->Space()){
+        size = out->stream->Space();
+    }
+
+    ssize_t ret = stream->Drain(size, [&](uint8_t* data, size_t len) -> int64_t {
+        return out->stream->Write(data, len);
+    }, false);
+
+    second->Release();
+    first->Release();
+
+    if(ret > 0){
+        out->WakeOtherEnd();
+    }
+
+    return ret;
+}
+
 void UNIXPipe::CreatePipe(UNIXPipe*& read, UNIXPipe*& write){
-    FancyRefPtr<DataStream> stream = new DataStream(1024);
-    
+    FancyRefPtr<DataStream> stream = new DataStream(DATASTREAM_BUFSIZE_DEFAULT);
+
     read = new UNIXPipe(UNIXPipe::ReadEnd, stream);
     write = new UNIXPipe(UNIXPipe::WriteEnd, stream);
 
     read->otherEnd = write;
     write->otherEnd = read;
-}
\ No newline at end of file
+}
+
+bool UNIXPipe::IsReady(size_t space){
+    if(end == ReadEnd){
+        return CanRead();
+    }
+
+    return end == WriteEnd && (stream->Space() >= space || widowed);
+}
+
+ssize_t UNIXPipe::WaitUntilReady(bool nonBlock, size_t space){
+    for(;;){
+        if(end == WriteEnd && widowed){
+            Thread::Current()->Signal(SIGPIPE); // Send SIGPIPE on broken pipe
+            return -EPIPE;
+        } else if(IsReady(space)){
+            return 1;
+        } else if(nonBlock){
+            return -EAGAIN;
+        }
+
+        FilesystemBlocker bl(this);
+
+        // The other end may have woken us before the blocker was added
+        if(widowed || IsReady(space)){
+            continue;
+        }
+
+        if(Thread::Current()->Block(&bl)){
+            return -EINTR;
+        }
+    }
+}
+
+ssize_t UNIXPipe::Claim(bool nonBlock){
+    for(;;){
+        if(!__atomic_test_and_set(&claimed, __ATOMIC_ACQUIRE)){
+            return 1;
+        } else if(nonBlock){
+            return -EAGAIN;
+        }
+
+        FilesystemBlocker bl(this);
+
+        // Released before the blocker was added
+        if(!__atomic_load_n(&claimed, __ATOMIC_RELAXED)){
+            continue;
+        }
+
+        if(Thread::Current()->Block(&bl)){
+            return -EINTR;
+        }
+    }
+}
+
+void UNIXPipe::Release(){
+    __atomic_clear(&claimed, __ATOMIC_RELEASE);
+    UnblockAll();
+}
+
+ssize_t UNIXPipe::WaitAndClaim(bool nonBlock, size_t space){
+    for(;;){
+        if(ssize_t ret = WaitUntilReady(nonBlock, space); ret <= 0){
+            return ret;
+        }
+
+        if(ssize_t ret = Claim(nonBlock); ret <= 0){
+            return ret;
+        }
+
+        // Another reader or writer may have got there whilst we waited for the claim
+        if(IsReady(space)){
+            return 1;
+        }
+
+        Release();
+    }
+}
+
+void UNIXPipe::WakeOtherEnd(){
+    UNIXPipe* other = otherEnd;
+    if(!other){
+        return;
+    }
+
+    {
+        ScopedSpinLock acq(other->watchingLock);
+        fs::SignalWatchers(other->watching);
+    }
+
+    other->UnblockAll();
+}
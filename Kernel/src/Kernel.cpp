@@ -14,6 +14,7 @@
 #include <PCI.h>
 #include <PS2.h>
 #include <Panic.h>
+#include <Profiler.h>
 #include <Scheduler.h>
 #include <SharedMemory.h>
 #include <Storage/AHCI.h>
@@ -23,6 +24,7 @@
 #include <Symbols.h>
 #include <Syscalls.h>
 #include <TTY/PTY.h>
+#include <Trace.h>
 #include <Timer.h>
 #include <Types.h>
 #include <USB/XHCI.h>
@@ -36,7 +38,7 @@ void IdleProcess() {
     Thread* th = Thread::Current();
     for (;;) {
         th->timeSlice = 0;
-        asm volatile("pause");
+        asm volatile("sti; hlt"); // Idle CPUs are not ticked, wait for an IPI or timer event
     }
 }
 
@@ -113,10 +115,7 @@ void KernelProcess() {
 
     Log::Write("OK");
 
-    void* initElf = (void*)kmalloc(initFsNode->size);
-    fs::Read(initFsNode, 0, initFsNode->size, (uint8_t*)initElf);
-
-    auto initProc = Process::CreateELFProcess(initElf, Vector<String>("init"), Vector<String>("PATH=/initrd"),
+    auto initProc = Process::CreateELFProcess(initFsNode, Vector<String>("init"), Vector<String>("PATH=/initrd"),
                                               "/system/lemon/init.lef", nullptr);
     initProc->Start();
 
@@ -161,6 +160,8 @@ extern "C" [[noreturn]] void kmain() {
     fs::VolumeManager::Initialize();
     DeviceManager::Initialize();
     Log::LateInitialize();
+    Trace::Initialize();
+    Profiler::Initialize();
 
     InitializeConstructors(); // Call global constructors
 
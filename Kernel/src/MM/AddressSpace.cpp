@@ -179,18 +179,30 @@ AddressSpace* AddressSpace::Fork() {
     AddressSpace* fork = new AddressSpace(Memory::ClonePageMap(m_pageMap));
     for (auto it = m_regions.begin(); it != m_regions.end(); it++) {
         MappedRegion& r = *it;
+        if (!r.vmObject.get()) {
+            continue;
+        }
 
-        r.vmObject->refCount++;
-        if (!r.vmObject->IsShared()) { // Shared VM Objects are shared, we do not want COW
-            r.vmObject->copyOnWrite = true;
+        if (r.vmObject->IsShared()) { // Shared VM Objects are shared, we do not want COW
+            r.vmObject->refCount++;
+            fork->m_regions.add_back(const_cast<const MappedRegion&>(r));
 
-            // Remap for both us and the fork as we are no longer setting the write flag because of COW
-            r.vmObject->MapAllocatedBlocks(r.Base(), m_pageMap);
+            r.vmObject->MapAllocatedBlocks(r.Base(), fork->m_pageMap);
+            continue;
         }
 
-        fork->m_regions.add_back(const_cast<const MappedRegion&>(r));
+        // Stop the blocks from being copied or allocated whilst we share them
+        r.lock.AcquireWrite();
+
+        // Only the list of blocks is copied, each block gets copied on the first write to it
+        FancyRefPtr<VMObject> clone = r.vmObject->Clone();
+
+        // Remap as we are no longer setting the write flag on shared blocks
+        r.vmObject->MapAllocatedBlocks(r.Base(), m_pageMap);
+        r.lock.ReleaseWrite();
 
-        r.vmObject->MapAllocatedBlocks(r.Base(), fork->m_pageMap);
+        fork->m_regions.add_back(MappedRegion(r.Base(), r.Size(), clone));
+        clone->MapAllocatedBlocks(r.Base(), fork->m_pageMap);
     }
 
     fork->m_parent = this;
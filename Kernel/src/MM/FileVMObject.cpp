@@ -0,0 +1,276 @@
+#include <MM/FileVMObject.h>
+
+#include <Assert.h>
+#include <CString.h>
+#include <Math.h>
+#include <Move.h>
+#include <Paging.h>
+#include <PhysicalAllocator.h>
+
+// Copy the first length bytes of a page to a newly allocated block and zero the rest,
+// returns the new block or 0 on failure
+static uintptr_t CopyBlock(uintptr_t phys, size_t length = PAGE_SIZE_4K) {
+    uintptr_t newPhys = Memory::AllocatePhysicalMemoryBlock();
+    assert(newPhys < PHYS_BLOCK_MAX);
+    if (!newPhys) {
+        return 0;
+    }
+
+    // Temporary mappings so we can copy the data over
+    uint8_t* virtBuffer = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(2));
+    uint8_t* virtDestBuffer = virtBuffer + PAGE_SIZE_4K;
+
+    Memory::KernelMapVirtualMemory4K(newPhys, (uintptr_t)virtDestBuffer, 1);
+    if (length) {
+        Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)virtBuffer, 1);
+        memcpy(virtDestBuffer, virtBuffer, length);
+    }
+
+    memset(virtDestBuffer + length, 0, PAGE_SIZE_4K - length);
+
+    Memory::KernelFree4KPages(virtBuffer, 2);
+    return newPhys;
+}
+
+FileVMObject::FileVMObject(FancyRefPtr<UNIXOpenFile> file, size_t fileOffset, size_t size, bool shared, bool writable,
+                           size_t fileLength)
+    : VMObject(size, false, shared), m_file(std::move(file)), m_fileOffset(fileOffset),
+      m_fileLength(MIN(fileLength, size)), m_writable(writable) {
+    assert(!(fileOffset & (PAGE_SIZE_4K - 1)));
+    assert(m_file->node);
+    assert(!shared || m_fileLength == size); // Zero filled pages can only be private
+
+    m_cache = m_file->node->GetPageCache();
+    m_cache->AddMapping();
+
+    // Writes always fault first, either to mark the cached page dirty or to copy it
+    copyOnWrite = true;
+
+    if (!shared) {
+        size_t blockCount = PAGE_COUNT_4K(size);
+
+        m_privateBlocks = new uint32_t[blockCount];
+        memset(m_privateBlocks, 0, sizeof(uint32_t) * blockCount);
+    }
+}
+
+FileVMObject::FileVMObject(const FileVMObject& other)
+    : VMObject(other.size, false, other.shared), m_file(other.m_file), m_cache(other.m_cache),
+      m_fileOffset(other.m_fileOffset), m_fileLength(other.m_fileLength), m_writable(other.m_writable) {
+    assert(!shared);
+
+    m_cache->AddMapping();
+    copyOnWrite = true;
+
+    size_t blockCount = PAGE_COUNT_4K(size);
+
+    m_privateBlocks = new uint32_t[blockCount];
+    for (unsigned i = 0; i < blockCount; i++) {
+        uintptr_t block = other.m_privateBlocks[i];
+        if (block) {
+            Memory::SharePhysicalMemoryBlock(block << PAGE_SHIFT_4K);
+        }
+
+        m_privateBlocks[i] = block;
+    }
+}
+
+FileVMObject::~FileVMObject() {
+    assert(refCount <= 1);
+
+    if (m_privateBlocks) {
+        for (unsigned i = 0; i < size >> PAGE_SHIFT_4K; i++) {
+            if (m_privateBlocks[i]) {
+                Memory::ReleasePhysicalMemoryBlock(static_cast<uintptr_t>(m_privateBlocks[i]) << PAGE_SHIFT_4K);
+            }
+        }
+
+        delete[] m_privateBlocks;
+    }
+
+    m_cache->RemoveMapping(); // Writes back any dirty pages
+}
+
+long FileVMObject::FilePageIndex(uintptr_t offset) const {
+    size_t fileOffset = m_fileOffset + (offset & ~static_cast<uintptr_t>(PAGE_SIZE_4K - 1));
+    if (fileOffset >= m_file->node->size) {
+        return -1; // Past the end of the file
+    }
+
+    return fileOffset >> PAGE_SHIFT_4K;
+}
+
+uintptr_t FileVMObject::CreatePrivateBlock(uintptr_t offset) {
+    size_t pageOffset = offset & ~static_cast<uintptr_t>(PAGE_SIZE_4K - 1);
+    if (pageOffset >= m_fileLength) {
+        return CopyBlock(0, 0); // Nothing from the file, just zeroes
+    }
+
+    long page = FilePageIndex(offset);
+    if (page < 0) {
+        return 0;
+    }
+
+    uintptr_t cached = m_cache->GetPage(page);
+    if (!cached) {
+        return 0;
+    }
+
+    return CopyBlock(cached, MIN(PAGE_SIZE_4K, m_fileLength - pageOffset));
+}
+
+uintptr_t FileVMObject::InstallPrivateBlock(unsigned blockIndex, uintptr_t phys) {
+    uint32_t& block = m_privateBlocks[blockIndex];
+    if (block) {
+        Memory::FreePhysicalMemoryBlock(phys); // Another thread got there first
+        return static_cast<uintptr_t>(block) << PAGE_SHIFT_4K;
+    }
+
+    block = phys >> PAGE_SHIFT_4K;
+    return phys;
+}
+
+int FileVMObject::Hit(uintptr_t base, uintptr_t offset, PageMap* pMap) {
+    unsigned blockIndex = offset >> PAGE_SHIFT_4K;
+    assert(blockIndex < (size >> PAGE_SHIFT_4K));
+
+    uintptr_t virt = base + (offset & ~static_cast<uintptr_t>(PAGE_SIZE_4K - 1));
+    if (m_privateBlocks) {
+        // Pages reaching past the file backed part of the mapping need their own block
+        uintptr_t newBlock = 0;
+        if ((offset | (PAGE_SIZE_4K - 1)) >= m_fileLength &&
+            !__atomic_load_n(&m_privateBlocks[blockIndex], __ATOMIC_ACQUIRE)) {
+            if (!(newBlock = CreatePrivateBlock(offset))) {
+                return 1;
+            }
+        }
+
+        ScopedSpinLock lockBlocks(m_lock);
+
+        uintptr_t block = m_privateBlocks[blockIndex];
+        if (newBlock) {
+            block = InstallPrivateBlock(blockIndex, newBlock) >> PAGE_SHIFT_4K;
+        }
+
+        if (block) {
+            bool writable = m_writable && !Memory::IsPhysicalMemoryBlockShared(block << PAGE_SHIFT_4K);
+            Memory::MapVirtualMemory4K(block << PAGE_SHIFT_4K, virt, 1,
+                                       PAGE_USER | (PAGE_WRITABLE * writable) | PAGE_PRESENT, pMap);
+            return 0;
+        }
+    }
+
+    long page = FilePageIndex(offset);
+    if (page < 0) {
+        return 1; // Fatal page fault, kill process
+    }
+
+    uintptr_t phys = m_cache->GetPage(page);
+    if (!phys) {
+        return 1; // Could not read the page
+    }
+
+    // Map read only so we know when the page gets written to
+    Memory::MapVirtualMemory4K(phys, virt, 1, PAGE_USER | PAGE_PRESENT, pMap);
+    return 0;
+}
+
+int FileVMObject::CopyOnWriteHit(uintptr_t base, uintptr_t offset, PageMap* pMap) {
+    unsigned blockIndex = offset >> PAGE_SHIFT_4K;
+    assert(blockIndex < (size >> PAGE_SHIFT_4K));
+
+    if (!m_writable) {
+        return 1; // Fatal page fault, kill process
+    }
+
+    uintptr_t virt = base + (offset & ~static_cast<uintptr_t>(PAGE_SIZE_4K - 1));
+    if (!m_privateBlocks) {
+        long page = FilePageIndex(offset);
+        if (page < 0) {
+            return 1;
+        }
+
+        uintptr_t phys = m_cache->GetPage(page);
+        if (!phys) {
+            return 1;
+        }
+
+        m_cache->MarkDirty(page);
+        Memory::MapVirtualMemory4K(phys, virt, 1, PAGE_USER | PAGE_WRITABLE | PAGE_PRESENT, pMap);
+        return 0;
+    }
+
+    // Copy the page out of the cache before taking the lock as reading it in may block
+    uintptr_t fileCopy = 0;
+    if (!__atomic_load_n(&m_privateBlocks[blockIndex], __ATOMIC_ACQUIRE)) {
+        if (!(fileCopy = CreatePrivateBlock(offset))) {
+            return 1;
+        }
+    }
+
+    ScopedSpinLock lockBlocks(m_lock);
+
+    uintptr_t phys;
+    if (fileCopy) {
+        phys = InstallPrivateBlock(blockIndex, fileCopy);
+    } else {
+        phys = static_cast<uintptr_t>(m_privateBlocks[blockIndex]) << PAGE_SHIFT_4K;
+        assert(phys); // Private blocks are never removed
+    }
+
+    if (Memory::IsPhysicalMemoryBlockShared(phys)) {
+        // Shared with a fork of the mapping
+        uintptr_t newPhys = CopyBlock(phys);
+        if (!newPhys) {
+            return 1;
+        }
+
+        m_privateBlocks[blockIndex] = newPhys >> PAGE_SHIFT_4K;
+        Memory::ReleasePhysicalMemoryBlock(phys);
+        phys = newPhys;
+    }
+
+    Memory::MapVirtualMemory4K(phys, virt, 1, PAGE_USER | PAGE_WRITABLE | PAGE_PRESENT, pMap);
+    return 0;
+}
+
+void FileVMObject::MapAllocatedBlocks(uintptr_t base, PageMap* pMap) {
+    uintptr_t virt = base;
+    for (unsigned i = 0; i < (size >> PAGE_SHIFT_4K); i++) {
+        uintptr_t block = m_privateBlocks ? m_privateBlocks[i] : 0;
+        if (block) {
+            bool writable = m_writable && !Memory::IsPhysicalMemoryBlockShared(block << PAGE_SHIFT_4K);
+            Memory::MapVirtualMemory4K(block << PAGE_SHIFT_4K, virt, 1,
+                                       PAGE_USER | (PAGE_WRITABLE * writable) | PAGE_PRESENT, pMap);
+        } else {
+            // Cached pages get mapped as they are accessed
+            Memory::MapVirtualMemory4K(0, virt, 1, PAGE_USER, pMap);
+        }
+
+        virt += PAGE_SIZE_4K;
+    }
+}
+
+VMObject* FileVMObject::Clone() {
+    assert(!shared);
+
+    FileVMObject* newVMO = new FileVMObject(*this);
+    newVMO->refCount = 1;
+
+    return newVMO;
+}
+
+size_t FileVMObject::UsedPhysicalMemory() const {
+    if (!m_privateBlocks) {
+        return 0; // Pages belong to the page cache
+    }
+
+    unsigned blockCount = 0;
+    for (unsigned i = 0; i < (size >> PAGE_SHIFT_4K); i++) {
+        if (m_privateBlocks[i]) {
+            blockCount++;
+        }
+    }
+
+    return blockCount << PAGE_SHIFT_4K;
+}
@@ -1,9 +1,11 @@
 #include <frg/slab.hpp>
 
 #include <Assert.h>
+#include <CPU.h>
 #include <CString.h>
 #include <Lock.h>
 #include <Logging.h>
+#include <MM/KMalloc.h>
 #include <Paging.h>
 #include <PhysicalAllocator.h>
 
@@ -37,18 +39,31 @@ private:
     bool m_irq = false;
 };
 
+#define KMALLOC_MAX_CPUS 256 // Caches are indexed by APIC ID
+#define KMALLOC_SLAB_PAGES 16 // Pages added to a size class at once
+
+// The kernel heap is the last GB of the address space
+#define KMALLOC_HEAP_PAGES ((~0ULL - KERNEL_HEAP_VIRTUAL_BASE + 1) >> PAGE_SHIFT_4K)
+
 lock_t allocatorInstanceLock = 0;
 
+// Map newly allocated physical blocks to a free range of the kernel heap
+static void* AllocateHeapPages(size_t pageCount) {
+    void* ptr = Memory::KernelAllocate4KPages(pageCount);
+    uintptr_t base = reinterpret_cast<uintptr_t>(ptr);
+
+    while (pageCount--) {
+        Memory::KernelMapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), base, 1);
+        base += PAGE_SIZE_4K;
+    }
+
+    return ptr;
+}
+
 struct KernelAllocator {
     uintptr_t map(size_t len) {
         size_t pageCount = (len + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K;
-        void* ptr = Memory::KernelAllocate4KPages(pageCount);
-        uintptr_t base = reinterpret_cast<uintptr_t>(ptr);
-
-        while (pageCount--) {
-            Memory::KernelMapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), base, 1);
-            base += PAGE_SIZE_4K;
-        }
+        void* ptr = AllocateHeapPages(pageCount);
 
         memset(ptr, 0, len);
 
@@ -75,32 +90,251 @@ struct KernelAllocator {
 
 KernelAllocator* allocator = nullptr;
 
+// Serves allocations too large for the size classes
 frg::slab_allocator<KernelAllocator, Lock>& Allocator() {
-    acquireLock(&allocatorInstanceLock);
-
     // This is a hack to get around the allocator not being initialized
-    if (!allocator) {
-        size_t pageCount = (sizeof(KernelAllocator) + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K;
-        allocator = reinterpret_cast<KernelAllocator*>(Memory::KernelAllocate4KPages(pageCount));
-        uintptr_t base = reinterpret_cast<uintptr_t>(allocator);
+    if (__builtin_expect(!__atomic_load_n(&allocator, __ATOMIC_ACQUIRE), 0)) {
+        ScopedSpinLock<true> lockInstance(allocatorInstanceLock);
 
-        while (pageCount--) {
-            Memory::KernelMapVirtualMemory4K(Memory::AllocatePhysicalMemoryBlock(), base, 1);
-            base += PAGE_SIZE_4K;
+        if (!allocator) {
+            KernelAllocator* newAllocator = reinterpret_cast<KernelAllocator*>(
+                AllocateHeapPages((sizeof(KernelAllocator) + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K));
+
+            new (newAllocator) KernelAllocator;
+            __atomic_store_n(&allocator, newAllocator, __ATOMIC_RELEASE);
         }
+    }
+
+    return allocator->slabAllocator;
+}
+
+// Free objects are linked through their first word
+struct FreeObject {
+    FreeObject* next;
+};
+
+// Objects of one size, carved out of slabs which are never returned
+struct SizeClass {
+    lock_t lock = 0;
+    FreeObject* freeList = nullptr;
+
+    uint64_t reservedPages = 0;
+    uint64_t handedOut = 0; // Objects held by CPUs, either allocated or in their caches
+    uint64_t peakHandedOut = 0;
+
+    uint64_t refills = 0;
+    uint64_t drains = 0;
+};
+
+SizeClass sizeClasses[KMALLOC_CLASS_COUNT];
+
+// Free objects of one size class held by a CPU
+struct Magazine {
+    unsigned count = 0;
+    void* objects[KMALLOC_MAGAZINE_SIZE];
 
-        new (allocator) KernelAllocator;
+    uint64_t allocations = 0;
+    uint64_t frees = 0;
+};
+
+// Only touched by the owning CPU with interrupts disabled
+struct CPUCache {
+    Magazine magazines[KMALLOC_CLASS_COUNT];
+};
+
+CPUCache* cpuCaches[KMALLOC_MAX_CPUS];
+
+// Size class + 1 of each kernel heap page, 0 if the page does not belong to a size class
+uint8_t heapPageClasses[KMALLOC_HEAP_PAGES];
+
+ALWAYS_INLINE static size_t ClassSize(unsigned sizeClass) { return 1UL << (sizeClass + KMALLOC_MIN_CLASS_SHIFT); }
+
+ALWAYS_INLINE static unsigned SizeClassOf(size_t size) {
+    if (size <= (1UL << KMALLOC_MIN_CLASS_SHIFT)) {
+        return 0;
     }
 
-    releaseLock(&allocatorInstanceLock);
+    return (64 - __builtin_clzl(size - 1)) - KMALLOC_MIN_CLASS_SHIFT;
+}
 
-    return allocator->slabAllocator;
+// Returns the size class an object was allocated from, -1 if it came from the slab allocator
+ALWAYS_INLINE static int SizeClassOfObject(void* p) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+    if (addr < KERNEL_HEAP_VIRTUAL_BASE) {
+        return -1;
+    }
+
+    return static_cast<int>(heapPageClasses[(addr - KERNEL_HEAP_VIRTUAL_BASE) >> PAGE_SHIFT_4K]) - 1;
 }
 
-void* kmalloc(size_t size) { return Allocator().allocate(size); }
+ALWAYS_INLINE static CPUCache& LocalCache() {
+    assert(!CheckInterrupts());
+
+    uint64_t id = GetCPULocal()->id;
+    assert(id < KMALLOC_MAX_CPUS);
 
-void kfree(void* p) { return Allocator().free(p); }
+    if (__builtin_expect(!cpuCaches[id], 0)) {
+        // Nobody else uses this CPU's cache, so there is no need for a lock
+        cpuCaches[id] = new (AllocateHeapPages((sizeof(CPUCache) + PAGE_SIZE_4K - 1) / PAGE_SIZE_4K)) CPUCache;
+    }
+
+    return *cpuCaches[id];
+}
+
+// Carves a new slab into free objects. The size class lock must be held.
+static void GrowSizeClass(SizeClass& sc, unsigned sizeClass) {
+    uint8_t* slab = reinterpret_cast<uint8_t*>(AllocateHeapPages(KMALLOC_SLAB_PAGES));
+
+    uintptr_t page = (reinterpret_cast<uintptr_t>(slab) - KERNEL_HEAP_VIRTUAL_BASE) >> PAGE_SHIFT_4K;
+    for (unsigned i = 0; i < KMALLOC_SLAB_PAGES; i++) {
+        heapPageClasses[page + i] = sizeClass + 1;
+    }
+
+    // Lowest addresses get handed out first
+    size_t size = ClassSize(sizeClass);
+    for (size_t offset = KMALLOC_SLAB_PAGES * PAGE_SIZE_4K; offset >= size; offset -= size) {
+        FreeObject* obj = reinterpret_cast<FreeObject*>(slab + offset - size);
+        obj->next = sc.freeList;
+        sc.freeList = obj;
+    }
+
+    sc.reservedPages += KMALLOC_SLAB_PAGES;
+}
+
+// Moves a batch of objects from the size class into the magazine
+static void RefillMagazine(Magazine& magazine, unsigned sizeClass) {
+    SizeClass& sc = sizeClasses[sizeClass];
+    acquireLock(&sc.lock);
+
+    sc.refills++;
+    while (magazine.count < KMALLOC_MAGAZINE_BATCH) {
+        if (!sc.freeList) {
+            GrowSizeClass(sc, sizeClass);
+        }
 
-void* krealloc(void* p, size_t sz) { return Allocator().reallocate(p, sz); }
+        FreeObject* obj = sc.freeList;
+        sc.freeList = obj->next;
+
+        magazine.objects[magazine.count++] = obj;
+    }
+
+    sc.handedOut += KMALLOC_MAGAZINE_BATCH;
+    if (sc.handedOut > sc.peakHandedOut) {
+        sc.peakHandedOut = sc.handedOut;
+    }
+
+    releaseLock(&sc.lock);
+}
+
+// Returns the least recently freed batch of objects to the size class
+static void DrainMagazine(Magazine& magazine, unsigned sizeClass) {
+    SizeClass& sc = sizeClasses[sizeClass];
+    acquireLock(&sc.lock);
+
+    sc.drains++;
+    for (unsigned i = 0; i < KMALLOC_MAGAZINE_BATCH; i++) {
+        FreeObject* obj = reinterpret_cast<FreeObject*>(magazine.objects[i]);
+        obj->next = sc.freeList;
+        sc.freeList = obj;
+    }
+
+    sc.handedOut -= KMALLOC_MAGAZINE_BATCH;
+    releaseLock(&sc.lock);
+
+    magazine.count -= KMALLOC_MAGAZINE_BATCH;
+    for (unsigned i = 0; i < magazine.count; i++) {
+        magazine.objects[i] = magazine.objects[i + KMALLOC_MAGAZINE_BATCH];
+    }
+}
+
+void* kmalloc(size_t size) {
+    if (size > KMALLOC_MAX_CLASS_SIZE) {
+        return Allocator().allocate(size);
+    }
+
+    unsigned sizeClass = SizeClassOf(size);
+    InterruptDisabler disableInterrupts;
+
+    Magazine& magazine = LocalCache().magazines[sizeClass];
+    if (__builtin_expect(!magazine.count, 0)) {
+        RefillMagazine(magazine, sizeClass);
+    }
+
+    magazine.allocations++;
+    return magazine.objects[--magazine.count];
+}
+
+void kfree(void* p) {
+    if (!p) {
+        return;
+    }
+
+    int sizeClass = SizeClassOfObject(p);
+    if (sizeClass < 0) {
+        Allocator().free(p);
+        return;
+    }
+
+    InterruptDisabler disableInterrupts;
+
+    Magazine& magazine = LocalCache().magazines[sizeClass];
+    if (__builtin_expect(magazine.count >= KMALLOC_MAGAZINE_SIZE, 0)) {
+        DrainMagazine(magazine, sizeClass);
+    }
+
+    magazine.frees++;
+    magazine.objects[magazine.count++] = p;
+}
+
+void* krealloc(void* p, size_t sz) {
+    if (!p) {
+        return kmalloc(sz);
+    }
+
+    int sizeClass = SizeClassOfObject(p);
+    if (sizeClass < 0) {
+        return Allocator().reallocate(p, sz);
+    }
+
+    size_t size = ClassSize(sizeClass);
+    if (sz <= size) {
+        return p;
+    }
+
+    void* newP = kmalloc(sz);
+    if (newP) {
+        memcpy(newP, p, size);
+        kfree(p);
+    }
+
+    return newP;
+}
+
+void GetKMallocClassStats(unsigned sizeClass, KMallocClassStats& stats) {
+    assert(sizeClass < KMALLOC_CLASS_COUNT);
+
+    stats = {};
+    stats.size = ClassSize(sizeClass);
+
+    // Only the owning CPU modifies its cache, so these are just a snapshot
+    for (CPUCache* cache : cpuCaches) {
+        if (cache) {
+            stats.allocations += cache->magazines[sizeClass].allocations;
+            stats.frees += cache->magazines[sizeClass].frees;
+        }
+    }
+
+    if (stats.allocations > stats.frees) {
+        stats.bytes = (stats.allocations - stats.frees) * stats.size;
+    }
+
+    SizeClass& sc = sizeClasses[sizeClass];
+    ScopedSpinLock<true> lockClass(sc.lock);
+
+    stats.peakBytes = sc.peakHandedOut * stats.size;
+    stats.reservedBytes = sc.reservedPages * PAGE_SIZE_4K;
+    stats.refills = sc.refills;
+    stats.drains = sc.drains;
+}
 
 void frg_panic(const char* s) { Log::Error(s); }
@@ -15,6 +15,10 @@ int VMObject::Hit(uintptr_t, uintptr_t, PageMap*){
     return 1; // Fatal page fault, kill process
 }
 
+int VMObject::CopyOnWriteHit(uintptr_t, uintptr_t, PageMap*){
+    return 1; // Fatal page fault, kill process
+}
+
 VMObject* VMObject::Split(uintptr_t offset){
     assert(!"Cannot split VMObject!");
 
@@ -49,7 +53,8 @@ int PhysicalVMObject::Hit(uintptr_t base, uintptr_t offset, PageMap* pMap){
 
     uint32_t& block = physicalBlocks[blockIndex];
     if(block){ // Another reference to the VMObject probably mapped this block
-        Memory::MapVirtualMemory4K(static_cast<uintptr_t>(block) << PAGE_SHIFT_4K, base + offset, 1, pMap);
+        Memory::MapVirtualMemory4K(static_cast<uintptr_t>(block) << PAGE_SHIFT_4K, base + offset, 1,
+                                   PAGE_USER | (PAGE_WRITABLE * IsBlockWritable(blockIndex)) | PAGE_PRESENT, pMap);
     } else { // We need to allocate block
         assert(anonymous);
 
@@ -78,6 +83,46 @@ int PhysicalVMObject::Hit(uintptr_t base, uintptr_t offset, PageMap* pMap){
     return 0; // Success
 }
 
+int PhysicalVMObject::CopyOnWriteHit(uintptr_t base, uintptr_t offset, PageMap* pMap){
+    unsigned blockIndex = offset >> PAGE_SHIFT_4K;
+    assert(blockIndex < (size >> PAGE_SHIFT_4K));
+
+    ScopedSpinLock lockCopy(copyLock);
+
+    uint32_t& block = physicalBlocks[blockIndex];
+    if(!block){
+        return Hit(base, offset, pMap); // Never allocated, nothing to copy
+    }
+
+    uintptr_t phys = static_cast<uintptr_t>(block) << PAGE_SHIFT_4K;
+    if(Memory::IsPhysicalMemoryBlockShared(phys)){
+        uintptr_t newPhys = Memory::AllocatePhysicalMemoryBlock();
+        assert(newPhys < PHYS_BLOCK_MAX);
+        if(!newPhys){
+            return 1; // Failed to allocate
+        }
+
+        // Temporary mappings so we can copy the data over
+        uint8_t* virtBuffer = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(2));
+        uint8_t* virtDestBuffer = virtBuffer + PAGE_SIZE_4K;
+
+        Memory::KernelMapVirtualMemory4K(phys, (uintptr_t)virtBuffer, 1);
+        Memory::KernelMapVirtualMemory4K(newPhys, (uintptr_t)virtDestBuffer, 1);
+
+        memcpy(virtDestBuffer, virtBuffer, PAGE_SIZE_4K);
+
+        Memory::KernelFree4KPages(virtBuffer, 2);
+
+        block = newPhys >> PAGE_SHIFT_4K;
+        Memory::ReleasePhysicalMemoryBlock(phys); // The other owners keep the original
+        phys = newPhys;
+    }
+
+    // Either we copied the block or every other owner has already made their own copy
+    Memory::MapVirtualMemory4K(phys, base + offset, 1, PAGE_USER | PAGE_WRITABLE | PAGE_PRESENT, pMap);
+    return 0;
+}
+
 void PhysicalVMObject::ForceAllocate(){
     void* mapping = Memory::KernelAllocate4KPages(1);
     for(unsigned i = 0; i < (size >> PAGE_SHIFT_4K); i++){
@@ -100,12 +145,11 @@ void PhysicalVMObject::ForceAllocate(){
 void PhysicalVMObject::MapAllocatedBlocks(uintptr_t base, PageMap* pMap){
     uintptr_t virt = base;
 
-    long pgFlags = PAGE_USER | (PAGE_WRITABLE * (!copyOnWrite)) | PAGE_PRESENT;
     for(unsigned i = 0; i < (size >> PAGE_SHIFT_4K); i++){
         uint64_t block = physicalBlocks[i];
         if(block){ // Is it allocated?
-            // Only set write flag if copyOnWrite is false
-            Memory::MapVirtualMemory4K(block << PAGE_SHIFT_4K, virt, 1, pgFlags, pMap);
+            // Only set write flag if the block is not shared with another VMObject
+            Memory::MapVirtualMemory4K(block << PAGE_SHIFT_4K, virt, 1, PAGE_USER | (PAGE_WRITABLE * IsBlockWritable(i)) | PAGE_PRESENT, pMap);
         } else {
             Memory::MapVirtualMemory4K(0, virt, 1, PAGE_USER, pMap); // Mark as user, not present, not writable
         }
@@ -114,30 +158,27 @@ void PhysicalVMObject::MapAllocatedBlocks(uintptr_t base, PageMap* pMap){
     }
 }
 
-VMObject* PhysicalVMObject::Clone(){
-    assert(!shared);
-    PhysicalVMObject* newVMO = new PhysicalVMObject(size, anonymous, shared);
-
-    // Temporary mappings so we can copy the data over
-    uint8_t* virtBuffer = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(2));
-    uint8_t* virtDestBuffer = virtBuffer + PAGE_SIZE_4K;
+PhysicalVMObject::PhysicalVMObject(const PhysicalVMObject& other) : VMObject(other.size, other.anonymous, other.shared) {
+    size_t blockCount = PAGE_COUNT_4K(size);
 
-    for(unsigned i = 0; i < (size >> PAGE_SHIFT_4K); i++){
-        uintptr_t block = physicalBlocks[i];
+    physicalBlocks = new uint32_t[blockCount];
+    for(unsigned i = 0; i < blockCount; i++){
+        uintptr_t block = other.physicalBlocks[i];
         if(block){
-            uintptr_t newBlock = Memory::AllocatePhysicalMemoryBlock();
-            newVMO->physicalBlocks[i] = newBlock >> PAGE_SHIFT_4K;
-
-            Memory::KernelMapVirtualMemory4K(block << PAGE_SHIFT_4K, (uintptr_t)virtBuffer, 1); // Map temporary mappings to our blocks
-            Memory::KernelMapVirtualMemory4K(newBlock, (uintptr_t)virtDestBuffer, 1);
-
-            memcpy(virtDestBuffer, virtBuffer, PAGE_SIZE_4K); // Copy each block
+            Memory::SharePhysicalMemoryBlock(block << PAGE_SHIFT_4K);
         }
+
+        physicalBlocks[i] = block;
     }
 
-    Memory::KernelFree4KPages(virtBuffer, 2);
+    copyOnWrite = true;
+}
+
+VMObject* PhysicalVMObject::Clone(){
+    assert(!shared);
+    PhysicalVMObject* newVMO = new PhysicalVMObject(*this);
 
-    newVMO->copyOnWrite = false;
+    copyOnWrite = true; // Our blocks are now shared too
     newVMO->refCount = 1;
 
     return newVMO;
@@ -164,7 +205,7 @@ PhysicalVMObject::~PhysicalVMObject(){
     if(physicalBlocks){
         for(unsigned i = 0; i < size >> PAGE_SHIFT_4K; i++){ // Free our allocated physical blocks
             if(physicalBlocks[i]){
-                Memory::FreePhysicalMemoryBlock(static_cast<uintptr_t>(physicalBlocks[i]) << PAGE_SHIFT_4K);
+                Memory::ReleasePhysicalMemoryBlock(static_cast<uintptr_t>(physicalBlocks[i]) << PAGE_SHIFT_4K);
             }
             
         }
@@ -186,11 +227,33 @@ void ProcessImageVMObject::MapAllocatedBlocks(uintptr_t requestedBase, PageMap*
         uint64_t block = physicalBlocks[i];
         assert(block);
 
-        Memory::MapVirtualMemory4K(block << PAGE_SHIFT_4K, virt, 1, PAGE_USER | (PAGE_WRITABLE * (write && !copyOnWrite)) | PAGE_PRESENT, pMap);
+        Memory::MapVirtualMemory4K(block << PAGE_SHIFT_4K, virt, 1, PAGE_USER | (PAGE_WRITABLE * (write && IsBlockWritable(i))) | PAGE_PRESENT, pMap);
         virt += PAGE_SIZE_4K;
     }
 }
 
+int ProcessImageVMObject::CopyOnWriteHit(uintptr_t base, uintptr_t offset, PageMap* pMap){
+    if(!write){
+        return 1; // Segment is read only
+    }
+
+    return PhysicalVMObject::CopyOnWriteHit(base, offset, pMap);
+}
+
+ProcessImageVMObject::ProcessImageVMObject(const ProcessImageVMObject& other) :
+    PhysicalVMObject(other), write(other.write), base(other.base) {
+
+}
+
+VMObject* ProcessImageVMObject::Clone(){
+    ProcessImageVMObject* newVMO = new ProcessImageVMObject(*this);
+
+    copyOnWrite = true;
+    newVMO->refCount = 1;
+
+    return newVMO;
+}
+
 AnonymousVMObject::AnonymousVMObject(size_t size)
     : PhysicalVMObject(size, true, false) {
 
@@ -198,11 +261,12 @@ AnonymousVMObject::AnonymousVMObject(size_t size)
 
 VMObject* AnonymousVMObject::Split(uintptr_t offset){
     assert(!(offset & (PAGE_SIZE_4K - 1)));
-    assert(!copyOnWrite || refCount <= 1);
+    assert(refCount <= 1);
 
     uintptr_t offsetBlocks = offset >> PAGE_SHIFT_4K;
 
     AnonymousVMObject* newObject = new AnonymousVMObject(size - offset);
+    newObject->copyOnWrite = copyOnWrite; // Blocks may still be shared
     memcpy(newObject->physicalBlocks, &physicalBlocks[offsetBlocks], ((size - offset) >> PAGE_SHIFT_4K) * sizeof(uint32_t));
 
     uint32_t* newPhysicalBlocks = new uint32_t[offsetBlocks];
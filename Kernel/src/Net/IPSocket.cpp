@@ -26,6 +26,21 @@ int64_t IPSocket::OnReceive(void* buffer, size_t len){
 	return -ENOSYS;
 }
 
+void IPSocket::Watch(FilesystemWatcher& watcher, int events){
+	ScopedSpinLock acq(m_watcherLock);
+	m_watching.add_back(&watcher);
+}
+
+void IPSocket::Unwatch(FilesystemWatcher& watcher){
+	ScopedSpinLock acq(m_watcherLock);
+	m_watching.remove(&watcher);
+}
+
+void IPSocket::NotifyWatchers(){
+	ScopedSpinLock acq(m_watcherLock);
+	fs::SignalWatchers(m_watching);
+}
+
 Socket* IPSocket::Accept(sockaddr* addr, socklen_t* addrlen, int mode){
 	return nullptr;
 }
@@ -75,17 +90,7 @@ int IPSocket::Listen(int backlog){
 }
     
 int64_t IPSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen, const void* ancillary, size_t ancillaryLen){
-	if(flags & SOCK_NONBLOCK && !pQueue.get_length()){
-		return -EAGAIN;
-	}
-
 	return -ENOSYS;
-
-	while(!pQueue.get_length()) Scheduler::Yield();
-
-	if(src && addrlen){
-		src->family = InternetProtocol;
-	}
 }
 
 int64_t IPSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen, const void* ancillary, size_t ancillaryLen){
@@ -11,6 +11,7 @@
 #include <Objects/Interface.h>
 
 #define NET_INTERFACE_STACKSIZE 32768
+#define NET_RX_BUDGET 64 // Most packets handled from one adapter before moving onto the next
 
 namespace Network{
 	extern HashMap<uint32_t, MACAddress> addressCache;
@@ -79,87 +80,124 @@ namespace Network{
 		Log::Info("[Network] [ICMP] Received packet, Type: %d, Code: %d", header->type, header->code);
 	}
 
-    void OnReceiveIPv4(void* data, size_t length){
-		if(length < sizeof(IPv4Header)){
+    void OnReceiveIPv4(NetworkAdapter* adapter, NetBuffer* buffer){
+		if(buffer->length < sizeof(IPv4Header)){
 			Log::Warning("[Network] [IPv4] Discarding packet (too short)");
+			CountDrop(NetLayerIPv4);
 			return;
 		}
 
-		IPv4Header* header = (IPv4Header*)data;
+		IPv4Header* header = reinterpret_cast<IPv4Header*>(buffer->data);
 
 		if(header->version != 4){
 			Log::Warning("[Network] [IPv4] Discarding packet (invalid version)");
+			CountDrop(NetLayerIPv4);
 			return;
 		}
 
-		BigEndian<uint16_t> checksum = header->headerChecksum;
-
-		header->headerChecksum = 0;
-		if(checksum.value != CaclulateChecksum(data, sizeof(IPv4Header)).value){ // Verify checksum
-			Log::Warning("[Network] [IPv4] Discarding packet (invalid checksum)");
+		if((uint16_t)header->length < sizeof(IPv4Header) || (uint16_t)header->length > buffer->length){
+			Log::Warning("[Network] [IPv4] Discarding packet (invalid length)");
+			CountDrop(NetLayerIPv4);
 			return;
 		}
 
+		// Loopback packets never left memory so there is nothing to verify
+		if(adapter->Type() != NetworkAdapter::NetworkAdapterLoopback){
+			BigEndian<uint16_t> checksum = header->headerChecksum;
+
+			header->headerChecksum = 0;
+			if(checksum.value != CaclulateChecksum(header, sizeof(IPv4Header)).value){ // Verify checksum
+				Log::Warning("[Network] [IPv4] Discarding packet (invalid checksum)");
+				CountDrop(NetLayerIPv4);
+				return;
+			}
+		}
+
+		// Strip the header and any Ethernet padding, the header stays reachable through network
+		buffer->network = buffer->data;
+		buffer->Trim((uint16_t)header->length);
+		buffer->Pull(sizeof(IPv4Header));
+
 		switch(header->protocol){
 			case IPv4ProtocolICMP:
-				OnReceiveICMP(header->data, length - sizeof(IPv4Header));
+				OnReceiveICMP(buffer->data, buffer->length);
 				break;
 			case IPv4ProtocolUDP:
-				UDP::OnReceiveUDP(*header, header->data, ((uint16_t)header->length) - sizeof(IPv4Header));
+				UDP::OnReceiveUDP(*header, buffer);
 				break;
 			case IPv4ProtocolTCP:
-				TCP::OnReceiveTCP(*header, header->data, ((uint16_t)header->length) - sizeof(IPv4Header));
+				TCP::OnReceiveTCP(*header, buffer);
 				break;
 			default:
 				Log::Warning("[Network] [IPv4] Discarding packet (invalid protocol %x)", header->protocol);
+				CountDrop(NetLayerIPv4);
 				break;
 		}
 	}
 
+	void OnReceiveFrame(NetworkAdapter* adapter, NetBuffer* buffer){
+		if(buffer->length < sizeof(EthernetFrame)){
+			Log::Warning("[Network] Discarding packet (too short)");
+			CountDrop(NetLayerEthernet);
+			return;
+		}
+
+		EthernetFrame* etherFrame = reinterpret_cast<EthernetFrame*>(buffer->data);
+		if(etherFrame->dest != adapter->mac && etherFrame->dest != MACAddress{0xff, 0xff, 0xff, 0xff, 0xff, 0xff}){
+			Log::Warning("[Network] Discarding packet (invalid MAC address %x:%x:%x:%x:%x:%x)", etherFrame->dest[0], etherFrame->dest[1], etherFrame->dest[2], etherFrame->dest[3], etherFrame->dest[4], etherFrame->dest[5]);
+			CountDrop(NetLayerEthernet);
+			return;
+		}
+
+		buffer->Pull(sizeof(EthernetFrame));
+
+		switch ((uint16_t)etherFrame->etherType)
+		{
+		case EtherTypeIPv4:
+			OnReceiveIPv4(adapter, buffer);
+			break;
+		case EtherTypeARP:
+			OnReceiveARP(buffer->data, buffer->length);
+			break;
+		default:
+			Log::Warning("[Network] Discarding packet (invalid EtherType %x)", etherFrame->etherType);
+			CountDrop(NetLayerEthernet);
+			break;
+		}
+	}
+
 	[[noreturn]] void InterfaceThread(){
 		Log::Info("[Network] Initializing network interface layer...");
 
 		for(;;){
-			NetworkPacket* p;
 			if(packetQueueSemaphore.Wait()){
 				continue; // We got interrupted
 			}
 			
-			for(NetworkAdapter* adapter : adapters){
-				if((p = adapter->Dequeue())){
-					if(p->length < sizeof(EthernetFrame)){
-						Log::Warning("[Network] Discarding packet (too short)");
-
-						adapter->CachePacket(p);
-						break;
+			// Drivers may signal once for a batch of packets, so drain every adapter.
+			// Each adapter gets at most NET_RX_BUDGET packets a pass so one cannot starve the others.
+			bool pending;
+			do {
+				pending = false;
+				for(NetworkAdapter* adapter : adapters){
+					unsigned count = 0;
+					NetBuffer* buffer;
+					while(count < NET_RX_BUDGET && (buffer = adapter->Dequeue())){
+						// Frames are handled in place, anything that keeps the buffer takes a reference
+						OnReceiveFrame(adapter, buffer);
+						ReleaseBuffer(buffer);
+
+						count++;
 					}
 
-					size_t len = p->length;
-					uint8_t buffer[ETHERNET_MAX_PACKET_SIZE];
-					memcpy(buffer, p->data, p->length);
-
-					adapter->CachePacket(p); // Get the packet back to the NIC driver's cache as soon as possible
-
-					EthernetFrame* etherFrame = reinterpret_cast<EthernetFrame*>(buffer);
-					if(etherFrame->dest != adapter->mac && etherFrame->dest != MACAddress{0xff, 0xff, 0xff, 0xff, 0xff, 0xff}){
-						Log::Warning("[Network] Discarding packet (invalid MAC address %x:%x:%x:%x:%x:%x)", etherFrame->dest[0], etherFrame->dest[1], etherFrame->dest[2], etherFrame->dest[3], etherFrame->dest[4], etherFrame->dest[5]);
-						continue;
-					}
-					
-					switch ((uint16_t)etherFrame->etherType)
-					{
-					case EtherTypeIPv4:
-						OnReceiveIPv4(etherFrame->data, len - sizeof(EthernetFrame));
-						break;
-					case EtherTypeARP:
-						OnReceiveARP(etherFrame->data, len - sizeof(EthernetFrame));
-						break;
-					default:
-						Log::Warning("[Network] Discarding packet (invalid EtherType %x)", etherFrame->etherType);
-						break;
+					if(count >= NET_RX_BUDGET){
+						pending = true;
 					}
 				}
-			}
+			} while(pending);
+
+			// TCP retransmission, delayed ACK and TIME-WAIT timers wake us through the same semaphore
+			TCP::ProcessTimers();
 		}
 	}
 
@@ -169,34 +207,49 @@ namespace Network{
 	}
 
 	void Send(void* data, size_t length, NetworkAdapter* adapter){
-		if(adapter){
-			adapter->SendPacket(data, length);
-		} else for(auto& adapter : adapters){
-			adapter->SendPacket(data, length);
-			break;
+		if(!adapter){
+			if(!adapters.get_length()){
+				return;
+			}
+
+			adapter = adapters[0];
 		}
+
+		if(length > ETHERNET_MAX_PACKET_SIZE){
+			return;
+		}
+
+		NetBuffer* buffer = AllocateBuffer(NetLayerEthernet);
+		if(!buffer){
+			return;
+		}
+
+		memcpy(buffer->Put(length), data, length);
+		CountCopy(NetLayerEthernet, length);
+
+		adapter->Transmit(buffer);
 	}
 
-    int SendIPv4(void* data, size_t length, IPv4Address& source, IPv4Address& destination, uint8_t protocol, NetworkAdapter* adapter){
-		if(length > 1518 - sizeof(EthernetFrame) - sizeof(IPv4Header)){
+    int SendIPv4(NetBuffer* buffer, IPv4Address& source, IPv4Address& destination, uint8_t protocol, NetworkAdapter* adapter){
+		if(buffer->length > ETHERNET_MAX_PACKET_SIZE - sizeof(EthernetFrame) - sizeof(IPv4Header)){
+			ReleaseBuffer(buffer);
 			return -EMSGSIZE;
 		}
 
 		assert(adapter);
 
-		uint8_t buffer[1600]; // The maxmium Ethernet frame size is 1518 so this will do
-
-		EthernetFrame* ethFrame = (EthernetFrame*)buffer;
-		ethFrame->etherType = EtherTypeIPv4;
-		ethFrame->src = adapter->mac;
-		
+		MACAddress destMAC;
 		if(destination.value == INADDR_BROADCAST){
-			ethFrame->dest = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff}; // Broadcast MAC Address
-		} else if(int status = Route(source, destination, ethFrame->dest, adapter); status < 0){
+			destMAC = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff}; // Broadcast MAC Address
+		} else if(int status = Route(source, destination, destMAC, adapter); status < 0){
+			CountDrop(NetLayerIPv4);
+			ReleaseBuffer(buffer);
 			return status;
 		}
 
-		IPv4Header* ipHeader = (IPv4Header*)ethFrame->data;
+		uint16_t length = buffer->length;
+
+		IPv4Header* ipHeader = reinterpret_cast<IPv4Header*>(buffer->Push(sizeof(IPv4Header)));
 		memset(ipHeader, 0, sizeof(IPv4Header));
 
 		ipHeader->ihl = 5; // 5 dwords (20 bytes)
@@ -209,11 +262,16 @@ namespace Network{
 		ipHeader->destIP = destination;
 		ipHeader->sourceIP = adapter->adapterIP;
 
-		ipHeader->headerChecksum = CaclulateChecksum(ipHeader, sizeof(IPv4Header));
+		if(adapter->Type() != NetworkAdapter::NetworkAdapterLoopback){
+			ipHeader->headerChecksum = CaclulateChecksum(ipHeader, sizeof(IPv4Header));
+		}
 
-		memcpy(ipHeader->data, data, length);
+		EthernetFrame* ethFrame = reinterpret_cast<EthernetFrame*>(buffer->Push(sizeof(EthernetFrame)));
+		ethFrame->etherType = EtherTypeIPv4;
+		ethFrame->src = adapter->mac;
+		ethFrame->dest = destMAC;
 
-		Send(ethFrame, sizeof(EthernetFrame) + sizeof(IPv4Header) + length, adapter);
+		adapter->Transmit(buffer);
 
 		return 0;
 	}
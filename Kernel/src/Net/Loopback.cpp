@@ -0,0 +1,42 @@
+#include <Net/Adapter.h>
+
+#include <Logging.h>
+
+#define LOOPBACK_QUEUE_MAX 1024 // Packets waiting for the network thread before we start dropping them
+
+namespace Network {
+    LoopbackAdapter::LoopbackAdapter() : NetworkAdapter(NetworkAdapterLoopback) {
+        SetInstanceName("lo");
+        SetDeviceName("Loopback Adapter");
+
+        mac = {0, 0, 0, 0, 0, 0};
+        adapterIP = IPv4Address(127, 0, 0, 1);
+        subnetMask = IPv4Address(255, 0, 0, 0);
+
+        dState = OK;
+        linkState = LinkUp;
+    }
+
+    void LoopbackAdapter::Transmit(NetBuffer* buffer){
+        // The buffer is queued as it is, the receive path strips the headers in place
+        buffer->adapter = this;
+
+        acquireLock(&queueLock);
+        if(queue.get_length() >= LOOPBACK_QUEUE_MAX){
+            dropped++; // Behave like a NIC with a full ring, TCP will send it again
+            releaseLock(&queueLock);
+
+            CountDrop(NetLayerDriver);
+            ReleaseBuffer(buffer);
+            return;
+        }
+
+        queue.add_back(buffer);
+        releaseLock(&queueLock);
+
+        // Handled on the network thread like any other packet, so a socket sending to
+        // itself never re-enters the TCP layer whilst it is still sending
+        packetSemaphore.Signal();
+        Network::packetQueueSemaphore.Signal();
+    }
+}
@@ -17,6 +17,10 @@ namespace Network {
     HashMap<uint32_t, MACAddress> addressCache;
 
     void InitializeConnections(){
+        InitializeBuffers();
+
+        NetFS::GetInstance()->RegisterAdapter(new LoopbackAdapter());
+
         InitializeNetworkThread();
     }
 
@@ -109,6 +113,15 @@ namespace Network {
             return -ENETUNREACH;
         }
 
+        if(adapter->Type() == NetworkAdapter::NetworkAdapterLoopback){
+            if(!isLocalDestination){
+                return -ENETUNREACH; // Nothing leaves through lo
+            }
+
+            mac = adapter->mac; // No need for ARP
+            return 0;
+        }
+
         if(isLocalDestination){
             int status = IPLookup(adapter, dest, mac);
             if(status < 0){
@@ -145,13 +158,18 @@ namespace Network {
 
             dirent->flags = FS_NODE_DIRECTORY;
             return 1;
+        } else if(index == 2){
+            strcpy(dirent->name, "stats");
+
+            dirent->flags = FS_NODE_CHARDEVICE;
+            return 1;
         }
 
-        if(index >= adapters.get_length() + 2){
+        if(index >= adapters.get_length() + 3){
             return 0; // Out of range
         }
 
-        NetworkAdapter* adapter = adapters[index - 2];
+        NetworkAdapter* adapter = adapters[index - 3];
         strcpy(dirent->name, adapter->InstanceName().c_str());
 
         dirent->flags = FS_NODE_CHARDEVICE;
@@ -164,6 +182,8 @@ namespace Network {
             return this;
         } else if(strcmp(name, "..") == 0){
             return DeviceManager::GetDevFS();
+        } else if(strcmp(name, "stats") == 0){
+            return StatisticsDevice();
         }
 
         for(NetworkAdapter* adapter : adapters){
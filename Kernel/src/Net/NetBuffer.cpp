@@ -0,0 +1,253 @@
+#include <Net/NetBuffer.h>
+
+#include <Net/Net.h>
+
+#include <CPU.h>
+#include <Device.h>
+#include <Errno.h>
+#include <Logging.h>
+#include <Math.h>
+#include <Paging.h>
+#include <PhysicalAllocator.h>
+#include <SMP.h>
+#include <Spinlock.h>
+
+#define NET_BUFFER_GROW_ORDER 3 // The pool grows by 2^order pages at a time
+
+static_assert(sizeof(NetBuffer) + NET_BUFFER_HEADROOM + ETHERNET_MAX_PACKET_SIZE <= NET_BUFFER_SIZE);
+static_assert(!(PAGE_SIZE_4K % NET_BUFFER_SIZE));
+
+// Each CPU allocates from and frees to its own list with interrupts disabled,
+// only going to the shared pool once it runs out or has too many
+struct NetBufferCache {
+    NetBuffer* free = nullptr; // Linked through next
+    unsigned count = 0;
+
+    lemon_net_layer_stats_t layers[NetLayerCount] = {};
+};
+
+namespace Network {
+    NetBuffer* sharedBuffers = nullptr; // Linked through next
+    unsigned sharedBufferCount = 0;
+    lock_t sharedBuffersLock = 0;
+
+    unsigned bufferCount = 0; // Every buffer ever allocated, they are never given back
+
+    // Counters from before the per CPU caches were set up
+    NetBufferCache bootCache;
+
+    class NetStatistics : public Device {
+    public:
+        NetStatistics() : Device("stats", DeviceTypeUNIXPseudo, NetFS::GetInstance()) {
+            flags = FS_NODE_CHARDEVICE;
+
+            SetDeviceName("Network Buffer Statistics");
+        }
+
+        ssize_t Read(size_t offset, size_t size, uint8_t* buffer) override {
+            lemon_net_stats_t stats = {};
+            stats.buffers = __atomic_load_n(&bufferCount, __ATOMIC_RELAXED);
+            stats.freeBuffers = __atomic_load_n(&sharedBufferCount, __ATOMIC_RELAXED);
+
+            auto add = [&stats](const NetBufferCache& cache) {
+                for (unsigned i = 0; i < NetLayerCount; i++) {
+                    stats.layers[i].allocations += __atomic_load_n(&cache.layers[i].allocations, __ATOMIC_RELAXED);
+                    stats.layers[i].copies += __atomic_load_n(&cache.layers[i].copies, __ATOMIC_RELAXED);
+                    stats.layers[i].bytesCopied += __atomic_load_n(&cache.layers[i].bytesCopied, __ATOMIC_RELAXED);
+                    stats.layers[i].drops += __atomic_load_n(&cache.layers[i].drops, __ATOMIC_RELAXED);
+                }
+            };
+
+            add(bootCache);
+            for (unsigned i = 0; i < SMP::processorCount; i++) {
+                if (NetBufferCache* cache = SMP::cpus[i]->netBufferCache; cache) {
+                    add(*cache);
+                }
+            }
+
+            if (offset >= sizeof(lemon_net_stats_t)) {
+                return 0;
+            }
+
+            size = MIN(size, sizeof(lemon_net_stats_t) - offset);
+            memcpy(buffer, reinterpret_cast<uint8_t*>(&stats) + offset, size);
+            return size;
+        }
+    };
+
+    NetStatistics* statistics = nullptr;
+
+    // Counters are only written by their own CPU, the atomics keep a thread
+    // which moves to another CPU part way through from losing an update
+    ALWAYS_INLINE static lemon_net_layer_stats_t& LocalCounters(NetLayer layer){
+        NetBufferCache* cache = GetCPULocal()->netBufferCache;
+        return (cache ? cache : &bootCache)->layers[layer];
+    }
+
+    // Carve up more pages and add them to the shared pool, false if we are out of memory or at NET_BUFFER_POOL_MAX
+    static bool GrowPool(){
+        const unsigned pages = 1U << NET_BUFFER_GROW_ORDER;
+        const unsigned count = pages * (PAGE_SIZE_4K / NET_BUFFER_SIZE);
+
+        if(__atomic_add_fetch(&bufferCount, count, __ATOMIC_RELAXED) > NET_BUFFER_POOL_MAX){
+            __atomic_sub_fetch(&bufferCount, count, __ATOMIC_RELAXED);
+            return false;
+        }
+
+        uintptr_t phys = Memory::AllocatePhysicalMemoryBlocks(NET_BUFFER_GROW_ORDER);
+        if(!phys){
+            __atomic_sub_fetch(&bufferCount, count, __ATOMIC_RELAXED);
+            return false;
+        }
+
+        uint8_t* virt = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(pages));
+        Memory::KernelMapVirtualMemory4K(phys, reinterpret_cast<uintptr_t>(virt), pages);
+
+        NetBuffer* head = nullptr;
+        NetBuffer* tail = nullptr;
+        for(unsigned i = 0; i < count; i++){
+            NetBuffer* buffer = reinterpret_cast<NetBuffer*>(virt + i * NET_BUFFER_SIZE);
+            buffer->physical = phys + i * NET_BUFFER_SIZE;
+            buffer->next = head;
+            head = buffer;
+
+            if(!tail){
+                tail = buffer;
+            }
+        }
+
+        ScopedSpinLock<true> lock{sharedBuffersLock};
+        tail->next = sharedBuffers;
+        sharedBuffers = head;
+        sharedBufferCount += count;
+
+        return true;
+    }
+
+    void InitializeBuffers(){
+        for(unsigned i = 0; i < SMP::processorCount; i++){
+            // The CPU reads this with interrupts disabled, so it never sees a partial write
+            __atomic_store_n(&SMP::cpus[i]->netBufferCache, new NetBufferCache(), __ATOMIC_RELEASE);
+        }
+
+        while(bufferCount < NET_BUFFER_POOL_INITIAL){
+            if(!GrowPool()){
+                Log::Warning("[Network] Could only allocate %u packet buffers", bufferCount);
+                break;
+            }
+        }
+
+        statistics = new NetStatistics();
+    }
+
+    NetBuffer* AllocateBuffer(NetLayer layer){
+        NetBuffer* buffer = nullptr;
+        for(;;){
+            {
+                InterruptDisabler disableInterrupts;
+
+                NetBufferCache* cache = GetCPULocal()->netBufferCache;
+                if(!cache){
+                    ScopedSpinLock lock{sharedBuffersLock};
+                    if((buffer = sharedBuffers)){
+                        sharedBuffers = buffer->next;
+                        sharedBufferCount--;
+                    }
+                } else {
+                    if(!cache->free){
+                        // Take half a cache worth at once so we are not on the shared lock for every packet
+                        ScopedSpinLock lock{sharedBuffersLock};
+                        while(sharedBuffers && cache->count < NET_BUFFER_CPU_CACHE / 2){
+                            NetBuffer* b = sharedBuffers;
+                            sharedBuffers = b->next;
+                            sharedBufferCount--;
+
+                            b->next = cache->free;
+                            cache->free = b;
+                            cache->count++;
+                        }
+                    }
+
+                    if((buffer = cache->free)){
+                        cache->free = buffer->next;
+                        cache->count--;
+                    }
+                }
+            }
+
+            // Mapping new pages is not safe from an interrupt handler
+            if(buffer || !CheckInterrupts() || !GrowPool()){
+                break;
+            }
+        }
+
+        lemon_net_layer_stats_t& counters = LocalCounters(layer);
+        if(!buffer){
+            __atomic_add_fetch(&counters.drops, 1, __ATOMIC_RELAXED);
+            return nullptr;
+        }
+        __atomic_add_fetch(&counters.allocations, 1, __ATOMIC_RELAXED);
+
+        buffer->next = buffer->prev = nullptr;
+        buffer->data = buffer->storage + NET_BUFFER_HEADROOM;
+        buffer->length = 0;
+        buffer->refCount = 1;
+        buffer->adapter = nullptr;
+        buffer->network = buffer->transport = nullptr;
+
+        return buffer;
+    }
+
+    void ReleaseBuffer(NetBuffer* buffer){
+        if(__atomic_sub_fetch(&buffer->refCount, 1, __ATOMIC_ACQ_REL)){
+            return;
+        }
+
+        InterruptDisabler disableInterrupts;
+
+        NetBufferCache* cache = GetCPULocal()->netBufferCache;
+        if(!cache){
+            ScopedSpinLock lock{sharedBuffersLock};
+            buffer->next = sharedBuffers;
+            sharedBuffers = buffer;
+            sharedBufferCount++;
+            return;
+        }
+
+        buffer->next = cache->free;
+        cache->free = buffer;
+        if(++cache->count <= NET_BUFFER_CPU_CACHE){
+            return;
+        }
+
+        // Give half back so buffers freed on one CPU (e.g. by the network thread) can be used by the others
+        NetBuffer* head = cache->free;
+        NetBuffer* tail = head;
+        for(unsigned i = 1; i < NET_BUFFER_CPU_CACHE / 2; i++){
+            tail = tail->next;
+        }
+
+        cache->free = tail->next;
+        cache->count -= NET_BUFFER_CPU_CACHE / 2;
+
+        ScopedSpinLock lock{sharedBuffersLock};
+        tail->next = sharedBuffers;
+        sharedBuffers = head;
+        sharedBufferCount += NET_BUFFER_CPU_CACHE / 2;
+    }
+
+    void CountCopy(NetLayer layer, size_t bytes){
+        lemon_net_layer_stats_t& counters = LocalCounters(layer);
+
+        __atomic_add_fetch(&counters.copies, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&counters.bytesCopied, bytes, __ATOMIC_RELAXED);
+    }
+
+    void CountDrop(NetLayer layer){
+        __atomic_add_fetch(&LocalCounters(layer).drops, 1, __ATOMIC_RELAXED);
+    }
+
+    Device* StatisticsDevice(){
+        return statistics;
+    }
+}
@@ -13,8 +13,8 @@ namespace Network {
         flags = FS_NODE_CHARDEVICE;
     }
 
-    void NetworkAdapter::SendPacket(void* data, size_t len){
-        assert(!"NetworkAdapter: Base class SendPacket has been called");
+    void NetworkAdapter::Transmit(NetBuffer* buffer){
+        assert(!"NetworkAdapter: Base class Transmit has been called");
     }
 
     int NetworkAdapter::GetLink() const {
@@ -25,7 +25,7 @@ namespace Network {
         return queue.get_length();
     }
 
-    NetworkPacket* NetworkAdapter::Dequeue() { 
+    NetBuffer* NetworkAdapter::Dequeue() { 
         ScopedSpinLock lock{queueLock};
         if(queue.get_length()) {
             packetSemaphore.SetValue(queue.get_length() - 1);
@@ -35,7 +35,7 @@ namespace Network {
         }
     }
 
-    NetworkPacket* NetworkAdapter::DequeueBlocking() {
+    NetBuffer* NetworkAdapter::DequeueBlocking() {
         if(packetSemaphore.Wait()){
             return nullptr; // We were interrupted
         }
@@ -47,18 +47,6 @@ namespace Network {
             return nullptr;
         }
     }
-    
-    void NetworkAdapter::CachePacket(NetworkPacket* pkt){
-        if(cache.get_length() < maxCache){
-            acquireLock(&cacheLock);
-
-            cache.add_back(pkt);
-
-            releaseLock(&cacheLock);
-        } else {
-            delete pkt;
-        }
-    };
 
     int NetworkAdapter::Ioctl(uint64_t cmd, uint64_t arg){
         Process* currentProcess = Scheduler::GetCurrentProcess();
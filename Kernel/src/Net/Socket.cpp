@@ -93,6 +93,99 @@ int64_t Socket::SendTo(void* buffer, size_t len, int flags, const sockaddr* src,
     return -1; // We should not return but get the compiler to shut up
 }
 
+int64_t Socket::SendMsg(const msghdr* msg, int flags) {
+    const sockaddr* dest = msg->msg_namelen ? reinterpret_cast<const sockaddr*>(msg->msg_name) : nullptr;
+    socklen_t destLength = dest ? msg->msg_namelen : 0;
+
+    if (msg->msg_iovlen == 1) {
+        return SendTo(msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len, flags, dest, destLength, msg->msg_control,
+                      msg->msg_controllen);
+    }
+
+    if (type != StreamSocket) {
+        // Each call to SendTo would be a datagram of its own
+        size_t length = IovecLength(msg->msg_iov, msg->msg_iovlen);
+        if (length > SOCKET_DATAGRAM_MAX) {
+            return -EMSGSIZE;
+        }
+
+        uint8_t* buffer = new uint8_t[length];
+        GatherIovecs(buffer, msg->msg_iov, msg->msg_iovlen);
+
+        int64_t ret = SendTo(buffer, length, flags, dest, destLength, msg->msg_control, msg->msg_controllen);
+        delete[] buffer;
+        return ret;
+    }
+
+    int64_t sent = 0;
+    for (unsigned i = 0; i < msg->msg_iovlen; i++) {
+        int64_t ret = SendTo(msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len, flags, dest, destLength,
+                             msg->msg_control, msg->msg_controllen);
+        if (ret < 0) {
+            return sent ? sent : ret;
+        }
+
+        sent += ret;
+        if (static_cast<size_t>(ret) < msg->msg_iov[i].iov_len) {
+            break; // Out of space and MSG_DONTWAIT was set
+        }
+    }
+
+    return sent;
+}
+
+int64_t Socket::ReceiveMsg(msghdr* msg, int flags) {
+    sockaddr* src = msg->msg_namelen ? reinterpret_cast<sockaddr*>(msg->msg_name) : nullptr;
+    socklen_t srcLength = msg->msg_namelen;
+    socklen_t* srcLengthPtr = src ? &srcLength : nullptr;
+
+    int64_t received = 0;
+    if (msg->msg_iovlen == 1) {
+        received = ReceiveFrom(msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len, flags, src, srcLengthPtr,
+                               msg->msg_control, msg->msg_controllen);
+    } else if (type != StreamSocket) {
+        // Read the whole datagram, then split it across the iovecs
+        size_t length = IovecLength(msg->msg_iov, msg->msg_iovlen);
+        if (length > SOCKET_DATAGRAM_MAX) {
+            length = SOCKET_DATAGRAM_MAX; // Larger datagrams are truncated
+        }
+
+        uint8_t* buffer = new uint8_t[length];
+
+        received = ReceiveFrom(buffer, length, flags, src, srcLengthPtr, msg->msg_control, msg->msg_controllen);
+        if (received > 0) {
+            ScatterIovecs(msg->msg_iov, msg->msg_iovlen, buffer, received);
+        }
+
+        delete[] buffer;
+    } else {
+        for (unsigned i = 0; i < msg->msg_iovlen; i++) {
+            // Only wait for the first iovec, after that take whatever has already arrived
+            int64_t ret = ReceiveFrom(msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len,
+                                      received ? (flags | MSG_DONTWAIT) : flags, src, srcLengthPtr, msg->msg_control,
+                                      msg->msg_controllen);
+            if (ret < 0) {
+                if (received) {
+                    break;
+                }
+
+                return ret;
+            }
+
+            received += ret;
+            if (static_cast<size_t>(ret) < msg->msg_iov[i].iov_len) {
+                break;
+            }
+        }
+    }
+
+    if (received >= 0 && src) {
+        msg->msg_namelen = srcLength;
+    }
+
+    return received;
+}
+
 int Socket::GetSocketOptions(int level, int opt, void* optValue, socklen_t* optLength) {
     if (level == SOL_SOCKET) {
         switch (opt) {
@@ -149,8 +242,8 @@ LocalSocket::LocalSocket(int type, int protocol) : Socket(type, protocol) {
         inbound = new PacketStream();
         outbound = new PacketStream();
     } else {
-        inbound = new DataStream(1024);
-        outbound = new DataStream(1024);
+        inbound = new DataStream(DATASTREAM_BUFSIZE_DEFAULT);
+        outbound = new DataStream(DATASTREAM_BUFSIZE_DEFAULT);
     }
 }
 
@@ -224,11 +317,10 @@ void LocalSocket::DisconnectPeer() {
 
 void LocalSocket::OnDisconnect() {
     m_connected = false;
+    UnblockAll(); // Writers waiting for space
 
     acquireLock(&m_watcherLock);
-    while (m_watching.get_length()) {
-        m_watching.remove_at(0)->Signal(); // Signal all watching on disconnect
-    }
+    fs::SignalWatchers(m_watching); // Signal all watching on disconnect
     releaseLock(&m_watcherLock);
 
     peer = nullptr;
@@ -381,9 +473,15 @@ int64_t LocalSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr*
 
     if (flags & MSG_PEEK) {
         return inbound->Peek(buffer, len);
-    } else {
-        return inbound->Read(buffer, len);
     }
+
+    int64_t ret = inbound->Read(buffer, len);
+    if (type == StreamSocket && ret > 0 && peer) {
+        peer->UnblockAll(); // Wake the peer if it was waiting for space
+        SignalPeer();
+    }
+
+    return ret;
 }
 
 int64_t LocalSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* src, socklen_t addrlen,
@@ -403,26 +501,51 @@ int64_t LocalSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr*
         return -ENOTCONN;
     }
 
-    if (type == StreamSocket && (flags & MSG_DONTWAIT) && outbound->Pos() + len >= STREAM_MAX_BUFSIZE) {
-        return -EAGAIN;
-    } else
-        while (type == StreamSocket && outbound->Pos() + len >= STREAM_MAX_BUFSIZE) {
-            Scheduler::Yield();
+    if (type == DatagramSocket) {
+        int64_t written = outbound->Write(buffer, len);
+        SignalPeer();
+
+        return written;
+    }
+
+    // The stream buffer has a fixed size, so block until the peer has read enough for the rest
+    DataStream* stream = static_cast<DataStream*>(outbound);
+
+    size_t written = 0;
+    while (written < len) {
+        size_t ret = stream->Write(reinterpret_cast<uint8_t*>(buffer) + written, len - written);
+        if (ret) {
+            written += ret;
+            SignalPeer();
+            continue;
         }
 
-    int64_t written = outbound->Write(buffer, len);
+        if (flags & MSG_DONTWAIT) {
+            return written ? written : -EAGAIN;
+        }
 
-    if (peer && peer->CanRead()) {
-        acquireLock(&peer->m_watcherLock);
-        while (peer->m_watching.get_length()) {
-            peer->m_watching.remove_at(0)->Signal();
+        FilesystemBlocker bl(this);
+        if (!m_connected) {
+            return written ? written : -EPIPE;
+        } else if (stream->Space()) {
+            continue; // The peer read before the blocker was added
+        }
+
+        if (Thread::Current()->Block(&bl)) {
+            return written ? written : -EINTR;
         }
-        releaseLock(&peer->m_watcherLock);
     }
 
     return written;
 }
 
+void LocalSocket::SignalPeer() {
+    if (LocalSocket* p = peer; p) {
+        ScopedSpinLock acq(p->m_watcherLock);
+        fs::SignalWatchers(p->m_watching);
+    }
+}
+
 ErrorOr<UNIXOpenFile*> LocalSocket::Open(size_t flags) {
     UNIXOpenFile* fDesc = new UNIXOpenFile;
 
@@ -458,14 +581,7 @@ void LocalSocket::Close() {
 }
 
 void LocalSocket::Watch(FilesystemWatcher& watcher, int events) {
-    if (!(events & (POLLIN | POLLPRI))) {
-        return;
-    }
-
-    if (CanRead() | !IsConnected()) { // POLLHUP does not care if it is requested
-        return;
-    }
-
+    // Register even if we are ready now, edge triggered epoll still needs to hear about the next event
     acquireLock(&m_watcherLock);
     m_watching.add_back(&watcher);
     releaseLock(&m_watcherLock);
@@ -3,6 +3,7 @@
 #include <Net/Adapter.h>
 
 #include <Timer.h>
+#include <TimerEvent.h>
 #include <Math.h>
 
 #include <Errno.h>
@@ -31,12 +32,191 @@ inline unsigned Hash<TCPConnectionIdentifier>(const TCPConnectionIdentifier& id)
     return ::Hash(id.remoteIP.value) ^ ::Hash(id.localIP.value) ^ ::Hash(id.remotePort) ^ ::Hash(id.localPort);
 }
 
+// Sequence numbers wrap around, so compare them by their distance
+ALWAYS_INLINE static bool SequenceBefore(uint32_t a, uint32_t b){
+    return static_cast<int32_t>(a - b) < 0;
+}
+
+ALWAYS_INLINE static bool SequenceAfter(uint32_t a, uint32_t b){
+    return static_cast<int32_t>(a - b) > 0;
+}
+
 namespace Network {
     namespace TCP {
-        List<TCPSocket*> closedSockets;
         HashMap<TCPConnectionIdentifier, TCPSocket*> sockets;
         uint16_t nextEphemeralPort = EPHEMERAL_PORT_RANGE_START;
 
+        // Largest segment (header, options and data) SendIPv4 will take
+        static constexpr size_t maxSegmentLength = ETHERNET_MAX_PACKET_SIZE - sizeof(EthernetFrame) - sizeof(IPv4Header);
+        // Option space kept free in data segments whilst we have SACK blocks to report
+        static constexpr size_t sackOptionLength = 4 + 8 * TCP_SACK_BLOCKS_MAX;
+
+        // Hashed timer wheel shared by every socket, a timer sits in slot (expiry % TCP_TIMER_WHEEL_SIZE).
+        // A single timer event wakes the network thread at the earliest expiry so it sleeps whilst nothing is armed.
+        FastList<TCPTimer*> timerWheel[TCP_TIMER_WHEEL_SIZE];
+        lock_t timerWheelLock = 0;
+        uint64_t timerWheelTick = 0; // Earliest tick which has not been fully processed
+        uint64_t timerWheelWakeTick = UINT64_MAX;
+        Timer::TimerEvent* timerWheelWake = nullptr;
+        bool timersDue = false;
+
+        ALWAYS_INLINE static uint64_t CurrentTick(){
+            return Timer::UsecondsSinceBoot() / TCP_TIMER_TICK;
+        }
+
+        static void OnTimerWheelWake(void*){
+            __atomic_store_n(&timersDue, true, __ATOMIC_RELEASE);
+            packetQueueSemaphore.Signal();
+        }
+
+        // Expects timerWheelLock to be held
+        static void ScheduleTimerWake(uint64_t tick){
+            if(tick >= timerWheelWakeTick){
+                return; // Already going to wake up in time
+            }
+
+            if(timerWheelWake){
+                delete timerWheelWake;
+            }
+
+            timerWheelWakeTick = tick;
+            timerWheelWake = new Timer::TimerEvent(static_cast<long>(tick * TCP_TIMER_TICK - Timer::UsecondsSinceBoot()), OnTimerWheelWake, nullptr);
+        }
+
+        // Expects timerWheelLock to be held
+        static void InsertTimer(TCPTimer& timer, long us){
+            uint64_t expiry = CurrentTick() + (us + TCP_TIMER_TICK - 1) / TCP_TIMER_TICK;
+            if(expiry < timerWheelTick){
+                expiry = timerWheelTick;
+            }
+
+            timer.expiry = expiry;
+            timer.armed = true;
+            timerWheel[expiry % TCP_TIMER_WHEEL_SIZE].add_back(&timer);
+
+            ScheduleTimerWake(expiry);
+        }
+
+        // (Re)start a timer
+        static void ArmTimer(TCPTimer& timer, long us){
+            ScopedSpinLock lock(timerWheelLock);
+            if(timer.armed){
+                timerWheel[timer.expiry % TCP_TIMER_WHEEL_SIZE].remove(&timer);
+            }
+
+            InsertTimer(timer, us);
+        }
+
+        // Start a timer unless it is already running
+        static void StartTimer(TCPTimer& timer, long us){
+            ScopedSpinLock lock(timerWheelLock);
+            if(!timer.armed){
+                InsertTimer(timer, us);
+            }
+        }
+
+        static void CancelTimer(TCPTimer& timer){
+            ScopedSpinLock lock(timerWheelLock);
+            if(timer.armed){
+                timerWheel[timer.expiry % TCP_TIMER_WHEEL_SIZE].remove(&timer);
+                timer.armed = false;
+            }
+        }
+
+        void ProcessTimers(){
+            if(!__atomic_exchange_n(&timersDue, false, __ATOMIC_ACQUIRE)){
+                return;
+            }
+
+            uint64_t now = CurrentTick();
+
+            acquireLock(&timerWheelLock);
+            timerWheelWakeTick = UINT64_MAX; // The wake event has fired
+
+            if(now - timerWheelTick >= TCP_TIMER_WHEEL_SIZE){
+                timerWheelTick = now - TCP_TIMER_WHEEL_SIZE + 1; // Every slot gets checked once
+            }
+
+            while(timerWheelTick <= now){
+                FastList<TCPTimer*>& slot = timerWheel[timerWheelTick % TCP_TIMER_WHEEL_SIZE];
+
+                TCPTimer* timer = slot.get_front();
+                while(timer && timer->expiry > now){
+                    timer = slot.next(timer); // Due on a later turn of the wheel
+                }
+
+                if(!timer){
+                    if(timerWheelTick == now){
+                        break; // Timers may still be added for this tick
+                    }
+
+                    timerWheelTick++;
+                    continue;
+                }
+
+                slot.remove(timer);
+                timer->armed = false;
+
+                // The handler may re-arm the timer or free the socket
+                releaseLock(&timerWheelLock);
+                (timer->socket->*timer->handler)();
+                acquireLock(&timerWheelLock);
+            }
+
+            // Wake up again for the earliest timer left, which is most likely within one turn of the wheel
+            uint64_t next = UINT64_MAX;
+            for(unsigned i = 0; i < TCP_TIMER_WHEEL_SIZE && now + i < next; i++){
+                FastList<TCPTimer*>& slot = timerWheel[(now + i) % TCP_TIMER_WHEEL_SIZE];
+                for(TCPTimer* timer = slot.get_front(); timer; timer = slot.next(timer)){
+                    if(timer->expiry < next){
+                        next = timer->expiry;
+                    }
+                }
+            }
+
+            if(next != UINT64_MAX){
+                ScheduleTimerWake(next);
+            }
+            releaseLock(&timerWheelLock);
+        }
+
+        static uint32_t InitialSequenceNumber(){
+            return (Timer::GetSystemUptime() % 512) * (rand() % 255) + (Timer::UsecondsSinceBoot() % 255);
+        }
+
+        // Smallest shift which lets the window field cover the whole buffer
+        static uint8_t WindowShift(size_t bufferSize){
+            uint8_t shift = 0;
+            while((bufferSize >> shift) > UINT16_MAX && shift < 14){
+                shift++;
+            }
+
+            return shift;
+        }
+
+        // Call f(kind, data, length) for each option in the header
+        template<typename F>
+        static void ForEachOption(TCPHeader* header, F&& f){
+            uint8_t* option = reinterpret_cast<uint8_t*>(header) + sizeof(TCPHeader);
+            uint8_t* end = reinterpret_cast<uint8_t*>(header) + header->dataOffset * 4;
+
+            while(option < end){
+                if(option[0] == TCPOptionEnd){
+                    break;
+                } else if(option[0] == TCPOptionNoOperation){
+                    option++;
+                    continue;
+                }
+
+                if(option + 1 >= end || option[1] < 2 || option + option[1] > end){
+                    break; // Malformed
+                }
+
+                f(option[0], option + 2, option[1] - 2);
+                option += option[1];
+            }
+        }
+
         TCPSocket* FindSocket(TCPConnectionIdentifier id){
             TCPSocket* sock = nullptr;
             
@@ -140,37 +320,19 @@ namespace Network {
                 checksum += ((uint16_t)(*reinterpret_cast<uint8_t*>(ptr)));
             }
 
-            checksum = (checksum & 0xFFFF) + (checksum >> 16);
+            while(checksum >> 16){
+                checksum = (checksum & 0xFFFF) + (checksum >> 16);
+            }
 
             BigEndian<uint16_t> ret;
             ret.value = ~checksum;
             return ret;
         }
 
-        int SendTCP(void* data, size_t length, IPv4Address& source, IPv4Address& destination, TCPHeader& header, NetworkAdapter* adapter = nullptr){
-            uint8_t buffer[1600];
-
-            if(length + sizeof(TCPHeader) > 1600){
-                length = 1600 - sizeof(TCPHeader);
-            }
-
-            TCPHeader* tcpHeader = reinterpret_cast<TCPHeader*>(buffer);
-
-            memcpy(buffer + sizeof(TCPHeader), data, length);
-
-            *tcpHeader = header;
-
-            tcpHeader->checksum = 0;
-            tcpHeader->checksum = CalculateTCPChecksum(source, destination, buffer, length + sizeof(TCPHeader));
-
-            if(int e = SendIPv4(buffer, length + sizeof(TCPHeader), source, destination, IPv4ProtocolTCP, adapter); e){
-                return e;
-            }
-
-            return length;
-        }
+        void OnReceiveTCP(IPv4Header& ipHeader, NetBuffer* buffer){
+            void* data = buffer->data;
+            size_t length = buffer->length;
 
-        void OnReceiveTCP(IPv4Header& ipHeader, void* data, size_t length){
             TCPHeader* tcpHeader = reinterpret_cast<TCPHeader*>(data);
             BigEndian<uint16_t> checksum = tcpHeader->checksum;
 
@@ -182,25 +344,30 @@ namespace Network {
             }*/
             tcpHeader->checksum = checksum;
 
-            if(tcpHeader->dataOffset * 4 < sizeof(TCPHeader)){
+            if(tcpHeader->dataOffset * 4 < sizeof(TCPHeader) || tcpHeader->dataOffset * 4 > length){
+                CountDrop(NetLayerTCP);
                 return; // Invalid data offset (must be at least 5)
             }
 
             TCPSocket* sock = FindSocket(TCPConnectionIdentifier(ipHeader.destIP, ipHeader.sourceIP, tcpHeader->destPort, tcpHeader->srcPort));
             if(!sock){
                 Log::Info("no such sock! (Source: %hd.%hd.%hd.%hd:%hu)", ipHeader.sourceIP.data[0], ipHeader.sourceIP.data[1], ipHeader.sourceIP.data[2], ipHeader.sourceIP.data[3], tcpHeader->srcPort);
+                CountDrop(NetLayerTCP);
                 return; // Port not bound to socket
             }
 
             if(sock->state == TCPSocket::TCPStateUnknown){
+                CountDrop(NetLayerTCP);
                 return; // Has not attempted to open connecction and is not a listen socket
             }
 
-            sock->OnReceive(ipHeader.sourceIP, ipHeader.destIP, reinterpret_cast<uint8_t*>(data), length);
+            buffer->transport = buffer->data;
+            sock->OnReceive(ipHeader.sourceIP, ipHeader.destIP, buffer);
         }
 
-        void TCPSocket::OnReceive(const IPv4Address& source, const IPv4Address& dest, uint8_t* data, size_t length){
-            TCPHeader* tcpHeader = reinterpret_cast<TCPHeader*>(data); // Checksum has already been verified
+        void TCPSocket::OnReceive(const IPv4Address& source, const IPv4Address& dest, NetBuffer* buffer){
+            TCPHeader* tcpHeader = reinterpret_cast<TCPHeader*>(buffer->data); // Checksum has already been verified
+            size_t length = buffer->length;
 
             if(state == TCPStateUnknown){
                 return; // We should not be receiving packets as we have not opened a connection and we are not listening
@@ -218,15 +385,23 @@ namespace Network {
                 }
 
                 if(syn){
-                    Log::Warning("[Network] [TCP] (State: LISTEN) TCP listen sockets not yet supported!");
+                    OnConnectionRequest(source, dest, tcpHeader);
                 }
                 return;
             }
 
+            uint16_t dataOffset = tcpHeader->dataOffset * 4;
+            size_t dataLength = length - dataOffset;
+
+            bool doUnblock = false; // Wake everyone, the state changed or writers can continue
+            bool dataReceived = false;
+            bool established = false; // Completed a passive open, hand the connection to the listen socket
+
+            acquireLock(&m_lock);
             if(tcpHeader->rst){
-                state = TCPStateUnknown; // Abort connection
+                Abort(ECONNRESET); // Abort connection
 
-                UnblockAll();
+                doUnblock = true;
             } else if(state == TCPStateSyn){
                 bool ack = tcpHeader->ack;
                 bool syn = tcpHeader->syn;
@@ -236,337 +411,1105 @@ namespace Network {
 
                 if(other){
                     Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] (State: SYN-SENT) Unexpected flags: %hx", other);
-                    return; // Unexpected flags
-                }
+                } else if(ack && syn && tcpHeader->acknowledgementNumber == m_sequenceNumber){ // It is important that we recieve a SYN and ACK, the ACK number must be equal to the sequence number.
+                    Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] (State: SYN-SENT) Recieved SYN-ACK (Sequence number: %u) from %d.%d.%d.%d:%d", (uint32_t)tcpHeader->sequence, source.data[0], source.data[1], source.data[2], source.data[3], (uint16_t)tcpHeader->srcPort);
+
+                    m_remoteSequenceNumber = tcpHeader->sequence + 1; // The SYN takes up a sequence number
+                    m_lastAcknowledged = m_highestSent = m_sequenceNumber;
+                    m_retransmitNext = m_sequenceNumber;
 
-                if(ack && syn){ // It is important that we recieve a SYN and ACK
-                    Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] (State: SYN-SENT) Recieved SYN-ACK (Sequence number: %u) from %d.%d.%d.%d:%d", tcpHeader->sequence, source.data[0], source.data[1], source.data[2], source.data[3], (uint16_t)tcpHeader->srcPort);
+                    ParseOptions(tcpHeader, true);
 
-                    m_remoteSequenceNumber = tcpHeader->sequence;
-                    m_lastAcknowledged = tcpHeader->acknowledgementNumber;
+                    // The window in a SYN is never scaled
+                    m_sendWindow = tcpHeader->windowSize;
+                    m_windowUpdateSequence = tcpHeader->sequence;
+                    m_windowUpdateAck = tcpHeader->acknowledgementNumber;
 
-                    if(m_lastAcknowledged == m_sequenceNumber){ // The ACK number must be equal to the sequence number.
-                        state = TCPStateEstablished; // Our SYN has been acknowledged with a SYN-ACK
+                    m_congestionWindow = MIN(TCP_INITIAL_WINDOW * m_maxSegmentSize, MAX(2 * m_maxSegmentSize, 14600U));
 
-                        UnblockAll(); // Unblock waiting threads
+                    if(m_rttTiming){
+                        m_rttTiming = false;
+                        UpdateRoundTripTime(Timer::UsecondsSinceBoot() - m_timedSince);
                     }
-                }
+                    m_retransmits = 0;
 
-                return;
-            } else if(state == TCPStateSynAck){
-                bool ack = tcpHeader->ack;
+                    state = TCPStateEstablished; // Our SYN has been acknowledged with a SYN-ACK
+                    m_ackNow = true;
 
-                if(ack){
+                    doUnblock = true; // Unblock waiting threads
+                }
+            } else if(state == TCPStateSynAck && !(tcpHeader->ack && tcpHeader->acknowledgementNumber == m_sequenceNumber)){
+                Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] (State: SYN-RECV) Ignoring segment which does not acknowledge our SYN");
+            } else if(uint16_t other = (tcpHeader->flags & (TCPHeader::FlagsMask ^ (TCPHeader::ACK | TCPHeader::PSH | TCPHeader::FIN | TCPHeader::ECE))); other){
+                Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] Unexpected flags: %hx", other); // Unsupported flags
+            } else if(state == TCPStateTimeWait){
+                if(tcpHeader->fin){
+                    // The peer did not receive our ACK of its FIN, send it again and restart the timer
+                    m_ackNow = true;
+                    ArmTimer(m_timeWaitTimer, TCP_TIME_WAIT);
+                }
+            } else {
+                if(state == TCPStateSynAck){
                     Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] (State: SYN-RECV) Recieved ACK from %d.%d.%d.%d:%d", source.data[0], source.data[1], source.data[2], source.data[3], (uint16_t)tcpHeader->srcPort);
 
-                    m_remoteSequenceNumber = tcpHeader->sequence;
-
-                    state = TCPStateEstablished; // Our SYN has been acknowledged with a SYN-ACK
+                    // SND.UNA and the RTT sample are taken care of as the ACK is processed below
+                    m_congestionWindow = MIN(TCP_INITIAL_WINDOW * m_maxSegmentSize, MAX(2 * m_maxSegmentSize, 14600U));
+                    m_retransmits = 0;
 
-                    UnblockAll(); // Unblock waiting threads
+                    state = TCPStateEstablished;
+                    established = true;
                 }
-            } else if(state == TCPStateEstablished){
-                bool ack = tcpHeader->ack;
-                bool psh = tcpHeader->psh;
-                bool fin = tcpHeader->fin;
-                
-                bool doUnblock = false;
-                uint16_t other = (tcpHeader->flags & (TCPHeader::FlagsMask ^ (TCPHeader::ACK | TCPHeader::PSH | TCPHeader::FIN | TCPHeader::ECE))); // Get all other flags
 
-                if(other){
-                    return; // Unsupported flags
+                if(tcpHeader->ack && ProcessAcknowledgement(tcpHeader, dataLength)){
+                    doUnblock = true; // Space has been freed in the send buffer
                 }
 
-                if(tcpHeader->sequence != m_remoteSequenceNumber){
-                    Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] (State: ESTABLISHED) Received packet with sequence number of %d, Expected %d", tcpHeader->sequence, m_remoteSequenceNumber);
-                    return; // Either a previous packet has been dropped, or it is retransmitting a previous packet
+                if(m_finAcknowledged){
+                    if(state == TCPStateFinWait1){
+                        Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] (State: FIN-WAIT-1) FIN acknowledged, entering FIN-WAIT-2");
+                        state = TCPStateFinWait2;
+                    } else if(state == TCPStateClosing){
+                        EnterTimeWait();
+                    } else if(state == TCPStateLastAck){
+                        state = TCPStateUnknown; // We have closed successfully
+
+                        CancelTimer(m_retransmitTimer);
+                        CancelTimer(m_delayedAckTimer);
+                    }
                 }
 
-                uint16_t dataOffset = tcpHeader->dataOffset * 4;
-                uint16_t dataLength = length - dataOffset;
+                if(state == TCPStateEstablished || state == TCPStateFinWait1 || state == TCPStateFinWait2){
+                    if(dataLength || tcpHeader->fin){
+                        Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] Recieving %d bytes of data (Flags: %hx, total len: %d)", dataLength, tcpHeader->flags & TCPHeader::FlagsMask, length);
 
-                if(ack){
-                    if(tcpHeader->acknowledgementNumber > m_sequenceNumber){
-                        Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] (State: ESTABLIHSED) recieved ACK wth ack number > sequence number");
-                        Acknowledge(m_remoteSequenceNumber);
-                        return;
+                        buffer->Pull(dataOffset); // The header stays reachable through transport
+                        dataReceived = ReceiveData(tcpHeader->sequence, buffer, tcpHeader->fin);
+                    }
+
+                    if(m_finReceived){
+                        if(state == TCPStateEstablished){
+                            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] (State: ESTABLISHED) Peer closed connection with FIN, entering CLOSE-WAIT");
+                            state = TCPStateCloseWait; // Connection ended, wait for process(es) to close file descriptors
+                        } else if(state == TCPStateFinWait1){
+                            state = TCPStateClosing; // Both ends closed at the same time
+                        } else {
+                            EnterTimeWait();
+                        }
+
+                        doUnblock = true;
                     }
+                } else if(dataLength){
+                    m_ackNow = true; // The peer has already sent FIN, let it know where the stream ended
+                }
+            }
 
-                    acquireLock(&m_unacknowledgedPacketsLock);
+            TCPSocket* listener = nullptr;
+            if(established){
+                listener = m_listener;
+                bool queued = listener && listener->QueueConnection(this);
+                ReleaseListener();
 
-                    m_lastAcknowledged = tcpHeader->acknowledgementNumber;
+                if(!queued){
+                    Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] Refusing connection, the listen socket is gone or its backlog is full");
 
-                    for(auto it = m_unacknowledgedPackets.begin(); it != m_unacknowledgedPackets.end(); it++){
-                        if(it->sequenceNumber <= m_lastAcknowledged){
-                            m_unacknowledgedPackets.remove(it);
-                        }
+                    Abort(ECONNREFUSED);
+                    listener = nullptr;
+                    doUnblock = false;
+                    m_ackNow = false;
 
-                        if(it == m_unacknowledgedPackets.end()){
-                            break;
-                        }
+                    releaseLock(&m_lock);
+                    Reset();
+                    acquireLock(&m_lock);
+                }
+            }
+
+            bool free = ShouldFree();
+            releaseLock(&m_lock);
+
+            if(free){
+                Free();
+                return;
+            }
+
+            if(listener){
+                listener->UnblockAll(); // Wake accept
+                listener->NotifyWatchers();
+            }
+
+            Output();
+
+            if(dataReceived && !doUnblock){
+                acquireLock(&blockedLock);
+                FilesystemBlocker* bl = blocked.get_front();
+                while(bl){
+                    FilesystemBlocker* next = blocked.next(bl);
+
+                    if(bl->RequestedLength() <= m_inboundData.Pos()){
+                        bl->Unblock();
                     }
 
-                    releaseLock(&m_unacknowledgedPacketsLock);
+                    bl = next;
                 }
+                releaseLock(&blockedLock);
+            }
 
-                Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] Recieving %d bytes of data (Flags: %hx, total len: %d)", dataLength, tcpHeader->flags & TCPHeader::FlagsMask);
+            if(doUnblock){
+                UnblockAll();
+            }
 
-                if(dataLength){
-                    m_inboundData.Write(data + dataOffset, dataLength);
+            if(doUnblock || dataReceived){
+                NotifyWatchers();
+            }
+        }
 
-                    acquireLock(&blockedLock);
-                    FilesystemBlocker* bl = blocked.get_front();
-                    while(bl){
-                        FilesystemBlocker* next = blocked.next(bl);
+        void TCPSocket::OnConnectionRequest(const IPv4Address& source, const IPv4Address& dest, TCPHeader* header){
+            // Each connection holds its buffers from the SYN until the handshake completes or times out,
+            // so those still in the handshake count towards the backlog too
+            acquireLock(&m_lock);
+            bool full = pending.get_length() + m_halfOpen >= m_backlog;
+            releaseLock(&m_lock);
 
-                        if(bl->RequestedLength() <= m_inboundData.Pos()){
-                            bl->Unblock();
-                        }
+            if(full){
+                Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] (State: LISTEN) Backlog full, dropping SYN");
+                return; // The peer will try again
+            }
+
+            NetworkAdapter* adapter = NetFS::GetInstance()->FindAdapter(dest.value);
+            if(!adapter){
+                return; // Not addressed to one of our adapters
+            }
+
+            TCPSocket* sock = new TCPSocket(StreamSocket, 0);
+            sock->adapter = adapter;
+            sock->address = dest;
+            sock->peerAddress = source;
+            sock->port = port;
+            sock->destinationPort = header->srcPort;
+            sock->m_noDelay = m_noDelay;
+
+            if(sock->AcquirePort(port)){
+                delete sock;
+                return;
+            }
+
+            acquireLock(&m_lock);
+            m_halfOpen++;
+            releaseLock(&m_lock);
+            sock->m_listener = this;
+
+            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] (State: LISTEN) Connection request from %hd.%hd.%hd.%hd:%hu", source.data[0], source.data[1], source.data[2], source.data[3], (uint16_t)header->srcPort);
+
+            uint32_t initialSequence = InitialSequenceNumber();
+
+            acquireLock(&sock->m_lock);
+            sock->state = TCPStateSynAck;
+            sock->m_fileClosed = true; // Nothing has a handle to it until it is accepted, free it if the handshake fails
+
+            sock->m_remoteSequenceNumber = header->sequence + 1; // The SYN takes up a sequence number
+            sock->ParseOptions(header, true);
+
+            // The window in a SYN is never scaled
+            sock->m_sendWindow = header->windowSize;
+            sock->m_windowUpdateSequence = header->sequence;
+            sock->m_windowUpdateAck = initialSequence;
+
+            sock->m_lastAcknowledged = initialSequence;
+            sock->m_sequenceNumber = sock->m_highestSent = initialSequence + 1;
+            sock->m_retransmitNext = initialSequence + 1;
+            sock->m_recover = initialSequence;
+
+            sock->m_rttTiming = true; // Time the handshake for the first RTT sample
+            sock->m_timedSequence = initialSequence;
+            sock->m_timedSince = Timer::UsecondsSinceBoot();
+
+            StartTimer(sock->m_retransmitTimer, sock->m_retransmitTimeout);
+            releaseLock(&sock->m_lock);
+
+            sock->SynchronizeAcknowledge(initialSequence, sock->m_remoteSequenceNumber);
+        }
+
+        bool TCPSocket::QueueConnection(TCPSocket* sock){
+            ScopedSpinLock lock(m_lock);
+            if(state != TCPStateListen || pending.get_length() >= m_backlog){
+                return false;
+            }
+
+            pending.add_back(sock);
+            sock->m_fileClosed = false; // Now belongs to the listen socket until it is accepted
+
+            return true;
+        }
+
+        void TCPSocket::ReleaseListener(){
+            TCPSocket* listener = m_listener;
+            if(!listener){
+                return;
+            }
+            m_listener = nullptr;
+
+            acquireLock(&listener->m_lock);
+            listener->m_halfOpen--;
+
+            // The listen socket may have been closed whilst we were in the handshake
+            if(listener->ShouldFree()){
+                ArmTimer(listener->m_timeWaitTimer, 0);
+            }
+            releaseLock(&listener->m_lock);
+        }
+
+        void TCPSocket::ParseOptions(TCPHeader* header, bool syn){
+            uint8_t windowShift = 0;
 
-                        bl = next;
+            ForEachOption(header, [&](uint8_t kind, uint8_t* option, uint8_t length){
+                if(kind == TCPOptionMSS && length == 2){
+                    uint16_t mss = (option[0] << 8) | option[1];
+                    if(mss){
+                        m_maxSegmentSize = MIN(mss, TCP_MSS);
                     }
-                    releaseLock(&blockedLock);
+                } else if(kind == TCPOptionWindowScale && length == 1){
+                    m_windowScaling = true;
+                    windowShift = MIN(option[0], 14); // RFC 7323 limits the shift to 14
+                } else if(kind == TCPOptionSACKPermitted && length == 0){
+                    m_sackPermitted = true;
+                }
+            });
+
+            // Window scaling is only used when both ends ask for it
+            if(m_windowScaling){
+                m_sendWindowShift = windowShift;
+                m_receiveWindowShift = WindowShift(m_inboundData.Capacity());
+            }
+        }
+
+        bool TCPSocket::ProcessAcknowledgement(TCPHeader* header, size_t dataLength){
+            uint32_t ack = header->acknowledgementNumber;
+            uint32_t sequence = header->sequence;
+
+            if(SequenceAfter(ack, m_highestSent)){
+                Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] Recieved ACK for data we have not sent");
+                m_ackNow = true;
+                return false;
+            } else if(SequenceBefore(ack, m_lastAcknowledged)){
+                return false; // Old duplicate
+            }
+
+            // Only take the window from segments newer than the last one used (RFC 793 SND.WL1 and SND.WL2)
+            bool windowChanged = false;
+            if(SequenceBefore(m_windowUpdateSequence, sequence) || (m_windowUpdateSequence == sequence && !SequenceBefore(ack, m_windowUpdateAck))){
+                uint32_t window = static_cast<uint32_t>(static_cast<uint16_t>(header->windowSize)) << m_sendWindowShift;
 
-                    m_remoteSequenceNumber = tcpHeader->sequence + dataLength;
+                windowChanged = (window != m_sendWindow);
+                m_sendWindow = window;
+                m_windowUpdateSequence = sequence;
+                m_windowUpdateAck = ack;
+            }
+
+            if(m_sackPermitted){
+                ForEachOption(header, [&](uint8_t kind, uint8_t* option, uint8_t length){
+                    if(kind != TCPOptionSACK){
+                        return;
+                    }
 
-                    Acknowledge(m_remoteSequenceNumber);
+                    BigEndian<uint32_t>* block = reinterpret_cast<BigEndian<uint32_t>*>(option);
+                    for(unsigned i = 0; i + 1 < length / sizeof(uint32_t); i += 2){
+                        AddSACKBlock(block[i], block[i + 1]);
+                    }
+                });
+            }
+
+            uint32_t acked = ack - m_lastAcknowledged;
+            if(!acked){
+                // RFC 5681 duplicate ACK, the peer received a segment past a hole
+                if(!dataLength && !windowChanged && !header->syn && !header->fin && m_highestSent != m_lastAcknowledged){
+                    m_duplicateAcks++;
+
+                    // Do not start another recovery for data sent before the last one (RFC 6582)
+                    if(!m_fastRecovery && m_duplicateAcks == 3 && SequenceAfter(ack, m_recover)){
+                        Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] Fast retransmit from %u", m_lastAcknowledged);
+
+                        m_slowStartThreshold = MAX((m_highestSent - m_lastAcknowledged) / 2, 2U * m_maxSegmentSize);
+                        m_congestionWindow = m_slowStartThreshold;
+                        m_bytesAcked = 0;
+
+                        m_recover = m_highestSent;
+                        m_fastRecovery = true;
+                        m_retransmitNow = true;
+                        m_retransmitNext = m_lastAcknowledged;
+                        m_rttTiming = false;
+                    }
                 }
 
-                if(psh){
-                    Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] PSH!");
+                return false;
+            }
+
+            // The FIN takes up the sequence number after the last byte of data
+            uint32_t dataAcked = acked;
+            if(dataAcked > m_outboundData.Pos()){
+                dataAcked = m_outboundData.Pos();
 
-                    doUnblock = true;
+                if(m_finQueued){
+                    m_finAcknowledged = true;
                 }
+            }
+
+            m_outboundData.Skip(dataAcked);
+            m_lastAcknowledged = ack;
+            if(SequenceBefore(m_sequenceNumber, ack)){
+                m_sequenceNumber = ack; // Data sent before a timeout made it after all
+            }
+
+            if(SequenceBefore(m_retransmitNext, ack)){
+                m_retransmitNext = ack;
+            }
 
-                if(fin){
-                    Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] (State: ESTABLISHED) Peer closed connection with FIN, entering CLOSE-WAIT");
-                    state = TCPStateCloseWait; // Connection ended, wait for process(es) to close file descriptors
+            // Forget SACKed ranges which are now cumulatively acknowledged
+            unsigned dropped = 0;
+            while(dropped < m_sackedCount && !SequenceAfter(m_sacked[dropped].end, ack)){
+                dropped++;
+            }
 
-                    Acknowledge(m_remoteSequenceNumber);
-                    doUnblock = true;
+            if(dropped){
+                for(unsigned i = dropped; i < m_sackedCount; i++){
+                    m_sacked[i - dropped] = m_sacked[i];
                 }
+                m_sackedCount -= dropped;
+            }
 
-                if(doUnblock){
-                    UnblockAll();
+            if(m_sackedCount && SequenceBefore(m_sacked[0].start, ack)){
+                m_sacked[0].start = ack;
+            }
+
+            if(m_rttTiming && SequenceAfter(ack, m_timedSequence)){
+                m_rttTiming = false;
+                UpdateRoundTripTime(Timer::UsecondsSinceBoot() - m_timedSince);
+            }
+
+            m_retransmits = 0;
+            m_duplicateAcks = 0;
+
+            if(m_fastRecovery){
+                if(!SequenceBefore(ack, m_recover)){
+                    m_fastRecovery = false; // Everything outstanding when we lost the segment has arrived
+                    m_congestionWindow = m_slowStartThreshold;
+                } else if(!m_sackPermitted){
+                    m_retransmitNow = true; // Partial ACK, the segment after it was lost as well (RFC 6582)
                 }
-            } else if(state == TCPStateFinWait1){
-                bool ack = tcpHeader->ack;
-                bool fin = tcpHeader->fin;
-                uint16_t other = (tcpHeader->flags & (TCPHeader::FlagsMask ^ (TCPHeader::ACK | TCPHeader::FIN))); // Get all other flags
+            } else if(m_congestionWindow < m_slowStartThreshold){
+                m_congestionWindow += MIN(acked, m_maxSegmentSize); // Slow start
+            } else {
+                // Congestion avoidance, grow by one segment every window
+                m_bytesAcked += acked;
+                if(m_bytesAcked >= m_congestionWindow){
+                    m_bytesAcked -= m_congestionWindow;
+                    m_congestionWindow += m_maxSegmentSize;
+                }
+            }
 
-                if(other){
-                    Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] (State: FIN-WAIT-1) Unexpected flags: %hx", other);
-                    return; // Unexpected flags
+            // There is no point letting the window grow past what we can have in flight
+            if(m_congestionWindow > m_outboundData.Capacity()){
+                m_congestionWindow = m_outboundData.Capacity();
+            }
+
+            if(m_lastAcknowledged == m_highestSent){
+                CancelTimer(m_retransmitTimer);
+            } else {
+                ArmTimer(m_retransmitTimer, m_retransmitTimeout);
+            }
+
+            if(m_writerWaiting && dataAcked){
+                m_writerWaiting = false;
+                return true;
+            }
+
+            return false;
+        }
+
+        void TCPSocket::AddSACKBlock(uint32_t start, uint32_t end){
+            if(!SequenceAfter(end, m_lastAcknowledged) || SequenceAfter(end, m_highestSent) || !SequenceBefore(start, end)){
+                return; // Old or invalid
+            }
+
+            if(SequenceBefore(start, m_lastAcknowledged)){
+                start = m_lastAcknowledged;
+            }
+
+            unsigned i = 0;
+            while(i < m_sackedCount && SequenceBefore(m_sacked[i].end, start)){
+                i++;
+            }
+
+            // Merge with any ranges the block overlaps or touches
+            unsigned j = i;
+            while(j < m_sackedCount && !SequenceAfter(m_sacked[j].start, end)){
+                if(SequenceBefore(m_sacked[j].start, start)){
+                    start = m_sacked[j].start;
+                }
+
+                if(SequenceAfter(m_sacked[j].end, end)){
+                    end = m_sacked[j].end;
+                }
+                j++;
+            }
+
+            if(j == i){
+                if(m_sackedCount == TCP_SACK_SCOREBOARD_SIZE){
+                    if(i == TCP_SACK_SCOREBOARD_SIZE){
+                        return; // Out of space, the data will just be sent again
+                    }
+
+                    m_sackedCount--; // Forget the highest range
                 }
 
-                if(fin && ack){
-                    state = TCPStateTimeWait;
+                for(unsigned k = m_sackedCount; k > i; k--){
+                    m_sacked[k] = m_sacked[k - 1];
+                }
+                m_sackedCount++;
+            } else if(j > i + 1){
+                for(unsigned k = j; k < m_sackedCount; k++){
+                    m_sacked[k - j + i + 1] = m_sacked[k];
+                }
+                m_sackedCount -= j - i - 1;
+            }
 
-                    Acknowledge(m_remoteSequenceNumber);
-                } else if(ack){
-                    m_remoteSequenceNumber = tcpHeader->sequence;
+            m_sacked[i] = {start, end};
+        }
 
-                    state = TCPStateFinWait2;
-                } else if(fin){
-                    m_remoteSequenceNumber = tcpHeader->sequence + 1;
+        uint32_t TCPSocket::Pipe(){
+            uint32_t pipe = m_sequenceNumber - m_lastAcknowledged;
+            uint32_t sacked = 0;
+            uint32_t lost = 0; // Holes below the highest SACKed byte which have not been sent again yet
+            uint32_t position = m_retransmitNext;
 
-                    FinishAcknowledge(m_remoteSequenceNumber);
+            for(unsigned i = 0; i < m_sackedCount; i++){
+                sacked += m_sacked[i].end - m_sacked[i].start;
 
-                    state = TCPStateLastAck;
+                if(SequenceBefore(position, m_sacked[i].start)){
+                    lost += m_sacked[i].start - position;
                 }
 
-                return;
-            } else if(state == TCPStateFinWait2){
-                bool fin = tcpHeader->fin;
+                if(SequenceAfter(m_sacked[i].end, position)){
+                    position = m_sacked[i].end;
+                }
+            }
 
-                // Allow the remote endpoint to resend ACK
-                uint16_t other = (tcpHeader->flags & (TCPHeader::FlagsMask ^ (TCPHeader::FIN | TCPHeader::ACK))); // Get all other flags
+            if(m_fastRecovery){
+                if(m_sackPermitted){
+                    sacked += lost;
+                } else {
+                    sacked += m_duplicateAcks * m_maxSegmentSize; // Each duplicate ACK means a segment has left the network
+                }
+            }
 
-                if(other){
-                    Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] (State: FIN-WAIT-2) Unexpected flags: %hx", other);
-                    return; // Unexpected flags
+            return (sacked > pipe) ? 0 : (pipe - sacked);
+        }
+
+        bool TCPSocket::NextHole(uint32_t& sequence, uint32_t& length, uint32_t maxLength){
+            uint32_t position = m_retransmitNext;
+
+            for(unsigned i = 0; i < m_sackedCount; i++){
+                if(SequenceBefore(position, m_sacked[i].start)){
+                    sequence = position;
+                    length = MIN(m_sacked[i].start - position, maxLength);
+                    return true;
+                }
+
+                if(SequenceAfter(m_sacked[i].end, position)){
+                    position = m_sacked[i].end;
                 }
+            }
 
-                if(fin){
-                    m_remoteSequenceNumber = tcpHeader->sequence + 1;
+            return false; // Anything past the last SACKed range has not been given up on yet
+        }
 
-                    state = TCPStateTimeWait;
+        bool TCPSocket::ReceiveData(uint32_t sequence, NetBuffer* buffer, bool fin){
+            uint32_t receiveNext = m_remoteSequenceNumber;
 
-                    Acknowledge(m_remoteSequenceNumber);
+            // Trim anything we already have
+            if(SequenceBefore(sequence, receiveNext)){
+                uint32_t duplicate = receiveNext - sequence;
+                if(duplicate > buffer->length){
+                    m_ackNow = true; // The peer has not seen our ACK
+                    CountDrop(NetLayerTCP);
+                    return false;
                 }
-            } else if(state == TCPStateCloseWait || state == TCPStateTimeWait){
-                state = TCPStateUnknown;
 
-                Reset(); // (CLOSE-WAIT) We should not be receiving packets on a close-wait / (TIME-WAIT) It did not receive our ACK, just reset
-            } else if(state == TCPStateLastAck){
-                bool ack = tcpHeader->ack;
+                buffer->Pull(duplicate);
+                sequence = receiveNext;
+            }
+
+            // Drop anything which does not fit in the window
+            size_t window = m_inboundData.Space();
+            uint32_t offset = sequence - receiveNext;
+            if(offset + buffer->length > window){
+                if(offset >= window){
+                    m_ackNow = true;
+                    CountDrop(NetLayerTCP);
+                    return false;
+                }
+
+                buffer->Trim(window - offset);
+                fin = false;
+            }
+
+            size_t length = buffer->length;
+            if(sequence != receiveNext){
+                // Out of order, keep it for when the gap is filled and let the peer know with a duplicate ACK
+                if(m_outOfOrderBytes + NET_BUFFER_SIZE <= window){
+                    TCPSegment** link = &m_outOfOrder;
+                    while(*link && SequenceBefore((*link)->sequence, sequence)){
+                        link = &(*link)->next;
+                    }
+
+                    if(!(*link && (*link)->sequence == sequence && (*link)->length >= length)){
+                        TCPSegment* segment = new TCPSegment;
+                        segment->next = *link;
+                        segment->sequence = sequence;
+                        segment->length = length;
+                        segment->fin = fin;
+                        segment->buffer = ReferenceBuffer(buffer);
 
-                if(ack){
-                    state = TCPStateUnknown; // We have closed successfully
+                        *link = segment;
+                        m_outOfOrderBytes += NET_BUFFER_SIZE;
+                    }
+
+                    m_lastOutOfOrder = sequence;
                 } else {
-                    Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] (State: LAST_ACK) Unexpected flags: %hx. Expected ACK", tcpHeader->flags & TCPHeader::FlagsMask);
+                    CountDrop(NetLayerTCP);
+                }
 
-                    state = TCPStateUnknown;
-                    Reset();
+                m_ackNow = true;
+                return false;
+            }
+
+            size_t written = m_inboundData.Write(buffer->data, length);
+            CountCopy(NetLayerTCP, written);
+            receiveNext += written;
+            if(fin && written == length){
+                receiveNext++;
+                m_finReceived = true;
+            }
+
+            bool filledHole = (m_outOfOrder != nullptr);
+            while(m_outOfOrder && !SequenceAfter(m_outOfOrder->sequence, receiveNext) && !m_finReceived){
+                TCPSegment* segment = m_outOfOrder;
+                m_outOfOrder = segment->next;
+                m_outOfOrderBytes -= NET_BUFFER_SIZE;
+
+                uint32_t skip = receiveNext - segment->sequence;
+                if(skip < segment->length){
+                    size_t segmentWritten = m_inboundData.Write(segment->buffer->data + skip, segment->length - skip);
+                    CountCopy(NetLayerTCP, segmentWritten);
+                    receiveNext += segmentWritten;
+                }
+
+                if(segment->fin && skip <= segment->length){
+                    receiveNext++;
+                    m_finReceived = true;
                 }
+
+                ReleaseBuffer(segment->buffer);
+                delete segment;
+            }
+
+            m_remoteSequenceNumber = receiveNext;
+
+            if(filledHole || m_finReceived){
+                m_ackNow = true; // Let the peer know straight away so it can leave recovery (RFC 5681)
+            } else if(++m_unacknowledgedSegments >= 2){
+                m_ackNow = true; // ACK at least every second segment
+            } else {
+                StartTimer(m_delayedAckTimer, TCP_DELAYED_ACK);
             }
 
-            if(m_fileClosed && state == TCPStateUnknown){
-                closedSockets.remove(this);
-                if(port) {
-                    ReleasePort();
+            return written > 0;
+        }
+
+        void TCPSocket::UpdateRoundTripTime(long sample){
+            if(sample <= 0){
+                sample = 1;
+            }
+
+            // RFC 6298
+            if(!m_smoothedRTT){
+                m_smoothedRTT = sample;
+                m_rttVariance = sample / 2;
+            } else {
+                long delta = m_smoothedRTT - sample;
+                if(delta < 0){
+                    delta = -delta;
                 }
 
-                delete this;
+                m_rttVariance = (3 * m_rttVariance + delta) / 4;
+                m_smoothedRTT = (7 * m_smoothedRTT + sample) / 8;
+            }
+
+            long rto = m_smoothedRTT + MAX(TCP_TIMER_TICK, 4 * m_rttVariance);
+            if(rto < TCP_RETRY_MIN){
+                rto = TCP_RETRY_MIN;
+            } else if(rto > TCP_RETRY_MAX){
+                rto = TCP_RETRY_MAX;
             }
+
+            m_retransmitTimeout = rto;
         }
 
-        int TCPSocket::Synchronize(uint32_t seqNumber){ // TCP SYN (Establish a connection to the server)
-            TCPHeader tcpHeader;
-            memset(&tcpHeader, 0, sizeof(TCPHeader));
-            
-            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [SYN] Sequence Number: %u", seqNumber);
+        void TCPSocket::EnterTimeWait(){
+            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] Entering TIME-WAIT");
+
+            state = TCPStateTimeWait;
+            m_ackNow = true;
 
-            tcpHeader.srcPort = port;
-            tcpHeader.destPort = destinationPort;
-            tcpHeader.sequence = seqNumber;
-            tcpHeader.acknowledgementNumber = 0;
+            CancelTimer(m_retransmitTimer);
+            ArmTimer(m_timeWaitTimer, TCP_TIME_WAIT);
+        }
 
-            tcpHeader.dataOffset = sizeof(TCPHeader) / 4; // Size of the TCP Header in DWORDs
-            tcpHeader.syn = 1; // SYN/Synchronize
+        void TCPSocket::Abort(int error){
+            state = TCPStateUnknown;
+            m_error = error;
 
-            tcpHeader.windowSize = 65535;
+            CancelTimer(m_retransmitTimer);
+            CancelTimer(m_delayedAckTimer);
+            CancelTimer(m_timeWaitTimer);
+        }
 
-            tcpHeader.checksum = CalculateTCPChecksum(adapter->adapterIP, peerAddress, &tcpHeader, sizeof(TCPHeader));
+        bool TCPSocket::ShouldFree(){
+            return m_fileClosed && state == TCPStateUnknown && !m_halfOpen;
+        }
 
-            if(int e = SendIPv4(&tcpHeader, sizeof(TCPHeader), address, peerAddress, IPv4ProtocolTCP, adapter); e){
-                return e;
+        void TCPSocket::Free(){
+            ReleaseListener();
+
+            if(port) {
+                ReleasePort();
             }
 
-            return 0;
+            delete this;
         }
-        
-        int TCPSocket::Acknowledge(uint32_t ackNumber){ // TCP ACK (Acknowledge connection)
-            TCPHeader tcpHeader;
-            memset(&tcpHeader, 0, sizeof(TCPHeader));
 
-            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [ACK] Acknowledgement Number: %u", ackNumber);
-            
-            tcpHeader.srcPort = port;
-            tcpHeader.destPort = destinationPort;
-            tcpHeader.sequence = m_sequenceNumber;
-            tcpHeader.acknowledgementNumber = ackNumber;
+        void TCPSocket::OnRetransmitTimeout(){
+            acquireLock(&m_lock);
+            if(state == TCPStateUnknown || state == TCPStateSyn || state == TCPStateTimeWait){
+                releaseLock(&m_lock);
+                return; // Connect retries the SYN itself
+            } else if(state == TCPStateSynAck){
+                if(m_retransmitTimeout >= TCP_RETRY_MAX){
+                    Abort(ETIMEDOUT); // The peer never completed the handshake
+
+                    bool free = ShouldFree();
+                    releaseLock(&m_lock);
+
+                    if(free){
+                        Free();
+                    }
+                    return;
+                }
 
-            tcpHeader.dataOffset = sizeof(TCPHeader) / 4; // Size of the TCP Header in DWORDs
-            tcpHeader.ack = 1; // ACK/Acknowledge
+                m_retransmitTimeout *= 2;
+                m_rttTiming = false; // Karn's algorithm, we cannot tell which SYN-ACK is being answered
 
-            tcpHeader.windowSize = 65535;
+                uint32_t initialSequence = m_lastAcknowledged;
+                uint32_t ack = m_remoteSequenceNumber;
 
-            tcpHeader.checksum = CalculateTCPChecksum(adapter->adapterIP, peerAddress, &tcpHeader, sizeof(TCPHeader));
+                ArmTimer(m_retransmitTimer, m_retransmitTimeout);
+                releaseLock(&m_lock);
 
-            if(int e = SendIPv4(&tcpHeader, sizeof(TCPHeader), address, peerAddress, IPv4ProtocolTCP, adapter); e){
-                return e;
+                SynchronizeAcknowledge(initialSequence, ack);
+                return;
             }
 
-            return 0;
-        }
-        
-        int TCPSocket::SynchronizeAcknowledge(uint32_t seqNumber, uint32_t ackNumber){ // TCP SYN-ACK (Establish connection to client and acknowledge the connection
-            TCPHeader tcpHeader;
-            memset(&tcpHeader, 0, sizeof(TCPHeader));
+            if(m_lastAcknowledged == m_highestSent){
+                // Nothing in flight, the peer's window is closed so see if it has opened up
+                m_probeWindow = m_outboundData.Pos() > 0;
+                releaseLock(&m_lock);
 
-            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [SYN-ACK] Sequence Number: %u, Acknowledgement Number: %u", seqNumber, ackNumber);
-            
-            tcpHeader.srcPort = port;
-            tcpHeader.destPort = destinationPort;
-            tcpHeader.sequence = seqNumber;
-            tcpHeader.acknowledgementNumber = ackNumber;
+                Output();
+                return;
+            }
+
+            if(++m_retransmits > TCP_MAX_RETRANSMITS){
+                Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] Connection timed out");
+                Abort(ETIMEDOUT);
+
+                bool free = ShouldFree();
+                releaseLock(&m_lock);
+
+                if(free){
+                    Free();
+                } else {
+                    UnblockAll();
+                    NotifyWatchers();
+                }
+                return;
+            }
 
-            tcpHeader.dataOffset = sizeof(TCPHeader) / 4; // Size of the TCP Header in DWORDs
-            tcpHeader.syn = 1; // SYN/Synchronize
-            tcpHeader.ack = 1; // ACK/Acknowledge
+            // RFC 5681, assume everything in flight has been lost and slow start from the first unacknowledged byte
+            m_slowStartThreshold = MAX((m_highestSent - m_lastAcknowledged) / 2, 2U * m_maxSegmentSize);
+            m_congestionWindow = m_maxSegmentSize;
+            m_bytesAcked = 0;
 
-            tcpHeader.windowSize = 65535;
+            m_recover = m_highestSent;
+            m_fastRecovery = false;
+            m_duplicateAcks = 0;
 
-            tcpHeader.checksum = CalculateTCPChecksum(adapter->adapterIP, peerAddress, &tcpHeader, sizeof(TCPHeader));
+            m_sequenceNumber = m_lastAcknowledged;
+            m_retransmitNext = m_lastAcknowledged;
+            m_sackedCount = 0; // The peer is allowed to discard data it has SACKed
+            m_rttTiming = false;
 
-            if(int e = SendIPv4(&tcpHeader, sizeof(TCPHeader), address, peerAddress, IPv4ProtocolTCP, adapter); e){
-                return e;
+            m_retransmitTimeout *= 2;
+            if(m_retransmitTimeout > TCP_RETRY_MAX){
+                m_retransmitTimeout = TCP_RETRY_MAX;
             }
+            releaseLock(&m_lock);
 
-            return 0;
+            Output();
         }
 
-        int TCPSocket::Finish(){ // TCP FIN (Last packet from sender)
-            TCPHeader tcpHeader;
-            memset(&tcpHeader, 0, sizeof(TCPHeader));
+        void TCPSocket::OnDelayedAckTimeout(){
+            acquireLock(&m_lock);
+            m_ackNow = m_unacknowledgedSegments > 0;
+            releaseLock(&m_lock);
 
-            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [FIN]");
-            
-            tcpHeader.srcPort = port;
-            tcpHeader.destPort = destinationPort;
-            tcpHeader.sequence = m_sequenceNumber;
+            Output();
+        }
 
-            tcpHeader.dataOffset = sizeof(TCPHeader) / 4; // Size of the TCP Header in DWORDs
-            tcpHeader.fin = 1; // FIN/Finish
+        void TCPSocket::OnTimeWaitTimeout(){
+            // Also used to free a socket which was closed after the connection was already gone
+            acquireLock(&m_lock);
+            if(state == TCPStateTimeWait){
+                state = TCPStateUnknown;
 
-            tcpHeader.windowSize = 65535;
+                CancelTimer(m_delayedAckTimer);
+            }
 
-            tcpHeader.checksum = CalculateTCPChecksum(adapter->adapterIP, peerAddress, &tcpHeader, sizeof(TCPHeader));
+            bool free = ShouldFree();
+            releaseLock(&m_lock);
 
-            if(int e = SendIPv4(&tcpHeader, sizeof(TCPHeader), address, peerAddress, IPv4ProtocolTCP, adapter); e){
-                return e;
+            if(free){
+                Free();
             }
+        }
 
-            return 0;
+        size_t TCPSocket::BuildHeader(uint8_t* buffer, uint32_t sequence, uint16_t flags){
+            TCPHeader* tcpHeader = reinterpret_cast<TCPHeader*>(buffer);
+            memset(tcpHeader, 0, sizeof(TCPHeader));
+
+            tcpHeader->srcPort = port;
+            tcpHeader->destPort = destinationPort;
+            tcpHeader->sequence = sequence;
+            tcpHeader->flags = flags;
+
+            uint8_t* options = buffer + sizeof(TCPHeader);
+            size_t optionsLength = 0;
+
+            if(flags & TCPHeader::SYN){
+                // A SYN-ACK may only carry the options the peer sent in its SYN
+                bool synAck = flags & TCPHeader::ACK;
+
+                options[0] = TCPOptionMSS;
+                options[1] = 4;
+                options[2] = TCP_MSS >> 8;
+                options[3] = TCP_MSS & 0xFF;
+                optionsLength = 4;
+
+                if(!synAck || m_windowScaling){
+                    options[optionsLength] = TCPOptionNoOperation;
+                    options[optionsLength + 1] = TCPOptionWindowScale;
+                    options[optionsLength + 2] = 3;
+                    options[optionsLength + 3] = WindowShift(m_inboundData.Capacity());
+                    optionsLength += 4;
+                }
+
+                if(!synAck || m_sackPermitted){
+                    options[optionsLength] = TCPOptionNoOperation;
+                    options[optionsLength + 1] = TCPOptionNoOperation;
+                    options[optionsLength + 2] = TCPOptionSACKPermitted;
+                    options[optionsLength + 3] = 2;
+                    optionsLength += 4;
+                }
+
+                // The window in a SYN is never scaled
+                tcpHeader->windowSize = MIN(m_inboundData.Space(), UINT16_MAX);
+            } else {
+                tcpHeader->windowSize = ReceiveWindow();
+            }
+
+            if(flags & TCPHeader::ACK){
+                tcpHeader->acknowledgementNumber = m_remoteSequenceNumber;
+
+                if(m_sackPermitted && m_outOfOrder){
+                    SequenceRange ranges[TCP_SACK_BLOCKS_MAX * 4];
+                    unsigned rangeCount = 0;
+
+                    for(TCPSegment* segment = m_outOfOrder; segment; segment = segment->next){
+                        uint32_t end = segment->sequence + segment->length;
+                        if(!segment->length){
+                            continue;
+                        }
+
+                        if(rangeCount && !SequenceAfter(segment->sequence, ranges[rangeCount - 1].end)){
+                            if(SequenceAfter(end, ranges[rangeCount - 1].end)){
+                                ranges[rangeCount - 1].end = end;
+                            }
+                        } else if(rangeCount < TCP_SACK_BLOCKS_MAX * 4){
+                            ranges[rangeCount++] = {segment->sequence, end};
+                        } else {
+                            break;
+                        }
+                    }
+
+                    // The block holding the latest segment goes first (RFC 2018), then the rest in order
+                    unsigned first = 0;
+                    for(unsigned i = 0; i < rangeCount; i++){
+                        if(!SequenceBefore(m_lastOutOfOrder, ranges[i].start) && SequenceBefore(m_lastOutOfOrder, ranges[i].end)){
+                            first = i;
+                            break;
+                        }
+                    }
+
+                    if(rangeCount){
+                        BigEndian<uint32_t>* blocks = reinterpret_cast<BigEndian<uint32_t>*>(options + optionsLength + 4);
+                        unsigned blockCount = 0;
+
+                        blocks[0] = ranges[first].start;
+                        blocks[1] = ranges[first].end;
+                        blockCount++;
+
+                        for(unsigned i = 0; i < rangeCount && blockCount < TCP_SACK_BLOCKS_MAX; i++){
+                            if(i != first){
+                                blocks[blockCount * 2] = ranges[i].start;
+                                blocks[blockCount * 2 + 1] = ranges[i].end;
+                                blockCount++;
+                            }
+                        }
+
+                        options[optionsLength] = TCPOptionNoOperation;
+                        options[optionsLength + 1] = TCPOptionNoOperation;
+                        options[optionsLength + 2] = TCPOptionSACK;
+                        options[optionsLength + 3] = 2 + 8 * blockCount;
+                        optionsLength += 4 + 8 * blockCount;
+                    }
+                }
+
+                // Everything received so far is acknowledged by this segment
+                m_advertisedEdge = m_remoteSequenceNumber + (static_cast<uint32_t>(static_cast<uint16_t>(tcpHeader->windowSize)) << ((flags & TCPHeader::SYN) ? 0 : m_receiveWindowShift));
+                m_unacknowledgedSegments = 0;
+                m_ackNow = false;
+                CancelTimer(m_delayedAckTimer);
+            }
+
+            tcpHeader->dataOffset = (sizeof(TCPHeader) + optionsLength) / 4; // Size of the TCP Header in DWORDs
+            return sizeof(TCPHeader) + optionsLength;
         }
 
-        int TCPSocket::FinishAcknowledge(uint32_t ackNumber){ // TCP FIN-ACK (Last packet from sender, acknowledge)
-            TCPHeader tcpHeader;
-            memset(&tcpHeader, 0, sizeof(TCPHeader));
+        int TCPSocket::SendSegment(NetBuffer* buffer){
+            TCPHeader* tcpHeader = reinterpret_cast<TCPHeader*>(buffer->data);
 
-            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [FIN-ACK] Acknowledgement Number: %u", ackNumber);
-            
-            tcpHeader.srcPort = port;
-            tcpHeader.destPort = destinationPort;
-            tcpHeader.sequence = m_sequenceNumber;
-            tcpHeader.acknowledgementNumber = ackNumber;
+            tcpHeader->checksum = 0;
+            if(adapter->Type() != NetworkAdapter::NetworkAdapterLoopback){
+                tcpHeader->checksum = CalculateTCPChecksum(address, peerAddress, buffer->data, buffer->length);
+            }
 
-            tcpHeader.dataOffset = sizeof(TCPHeader) / 4; // Size of the TCP Header in DWORDs
-            tcpHeader.ack = 1; // ACK/Acknowledge
-            tcpHeader.fin = 1;
+            return SendIPv4(buffer, address, peerAddress, IPv4ProtocolTCP, adapter);
+        }
 
-            tcpHeader.windowSize = 65535;
+        void TCPSocket::Output(){
+            for(;;){
+                // Taken before the lock as the pool may have to grow
+                NetBuffer* buffer = AllocateBuffer(NetLayerTCP);
+                if(!buffer){
+                    return; // The retransmit timer will try again
+                }
 
-            tcpHeader.checksum = CalculateTCPChecksum(adapter->adapterIP, peerAddress, &tcpHeader, sizeof(TCPHeader));
+                acquireLock(&m_lock);
+                if(state != TCPStateEstablished && state != TCPStateCloseWait && state != TCPStateFinWait1 && state != TCPStateClosing && state != TCPStateLastAck){
+                    // Nothing more to send, though the peer may still need an ACK of its FIN
+                    bool ack = m_ackNow && (state == TCPStateFinWait2 || state == TCPStateTimeWait);
+                    if(ack){
+                        buffer->Put(BuildHeader(buffer->data, m_sequenceNumber, TCPHeader::ACK));
+                    }
+                    releaseLock(&m_lock);
 
-            if(int e = SendIPv4(&tcpHeader, sizeof(TCPHeader), address, peerAddress, IPv4ProtocolTCP, adapter); e){
-                return e;
+                    if(ack){
+                        SendSegment(buffer);
+                    } else {
+                        ReleaseBuffer(buffer);
+                    }
+                    return;
+                }
+
+                uint32_t dataEnd = m_lastAcknowledged + m_outboundData.Pos(); // Sequence number after the last byte in the send buffer
+                uint32_t maxLength = MIN(m_maxSegmentSize, maxSegmentLength - sizeof(TCPHeader) - (m_outOfOrder ? sackOptionLength : 0));
+
+                uint32_t sequence;
+                uint32_t length = 0;
+                uint16_t flags = TCPHeader::ACK;
+                bool retransmission = true;
+                if(m_retransmitNow){
+                    // Fast retransmit, or a partial ACK in recovery
+                    m_retransmitNow = false;
+
+                    sequence = m_lastAcknowledged;
+                    length = MIN(dataEnd - sequence, maxLength);
+                    if(m_sackedCount && SequenceBefore(m_sacked[0].start, sequence + length)){
+                        length = m_sacked[0].start - sequence;
+                    }
+
+                    if(SequenceBefore(m_retransmitNext, sequence + length)){
+                        m_retransmitNext = sequence + length;
+                    }
+                } else if(m_fastRecovery && m_sackPermitted && NextHole(sequence, length, maxLength) && Pipe() + length <= m_congestionWindow){
+                    m_retransmitNext = sequence + length; // Another hole the SACKs tell us about
+                } else {
+                    // New data, or data being sent again after a timeout
+                    sequence = m_sequenceNumber;
+                    retransmission = SequenceBefore(sequence, m_highestSent);
+
+                    uint32_t available = SequenceBefore(sequence, dataEnd) ? (dataEnd - sequence) : 0;
+                    uint32_t inFlight = sequence - m_lastAcknowledged;
+
+                    uint32_t pipe = Pipe();
+                    uint32_t usable = (m_congestionWindow > pipe) ? (m_congestionWindow - pipe) : 0;
+                    if(m_sendWindow > inFlight){
+                        usable = MIN(usable, m_sendWindow - inFlight);
+                    } else {
+                        usable = 0;
+                    }
+
+                    length = MIN(available, usable);
+                    length = MIN(length, maxLength);
+
+                    if(m_probeWindow && available && !length){
+                        length = 1; // Probe the closed window with a single byte
+                    } else if(length < available && length < maxLength && inFlight){
+                        length = 0; // Wait for the window to open up rather than sending a small segment
+                    } else if(length && length < maxLength && length == available && inFlight && !m_noDelay && !m_finQueued){
+                        length = 0; // Nagle's algorithm, hold small writes back until everything in flight is acknowledged
+                    }
+                    m_probeWindow = false;
+
+                    if(available && !length && !inFlight && !m_sendWindow){
+                        StartTimer(m_retransmitTimer, m_retransmitTimeout); // Probe the window if the peer never opens it
+                    }
+                }
+
+                // Send our FIN with the last of the data
+                if(m_finQueued && sequence + length == dataEnd && (length || sequence == m_sequenceNumber || SequenceAfter(m_highestSent, dataEnd))){
+                    flags |= TCPHeader::FIN;
+                }
+
+                if(!length && !(flags & TCPHeader::FIN)){
+                    if(!m_ackNow){
+                        releaseLock(&m_lock);
+
+                        ReleaseBuffer(buffer);
+                        return;
+                    }
+
+                    sequence = m_sequenceNumber; // Just an ACK
+                }
+
+                if(length && sequence + length == dataEnd){
+                    flags |= TCPHeader::PSH; // Nothing left in the send buffer after this segment
+                }
+
+                buffer->Put(BuildHeader(buffer->data, sequence, flags));
+                if(length){
+                    // The only copy on the way out, the IPv4 and Ethernet headers go in the headroom
+                    m_outboundData.PeekAt(sequence - m_lastAcknowledged, buffer->Put(length), length);
+                    CountCopy(NetLayerTCP, length);
+                }
+
+                if(length || (flags & TCPHeader::FIN)){
+                    uint32_t end = sequence + length + ((flags & TCPHeader::FIN) ? 1 : 0);
+                    if(sequence == m_sequenceNumber){
+                        m_sequenceNumber = end;
+                    }
+
+                    if(SequenceAfter(end, m_highestSent)){
+                        if(!m_rttTiming && !retransmission){
+                            m_rttTiming = true; // Time this segment to get an RTT sample
+                            m_timedSequence = sequence;
+                            m_timedSince = Timer::UsecondsSinceBoot();
+                        }
+
+                        m_highestSent = end;
+                    }
+
+                    StartTimer(m_retransmitTimer, m_retransmitTimeout);
+                }
+                releaseLock(&m_lock);
+
+                if(int e = SendSegment(buffer); e){
+                    Log::Debug(debugLevelNetwork, DebugLevelNormal, "[Network] [TCP] Failed to send segment: %d", e);
+                    return; // The retransmit timer will try again
+                }
+
+                if(!length && !(flags & TCPHeader::FIN)){
+                    return;
+                }
             }
+        }
 
-            return 0;
+        int TCPSocket::Synchronize(uint32_t seqNumber){ // TCP SYN (Establish a connection to the server)
+            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [SYN] Sequence Number: %u", seqNumber);
+
+            NetBuffer* buffer = AllocateBuffer(NetLayerTCP);
+            if(!buffer){
+                return -ENOBUFS;
+            }
+
+            acquireLock(&m_lock);
+            buffer->Put(BuildHeader(buffer->data, seqNumber, TCPHeader::SYN));
+            releaseLock(&m_lock);
+
+            return SendSegment(buffer);
         }
 
-        int TCPSocket::Reset(){ // TCP RST (Abort connection)
-            TCPHeader tcpHeader;
-            memset(&tcpHeader, 0, sizeof(TCPHeader));
+        int TCPSocket::Acknowledge(){ // TCP ACK (Acknowledge everything received so far)
+            NetBuffer* buffer = AllocateBuffer(NetLayerTCP);
+            if(!buffer){
+                return -ENOBUFS;
+            }
 
-            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [RST]");
-            
-            tcpHeader.srcPort = port;
-            tcpHeader.destPort = destinationPort;
-            tcpHeader.sequence = m_sequenceNumber;
+            acquireLock(&m_lock);
+            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [ACK] Acknowledgement Number: %u", m_remoteSequenceNumber);
 
-            tcpHeader.dataOffset = sizeof(TCPHeader) / 4; // Size of the TCP Header in DWORDs
-            tcpHeader.rst = 1; // RST, Abort the connections
+            buffer->Put(BuildHeader(buffer->data, m_sequenceNumber, TCPHeader::ACK));
+            releaseLock(&m_lock);
 
-            tcpHeader.checksum = CalculateTCPChecksum(adapter->adapterIP, peerAddress, &tcpHeader, sizeof(TCPHeader));
+            return SendSegment(buffer);
+        }
 
-            if(int e = SendIPv4(&tcpHeader, sizeof(TCPHeader), address, peerAddress, IPv4ProtocolTCP, adapter); e){
-                return e;
+        int TCPSocket::SynchronizeAcknowledge(uint32_t seqNumber, uint32_t ackNumber){ // TCP SYN-ACK (Establish connection to client and acknowledge the connection
+            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [SYN-ACK] Sequence Number: %u, Acknowledgement Number: %u", seqNumber, ackNumber);
+
+            NetBuffer* buffer = AllocateBuffer(NetLayerTCP);
+            if(!buffer){
+                return -ENOBUFS;
             }
 
-            return 0;
+            acquireLock(&m_lock);
+            buffer->Put(BuildHeader(buffer->data, seqNumber, TCPHeader::SYN | TCPHeader::ACK));
+            reinterpret_cast<TCPHeader*>(buffer->data)->acknowledgementNumber = ackNumber;
+            releaseLock(&m_lock);
+
+            return SendSegment(buffer);
+        }
+
+        int TCPSocket::Reset(){ // TCP RST (Abort connection)
+            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] [RST]");
+
+            NetBuffer* buffer = AllocateBuffer(NetLayerTCP);
+            if(!buffer){
+                return -ENOBUFS;
+            }
+
+            acquireLock(&m_lock);
+            buffer->Put(BuildHeader(buffer->data, m_sequenceNumber, TCPHeader::RST));
+            releaseLock(&m_lock);
+
+            return SendSegment(buffer);
         }
 
         unsigned short TCPSocket::AllocatePort(){
@@ -586,11 +1529,55 @@ namespace Network {
         }
 
         TCPSocket::~TCPSocket(){
-
+            CancelTimer(m_retransmitTimer);
+            CancelTimer(m_delayedAckTimer);
+            CancelTimer(m_timeWaitTimer);
+
+            while(m_outOfOrder){
+                TCPSegment* next = m_outOfOrder->next;
+                ReleaseBuffer(m_outOfOrder->buffer);
+                delete m_outOfOrder;
+                m_outOfOrder = next;
+            }
         }
 
         Socket* TCPSocket::Accept(sockaddr* addr, socklen_t* addrlen, int mode){
-            return nullptr;
+            TCPSocket* sock = nullptr;
+
+            for(;;){
+                if(state != TCPStateListen){
+                    return nullptr;
+                }
+
+                acquireLock(&m_lock);
+                if(pending.get_length()){
+                    sock = static_cast<TCPSocket*>(pending.remove_at(0));
+                }
+                releaseLock(&m_lock);
+
+                if(sock){
+                    break;
+                } else if(mode & O_NONBLOCK){
+                    return nullptr;
+                }
+
+                FilesystemBlocker bl(this);
+                if(pending.get_length()){
+                    continue; // Arrived before we could block
+                }
+
+                if(Thread::Current()->Block(&bl)){
+                    return nullptr; // We were interrupted
+                }
+            }
+
+            if(addr && addrlen && *addrlen >= sizeof(sockaddr_in)){
+                *reinterpret_cast<sockaddr_in*>(addr) = {.sin_family = AF_INET, .sin_port = sock->destinationPort, .sin_addr = {sock->peerAddress.value}};
+
+                *addrlen = sizeof(sockaddr_in);
+            }
+
+            return sock;
         }
 
         int TCPSocket::Bind(const sockaddr* addr, socklen_t addrlen){
@@ -653,24 +1640,50 @@ namespace Network {
                 }
             }
 
+            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] Connecting to %hd.%hd.%hd.%hd:%hd", peerAddress.data[0], peerAddress.data[1], peerAddress.data[2], peerAddress.data[3], (uint16_t)destinationPort);
+
+            // The SYN takes up the sequence number before the first byte of data
+            uint32_t initialSequence = InitialSequenceNumber();
+
+            acquireLock(&m_lock);
             state = TCPStateSyn;
+            m_error = 0;
 
-            Log::Debug(debugLevelNetwork, DebugLevelVerbose, "[Network] [TCP] Connecting to %hd.%hd.%hd.%hd:%hd", peerAddress.data[0], peerAddress.data[1], peerAddress.data[2], peerAddress.data[3], (uint16_t)destinationPort);
+            m_sequenceNumber = m_highestSent = initialSequence + 1;
+            m_lastAcknowledged = initialSequence;
+            m_recover = initialSequence;
 
-            m_sequenceNumber = (Timer::GetSystemUptime() % 512) * (rand() % 255) + (Timer::UsecondsSinceBoot() % 255) + 1;
-            Synchronize(m_sequenceNumber - 1); // The peer should acknowledge the sent sequence number + 1, so just send (sequenceNumber - 1)
+            m_rttTiming = true; // Use the handshake for the first RTT sample
+            m_timedSequence = initialSequence;
+            m_timedSince = Timer::UsecondsSinceBoot();
+            releaseLock(&m_lock);
 
-            long retryPeriod = TCP_RETRY_MIN;
+            Synchronize(initialSequence);
+
+            long retryPeriod = TCP_RTO_INITIAL;
             while(state == TCPStateSyn){
                 FilesystemBlocker bl(this);
+                if(state != TCPStateSyn){
+                    break; // The SYN-ACK came in before we blocked
+                }
 
                 long timeout = retryPeriod;
                 if(Thread::Current()->Block(&bl, timeout)){
                     return -EINTR;
                 }
 
-                if(timeout <= 0){
-                    retryPeriod *= 4;
+                if(timeout <= 0 && state == TCPStateSyn){
+                    if(retryPeriod >= TCP_RETRY_MAX){
+                        state = TCPStateUnknown;
+                        return -ETIMEDOUT;
+                    }
+                    retryPeriod *= 2;
+
+                    acquireLock(&m_lock);
+                    m_rttTiming = false; // Karn's algorithm, we cannot tell which SYN is being answered
+                    releaseLock(&m_lock);
+
+                    Synchronize(initialSequence);
                 }
             }
 
@@ -678,8 +1691,6 @@ namespace Network {
                 return -ECONNREFUSED;
             }
 
-            m_remoteSequenceNumber += 1;
-            Acknowledge(m_remoteSequenceNumber);
             return 0;
         }
 
@@ -692,90 +1703,162 @@ namespace Network {
                 return -EISCONN;
             }
 
+            acquireLock(&m_lock);
             state = TCPStateListen;
-
-            if(backlog > 0){
-                pendingConnections = Semaphore(backlog - pending.get_length());
-            }
+            m_backlog = (backlog > 0) ? MIN(backlog, CONNECTION_BACKLOG) : CONNECTION_BACKLOG;
+            releaseLock(&m_lock);
 
             return 0;
         }
 
         int64_t TCPSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen, const void* ancillary, size_t ancillaryLen){
-            if(state != TCPStateEstablished && !m_inboundData.Pos()){
-                Log::Debug(debugLevelNetwork, DebugLevelNormal, "TCPSocket::ReceiveFrom: Not connected!");
-                return -ENOTCONN;
+            iovec iov = {.iov_base = buffer, .iov_len = len};
+            msghdr msg = SingleBufferMessage(&iov, src, (src && addrlen) ? *addrlen : 0);
+
+            int64_t ret = ReceiveMsg(&msg, flags);
+            if(ret >= 0 && src && addrlen){
+                *addrlen = msg.msg_namelen;
+            }
+
+            return ret;
+        }
+
+        int64_t TCPSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* dest, socklen_t addrlen, const void* ancillary, size_t ancillaryLen){
+            if(dest || addrlen){
+                Log::Debug(debugLevelNetwork, DebugLevelNormal, "TCPSocket::SendTo: Already connected!");
+                return -EISCONN; // dest is invalid
             }
 
-            if(addrlen && *addrlen >= sizeof(sockaddr_in)){
-                *reinterpret_cast<sockaddr_in*>(src) = {.sin_family = AF_INET, .sin_port = destinationPort, .sin_addr = {peerAddress.value}};
+            iovec iov = {.iov_base = buffer, .iov_len = len};
+            msghdr msg = SingleBufferMessage(&iov, nullptr, 0);
 
-                *addrlen = sizeof(sockaddr_in);
+            return SendMsg(&msg, flags);
+        }
+
+        int64_t TCPSocket::ReceiveMsg(msghdr* msg, int flags){
+            if(msg->msg_name && msg->msg_namelen >= sizeof(sockaddr_in)){
+                *reinterpret_cast<sockaddr_in*>(msg->msg_name) = {.sin_family = AF_INET, .sin_port = destinationPort, .sin_addr = {peerAddress.value}};
+
+                msg->msg_namelen = sizeof(sockaddr_in);
             }
 
-            if(state == TCPStateEstablished && m_inboundData.Pos() < len){ // We do not want to block when in CLOSE-WAIT
-                FilesystemBlocker bl(this, len);
+            while(!m_inboundData.Pos()){
+                if(m_error){
+                    return -m_error; // ECONNRESET if we recieved an RST
+                } else if(m_finReceived){
+                    return 0; // The peer will not send any more data
+                } else if(state != TCPStateEstablished && state != TCPStateFinWait1 && state != TCPStateFinWait2){
+                    Log::Debug(debugLevelNetwork, DebugLevelNormal, "TCPSocket::ReceiveMsg: Not connected!");
+                    return -ENOTCONN;
+                }
+
+                if(flags & MSG_DONTWAIT){
+                    return -EAGAIN;
+                }
+
+                FilesystemBlocker bl(this);
+                if(m_inboundData.Pos() || m_finReceived || m_error){
+                    continue; // Arrived before we could block
+                }
 
                 if(Thread::Current()->Block(&bl)){
                     return -EINTR; // We were interrupted
                 }
             }
 
-            if(state == TCPStateUnknown){
-                return -ECONNRESET; // If state is now unknown we recieved an RST
-            }
-
-            if(len > m_inboundData.Pos()){
-                len = m_inboundData.Pos(); // We could have been unblocked earlier by a PSH or FIN
+            // Fill each iovec in turn until the receive buffer runs dry
+            int64_t ret = 0;
+            for(unsigned i = 0; i < msg->msg_iovlen; i++){
+                size_t read = m_inboundData.Read(msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+                ret += read;
 
-                if(!len){
-                    return 0;
+                if(read < msg->msg_iov[i].iov_len){
+                    break;
                 }
             }
+            CountCopy(NetLayerSocket, ret);
+
+            // Receiver side silly window avoidance (RFC 1122), only tell the peer about
+            // the space we have freed once it is worth sending more data into
+            bool windowUpdate = false;
+            acquireLock(&m_lock);
+            if(state == TCPStateEstablished || state == TCPStateFinWait1 || state == TCPStateFinWait2){
+                size_t advertised = SequenceAfter(m_advertisedEdge, m_remoteSequenceNumber) ? (m_advertisedEdge - m_remoteSequenceNumber) : 0;
+                size_t space = m_inboundData.Space();
+
+                if(space > advertised && space - advertised >= MIN(m_inboundData.Capacity() / 2, 2 * TCP_MSS)){
+                    m_ackNow = true;
+                    windowUpdate = true;
+                }
+            }
+            releaseLock(&m_lock);
+
+            if(windowUpdate){
+                Output();
+            }
 
-            return m_inboundData.Read(buffer, len);
+            return ret;
         }
 
-        int64_t TCPSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* dest, socklen_t addrlen, const void* ancillary, size_t ancillaryLen){
-            if(state != TCPStateEstablished){
-                Log::Debug(debugLevelNetwork, DebugLevelNormal, "TCPSocket::SendTo: Not connected!");
-                return -ENOTCONN;
+        int64_t TCPSocket::SendMsg(const msghdr* msg, int flags){
+            if(state != TCPStateEstablished && state != TCPStateCloseWait){
+                Log::Debug(debugLevelNetwork, DebugLevelNormal, "TCPSocket::SendMsg: Not connected!");
+                return m_error ? -m_error : -ENOTCONN;
             }
 
-            if(dest || addrlen){
-                Log::Debug(debugLevelNetwork, DebugLevelNormal, "TCPSocket::SendTo: Already connected!");
+            if(msg->msg_name && msg->msg_namelen){
+                Log::Debug(debugLevelNetwork, DebugLevelNormal, "TCPSocket::SendMsg: Already connected!");
                 return -EISCONN; // dest is invalid
             }
 
-            uint16_t shortLength = static_cast<uint16_t>(len);
-
-            TCPHeader header;
-            memset(&header, 0, sizeof(TCPHeader));
+            size_t written = 0;
+            unsigned index = 0; // iovec we are copying from
+            size_t offset = 0;  // Bytes of it already in the send buffer
+            for(;;){
+                // Copy as many of the iovecs as fit before sending, so a header and
+                // body written together do not go out as separate small segments.
+                // Anything which does not fit waits for the peer to acknowledge what is in the buffer
+                for(; index < msg->msg_iovlen; index++, offset = 0){
+                    const iovec& iov = msg->msg_iov[index];
+
+                    size_t chunk = m_outboundData.Write(reinterpret_cast<uint8_t*>(iov.iov_base) + offset, iov.iov_len - offset);
+                    CountCopy(NetLayerSocket, chunk);
+                    written += chunk;
+                    offset += chunk;
+
+                    if(offset < iov.iov_len){
+                        break; // Send buffer is full
+                    }
+                }
 
-            header.srcPort = port;
-            header.destPort = destinationPort;
-            header.sequence = m_sequenceNumber;
-            header.acknowledgementNumber = m_remoteSequenceNumber;
+                Output();
 
-            header.dataOffset = sizeof(TCPHeader) / 4;
+                if(index >= msg->msg_iovlen){
+                    break;
+                }
 
-            header.windowSize = 65535;
+                if(flags & MSG_DONTWAIT){
+                    return written ? written : -EAGAIN;
+                }
 
-            header.ack = 1;
-            header.psh = 1;
+                FilesystemBlocker bl(this);
 
-            TCPPacket pack = { .header = header, .sequenceNumber = m_sequenceNumber, .length = shortLength, .data = new uint8_t[len]};
-            memcpy(pack.data, buffer, shortLength);
+                acquireLock(&m_lock);
+                m_writerWaiting = true;
+                releaseLock(&m_lock);
 
-            m_sequenceNumber += shortLength;
+                if(m_outboundData.Space()){
+                    continue; // Acknowledged before we could block
+                } else if(state != TCPStateEstablished && state != TCPStateCloseWait){
+                    return written ? written : (m_error ? -m_error : -EPIPE);
+                }
 
-            int64_t ret = SendTCP(buffer, shortLength, address, peerAddress, header, adapter);
-            if(ret >= 0){
-                ScopedSpinLock acquired(m_unacknowledgedPacketsLock);
-                m_unacknowledgedPackets.add_back(pack);
+                if(Thread::Current()->Block(&bl)){
+                    return written ? written : -EINTR;
+                }
             }
 
-            return ret;
+            return written;
         }
 
         int TCPSocket::SetSocketOptions(int level, int opt, const void* optValue, socklen_t optLength){
@@ -786,8 +1869,11 @@ namespace Network {
                             return -EFAULT; // need to be at least int size
                         }
 
-                        m_noDelay = *reinterpret_cast<const int*>(optValue); // Disable 'Nagle's algorithm', we don't actualy implement this yet 
-                        // Nagle's algorithm involves buffering output until we fill a packet
+                        // Disable Nagle's algorithm, which holds back small segments whilst data is in flight
+                        m_noDelay = *reinterpret_cast<const int*>(optValue);
+                        if(m_noDelay){
+                            Output(); // Send anything which was being held back
+                        }
                         return 0;
                     default:
                         Log::Warning("TCPSocket::SetSocketOptions: Unknown option: %d", opt);
@@ -841,30 +1927,52 @@ namespace Network {
             if(handleCount <= 0){
                 Log::Debug(debugLevelNetwork, DebugLevelVerbose, "Closing TCP socket...");
 
-                m_fileClosed = true;
+                Disconnect();
+            }
+        }
 
-                if(state == TCPStateListen || state == TCPStateUnknown){
-                    return; // No active connection
-                }
-                
-                if(state == TCPStateSyn || state == TCPStateSynAck){
-                    Reset(); // Connection has not been estabilished
+        void TCPSocket::Disconnect(){
+            bool reset = false;
+            List<Socket*> unaccepted;
 
-                    return;
+            acquireLock(&m_lock);
+            if(state == TCPStateListen){
+                state = TCPStateUnknown; // No active connection
+
+                while(pending.get_length()){
+                    unaccepted.add_back(pending.remove_at(0));
                 }
+            } else if(state == TCPStateSyn || state == TCPStateSynAck){
+                Abort(0); // Connection has not been estabilished
+                reset = true;
+            } else if(state == TCPStateEstablished){
+                state = TCPStateFinWait1;
+                m_finQueued = true; // Sent by Output after anything left in the send buffer
+            } else if(state == TCPStateCloseWait){
+                state = TCPStateLastAck;
+                m_finQueued = true;
+            }
+            releaseLock(&m_lock);
 
-                if(state == TCPStateEstablished){
-                    state = TCPStateFinWait1;
+            if(reset){
+                Reset();
+            } else {
+                Output();
+            }
 
-                    FinishAcknowledge(m_remoteSequenceNumber);
-                } else if(state == TCPStateCloseWait){
-                    state = TCPStateLastAck;
+            // Connections nobody accepted get closed along with the listen socket
+            while(unaccepted.get_length()){
+                static_cast<TCPSocket*>(unaccepted.remove_at(0))->Disconnect();
+            }
 
-                    Finish();
-                }
+            // Sockets are only ever freed on the network thread, once the connection is gone
+            acquireLock(&m_lock);
+            m_fileClosed = true;
 
-                closedSockets.add_back(this);
+            if(state == TCPStateUnknown){
+                ArmTimer(m_timeWaitTimer, 0);
             }
+            releaseLock(&m_lock);
         }
     }
-}
\ No newline at end of file
+}
@@ -74,35 +74,39 @@ namespace Network::UDP{
         return 0;
     }
 
-    int SendUDP(void* data, size_t length, IPv4Address& source, IPv4Address& destination, BigEndian<uint16_t> sourcePort, BigEndian<uint16_t> destinationPort, NetworkAdapter* adapter){
-		if(length > 1518){
+    // Largest payload which fits in one frame
+    static constexpr size_t maxPayloadLength = ETHERNET_MAX_PACKET_SIZE - sizeof(EthernetFrame) - sizeof(IPv4Header) - sizeof(UDPHeader);
+
+    int SendUDP(NetBuffer* buffer, IPv4Address& source, IPv4Address& destination, BigEndian<uint16_t> sourcePort, BigEndian<uint16_t> destinationPort, NetworkAdapter* adapter){
+		if(buffer->length > maxPayloadLength){
+			ReleaseBuffer(buffer);
 			return -EMSGSIZE;
 		}
 
-		uint8_t buffer[1600];
+		uint16_t length = buffer->length;
 
-		UDPHeader* header = (UDPHeader*)buffer;
+		UDPHeader* header = reinterpret_cast<UDPHeader*>(buffer->Push(sizeof(UDPHeader)));
 		header->destPort = destinationPort;
 		header->srcPort = sourcePort;
 		header->length = sizeof(UDPHeader) + length;
 		header->checksum = 0;
 
-		memcpy(header->data, data, length);
-
 		//header->checksum = CaclulateChecksum(header, sizeof(UDPHeader));
 
-		return SendIPv4(header, header->length, source, destination, IPv4ProtocolUDP, adapter);
+		return SendIPv4(buffer, source, destination, IPv4ProtocolUDP, adapter);
 	}
 
-    void OnReceiveUDP(IPv4Header& ipHeader, void* data, size_t length){
-		if(length < sizeof(UDPHeader)){
+    void OnReceiveUDP(IPv4Header& ipHeader, NetBuffer* buffer){
+		if(buffer->length < sizeof(UDPHeader)){
 			Log::Warning("[Network] [UDP] Discarding packet (too short)");
+			CountDrop(NetLayerUDP);
 			return;
 		}
 
-		UDPHeader* header = (UDPHeader*)data;
-        if(header->length > length){
-			Log::Warning("[Network] [UDP] Discarding packet (too long)");
+		UDPHeader* header = reinterpret_cast<UDPHeader*>(buffer->data);
+        if((uint16_t)header->length > buffer->length || (uint16_t)header->length < sizeof(UDPHeader)){
+			Log::Warning("[Network] [UDP] Discarding packet (invalid length)");
+			CountDrop(NetLayerUDP);
             return;
         }
 		
@@ -110,9 +114,18 @@ namespace Network::UDP{
 		    Log::Info("[Network] [UDP] Receiving Packet (Source port: %d, Destination port: %d)", (uint16_t)header->srcPort, (uint16_t)header->destPort);
         });
 
+		buffer->transport = buffer->data;
+		buffer->Trim((uint16_t)header->length);
+		buffer->Pull(sizeof(UDPHeader));
+
+        // Hold the lock so the socket cannot release its port and go away under us
+        ScopedSpinLock lockSockets(socketsLock);
+
         UDPSocket* sock = nullptr;
         if(sockets.get((uint16_t)header->destPort, sock) && sock){
-            sock->OnReceive(ipHeader.sourceIP, header->srcPort, header->data, header->length);
+            sock->OnReceive(buffer);
+        } else {
+            CountDrop(NetLayerUDP); // Nobody is listening
         }
     }
 
@@ -124,6 +137,10 @@ namespace Network::UDP{
         if(bound){
             ReleasePort();
         }
+
+        while(packets.get_length()){
+            ReleaseBuffer(packets.remove_at(0));
+        }
     }
 
     unsigned short UDPSocket::AllocatePort(){
@@ -138,16 +155,17 @@ namespace Network::UDP{
         return Network::UDP::ReleasePort(port);
     }
 
-    int64_t UDPSocket::OnReceive(IPv4Address& sourceIP, BigEndian<uint16_t> sourcePort, void* buffer, size_t len){
-        UDPPacket pkt;
-        pkt.sourceIP = sourceIP;
-        pkt.sourcePort = sourcePort;
-        pkt.length = len;
+    void UDPSocket::OnReceive(NetBuffer* buffer){
+        acquireLock(&packetsLock);
+        if(packets.get_length() >= UDP_RECEIVE_QUEUE_MAX){
+            releaseLock(&packetsLock);
 
-        pkt.data = new uint8_t[len];
-        memcpy(pkt.data, buffer, len);
+            CountDrop(NetLayerUDP); // The reader is not keeping up
+            return;
+        }
 
-        packets.add_back(pkt);
+        packets.add_back(ReferenceBuffer(buffer));
+        releaseLock(&packetsLock);
 
         acquireLock(&blockedLock);
         while(blocked.get_length()){
@@ -155,7 +173,7 @@ namespace Network::UDP{
         }
         releaseLock(&blockedLock);
 
-        return 0;
+        NotifyWatchers();
     }
 
     Socket* UDPSocket::Accept(sockaddr* addr, socklen_t* addrlen, int mode){
@@ -189,51 +207,86 @@ namespace Network::UDP{
     }
 
     int64_t UDPSocket::ReceiveFrom(void* buffer, size_t len, int flags, sockaddr* src, socklen_t* addrlen, const void* ancillary, size_t ancillaryLen){
+        iovec iov = {.iov_base = buffer, .iov_len = len};
+        msghdr msg = SingleBufferMessage(&iov, src, (src && addrlen) ? *addrlen : 0);
+
+        int64_t ret = ReceiveMsg(&msg, flags);
+        if(ret >= 0 && src && addrlen){
+            *addrlen = msg.msg_namelen;
+        }
+
+        return ret;
+    }
+
+    int64_t UDPSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* dest, socklen_t addrlen, const void* ancillary, size_t ancillaryLen){
+        iovec iov = {.iov_base = buffer, .iov_len = len};
+        msghdr msg = SingleBufferMessage(&iov, const_cast<sockaddr*>(dest), dest ? addrlen : 0);
+
+        return SendMsg(&msg, flags);
+    }
+
+    int64_t UDPSocket::ReceiveMsg(msghdr* msg, int flags){
         acquireLock(&packetsLock);
-        if(packets.get_length() <= 0){
+        while(packets.get_length() <= 0){
             releaseLock(&packetsLock);
             if(flags & MSG_DONTWAIT){
                 return -EAGAIN; // Don't wait
             } else if(FilesystemBlocker bl(this); Thread::Current()->Block(&bl)){
                 return -EINTR; // We were interrupted
             }
+
+            acquireLock(&packetsLock); // Someone else may have taken the packet
         }
 
-        UDPPacket pkt = packets.remove_at(0);
+        NetBuffer* packet = packets.remove_at(0);
         releaseLock(&packetsLock);
 
-        if(src && addrlen){
-            sockaddr_in addr;
+        if(msg->msg_name && msg->msg_namelen){
+            const IPv4Header* ipHeader = reinterpret_cast<const IPv4Header*>(packet->network);
+            const UDPHeader* udpHeader = reinterpret_cast<const UDPHeader*>(packet->transport);
+
+            sockaddr_in addr = {};
             addr.sin_family = InternetProtocol;
-            addr.sin_port = pkt.sourcePort;
-            addr.sin_addr.s_addr = pkt.sourceIP.value;
+            addr.sin_port = udpHeader->srcPort.value;
+            addr.sin_addr.s_addr = ipHeader->sourceIP.value;
 
-            memcpy(src, &addr, *addrlen); // Make sure to stay within bounds of addrlen
+            memcpy(msg->msg_name, &addr, MIN(msg->msg_namelen, sizeof(sockaddr_in))); // Make sure to stay within bounds of msg_namelen
 
-            *addrlen = sizeof(sockaddr_in); // addrlen is updated to contain the actual size of the source address
+            msg->msg_namelen = sizeof(sockaddr_in); // Updated to contain the actual size of the source address
         }
 
-        size_t finalLength = MIN(len, pkt.length);
-        memcpy(buffer, pkt.data, finalLength);
+        // One copy straight out of the packet, whatever does not fit in the iovecs is discarded
+        size_t copied = ScatterIovecs(msg->msg_iov, msg->msg_iovlen, packet->data, packet->length);
+        CountCopy(NetLayerSocket, copied);
 
-        delete[] pkt.data; // Free buffer
+        int64_t ret = copied;
+        if(copied < packet->length){
+            msg->msg_flags |= MSG_TRUNC;
+
+            if(flags & MSG_TRUNC){
+                ret = packet->length; // Caller asked for the real length of the datagram
+            }
+        }
 
-        return finalLength;
+        ReleaseBuffer(packet);
+
+        return ret;
     }
 
-    int64_t UDPSocket::SendTo(void* buffer, size_t len, int flags, const sockaddr* dest, socklen_t addrlen, const void* ancillary, size_t ancillaryLen){
+    int64_t UDPSocket::SendMsg(const msghdr* msg, int flags){
         IPv4Address sendIPAddress;
         BigEndian<uint16_t> destPort;
 
-        if(dest && addrlen){
-            const sockaddr_in* inetAddr = (const sockaddr_in*)dest;
+        if(msg->msg_name && msg->msg_namelen){
+            const sockaddr* dest = reinterpret_cast<const sockaddr*>(msg->msg_name);
+            const sockaddr_in* inetAddr = reinterpret_cast<const sockaddr_in*>(dest);
 
             if(dest->family != InternetProtocol){
                 Log::Warning("[UDPSocket] Invalid address family (not IPv4)");
                 return -EINVAL;
             }
             
-            if(addrlen < sizeof(sockaddr_in)){
+            if(msg->msg_namelen < sizeof(sockaddr_in)){
                 Log::Warning("[UDPSocket] Invalid address length");
                 return -EINVAL;
             }
@@ -245,6 +298,11 @@ namespace Network::UDP{
             destPort = destinationPort;
         }
 
+        size_t len = IovecLength(msg->msg_iov, msg->msg_iovlen);
+        if(len > maxPayloadLength){
+            return -EMSGSIZE;
+        }
+
         if(!port){
             port = AllocatePort();
 
@@ -254,23 +312,29 @@ namespace Network::UDP{
             }
         }
 
-        if(!adapter){
+        NetworkAdapter* sendAdapter = adapter;
+        if(!sendAdapter){
             MACAddress mac;
-            NetworkAdapter* adapter = nullptr;
             
-            if(int e = Route(INADDR_ANY, sendIPAddress, mac, adapter)){
-                return e;
-            }
-        
-            if(int e = SendUDP(buffer, len, address, sendIPAddress, port, destPort, adapter)){
-                return e;
-            }
-        } else {
-            if(int e = SendUDP(buffer, len, address, sendIPAddress, port, destPort, adapter)){
+            if(int e = Route(INADDR_ANY, sendIPAddress, mac, sendAdapter)){
                 return e;
             }
         }
 
+        // The payload is gathered straight into the packet and is the only copy,
+        // the headers are pushed in front of it
+        NetBuffer* packet = AllocateBuffer(NetLayerUDP);
+        if(!packet){
+            return -ENOBUFS;
+        }
+
+        GatherIovecs(packet->Put(len), msg->msg_iov, msg->msg_iovlen);
+        CountCopy(NetLayerSocket, len);
+
+        if(int e = SendUDP(packet, address, sendIPAddress, port, destPort, sendAdapter)){
+            return e;
+        }
+
         return len;
     }
 }
\ No newline at end of file
@@ -2,6 +2,103 @@
 
 #include <Errno.h>
 #include <Logging.h>
+#include <Math.h>
+#include <Objects/Process.h>
+#include <Paging.h>
+#include <PhysicalAllocator.h>
+#include <Scheduler.h>
+#include <Trace.h>
+
+// When the peer's ring is full, give it a chance to catch up before sleeping
+#define ENDPOINT_RING_FULL_YIELDS 64
+#define ENDPOINT_RING_FULL_SLEEP 500 // us
+// Give up on a ring lock after roughly half a second, the peer holding it may never let go
+#define ENDPOINT_RING_LOCK_ATTEMPTS 1024
+
+// Stops both endpoints of a pair from creating rings at once
+static lock_t ringCreationLock = 0;
+
+static uint32_t RingSlotSize(uint16_t msgSize){
+    return (sizeof(lemon_endpoint_ring_slot_t) + msgSize + 15) & ~15U;
+}
+
+static uint32_t RingSlotCount(uint32_t slotSize){
+    uint32_t count = LEMON_ENDPOINT_RING_MAX_SLOTS;
+    while(count > LEMON_ENDPOINT_RING_MIN_SLOTS && count * slotSize > LEMON_ENDPOINT_RING_SIZE){
+        count >>= 1;
+    }
+
+    return count;
+}
+
+static size_t RingSize(uint16_t msgSize){
+    uint32_t slotSize = RingSlotSize(msgSize);
+
+    return PAGE_COUNT_4K(RingSlotCount(slotSize) * slotSize) << PAGE_SHIFT_4K;
+}
+
+// The ring locks are in memory shared with the peer, so we cannot trust them to ever be released.
+// Returns 0 once the lock is held, -EINTR if a signal arrives or -EAGAIN if it is held for too long
+static int AcquireRingLock(uint32_t* lock){
+    for(unsigned attempts = 0; __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE); attempts++){
+        if(Thread::Current()->HasPendingSignals()){
+            return -EINTR;
+        } else if(attempts >= ENDPOINT_RING_LOCK_ATTEMPTS){
+            return -EAGAIN;
+        }
+
+        if(attempts < ENDPOINT_RING_FULL_YIELDS){
+            Scheduler::Yield();
+        } else {
+            Thread::Current()->Sleep(ENDPOINT_RING_FULL_SLEEP);
+        }
+    }
+
+    return 0;
+}
+
+static void ReleaseRingLock(uint32_t* lock){
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+EndpointRingVMObject::EndpointRingVMObject(uint16_t msgSize)
+    : VMObject(PAGE_SIZE_4K + 2 * RingSize(msgSize), false, true){
+    slotSize = RingSlotSize(msgSize);
+    slotCount = RingSlotCount(slotSize);
+    ringSize = RingSize(msgSize);
+
+    unsigned pageCount = size >> PAGE_SHIFT_4K;
+
+    pages = new uintptr_t[pageCount];
+    mapping = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(pageCount));
+    for(unsigned i = 0; i < pageCount; i++){
+        pages[i] = Memory::AllocatePhysicalMemoryBlock();
+        Memory::KernelMapVirtualMemory4K(pages[i], reinterpret_cast<uintptr_t>(mapping) + (i << PAGE_SHIFT_4K), 1);
+    }
+
+    memset(mapping, 0, size);
+}
+
+EndpointRingVMObject::~EndpointRingVMObject(){
+    unsigned pageCount = size >> PAGE_SHIFT_4K;
+
+    Memory::KernelFree4KPages(mapping, pageCount);
+    for(unsigned i = 0; i < pageCount; i++){
+        Memory::FreePhysicalMemoryBlock(pages[i]);
+    }
+
+    delete[] pages;
+}
+
+void EndpointRingVMObject::MapAllocatedBlocks(uintptr_t base, PageMap* pMap){
+    for(unsigned i = 0; i < (size >> PAGE_SHIFT_4K); i++){
+        Memory::MapVirtualMemory4K(pages[i], base + (i << PAGE_SHIFT_4K), 1, pMap);
+    }
+}
+
+VMObject* EndpointRingVMObject::Clone(){
+    assert(!"Endpoint rings cannot be cloned!");
+}
 
 MessageEndpoint::MessageEndpoint(uint16_t maxSize){
     maxMessageSize = maxSize;
@@ -26,7 +123,13 @@ MessageEndpoint::~MessageEndpoint(){
 void MessageEndpoint::Destroy(){
     // TODO: peer race condition
     if(peer){
+        if(ring.get()){
+            // Let the peer know once it has read everything we wrote to the ring
+            __atomic_store_n(&ring->Ring(!ringIndex)->producerClosed, 1, __ATOMIC_RELEASE);
+        }
+
         peer->peer = nullptr;
+        peer->SignalWaiting();
     }
 }
 
@@ -35,11 +138,21 @@ int64_t MessageEndpoint::Read(uint64_t* id, uint16_t* size, uint8_t* data){
     assert(size);
     assert(data);
 
+    // Anything queued before we started reading from the ring comes first
     if(queue.Empty()){
+        if(__atomic_load_n(&ringAttached, __ATOMIC_ACQUIRE)){
+            if(int64_t ret = ReadRing(id, size, data); ret){
+                if(ret > 0){
+                    TRACE_EVENT(TraceEventIPCReceive, reinterpret_cast<uintptr_t>(this), *id, *size);
+                }
+                return ret;
+            }
+        }
+
         if(!peer){
             return -ENOTCONN;
         }
-        
+
         return 0;
     }
 
@@ -47,6 +160,7 @@ int64_t MessageEndpoint::Read(uint64_t* id, uint16_t* size, uint8_t* data){
 
     Message* m;
     if(queue.Dequeue(m) <= 0){
+        releaseLock(&queueLock);
         return 0;
     }
 
@@ -58,7 +172,12 @@ int64_t MessageEndpoint::Read(uint64_t* id, uint16_t* size, uint8_t* data){
 
     releaseLock(&queueLock);
 
-    queueAvailablilitySemaphore.Signal();
+    // The peer waits on its own semaphore before queueing on us
+    if(MessageEndpoint* p = peer; p){
+        p->queueAvailablilitySemaphore.Signal();
+    }
+
+    TRACE_EVENT(TraceEventIPCReceive, reinterpret_cast<uintptr_t>(this), *id, *size);
 
     if(debugLevelMessageEndpoint >= DebugLevelVerbose){
         Log::Info("[MessageEndpoint] Receiving message (ID: %u, Size: %u)", *id, *size);
@@ -78,34 +197,52 @@ int64_t MessageEndpoint::Call(uint64_t id, uint16_t size, uint64_t data, uint64_
 
     assert(rSize);
     assert(rData);
-    
+
+    Message* reply = nullptr;
+
+    acquireLock(&queueLock);
+    if(cache.Dequeue(reply) <= 0){
+        reply = nullptr;
+    }
+    releaseLock(&queueLock);
+
+    if(!reply){
+        reply = AllocateMessage();
+    }
+
     Semaphore s = Semaphore(0);
     acquireLock(&waitingResponseLock);
-    
-    uint8_t* buffer = nullptr;
-    uint16_t returnSize; // We cannot use rSize as it lies within the process' address space, not the kernel's
-    waitingResponse.add_back({&s, {.id = rID, .size = &returnSize, .buffer = &buffer}});
-
+    waitingResponse.add_back({&s, {.id = rID, .message = reply}});
     releaseLock(&waitingResponseLock);
 
     Write(id, size, data); // Send message
 
     // TODO: timeout
+    int64_t ret = 0;
     if(s.Wait()){ // Await response
-        if(buffer){
-            delete buffer;
+        // The peer fills in the reply whilst holding the lock, so it is done with it once we have the lock
+        acquireLock(&waitingResponseLock);
+        for(auto it = waitingResponse.begin(); it != waitingResponse.end(); it++){
+            if(it->item1 == &s){
+                waitingResponse.remove(it);
+                break;
+            }
         }
+        releaseLock(&waitingResponseLock);
 
-        return -EINTR; // Interrupted
-    }
-    
-    if(buffer){
-        memcpy(rData, buffer, returnSize);
-        *rSize = returnSize;
+        ret = -EINTR; // Interrupted
+    } else {
+        memcpy(rData, reply->data, reply->size);
+        *rSize = reply->size;
 
-        delete buffer;
+        TRACE_EVENT(TraceEventIPCReceive, reinterpret_cast<uintptr_t>(this), rID, reply->size);
     }
-    return 0;
+
+    acquireLock(&queueLock);
+    cache.Enqueue(reply);
+    releaseLock(&queueLock);
+
+    return ret;
 }
 
 int64_t MessageEndpoint::Write(uint64_t id, uint16_t size, uint64_t data){
@@ -117,18 +254,16 @@ int64_t MessageEndpoint::Write(uint64_t id, uint16_t size, uint64_t data){
         return -EINVAL;
     }
 
+    TRACE_EVENT(TraceEventIPCSend, reinterpret_cast<uintptr_t>(peer), id, size);
+
     acquireLock(&peer->waitingResponseLock);
     for(auto it = peer->waitingResponse.begin(); it != peer->waitingResponse.end(); it++){
         if(it->item2.id == id){
-            Response& response = it->item2;
-
-            if(size){
-                *it->item2.buffer = new uint8_t[size];
-
-                memcpy(*it->item2.buffer, reinterpret_cast<uint8_t*>(data), size);
-            }
+            Message* reply = it->item2.message;
 
-            *response.size = size;
+            reply->id = id;
+            reply->size = size;
+            memcpy(reply->data, reinterpret_cast<uint8_t*>(data), size);
 
             it->item1->Signal();
 
@@ -143,12 +278,25 @@ int64_t MessageEndpoint::Write(uint64_t id, uint16_t size, uint64_t data){
     }
     releaseLock(&peer->waitingResponseLock);
 
+    if(__atomic_load_n(&peer->ringAttached, __ATOMIC_ACQUIRE)){
+        return WriteRing(id, size, data);
+    }
+
     if(queueAvailablilitySemaphore.Wait()){
         return -EINTR;
     }
 
     acquireLock(&peer->queueLock);
 
+    if(peer->ringAttached){
+        // The peer started reading from the ring whilst we were waiting,
+        // everything from now on has to go through the ring to stay in order
+        releaseLock(&peer->queueLock);
+        queueAvailablilitySemaphore.Signal();
+
+        return WriteRing(id, size, data);
+    }
+
     Message* m;
     if(peer->cache.Dequeue(m)){ // Check for a cached message allocaiton
         m->size = size;
@@ -164,11 +312,7 @@ int64_t MessageEndpoint::Write(uint64_t id, uint16_t size, uint64_t data){
 
     peer->queue.Enqueue(m);
 
-    acquireLock(&peer->waitingLock);
-    while(peer->waiting.get_length() > 0){
-        peer->waiting.remove_at(0)->Signal();
-    }
-    releaseLock(&peer->waitingLock);
+    peer->SignalWaiting();
 
     if(debugLevelMessageEndpoint >= DebugLevelVerbose){
         Log::Info("[MessageEndpoint] Sending message (ID: %u, Size: %u) to peer", id, size);
@@ -176,4 +320,201 @@ int64_t MessageEndpoint::Write(uint64_t id, uint16_t size, uint64_t data){
 
     releaseLock(&peer->queueLock);
     return 0;
-}
\ No newline at end of file
+}
+
+int64_t MessageEndpoint::MapRing(Process* proc, lemon_endpoint_ring_info_t& info){
+    if(!ring.get()){
+        FancyRefPtr<EndpointRingVMObject> newRing = new EndpointRingVMObject(maxMessageSize);
+
+        acquireLock(&ringCreationLock);
+        if(!peer){
+            releaseLock(&ringCreationLock);
+            return -ENOTCONN;
+        }
+
+        if(!ring.get()){ // Make sure the peer did not beat us to it
+            ring = newRing;
+            peer->ring = newRing;
+        }
+        releaseLock(&ringCreationLock);
+    }
+
+    acquireLock(&ringMappingLock);
+
+    // Reuse the existing mapping if it is still there
+    uintptr_t base = 0;
+    if(ringMappingBase){
+        if(MappedRegion* region = proc->addressSpace->AddressToRegionReadLock(ringMappingBase); region){
+            if(region->vmObject.get() == ring.get() && region->Base() == ringMappingBase){
+                base = ringMappingBase;
+            }
+
+            region->lock.ReleaseRead();
+        }
+    }
+
+    if(!base){
+        MappedRegion* region = proc->addressSpace->MapVMO(static_pointer_cast<VMObject>(ring), 0, false);
+        if(!region){
+            releaseLock(&ringMappingLock);
+            return -ENOMEM;
+        }
+
+        base = ringMappingBase = region->Base();
+    }
+
+    releaseLock(&ringMappingLock);
+
+    acquireLock(&queueLock);
+    if(!ringAttached){
+        __atomic_store_n(&ring->Ring(ringIndex)->consumerAttached, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&ringAttached, true, __ATOMIC_RELEASE);
+    }
+    releaseLock(&queueLock);
+
+    info = {
+        .base = base,
+        .dataOffset = {ring->DataOffset(0), ring->DataOffset(1)},
+        .rx = static_cast<uint32_t>(ringIndex),
+        .tx = static_cast<uint32_t>(!ringIndex),
+        .slotCount = ring->SlotCount(),
+        .slotSize = ring->SlotSize(),
+        .msgSize = maxMessageSize,
+    };
+
+    if(debugLevelMessageEndpoint >= DebugLevelNormal){
+        Log::Info("[MessageEndpoint] Mapped ring at %x (%u slots of %u bytes)", base, ring->SlotCount(), ring->SlotSize());
+    }
+
+    return 0;
+}
+
+void MessageEndpoint::UnmapRing(Process* proc){
+    acquireLock(&ringMappingLock);
+    if(!ringMappingBase){
+        releaseLock(&ringMappingLock);
+        return;
+    }
+
+    bool mapped = false;
+    if(MappedRegion* region = proc->addressSpace->AddressToRegionReadLock(ringMappingBase); region){
+        mapped = (region->vmObject.get() == ring.get() && region->Base() == ringMappingBase);
+
+        region->lock.ReleaseRead();
+    }
+
+    if(mapped){
+        proc->addressSpace->UnmapMemory(ringMappingBase, ring->Size());
+        ringMappingBase = 0;
+    }
+    releaseLock(&ringMappingLock);
+}
+
+int64_t MessageEndpoint::Notify(){
+    MessageEndpoint* p = peer;
+    if(!p){
+        return -ENOTCONN;
+    }
+
+    p->SignalWaiting();
+    return 0;
+}
+
+void MessageEndpoint::SignalWaiting(){
+    acquireLock(&waitingLock);
+    while(waiting.get_length() > 0){
+        waiting.remove_at(0)->Signal();
+    }
+    releaseLock(&waitingLock);
+}
+
+int64_t MessageEndpoint::ReadRing(uint64_t* id, uint16_t* size, uint8_t* data){
+    lemon_endpoint_ring_t* r = ring->Ring(ringIndex);
+    if(int e = AcquireRingLock(&r->consumerLock); e){
+        return e;
+    }
+
+    uint64_t head = r->head;
+    if(__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head){
+        ReleaseRingLock(&r->consumerLock);
+        return 0; // Read will check if the peer has gone
+    }
+
+    // The peer can write to the slot at any time, so only read each field once
+    lemon_endpoint_ring_slot_t* slot = ring->Slot(ringIndex, head);
+    uint16_t msgSize = MIN(__atomic_load_n(&slot->size, __ATOMIC_RELAXED), maxMessageSize);
+
+    *id = slot->id;
+    *size = msgSize;
+    memcpy(data, slot->data, msgSize);
+
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    ReleaseRingLock(&r->consumerLock);
+
+    if(debugLevelMessageEndpoint >= DebugLevelVerbose){
+        Log::Info("[MessageEndpoint] Receiving message from ring (ID: %u, Size: %u)", *id, *size);
+    }
+
+    return 1;
+}
+
+int64_t MessageEndpoint::WriteRing(uint64_t id, uint16_t size, uint64_t data){
+    FancyRefPtr<EndpointRingVMObject> rings = ring; // Keep the rings around in case the peer goes away
+
+    int index = !ringIndex; // The peer reads from the other ring
+    lemon_endpoint_ring_t* r = rings->Ring(index);
+    if(int e = AcquireRingLock(&r->producerLock); e){
+        return e;
+    }
+
+    uint64_t tail = r->tail;
+    for(unsigned attempts = 0;; attempts++){
+        uint64_t used = tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if(used < rings->SlotCount()){
+            break;
+        }
+
+        int64_t error = 0;
+        if(used > rings->SlotCount()){
+            error = -EIO; // Only possible if the ring has been trashed
+        } else if(!peer){
+            error = -ENOTCONN;
+        } else if(Thread::Current()->HasPendingSignals()){
+            error = -EINTR;
+        }
+
+        if(error){
+            ReleaseRingLock(&r->producerLock);
+            return error;
+        }
+
+        if(attempts < ENDPOINT_RING_FULL_YIELDS){
+            Scheduler::Yield();
+        } else {
+            Thread::Current()->Sleep(ENDPOINT_RING_FULL_SLEEP);
+        }
+    }
+
+    lemon_endpoint_ring_slot_t* slot = rings->Slot(index, tail);
+    slot->id = id;
+    slot->size = size;
+    memcpy(slot->data, reinterpret_cast<uint8_t*>(data), size);
+
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+    // Only wake the peer if it may have seen the ring empty
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bool wasEmpty = (__atomic_load_n(&r->head, __ATOMIC_RELAXED) == tail);
+
+    ReleaseRingLock(&r->producerLock);
+
+    if(MessageEndpoint* p = peer; wasEmpty && p){
+        p->SignalWaiting();
+    }
+
+    if(debugLevelMessageEndpoint >= DebugLevelVerbose){
+        Log::Info("[MessageEndpoint] Sending message (ID: %u, Size: %u) to peer ring", id, size);
+    }
+
+    return 0;
+}
@@ -6,6 +6,7 @@
 #include <CPU.h>
 #include <ELF.h>
 #include <IDT.h>
+#include <RunQueue.h>
 #include <SMP.h>
 #include <Scheduler.h>
 #include <String.h>
@@ -43,8 +44,9 @@ FancyRefPtr<Process> Process::CreateKernelProcess(void* entry, const char* name,
     return proc;
 }
 
-FancyRefPtr<Process> Process::CreateELFProcess(void* elf, const Vector<String>& argv, const Vector<String>& envp, const char* execPath, Process* parent){
-    if (!VerifyELF(elf)) {
+FancyRefPtr<Process> Process::CreateELFProcess(FsNode* node, const Vector<String>& argv, const Vector<String>& envp, const char* execPath, Process* parent){
+    elf64_header_t header;
+    if (fs::Read(node, 0, sizeof(header), reinterpret_cast<uint8_t*>(&header)) != sizeof(header) || !VerifyELF(&header)) {
         return nullptr;
     }
 
@@ -61,7 +63,7 @@ FancyRefPtr<Process> Process::CreateELFProcess(void* elf, const Vector<String>&
     thread->timeSlice = thread->timeSliceDefault;
     thread->priority = 4;
 
-    elf_info_t elfInfo = LoadELFSegments(proc.get(), elf, 0);
+    elf_info_t elfInfo = LoadELFSegments(proc.get(), node, 0);
 
     MappedRegion* stackRegion = proc->addressSpace->AllocateAnonymousVMObject(0x400000, 0, false); // 4MB max stacksize
 
@@ -154,6 +156,11 @@ Process::Process(pid_t pid, const char* _name, const char* _workingDir, Process*
 
 uintptr_t Process::LoadELF(uintptr_t* stackPointer, elf_info_t elfInfo, const Vector<String>& argv, const Vector<String>& envp, const char* execPath) {
     uintptr_t rip = elfInfo.entry;
+    if (execPath) {
+        String path = fs::CanonicalizePath(execPath, workingDirPath);
+        strncpy(executablePath, path.c_str(), PATH_MAX);
+    }
+
     if (elfInfo.linkerPath) {
         // char* linkPath = elfInfo.linkerPath;
         uintptr_t linkerBaseAddress = 0x7FC0000000; // Linker base address
@@ -163,18 +170,13 @@ uintptr_t Process::LoadELF(uintptr_t* stackPointer, elf_info_t elfInfo, const Ve
             KernelPanic("Failed to load dynamic linker!");
         }
 
-        void* linkerElf = kmalloc(node->size);
-        fs::Read(node, 0, node->size, (uint8_t*)linkerElf); // Load Dynamic Linker
-
-        if (!VerifyELF(linkerElf)) {
+        elf_info_t linkerELFInfo = LoadELFSegments(this, node, linkerBaseAddress); // Load Dynamic Linker
+        if (!linkerELFInfo.entry) {
             Log::Warning("Invalid Dynamic Linker ELF");
             return 0;
         }
 
-        elf_info_t linkerELFInfo = LoadELFSegments(this, linkerElf, linkerBaseAddress);
         rip = linkerELFInfo.entry;
-
-        kfree(linkerElf);
     }
 
     char* tempArgv[argv.size()];
@@ -264,7 +266,7 @@ Process::~Process() {
     assert(m_state == Process_Dead);
     assert(!m_parent);
 
-    if (addressSpace) {
+    if (addressSpace && !m_borrowsAddressSpace) {
         delete addressSpace;
         addressSpace = nullptr;
     }
@@ -349,6 +351,8 @@ void Process::Die() {
             }
             
             thread->state = ThreadStateZombie;
+            // Zombie threads must run to leave the kernel, make sure it is not left off the run queue
+            Scheduler::Wake(thread.get());
 
             if (!acquireTestLock(&thread->kernelLock)) {
                 thread->state =
@@ -422,8 +426,6 @@ void Process::Die() {
 
     assert(!runningThreads.get_length());
 
-    // Prevent run queue balancing
-    acquireLock(&Scheduler::processesLock);
     acquireLockIntDisable(&m_processLock);
 
     CPU* cpu = GetCPULocal();
@@ -438,14 +440,7 @@ void Process::Die() {
     }
 
     acquireLock(&cpu->runQueueLock);
-
-    for (unsigned j = 0; j < cpu->runQueue->get_length(); j++) {
-        if (Thread* thread = cpu->runQueue->get_at(j); thread != cpu->currentThread && thread->parent == this) {
-            cpu->runQueue->remove_at(j);
-            j = 0;
-        }
-    }
-
+    cpu->runQueue->RemoveProcessThreads(this);
     releaseLock(&cpu->runQueueLock);
 
     for (unsigned i = 0; i < SMP::processorCount; i++) {
@@ -459,19 +454,11 @@ void Process::Die() {
         if(other->currentThread && other->currentThread->parent == this) {
             assert(other->currentThread->state == ThreadStateDying); // The thread state should be blocked
 
+            other->currentThread->onCPU = false;
             other->currentThread = nullptr;
         }
 
-        for (unsigned j = 0; j < other->runQueue->get_length(); j++) {
-            Thread* thread = other->runQueue->get_at(j);
-
-            assert(thread);
-
-            if (thread->parent == this) {
-                other->runQueue->remove(thread);
-                j = 0;
-            }
-        }
+        other->runQueue->RemoveProcessThreads(this);
 
         if (other->currentThread == nullptr) {
             APIC::Local::SendIPI(i, ICR_DSH_SELF, ICR_MESSAGE_TYPE_FIXED, IPI_SCHEDULE);
@@ -486,7 +473,6 @@ void Process::Die() {
     }
 
     asm("sti");
-    releaseLock(&Scheduler::processesLock);
 
     Log::Debug(debugLevelScheduler, DebugLevelNormal, "[%d] Closing handles...", m_pid);
     m_handles.clear();
@@ -505,6 +491,17 @@ void Process::Die() {
         m_watching.clear();
     }
 
+    bool isDyingProcess = (thisThread->parent == this);
+    if (m_borrowsAddressSpace) {
+        if (isDyingProcess) {
+            // We are still running on our vfork parent's page tables, which it may free as soon as it continues.
+            // Interrupts stay disabled until we switch away for good, otherwise rescheduling would load them again
+            asm volatile("cli; mov %%rax, %%cr3" ::"a"(((uint64_t)Memory::kernelPML4) - KERNEL_VIRTUAL_BASE));
+        }
+
+        m_addressSpaceReleased.Signal(); // Let our vfork parent continue
+    }
+
     if(m_parent && (m_parent->State() == Process_Running)){
         Log::Debug(debugLevelScheduler, DebugLevelNormal, "[%d] Sending SIGCHILD to %s...", m_pid, m_parent->name);
         m_parent->GetMainThread()->Signal(SIGCHLD);
@@ -514,7 +511,6 @@ void Process::Die() {
     Log::Debug(debugLevelScheduler, DebugLevelNormal, "[%d] Marking process for destruction...", m_pid);
     Scheduler::MarkProcessForDestruction(this);
 
-    bool isDyingProcess = (thisThread->parent == this);
     if(isDyingProcess){
         acquireLockIntDisable(&cpu->runQueueLock);
         Log::Debug(debugLevelScheduler, DebugLevelNormal, "[%d] Rescheduling...", m_pid);
@@ -529,7 +525,7 @@ void Process::Die() {
         // cpu may have changes since we released the processes lock
         // as the run queue
         cpu = GetCPULocal();
-        cpu->runQueue->remove(thisThread);
+        thisThread->onCPU = false;
         cpu->currentThread = cpu->idleThread;
 
         releaseLock(&cpu->runQueueLock);
@@ -570,12 +566,20 @@ void Process::Unwatch(KernelObjectWatcher& watcher) {
     m_watching.remove(&watcher);
 }
 
-FancyRefPtr<Process> Process::Fork() {
+FancyRefPtr<Process> Process::Fork(bool borrowAddressSpace) {
     ScopedSpinLock lock(m_processLock);
 
     FancyRefPtr<Process> newProcess = new Process(Scheduler::GetNextPID(), name, workingDirPath, this);
     delete newProcess->addressSpace; // TODO: Do not create address space in first place
-    newProcess->addressSpace = addressSpace->Fork();
+    if (borrowAddressSpace) {
+        newProcess->addressSpace = addressSpace;
+        newProcess->m_borrowsAddressSpace = true;
+        newProcess->m_signalTrampoline = m_signalTrampoline;
+    } else {
+        newProcess->addressSpace = addressSpace->Fork();
+    }
+
+    strcpy(newProcess->executablePath, executablePath);
 
     newProcess->euid = euid;
     newProcess->uid = uid;
@@ -0,0 +1,435 @@
+#include <Profiler.h>
+
+#include <CPU.h>
+#include <CString.h>
+#include <Device.h>
+#include <Errno.h>
+#include <Objects/Process.h>
+#include <Paging.h>
+#include <SMP.h>
+#include <Scheduler.h>
+#include <Spinlock.h>
+#include <Thread.h>
+#include <Timer.h>
+#include <UserPointer.h>
+
+#define PROFILER_SAMPLES_PER_CPU 4096 // Must be a power of two
+#define PROFILER_MAX_READ 0x10000      // Most memory IoCtlProfilerReadMemory copies at once
+
+// Same layout as the trace buffers, each CPU only writes to its own ring
+// from the timer interrupt so taking a sample needs no locks.
+struct ProfileBuffer {
+    struct Slot {
+        uint64_t seq; // 0 whilst being written, index + 1 afterwards
+        lemon_profile_sample_t sample;
+    };
+
+    uint64_t head = 0;
+    uint64_t tail = 0;
+    uint64_t lost = 0;
+    Slot slots[PROFILER_SAMPLES_PER_CPU];
+};
+
+namespace Profiler {
+
+bool enabled = false;
+uint64_t samplePeriodNs = 1000000000 / LEMON_PROFILER_DEFAULT_FREQUENCY;
+
+pid_t targetPID = -1;
+
+// Physical address of a present user page, 0 if it is not mapped in.
+// Only looks at the page tables, so it never faults and takes no locks.
+static uintptr_t UserPagePhysical(PageMap* pageMap, uintptr_t addr) {
+    if (PML4_GET_INDEX(addr) != 0) {
+        return 0;
+    }
+
+    uint32_t pdptIndex = PDPT_GET_INDEX(addr);
+    uint32_t pageDirIndex = PAGE_DIR_GET_INDEX(addr);
+    if (!(pageMap->pageDirs[pdptIndex][pageDirIndex] & PAGE_PRESENT) || !pageMap->pageTables[pdptIndex][pageDirIndex]) {
+        return 0;
+    }
+
+    uint64_t page = pageMap->pageTables[pdptIndex][pageDirIndex][PAGE_TABLE_GET_INDEX(addr)];
+    if (!(page & PAGE_PRESENT)) {
+        return 0;
+    }
+
+    return (page & PAGE_FRAME) | (addr & (PAGE_SIZE_4K - 1));
+}
+
+// Walk the frame pointers of the current user stack.
+// Frames are 16 byte aligned so a frame never crosses a page boundary.
+static unsigned WalkUserStack(PageMap* pageMap, uint64_t rip, uint64_t rbp, uint64_t* frames, unsigned max) {
+    unsigned count = 0;
+    frames[count++] = rip;
+
+    while (count < max && rbp && !(rbp & 0xf) && UserPagePhysical(pageMap, rbp)) {
+        uint64_t* frame = reinterpret_cast<uint64_t*>(rbp);
+        if (!frame[1]) {
+            break;
+        }
+
+        frames[count++] = frame[1];
+        if (frame[0] <= rbp) {
+            break; // The stack grows down so the caller's frame is always above ours
+        }
+
+        rbp = frame[0];
+    }
+
+    return count;
+}
+
+// Only follow frames on the thread's own kernel stack,
+// anything else (e.g. the interrupt hit whilst switching stacks) ends the walk
+static unsigned WalkKernelStack(Thread* thread, uint64_t rip, uint64_t rbp, uint64_t* frames, unsigned max) {
+    uintptr_t stackBottom = reinterpret_cast<uintptr_t>(thread->kernelStackBase);
+    uintptr_t stackTop = reinterpret_cast<uintptr_t>(thread->kernelStack);
+
+    unsigned count = 0;
+    frames[count++] = rip;
+
+    while (count < max && rbp >= stackBottom && rbp + 16 <= stackTop && !(rbp & 0x7)) {
+        uint64_t* frame = reinterpret_cast<uint64_t*>(rbp);
+        if (!frame[1]) {
+            break;
+        }
+
+        frames[count++] = frame[1];
+        if (frame[0] <= rbp) {
+            break;
+        }
+
+        rbp = frame[0];
+    }
+
+    return count;
+}
+
+void Sample(RegisterContext* r) {
+    CPU* cpu = GetCPULocal();
+    ProfileBuffer* profile = cpu->profileBuffer;
+
+    Thread* thread = cpu->currentThread;
+    if (!profile || !thread || thread == cpu->idleThread) {
+        return;
+    }
+
+    Process* process = thread->parent;
+    pid_t pid = __atomic_load_n(&targetPID, __ATOMIC_RELAXED);
+    if (pid >= 0 && process->PID() != pid) {
+        return;
+    }
+
+    uint64_t index = profile->head;
+    ProfileBuffer::Slot& slot = profile->slots[index & (PROFILER_SAMPLES_PER_CPU - 1)];
+
+    __atomic_store_n(&slot.seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    lemon_profile_sample_t& sample = slot.sample;
+    sample.timestamp = Timer::NanosecondsSinceBoot();
+    sample.pid = process->PID();
+    sample.tid = thread->tid;
+    sample.cpu = cpu->id;
+    sample.kernelFrames = 0;
+    sample.userFrames = 0;
+    sample.reserved = 0;
+
+    // User threads enter the kernel with their registers at the top of the kernel stack
+    RegisterContext* user = r;
+    if (!(r->cs & 3)) {
+        sample.kernelFrames = WalkKernelStack(thread, r->rip, r->rbp, sample.frames, LEMON_PROFILER_MAX_FRAMES);
+
+        user = reinterpret_cast<RegisterContext*>(thread->kernelStack) - 1;
+        if (user->cs != USER_CS || user->ss != USER_SS) {
+            user = nullptr; // Kernel thread
+        }
+    }
+
+    if (user && sample.kernelFrames < LEMON_PROFILER_MAX_FRAMES) {
+        sample.userFrames = WalkUserStack(process->GetPageMap(), user->rip, user->rbp,
+                                          sample.frames + sample.kernelFrames,
+                                          LEMON_PROFILER_MAX_FRAMES - sample.kernelFrames);
+    }
+
+    __atomic_store_n(&slot.seq, index + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&profile->head, index + 1, __ATOMIC_RELEASE);
+}
+
+// Reading another process's memory or samples is as powerful as ptrace,
+// so only allow it for root or the process's own user
+static bool CanInspectProcess(const Process* target) {
+    const Process* current = Process::Current();
+    return current->euid == 0 || current->euid == target->uid;
+}
+
+// Copy from the memory of another process through its page tables,
+// stops at the first page which is not present
+static long ReadProcessMemory(Process* process, uintptr_t address, uint8_t* buffer, size_t size) {
+    uint8_t* mapping = reinterpret_cast<uint8_t*>(Memory::KernelAllocate4KPages(1));
+    uint8_t* page = new uint8_t[PAGE_SIZE_4K];
+
+    size_t read = 0;
+    bool fault = false;
+    while (read < size) {
+        uintptr_t addr = address + read;
+
+        // Hold the region so it cannot be unmapped under us
+        MappedRegion* region = process->addressSpace->AddressToRegionReadLock(addr);
+        if (!region) {
+            break;
+        }
+
+        uintptr_t phys = UserPagePhysical(process->GetPageMap(), addr);
+        if (!phys) {
+            region->lock.ReleaseRead();
+            break;
+        }
+
+        size_t offset = addr & (PAGE_SIZE_4K - 1);
+        size_t count = PAGE_SIZE_4K - offset;
+        if (count > size - read) {
+            count = size - read;
+        }
+
+        {
+            // The mapping is only flushed from this CPU's TLB, so stay here whilst using it
+            InterruptDisabler disableInterrupts;
+            Memory::KernelMapVirtualMemory4K(phys & ~static_cast<uintptr_t>(PAGE_SIZE_4K - 1),
+                                             reinterpret_cast<uintptr_t>(mapping), 1);
+            memcpy(page, mapping + offset, count);
+        }
+        region->lock.ReleaseRead();
+
+        // The destination is in our own address space and may fault, so copy after releasing the region
+        if (UserMemcpy(buffer + read, page, count)) {
+            fault = true;
+            break;
+        }
+
+        read += count;
+    }
+
+    delete[] page;
+    Memory::KernelFree4KPages(mapping, 1);
+
+    if (fault || (!read && size)) {
+        return -EFAULT;
+    }
+
+    return read;
+}
+
+class ProfilerDevice : public Device {
+public:
+    ProfilerDevice(const char* name) : Device(name, DeviceTypeUNIXPseudo) {
+        flags = FS_NODE_CHARDEVICE;
+
+        SetDeviceName("Sampling Profiler");
+    }
+
+    // Reads whole samples, not in timestamp order across CPUs
+    ssize_t Read(size_t, size_t size, uint8_t* buffer) override {
+        if (!IsSessionOwner()) {
+            return -EPERM;
+        }
+
+        if (acquireTestLock(&m_readLock)) {
+            return -EBUSY;
+        }
+
+        size_t count = size / sizeof(lemon_profile_sample_t);
+        size_t read = 0;
+        for (unsigned i = 0; i < SMP::processorCount && read < count; i++) {
+            ProfileBuffer* profile = SMP::cpus[i]->profileBuffer;
+            if (!profile) {
+                continue;
+            }
+
+            while (read < count) {
+                uint64_t head = __atomic_load_n(&profile->head, __ATOMIC_ACQUIRE);
+                if (profile->tail == head) {
+                    break;
+                }
+
+                if (head - profile->tail > PROFILER_SAMPLES_PER_CPU) {
+                    profile->lost += head - PROFILER_SAMPLES_PER_CPU - profile->tail;
+                    profile->tail = head - PROFILER_SAMPLES_PER_CPU;
+                }
+
+                ProfileBuffer::Slot& slot = profile->slots[profile->tail & (PROFILER_SAMPLES_PER_CPU - 1)];
+                uint64_t seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+                lemon_profile_sample_t sample = slot.sample;
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+                if (seq != profile->tail + 1 || __atomic_load_n(&slot.seq, __ATOMIC_RELAXED) != seq) {
+                    profile->lost++;
+                    profile->tail++;
+                    continue;
+                }
+
+                memcpy(buffer + read * sizeof(lemon_profile_sample_t), &sample, sizeof(lemon_profile_sample_t));
+                read++;
+                profile->tail++;
+            }
+        }
+
+        releaseLock(&m_readLock);
+        return read * sizeof(lemon_profile_sample_t);
+    }
+
+    int Ioctl(uint64_t cmd, uint64_t arg) override {
+        switch (cmd) {
+        case IoCtlProfilerStart: {
+            lemon_profiler_config_t config;
+            UserPointer<lemon_profiler_config_t> configPtr = arg;
+            if (configPtr.GetValue(config)) {
+                return -EFAULT;
+            }
+
+            if (config.frequency > LEMON_PROFILER_MAX_FREQUENCY) {
+                return -EINVAL;
+            } else if (!config.frequency) {
+                config.frequency = LEMON_PROFILER_DEFAULT_FREQUENCY;
+            }
+
+            if (__atomic_load_n(&enabled, __ATOMIC_ACQUIRE) && !IsSessionOwner()) {
+                return -EPERM; // Another user's session is running
+            }
+
+            if (config.pid < 0) {
+                if (Process::Current()->euid != 0) {
+                    return -EPERM; // Samples from every process include other users' stacks
+                }
+            } else {
+                FancyRefPtr<Process> target = Scheduler::FindProcessByPID(config.pid);
+                if (!target.get()) {
+                    return -ESRCH;
+                } else if (!CanInspectProcess(target.get())) {
+                    return -EPERM;
+                }
+            }
+
+            if (acquireTestLock(&m_readLock)) {
+                return -EBUSY;
+            }
+
+            for (unsigned i = 0; i < SMP::processorCount; i++) {
+                if (ProfileBuffer* profile = SMP::cpus[i]->profileBuffer; profile) {
+                    profile->tail = __atomic_load_n(&profile->head, __ATOMIC_ACQUIRE);
+                    profile->lost = 0;
+                } else {
+                    __atomic_store_n(&SMP::cpus[i]->profileBuffer, new ProfileBuffer(), __ATOMIC_RELEASE);
+                }
+            }
+
+            releaseLock(&m_readLock);
+
+            // Starting drops whatever the last session left unread, so its samples never reach the new owner
+            m_owner = Process::Current()->euid;
+            m_frequency = config.frequency;
+            __atomic_store_n(&targetPID, config.pid, __ATOMIC_RELAXED);
+            __atomic_store_n(&samplePeriodNs, 1000000000 / config.frequency, __ATOMIC_RELAXED);
+
+            // Each CPU starts sampling the next time its timer is programmed
+            __atomic_store_n(&enabled, true, __ATOMIC_RELEASE);
+            return 0;
+        }
+        case IoCtlProfilerStop:
+            if (!IsSessionOwner()) {
+                return -EPERM;
+            }
+
+            __atomic_store_n(&enabled, false, __ATOMIC_RELEASE);
+            return 0;
+        case IoCtlProfilerGetInfo: {
+            lemon_profiler_info_t info = {
+                .cpuCount = SMP::processorCount,
+                .samplesPerCPU = PROFILER_SAMPLES_PER_CPU,
+                .enabled = __atomic_load_n(&enabled, __ATOMIC_ACQUIRE),
+                .frequency = m_frequency,
+                .pid = targetPID,
+                .reserved = 0,
+                .pending = 0,
+                .lost = 0,
+            };
+
+            for (unsigned i = 0; i < SMP::processorCount; i++) {
+                if (ProfileBuffer* profile = SMP::cpus[i]->profileBuffer; profile) {
+                    uint64_t pending = __atomic_load_n(&profile->head, __ATOMIC_ACQUIRE) - profile->tail;
+                    if (pending > PROFILER_SAMPLES_PER_CPU) {
+                        info.lost += pending - PROFILER_SAMPLES_PER_CPU;
+                        pending = PROFILER_SAMPLES_PER_CPU;
+                    }
+
+                    info.pending += pending;
+                    info.lost += profile->lost;
+                }
+            }
+
+            UserPointer<lemon_profiler_info_t> infoPtr = arg;
+            if (infoPtr.StoreValue(info)) {
+                return -EFAULT;
+            }
+            return 0;
+        }
+        case IoCtlProfilerGetExecutable:
+        case IoCtlProfilerReadMemory: {
+            lemon_profiler_read_t req;
+            UserPointer<lemon_profiler_read_t> reqPtr = arg;
+            if (reqPtr.GetValue(req)) {
+                return -EFAULT;
+            }
+
+            FancyRefPtr<Process> process = Scheduler::FindProcessByPID(req.pid);
+            if (!process.get()) {
+                return -ESRCH;
+            } else if (!CanInspectProcess(process.get())) {
+                return -EPERM;
+            }
+
+            UserBuffer<uint8_t> buffer = reinterpret_cast<uintptr_t>(req.buffer);
+            if (cmd == IoCtlProfilerGetExecutable) {
+                size_t length = strlen(process->executablePath) + 1;
+                if (length > req.size) {
+                    return -ENAMETOOLONG;
+                }
+
+                if (buffer.Write(reinterpret_cast<uint8_t*>(process->executablePath), 0, length)) {
+                    return -EFAULT;
+                }
+                return 0;
+            }
+
+            if (req.size > PROFILER_MAX_READ) {
+                return -EINVAL;
+            } else if (!IsUsermodePointer(buffer.Pointer(), 0, req.size) || process->IsDead()) {
+                return -EFAULT;
+            }
+
+            return ReadProcessMemory(process.get(), req.address, buffer.Pointer(), req.size);
+        }
+        default:
+            return -EINVAL;
+        }
+    }
+
+private:
+    // Only root and whoever started the session may stop it or read its samples
+    bool IsSessionOwner() const {
+        uid_t euid = Process::Current()->euid;
+        return euid == 0 || euid == m_owner;
+    }
+
+    lock_t m_readLock = 0;
+    uint32_t m_frequency = LEMON_PROFILER_DEFAULT_FREQUENCY;
+    uid_t m_owner = 0; // Effective UID which started the session, root until one has been started
+};
+
+ProfilerDevice* profilerDevice = nullptr;
+
+void Initialize() { profilerDevice = new ProfilerDevice("profiler"); }
+
+} // namespace Profiler
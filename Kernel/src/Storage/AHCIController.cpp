@@ -19,8 +19,23 @@ Port* ports[32];
 PCIDevice* controllerPCIDevice;
 uint8_t ahciClassCode = PCI_CLASS_STORAGE;
 uint8_t ahciSubclass = PCI_SUBCLASS_SATA;
+uint8_t irq = 0xFF;
 
-void InterruptHandler(void*, RegisterContext* r) {}
+void InterruptHandler(void*, RegisterContext* r) {
+    uint32_t pending = ahciHBA->is;
+
+    for (uint32_t ports = pending; ports; ports &= ports - 1) {
+        int i = __builtin_ctz(ports);
+        if (AHCI::ports[i]) {
+            AHCI::ports[i]->ProcessCompletions();
+        } else {
+            ahciHBA->ports[i].is = ahciHBA->ports[i].is;
+        }
+    }
+
+    // Port interrupt status has to be cleared first
+    ahciHBA->is = pending;
+}
 
 int Init() {
     if (!PCI::FindGenericDevice(ahciClassCode, ahciSubclass)) {
@@ -42,11 +57,12 @@ int Init() {
 
     ahciHBA = (hba_mem_t*)ahciVirtualAddress;
 
-    /*uint8_t irq = controllerPCIDevice->AllocateVector(PCIVectors::PCIVectorAny);
+    irq = controllerPCIDevice->AllocateVector(PCIVectors::PCIVectorAny);
     if (irq == 0xFF) {
-        Log::Warning("[AHCI] Failed to allocate vector!");
+        Log::Warning("[AHCI] Failed to allocate vector, polling for completions");
+    } else {
+        IDT::RegisterInterruptHandler(irq, InterruptHandler);
     }
-    //IDT::RegisterInterruptHandler(irq, InterruptHandler);*/
 
     uint32_t pi = ahciHBA->pi;
 
@@ -57,7 +73,7 @@ int Init() {
     ahciHBA->ghc &= ~AHCI_GHC_IE;
 
     if (debugLevelAHCI >= DebugLevelNormal) {
-        Log::Info("[AHCI] Interrupt Vector: %x, Base Address: %x, Virtual Base Address: %x", -1, ahciBaseAddress,
+        Log::Info("[AHCI] Interrupt Vector: %x, Base Address: %x, Virtual Base Address: %x", irq, ahciBaseAddress,
                   ahciVirtualAddress);
         Log::Info("[AHCI] (Cap: %x, Cap2: %x) Enabled? %Y, BOHC? %Y, 64-bit addressing? %Y, Staggered Spin-up? %Y, "
                   "Slumber State Capable? %Y, Partial State Capable? %Y, FIS-based switching? %Y",
@@ -90,11 +106,18 @@ int Init() {
                 if (ports[i]->status != AHCIStatus::Active) {
                     delete ports[i];
                     ports[i] = nullptr;
+                } else if (irq != 0xFF) {
+                    ports[i]->EnableInterrupts();
                 }
             }
         }
     }
 
+    if (irq != 0xFF) {
+        ahciHBA->is = 0xffffffff;
+        ahciHBA->ghc |= AHCI_GHC_IE;
+    }
+
     return 0;
 }
 } // namespace AHCI
\ No newline at end of file
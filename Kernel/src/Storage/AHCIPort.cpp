@@ -2,6 +2,7 @@
 
 #include <Errno.h>
 #include <Logging.h>
+#include <Math.h>
 #include <Paging.h>
 #include <PhysicalAllocator.h>
 #include <Scheduler.h>
@@ -11,8 +12,6 @@
 
 #include <Debug.h>
 
-#define HBA_PxIS_TFES (1 << 30)
-
 namespace AHCI {
 Port::Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem) {
     registers = portStructure;
@@ -51,8 +50,9 @@ Port::Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem) {
     fis->rfis.fis_type = FIS_TYPE_REG_D2H;
     fis->sdbfis[0] = FIS_TYPE_DEV_BITS;
 
-    for (int i = 0; i < 8 /*Support for 8 command slots*/; i++) {
+    for (int i = 0; i < AHCI_MAX_COMMAND_SLOTS; i++) {
         commandList[i].prdtl = 1;
+        requests[i] = nullptr;
 
         phys = Memory::AllocatePhysicalMemoryBlock();
         commandList[i].ctba = (uint32_t)(phys & 0xFFFFFFFF);
@@ -68,8 +68,8 @@ Port::Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem) {
         registers->cmd &= ~HBA_PxCMD_ASP; // Disable aggressive slumber and partial
     }
 
-    registers->is = 0; // Clear interrupts
-    registers->ie = 1;
+    registers->is = 0xffffffff; // Clear interrupts
+    registers->ie = HBA_PxIE_DEFAULT;
     registers->fbs &= ~(0xFFFFF000U);
 
     registers->cmd |= HBA_PxCMD_POD;
@@ -151,6 +151,24 @@ Port::Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem) {
 
     Identify();
 
+    // Only queue commands when both the HBA and the drive support it
+    if (ncq && (hbaMem->cap & AHCI_CAP_NCQ)) {
+        slotCount = MIN(slotCount, AHCI_CAP_NCS(hbaMem->cap));
+    } else {
+        ncq = false;
+        slotCount = 1;
+    }
+    freeSlots = (slotCount == 32) ? 0xFFFFFFFFU : ((1U << slotCount) - 1);
+
+    // The command engine keeps running, commands are issued by setting their slot in PxCI
+    registers->serr = registers->serr;
+    registers->is = 0xffffffff;
+    StartCMD(registers);
+
+    if (debugLevelAHCI >= DebugLevelNormal) {
+        Log::Info("[AHCI] Port %d: NCQ? %Y, %u command slots", num, ncq, slotCount);
+    }
+
     if (debugLevelAHCI >= DebugLevelNormal) {
         Log::Info("[AHCI] Port - SSTS: %x, SCTL: %x, SERR: %x, SACT: %x, Cmd/Status: %x, FBS: %x, IE: %x",
                   registers->ssts, registers->sctl, registers->serr, registers->sact, registers->cmd, registers->fbs,
@@ -169,7 +187,6 @@ Port::Port(int num, hba_port_t* portStructure, hba_mem_t* hbaMem) {
 
     InitializePartitions();
 
-    portLock.SetValue(1);
     bufferSemaphore.SetValue(8);
 }
 
@@ -196,253 +213,312 @@ void Port::ReleaseBuffer(int index) {
     bufferSemaphore.Signal();
 }
 
-int Port::ReadDiskBlock(uint64_t lba, uint32_t count, void* _buffer) {
-    uint64_t blockCount = ((count + (blocksize - 1)) / blocksize);
-    uint8_t* buffer = reinterpret_cast<uint8_t*>(_buffer);
+void AHCIRequest::Reset() {
+    waiter = Thread::Current();
+    thread = nullptr;
+    shouldBlock = true;
+    removed = false;
+    interrupted = false;
+    complete = false;
+}
 
-    // Log::Info("LBA: %x, count: %u, blcount: %u", lba, count, blockCount);
+void AHCIRequest::Complete(int s) {
+    status = s;
+    __atomic_store_n(&shouldBlock, false, __ATOMIC_SEQ_CST);
 
-    int buf = AcquireBuffer();
-    if (buf == -EINTR) {
-        return EINTR;
+    // If we interrupted the waiting thread whilst it holds the blocker lock,
+    // it has not checked shouldBlock yet so it will not block
+    while (acquireTestLock(&lock)) {
+        if (waiter == Thread::Current()) {
+            __atomic_store_n(&complete, true, __ATOMIC_RELEASE);
+            return;
+        }
     }
-    if (buf >= 8 || buf < 0) {
-        return 4; // Should not happen
+
+    removed = true;
+    if (thread) {
+        thread->Unblock();
     }
+    releaseLock(&lock);
+
+    // The waiter may destroy the request as soon as it sees it is complete
+    __atomic_store_n(&complete, true, __ATOMIC_RELEASE);
+}
 
-    while (blockCount >= 8 && count) {
-        int size = 512 * 8;
-        if (size > count)
-            size = count;
+int Port::ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer) {
+    return Transfer(false, lba, count, reinterpret_cast<uint8_t*>(buffer));
+}
 
-        if (!size)
-            break;
+int Port::WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer) {
+    return Transfer(true, lba, count, reinterpret_cast<uint8_t*>(buffer));
+}
 
-        if (int e = Access(lba, 8, physBuffers[buf], 0); e) { // LBA, 8 blocks, read
-            return e;                                         // Error Reading Sectors
+int Port::Transfer(bool write, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    uint32_t wholeBlocks = count & ~(blocksize - 1);
+    if (wholeBlocks && reinterpret_cast<uintptr_t>(buffer) >= KERNEL_HEAP_VIRTUAL_BASE &&
+        !(reinterpret_cast<uintptr_t>(buffer) & 0x1)) {
+        // The HBA can access the kernel heap (including page cache mappings) directly
+        if (int e = TransferDirect(write, lba, wholeBlocks, buffer); e) {
+            return e;
         }
+    } else if (wholeBlocks) {
+        // Go through a temporary buffer on the kernel heap so large transfers still use large commands
+        uint32_t bounceSize = MIN(wholeBlocks, AHCI_BOUNCE_BUFFER_SIZE);
+        uint8_t* bounce = reinterpret_cast<uint8_t*>(kmalloc(bounceSize));
+
+        for (uint32_t offset = 0; offset < wholeBlocks; offset += bounceSize) {
+            uint32_t size = MIN(bounceSize, wholeBlocks - offset);
+            if (write) {
+                memcpy(bounce, buffer + offset, size);
+            }
+
+            if (int e = TransferDirect(write, lba + offset / blocksize, size, bounce); e) {
+                kfree(bounce);
+                return e;
+            }
 
-        memcpy(buffer, buffers[buf], size);
+            if (!write) {
+                memcpy(buffer + offset, bounce, size);
+            }
+        }
 
-        buffer += size;
-        lba += 8;
-        blockCount -= 8;
-        count -= size;
+        kfree(bounce);
     }
 
-    while (blockCount >= 2 && count) {
-        int size = 512 << 1;
-        if (size > count)
-            size = count;
-
-        if (!size)
-            break;
+    if (count > wholeBlocks) {
+        // Partial last block
+        return TransferBuffered(write, lba + wholeBlocks / blocksize, count - wholeBlocks, buffer + wholeBlocks);
+    }
 
-        if (int e = Access(lba, 2, physBuffers[buf], 0); e) { // LBA, 2 blocks, read
-            ReleaseBuffer(buf);
-            return e; // Error Reading Sectors
-        }
+    return 0;
+}
 
-        memcpy(buffer, buffers[buf], size);
+int Port::TransferDirect(bool write, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    assert(!(count & (blocksize - 1)));
 
-        buffer += size;
-        lba += 2;
-        blockCount -= 2;
-        count -= size;
-    }
+    // Split into commands of at most AHCI_MAX_TRANSFER_SIZE and keep several of them in flight
+    const unsigned maxInFlight = 8;
+    AHCIRequest requests[maxInFlight];
 
-    while (blockCount && count) {
-        int size = 512;
-        if (size > count)
-            size = count;
+    int error = 0;
+    unsigned submitted = 0;
+    unsigned completed = 0;
 
-        if (!size)
-            break;
+    uint32_t offset = 0;
+    while (offset < count || completed < submitted) {
+        // Wait for the oldest command once we run out of requests or commands to submit
+        if (submitted - completed >= maxInFlight || offset >= count) {
+            AHCIRequest& req = requests[completed++ % maxInFlight];
+            Wait(req);
 
-        if (int e = Access(lba, 1, physBuffers[buf], 0); e) { // LBA, 1 block, read
-            ReleaseBuffer(buf);
-            return e; // Error Reading Sectors
+            if (req.status && !error) {
+                error = req.status;
+            }
+            continue;
         }
 
-        memcpy(buffer, buffers[buf], size);
-
-        buffer += size;
-        lba++;
-        blockCount--;
-        count -= size;
+        uint32_t size = MIN(count - offset, AHCI_MAX_TRANSFER_SIZE);
+        Submit(requests[submitted++ % maxInFlight], write, lba + offset / blocksize, size, buffer + offset);
+        offset += size;
     }
-    ReleaseBuffer(buf);
-    return 0;
+
+    return error;
 }
 
-int Port::WriteDiskBlock(uint64_t lba, uint32_t count, void* _buffer) {
-    uint64_t blockCount = ((count + (blocksize - 1)) / blocksize);
-    uint8_t* buffer = reinterpret_cast<uint8_t*>(_buffer);
+int Port::TransferBuffered(bool write, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    assert(count < static_cast<uint32_t>(blocksize));
 
-    unsigned buf = AcquireBuffer();
-    if (buf >= 8) {
+    int buf = AcquireBuffer();
+    if (buf == -EINTR) {
+        return EINTR;
+    }
+    if (buf >= 8 || buf < 0) {
         return 4; // Should not happen
     }
 
-    while (blockCount-- && count) {
-        uint64_t size;
-        if (count < 512)
-            size = count;
-        else
-            size = 512;
-
-        if (!size)
-            break;
-
-        memcpy(buffers[buf], buffer, size);
+    if (write) {
+        // Read modify write so the rest of the block is left untouched
+        AHCIRequest req;
+        Submit(req, false, lba, blocksize, reinterpret_cast<uint8_t*>(buffers[buf]));
+        Wait(req);
 
-        if (int e = Access(lba, 1, physBuffers[buf], 1); e) { // LBA, 1 block, write
+        if (req.status) {
             ReleaseBuffer(buf);
-            return e; // Error Reading Sectors
+            return req.status;
         }
 
-        buffer += size;
-        lba++;
+        memcpy(buffers[buf], buffer, count);
     }
+
+    AHCIRequest req;
+    Submit(req, write, lba, blocksize, reinterpret_cast<uint8_t*>(buffers[buf]));
+    Wait(req);
+
+    if (!req.status && !write) {
+        memcpy(buffer, buffers[buf], count);
+    }
+
     ReleaseBuffer(buf);
+    return req.status;
+}
 
-    return 0;
+int Port::AllocateSlot() {
+    uint32_t slots = __atomic_load_n(&freeSlots, __ATOMIC_RELAXED);
+    while (slots) {
+        int slot = __builtin_ctz(slots);
+        if (__atomic_compare_exchange_n(&freeSlots, &slots, slots & ~(1U << slot), false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            return slot;
+        }
+    }
+
+    return -1;
 }
 
-int Port::Access(uint64_t lba, uint32_t count, uintptr_t physBuffer, int write) {
-    assert(CheckInterrupts());
+void Port::Submit(AHCIRequest& req, bool write, uint64_t lba, uint32_t size, uint8_t* buffer) {
+    assert(size && size <= AHCI_MAX_TRANSFER_SIZE && !(size & (blocksize - 1)));
+    assert(reinterpret_cast<uintptr_t>(buffer) >= KERNEL_HEAP_VIRTUAL_BASE);
 
-    if (portLock.Wait()) {
-        return -EINTR;
+    int slot;
+    while ((slot = AllocateSlot()) < 0) {
+        Scheduler::Yield(); // Every slot is in use, wait for commands to complete
     }
 
-    registers->ie = 0xffffffff;
-    registers->is = 0;
-    int spin = 0;
+    req.Reset();
 
-    int slot = FindCmdSlot();
-    if (slot == -1) {
-        Log::Warning("[SATA] Could not find command slot!");
+    hba_cmd_tbl_t* commandTable = commandTables[slot];
+    memset(commandTable, 0, sizeof(hba_cmd_tbl_t));
 
-        portLock.Signal();
-        return -EIO;
-    }
+    // Merge physically contiguous pages into a single region
+    unsigned prdCount = 0;
+    uintptr_t virt = reinterpret_cast<uintptr_t>(buffer);
+    uintptr_t end = virt + size;
+    while (virt < end) {
+        uint32_t length = MIN(PAGE_SIZE_4K - (virt & (PAGE_SIZE_4K - 1)), end - virt);
+        uintptr_t phys = Memory::VirtualToPhysicalAddress(virt) + (virt & (PAGE_SIZE_4K - 1));
+
+        virt += length;
+
+        if (prdCount) {
+            hba_prdt_entry_t* last = &commandTable->prdt_entry[prdCount - 1];
+            uintptr_t lastEnd = ((static_cast<uintptr_t>(last->dbau) << 32) | last->dba) + last->dbc + 1;
+            if (lastEnd == phys && last->dbc + 1 + length <= AHCI_PRD_MAX_BYTES) {
+                last->dbc += length;
+                continue;
+            }
+        }
 
-    registers->serr = registers->tfd = 0;
+        assert(prdCount < AHCI_MAX_PRDT_ENTRIES);
 
-    hba_cmd_header_t* commandHeader = &commandList[slot];
+        hba_prdt_entry_t* prd = &commandTable->prdt_entry[prdCount++];
+        prd->dba = phys & 0xFFFFFFFF;
+        prd->dbau = (phys >> 32) & 0xFFFFFFFF;
+        prd->dbc = length - 1; // 0's based, always odd as the length is even
+    }
 
+    hba_cmd_header_t* commandHeader = &commandList[slot];
     commandHeader->cfl = sizeof(fis_reg_h2d_t) / sizeof(uint32_t);
-
     commandHeader->a = 0;
     commandHeader->w = write;
     commandHeader->c = 0;
     commandHeader->p = 0;
-
+    commandHeader->prdtl = prdCount;
     commandHeader->prdbc = 0;
     commandHeader->pmp = 0;
 
-    hba_cmd_tbl_t* commandTable = commandTables[slot];
-    memset(commandTable, 0, sizeof(hba_cmd_tbl_t));
-
-    commandTable->prdt_entry[0].dba = physBuffer & 0xFFFFFFFF;
-    commandTable->prdt_entry[0].dbau = (physBuffer >> 32) & 0xFFFFFFFF;
-    commandTable->prdt_entry[0].dbc = 512 * count - 1; // 512 bytes per sector
-    commandTable->prdt_entry[0].i = 1;
-
     fis_reg_h2d_t* cmdfis = (fis_reg_h2d_t*)(commandTable->cfis);
-    memset(commandTable->cfis, 0, sizeof(fis_reg_h2d_t));
-
     cmdfis->fis_type = FIS_TYPE_REG_H2D;
     cmdfis->c = 1;      // Command
     cmdfis->pmport = 0; // Port multiplier
 
-    if (write) {
-        cmdfis->command = ATA_CMD_WRITE_DMA_EX;
+    uint32_t blockCount = size / blocksize;
+    if (ncq) {
+        cmdfis->command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+
+        // The block count goes in the feature register and the tag in the count register
+        cmdfis->featurel = blockCount & 0xff;
+        cmdfis->featureh = (blockCount >> 8) & 0xff;
+        cmdfis->countl = slot << 3;
     } else {
-        cmdfis->command = ATA_CMD_READ_DMA_EX;
+        cmdfis->command = write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX;
+
+        cmdfis->countl = blockCount & 0xff;
+        cmdfis->counth = (blockCount >> 8) & 0xff;
     }
 
     cmdfis->lba0 = lba & 0xFF;
     cmdfis->lba1 = (lba >> 8) & 0xFF;
     cmdfis->lba2 = (lba >> 16) & 0xFF;
-    cmdfis->device = 1 << 6;
+    cmdfis->device = 1 << 6; // LBA mode
 
     cmdfis->lba3 = (lba >> 24) & 0xFF;
     cmdfis->lba4 = (lba >> 32) & 0xFF;
     cmdfis->lba5 = (lba >> 40) & 0xFF;
 
-    cmdfis->countl = count & 0xff;
-    cmdfis->counth = count >> 8;
-
-    cmdfis->control = 0x8;
-
-    spin = Timer::UsecondsSinceBoot() + 100000;
-    while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin) {
-        if (Timer::UsecondsSinceBoot() >= spin) {
-            spin = 0;
-        }
+    ScopedSpinLock<true> lockSlots(slotLock);
+    requests[slot] = &req;
+    issuedSlots |= 1U << slot;
 
-        Scheduler::Yield();
+    // PxSACT and PxCI are write 1 to set
+    if (ncq) {
+        registers->sact = 1U << slot;
     }
+    registers->ci = 1U << slot;
+}
 
-    if (spin <= 0) {
-        Log::Warning("[SATA] Port Hung");
-
-        portLock.Signal();
-        return -EIO;
+void Port::Wait(AHCIRequest& req) {
+    while (!req.IsComplete()) {
+        if (polling) {
+            ProcessCompletions(); // No interrupts so poll
+            if (!req.IsComplete()) {
+                Scheduler::Yield();
+            }
+        } else if (Thread::Current()->Block(&req)) {
+            Scheduler::Yield(); // Interrupted, but the HBA may still be writing to the buffer
+        }
     }
+}
 
-    registers->ie = registers->is = 0xffffffff;
+void Port::ProcessCompletions() {
+    ScopedSpinLock<true> lockSlots(slotLock);
 
-    StartCMD(registers);
-    registers->ci |= 1 << slot;
+    uint32_t interruptStatus = registers->is;
+    registers->is = interruptStatus; // Write 1 to clear
 
-    // Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot,
-    // registers->cmd, registers->is, registers->ci, registers->tfd);
+    // A slot is done once the HBA has cleared it from both PxCI and PxSACT
+    uint32_t completed = issuedSlots & ~(registers->sact | registers->ci);
+    uint32_t failed = 0;
 
-    spin = Timer::UsecondsSinceBoot() + 200000;
-    while ((registers->ci & (1 << slot)) && Timer::UsecondsSinceBoot() < spin) {
-        if (registers->is & HBA_PxIS_TFES) // Task file error
-        {
-            Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
+    if (interruptStatus & HBA_PxIS_ERROR) {
+        Log::Warning("[SATA] Disk Error (IS: %x, SERR: %x, TFD: %x)", interruptStatus, registers->serr,
+                     registers->tfd);
 
-            StopCMD(registers);
-            portLock.Signal();
-            return -EIO;
-        }
-    }
+        // The HBA stops processing commands on an error and it does not say which queued command failed,
+        // so fail everything still outstanding and restart the command engine
+        failed = issuedSlots & ~completed;
 
-    spin = Timer::UsecondsSinceBoot() + 100000;
-    while ((registers->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin) {
-        if (Timer::UsecondsSinceBoot() >= spin) {
-            spin = 0;
-        }
-
-        Scheduler::Yield();
+        StopCMD(registers);
+        registers->serr = registers->serr;
+        registers->is = 0xffffffff;
+        StartCMD(registers);
     }
 
-    StopCMD(registers);
+    issuedSlots &= ~(completed | failed);
 
-    if (spin <= 0) {
-        Log::Warning("[SATA] Port Hung");
+    while (completed | failed) {
+        int slot = __builtin_ctz(completed | failed);
+        uint32_t bit = 1U << slot;
 
-        portLock.Signal();
-        return -EIO;
-    }
+        AHCIRequest* req = requests[slot];
+        requests[slot] = nullptr;
+        __atomic_or_fetch(&freeSlots, bit, __ATOMIC_RELEASE);
 
-    // Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot,
-    // registers->cmd, registers->is, registers->ci, registers->tfd);
+        assert(req);
+        req->Complete((failed & bit) ? -EIO : 0);
 
-    if (registers->is & HBA_PxIS_TFES) {
-        Log::Warning("[SATA] Disk Error (SERR: %x)", registers->serr);
-
-        portLock.Signal();
-        return -EIO;
+        completed &= ~bit;
+        failed &= ~bit;
     }
-
-    portLock.Signal();
-    return 0;
 }
 
 void Port::Identify() {
@@ -514,7 +590,6 @@ void Port::Identify() {
     registers->ie = registers->is = 0xffffffff;
 
     StartCMD(registers);
-    registers->sact |= 1 << slot;
     registers->ci |= 1 << slot;
 
     // Log::Info("SERR: %x, Slot: %x, PxCMD: %x, Int status: %x, Ci: %x, TFD: %x", registers->serr, slot,
@@ -544,7 +619,13 @@ void Port::Identify() {
         StopCMD(registers);
         return;
     }
-    return;
+
+    const uint16_t* identity = reinterpret_cast<uint16_t*>(buffers[0]);
+    if (identity[ATA_IDENTIFY_SATA_CAPABILITIES] != 0xFFFF &&
+        (identity[ATA_IDENTIFY_SATA_CAPABILITIES] & ATA_SATA_CAP_NCQ)) {
+        ncq = true;
+        slotCount = (identity[ATA_IDENTIFY_QUEUE_DEPTH] & 0x1f) + 1;
+    }
 }
 
 int Port::FindCmdSlot() {
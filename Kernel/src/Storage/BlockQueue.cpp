@@ -0,0 +1,293 @@
+#include <Storage/BlockQueue.h>
+
+#include <Assert.h>
+#include <CString.h>
+#include <Device.h>
+#include <Errno.h>
+#include <Math.h>
+#include <Scheduler.h>
+#include <Timer.h>
+#include <Trace.h>
+
+void BlockRequest::Reset() {
+    waiter = Thread::Current();
+    thread = nullptr;
+    shouldBlock = true;
+    removed = false;
+    interrupted = false;
+    complete = false;
+
+    status = 0;
+    nextMerged = nullptr;
+}
+
+void BlockRequest::Complete(int s) {
+    TRACE_EVENT(TraceEventBlockComplete, reinterpret_cast<uintptr_t>(this), lba, s);
+
+    status = s;
+    __atomic_store_n(&shouldBlock, false, __ATOMIC_SEQ_CST);
+
+    // The waiter may be holding the blocker lock whilst it checks shouldBlock
+    while (acquireTestLock(&lock)) {
+        if (waiter == Thread::Current()) {
+            __atomic_store_n(&complete, true, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+
+    removed = true;
+    if (thread) {
+        thread->Unblock();
+    }
+    releaseLock(&lock);
+
+    // The waiter may destroy the request as soon as it sees it is complete
+    __atomic_store_n(&complete, true, __ATOMIC_RELEASE);
+}
+
+BlockQueue::BlockQueue(DiskDevice* disk) : m_disk(disk) { ResetStats(); }
+
+bool BlockQueue::Mergeable(const BlockRequest* request) const {
+    return !(request->size % m_disk->blocksize);
+}
+
+void BlockQueue::Submit(BlockRequest** requests, unsigned count) {
+    {
+        ScopedSpinLock lockQueue(m_lock);
+        for (unsigned i = 0; i < count; i++) {
+            TRACE_EVENT(TraceEventBlockSubmit, reinterpret_cast<uintptr_t>(requests[i]), requests[i]->lba,
+                        requests[i]->size | (requests[i]->write ? LEMON_TRACE_BLOCK_WRITE : 0));
+            Enqueue(requests[i]);
+        }
+    }
+
+    Run();
+}
+
+void BlockQueue::Wait(BlockRequest& request) {
+    assert(!request.callback);
+
+    while (!request.IsComplete()) {
+        if (Thread::Current()->Block(&request)) {
+            Scheduler::Yield(); // Interrupted, but the driver may still be using the buffer
+        }
+    }
+}
+
+int BlockQueue::Transfer(bool write, uint64_t lba, uint32_t size, uint8_t* buffer) {
+    BlockRequest request(write, lba, size, buffer);
+
+    Submit(request);
+    Wait(request);
+
+    return request.status;
+}
+
+void BlockQueue::Enqueue(BlockRequest* request) {
+    uint64_t now = Timer::UsecondsSinceBoot();
+
+    request->Reset();
+    request->submitTime = now;
+    m_stats.requests++;
+
+    uint32_t blocksize = m_disk->blocksize;
+    uint64_t blockCount = (request->size + blocksize - 1) / blocksize;
+
+    Command* insertBefore = nullptr;
+    for (Command* c = m_pending.get_front(); c; c = m_pending.next(c)) {
+        if (c->write == request->write && Mergeable(request) && !(c->size % blocksize) &&
+            c->size + request->size <= BLOCK_QUEUE_MAX_MERGE_SIZE) {
+            if (c->lba + c->size / blocksize == request->lba) {
+                c->last->nextMerged = request;
+                c->last = request;
+                c->size += request->size;
+                c->count++;
+
+                m_stats.merges++;
+                return;
+            } else if (request->lba + blockCount == c->lba) {
+                request->nextMerged = c->first;
+                c->first = request;
+                c->lba = request->lba;
+                c->size += request->size;
+                c->count++;
+
+                m_stats.merges++;
+                return;
+            }
+        }
+
+        if (!insertBefore && c->lba > request->lba) {
+            insertBefore = c;
+        }
+    }
+
+    Command* command = new Command;
+    command->write = request->write;
+    command->lba = request->lba;
+    command->size = request->size;
+    command->deadline = now + (request->write ? BLOCK_QUEUE_WRITE_DEADLINE : BLOCK_QUEUE_READ_DEADLINE);
+    command->first = command->last = request;
+    command->count = 1;
+
+    if (insertBefore) {
+        m_pending.insert(command, insertBefore);
+    } else {
+        m_pending.add_back(command);
+    }
+}
+
+BlockQueue::Command* BlockQueue::NextCommand() {
+    uint64_t now = Timer::UsecondsSinceBoot();
+
+    Command* expired = nullptr;
+    Command* next = nullptr;
+    for (Command* c = m_pending.get_front(); c; c = m_pending.next(c)) {
+        if (c->deadline <= now && (!expired || c->deadline < expired->deadline)) {
+            expired = c;
+        }
+
+        if (!next && c->lba >= m_head) {
+            next = c;
+        }
+    }
+
+    if (expired) {
+        if (expired != next) {
+            m_stats.expired++;
+        }
+        return expired;
+    }
+
+    // Wrap around to the lowest block once we reach the end
+    return next ? next : m_pending.get_front();
+}
+
+void BlockQueue::Run() {
+    for (;;) {
+        Command* command;
+        {
+            ScopedSpinLock lockQueue(m_lock);
+            if (!m_pending.get_length() || m_inFlight >= m_depth) {
+                return; // Whoever has a command in flight picks up the rest once it is done
+            }
+
+            command = NextCommand();
+            m_pending.remove(command);
+
+            m_head = command->lba + (command->size + m_disk->blocksize - 1) / m_disk->blocksize;
+            m_inFlight++;
+            m_stats.dispatched++;
+        }
+
+        Dispatch(command);
+
+        ScopedSpinLock lockQueue(m_lock);
+        m_inFlight--;
+    }
+}
+
+void BlockQueue::Dispatch(Command* command) {
+    uint8_t* buffer = command->first->buffer;
+
+    // Merged requests usually read into one buffer, otherwise go through a temporary one
+    bool bounce = false;
+    for (BlockRequest* r = command->first; r->nextMerged; r = r->nextMerged) {
+        if (r->buffer + r->size != r->nextMerged->buffer) {
+            bounce = true;
+            break;
+        }
+    }
+
+    if (bounce) {
+        buffer = reinterpret_cast<uint8_t*>(kmalloc(command->size));
+
+        if (command->write) {
+            uint32_t offset = 0;
+            for (BlockRequest* r = command->first; r; r = r->nextMerged) {
+                memcpy(buffer + offset, r->buffer, r->size);
+                offset += r->size;
+            }
+        }
+    }
+
+    int e;
+    if (command->write) {
+        e = m_disk->WriteDiskBlock(command->lba, command->size, buffer);
+    } else {
+        e = m_disk->ReadDiskBlock(command->lba, command->size, buffer);
+    }
+
+    int status = e ? ((e < 0) ? e : -EIO) : 0;
+
+    if (bounce) {
+        if (!command->write && !status) {
+            uint32_t offset = 0;
+            for (BlockRequest* r = command->first; r; r = r->nextMerged) {
+                memcpy(r->buffer, buffer + offset, r->size);
+                offset += r->size;
+            }
+        }
+
+        kfree(buffer);
+    }
+
+    uint64_t now = Timer::UsecondsSinceBoot();
+    {
+        ScopedSpinLock lockQueue(m_lock);
+        if (bounce) {
+            m_stats.bounced++;
+        }
+
+        if (status) {
+            m_stats.errors++;
+        } else if (command->write) {
+            m_stats.bytesWritten += command->size;
+        } else {
+            m_stats.bytesRead += command->size;
+        }
+
+        for (BlockRequest* r = command->first; r; r = r->nextMerged) {
+            uint64_t latency = now - r->submitTime;
+            unsigned bucket = (latency < 2) ? 0 : (63 - __builtin_clzll(latency));
+
+            m_stats.latency[MIN(bucket, LEMON_DISK_LATENCY_BUCKETS - 1)]++;
+        }
+    }
+
+    BlockRequest* r = command->first;
+    delete command;
+
+    while (r) {
+        // The request may be gone once it has completed
+        BlockRequest* next = r->nextMerged;
+        if (r->callback) {
+            r->status = status;
+            r->callback(r, r->data);
+        } else {
+            r->Complete(status);
+        }
+
+        r = next;
+    }
+}
+
+void BlockQueue::GetStats(lemon_disk_queue_stats_t& stats) {
+    ScopedSpinLock lockQueue(m_lock);
+
+    stats = m_stats;
+    stats.queueDepth = m_depth;
+    stats.inFlight = m_inFlight;
+    stats.queued = m_pending.get_length();
+    stats.blocksize = m_disk->blocksize;
+}
+
+void BlockQueue::ResetStats() {
+    ScopedSpinLock lockQueue(m_lock);
+    memset(&m_stats, 0, sizeof(lemon_disk_queue_stats_t));
+}
+
+void BlockQueue::SetDepth(unsigned depth) {
+    ScopedSpinLock lockQueue(m_lock);
+    m_depth = MIN(MAX(depth, 1U), static_cast<unsigned>(BLOCK_QUEUE_MAX_DEPTH));
+}
@@ -4,10 +4,11 @@
 #include <Fs/Fat32.h>
 #include <Fs/VolumeManager.h>
 #include <Logging.h>
+#include <UserPointer.h>
 
 static int nextDeviceNumber = 0;
 
-DiskDevice::DiskDevice() : Device(DeviceTypeStorageDevice) {
+DiskDevice::DiskDevice() : Device(DeviceTypeStorageDevice), queue(this) {
     flags = FS_NODE_CHARDEVICE;
 
     char buf[16];
@@ -30,7 +31,7 @@ ssize_t DiskDevice::Read(size_t off, size_t size, uint8_t* buffer) {
         return -EINVAL; // Block aligned reads only
     }
 
-    int e = ReadDiskBlock(off / blocksize, size, buffer);
+    int e = queue.Transfer(false, off / blocksize, size, buffer);
 
     if (e) {
         return -EIO;
@@ -41,4 +42,31 @@ ssize_t DiskDevice::Read(size_t off, size_t size, uint8_t* buffer) {
 
 ssize_t DiskDevice::Write(size_t off, size_t size, uint8_t* buffer) { return -ENOSYS; }
 
+int DiskDevice::Ioctl(uint64_t cmd, uint64_t arg) {
+    switch (cmd) {
+    case IoCtlDiskGetQueueStats: {
+        lemon_disk_queue_stats_t stats;
+        queue.GetStats(stats);
+
+        UserPointer<lemon_disk_queue_stats_t> statsPtr = arg;
+        if (statsPtr.StoreValue(stats)) {
+            return -EFAULT;
+        }
+        return 0;
+    }
+    case IoCtlDiskSetQueueDepth:
+        if (arg < 1 || arg > BLOCK_QUEUE_MAX_DEPTH) {
+            return -EINVAL;
+        }
+
+        queue.SetDepth(arg);
+        return 0;
+    case IoCtlDiskResetQueueStats:
+        queue.ResetStats();
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
 DiskDevice::~DiskDevice() {}
\ No newline at end of file
@@ -1,15 +1,21 @@
 #include <Storage/NVMe.h>
 
 #include <Debug.h>
+#include <IDT.h>
 #include <Logging.h>
 #include <Math.h>
 #include <PCI.h>
+#include <SMP.h>
 #include <Scheduler.h>
 
 namespace NVMe {
 char* deviceName = "Generic NVMe Controller";
 Vector<Controller*> nvmControllers;
 
+void QueueIRQHandler(NVMeQueue* queue, RegisterContext*) { queue->ProcessCompletions(); }
+
+void ControllerIRQHandler(Controller* controller, RegisterContext*) { controller->OnInterrupt(); }
+
 void Initialize() {
     PCI::EnumerateGenericPCIDevices(PCI_CLASS_STORAGE, PCI_SUBCLASS_NVM,
                                     [](const PCIInfo& dev) -> void { nvmControllers.add_back(new Controller(dev)); });
@@ -37,15 +43,92 @@ NVMeQueue::NVMeQueue(uint16_t qid, uintptr_t cqBase, uintptr_t sqBase, void* cq,
     sqCount = ssz / sizeof(NVMeCommand);
 }
 
-long NVMeQueue::Consume(NVMeCommand& cmd) { return 0; }
+void NVMeRequest::Reset() {
+    waiter = Thread::Current();
+    thread = nullptr;
+    shouldBlock = true;
+    removed = false;
+    interrupted = false;
+    complete = false;
+}
 
-void NVMeQueue::Submit(NVMeCommand& cmd) {
-    acquireLock(&queueLock);
-    cmd.commandID = nextCommandID++;
-    if (nextCommandID == 0xffff) {
-        nextCommandID = 0;
+void NVMeRequest::Complete(const NVMeCompletion& c) {
+    completion = c;
+    __atomic_store_n(&shouldBlock, false, __ATOMIC_SEQ_CST);
+
+    // If we interrupted the waiting thread whilst it holds the blocker lock,
+    // it has not checked shouldBlock yet so it will not block
+    while (acquireTestLock(&lock)) {
+        if (waiter == Thread::Current()) {
+            __atomic_store_n(&complete, true, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+
+    removed = true;
+    if (thread) {
+        thread->Unblock();
+    }
+    releaseLock(&lock);
+
+    // The waiter may destroy the request as soon as it sees it is complete
+    __atomic_store_n(&complete, true, __ATOMIC_RELEASE);
+}
+
+void NVMeQueue::InitializeSlots() {
+    unsigned slotCount = MIN(NVME_QUEUE_MAX_COMMANDS, sqCount - 1); // A full queue would look empty
+    freeSlots = (slotCount == 32) ? 0xFFFFFFFFU : ((1U << slotCount) - 1);
+    slotAvailability.SetValue(slotCount);
+
+    for (unsigned i = 0; i < NVME_QUEUE_MAX_COMMANDS; i++) {
+        requests[i] = nullptr;
+
+        prpListsPhys[i] = Memory::AllocatePhysicalMemoryBlock();
+        prpLists[i] = reinterpret_cast<uint64_t*>(Memory::KernelAllocate4KPages(1));
+        Memory::KernelMapVirtualMemory4K(prpListsPhys[i], reinterpret_cast<uintptr_t>(prpLists[i]), 1);
+    }
+}
+
+int NVMeQueue::AllocateSlot() {
+    uint32_t slots = __atomic_load_n(&freeSlots, __ATOMIC_RELAXED);
+    while (slots) {
+        int slot = __builtin_ctz(slots);
+        if (__atomic_compare_exchange_n(&freeSlots, &slots, slots & ~(1U << slot), false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            return slot;
+        }
+    }
+
+    return -1;
+}
+
+int NVMeQueue::Submit(NVMeCommand& cmd, NVMeRequest& req, const uint64_t* prps, unsigned prpCount) {
+    assert(prpCount > 0 && prpCount <= NVME_MAX_PRP_ENTRIES);
+
+    // Every slot may be in use, if so wait for a command to complete
+    if (slotAvailability.Wait()) {
+        return -EINTR;
     }
 
+    // The slot is freed before its request completes and Wait signals the semaphore
+    int slot = AllocateSlot();
+    assert(slot >= 0);
+
+    req.Reset();
+    requests[slot] = &req;
+
+    cmd.commandID = slot;
+    cmd.prp1 = prps[0];
+    if (prpCount == 2) {
+        cmd.prp2 = prps[1];
+    } else if (prpCount > 2) {
+        memcpy(prpLists[slot], prps + 1, (prpCount - 1) * sizeof(uint64_t));
+        cmd.prp2 = prpListsPhys[slot];
+    } else {
+        cmd.prp2 = 0;
+    }
+
+    ScopedSpinLock<true> lockQueue(queueLock);
     submissionQueue[sqTail] = cmd;
 
     sqTail++;
@@ -54,7 +137,59 @@ void NVMeQueue::Submit(NVMeCommand& cmd) {
     }
 
     *submissionDB = sqTail;
-    releaseLock(&queueLock);
+    return 0;
+}
+
+void NVMeQueue::Wait(NVMeRequest& req) {
+    while (!req.IsComplete()) {
+        if (irq == 0xFF) {
+            ProcessCompletions(); // No interrupts so poll
+            if (!req.IsComplete()) {
+                Scheduler::Yield();
+            }
+        } else if (Thread::Current()->Block(&req)) {
+            Scheduler::Yield(); // Interrupted, but the controller may still be writing to the buffer
+        }
+    }
+
+    // ProcessCompletions has already freed the slot, but the semaphore lock
+    // is taken with interrupts enabled so it cannot be signalled from the interrupt handler
+    slotAvailability.Signal();
+}
+
+void NVMeQueue::ProcessCompletions() {
+    ScopedSpinLock<true> lockCompletions(completionLock);
+
+    bool processed = false;
+    for (;;) {
+        asm volatile("" ::: "memory"); // Written by the controller
+        if (completionQueue[cqHead].phaseTag != completionCycleState) {
+            break;
+        }
+
+        NVMeCompletion completion = completionQueue[cqHead];
+        if (++cqHead >= cqCount) {
+            cqHead = 0;
+            completionCycleState = !completionCycleState;
+        }
+        processed = true;
+
+        uint16_t slot = completion.commandID;
+        if (slot >= NVME_QUEUE_MAX_COMMANDS || !requests[slot]) {
+            Log::Warning("[NVMe] Completion for unknown command %u on queue %u", slot, queueID);
+            continue;
+        }
+
+        NVMeRequest* req = requests[slot];
+        requests[slot] = nullptr;
+        __atomic_or_fetch(&freeSlots, 1U << slot, __ATOMIC_RELEASE);
+
+        req->Complete(completion);
+    }
+
+    if (processed) {
+        *completionDB = cqHead;
+    }
 }
 
 void NVMeQueue::SubmitWait(NVMeCommand& cmd, NVMeCompletion& complet) {
@@ -99,7 +234,6 @@ Controller::Controller(const PCIInfo& dev) : PCIDevice(dev) {
 
     EnableBusMastering();
     EnableMemorySpace();
-    // pciDevice->EnableInterrupts();
 
     Log::Info("[NVMe] Initializing Controller... Version: %d.%d.%d, Maximum Queue Entries Supported: %u",
               cRegs->version >> 16, cRegs->version >> 8 & 0xff, cRegs->version & 0xff, GetMaxQueueEntries());
@@ -195,17 +329,36 @@ Controller::Controller(const PCIInfo& dev) : PCIDevice(dev) {
 
     // GetNamespaceList();
 
-    // Attempt to allocate 12 I/O queues
-    if (SetNumberOfQueues(12)) {
+    // Maximum data transfer size is in units of the minimum page size, 0 means no limit
+    if (controllerIdentity->maximumDataTransferSize) {
+        maxTransferSize = MIN(maxTransferSize, GetMinMemoryPageSize() << controllerIdentity->maximumDataTransferSize);
+    }
+
+    // Attempt to allocate an I/O queue per CPU
+    if (SetNumberOfQueues(SMP::processorCount)) {
         dStatus = ControllerError; // Failed to create at least one I/O queue
         return;
     }
 
-    // Create 32 I/O Queues
-    for (unsigned i = 0; i < MIN(completionQueuesAllocated, submissionQueuesAllocated); i++) {
-        NVMeQueue* qPtr = new NVMeQueue();
+    // Without MSI-X every queue shares one interrupt
+    unsigned queueCount = MIN(MIN(completionQueuesAllocated, submissionQueuesAllocated), SMP::processorCount);
+    if (!MSIXCapable() || MSIXTableSize() <= queueCount) {
+        sharedIRQ = AllocateVector(PCIVectorAny);
+        if (sharedIRQ == 0xFF) {
+            Log::Warning("[NVMe] Failed to allocate an interrupt, polling for completions");
+        } else {
+            EnableInterrupts();
+            IDT::RegisterInterruptHandler(sharedIRQ, reinterpret_cast<isr_t>(&ControllerIRQHandler), this);
+        }
+    }
 
-        if (CreateIOQueue(qPtr)) { // Error creating I/O queue?
+    for (unsigned apicID = 0; apicID < 256 && ioQueues.size() < queueCount; apicID++) {
+        if (!SMP::cpus[apicID]) {
+            continue;
+        }
+
+        NVMeQueue* qPtr = new NVMeQueue();
+        if (CreateIOQueue(qPtr, apicID)) { // Error creating I/O queue?
             delete qPtr;
             break;
         }
@@ -213,13 +366,20 @@ Controller::Controller(const PCIInfo& dev) : PCIDevice(dev) {
         ioQueues.add_back(qPtr);
     }
 
-    if (ioQueues.get_length() < 1) {
+    if (ioQueues.size() < 1) {
         Log::Warning("[NVMe] Failed to create any I/O queues!");
         dStatus = ControllerError; // Failed to create at least one I/O queue
         return;
     }
 
-    queueAvailability = Semaphore(ioQueues.get_length());
+    // CPUs without their own queue share them
+    unsigned cpuIndex = 0;
+    for (unsigned apicID = 0; apicID < 256; apicID++) {
+        cpuQueues[apicID] = nullptr;
+        if (SMP::cpus[apicID]) {
+            cpuQueues[apicID] = ioQueues[cpuIndex++ % ioQueues.size()];
+        }
+    }
 
     IF_DEBUG(debugLevelNVMe >= DebugLevelNormal, {
         char serialNumber[21];
@@ -281,7 +441,7 @@ Controller::Controller(const PCIInfo& dev) : PCIDevice(dev) {
     }
 }
 
-long Controller::CreateIOQueue(NVMeQueue* qPtr) {
+long Controller::CreateIOQueue(NVMeQueue* qPtr, uint8_t apicID) {
     uintptr_t sqBase = Memory::AllocatePhysicalMemoryBlock();
     uintptr_t cqBase = Memory::AllocatePhysicalMemoryBlock();
     void* sq = Memory::KernelAllocate4KPages(1);
@@ -296,12 +456,28 @@ long Controller::CreateIOQueue(NVMeQueue* qPtr) {
 
     *qPtr = NVMeQueue(queueID, cqBase, sqBase, cq, sq, GetCompletionDoorbell(queueID), GetSubmissionDoorbell(queueID),
                       PAGE_SIZE_4K, PAGE_SIZE_4K);
+    qPtr->InitializeSlots();
+
+    // Each queue gets an MSI-X vector on its CPU, the table entry is the queue ID
+    uint16_t intVector = 0;
+    if (sharedIRQ != 0xFF) {
+        qPtr->irq = sharedIRQ;
+    } else if (MSIXCapable() && queueID < MSIXTableSize()) {
+        qPtr->irq = AllocateMSIXVector(queueID, apicID);
+        intVector = queueID;
+
+        if (qPtr->irq != 0xFF) {
+            IDT::RegisterInterruptHandler(qPtr->irq, reinterpret_cast<isr_t>(&QueueIRQHandler), qPtr);
+        }
+    }
 
     NVMeCommand createCq;
     memset(&createCq, 0, sizeof(NVMeCommand));
     createCq.opcode = AdminCmdCreateIOCompletionQueue;
 
     createCq.createIOCQ.contiguous = 1;
+    createCq.createIOCQ.intEnable = (qPtr->irq != 0xFF);
+    createCq.createIOCQ.intVector = intVector;
     createCq.createIOCQ.queueID = queueID;
     createCq.createIOCQ.queueSize = qPtr->CQSize() - 1;
     createCq.prp1 = cqBase;
@@ -351,8 +527,9 @@ long Controller::SetNumberOfQueues(uint16_t num) {
         return completion.status;
     }
 
-    completionQueuesAllocated = (completion.dw0 >> 16) & 0xffff; // High word
-    submissionQueuesAllocated = completion.dw0 & 0xffff;         // Low Word
+    // Both are 0's based
+    completionQueuesAllocated = ((completion.dw0 >> 16) & 0xffff) + 1; // High word
+    submissionQueuesAllocated = (completion.dw0 & 0xffff) + 1;         // Low Word
 
     return 0;
 }
@@ -419,18 +596,14 @@ long Controller::GetNamespaceList() {
     return 0;
 }
 
-NVMeQueue* Controller::AcquireIOQueue() {
-    if (queueAvailability.Wait()) {
-        return nullptr;
-    }
-
-    assert(ioQueues.get_length() > 0);
-    return ioQueues.remove_at(0);
+NVMeQueue* Controller::GetIOQueue() {
+    assert(ioQueues.size() > 0);
+    return cpuQueues[GetCPULocal()->id];
 }
 
-void Controller::ReleaseIOQueue(NVMeQueue* queue) {
-    ioQueues.add_back(queue);
-
-    queueAvailability.Signal();
+void Controller::OnInterrupt() {
+    for (NVMeQueue* queue : ioQueues) {
+        queue->ProcessCompletions();
+    }
 }
 } // namespace NVMe
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #include <Debug.h>
 #include <Errno.h>
+#include <Math.h>
+#include <Paging.h>
 #include <Storage/GPT.h>
 
 namespace NVMe {
@@ -64,126 +66,177 @@ void Namespace::ReleaseBuffer(int buffer) {
     bufferAvailability.Signal();
 }
 
-int Namespace::ReadDiskBlock(uint64_t lba, uint32_t count, void* _buffer) {
-    if (lba + count > diskSize) {
+int Namespace::ReadDiskBlock(uint64_t lba, uint32_t count, void* buffer) {
+    return Transfer(NVMCommands::NVMCmdRead, lba, count, reinterpret_cast<uint8_t*>(buffer));
+}
+
+int Namespace::WriteDiskBlock(uint64_t lba, uint32_t count, void* buffer) {
+    return Transfer(NVMCommands::NVMCmdWrite, lba, count, reinterpret_cast<uint8_t*>(buffer));
+}
+
+int Namespace::Transfer(uint8_t opcode, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    if (lba + (count + blocksize - 1) / blocksize > diskSize) {
         return 2;
     }
 
-    uint32_t blockCount = (count + (blocksize - 1)) / blocksize;
-    uint8_t* buffer = reinterpret_cast<uint8_t*>(_buffer);
-    int blockBufferIndex = AcquireBuffer();
-    if (blockBufferIndex == -EINTR) {
-        return -EINTR;
-    }
-    assert(blockBufferIndex >= 0);
+    uint32_t wholeBlocks = count & ~(blocksize - 1);
+    if (wholeBlocks && reinterpret_cast<uintptr_t>(buffer) >= KERNEL_HEAP_VIRTUAL_BASE &&
+        !(reinterpret_cast<uintptr_t>(buffer) & 0x3)) {
+        // The controller can access the kernel heap directly
+        if (int e = TransferDirect(opcode, lba, wholeBlocks, buffer); e) {
+            return e;
+        }
+    } else if (wholeBlocks) {
+        // Go through a temporary buffer on the kernel heap so large transfers still use large commands
+        uint32_t bounceSize = MIN(wholeBlocks, NVME_BOUNCE_BUFFER_SIZE);
+        uint8_t* bounce = reinterpret_cast<uint8_t*>(kmalloc(bounceSize));
+
+        for (uint32_t offset = 0; offset < wholeBlocks; offset += bounceSize) {
+            uint32_t size = MIN(bounceSize, wholeBlocks - offset);
+            if (opcode == NVMCommands::NVMCmdWrite) {
+                memcpy(bounce, buffer + offset, size);
+            }
+
+            if (int e = TransferDirect(opcode, lba + offset / blocksize, size, bounce); e) {
+                kfree(bounce);
+                return e;
+            }
+
+            if (opcode == NVMCommands::NVMCmdRead) {
+                memcpy(buffer + offset, bounce, size);
+            }
+        }
 
-    NVMeQueue* queue = controller->AcquireIOQueue();
-    if (!queue) {
-        return -EINTR; // The only time it should be null is if we got interrupted
+        kfree(bounce);
     }
 
-    NVMeCompletion completion;
+    if (count > wholeBlocks) {
+        // Partial last block
+        return TransferBuffered(opcode, lba + wholeBlocks / blocksize, count - wholeBlocks, buffer + wholeBlocks);
+    }
 
-    NVMeCommand cmd;
-    memset(&cmd, 0, sizeof(NVMeCommand));
-    cmd.opcode = NVMCommands::NVMCmdRead;
+    return 0;
+}
 
-    cmd.read.blockNum = 1;
-    cmd.read.startLBA = lba;
-    cmd.prp1 = physBuffers[blockBufferIndex];
-    cmd.nsID = nsID;
+int Namespace::TransferDirect(uint8_t opcode, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    assert(!(count & (blocksize - 1)));
+
+    // Split into commands of at most maxTransfer bytes and keep several of them in flight
+    const unsigned maxInFlight = 8;
+    uint32_t maxTransfer = MIN(controller->MaxTransferSize(), 0x10000U * blocksize) & ~(blocksize - 1);
+
+    NVMeQueue* queue = controller->GetIOQueue();
+    NVMeRequest requests[maxInFlight];
+    uint64_t* prps = reinterpret_cast<uint64_t*>(kmalloc(NVME_MAX_PRP_ENTRIES * sizeof(uint64_t)));
+
+    int error = 0;
+    unsigned submitted = 0;
+    unsigned completed = 0;
+
+    uint32_t offset = 0;
+    while ((offset < count && !error) || completed < submitted) {
+        // Wait for the oldest command once we run out of requests or commands to submit.
+        // After an error nothing more gets submitted, but the commands in flight still use the requests and buffer
+        if (submitted - completed >= maxInFlight || offset >= count || error) {
+            NVMeRequest& req = requests[completed++ % maxInFlight];
+            queue->Wait(req);
+
+            if (req.completion.status > 0 && !error) {
+                IF_DEBUG(debugLevelNVMe >= DebugLevelNormal,
+                         { Log::Error("[NVMe] (NSID: %d, LBA: %x) Disk Error %d", nsID, lba, req.completion.status); });
+                error = -req.completion.status;
+            }
+            continue;
+        }
 
-    while (blockCount && count > 0) {
-        int size = blocksize;
-        if (size > count)
-            size = count;
+        uint32_t size = MIN(count - offset, maxTransfer);
+        uintptr_t virt = reinterpret_cast<uintptr_t>(buffer + offset);
 
-        if (!size)
-            break;
+        // First entry may start part way through a page, every other entry is a whole page
+        unsigned prpCount = 0;
+        prps[prpCount++] = Memory::VirtualToPhysicalAddress(virt) + (virt & (PAGE_SIZE_4K - 1));
+        for (uintptr_t page = (virt & ~static_cast<uintptr_t>(PAGE_SIZE_4K - 1)) + PAGE_SIZE_4K; page < virt + size;
+             page += PAGE_SIZE_4K) {
+            prps[prpCount++] = Memory::VirtualToPhysicalAddress(page);
+        }
 
-        queue->SubmitWait(cmd, completion);
+        NVMeCommand cmd;
+        memset(&cmd, 0, sizeof(NVMeCommand));
+        cmd.opcode = opcode;
+        cmd.nsID = nsID;
 
-        if (completion.status > 0) {
-            controller->ReleaseIOQueue(queue);
-            ReleaseBuffer(blockBufferIndex);
+        // Read and write have the same layout
+        cmd.read.startLBA = lba + offset / blocksize;
+        cmd.read.blockNum = size / blocksize - 1; // 0's based
 
-            IF_DEBUG(debugLevelNVMe >= DebugLevelNormal,
-                     { Log::Error("[NVMe] (NSID: %d, LBA: %x) Disk Error %d", nsID, lba, completion.status); });
-            return -completion.status;
+        if (int e = queue->Submit(cmd, requests[submitted % maxInFlight], prps, prpCount); e) {
+            error = e;
+            continue;
         }
 
-        memcpy(buffer, buffers[blockBufferIndex], size);
-
-        count -= size;
-        buffer += size;
-        cmd.read.startLBA++;
-        blockCount--;
+        submitted++;
+        offset += size;
     }
 
-    ReleaseBuffer(blockBufferIndex);
-    controller->ReleaseIOQueue(queue);
-    return 0;
+    kfree(prps);
+    return error;
 }
 
-int Namespace::WriteDiskBlock(uint64_t lba, uint32_t count, void* _buffer) {
-    if (lba + count > diskSize) {
-        return 2;
-    }
-
-    uint32_t blockCount = (count + (blocksize - 1)) / blocksize;
-    uint8_t* buffer = reinterpret_cast<uint8_t*>(_buffer);
+int Namespace::TransferBuffered(uint8_t opcode, uint64_t lba, uint32_t count, uint8_t* buffer) {
     int blockBufferIndex = AcquireBuffer();
     if (blockBufferIndex == -EINTR) {
         return -EINTR;
     }
-
     assert(blockBufferIndex >= 0);
 
-    NVMeQueue* queue = controller->AcquireIOQueue();
-    if (!queue) {
-        return -EINTR; // The only time it should be null is if we got interrupted
-    }
-
-    NVMeCompletion completion;
-
-    NVMeCommand cmd;
-    memset(&cmd, 0, sizeof(NVMeCommand));
-    cmd.opcode = NVMCommands::NVMCmdWrite;
+    NVMeQueue* queue = controller->GetIOQueue();
 
-    cmd.write.blockNum = 1;
-    cmd.write.startLBA = lba;
-    cmd.prp1 = physBuffers[blockBufferIndex];
-    cmd.nsID = nsID;
+    // A page worth of blocks at a time
+    uint32_t blocksPerBuffer = PAGE_SIZE_4K / blocksize;
+    while (count > 0) {
+        uint32_t size = MIN(count, blocksPerBuffer * blocksize);
+        uint32_t blockCount = (size + blocksize - 1) / blocksize;
 
-    while (blockCount && count > 0) {
-        int size = blocksize;
-        if (size > count)
-            size = count;
-
-        if (!size)
-            break;
+        if (opcode == NVMCommands::NVMCmdWrite) {
+            if (size & (blocksize - 1)) {
+                memset(buffers[blockBufferIndex], 0, blockCount * blocksize); // Pad the last block
+            }
+            memcpy(buffers[blockBufferIndex], buffer, size);
+        }
 
-        memcpy(buffers[blockBufferIndex], buffer, size);
+        NVMeCommand cmd;
+        memset(&cmd, 0, sizeof(NVMeCommand));
+        cmd.opcode = opcode;
+        cmd.nsID = nsID;
+        cmd.read.startLBA = lba;
+        cmd.read.blockNum = blockCount - 1; // 0's based
 
-        queue->SubmitWait(cmd, completion);
+        NVMeRequest req;
+        uint64_t prp = physBuffers[blockBufferIndex];
+        if (int e = queue->Submit(cmd, req, &prp, 1); e) {
+            ReleaseBuffer(blockBufferIndex);
+            return e;
+        }
+        queue->Wait(req);
 
-        if (completion.status > 0) {
-            controller->ReleaseIOQueue(queue);
+        if (req.completion.status > 0) {
             ReleaseBuffer(blockBufferIndex);
 
             IF_DEBUG(debugLevelNVMe >= DebugLevelNormal,
-                     { Log::Error("[NVMe] (NSID: %d, LBA: %x) Disk Error %d", nsID, lba, completion.status); });
-            return -completion.status;
+                     { Log::Error("[NVMe] (NSID: %d, LBA: %x) Disk Error %d", nsID, lba, req.completion.status); });
+            return -req.completion.status;
+        }
+
+        if (opcode == NVMCommands::NVMCmdRead) {
+            memcpy(buffer, buffers[blockBufferIndex], size);
         }
 
         count -= size;
         buffer += size;
-        cmd.read.startLBA++;
-        blockCount--;
+        lba += blockCount;
     }
 
     ReleaseBuffer(blockBufferIndex);
-    controller->ReleaseIOQueue(queue);
     return 0;
 }
-} // namespace NVMe
\ No newline at end of file
+} // namespace NVMe
@@ -43,14 +43,14 @@ int PartitionDevice::ReadBlock(uint64_t lba, uint32_t count, void* buffer) {
         return 2;
     }
 
-    return parentDisk->ReadDiskBlock(lba + m_startLBA, count, buffer);
+    return parentDisk->queue.Transfer(false, lba + m_startLBA, count, reinterpret_cast<uint8_t*>(buffer));
 }
 
 int PartitionDevice::WriteBlock(uint64_t lba, uint32_t count, void* buffer) {
     if (lba * parentDisk->blocksize + count > (m_endLBA - m_startLBA) * parentDisk->blocksize)
         return 2;
 
-    return parentDisk->WriteDiskBlock(lba + m_startLBA, count, buffer);
+    return parentDisk->queue.Transfer(true, lba + m_startLBA, count, reinterpret_cast<uint8_t*>(buffer));
 }
 
 ssize_t PartitionDevice::Read(size_t off, size_t size, uint8_t* buffer) {
@@ -59,7 +59,7 @@ ssize_t PartitionDevice::Read(size_t off, size_t size, uint8_t* buffer) {
         return -EINVAL; // Block aligned reads only
     }
 
-    int e = parentDisk->ReadDiskBlock(m_startLBA + off / parentDisk->blocksize, size, buffer);
+    int e = parentDisk->queue.Transfer(false, m_startLBA + off / parentDisk->blocksize, size, buffer);
 
     if (e) {
         return -EIO;
@@ -74,7 +74,7 @@ ssize_t PartitionDevice::Write(size_t off, size_t size, uint8_t* buffer) {
         return -EINVAL; // Block aligned writes only
     }
 
-    int e = parentDisk->WriteDiskBlock(m_startLBA + off / parentDisk->blocksize, size, buffer);
+    int e = parentDisk->queue.Transfer(true, m_startLBA + off / parentDisk->blocksize, size, buffer);
 
     if (e) {
         return -EIO;
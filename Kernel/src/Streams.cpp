@@ -1,6 +1,7 @@
 #include <Stream.h>
 
 #include <Assert.h>
+#include <Errno.h>
 #include <Logging.h>
 #include <Timer.h>
 
@@ -28,29 +29,37 @@ void Stream::Wait() { assert(!"Stream::Wait called from base class"); }
 
 Stream::~Stream() {}
 
-DataStream::DataStream(size_t bufSize) {
-    bufferSize = bufSize;
-    bufferPos = 0;
+static size_t RoundStreamSize(size_t size) {
+    if (size < DATASTREAM_BUFSIZE_MIN) {
+        return DATASTREAM_BUFSIZE_MIN;
+    } else if (size > DATASTREAM_BUFSIZE_MAX) {
+        return DATASTREAM_BUFSIZE_MAX;
+    }
+
+    size_t rounded = DATASTREAM_BUFSIZE_MIN;
+    while (rounded < size) {
+        rounded <<= 1;
+    }
 
-    buffer = reinterpret_cast<uint8_t*>(kmalloc(bufferSize));
+    return rounded;
 }
 
-DataStream::~DataStream() { kfree(buffer); }
+DataStream::DataStream(size_t bufSize) { bufferSize = RoundStreamSize(bufSize); }
 
-int64_t DataStream::Read(void* data, size_t len) {
-    acquireLock(&streamLock);
+DataStream::~DataStream() {
+    if (buffer) {
+        kfree(buffer);
+    }
+}
 
-    if (len >= bufferPos)
-        len = bufferPos;
+void DataStream::AllocateBuffer() { buffer = reinterpret_cast<uint8_t*>(kmalloc(bufferSize)); }
 
-    if (!len) {
-        releaseLock(&streamLock);
-        return 0;
-    }
+int64_t DataStream::Read(void* data, size_t len) {
+    acquireLock(&streamLock);
 
-    memcpy(data, buffer, len);
+    len = CopyOut(data, len);
 
-    memcpy(buffer, buffer + len, bufferPos - len);
+    readPos = (readPos + len) & (bufferSize - 1);
     bufferPos -= len;
 
     releaseLock(&streamLock);
@@ -59,51 +68,99 @@ int64_t DataStream::Read(void* data, size_t len) {
 }
 
 int64_t DataStream::Peek(void* data, size_t len) {
-    acquireLock(&streamLock);
+    ScopedSpinLock acq(streamLock);
+
+    return CopyOut(data, len);
+}
+
+int64_t DataStream::PeekAt(size_t offset, void* data, size_t len) {
+    ScopedSpinLock acq(streamLock);
+
+    return CopyOut(data, len, offset);
+}
 
-    if (len >= bufferPos)
+int64_t DataStream::Skip(size_t len) {
+    ScopedSpinLock acq(streamLock);
+    if (len > bufferPos) {
         len = bufferPos;
+    }
 
-    if (!len) {
-        releaseLock(&streamLock);
+    readPos = (readPos + len) & (bufferSize - 1);
+    bufferPos -= len;
+
+    return len;
+}
+
+size_t DataStream::CopyOut(void* data, size_t len, size_t offset) {
+    if (offset >= bufferPos) {
         return 0;
     }
 
-    memcpy(data, buffer, len);
+    if (len > bufferPos - offset)
+        len = bufferPos - offset;
 
-    releaseLock(&streamLock);
+    if (!len) {
+        return 0;
+    }
+
+    size_t start = (readPos + offset) & (bufferSize - 1);
+    size_t firstRun = bufferSize - start;
+    if (firstRun >= len) {
+        memcpy(data, buffer + start, len);
+    } else {
+        memcpy(data, buffer + start, firstRun);
+        memcpy(reinterpret_cast<uint8_t*>(data) + firstRun, buffer, len - firstRun);
+    }
 
     return len;
 }
 
 int64_t DataStream::Write(void* data, size_t len) {
     acquireLock(&streamLock);
-    if (bufferPos + len >= bufferSize) {
-        void* oldBuffer = buffer;
+    if (!buffer) {
+        AllocateBuffer();
+    }
+
+    if (len > bufferSize - bufferPos) {
+        len = bufferSize - bufferPos;
+    }
+
+    size_t writePos = WritePos();
+    size_t firstRun = bufferSize - writePos;
+    if (firstRun >= len) {
+        memcpy(buffer + writePos, data, len);
+    } else {
+        memcpy(buffer + writePos, data, firstRun);
+        memcpy(buffer, reinterpret_cast<uint8_t*>(data) + firstRun, len - firstRun);
+    }
 
-        while (bufferPos + len >= bufferSize)
-            bufferSize *= 2;
+    bufferPos += len;
+
+    releaseLock(&streamLock);
 
-        buffer = reinterpret_cast<uint8_t*>(kmalloc(bufferSize));
+    return len;
+}
 
-        memcpy(buffer, oldBuffer, bufferPos);
+int64_t DataStream::Resize(size_t size) {
+    size = RoundStreamSize(size);
 
-        kfree(oldBuffer);
+    ScopedSpinLock acq(streamLock);
+    if (activeSpans || bufferPos > size) {
+        return -EBUSY;
     }
 
-    memcpy(buffer + bufferPos, data, len);
-    bufferPos += len;
+    if (buffer) {
+        uint8_t* newBuffer = reinterpret_cast<uint8_t*>(kmalloc(size));
+        CopyOut(newBuffer, bufferPos);
 
-    if (bufferPos > 0 && waiting.get_length() > 0) {
-        while (waiting.get_length()) {
-            // Scheduler::UnblockThread(waiting.remove_at(0));
-            // TODO: Reinstate blocker
-        }
+        kfree(buffer);
+        buffer = newBuffer;
     }
 
-    releaseLock(&streamLock);
+    bufferSize = size;
+    readPos = 0;
 
-    return len;
+    return bufferSize;
 }
 
 int64_t DataStream::Empty() { return !bufferPos; }
@@ -190,13 +190,11 @@ PTY::PTY(int id) : m_id(id) {
 }
 
 PTY::~PTY(){
-    while (m_watchingSlave.get_length()) {
-        m_watchingSlave.remove_at(0)->Signal(); // Signal all watching
-    }
+    ScopedSpinLock lockWatchers(m_watcherLock);
 
-    while (m_watchingMaster.get_length()) {
-        m_watchingMaster.remove_at(0)->Signal(); // Signal all watching
-    }
+    fs::SignalWatchers(m_watchingSlave); // Signal all watching
+
+    fs::SignalWatchers(m_watchingMaster); // Signal all watching
 }
 
 void PTY::Close() {
@@ -264,17 +262,14 @@ ssize_t PTY::MasterWrite(char* buffer, size_t count) {
         }
     }
 
+    ScopedSpinLock lockWatchers(m_watcherLock);
     if (IsCanonical()) {
         if (slave.lines && m_watchingSlave.get_length()) {
-            while (m_watchingSlave.get_length()) {
-                m_watchingSlave.remove_at(0)->Signal(); // Signal all watching
-            }
+            fs::SignalWatchers(m_watchingSlave); // Signal all watching
         }
     } else {
         if (slave.bufferPos && m_watchingSlave.get_length()) {
-            while (m_watchingSlave.get_length()) {
-                m_watchingSlave.remove_at(0)->Signal(); // Signal all watching
-            }
+            fs::SignalWatchers(m_watchingSlave); // Signal all watching
         }
     }
 
@@ -292,39 +287,46 @@ ssize_t PTY::SlaveWrite(char* buffer, size_t count) {
         releaseLock(&masterFile.blockedLock);
     }
 
+    ScopedSpinLock lockWatchers(m_watcherLock);
     if (master.bufferPos && m_watchingMaster.get_length()) {
-        while (m_watchingMaster.get_length()) {
-            m_watchingMaster.remove_at(0)->Signal(); // Signal all watching
-        }
+        fs::SignalWatchers(m_watchingMaster); // Signal all watching
     }
 
     return written;
 }
 
 void PTY::WatchMaster(FilesystemWatcher& watcher, int events) {
+    ScopedSpinLock lockWatchers(m_watcherLock);
+
+    // Stay registered when signalling straight away, edge triggered epoll still needs to hear about the next event
+    m_watchingMaster.add_back(&watcher);
+
     if (!(events & (POLLIN))) { // We don't really block on writes and nothing else applies except POLLIN
         watcher.Signal();
-        return;
     } else if (masterFile.CanRead()) {
         watcher.Signal();
-        return;
     }
-
-    m_watchingMaster.add_back(&watcher);
 }
 
 void PTY::WatchSlave(FilesystemWatcher& watcher, int events) {
+    ScopedSpinLock lockWatchers(m_watcherLock);
+
+    // Stay registered when signalling straight away, edge triggered epoll still needs to hear about the next event
+    m_watchingSlave.add_back(&watcher);
+
     if (!(events & (POLLIN))) { // We don't really block on writes and nothing else applies except POLLIN
         watcher.Signal();
-        return;
     } else if (slaveFile.CanRead()) {
         watcher.Signal();
-        return;
     }
-
-    m_watchingSlave.add_back(&watcher);
 }
 
-void PTY::UnwatchMaster(FilesystemWatcher& watcher) { m_watchingMaster.remove(&watcher); }
+void PTY::UnwatchMaster(FilesystemWatcher& watcher) {
+    ScopedSpinLock lockWatchers(m_watcherLock);
+    m_watchingMaster.remove(&watcher);
+}
 
-void PTY::UnwatchSlave(FilesystemWatcher& watcher) { m_watchingSlave.remove(&watcher); }
\ No newline at end of file
+void PTY::UnwatchSlave(FilesystemWatcher& watcher) {
+    ScopedSpinLock lockWatchers(m_watcherLock);
+    m_watchingSlave.remove(&watcher);
+}
\ No newline at end of file
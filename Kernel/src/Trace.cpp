@@ -0,0 +1,203 @@
+#include <Trace.h>
+
+#include <CPU.h>
+#include <CString.h>
+#include <Device.h>
+#include <Errno.h>
+#include <Objects/Process.h>
+#include <SMP.h>
+#include <Spinlock.h>
+#include <Thread.h>
+#include <Timer.h>
+#include <UserPointer.h>
+
+#define TRACE_RECORDS_PER_CPU 16384 // Must be a power of two
+
+// Each CPU has its own ring buffer which only it writes to, with interrupts disabled,
+// so recording needs no locks. Old records get overwritten when the reader falls behind.
+struct TraceBuffer {
+    // seq is 0 whilst the record is being written and its index + 1 afterwards,
+    // the reader checks it before and after copying to know the record did not change
+    struct Slot {
+        uint64_t seq;
+        lemon_trace_record_t record;
+    };
+
+    uint64_t head = 0; // Records ever written
+    uint64_t tail = 0; // Next record to read
+    uint64_t lost = 0;
+    Slot slots[TRACE_RECORDS_PER_CPU];
+};
+
+namespace Trace {
+
+bool enabled = false;
+
+class TraceDevice : public Device {
+public:
+    TraceDevice(const char* name) : Device(name, DeviceTypeUNIXPseudo) {
+        flags = FS_NODE_CHARDEVICE;
+
+        SetDeviceName("Kernel Trace");
+    }
+
+    // Reads whole records, not in timestamp order across CPUs
+    ssize_t Read(size_t, size_t size, uint8_t* buffer) override {
+        if (!IsPrivileged()) {
+            return -EPERM;
+        }
+
+        if (acquireTestLock(&m_readLock)) {
+            return -EBUSY; // Records can only go to one reader
+        }
+
+        size_t count = size / sizeof(lemon_trace_record_t);
+        size_t read = 0;
+        for (unsigned i = 0; i < SMP::processorCount && read < count; i++) {
+            TraceBuffer* trace = SMP::cpus[i]->traceBuffer;
+            if (!trace) {
+                continue;
+            }
+
+            while (read < count) {
+                uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+                if (trace->tail == head) {
+                    break;
+                }
+
+                if (head - trace->tail > TRACE_RECORDS_PER_CPU) {
+                    trace->lost += head - TRACE_RECORDS_PER_CPU - trace->tail;
+                    trace->tail = head - TRACE_RECORDS_PER_CPU;
+                }
+
+                TraceBuffer::Slot& slot = trace->slots[trace->tail & (TRACE_RECORDS_PER_CPU - 1)];
+                uint64_t seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+                lemon_trace_record_t record = slot.record;
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+                if (seq != trace->tail + 1 || __atomic_load_n(&slot.seq, __ATOMIC_RELAXED) != seq) {
+                    trace->lost++; // Overwritten whilst we were reading it
+                    trace->tail++;
+                    continue;
+                }
+
+                memcpy(buffer + read * sizeof(lemon_trace_record_t), &record, sizeof(lemon_trace_record_t));
+                read++;
+                trace->tail++;
+            }
+        }
+
+        releaseLock(&m_readLock);
+        return read * sizeof(lemon_trace_record_t);
+    }
+
+    int Ioctl(uint64_t cmd, uint64_t arg) override {
+        if (!IsPrivileged()) {
+            return -EPERM;
+        }
+
+        switch (cmd) {
+        case IoCtlTraceEnable:
+            for (unsigned i = 0; i < SMP::processorCount; i++) {
+                if (!SMP::cpus[i]->traceBuffer) {
+                    // The CPU reads this with interrupts disabled, so it never sees a partial write
+                    __atomic_store_n(&SMP::cpus[i]->traceBuffer, new TraceBuffer(), __ATOMIC_RELEASE);
+                }
+            }
+
+            __atomic_store_n(&enabled, true, __ATOMIC_RELEASE);
+            return 0;
+        case IoCtlTraceDisable:
+            __atomic_store_n(&enabled, false, __ATOMIC_RELEASE);
+            return 0;
+        case IoCtlTraceClear:
+            if (acquireTestLock(&m_readLock)) {
+                return -EBUSY;
+            }
+
+            for (unsigned i = 0; i < SMP::processorCount; i++) {
+                if (TraceBuffer* trace = SMP::cpus[i]->traceBuffer; trace) {
+                    trace->tail = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+                    trace->lost = 0;
+                }
+            }
+
+            releaseLock(&m_readLock);
+            return 0;
+        case IoCtlTraceGetInfo: {
+            lemon_trace_info_t info = {
+                .cpuCount = SMP::processorCount,
+                .recordsPerCPU = TRACE_RECORDS_PER_CPU,
+                .enabled = __atomic_load_n(&enabled, __ATOMIC_ACQUIRE),
+                .reserved = 0,
+                .pending = 0,
+                .lost = 0,
+            };
+
+            for (unsigned i = 0; i < SMP::processorCount; i++) {
+                if (TraceBuffer* trace = SMP::cpus[i]->traceBuffer; trace) {
+                    uint64_t pending = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE) - trace->tail;
+                    if (pending > TRACE_RECORDS_PER_CPU) {
+                        info.lost += pending - TRACE_RECORDS_PER_CPU;
+                        pending = TRACE_RECORDS_PER_CPU;
+                    }
+
+                    info.pending += pending;
+                    info.lost += trace->lost;
+                }
+            }
+
+            UserPointer<lemon_trace_info_t> infoPtr = arg;
+            if (infoPtr.StoreValue(info)) {
+                return -EFAULT;
+            }
+            return 0;
+        }
+        default:
+            return -EINVAL;
+        }
+    }
+
+private:
+    // Records cover the syscalls, IPC and page fault addresses of every process, so the trace is root only
+    bool IsPrivileged() const { return Process::Current()->euid == 0; }
+
+    lock_t m_readLock = 0;
+};
+
+TraceDevice* traceDevice = nullptr;
+
+void Record(uint16_t type, uint64_t arg0, uint64_t arg1, uint64_t arg2) {
+    // Nothing else on this CPU can record until we are done
+    InterruptDisabler disableInterrupts;
+
+    CPU* cpu = GetCPULocal();
+    TraceBuffer* trace = cpu->traceBuffer;
+    if (!trace) {
+        return;
+    }
+
+    uint64_t index = trace->head;
+    TraceBuffer::Slot& slot = trace->slots[index & (TRACE_RECORDS_PER_CPU - 1)];
+
+    __atomic_store_n(&slot.seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    Thread* thread = cpu->currentThread;
+    slot.record = {
+        .timestamp = Timer::NanosecondsSinceBoot(),
+        .type = type,
+        .cpu = static_cast<uint16_t>(cpu->id),
+        .pid = thread ? thread->parent->PID() : -1,
+        .tid = thread ? thread->tid : -1,
+        .reserved = 0,
+        .args = {arg0, arg1, arg2},
+    };
+
+    __atomic_store_n(&slot.seq, index + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&trace->head, index + 1, __ATOMIC_RELEASE);
+}
+
+void Initialize() { traceDevice = new TraceDevice("trace"); }
+
+} // namespace Trace
@@ -77,12 +77,27 @@ public:
     inline rect_t GetFixedBounds() { return fixedBounds; }
 
     virtual void SetBounds(rect_t bounds) {
+        Invalidate();
+
         this->bounds = bounds;
         UpdateFixedBounds();
+
+        Invalidate();
     };
 
+    /////////////////////////////
+    /// \brief Mark the widget as changed
+    ///
+    /// Only the changed parts of a window get recomposited. Widgets damage themselves
+    /// when their state changes, call this after changing a widget directly.
+    /////////////////////////////
+    void Invalidate();
+
     Widget* active = nullptr; // Only applies to containers, etc. is so widgets know whether they are active or not
 protected:
+    // Damage the whole window, application callbacks can change any widget
+    void InvalidateWindow();
+
     Widget* parent = nullptr;
     Window* window = nullptr;
 
@@ -120,6 +135,7 @@ public:
     virtual void OnMouseMove(vector2i_t mousePos);
     virtual void OnDoubleClick(vector2i_t mousePos);
     virtual void OnKeyPress(int key);
+    virtual void OnHover(vector2i_t mousePos);
 
     virtual void UpdateFixedBounds();
 
@@ -274,6 +290,7 @@ protected:
 
     std::vector<ContextMenuEntry> ctxEntries;
     bool masked = false;
+    bool cursorShown = false; // Cursor was visible when last painted
 
 public:
     bool editable = true;
@@ -332,6 +349,7 @@ public:
     void OnMouseMove(vector2i_t mousePos);
     void OnDoubleClick(vector2i_t mousePos);
     void OnKeyPress(int key);
+    void OnHover(vector2i_t mousePos);
     void OnInactive();
 
     void UpdateFixedBounds();
@@ -406,12 +424,14 @@ public:
     void OnMouseMove(vector2i_t mousePos);
     void OnDoubleClick(vector2i_t mousePos);
     void OnKeyPress(int key);
+    void OnHover(vector2i_t mousePos);
 
     int AddItem(GridItem& item);
 
     void ClearItems() {
         items.clear();
         ResetScrollBar();
+        Invalidate();
     }
 
     void UpdateFixedBounds();
@@ -21,6 +21,9 @@
 
 #define WINDOW_MENUBAR_HEIGHT 20
 
+// Most damage rects sent with a commit, beyond this their bounding box is sent
+#define WINDOW_MAX_DAMAGE_RECTS 16
+
 namespace Lemon::GUI {
 typedef void (*WindowPaintHandler)(surface_t*);
 
@@ -39,12 +42,11 @@ enum {
     WindowFlag_Transparent = 0x20,  // Enable window alpha channel
 };
 
+// Only written by LemonWM, clients commit buffers with CommitBuffer
 struct WindowBuffer {
-    uint64_t currentBuffer;
+    uint64_t currentBuffer; // Buffer on screen, 0 for buffer 1 and 1 for buffer 2
     uint64_t buffer1Offset;
     uint64_t buffer2Offset;
-    uint32_t drawing; // Is being drawn?
-    uint32_t dirty;   // Does it need to be drawn?
 };
 
 enum WindowType {
@@ -133,10 +135,26 @@ public:
     /////////////////////////////
     /// \brief Swap the window buffers
     ///
-    /// Swap the window buffers, equivalent to Paint() on a Basic Window without OnPaint()
+    /// Send the buffer drawn to to LemonWM along with any damage, then wait for LemonWM to release the other buffer.
+    /// Equivalent to Paint() on a Basic Window without OnPaint()
     /////////////////////////////
     void SwapBuffers();
 
+    /////////////////////////////
+    /// \brief Mark part of the window as changed
+    ///
+    /// LemonWM only recomposites the damaged parts of the window when the buffers are swapped.
+    /// If nothing has been damaged since the last swap, the whole window is.
+    ///
+    /// \param rect Damaged rect in window coordinates
+    /////////////////////////////
+    void Invalidate(const Rect& rect);
+
+    /////////////////////////////
+    /// \brief Mark the whole window as changed
+    /////////////////////////////
+    inline void InvalidateAll() { m_damageAll = true; }
+
     /////////////////////////////
     /// \brief Check the event queue for events.
     ///
@@ -288,7 +306,8 @@ public:
     bool closed = false; // Set to true when close button pressed
 
 private:
-    class TooltipWindow : protected LemonWMServerEndpoint {
+    // Tooltips have their own connection to LemonWM, so they handle BufferReleased themselves
+    class TooltipWindow : protected LemonWMServerEndpoint, LemonWMClient {
       public:
         TooltipWindow(const char* text, vector2i_t pos, const RGBAColour& bgColour);
 
@@ -300,7 +319,23 @@ private:
         inline void Minimize(bool minimized) { LemonWMServerEndpoint::Minimize(windowID, minimized); }
 
     private:
+        // Wait for LemonWM to release the buffer being drawn to
+        void WaitForBuffer();
+
+        void OnPeerDisconnect(const Lemon::Handle& client) override;
+        void OnSendEvent(const Lemon::Handle&, int64_t, int32_t, uint64_t) override {}
+        void OnThemeUpdated(const Lemon::Handle&) override {}
+        void OnPing(const Lemon::Handle& client, int64_t windowID) override;
+        void OnBufferReleased(const Lemon::Handle& client, int64_t windowID, uint64_t serial) override;
+
+        void OnWindowCreated(const Lemon::Handle&, int64_t, uint32_t, const std::string&) override {}
+        void OnWindowStateChanged(const Lemon::Handle&, int64_t, uint32_t, int32_t) override {}
+        void OnWindowTitleChanged(const Lemon::Handle&, int64_t, const std::string&) override {}
+        void OnWindowDestroyed(const Lemon::Handle&, int64_t) override {}
+
         int64_t windowID = 0;
+        uint64_t commitSerial = 0;   // Serial of the last commit
+        uint64_t releasedSerial = 0; // Last commit LemonWM has released the previous buffer for
 
         Graphics::TextObject textObject;
         RGBAColour backgroundColour;
@@ -323,6 +358,11 @@ private:
     /////////////////////////////
     void GUIHandleEvent(LemonEvent& ev);
 
+    // Send the buffer being drawn to LemonWM and start drawing to the other
+    void CommitBuffer();
+    // Wait for LemonWM to release the buffer being drawn to
+    void WaitForBuffer();
+
     bool m_shouldResize = false;
     vector2i_t m_resizeBounds;
 
@@ -333,6 +373,11 @@ private:
     uint8_t* m_buffer2;
     uint64_t m_windowBufferKey;
 
+    std::vector<Rect> m_damage; // Damage since the last commit
+    bool m_damageAll = true;
+    uint64_t m_commitSerial = 0;   // Serial of the last commit
+    uint64_t m_releasedSerial = 0; // Last commit LemonWM has released the previous buffer for
+
     uint32_t m_flags;
 
     int m_windowType = WindowType::Basic;
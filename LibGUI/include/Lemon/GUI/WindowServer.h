@@ -63,6 +63,7 @@ private:
     void OnSendEvent(const Lemon::Handle& client, int64_t windowID, int32_t id, uint64_t data) override;
     void OnThemeUpdated(const Lemon::Handle& client) override;
     void OnPing(const Lemon::Handle& client, int64_t windowID) override;
+    void OnBufferReleased(const Lemon::Handle& client, int64_t windowID, uint64_t serial) override;
 
     void OnWindowCreated(const Lemon::Handle& client, int64_t windowID, uint32_t flags, const std::string& name) override;
     void OnWindowStateChanged(const Lemon::Handle& client, int64_t windowID, uint32_t flags, int32_t state) override;
@@ -27,13 +27,29 @@ Widget::~Widget() {}
 
 void Widget::SetLayout(LayoutSize newSizeX, LayoutSize newSizeY, WidgetAlignment newAlign,
                        WidgetAlignment newAlignVert) {
+    Invalidate();
+
     sizeX = newSizeX;
     sizeY = newSizeY;
     align = newAlign;
     verticalAlign = newAlignVert;
     UpdateFixedBounds();
+
+    Invalidate();
 };
 
+void Widget::Invalidate() {
+    if (window) {
+        window->Invalidate(fixedBounds);
+    }
+}
+
+void Widget::InvalidateWindow() {
+    if (window) {
+        window->InvalidateAll();
+    }
+}
+
 void Widget::Paint(__attribute__((unused)) surface_t* surface) {}
 
 void Widget::OnMouseEnter(vector2i_t mousePos) { OnMouseMove(mousePos); }
@@ -134,6 +150,7 @@ void Container::AddWidget(Widget* w) {
     }
 
     UpdateFixedBounds();
+    Invalidate();
 }
 
 void Container::RemoveWidget(Widget* w) {
@@ -146,6 +163,7 @@ void Container::RemoveWidget(Widget* w) {
         lastMousedOver = nullptr;
 
     children.erase(std::remove(children.begin(), children.end(), w), children.end());
+    Invalidate();
 }
 
 void Container::Paint(surface_t* surface) {
@@ -162,6 +180,7 @@ void Container::OnMouseEnter(vector2i_t mousePos) {
     for (Widget* w : children) {
         if (Graphics::PointInRect(w->GetFixedBounds(), mousePos)) {
             w->OnMouseEnter(mousePos);
+            w->Invalidate();
 
             lastMousedOver = w;
             break;
@@ -172,6 +191,7 @@ void Container::OnMouseEnter(vector2i_t mousePos) {
 void Container::OnMouseExit(vector2i_t mousePos) {
     if (lastMousedOver) {
         lastMousedOver->OnMouseExit(mousePos);
+        lastMousedOver->Invalidate();
     }
 
     lastMousedOver = nullptr;
@@ -183,12 +203,14 @@ void Container::OnMouseDown(vector2i_t mousePos) {
             if (active != w) {
                 if (active) {
                     active->OnInactive();
+                    active->Invalidate();
                 }
 
                 w->OnActive();
             }
             active = w;
             w->OnMouseDown(mousePos);
+            w->Invalidate();
             break;
         }
     }
@@ -197,14 +219,20 @@ void Container::OnMouseDown(vector2i_t mousePos) {
 void Container::OnMouseUp(vector2i_t mousePos) {
     if (active) {
         active->OnMouseUp(mousePos);
+        active->Invalidate();
     }
 }
 
 void Container::OnRightMouseDown(vector2i_t mousePos) {
     for (Widget* w : children) {
         if (Graphics::PointInRect(w->GetFixedBounds(), mousePos)) {
+            if (active && active != w) {
+                active->Invalidate();
+            }
+
             active = w;
             w->OnRightMouseDown(mousePos);
+            w->Invalidate();
             break;
         }
     }
@@ -213,31 +241,42 @@ void Container::OnRightMouseDown(vector2i_t mousePos) {
 void Container::OnRightMouseUp(vector2i_t mousePos) {
     if (active) {
         active->OnRightMouseUp(mousePos);
+        active->Invalidate();
     }
 }
 
 void Container::OnMouseMove(vector2i_t mousePos) {
+    OnHover(mousePos);
+
+    if (active) {
+        active->OnMouseMove(mousePos);
+    }
+}
+
+void Container::OnHover(vector2i_t mousePos) {
+    // Widgets drawn differently under the mouse need repainting
+    // when it moves onto or off of them
     for (Widget* w : children) {
         if (Graphics::PointInRect(w->GetFixedBounds(), mousePos)) {
             if (w == lastMousedOver) {
+                w->OnHover(mousePos);
                 break;
             } else {
                 if (lastMousedOver) {
                     lastMousedOver->OnMouseExit(mousePos);
+                    lastMousedOver->Invalidate();
                 }
 
                 w->OnMouseEnter(mousePos);
+                w->Invalidate();
 
                 lastMousedOver = w;
             }
         } else if (w == lastMousedOver) {
+            w->Invalidate();
             lastMousedOver = nullptr;
         }
     }
-
-    if (active) {
-        active->OnMouseMove(mousePos);
-    }
 }
 
 void Container::OnDoubleClick(vector2i_t mousePos) {
@@ -245,6 +284,7 @@ void Container::OnDoubleClick(vector2i_t mousePos) {
         Graphics::PointInRect(active->GetFixedBounds(),
                               mousePos)) { // If user hasnt clicked on same widget then this aint a double click
         active->OnDoubleClick(mousePos);
+        active->Invalidate();
     } else {
         OnMouseDown(mousePos);
     }
@@ -253,6 +293,7 @@ void Container::OnDoubleClick(vector2i_t mousePos) {
 void Container::OnKeyPress(int key) {
     if (active) {
         active->OnKeyPress(key);
+        active->Invalidate();
     }
 }
 
@@ -331,6 +372,8 @@ Button::Button(const char* _label, rect_t _bounds) : Widget(_bounds) {
 void Button::SetLabel(const char* _label) {
     label = _label;
     labelLength = Graphics::GetTextLength(label.c_str());
+
+    Invalidate();
 }
 
 void Button::DrawButtonLabel(surface_t* surface) {
@@ -368,8 +411,10 @@ void Button::Paint(surface_t* surface) {
 void Button::OnMouseDown(__attribute__((unused)) vector2i_t mousePos) { pressed = true; }
 
 void Button::OnMouseUp(vector2i_t mousePos) {
-    if (Graphics::PointInRect(fixedBounds, mousePos) && e.onPress.handler)
+    if (Graphics::PointInRect(fixedBounds, mousePos) && e.onPress.handler) {
+        InvalidateWindow();
         e.onPress();
+    }
 
     pressed = false;
 }
@@ -613,14 +658,24 @@ void TextBox::Paint(surface_t* surface) {
         }
     }
 
+    bool showCursor = false;
     if (editable && parent->active == this) { // Only draw cursor if active
         timespec t;
         clock_gettime(CLOCK_BOOTTIME, &t);
 
         long msec = (t.tv_nsec / 1000000.0);
-        if (msec < 250 || (msec > 500 && msec < 750)) // Only draw the cursor for a quarter of a second so it blinks
-            Graphics::DrawRect(fixedBounds.pos.x + cursorX, fixedBounds.pos.y + cursorY, 2, font->lineHeight,
-                               textColour.r, textColour.g, textColour.b, surface);
+        showCursor = msec < 250 || (msec > 500 && msec < 750); // Only draw the cursor for a quarter of a second so it blinks
+    }
+
+    rect_t cursorRect = {fixedBounds.pos.x + cursorX, fixedBounds.pos.y + cursorY, 2, font->lineHeight};
+    if (showCursor) {
+        Graphics::DrawRect(cursorRect, textColour, surface);
+    }
+
+    // Blinking only damages the cursor, anything else changing damages the whole textbox
+    if (showCursor != cursorShown && window) {
+        window->Invalidate(cursorRect);
+        cursorShown = showCursor;
     }
 }
 
@@ -658,6 +713,8 @@ void TextBox::LoadText(const char* text) {
     } else {
         contents.push_back(std::string(text2));
     }
+
+    Invalidate();
 }
 
 void TextBox::OnMouseDown(vector2i_t mousePos) {
@@ -700,6 +757,7 @@ void TextBox::OnCommand(unsigned short cmd) { (void)cmd; }
 void TextBox::OnMouseMove(__attribute__((unused)) vector2i_t mousePos) {
     if (multiline && sBar.pressed) {
         sBar.OnMouseMoveRelative({0, mousePos.y - fixedBounds.pos.y});
+        Invalidate();
     }
 }
 
@@ -747,6 +805,7 @@ void TextBox::OnKeyPress(int key) {
 
             ResetScrollBar();
         } else if (OnSubmit) {
+            InvalidateWindow();
             OnSubmit(this);
         }
     } else if (key == KEY_ARROW_LEFT) { // Move cursor left
@@ -807,6 +866,8 @@ void TextBox::MaskText(bool state) {
     } else {
         masked = false;
     }
+
+    Invalidate();
 }
 
 //////////////////////////
@@ -829,10 +890,12 @@ void ListView::SetModel(DataModel* model) {
 
     model->Refresh();
     cacheDirty = true;
+    Invalidate();
 }
 
 void ListView::UpdateData() {
     cacheDirty = true;
+    Invalidate();
 }
 
 void ListView::Paint(surface_t* surface) {
@@ -975,8 +1038,10 @@ void ListView::OnMouseDown(vector2i_t mousePos) {
     if (selected >= model->RowCount())
         selected = (int)model->RowCount() - 1;
 
-    if (OnSelect)
+    if (OnSelect) {
+        InvalidateWindow();
         OnSelect(selected, this);
+    }
 }
 
 void ListView::OnDoubleClick(vector2i_t mousePos) {
@@ -994,8 +1059,10 @@ void ListView::OnDoubleClick(vector2i_t mousePos) {
             floor(((double)mousePos.y + sBar.scrollPos - fixedBounds.pos.y - columnDisplayHeight) / itemHeight);
 
         if (selected == clickedItem) { // Make sure the same item was clicked twice
-            if (OnSubmit)
+            if (OnSubmit) {
+                InvalidateWindow();
                 OnSubmit(selected, this);
+            }
         } else {
             selected = clickedItem;
 
@@ -1010,9 +1077,13 @@ void ListView::OnDoubleClick(vector2i_t mousePos) {
 void ListView::OnMouseMove(vector2i_t mousePos) {
     if (showScrollBar && sBar.pressed) {
         sBar.OnMouseMoveRelative({0, mousePos.y - fixedBounds.pos.y});
+        Invalidate();
     }
 }
 
+// The row under the mouse is highlighted
+void ListView::OnHover(__attribute__((unused)) vector2i_t mousePos) { Invalidate(); }
+
 void ListView::OnMouseUp(__attribute__((unused)) vector2i_t mousePos) { sBar.pressed = false; }
 
 void ListView::OnKeyPress(int key) {
@@ -1033,8 +1104,10 @@ void ListView::OnKeyPress(int key) {
         selected++;
         break;
     case KEY_ENTER:
-        if (OnSubmit)
+        if (OnSubmit) {
+            InvalidateWindow();
             OnSubmit(selected, this);
+        }
         return;
     }
 
@@ -1144,6 +1217,7 @@ void ListView::OnEditboxSubmit() {
     // items[selected].details[editingColumnIndex] = editbox.contents.front();
 
     if (OnEdit) {
+        InvalidateWindow();
         OnEdit(selected, this);
     }
 
@@ -1273,8 +1347,10 @@ void GridView::OnMouseDown(vector2i_t mousePos) {
             (vector2i_t){
                 0, sBar.scrollPos}); // Position relative to position of GridView, but absolute from scroll position
 
-        if (OnSelect)
+        if (OnSelect) {
+            InvalidateWindow();
             OnSelect(items[selected], this);
+        }
     }
 }
 
@@ -1288,9 +1364,13 @@ void GridView::OnMouseMove(vector2i_t mousePos) {
     vector2i_t sBarPos = {fixedBounds.x + fixedBounds.width - 16, fixedBounds.y};
     if (sBar.pressed) {
         sBar.OnMouseMoveRelative(mousePos - sBarPos);
+        Invalidate();
     }
 }
 
+// Items under the mouse are highlighted
+void GridView::OnHover(__attribute__((unused)) vector2i_t mousePos) { Invalidate(); }
+
 void GridView::OnDoubleClick(vector2i_t mousePos) {
     int oldSelected = selected;
     selected = PosToItem(
@@ -1299,24 +1379,30 @@ void GridView::OnDoubleClick(vector2i_t mousePos) {
                      sBar.scrollPos}); // Position relative to position of GridView, but absolute from scroll position
 
     if (selected >= 0 && oldSelected == selected && static_cast<unsigned>(selected) < items.size()) {
-        if (OnSubmit)
+        if (OnSubmit) {
+            InvalidateWindow();
             OnSubmit(items[selected], this);
+        }
     }
 }
 
 void GridView::OnKeyPress(int key) {
     if (key == '\n') {
         if (selected >= 0 && static_cast<unsigned>(selected) < items.size()) {
-            if (OnSubmit)
+            if (OnSubmit) {
+                InvalidateWindow();
                 OnSubmit(items[selected], this);
+            }
         }
     } else if (key == KEY_ARROW_UP) {
         if (selected / itemsPerRow > 0) {
             selected -= itemsPerRow;
 
             if (selected >= 0 && static_cast<unsigned>(selected) < items.size()) {
-                if (OnSelect)
+                if (OnSelect) {
+                    InvalidateWindow();
                     OnSelect(items[selected], this);
+                }
             }
         }
     } else if (key == KEY_ARROW_LEFT) {
@@ -1324,8 +1410,10 @@ void GridView::OnKeyPress(int key) {
             selected--;
 
             if (selected >= 0 && static_cast<unsigned>(selected) < items.size()) {
-                if (OnSelect)
+                if (OnSelect) {
+                    InvalidateWindow();
                     OnSelect(items[selected], this);
+                }
             }
         }
     } else if (key == KEY_ARROW_DOWN) {
@@ -1337,8 +1425,10 @@ void GridView::OnKeyPress(int key) {
             }
 
             if (selected >= 0 && static_cast<unsigned>(selected) < items.size()) {
-                if (OnSelect)
+                if (OnSelect) {
+                    InvalidateWindow();
                     OnSelect(items[selected], this);
+                }
             }
         }
     } else if (key == KEY_ARROW_RIGHT) {
@@ -1346,8 +1436,10 @@ void GridView::OnKeyPress(int key) {
             selected++;
 
             if (selected >= 0 && static_cast<unsigned>(selected) < items.size()) {
-                if (OnSelect)
+                if (OnSelect) {
+                    InvalidateWindow();
                     OnSelect(items[selected], this);
+                }
             }
         }
     }
@@ -1369,6 +1461,7 @@ int GridView::AddItem(GridItem& item) {
     items.push_back(item);
 
     ResetScrollBar();
+    Invalidate();
 
     return items.size() - 1;
 }
@@ -1403,6 +1496,7 @@ void ScrollView::AddWidget(Widget* w) {
     w->SetWindow(window);
 
     UpdateFixedBounds();
+    Invalidate();
 }
 
 void ScrollView::OnMouseDown(vector2i_t mousePos) {
@@ -1435,9 +1529,11 @@ void ScrollView::OnMouseMove(vector2i_t mousePos) {
     if (sBarVertical.pressed) {
         sBarVertical.OnMouseMoveRelative(mousePos - (vector2i_t){fixedBounds.width - 16, 0});
         UpdateFixedBounds();
+        Invalidate();
     } else if (sBarHorizontal.pressed) {
         sBarHorizontal.OnMouseMoveRelative(mousePos - (vector2i_t){0, fixedBounds.height - 16});
         UpdateFixedBounds();
+        Invalidate();
     } else if (active) {
         active->OnMouseMove(mousePos);
     }
@@ -4,10 +4,12 @@
 #include <Lemon/GUI/Window.h>
 
 #include <Lemon/GUI/WindowServer.h>
+#include <Lemon/System/KernelObject.h>
 
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <sstream>
 
 namespace Lemon::GUI {
@@ -39,7 +41,6 @@ Window::Window(const char* title, vector2i_t size, uint32_t flags, int type, vec
 
     m_windowBufferInfo = (WindowBuffer*)Lemon::MapSharedMemory(m_windowBufferKey);
 
-    m_windowBufferInfo->currentBuffer = 1;
     m_buffer1 = ((uint8_t*)m_windowBufferInfo) + m_windowBufferInfo->buffer1Offset;
     m_buffer2 = ((uint8_t*)m_windowBufferInfo) + m_windowBufferInfo->buffer2Offset;
 
@@ -84,7 +85,6 @@ void Window::Resize(vector2i_t size) {
 
     m_windowBufferInfo = (WindowBuffer*)Lemon::MapSharedMemory(m_windowBufferKey);
 
-    m_windowBufferInfo->currentBuffer = 0;
     m_buffer1 = ((uint8_t*)m_windowBufferInfo) + m_windowBufferInfo->buffer1Offset;
     m_buffer2 = ((uint8_t*)m_windowBufferInfo) + m_windowBufferInfo->buffer2Offset;
 
@@ -92,6 +92,11 @@ void Window::Resize(vector2i_t size) {
     surface.width = size.x;
     surface.height = size.y;
 
+    // The new buffers are not on screen yet
+    m_releasedSerial = m_commitSerial;
+    m_damage.clear();
+    m_damageAll = true;
+
     Paint();
 }
 
@@ -103,21 +108,88 @@ void Window::UpdateFlags(uint32_t flags) {
 }
 
 void Window::SwapBuffers() {
-    while (m_windowBufferInfo->drawing)
-        ; // WM is currently drawing the other buffer
+    CommitBuffer();
 
-    if (surface.buffer == m_buffer1) {
-        m_windowBufferInfo->currentBuffer = 0;
-        surface.buffer = m_buffer2;
-    } else {
-        m_windowBufferInfo->currentBuffer = 1;
-        surface.buffer = m_buffer1;
+    // The caller may start drawing as soon as we return
+    WaitForBuffer();
+}
+
+void Window::Invalidate(const Rect& rect) {
+    if (m_damageAll) {
+        return;
+    }
+
+    // Clip to the window
+    int left = std::max(rect.x, 0);
+    int top = std::max(rect.y, 0);
+    int right = std::min(rect.x + rect.width, surface.width);
+    int bottom = std::min(rect.y + rect.height, surface.height);
+    if (right <= left || bottom <= top) {
+        return;
     }
 
-    m_windowBufferInfo->dirty = 1;
+    Rect damage = {left, top, right - left, bottom - top};
+    for (const Rect& r : m_damage) {
+        if (r.Contains(damage)) {
+            return; // Already damaged
+        }
+    }
+
+    m_damage.push_back(damage);
+}
+
+void Window::CommitBuffer() {
+    uint32_t bufferIndex = (surface.buffer == m_buffer1) ? 0 : 1;
+
+    // No damage means the whole window
+    std::string damage;
+    if (!m_damageAll && m_damage.size() > WINDOW_MAX_DAMAGE_RECTS) {
+        Rect bounds = m_damage.front();
+        for (const Rect& r : m_damage) {
+            int right = std::max(bounds.x + bounds.width, r.x + r.width);
+            int bottom = std::max(bounds.y + bounds.height, r.y + r.height);
+            bounds.x = std::min(bounds.x, r.x);
+            bounds.y = std::min(bounds.y, r.y);
+            bounds.width = right - bounds.x;
+            bounds.height = bottom - bounds.y;
+        }
+
+        damage.assign(reinterpret_cast<const char*>(&bounds), sizeof(Rect));
+    } else if (!m_damageAll) {
+        damage.assign(reinterpret_cast<const char*>(m_damage.data()), m_damage.size() * sizeof(Rect));
+    }
+
+    m_damage.clear();
+    m_damageAll = false;
+
+    WindowServer::Instance()->CommitBuffer(m_windowID, bufferIndex, ++m_commitSerial, damage);
+
+    // The other buffer stays on screen until LemonWM handles the commit
+    surface.buffer = bufferIndex ? m_buffer1 : m_buffer2;
+}
+
+void Window::WaitForBuffer() {
+    WindowServer* server = WindowServer::Instance();
+
+    // LemonWM sends BufferReleased once it has switched to the committed buffer
+    while (m_releasedSerial < m_commitSerial) {
+        server->Poll();
+        if (m_releasedSerial >= m_commitSerial) {
+            break;
+        }
+
+        Lemon::WaitForKernelObject(server->GetHandle().get(), -1);
+    }
 }
 
 void Window::Paint() {
+    WaitForBuffer();
+
+    // These can draw anywhere
+    if (OnPaint || OnPaintEnd || m_windowType == WindowType::Basic) {
+        m_damageAll = true;
+    }
+
     if (OnPaint)
         OnPaint(&surface);
 
@@ -132,7 +204,8 @@ void Window::Paint() {
     if (OnPaintEnd)
         OnPaintEnd(&surface);
 
-    SwapBuffers();
+    // Keep drawing whilst LemonWM switches buffers
+    CommitBuffer();
 }
 
 bool Window::PollEvent(LemonEvent& ev) {
@@ -150,8 +223,12 @@ void Window::GUIPollEvents() {
     while (!closed && PollEvent(ev)) {
         // If the handler returns true, the event is not processed.
         auto handler = m_eventHandlers.find(ev.event);
-        if (handler != m_eventHandlers.end() && handler->second(ev)) {
-            continue;
+        if (handler != m_eventHandlers.end()) {
+            InvalidateAll(); // Handlers can change anything
+
+            if (handler->second(ev)) {
+                continue;
+            }
         }
         
         GUIHandleEvent(ev);
@@ -228,12 +305,20 @@ void Window::GUIHandleEvent(LemonEvent& ev) {
         rootContainer.OnRightMouseUp(ev.mousePos);
         break;
     case EventMouseExit:
+        if (menuBar) {
+            menuBar->Invalidate();
+        }
+
         lastMousePos = {INT_MIN, INT_MIN}; // Prevent anything from staying selected
         rootContainer.OnMouseExit(ev.mousePos);
 
         break;
     case EventMouseEnter:
     case EventMouseMoved:
+        if (menuBar && (lastMousePos.y < WINDOW_MENUBAR_HEIGHT || ev.mousePos.y < WINDOW_MENUBAR_HEIGHT)) {
+            menuBar->Invalidate(); // Menu items are highlighted under the mouse
+        }
+
         lastMousePos = ev.mousePos;
 
         if (menuBar && ev.mousePos.y >= 0 && ev.mousePos.y < menuBar->GetFixedBounds().height) {
@@ -265,6 +350,7 @@ void Window::GUIHandleEvent(LemonEvent& ev) {
         break;
     case EventWindowCommand:
         if (menuBar && !rootContainer.active && OnMenuCmd) {
+            InvalidateAll();
             OnMenuCmd(ev.windowCmd, this);
         } else {
             rootContainer.OnCommand(ev.windowCmd);
@@ -277,7 +363,17 @@ void Window::AddWidget(Widget* w) { rootContainer.AddWidget(w); }
 
 void Window::RemoveWidget(Widget* w) { rootContainer.RemoveWidget(w); }
 
-void Window::SetActive(Widget* w) { rootContainer.active = w; }
+void Window::SetActive(Widget* w) {
+    if (rootContainer.active) {
+        rootContainer.active->Invalidate();
+    }
+
+    rootContainer.active = w;
+
+    if (w) {
+        w->Invalidate();
+    }
+}
 
 void Window::DisplayContextMenu(const std::vector<ContextMenuEntry>& entries, vector2i_t pos) {
     if (pos.x == -1 && pos.y == -1) {
@@ -329,7 +425,6 @@ Window::TooltipWindow::TooltipWindow(const char* text, vector2i_t pos, const RGB
 
     windowBufferInfo = (WindowBuffer*)Lemon::MapSharedMemory(windowBufferKey);
 
-    windowBufferInfo->currentBuffer = 0;
     buffer1 = ((uint8_t*)windowBufferInfo) + windowBufferInfo->buffer1Offset;
     buffer2 = ((uint8_t*)windowBufferInfo) + windowBufferInfo->buffer2Offset;
 
@@ -357,7 +452,6 @@ void Window::TooltipWindow::SetText(const char* text) {
 
     windowBufferInfo = (WindowBuffer*)Lemon::MapSharedMemory(windowBufferKey);
 
-    windowBufferInfo->currentBuffer = 1;
     buffer1 = ((uint8_t*)windowBufferInfo) + windowBufferInfo->buffer1Offset;
     buffer2 = ((uint8_t*)windowBufferInfo) + windowBufferInfo->buffer2Offset;
 
@@ -365,6 +459,9 @@ void Window::TooltipWindow::SetText(const char* text) {
     surface.width = textObject.Size().x + 8;
     surface.height = textObject.Size().y + 8;
 
+    // The new buffers are not on screen yet
+    releasedSerial = commitSerial;
+
     Paint();
 }
 
@@ -373,19 +470,45 @@ void Window::TooltipWindow::Paint() {
         return;
     }
 
+    WaitForBuffer();
+
     Graphics::DrawRect(0, 0, surface.width, surface.height, backgroundColour, &surface);
 
     textObject.BlitTo(&surface);
 
-    if (surface.buffer == buffer1) {
-        windowBufferInfo->currentBuffer = 0;
-        surface.buffer = buffer2;
-    } else {
-        windowBufferInfo->currentBuffer = 1;
-        surface.buffer = buffer1;
+    uint32_t bufferIndex = (surface.buffer == buffer1) ? 0 : 1;
+    CommitBuffer(windowID, bufferIndex, ++commitSerial, "");
+
+    // The other buffer stays on screen until LemonWM handles the commit
+    surface.buffer = bufferIndex ? buffer1 : buffer2;
+}
+
+void Window::TooltipWindow::WaitForBuffer() {
+    // LemonWM sends BufferReleased once it has switched to the committed buffer
+    while (releasedSerial < commitSerial) {
+        Lemon::Message m;
+        while (Endpoint::Poll(m) > 0) {
+            HandleMessage(m_handle, m);
+        }
+
+        if (releasedSerial >= commitSerial) {
+            break;
+        }
+
+        Lemon::WaitForKernelObject(GetHandle().get(), -1);
     }
+}
 
-    windowBufferInfo->dirty = 1;
+void Window::TooltipWindow::OnPeerDisconnect(const Lemon::Handle&) {
+    throw std::runtime_error("WindowServer has disconnected!");
+}
+
+void Window::TooltipWindow::OnPing(const Lemon::Handle&, int64_t id) { Pong(id); }
+
+void Window::TooltipWindow::OnBufferReleased(const Lemon::Handle&, int64_t id, uint64_t serial) {
+    if (id == windowID) {
+        releasedSerial = std::max(releasedSerial, serial);
+    }
 }
 
 void WindowMenuBar::Paint(surface_t* surface) {
@@ -3,6 +3,7 @@
 #include <Lemon/GUI/Theme.h>
 #include <Lemon/GUI/Window.h>
 
+#include <algorithm>
 #include <assert.h>
 
 namespace Lemon {
@@ -51,10 +52,22 @@ void WindowServer::OnSendEvent(const Lemon::Handle&, int64_t windowID, int32_t i
     }
 }
 
-void WindowServer::OnThemeUpdated(const Lemon::Handle&) { GUI::Theme::Current().Update(GetSystemTheme()); }
+void WindowServer::OnThemeUpdated(const Lemon::Handle&) {
+    GUI::Theme::Current().Update(GetSystemTheme());
+
+    for (auto& window : m_windows) {
+        window.second->InvalidateAll();
+    }
+}
 
 void WindowServer::OnPing(const Lemon::Handle&, int64_t windowID) { Pong(windowID); }
 
+void WindowServer::OnBufferReleased(const Lemon::Handle&, int64_t windowID, uint64_t serial) {
+    if (auto window = m_windows.find(windowID); window != m_windows.end()) {
+        window->second->m_releasedSerial = std::max(window->second->m_releasedSerial, serial);
+    }
+}
+
 void WindowServer::OnWindowCreated(const Lemon::Handle&, int64_t windowID, uint32_t flags, const std::string& name) {
     if (OnWindowCreatedHandler)
         OnWindowCreatedHandler(windowID, flags, name);
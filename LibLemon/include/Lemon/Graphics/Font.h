@@ -3,6 +3,8 @@
 #include <exception>
 
 namespace Lemon::Graphics {
+class GlyphCache;
+
 struct Font {
     bool monospace = false;
     void* face;
@@ -12,6 +14,8 @@ struct Font {
     int width;
     int tabWidth = 4;
     char* id;
+
+    GlyphCache* glyphCache = nullptr; // Rendered glyphs, created on first use
 };
 
 class FontException : public std::exception {
@@ -44,4 +48,11 @@ Font* LoadFont(const char* path, const char* id = nullptr, int sz = 10);
 Font* GetFont(const char* id);
 
 Font* DefaultFont();
+
+/////////////////////////////
+/// \brief Drop every glyph rendered for a font
+///
+/// Glyphs are rendered again as they get drawn.
+/////////////////////////////
+void ClearGlyphCache(Font* font);
 } // namespace Lemon::Graphics
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Lemon::Graphics {
+
+enum SIMDLevel {
+    SIMDScalar,
+    SIMDSSE2,
+    SIMDSSE41,
+    SIMDAVX2,
+    SIMDLevelCount,
+};
+
+/////////////////////////////
+/// \brief Pixel loops used for drawing
+///
+/// Pixels are 32-bit BGRA with straight alpha. Every level gives exactly the same
+/// results, the scalar kernels are the reference the SIMD kernels are checked against.
+/////////////////////////////
+struct PixelKernels {
+    SIMDLevel level;
+    const char* name;
+
+    // Blend count src pixels over dest
+    void (*blend)(uint32_t* dest, const uint32_t* src, size_t count);
+    // Blend colour over count dest pixels
+    void (*blendFill)(uint32_t* dest, uint32_t colour, size_t count);
+    // Set count dest pixels to colour
+    void (*fill)(uint32_t* dest, uint32_t colour, size_t count);
+    // Copy count pixels, src and dest must not overlap
+    void (*copy)(uint32_t* dest, const uint32_t* src, size_t count);
+    // Gradient from c1 to c2 over length pixels, draws count pixels starting at pixel start.
+    // start + count must not be more than length
+    void (*gradient)(uint32_t* dest, uint32_t c1, uint32_t c2, int start, int length, size_t count);
+
+    // Scale src into width x height pixels of dest. Pitches are in pixels,
+    // steps are the source pixels per destination pixel in 16.16 fixed point.
+    // Bilinear filtering is used for enlarging or shrinking by less than half
+    void (*scaleBilinear)(uint32_t* dest, int destPitch, int width, int height, const uint32_t* src, int srcPitch,
+                          int srcWidth, int srcHeight, uint32_t stepX, uint32_t stepY);
+    // Averages the box of source pixels covered by each destination pixel
+    void (*scaleBox)(uint32_t* dest, int destPitch, int width, int height, const uint32_t* src, int srcPitch,
+                     int srcWidth, int srcHeight, uint32_t stepX, uint32_t stepY);
+};
+
+/////////////////////////////
+/// \brief Get the fastest kernels supported by the CPU
+///
+/// Detected using CPUID the first time it is called
+/////////////////////////////
+const PixelKernels& Kernels();
+
+/////////////////////////////
+/// \brief Get the kernels for a SIMD level
+///
+/// \return Kernels, nullptr if the CPU does not support the level
+/////////////////////////////
+const PixelKernels* GetKernels(SIMDLevel level);
+
+/////////////////////////////
+/// \brief Scale pixels from src by xScale and yScale
+///
+/// Picks box filtering when shrinking by half or more and bilinear filtering otherwise.
+/// Only the part of the width x height area which maps to src gets drawn.
+/////////////////////////////
+void ScalePixels(uint32_t* dest, int destPitch, int width, int height, const uint32_t* src, int srcPitch, int srcWidth,
+                 int srcHeight, double xScale, double yScale);
+
+} // namespace Lemon::Graphics
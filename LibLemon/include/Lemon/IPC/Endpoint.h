@@ -9,11 +9,14 @@
 #include <Lemon/Core/Logger.h>
 
 #include <Lemon/IPC/Message.h>
+#include <Lemon/IPC/Ring.h>
 
 #include <assert.h>
 #include <stdint.h>
 #include <fcntl.h>
 
+#include <deque>
+
 namespace Lemon {
 class EndpointException : public std::exception {
 public:
@@ -40,7 +43,9 @@ public:
 
     Endpoint(const Lemon::Endpoint& other) = delete;
 
-    Endpoint(Lemon::Endpoint&& other) : m_handle(std::move(other.m_handle)), m_msgSize(other.m_msgSize) {
+    Endpoint(Lemon::Endpoint&& other)
+        : m_handle(std::move(other.m_handle)), m_msgSize(other.m_msgSize), m_ring(other.m_ring),
+          m_replies(std::move(other.m_replies)) {
         assert(m_handle.get() > 0);
 
         other.m_handle = Handle();
@@ -51,6 +56,8 @@ public:
 
         m_handle = h;
         this->m_msgSize = msgSize;
+
+        m_ring.Map(m_handle.get());
     }
 
     Endpoint(Handle h) {
@@ -58,6 +65,12 @@ public:
 
         m_handle = h;
 
+        // Mapping the ring gets us the message size too
+        if (!m_ring.Map(m_handle.get())) {
+            this->m_msgSize = m_ring.GetMessageSize();
+            return;
+        }
+
         LemonEndpointInfo endpInfo;
         if (long ret = EndpointInfo(m_handle.get(), endpInfo); ret) {
             if (ret == -EINVAL) {
@@ -97,11 +110,15 @@ public:
 
         m_handle = Handle(handle);
         m_msgSize = endpInfo.msgSize;
+
+        m_ring.Map(handle);
     }
 
     Lemon::Endpoint& operator=(Lemon::Endpoint&& other) {
         m_handle = std::move(other.m_handle);
         m_msgSize = other.m_msgSize;
+        m_ring = other.m_ring;
+        m_replies = std::move(other.m_replies);
 
         assert(m_handle.get());
 
@@ -142,23 +159,40 @@ public:
     /////////////////////////////
     inline uint16_t GetMessageSize() const { return m_msgSize; }
 
+    /////////////////////////////
+    /// \brief Check if messages go through shared memory
+    ///
+    /// \return true when the endpoint has its rings mapped
+    /////////////////////////////
+    inline bool IsRingMapped() const { return m_ring.IsMapped(); }
+
     inline long Queue(uint64_t id, const uint8_t* data, uint16_t size) {
+        if (m_ring.IsMapped() && m_ring.Write(m_handle.get(), id, data, size)) {
+            return 0;
+        }
+
         return EndpointQueue(m_handle.get(), id, size, reinterpret_cast<uintptr_t>(data));
     }
 
     inline long Queue(uint64_t id, uint64_t data, uint16_t size) {
-        return EndpointQueue(m_handle.get(), id, size, data);
+        return Queue(id, reinterpret_cast<const uint8_t*>(data), size);
     }
 
-    inline long Queue(const Message& m) {
-        return EndpointQueue(m_handle.get(), m.id(), m.length(), reinterpret_cast<uintptr_t>(m.data()));
-    }
+    inline long Queue(const Message& m) { return Queue(m.id(), m.data(), m.length()); }
 
     inline long Poll(Message& m) {
+        if (m_replies.size()) { // Messages we skipped over whilst waiting for a reply
+            PendingMessage& pending = m_replies.front();
+            m.Set(pending.data, pending.size, pending.id);
+
+            m_replies.pop_front();
+            return 1;
+        }
+
         uint64_t id;
         uint16_t size;
         uint8_t* data = new uint8_t[m_msgSize];
-        long ret = EndpointDequeue(m_handle.get(), &id, &size, data);
+        long ret = Receive(id, size, data);
 
         if (ret > 0) {
             m.Set(data, size, id);
@@ -169,6 +203,21 @@ public:
     }
 
     inline long Call(const Message& call, Message& rmsg, uint64_t id) {
+        if (m_ring.IsMapped()) {
+            // The reply is written to our ring, so wait for it ourselves
+            if (long ret = Queue(call); ret) {
+                return ret;
+            }
+
+            PendingMessage reply;
+            if (long ret = WaitForReply(id, reply); ret) {
+                return ret;
+            }
+
+            rmsg.Set(reply.data, reply.size, reply.id);
+            return 0;
+        }
+
         uint16_t size = call.length();
         uint8_t* data = new uint8_t[m_msgSize];
 
@@ -184,6 +233,21 @@ public:
     }
 
     inline long Call(Message& call, uint64_t id) { // Use the same buffer for return
+        if (m_ring.IsMapped()) {
+            if (long ret = Queue(call); ret) {
+                return ret;
+            }
+
+            PendingMessage reply;
+            if (long ret = WaitForReply(id, reply); ret) {
+                return ret;
+            }
+
+            delete[] call.m_data;
+            call.Set(reply.data, reply.size, reply.id);
+            return 0;
+        }
+
         uint16_t size = call.length();
         uint8_t* data = const_cast<uint8_t*>(call.data());
 
@@ -197,7 +261,50 @@ public:
     }
 
 protected:
+    struct PendingMessage {
+        uint64_t id;
+        uint16_t size;
+        uint8_t* data;
+    };
+
+    inline long Receive(uint64_t& id, uint16_t& size, uint8_t* data) {
+        if (m_ring.IsMapped()) {
+            return m_ring.Read(m_handle.get(), id, size, data);
+        }
+
+        return EndpointDequeue(m_handle.get(), &id, &size, data);
+    }
+
+    // Anything that arrives before the reply is kept for Poll
+    inline long WaitForReply(uint64_t id, PendingMessage& reply) {
+        uint8_t* data = new uint8_t[m_msgSize];
+        for (;;) {
+            uint64_t msgID;
+            uint16_t size;
+
+            long ret = Receive(msgID, size, data);
+            if (ret < 0) {
+                delete[] data;
+                return ret;
+            } else if (!ret) {
+                WaitForKernelObject(m_handle.get(), -1);
+                continue;
+            }
+
+            if (msgID == id) {
+                reply = {msgID, size, data};
+                return 0;
+            }
+
+            m_replies.push_back({msgID, size, data});
+            data = new uint8_t[m_msgSize];
+        }
+    }
+
     Handle m_handle;
     uint16_t m_msgSize = 512;
+
+    EndpointRing m_ring;
+    std::deque<PendingMessage> m_replies;
 };
 }; // namespace Lemon
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <Lemon/IPC/Message.h>
+#include <Lemon/IPC/Ring.h>
 #include <string.h>
 
 #include <list>
@@ -65,6 +66,9 @@ private:
     // Repopulate the std::vector of raw handles
     void RepopulateRawHandles();
 
+    // Read a message from a client, through its ring if it has one
+    long Receive(handle_t client, uint64_t& id, uint16_t& size, uint8_t* data);
+
 protected:
     struct InterfaceMessageInfo {
         Handle client;
@@ -76,6 +80,7 @@ protected:
     std::map<std::string, int> m_objects;
     std::vector<handle_t> m_rawEndpoints;
     std::list<Handle> m_endpoints;
+    std::map<handle_t, EndpointRing> m_rings;
     uint16_t m_msgSize;
     uint8_t* m_dataBuffer = nullptr;
 
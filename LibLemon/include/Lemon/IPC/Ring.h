@@ -0,0 +1,59 @@
+#pragma once
+
+#include <Lemon/System/ABI/IPC.h>
+#include <Lemon/Types.h>
+
+#include <stdint.h>
+
+namespace Lemon {
+/////////////////////////////
+/// \brief Shared memory transport of an endpoint
+///
+/// Once mapped, messages are written straight to the peer's ring and read from ours,
+/// the kernel is only needed to wake the peer when its ring was empty.
+/// Any messages the peer sent before the ring was mapped are read through the kernel first.
+/////////////////////////////
+class EndpointRing final {
+public:
+    /////////////////////////////
+    /// \brief Map the rings of an endpoint
+    ///
+    /// \param endpoint Handle ID of the endpoint
+    ///
+    /// \return 0 on success, negative error code on failure
+    /////////////////////////////
+    long Map(handle_t endpoint);
+
+    inline bool IsMapped() const { return m_info.base; }
+    inline uint16_t GetMessageSize() const { return m_info.msgSize; }
+
+    /////////////////////////////
+    /// \brief Write a message to the peer's ring
+    ///
+    /// \return 1 on success, 0 when the message has to be sent through the kernel instead
+    /////////////////////////////
+    long Write(handle_t endpoint, uint64_t id, const uint8_t* data, uint16_t size);
+
+    /////////////////////////////
+    /// \brief Read a message
+    ///
+    /// \param data Buffer of at least the maximum message size
+    ///
+    /// \return 1 on success, 0 on empty, negative error code on failure
+    /////////////////////////////
+    long Read(handle_t endpoint, uint64_t& id, uint16_t& size, uint8_t* data);
+
+private:
+    inline lemon_endpoint_ring_t* Ring(uint32_t index) {
+        return reinterpret_cast<lemon_endpoint_ring_t*>(m_info.base + index * LEMON_ENDPOINT_RING_HEADER_SIZE);
+    }
+
+    inline lemon_endpoint_ring_slot_t* Slot(uint32_t index, uint64_t n) {
+        return reinterpret_cast<lemon_endpoint_ring_slot_t*>(m_info.base + m_info.dataOffset[index] +
+                                                             (n & (m_info.slotCount - 1)) * m_info.slotSize);
+    }
+
+    lemon_endpoint_ring_info_t m_info = {};
+    bool m_kernelQueueEmpty = false; // Messages sent before the ring was mapped have been read
+};
+} // namespace Lemon
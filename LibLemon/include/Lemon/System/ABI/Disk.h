@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+enum DiskIoCtl {
+    IoCtlDiskGetQueueStats = 0x1000, // Fill a lemon_disk_queue_stats_t
+    IoCtlDiskSetQueueDepth = 0x1001, // Set the amount of commands given to the driver at once
+    IoCtlDiskResetQueueStats = 0x1002,
+};
+
+#define LEMON_DISK_LATENCY_BUCKETS 20
+
+typedef struct {
+    uint32_t queueDepth; // Most commands given to the driver at once
+    uint32_t inFlight;   // Commands the driver is currently processing
+    uint32_t queued;     // Commands waiting to be given to the driver
+    uint32_t blocksize;
+
+    uint64_t requests;   // Requests submitted
+    uint64_t dispatched; // Commands given to the driver
+    uint64_t merges;     // Requests merged into an adjacent request
+    uint64_t bounced;    // Merged commands whose buffers were not contiguous and had to be copied
+    uint64_t expired;    // Commands dispatched out of order as their deadline passed
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t errors;
+
+    // Request latency from submission to completion,
+    // bucket 0 is below 2us and bucket n counts latencies of [2^n, 2^(n + 1)) us
+    uint64_t latency[LEMON_DISK_LATENCY_BUCKETS];
+} lemon_disk_queue_stats_t;
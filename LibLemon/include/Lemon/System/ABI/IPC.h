@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+// A connected endpoint pair can share a mapping of two rings, one for each direction,
+// so that messages are passed without going through the kernel
+
+#define LEMON_ENDPOINT_RING_SIZE 0x10000 // Memory for the slots of each ring
+#define LEMON_ENDPOINT_RING_MIN_SLOTS 4
+#define LEMON_ENDPOINT_RING_MAX_SLOTS 256
+
+#define LEMON_ENDPOINT_RING_HEADER_SIZE 256 // Both ring headers share the first page of the mapping
+
+typedef struct {
+    uint64_t id;
+    uint16_t size;
+    uint16_t reserved[3];
+    uint8_t data[];
+} lemon_endpoint_ring_slot_t;
+
+// The other side can write to anything in the mapping, so the ring geometry is
+// returned by the kernel and not kept here
+typedef struct {
+    // Only written whilst holding producerLock
+    uint64_t tail; // Amount of messages written
+    uint32_t producerLock;
+    uint32_t reserved0;
+    uint8_t pad0[48];
+
+    // Only written whilst holding consumerLock
+    uint64_t head; // Amount of messages read
+    uint32_t consumerLock;
+    uint32_t reserved1;
+    uint8_t pad1[48];
+
+    // Set by the kernel once the consumer reads from the ring,
+    // before that messages have to go through the kernel
+    uint32_t consumerAttached;
+    // Set by the kernel once the producer's endpoint has been destroyed
+    uint32_t producerClosed;
+} lemon_endpoint_ring_t;
+
+typedef struct {
+    uint64_t base;          // Address of the mapping
+    uint64_t dataOffset[2]; // Offset of each ring's first slot from base
+    uint32_t rx;            // Index of the ring we read from
+    uint32_t tx;            // Index of the ring we write to
+    uint32_t slotCount;     // Power of two
+    uint32_t slotSize;      // Including the slot header
+    uint16_t msgSize;       // Maximum message size
+} lemon_endpoint_ring_info_t;
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+// Layers of the network stack which packet buffers are counted against
+enum NetLayer {
+    NetLayerDriver,   // Network adapters and their rings
+    NetLayerEthernet, // Link layer, including ARP
+    NetLayerIPv4,
+    NetLayerUDP,
+    NetLayerTCP,
+    NetLayerSocket, // Copies between process memory and the kernel
+    NetLayerCount,
+};
+
+typedef struct {
+    uint64_t allocations; // Packet buffers taken from the pool
+    uint64_t copies;      // Times packet data was copied
+    uint64_t bytesCopied;
+    uint64_t drops; // Packets thrown away, including when no buffer was available
+} lemon_net_layer_stats_t;
+
+// Read from /dev/net/stats, counters only ever go up
+typedef struct {
+    uint32_t buffers;     // Packet buffers allocated, in use or free
+    uint32_t freeBuffers; // Buffers in the pool, not counting those cached by each CPU
+    lemon_net_layer_stats_t layers[NetLayerCount];
+} lemon_net_stats_t;
@@ -0,0 +1,16 @@
+#pragma once
+
+// Pipe buffers are 64 KiB unless resized, sizes are rounded up to a power of two between 4 KiB and 1 MiB
+enum PipeIoCtl {
+    IoCtlPipeSetSize = 0x1000, // Returns the new size, fails with EBUSY if the unread data does not fit
+    IoCtlPipeGetSize = 0x1001,
+};
+
+// Flags for SYS_SPLICE and SYS_TEE
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1 // Ignored, data is always moved without going through userspace
+#endif
+
+#ifndef SPLICE_F_NONBLOCK
+#define SPLICE_F_NONBLOCK 2 // Do not wait on pipes
+#endif
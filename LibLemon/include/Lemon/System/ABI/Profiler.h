@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+enum ProfilerIoCtl {
+    IoCtlProfilerStart = 0x3100,         // Start sampling with a lemon_profiler_config_t, clears unread samples
+    IoCtlProfilerStop = 0x3101,          // Stop sampling, samples can still be read
+    IoCtlProfilerGetInfo = 0x3102,       // Fill a lemon_profiler_info_t
+    IoCtlProfilerGetExecutable = 0x3103, // lemon_profiler_read_t, copy the path of the process's executable
+    IoCtlProfilerReadMemory = 0x3104,    // lemon_profiler_read_t, read the memory of a process for symbolising.
+                                         // Returns the amount of bytes read, which stops short at pages not present
+};
+
+#define LEMON_PROFILER_MAX_FRAMES 30
+
+#define LEMON_PROFILER_DEFAULT_FREQUENCY 1000
+#define LEMON_PROFILER_MAX_FREQUENCY 10000
+
+typedef struct {
+    int32_t pid;        // Process to sample, -1 for every process
+    uint32_t frequency; // Samples per second on each CPU, 0 for the default
+} lemon_profiler_config_t;
+
+// frames[0] is the innermost frame. The kernel frames (if any) come first,
+// then the user frames of the thread
+typedef struct {
+    uint64_t timestamp; // Nanoseconds since boot
+    int32_t pid;
+    int32_t tid;
+    uint16_t cpu;
+    uint16_t kernelFrames;
+    uint16_t userFrames;
+    uint16_t reserved;
+    uint64_t frames[LEMON_PROFILER_MAX_FRAMES];
+} lemon_profile_sample_t;
+
+typedef struct {
+    uint32_t cpuCount;
+    uint32_t samplesPerCPU; // Samples each CPU keeps before overwriting the oldest
+    uint32_t enabled;
+    uint32_t frequency;
+    int32_t pid;
+    uint32_t reserved;
+    uint64_t pending; // Samples waiting to be read
+    uint64_t lost;    // Samples overwritten before they were read
+} lemon_profiler_info_t;
+
+typedef struct {
+    int32_t pid;
+    uint32_t reserved;
+    uint64_t address; // Ignored for IoCtlProfilerGetExecutable
+    void* buffer;
+    uint64_t size;
+} lemon_profiler_read_t;
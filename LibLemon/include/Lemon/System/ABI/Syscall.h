@@ -109,3 +109,11 @@
 #define SYS_EPOLL_CREATE 108
 #define SYS_EPOLL_CTL 109
 #define SYS_EPOLL_WAIT 110
+#define SYS_FCHDIR 111
+#define SYS_VFORK 112
+#define SYS_ENDPOINT_MAP_RING 113
+#define SYS_ENDPOINT_NOTIFY 114
+#define SYS_SPLICE 115
+#define SYS_TEE 116
+#define SYS_SENDMMSG 117
+#define SYS_RECVMMSG 118
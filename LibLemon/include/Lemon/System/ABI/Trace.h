@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+enum TraceIoCtl {
+    IoCtlTraceEnable = 0x3000,  // Start recording events
+    IoCtlTraceDisable = 0x3001, // Stop recording, records can still be read
+    IoCtlTraceClear = 0x3002,   // Throw away every unread record
+    IoCtlTraceGetInfo = 0x3003, // Fill a lemon_trace_info_t
+};
+
+enum TraceEventType {
+    TraceEventNone,
+    TraceEventSchedSwitch,   // args: previous pid, previous tid, previous thread state. pid and tid are the next thread
+    TraceEventSyscallEntry,  // args: syscall number
+    TraceEventSyscallExit,   // args: syscall number, return value
+    TraceEventPageFault,     // args: address, error code, instruction pointer
+    TraceEventPageFaultEnd,  // args: address
+    TraceEventBlockSubmit,   // args: request, lba, size in bytes with bit 63 set for writes
+    TraceEventBlockComplete, // args: request, lba, status
+    TraceEventIPCSend,       // args: receiving endpoint, message id, message size
+    TraceEventIPCReceive,    // args: receiving endpoint, message id, message size
+    TraceEventIRQEntry,      // args: interrupt vector
+    TraceEventIRQExit,       // args: interrupt vector
+    TraceEventTypeCount,
+};
+
+#define LEMON_TRACE_BLOCK_WRITE (1UL << 63)
+
+typedef struct {
+    uint64_t timestamp; // Nanoseconds since boot
+    uint16_t type;      // TraceEventType
+    uint16_t cpu;
+    int32_t pid; // Process and thread running when the event was recorded, -1 if none
+    int32_t tid;
+    uint32_t reserved;
+    uint64_t args[3];
+} lemon_trace_record_t;
+
+typedef struct {
+    uint32_t cpuCount;
+    uint32_t recordsPerCPU; // Records each CPU keeps before overwriting the oldest
+    uint32_t enabled;
+    uint32_t reserved;
+    uint64_t pending; // Records waiting to be read
+    uint64_t lost;    // Records overwritten before they were read
+} lemon_trace_info_t;
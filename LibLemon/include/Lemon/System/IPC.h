@@ -1,5 +1,6 @@
 #pragma once
 
+#include <Lemon/System/ABI/IPC.h>
 #include <Lemon/Types.h>
 #include <lemon/syscall.h>
 
@@ -140,4 +141,32 @@ __attribute__((always_inline)) inline long EndpointCall(handle_t endpoint, uint6
 __attribute__((always_inline)) inline long EndpointInfo(handle_t endp, LemonEndpointInfo& info) {
     return syscall(SYS_ENDPOINT_INFO, endp, &info);
 }
+
+/////////////////////////////
+/// \brief EndpointMapRing (endpoint, info)
+///
+/// Map the shared memory rings of an endpoint pair.
+/// Once mapped, messages sent to the endpoint are written to the ring.
+///
+/// \param endpoint Endpoint handle
+/// \param info Ring information to be populated
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+__attribute__((always_inline)) inline long EndpointMapRing(handle_t endp, lemon_endpoint_ring_info_t& info) {
+    return syscall(SYS_ENDPOINT_MAP_RING, endp, &info);
+}
+
+/////////////////////////////
+/// \brief EndpointNotify (endpoint)
+///
+/// Wake anything waiting on the peer of an endpoint after writing to a ring that was empty.
+///
+/// \param endpoint Endpoint handle
+///
+/// \return 0 on success, negative error code on failure
+/////////////////////////////
+__attribute__((always_inline)) inline long EndpointNotify(handle_t endp) {
+    return syscall(SYS_ENDPOINT_NOTIFY, endp);
+}
 } // namespace Lemon
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <Lemon/Graphics/Font.h>
+
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+namespace Lemon::Graphics {
+
+// A rendered glyph, the coverage stays valid until the cache is cleared
+struct Glyph {
+    uint32_t index;          // FreeType glyph index, used for kerning
+    int top;                 // Distance from the baseline to the top row of the bitmap
+    int advance;             // Horizontal advance in pixels
+    uint16_t width;          // Bitmap width in pixels
+    uint16_t rows;           // Bitmap height in pixels
+    uint16_t pitch;          // Distance between rows of coverage in bytes
+    const uint8_t* coverage; // 8-bit coverage of the first row, inside an atlas page
+};
+
+/////////////////////////////
+/// \brief Rendered glyphs of a font
+///
+/// Glyphs are rendered by FreeType the first time they are used and their coverage
+/// is packed into shelves of large atlas pages, so drawing and measuring text
+/// afterwards is a lookup. A font only has one size, if it changes the cache is cleared.
+/////////////////////////////
+class GlyphCache final {
+public:
+    static constexpr int atlasPageSize = 512;
+
+    GlyphCache(Font* font);
+    ~GlyphCache();
+
+    /////////////////////////////
+    /// \brief Get a glyph, rendering it if not cached
+    ///
+    /// \param codepoint Unicode codepoint
+    ///
+    /// \return Glyph, empty with no advance if the font could not render it
+    /////////////////////////////
+    inline const Glyph& GetGlyph(uint32_t codepoint) {
+        if (codepoint < 128 && m_ascii[codepoint] && m_pixelHeight == m_font->pixelHeight) {
+            return *m_ascii[codepoint];
+        }
+
+        return LoadGlyph(codepoint);
+    }
+
+    void Clear();
+
+private:
+    const Glyph& LoadGlyph(uint32_t codepoint);
+
+    // Find space for a bitmap in the atlas, returns a pointer to its first row
+    uint8_t* Allocate(int width, int rows, int& pitch);
+
+    Font* m_font;
+    int m_pixelHeight;
+
+    std::unordered_map<uint32_t, Glyph> m_glyphs;
+    const Glyph* m_ascii[128] = {}; // Elements of m_glyphs do not move
+
+    std::vector<uint8_t*> m_pages;
+    uint8_t* m_page = nullptr; // Page being filled
+    int m_shelfX = 0;
+    int m_shelfY = 0;
+    int m_shelfHeight = 0;
+};
+
+} // namespace Lemon::Graphics
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <Lemon/Graphics/Graphics.h>
+#include <Lemon/Graphics/PixelKernels.h>
+
+#include <stdint.h>
+
+// Helpers shared by every level of the pixel kernels.
+// They have internal linkage so a copy inlined into AVX2 code never gets used by another level.
+
+namespace Lemon::Graphics {
+
+extern const PixelKernels scalarKernels;
+extern const PixelKernels sse2Kernels;
+extern const PixelKernels sse41Kernels;
+extern const PixelKernels avx2Kernels;
+
+// Divide by 255 with rounding, exact for 0 <= x <= 65535
+static inline uint32_t Div255(uint32_t x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+// c = (s * a + d * (255 - a)) / 255
+//
+// When the destination is opaque this is the same as blending premultiplied colours
+// and the result is opaque. Otherwise fall back to the straight alpha blend.
+static inline uint32_t BlendPixel(uint32_t dest, uint32_t src) {
+    uint32_t a = src >> 24;
+    if (a == 0) {
+        return dest;
+    } else if (a == 255) {
+        return src;
+    } else if ((dest >> 24) != 255) {
+        return AlphaBlendInt(dest, src);
+    }
+
+    uint32_t result = 0xff000000;
+    for (int shift = 0; shift < 24; shift += 8) {
+        uint32_t s = (src >> shift) & 0xff;
+        uint32_t d = (dest >> shift) & 0xff;
+        result |= Div255(s * a + d * (255 - a)) << shift;
+    }
+
+    return result;
+}
+
+// Each channel is interpolated in 16.16 fixed point,
+// pixel j has the value (base + j * step) >> 16
+struct GradientSteps {
+    int32_t base[4];
+    int32_t step[4];
+};
+
+static inline GradientSteps GetGradientSteps(uint32_t c1, uint32_t c2, int length) {
+    if (length < 1) {
+        length = 1;
+    }
+
+    GradientSteps g;
+    for (int i = 0; i < 4; i++) {
+        int32_t from = (c1 >> (i * 8)) & 0xff;
+        int32_t to = (c2 >> (i * 8)) & 0xff;
+
+        g.base[i] = from << 16;
+        g.step[i] = (to - from) * 65536 / length;
+    }
+
+    return g;
+}
+
+static inline uint32_t GradientPixel(const GradientSteps& g, int j) {
+    uint32_t pixel = 0;
+    for (int i = 0; i < 4; i++) {
+        pixel |= static_cast<uint32_t>((g.base[i] + j * g.step[i]) >> 16) << (i * 8);
+    }
+
+    return pixel;
+}
+
+// Source position of a destination pixel in 16.16 fixed point, clamped to the last source pixel
+static inline int ScaleSourceIndex(int i, uint32_t step, int srcSize) {
+    uint64_t pos = (static_cast<uint64_t>(i) * step) >> 16;
+    return pos < static_cast<uint64_t>(srcSize) ? static_cast<int>(pos) : srcSize - 1;
+}
+
+// Fractional part of the source position in 1/256ths
+static inline uint32_t ScaleSourceFraction(int i, uint32_t step) {
+    return ((static_cast<uint64_t>(i) * step) >> 8) & 0xff;
+}
+
+// Source pixels [start, end) covered by a destination pixel, always at least one
+static inline void ScaleSourceBox(int i, uint32_t step, int srcSize, int& start, int& end) {
+    start = ScaleSourceIndex(i, step, srcSize);
+
+    uint64_t next = (static_cast<uint64_t>(i + 1) * step) >> 16;
+    if (next > static_cast<uint64_t>(srcSize)) {
+        next = srcSize;
+    }
+
+    end = static_cast<int>(next) > start ? static_cast<int>(next) : start + 1;
+}
+
+// Boxes with fewer pixels than this are averaged with a reciprocal, larger ones get divided
+#define BOX_RECIPROCAL_MAX_COUNT 4096
+
+// 0.32 fixed point reciprocal of the pixel count of a box, 0 if the sums have to be divided instead.
+// It is rounded up, which keeps BoxAverage exact as long as (sum + count / 2) * count < 2^32.
+static inline uint32_t BoxReciprocal(uint32_t count) {
+    if (count < 2 || count >= BOX_RECIPROCAL_MAX_COUNT) {
+        return 0;
+    }
+
+    return static_cast<uint32_t>(((1ULL << 32) + count - 1) / count);
+}
+
+// Average of one channel summed over a box, rounded to the nearest value
+static inline uint32_t BoxAverage(uint32_t sum, uint32_t count, uint32_t recip) {
+    uint32_t n = sum + count / 2;
+    if (!recip) {
+        return n / count;
+    }
+
+    return static_cast<uint32_t>((static_cast<uint64_t>(n) * recip) >> 32);
+}
+
+} // namespace Lemon::Graphics
@@ -4,41 +4,48 @@
 #include <Lemon/Graphics/Graphics.h>
 #include <Lemon/Graphics/Rect.h>
 
+#include <Lemon/Graphics/PixelKernels.h>
+
 #include "FastMem.h"
 
+using Lemon::Graphics::Kernels;
+
 void Surface::Blit(const Surface* src) {
+    const uint32_t* srcPixels = reinterpret_cast<const uint32_t*>(src->buffer);
+    uint32_t* destPixels = reinterpret_cast<uint32_t*>(buffer);
+
     if (width == src->width) {
-        memcpy_optimized(buffer, src->buffer, width * std::min(height, src->height));
+        Kernels().copy(destPixels, srcPixels, width * std::min(height, src->height));
         return;
     }
 
     int copySize = std::min(width, src->width); // Amount of uint32_ts to copy
-    int srcPitch = src->width << 2;             // Bytes needed to get to next line in source surface
     int effectiveHeight = std::min(height, src->height);
 
     for (int i = 0; i < effectiveHeight; i++) {
-        memcpy_optimized(buffer + (width << 2) * i, src->buffer + srcPitch * i, copySize);
+        Kernels().copy(destPixels + width * i, srcPixels + src->width * i, copySize);
     }
 }
 
 void Surface::Blit(const Surface* src, const Vector2i& offset) {
-    int xOffset = std::max(offset.x, 0) << 2;
+    int xOffset = std::max(offset.x, 0);
     int yOffset = std::max(offset.y, 0);
 
     // Account for negative offsets
     int srcXOffset = std::max(-offset.x, 0);
     int srcYOffset = std::max(-offset.y, 0);
 
-    int effectiveWidth = std::min(src->width - srcXOffset, width - offset.x);
-    int effectiveHeight = std::min(src->height - srcYOffset, height - offset.y);
+    int effectiveWidth = std::min(src->width - srcXOffset, width - xOffset);
+    int effectiveHeight = std::min(src->height - srcYOffset, height - yOffset);
     if (effectiveWidth <= 0 || effectiveHeight <= 0) {
         return; // No pixels to copy
     }
 
     int srcPitch = src->width << 2; // Bytes needed to get to next line in source surface
     for (int i = 0; i < effectiveHeight; i++) {
-        memcpy_optimized(buffer + (width << 2) * (i + yOffset) + (xOffset << 2),
-                         src->buffer + srcPitch * i + (srcXOffset << 2), effectiveWidth);
+        Kernels().copy(reinterpret_cast<uint32_t*>(buffer + (width << 2) * (i + yOffset) + (xOffset << 2)),
+                       reinterpret_cast<const uint32_t*>(src->buffer + srcPitch * (i + srcYOffset) + (srcXOffset << 2)),
+                       effectiveWidth);
     }
 }
 
@@ -75,12 +82,12 @@ void Surface::Blit(const Surface* src, const Vector2i& offset, const Rect& regio
     int srcPitch = src->width << 2; // Bytes needed to get to next line in source surface
 
     for (int i = 0; i < effectiveHeight; i++) {
-        memcpy_optimized(buffer + (width << 2) * (i + yOffset) + (xOffset << 2),
-                         src->buffer + srcPitch * (i + sourceYOffset) + (sourceXOffset << 2), effectiveWidth);
+        Kernels().copy(reinterpret_cast<uint32_t*>(buffer + (width << 2) * (i + yOffset) + (xOffset << 2)),
+                       reinterpret_cast<const uint32_t*>(src->buffer + srcPitch * (i + sourceYOffset) + (sourceXOffset << 2)),
+                       effectiveWidth);
     }
 }
 
-// TODO: Fast blit in asm
 void Surface::AlphaBlit(const Surface* src, const Vector2i& offset, const Rect& region) {
     int xOffset = offset.x;
     int yOffset = offset.y;
@@ -116,7 +123,7 @@ void Surface::AlphaBlit(const Surface* src, const Vector2i& offset, const Rect&
     for (int i = 0; i < effectiveHeight; i++) {
         alphablend_optimized(
             reinterpret_cast<uint32_t*>(buffer + (width << 2) * (i + yOffset) + (xOffset << 2)),
-            reinterpret_cast<uint32_t*>(src->buffer + srcPitch * (i + sourceYOffset) + (sourceXOffset << 2)),
+            reinterpret_cast<const uint32_t*>(src->buffer + srcPitch * (i + sourceYOffset) + (sourceXOffset << 2)),
             effectiveWidth);
     }
 }
\ No newline at end of file
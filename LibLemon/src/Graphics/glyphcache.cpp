@@ -0,0 +1,108 @@
+#include "GlyphCache.h"
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <string.h>
+
+namespace Lemon::Graphics {
+GlyphCache::GlyphCache(Font* font) : m_font(font), m_pixelHeight(font->pixelHeight) {}
+
+GlyphCache::~GlyphCache() { Clear(); }
+
+void GlyphCache::Clear() {
+    for (uint8_t* page : m_pages) {
+        delete[] page;
+    }
+
+    m_pages.clear();
+    m_glyphs.clear();
+    memset(m_ascii, 0, sizeof(m_ascii));
+
+    m_page = nullptr;
+    m_shelfX = m_shelfY = m_shelfHeight = 0;
+    m_pixelHeight = m_font->pixelHeight;
+}
+
+const Glyph& GlyphCache::LoadGlyph(uint32_t codepoint) {
+    if (m_pixelHeight != m_font->pixelHeight) {
+        Clear();
+    }
+
+    if (auto it = m_glyphs.find(codepoint); it != m_glyphs.end()) {
+        return it->second;
+    }
+
+    FT_Face face = (FT_Face)m_font->face;
+
+    Glyph glyph = {};
+    glyph.index = FT_Get_Char_Index(face, codepoint);
+
+    if (!FT_Load_Glyph(face, glyph.index, FT_LOAD_RENDER)) {
+        FT_Bitmap& bitmap = face->glyph->bitmap;
+
+        glyph.top = face->glyph->bitmap_top;
+        glyph.advance = face->glyph->advance.x >> 6;
+
+        if (bitmap.width && bitmap.rows && bitmap.pixel_mode == FT_PIXEL_MODE_GRAY) {
+            int pitch;
+            uint8_t* coverage = Allocate(bitmap.width, bitmap.rows, pitch);
+            for (unsigned i = 0; i < bitmap.rows; i++) {
+                memcpy(coverage + i * pitch, bitmap.buffer + i * bitmap.pitch, bitmap.width);
+            }
+
+            glyph.width = bitmap.width;
+            glyph.rows = bitmap.rows;
+            glyph.pitch = pitch;
+            glyph.coverage = coverage;
+        }
+    }
+
+    const Glyph& cached = m_glyphs.insert({codepoint, glyph}).first->second;
+    if (codepoint < 128) {
+        m_ascii[codepoint] = &cached;
+    }
+
+    return cached;
+}
+
+uint8_t* GlyphCache::Allocate(int width, int rows, int& pitch) {
+    if (width > atlasPageSize || rows > atlasPageSize) {
+        // Too big to share a page
+        uint8_t* page = new uint8_t[width * rows];
+        m_pages.push_back(page);
+
+        pitch = width;
+        return page;
+    }
+
+    if (m_shelfX + width > atlasPageSize) {
+        m_shelfY += m_shelfHeight;
+        m_shelfX = 0;
+        m_shelfHeight = 0;
+    }
+
+    if (!m_page || m_shelfY + rows > atlasPageSize) {
+        m_page = new uint8_t[atlasPageSize * atlasPageSize];
+        m_pages.push_back(m_page);
+
+        m_shelfX = m_shelfY = m_shelfHeight = 0;
+    }
+
+    uint8_t* coverage = m_page + m_shelfY * atlasPageSize + m_shelfX;
+
+    m_shelfX += width;
+    if (rows > m_shelfHeight) {
+        m_shelfHeight = rows;
+    }
+
+    pitch = atlasPageSize;
+    return coverage;
+}
+
+void ClearGlyphCache(Font* font) {
+    if (font->glyphCache) {
+        font->glyphCache->Clear();
+    }
+}
+} // namespace Lemon::Graphics
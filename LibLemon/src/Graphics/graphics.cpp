@@ -6,10 +6,17 @@
 
 #include <assert.h>
 
+#include <algorithm>
+
 #include "FastMem.h"
+#include "PixelKernelsInternal.h"
 
 namespace Lemon::Graphics {
 
+static inline uint32_t OpaqueColour(const RGBAColour& colour) {
+    return 0xff000000 | (static_cast<uint32_t>(colour.r) << 16) | (static_cast<uint32_t>(colour.g) << 8) | colour.b;
+}
+
 // Check if a point lies inside a rectangle
 bool PointInRect(rect_t rect, vector2i_t point) {
     return (point.x >= rect.pos.x && point.x < rect.pos.x + rect.size.x && point.y >= rect.pos.y &&
@@ -110,7 +117,10 @@ uint32_t Interpolate(double q11, double q21, double q12, double q22, double x, d
 }
 
 void DrawGradient(int x, int y, int width, int height, rgba_colour_t c1, rgba_colour_t c2, surface_t* surface) {
+    int length = width;
+    int start = 0; // Pixels of the gradient cut off on the left
     if (x < 0) {
+        start = -x;
         width += x;
         x = 0;
     }
@@ -120,10 +130,17 @@ void DrawGradient(int x, int y, int width, int height, rgba_colour_t c1, rgba_co
         y = 0;
     }
 
-    for (int j = 0; j < width && (x + j) < surface->width; j++) {
-        DrawRect(x + j, y, 1, height, (uint8_t)(j * (((double)c2.r - (double)c1.r) / width) + c1.r),
-                 (uint8_t)(j * (((double)c2.g - (double)c1.g) / width) + c1.g),
-                 (uint8_t)(j * (((double)c2.b - (double)c1.b) / width) + c1.b), surface);
+    width = std::min(width, surface->width - x);
+    height = std::min(height, surface->height - y);
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+
+    // Draw the first row then copy it to the rest
+    uint32_t* row = reinterpret_cast<uint32_t*>(surface->buffer) + y * surface->width + x;
+    Kernels().gradient(row, OpaqueColour(c1), OpaqueColour(c2), start, length, width);
+    for (int i = 1; i < height; i++) {
+        Kernels().copy(row + i * surface->width, row, width);
     }
 }
 
@@ -136,42 +153,23 @@ void DrawGradientVertical(rect_t rect, rgba_colour_t c1, rgba_colour_t c2, surfa
 }
 
 void DrawGradientVertical(int x, int y, int width, int height, rgba_colour_t c1, rgba_colour_t c2, surface_t* surface) {
-    if (x < 0) {
-        width += x;
-        x = 0;
-    }
-
-    if (y < 0) {
-        height += y;
-        y = 0;
-    }
-
-    width = (width + x > surface->width) ? (surface->width - x) : width;
-
-    for (int j = 0; j < height && (y + j) < surface->height; j++) {
-        DrawRect(x, y + j, width, 1, (uint8_t)(j * (((double)c2.r - (double)c1.r) / height) + c1.r),
-                 (uint8_t)(j * (((double)c2.g - (double)c1.g) / height) + c1.g),
-                 (uint8_t)(j * (((double)c2.b - (double)c1.b) / height) + c1.b), surface);
-    }
+    DrawGradientVertical(x, y, width, height, c1, c2, surface, {0, 0, surface->width, surface->height});
 }
 
 void DrawGradientVertical(int x, int y, int width, int height, rgba_colour_t c1, rgba_colour_t c2, surface_t* surface,
                           rect_t limits) {
+    int j = 0; // Its important that we change j instead of y for the gradient calculation
     if (x < 0) {
         width += x;
         x = 0;
     }
 
     if (y < 0) {
-        height += y;
-        y = 0;
+        j = -y;
     }
 
-    width = (width + x > surface->width) ? (surface->width - x) : width;
-
-    int j = 0;
-    if (limits.pos.y > y) {
-        j = limits.pos.y - y; // Its important that we change j instead of y for the gradient calculation
+    if (limits.pos.y > y + j) {
+        j = limits.pos.y - y;
     }
 
     if (limits.pos.x > x) {
@@ -179,14 +177,16 @@ void DrawGradientVertical(int x, int y, int width, int height, rgba_colour_t c1,
         x = limits.pos.x;
     }
 
-    if (x + width > limits.pos.x + limits.size.x) {
-        width = limits.pos.x - x + limits.size.x;
+    width = std::min({width, limits.pos.x + limits.size.x - x, surface->width - x});
+    if (width <= 0) {
+        return;
     }
 
+    // Each row is a single colour
+    GradientSteps g = GetGradientSteps(OpaqueColour(c1), OpaqueColour(c2), height);
+    uint32_t* buffer = reinterpret_cast<uint32_t*>(surface->buffer);
     for (; j < height && (y + j) < surface->height && (y + j) < limits.pos.y + limits.size.y; j++) {
-        DrawRect(x, y + j, width, 1, (uint8_t)(j * (((double)c2.r - (double)c1.r) / height) + c1.r),
-                 (uint8_t)(j * (((double)c2.g - (double)c1.g) / height) + c1.g),
-                 (uint8_t)(j * (((double)c2.b - (double)c1.b) / height) + c1.b), surface);
+        Kernels().fill(buffer + (y + j) * surface->width + x, GradientPixel(g, j), width);
     }
 }
 
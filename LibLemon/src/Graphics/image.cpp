@@ -1,4 +1,5 @@
 #include <Lemon/Graphics/Graphics.h>
+#include <Lemon/Graphics/PixelKernels.h>
 
 #include <Lemon/Core/Logger.h>
 
@@ -8,6 +9,8 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include <zlib.h>
 #include <png.h>
 #include <jpeglib.h>
@@ -101,7 +104,6 @@ int LoadImage(const char* path, int x, int y, int w, int h, surface_t* surface,
 
     double xScale = ((double)w) / surf.width;
     double yScale = (((double)h) / surf.height);
-    double xOffset = 0;
 
     if (preserveAspectRatio) {
         if (yScale > xScale)
@@ -110,46 +112,15 @@ int LoadImage(const char* path, int x, int y, int w, int h, surface_t* surface,
             yScale = xScale;
     }
 
-    uint8_t* srcBuffer = surf.buffer;
-
     if (!surface->buffer) { // Allocate new surface if needed
         *surface = {.width = w + x, .height = h + y, .depth = 32, .buffer = new uint8_t[(w + x) * (h + y) * 4]};
     }
 
-    uint32_t* destBuffer = (uint32_t*)surface->buffer;
-
-    for (int i = 0; i < h && i + y < surface->height; i++) {
-        double _yval = ((double)i) / yScale;
-        if (ceil(_yval) >= surf.height)
-            break;
-        for (int j = 0; j < w && j + x < surface->width; j++) {
-            double _xval = xOffset + ((double)+j) / xScale;
-            if (ceil(_xval) >= surf.width)
-                break;
-            uint32_t offset = (y + i) * surface->width + x + j;
-
-            long b = Interpolate(srcBuffer[((int)floor(_yval) * surf.width + (int)floor(_xval)) * 4],
-                                 srcBuffer[((int)floor(_yval) * surf.width + (int)ceil(_xval)) * 4],
-                                 srcBuffer[((int)ceil(_yval) * surf.width + (int)floor(_xval)) * 4],
-                                 srcBuffer[((int)ceil(_yval) * surf.width + (int)ceil(_xval)) * 4], _xval, _yval);
-            long g = Interpolate(srcBuffer[((int)floor(_yval) * surf.width + (int)floor(_xval)) * 4 + 1],
-                                 srcBuffer[((int)floor(_yval) * surf.width + (int)ceil(_xval)) * 4 + 1],
-                                 srcBuffer[((int)floor(_yval) * surf.width + (int)ceil(_xval)) * 4 + 1],
-                                 srcBuffer[((int)ceil(_yval) * surf.width + (int)ceil(_xval)) * 4 + 1], _xval, _yval);
-            long r = Interpolate(srcBuffer[((int)floor(_yval) * surf.width + (int)floor(_xval)) * 4 + 2],
-                                 srcBuffer[((int)floor(_yval) * surf.width + (int)ceil(_xval)) * 4 + 2],
-                                 srcBuffer[((int)floor(_yval) * surf.width + (int)ceil(_xval)) * 4 + 2],
-                                 srcBuffer[((int)ceil(_yval) * surf.width + (int)ceil(_xval)) * 4 + 2], _xval, _yval);
-            long a = Interpolate(srcBuffer[((int)floor(_yval) * surf.width + (int)floor(_xval)) * 4 + 3],
-                                 srcBuffer[((int)floor(_yval) * surf.width + (int)ceil(_xval)) * 4 + 3],
-                                 srcBuffer[((int)floor(_yval) * surf.width + (int)ceil(_xval)) * 4 + 3],
-                                 srcBuffer[((int)ceil(_yval) * surf.width + (int)ceil(_xval)) * 4 + 3], _xval, _yval);
-
-            destBuffer[offset] = (a << 24) | (r << 16) | (g << 8) | b;
-        }
-    }
+    ScalePixels(reinterpret_cast<uint32_t*>(surface->buffer) + y * surface->width + x, surface->width,
+                std::min(w, surface->width - x), std::min(h, surface->height - y),
+                reinterpret_cast<const uint32_t*>(surf.buffer), surf.width, surf.width, surf.height, xScale, yScale);
 
-    free(srcBuffer);
+    free(surf.buffer);
     fclose(imageFile);
 
     return 0;
@@ -0,0 +1,203 @@
+#include "PixelKernelsInternal.h"
+
+#include <cpuid.h>
+
+namespace Lemon::Graphics {
+
+static void BlendScalar(uint32_t* dest, const uint32_t* src, size_t count) {
+    for (; count; count--, dest++, src++) {
+        *dest = BlendPixel(*dest, *src);
+    }
+}
+
+static void BlendFillScalar(uint32_t* dest, uint32_t colour, size_t count) {
+    for (; count; count--, dest++) {
+        *dest = BlendPixel(*dest, colour);
+    }
+}
+
+static void FillScalar(uint32_t* dest, uint32_t colour, size_t count) {
+    while (count--) {
+        *(dest++) = colour;
+    }
+}
+
+static void CopyScalar(uint32_t* dest, const uint32_t* src, size_t count) {
+    while (count--) {
+        *(dest++) = *(src++);
+    }
+}
+
+static void GradientScalar(uint32_t* dest, uint32_t c1, uint32_t c2, int start, int length, size_t count) {
+    GradientSteps g = GetGradientSteps(c1, c2, length);
+    for (size_t i = 0; i < count; i++) {
+        dest[i] = GradientPixel(g, start + static_cast<int>(i));
+    }
+}
+
+static void ScaleBilinearScalar(uint32_t* dest, int destPitch, int width, int height, const uint32_t* src,
+                                int srcPitch, int srcWidth, int srcHeight, uint32_t stepX, uint32_t stepY) {
+    for (int y = 0; y < height; y++, dest += destPitch) {
+        int y0 = ScaleSourceIndex(y, stepY, srcHeight);
+        int y1 = y0 + 1 < srcHeight ? y0 + 1 : y0;
+        uint32_t fy = ScaleSourceFraction(y, stepY);
+
+        const uint32_t* row0 = src + y0 * srcPitch;
+        const uint32_t* row1 = src + y1 * srcPitch;
+        for (int x = 0; x < width; x++) {
+            int x0 = ScaleSourceIndex(x, stepX, srcWidth);
+            int x1 = x0 + 1 < srcWidth ? x0 + 1 : x0;
+            uint32_t fx = ScaleSourceFraction(x, stepX);
+
+            // Interpolate the two columns vertically then the result horizontally,
+            // truncating after each step the same as the SIMD kernels
+            uint32_t pixel = 0;
+            for (int shift = 0; shift < 32; shift += 8) {
+                uint32_t left = (((row0[x0] >> shift) & 0xff) * (256 - fy) + ((row1[x0] >> shift) & 0xff) * fy) >> 8;
+                uint32_t right = (((row0[x1] >> shift) & 0xff) * (256 - fy) + ((row1[x1] >> shift) & 0xff) * fy) >> 8;
+
+                pixel |= ((left * (256 - fx) + right * fx) >> 8) << shift;
+            }
+
+            dest[x] = pixel;
+        }
+    }
+}
+
+static void ScaleBoxScalar(uint32_t* dest, int destPitch, int width, int height, const uint32_t* src, int srcPitch,
+                           int srcWidth, int srcHeight, uint32_t stepX, uint32_t stepY) {
+    for (int y = 0; y < height; y++, dest += destPitch) {
+        int y0, y1;
+        ScaleSourceBox(y, stepY, srcHeight, y0, y1);
+
+        for (int x = 0; x < width; x++) {
+            int x0, x1;
+            ScaleSourceBox(x, stepX, srcWidth, x0, x1);
+
+            uint32_t sum[4] = {0, 0, 0, 0};
+            for (int i = y0; i < y1; i++) {
+                for (int j = x0; j < x1; j++) {
+                    uint32_t p = src[i * srcPitch + j];
+                    sum[0] += p & 0xff;
+                    sum[1] += (p >> 8) & 0xff;
+                    sum[2] += (p >> 16) & 0xff;
+                    sum[3] += p >> 24;
+                }
+            }
+
+            uint32_t count = (x1 - x0) * (y1 - y0);
+            uint32_t recip = BoxReciprocal(count);
+            uint32_t pixel = 0;
+            for (int c = 0; c < 4; c++) {
+                pixel |= BoxAverage(sum[c], count, recip) << (c * 8);
+            }
+
+            dest[x] = pixel;
+        }
+    }
+}
+
+const PixelKernels scalarKernels = {
+    .level = SIMDScalar,
+    .name = "scalar",
+    .blend = BlendScalar,
+    .blendFill = BlendFillScalar,
+    .fill = FillScalar,
+    .copy = CopyScalar,
+    .gradient = GradientScalar,
+    .scaleBilinear = ScaleBilinearScalar,
+    .scaleBox = ScaleBoxScalar,
+};
+
+static SIMDLevel DetectSIMDLevel() {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(edx & bit_SSE2)) {
+        return SIMDScalar;
+    }
+
+    if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+        return SIMDSSE2;
+    }
+
+    // AVX2 also needs the OS to save the YMM registers
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+        return SIMDSSE41;
+    }
+
+    uint32_t xcr0Low, xcr0High;
+    asm volatile("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+    if ((xcr0Low & 0x6) != 0x6) { // SSE and AVX state
+        return SIMDSSE41;
+    }
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || !(ebx & bit_AVX2)) {
+        return SIMDSSE41;
+    }
+
+    return SIMDAVX2;
+}
+
+static SIMDLevel SupportedSIMDLevel() {
+    static SIMDLevel level = DetectSIMDLevel();
+    return level;
+}
+
+const PixelKernels* GetKernels(SIMDLevel level) {
+    if (level > SupportedSIMDLevel()) {
+        return nullptr;
+    }
+
+    switch (level) {
+    case SIMDScalar:
+        return &scalarKernels;
+    case SIMDSSE2:
+        return &sse2Kernels;
+    case SIMDSSE41:
+        return &sse41Kernels;
+    case SIMDAVX2:
+        return &avx2Kernels;
+    default:
+        return nullptr;
+    }
+}
+
+const PixelKernels& Kernels() {
+    static const PixelKernels* kernels = GetKernels(SupportedSIMDLevel());
+    return *kernels;
+}
+
+void ScalePixels(uint32_t* dest, int destPitch, int width, int height, const uint32_t* src, int srcPitch, int srcWidth,
+                 int srcHeight, double xScale, double yScale) {
+    if (xScale <= 0 || yScale <= 0 || srcWidth <= 0 || srcHeight <= 0) {
+        return;
+    }
+
+    uint32_t stepX = static_cast<uint32_t>(65536 / xScale);
+    uint32_t stepY = static_cast<uint32_t>(65536 / yScale);
+    if (!stepX || !stepY) {
+        return;
+    }
+
+    // Stop at the last destination pixel which still maps inside the source
+    uint64_t maxWidth = ((static_cast<uint64_t>(srcWidth) << 16) + stepX - 1) / stepX;
+    uint64_t maxHeight = ((static_cast<uint64_t>(srcHeight) << 16) + stepY - 1) / stepY;
+    if (static_cast<uint64_t>(width) > maxWidth) {
+        width = static_cast<int>(maxWidth);
+    }
+
+    if (static_cast<uint64_t>(height) > maxHeight) {
+        height = static_cast<int>(maxHeight);
+    }
+
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+
+    if (stepX >= 0x20000 && stepY >= 0x20000) {
+        Kernels().scaleBox(dest, destPitch, width, height, src, srcPitch, srcWidth, srcHeight, stepX, stepY);
+    } else {
+        Kernels().scaleBilinear(dest, destPitch, width, height, src, srcPitch, srcWidth, srcHeight, stepX, stepY);
+    }
+}
+
+} // namespace Lemon::Graphics
@@ -0,0 +1,486 @@
+#include "PixelKernelsInternal.h"
+
+#include <immintrin.h>
+
+// LibLemon is built for x86-64-v2 so SSE4.1 can be used directly,
+// AVX2 functions are marked and only called once CPUID says it is there.
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+namespace Lemon::Graphics {
+
+// Blend four pixels over opaque destination pixels, see BlendPixel
+template <bool sse41> static inline __m128i BlendOpaque(__m128i d, __m128i s) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i v255 = _mm_set1_epi16(255);
+    const __m128i v128 = _mm_set1_epi16(128);
+
+    __m128i srcLow = _mm_unpacklo_epi8(s, zero);
+    __m128i srcHigh = _mm_unpackhi_epi8(s, zero);
+    __m128i destLow = _mm_unpacklo_epi8(d, zero);
+    __m128i destHigh = _mm_unpackhi_epi8(d, zero);
+
+    // Alpha of each pixel in all four of its 16-bit channels
+    __m128i alphaLow, alphaHigh;
+    if constexpr (sse41) {
+        alphaLow = _mm_shuffle_epi8(s, _mm_setr_epi8(3, -1, 3, -1, 3, -1, 3, -1, 7, -1, 7, -1, 7, -1, 7, -1));
+        alphaHigh = _mm_shuffle_epi8(s, _mm_setr_epi8(11, -1, 11, -1, 11, -1, 11, -1, 15, -1, 15, -1, 15, -1, 15, -1));
+    } else {
+        alphaLow = _mm_shufflehi_epi16(_mm_shufflelo_epi16(srcLow, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+        alphaHigh =
+            _mm_shufflehi_epi16(_mm_shufflelo_epi16(srcHigh, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    }
+
+    // s * a + d * (255 - a) is at most 65025 so fits in 16 bits
+    __m128i low = _mm_add_epi16(_mm_mullo_epi16(srcLow, alphaLow),
+                                _mm_mullo_epi16(destLow, _mm_sub_epi16(v255, alphaLow)));
+    __m128i high = _mm_add_epi16(_mm_mullo_epi16(srcHigh, alphaHigh),
+                                 _mm_mullo_epi16(destHigh, _mm_sub_epi16(v255, alphaHigh)));
+
+    // Div255
+    low = _mm_add_epi16(low, v128);
+    high = _mm_add_epi16(high, v128);
+    low = _mm_srli_epi16(_mm_add_epi16(low, _mm_srli_epi16(low, 8)), 8);
+    high = _mm_srli_epi16(_mm_add_epi16(high, _mm_srli_epi16(high, 8)), 8);
+
+    return _mm_or_si128(_mm_packus_epi16(low, high), _mm_set1_epi32(0xff000000));
+}
+
+template <bool sse41> static inline bool AllAlphaZero(__m128i v, __m128i alphaMask) {
+    if constexpr (sse41) {
+        return _mm_testz_si128(v, alphaMask);
+    } else {
+        return _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(v, alphaMask), _mm_setzero_si128())) == 0xffff;
+    }
+}
+
+template <bool sse41> static inline bool AllAlphaFull(__m128i v, __m128i alphaMask) {
+    if constexpr (sse41) {
+        return _mm_testc_si128(v, alphaMask);
+    } else {
+        return _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(v, alphaMask), alphaMask)) == 0xffff;
+    }
+}
+
+template <bool sse41> static void BlendSSE(uint32_t* dest, const uint32_t* src, size_t count) {
+    const __m128i alphaMask = _mm_set1_epi32(0xff000000);
+
+    for (; count >= 4; count -= 4, dest += 4, src += 4) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        if (AllAlphaZero<sse41>(s, alphaMask)) {
+            continue; // Nothing to draw
+        } else if (AllAlphaFull<sse41>(s, alphaMask)) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), s);
+            continue;
+        }
+
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dest));
+        if (!AllAlphaFull<sse41>(d, alphaMask)) {
+            for (int i = 0; i < 4; i++) {
+                dest[i] = BlendPixel(dest[i], src[i]);
+            }
+            continue;
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), BlendOpaque<sse41>(d, s));
+    }
+
+    for (; count; count--, dest++, src++) {
+        *dest = BlendPixel(*dest, *src);
+    }
+}
+
+static void FillSSE2(uint32_t* dest, uint32_t colour, size_t count) {
+    const __m128i c = _mm_set1_epi32(colour);
+
+    for (; count >= 16; count -= 16, dest += 16) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), c);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 4), c);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 8), c);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 12), c);
+    }
+
+    for (; count >= 4; count -= 4, dest += 4) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), c);
+    }
+
+    while (count--) {
+        *(dest++) = colour;
+    }
+}
+
+template <bool sse41> static void BlendFillSSE(uint32_t* dest, uint32_t colour, size_t count) {
+    uint32_t a = colour >> 24;
+    if (a == 0) {
+        return;
+    } else if (a == 255) {
+        FillSSE2(dest, colour, count);
+        return;
+    }
+
+    const __m128i alphaMask = _mm_set1_epi32(0xff000000);
+    const __m128i s = _mm_set1_epi32(colour);
+
+    for (; count >= 4; count -= 4, dest += 4) {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dest));
+        if (!AllAlphaFull<sse41>(d, alphaMask)) {
+            for (int i = 0; i < 4; i++) {
+                dest[i] = BlendPixel(dest[i], colour);
+            }
+            continue;
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), BlendOpaque<sse41>(d, s));
+    }
+
+    for (; count; count--, dest++) {
+        *dest = BlendPixel(*dest, colour);
+    }
+}
+
+static void CopySSE2(uint32_t* dest, const uint32_t* src, size_t count) {
+    for (; count >= 16; count -= 16, dest += 16, src += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 12));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), a);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 4), b);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 8), c);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 12), d);
+    }
+
+    for (; count >= 4; count -= 4, dest += 4, src += 4) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest),
+                         _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+    }
+
+    while (count--) {
+        *(dest++) = *(src++);
+    }
+}
+
+static void GradientSSE2(uint32_t* dest, uint32_t c1, uint32_t c2, int start, int length, size_t count) {
+    GradientSteps g = GetGradientSteps(c1, c2, length);
+
+    // Each channel has its own vector holding four pixels
+    __m128i value[4];
+    __m128i step[4];
+    for (int c = 0; c < 4; c++) {
+        value[c] = _mm_setr_epi32(g.base[c] + start * g.step[c], g.base[c] + (start + 1) * g.step[c],
+                                  g.base[c] + (start + 2) * g.step[c], g.base[c] + (start + 3) * g.step[c]);
+        step[c] = _mm_set1_epi32(g.step[c] * 4);
+    }
+
+    // Every value is between 0 and 255 << 16 so shifting and masking puts the channels in place
+    const __m128i maskG = _mm_set1_epi32(0xff00);
+    const __m128i maskR = _mm_set1_epi32(0xff0000);
+    const __m128i maskA = _mm_set1_epi32(0xff000000);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i pixels = _mm_or_si128(
+            _mm_or_si128(_mm_srli_epi32(value[0], 16), _mm_and_si128(_mm_srli_epi32(value[1], 8), maskG)),
+            _mm_or_si128(_mm_and_si128(value[2], maskR), _mm_and_si128(_mm_slli_epi32(value[3], 8), maskA)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), pixels);
+
+        for (int c = 0; c < 4; c++) {
+            value[c] = _mm_add_epi32(value[c], step[c]);
+        }
+    }
+
+    for (; i < count; i++) {
+        dest[i] = GradientPixel(g, start + static_cast<int>(i));
+    }
+}
+
+static void ScaleBilinearSSE2(uint32_t* dest, int destPitch, int width, int height, const uint32_t* src, int srcPitch,
+                              int srcWidth, int srcHeight, uint32_t stepX, uint32_t stepY) {
+    const __m128i zero = _mm_setzero_si128();
+
+    for (int y = 0; y < height; y++, dest += destPitch) {
+        int y0 = ScaleSourceIndex(y, stepY, srcHeight);
+        int y1 = y0 + 1 < srcHeight ? y0 + 1 : y0;
+        uint32_t fy = ScaleSourceFraction(y, stepY);
+
+        const uint32_t* row0 = src + y0 * srcPitch;
+        const uint32_t* row1 = src + y1 * srcPitch;
+        const __m128i weightTop = _mm_set1_epi16(256 - fy);
+        const __m128i weightBottom = _mm_set1_epi16(fy);
+
+        for (int x = 0; x < width; x++) {
+            int x0 = ScaleSourceIndex(x, stepX, srcWidth);
+            int x1 = x0 + 1 < srcWidth ? x0 + 1 : x0;
+            uint32_t fx = ScaleSourceFraction(x, stepX);
+
+            // Left pixel in the low four channels, right pixel in the high four
+            __m128i top = _mm_unpacklo_epi32(_mm_cvtsi32_si128(row0[x0]), _mm_cvtsi32_si128(row0[x1]));
+            __m128i bottom = _mm_unpacklo_epi32(_mm_cvtsi32_si128(row1[x0]), _mm_cvtsi32_si128(row1[x1]));
+            top = _mm_unpacklo_epi8(top, zero);
+            bottom = _mm_unpacklo_epi8(bottom, zero);
+
+            __m128i column = _mm_srli_epi16(
+                _mm_add_epi16(_mm_mullo_epi16(top, weightTop), _mm_mullo_epi16(bottom, weightBottom)), 8);
+
+            __m128i weightX = _mm_set_epi16(fx, fx, fx, fx, 256 - fx, 256 - fx, 256 - fx, 256 - fx);
+            __m128i row = _mm_mullo_epi16(column, weightX);
+            row = _mm_srli_epi16(_mm_add_epi16(row, _mm_srli_si128(row, 8)), 8);
+
+            dest[x] = _mm_cvtsi128_si32(_mm_packus_epi16(row, row));
+        }
+    }
+}
+
+// High 32 bits of each unsigned product, there is only the 32 x 32 -> 64 bit multiply
+static inline __m128i MulHi32SSE2(__m128i a, __m128i b) {
+    __m128i even = _mm_srli_epi64(_mm_mul_epu32(a, b), 32);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_or_si128(even, _mm_and_si128(odd, _mm_set_epi32(-1, 0, -1, 0)));
+}
+
+static void ScaleBoxSSE(uint32_t* dest, int destPitch, int width, int height, const uint32_t* src, int srcPitch,
+                        int srcWidth, int srcHeight, uint32_t stepX, uint32_t stepY) {
+    const __m128i zero = _mm_setzero_si128();
+
+    for (int y = 0; y < height; y++, dest += destPitch) {
+        int y0, y1;
+        ScaleSourceBox(y, stepY, srcHeight, y0, y1);
+
+        for (int x = 0; x < width; x++) {
+            int x0, x1;
+            ScaleSourceBox(x, stepX, srcWidth, x0, x1);
+
+            // One 32-bit sum per channel
+            __m128i sum = zero;
+            for (int i = y0; i < y1; i++) {
+                const uint32_t* row = src + i * srcPitch;
+                for (int j = x0; j < x1; j++) {
+                    __m128i p = _mm_unpacklo_epi8(_mm_cvtsi32_si128(row[j]), zero);
+                    sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(p, zero));
+                }
+            }
+
+            uint32_t count = (x1 - x0) * (y1 - y0);
+            uint32_t recip = BoxReciprocal(count);
+
+            __m128i average;
+            if (recip) {
+                // Add half the count first so the average is rounded to nearest
+                __m128i n = _mm_add_epi32(sum, _mm_set1_epi32(count / 2));
+                average = MulHi32SSE2(n, _mm_set1_epi32(recip));
+            } else {
+                alignas(16) uint32_t sums[4];
+                _mm_store_si128(reinterpret_cast<__m128i*>(sums), sum);
+                average = _mm_setr_epi32(BoxAverage(sums[0], count, 0), BoxAverage(sums[1], count, 0),
+                                         BoxAverage(sums[2], count, 0), BoxAverage(sums[3], count, 0));
+            }
+
+            average = _mm_packs_epi32(average, average);
+            dest[x] = _mm_cvtsi128_si32(_mm_packus_epi16(average, average));
+        }
+    }
+}
+
+// Blend eight pixels over opaque destination pixels, see BlendPixel
+AVX2_TARGET static inline __m256i BlendOpaqueAVX2(__m256i d, __m256i s) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i v255 = _mm256_set1_epi16(255);
+    const __m256i v128 = _mm256_set1_epi16(128);
+
+    // Unpacking and packing work within each 128-bit lane so the pixel order is kept
+    __m256i srcLow = _mm256_unpacklo_epi8(s, zero);
+    __m256i srcHigh = _mm256_unpackhi_epi8(s, zero);
+    __m256i destLow = _mm256_unpacklo_epi8(d, zero);
+    __m256i destHigh = _mm256_unpackhi_epi8(d, zero);
+
+    __m256i alphaLow = _mm256_shuffle_epi8(s, _mm256_setr_epi8(3, -1, 3, -1, 3, -1, 3, -1, 7, -1, 7, -1, 7, -1, 7, -1, 3,
+                                                                -1, 3, -1, 3, -1, 3, -1, 7, -1, 7, -1, 7, -1, 7, -1));
+    __m256i alphaHigh =
+        _mm256_shuffle_epi8(s, _mm256_setr_epi8(11, -1, 11, -1, 11, -1, 11, -1, 15, -1, 15, -1, 15, -1, 15, -1, 11, -1,
+                                                11, -1, 11, -1, 11, -1, 15, -1, 15, -1, 15, -1, 15, -1));
+
+    __m256i low = _mm256_add_epi16(_mm256_mullo_epi16(srcLow, alphaLow),
+                                   _mm256_mullo_epi16(destLow, _mm256_sub_epi16(v255, alphaLow)));
+    __m256i high = _mm256_add_epi16(_mm256_mullo_epi16(srcHigh, alphaHigh),
+                                    _mm256_mullo_epi16(destHigh, _mm256_sub_epi16(v255, alphaHigh)));
+
+    low = _mm256_add_epi16(low, v128);
+    high = _mm256_add_epi16(high, v128);
+    low = _mm256_srli_epi16(_mm256_add_epi16(low, _mm256_srli_epi16(low, 8)), 8);
+    high = _mm256_srli_epi16(_mm256_add_epi16(high, _mm256_srli_epi16(high, 8)), 8);
+
+    return _mm256_or_si256(_mm256_packus_epi16(low, high), _mm256_set1_epi32(0xff000000));
+}
+
+AVX2_TARGET static void BlendAVX2(uint32_t* dest, const uint32_t* src, size_t count) {
+    const __m256i alphaMask = _mm256_set1_epi32(0xff000000);
+
+    for (; count >= 8; count -= 8, dest += 8, src += 8) {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+        if (_mm256_testz_si256(s, alphaMask)) {
+            continue;
+        } else if (_mm256_testc_si256(s, alphaMask)) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), s);
+            continue;
+        }
+
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dest));
+        if (!_mm256_testc_si256(d, alphaMask)) {
+            for (int i = 0; i < 8; i++) {
+                dest[i] = BlendPixel(dest[i], src[i]);
+            }
+            continue;
+        }
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), BlendOpaqueAVX2(d, s));
+    }
+
+    for (; count; count--, dest++, src++) {
+        *dest = BlendPixel(*dest, *src);
+    }
+}
+
+AVX2_TARGET static void FillAVX2(uint32_t* dest, uint32_t colour, size_t count) {
+    const __m256i c = _mm256_set1_epi32(colour);
+
+    for (; count >= 32; count -= 32, dest += 32) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), c);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 8), c);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 16), c);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 24), c);
+    }
+
+    for (; count >= 8; count -= 8, dest += 8) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), c);
+    }
+
+    while (count--) {
+        *(dest++) = colour;
+    }
+}
+
+AVX2_TARGET static void BlendFillAVX2(uint32_t* dest, uint32_t colour, size_t count) {
+    uint32_t a = colour >> 24;
+    if (a == 0) {
+        return;
+    } else if (a == 255) {
+        FillAVX2(dest, colour, count);
+        return;
+    }
+
+    const __m256i alphaMask = _mm256_set1_epi32(0xff000000);
+    const __m256i s = _mm256_set1_epi32(colour);
+
+    for (; count >= 8; count -= 8, dest += 8) {
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dest));
+        if (!_mm256_testc_si256(d, alphaMask)) {
+            for (int i = 0; i < 8; i++) {
+                dest[i] = BlendPixel(dest[i], colour);
+            }
+            continue;
+        }
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), BlendOpaqueAVX2(d, s));
+    }
+
+    for (; count; count--, dest++) {
+        *dest = BlendPixel(*dest, colour);
+    }
+}
+
+AVX2_TARGET static void CopyAVX2(uint32_t* dest, const uint32_t* src, size_t count) {
+    for (; count >= 32; count -= 32, dest += 32, src += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 8));
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 16));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 24));
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), a);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 8), b);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 16), c);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 24), d);
+    }
+
+    for (; count >= 8; count -= 8, dest += 8, src += 8) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest),
+                            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src)));
+    }
+
+    while (count--) {
+        *(dest++) = *(src++);
+    }
+}
+
+AVX2_TARGET static void GradientAVX2(uint32_t* dest, uint32_t c1, uint32_t c2, int start, int length,
+                                     size_t count) {
+    GradientSteps g = GetGradientSteps(c1, c2, length);
+
+    __m256i value[4];
+    __m256i step[4];
+    for (int c = 0; c < 4; c++) {
+        __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        value[c] = _mm256_add_epi32(_mm256_set1_epi32(g.base[c] + start * g.step[c]),
+                                    _mm256_mullo_epi32(lane, _mm256_set1_epi32(g.step[c])));
+        step[c] = _mm256_set1_epi32(g.step[c] * 8);
+    }
+
+    const __m256i maskG = _mm256_set1_epi32(0xff00);
+    const __m256i maskR = _mm256_set1_epi32(0xff0000);
+    const __m256i maskA = _mm256_set1_epi32(0xff000000);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i pixels = _mm256_or_si256(
+            _mm256_or_si256(_mm256_srli_epi32(value[0], 16), _mm256_and_si256(_mm256_srli_epi32(value[1], 8), maskG)),
+            _mm256_or_si256(_mm256_and_si256(value[2], maskR),
+                            _mm256_and_si256(_mm256_slli_epi32(value[3], 8), maskA)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i), pixels);
+
+        for (int c = 0; c < 4; c++) {
+            value[c] = _mm256_add_epi32(value[c], step[c]);
+        }
+    }
+
+    for (; i < count; i++) {
+        dest[i] = GradientPixel(g, start + static_cast<int>(i));
+    }
+}
+
+const PixelKernels sse2Kernels = {
+    .level = SIMDSSE2,
+    .name = "sse2",
+    .blend = BlendSSE<false>,
+    .blendFill = BlendFillSSE<false>,
+    .fill = FillSSE2,
+    .copy = CopySSE2,
+    .gradient = GradientSSE2,
+    .scaleBilinear = ScaleBilinearSSE2,
+    .scaleBox = ScaleBoxSSE,
+};
+
+const PixelKernels sse41Kernels = {
+    .level = SIMDSSE41,
+    .name = "sse4.1",
+    .blend = BlendSSE<true>,
+    .blendFill = BlendFillSSE<true>,
+    .fill = FillSSE2,
+    .copy = CopySSE2,
+    .gradient = GradientSSE2,
+    .scaleBilinear = ScaleBilinearSSE2,
+    .scaleBox = ScaleBoxSSE,
+};
+
+// Scaling reads one or two source pixels at a time and gains nothing from wider vectors
+const PixelKernels avx2Kernels = {
+    .level = SIMDAVX2,
+    .name = "avx2",
+    .blend = BlendAVX2,
+    .blendFill = BlendFillAVX2,
+    .fill = FillAVX2,
+    .copy = CopyAVX2,
+    .gradient = GradientAVX2,
+    .scaleBilinear = ScaleBilinearSSE2,
+    .scaleBox = ScaleBoxSSE,
+};
+
+} // namespace Lemon::Graphics
@@ -4,9 +4,13 @@
 
 #include <Lemon/Core/Unicode.h>
 
+#include "GlyphCache.h"
+
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+#include <algorithm>
+
 #include <ctype.h>
 
 extern uint8_t font_default[];
@@ -15,6 +19,56 @@ namespace Lemon::Graphics {
 extern int fontState;
 extern Font* mainFont;
 
+struct TextClip {
+    int left;
+    int top;
+    int right;
+    int bottom;
+};
+
+static inline TextClip ClipToSurface(surface_t* surface, const rect_t& limits) {
+    return {
+        std::max(limits.x, 0),
+        std::max(limits.y, 0),
+        static_cast<int>(std::min<long>(static_cast<long>(limits.x) + limits.width, surface->width)),
+        static_cast<int>(std::min<long>(static_cast<long>(limits.y) + limits.height, surface->height)),
+    };
+}
+
+static inline GlyphCache* GetGlyphCache(Font* font) {
+    if (!font->glyphCache) {
+        font->glyphCache = new GlyphCache(font);
+    }
+
+    return font->glyphCache;
+}
+
+// Blit the coverage of a glyph straight from the atlas, y is the top of the line
+static void BlitGlyph(const Glyph& glyph, int x, int y, uint32_t colour, surface_t* surface, const TextClip& clip,
+                      Font* font) {
+    int glyphY = y + (font->height - glyph.top);
+
+    // Nothing is drawn below the line
+    int rowStart = std::max(0, clip.top - glyphY);
+    int rowEnd = std::min({static_cast<int>(glyph.rows), font->lineHeight - (font->height - glyph.top), clip.bottom - glyphY});
+    int colStart = std::max(0, clip.left - x);
+    int colEnd = std::min(static_cast<int>(glyph.width), clip.right - x);
+
+    uint32_t* buffer = reinterpret_cast<uint32_t*>(surface->buffer);
+    for (int i = rowStart; i < rowEnd; i++) {
+        const uint8_t* coverage = glyph.coverage + i * glyph.pitch;
+        uint32_t* dest = buffer + (glyphY + i) * surface->width + x;
+
+        for (int j = colStart; j < colEnd; j++) {
+            if (coverage[j] == 255) {
+                dest[j] = colour;
+            } else if (coverage[j]) {
+                dest[j] = AlphaBlendInt(dest[j], (colour & 0xFFFFFF) | (coverage[j] << 24));
+            }
+        }
+    }
+}
+
 int DrawChar(int character, int x, int y, uint8_t r, uint8_t g, uint8_t b, surface_t* surface, rect_t limits,
              Font* font) {
     if (!isprint(character)) {
@@ -41,53 +95,11 @@ int DrawChar(int character, int x, int y, uint8_t r, uint8_t g, uint8_t b, surfa
         InitializeFonts();
 
     uint32_t colour_i = 0xFF000000 | (r << 16) | (g << 8) | b;
-    uint32_t* buffer = (uint32_t*)surface->buffer;
-
-    FT_Face face = (FT_Face)font->face;
-    if (int err = FT_Load_Char(face, character, FT_LOAD_RENDER)) {
-        return 0;
-    }
-
-    int maxHeight = font->lineHeight - (font->height - face->glyph->bitmap_top);
-
-    if (y + maxHeight >= limits.y + limits.height) {
-        maxHeight = limits.y + limits.height - y;
-    }
 
-    if (y + maxHeight >= surface->height) {
-        maxHeight = surface->height - y;
-    }
+    const Glyph& glyph = GetGlyphCache(font)->GetGlyph(character);
+    BlitGlyph(glyph, x, y, colour_i, surface, ClipToSurface(surface, limits), font);
 
-    if (y < 0 && -y > maxHeight) {
-        return 0;
-    }
-
-    int i = 0;
-    if (y < 0) {
-        i = -y;
-    }
-
-    if (y + (font->height - face->glyph->bitmap_top) < limits.y) {
-        i = limits.y - (y + (font->height - face->glyph->bitmap_top));
-    }
-
-    for (; i < static_cast<int>(face->glyph->bitmap.rows) && i < maxHeight; i++) {
-        if (y + i < 0)
-            continue;
-
-        uint32_t yOffset = (i + y + (font->height - face->glyph->bitmap_top)) * (surface->width);
-        for (unsigned int j = 0; j < face->glyph->bitmap.width && static_cast<long>(j) + x < surface->width;
-             j++) {
-            if (x + static_cast<long>(j) < 0)
-                continue;
-            if (face->glyph->bitmap.buffer[i * face->glyph->bitmap.width + j] == 255)
-                buffer[yOffset + (j + x)] = colour_i;
-            else if (face->glyph->bitmap.buffer[i * face->glyph->bitmap.width + j] > 0) {
-                buffer[yOffset + (j + x)] = AlphaBlendInt(buffer[yOffset + (j + x)], RGBAColour::ToARGB({r, g, b, face->glyph->bitmap.buffer[i * face->glyph->bitmap.width + j]}));
-            }
-        }
-    }
-    return face->glyph->advance.x >> 6;
+    return glyph.advance;
 }
 
 int DrawChar(int character, int x, int y, uint8_t r, uint8_t g, uint8_t b, surface_t* surface, Font* font) {
@@ -117,23 +129,15 @@ int DrawString(const char* str, int x, int y, uint8_t r, uint8_t g, uint8_t b, s
         InitializeFonts();
 
     uint32_t colour_i = 0xFF000000 | (r << 16) | (g << 8) | b;
-    uint32_t* buffer = (uint32_t*)surface->buffer;
-
-    unsigned int maxHeight = font->lineHeight;
 
-    if (y < 0 && static_cast<unsigned>(-y) > maxHeight) {
+    if (y < 0 && -y > font->lineHeight) {
         return 0;
     }
 
-    if (y + static_cast<int>(maxHeight) >= limits.y + limits.height) {
-        maxHeight = limits.y + limits.height - y;
-    }
-
-    if (y + static_cast<int>(maxHeight) >= surface->height) {
-        maxHeight = surface->height - y;
-    }
-
     FT_Face face = (FT_Face)font->face;
+    GlyphCache* cache = GetGlyphCache(font);
+    TextClip clip = ClipToSurface(surface, limits);
+    bool hasKerning = FT_HAS_KERNING(face);
 
     unsigned int lastGlyph = 0;
     int xOffset = x;
@@ -150,57 +154,20 @@ int DrawString(const char* str, int x, int y, uint8_t r, uint8_t g, uint8_t b, s
             }
         }
 
-        unsigned int glyph = FT_Get_Char_Index(face, cp);
-        if (FT_HAS_KERNING(face) && lastGlyph) {
+        const Glyph& glyph = cache->GetGlyph(cp);
+        if (hasKerning && lastGlyph) {
             FT_Vector delta;
 
-            FT_Get_Kerning(face, lastGlyph, glyph, FT_KERNING_DEFAULT, &delta);
+            FT_Get_Kerning(face, lastGlyph, glyph.index, FT_KERNING_DEFAULT, &delta);
             xOffset += delta.x >> 6;
         }
-        lastGlyph = glyph;
-
-        if (int err = FT_Load_Glyph(face, glyph, FT_LOAD_RENDER)) {
-            continue;
-        }
-
-        if (xOffset + (face->glyph->advance.x >> 6) < limits.x) {
-            xOffset += face->glyph->advance.x >> 6;
-            continue;
-        }
-
-        unsigned i = 0;
-        if (y < 0) {
-            i = -y;
-        }
-
-        if (y + (font->height - face->glyph->bitmap_top) < limits.y) {
-            i = limits.y - (y + (font->height - face->glyph->bitmap_top));
-        }
-
-        for (; i < face->glyph->bitmap.rows && i + (font->height - face->glyph->bitmap_top) < maxHeight;
-             i++) {
-            uint32_t yOffset = (i + y + (font->height - face->glyph->bitmap_top)) * (surface->width);
-
-            unsigned j = 0;
-            if (xOffset < 0) {
-                j = -x;
-            }
+        lastGlyph = glyph.index;
 
-            if (xOffset < limits.x) {
-                j = limits.x - xOffset;
-            }
-
-            for (; j < face->glyph->bitmap.width && (xOffset + static_cast<long>(j)) < surface->width; j++) {
-                unsigned off = yOffset + (j + xOffset);
-                if (face->glyph->bitmap.buffer[i * face->glyph->bitmap.width + j] == 255)
-                    buffer[off] = colour_i;
-                else if (face->glyph->bitmap.buffer[i * face->glyph->bitmap.width + j]) {
-                    buffer[off] = AlphaBlendInt(buffer[off], RGBAColour::ToARGB({r, g, b, face->glyph->bitmap.buffer[i * face->glyph->bitmap.width + j]}));
-                }
-            }
+        if (xOffset < clip.right && xOffset + glyph.advance >= clip.left) {
+            BlitGlyph(glyph, xOffset, y, colour_i, surface, clip, font);
         }
 
-        xOffset += face->glyph->advance.x >> 6;
+        xOffset += glyph.advance;
     }
     return xOffset - x;
 }
@@ -233,12 +200,7 @@ int GetCharWidth(int c, Font* font) {
         return 0;
     }
 
-    FT_Face face = (FT_Face)font->face;
-    if (int err = FT_Load_Char(face, c, FT_LOAD_ADVANCE_ONLY)) {
-        return 0;
-    }
-
-    return face->glyph->advance.x >> 6;
+    return GetGlyphCache(font)->GetGlyph(c).advance;
 }
 
 int GetCharWidth(char c) { return GetCharWidth(c, mainFont); }
@@ -250,7 +212,7 @@ int GetTextLength(const char* str, size_t n, Font* font) {
         return strlen(str) * 8;
     }
 
-    FT_Face face = (FT_Face)font->face;
+    GlyphCache* cache = GetGlyphCache(font);
 
     size_t len = 0;
     size_t i = 0;
@@ -275,12 +237,7 @@ int GetTextLength(const char* str, size_t n, Font* font) {
             }
         }
 
-        if (int err = FT_Load_Char(face, cp, FT_LOAD_ADVANCE_ONLY)) {
-            str++;
-            continue;
-        }
-
-        len += face->glyph->advance.x >> 6;
+        len += cache->GetGlyph(cp).advance;
     }
 
     return len;
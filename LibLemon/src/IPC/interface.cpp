@@ -54,6 +54,12 @@ long Interface::Poll(Lemon::Handle& client, Message& m) {
             m_rawEndpoints.push_back(newIf);
             m_endpoints.push_back(Handle(newIf));
 
+            // Clients write straight to shared memory once we read from it
+            EndpointRing ring;
+            if (!ring.Map(newIf)) {
+                m_rings[newIf] = ring;
+            }
+
             for (Waiter* waiter : waiters) {
                 waiter->RepopulateHandles(); // Repopulate handles
             }
@@ -70,20 +76,13 @@ long Interface::Poll(Lemon::Handle& client, Message& m) {
         return 1;
     }
 
-    for (auto it = m_endpoints.begin(); !m_endpoints.empty() && it != m_endpoints.end(); it++) {
+    for (auto it = m_endpoints.begin(); it != m_endpoints.end();) {
         InterfaceMessageInfo msg{*it, 0, nullptr, 0};
 
-        while (long ret = EndpointDequeue(it->get(), &msg.id, &msg.length, m_dataBuffer)) {
+        bool disconnected = false;
+        while (long ret = Receive(it->get(), msg.id, msg.length, m_dataBuffer)) {
             if (ret < 0) { // We have probably disconnected
-                m_endpoints.erase(it);
-                RepopulateRawHandles();
-
-                msg.id = MessagePeerDisconnect;
-                m_queue.push_back(std::move(msg));
-
-                for (Waiter* waiter : waiters) {
-                    waiter->RepopulateHandles();
-                }
+                disconnected = true;
                 break;
             }
 
@@ -92,6 +91,24 @@ long Interface::Poll(Lemon::Handle& client, Message& m) {
 
             m_dataBuffer = new uint8_t[m_msgSize];
         }
+
+        if (disconnected) {
+            m_rings.erase(it->get());
+
+            msg.id = MessagePeerDisconnect;
+            msg.data = nullptr;
+            msg.length = 0;
+            m_queue.push_back(std::move(msg));
+
+            it = m_endpoints.erase(it);
+            RepopulateRawHandles();
+
+            for (Waiter* waiter : waiters) {
+                waiter->RepopulateHandles();
+            }
+        } else {
+            it++;
+        }
     }
 
     if (m_queue.size() > 0) {
@@ -107,6 +124,14 @@ long Interface::Poll(Lemon::Handle& client, Message& m) {
     }
 }
 
+long Interface::Receive(handle_t client, uint64_t& id, uint16_t& size, uint8_t* data) {
+    if (auto it = m_rings.find(client); it != m_rings.end()) {
+        return it->second.Read(client, id, size, data);
+    }
+
+    return EndpointDequeue(client, &id, &size, data);
+}
+
 void Interface::RepopulateRawHandles() {
     m_rawEndpoints.clear();
     for (auto& handle : m_endpoints) {
@@ -0,0 +1,102 @@
+#include <Lemon/IPC/Ring.h>
+
+#include <Lemon/System/IPC.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+
+namespace Lemon {
+// Whoever holds the lock only copies a message, so it is not worth sleeping
+static inline void AcquireRingLock(uint32_t* lock) {
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static inline void ReleaseRingLock(uint32_t* lock) { __atomic_store_n(lock, 0, __ATOMIC_RELEASE); }
+
+long EndpointRing::Map(handle_t endpoint) {
+    lemon_endpoint_ring_info_t info;
+    if (long ret = EndpointMapRing(endpoint, info); ret) {
+        return ret;
+    }
+
+    m_info = info;
+    m_kernelQueueEmpty = false;
+    return 0;
+}
+
+long EndpointRing::Write(handle_t endpoint, uint64_t id, const uint8_t* data, uint16_t size) {
+    lemon_endpoint_ring_t* r = Ring(m_info.tx);
+    if (!__atomic_load_n(&r->consumerAttached, __ATOMIC_ACQUIRE) || size > m_info.msgSize) {
+        return 0; // The peer still reads through the kernel
+    }
+
+    AcquireRingLock(&r->producerLock);
+
+    uint64_t tail = r->tail;
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= m_info.slotCount) {
+        ReleaseRingLock(&r->producerLock);
+        return 0; // Full, the kernel will wait for space
+    }
+
+    lemon_endpoint_ring_slot_t* slot = Slot(m_info.tx, tail);
+    slot->id = id;
+    slot->size = size;
+    memcpy(slot->data, data, size);
+
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+    // The peer only needs waking if it may have seen the ring empty
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bool wasEmpty = (__atomic_load_n(&r->head, __ATOMIC_RELAXED) == tail);
+
+    ReleaseRingLock(&r->producerLock);
+
+    if (wasEmpty) {
+        EndpointNotify(endpoint);
+    }
+    return 1;
+}
+
+long EndpointRing::Read(handle_t endpoint, uint64_t& id, uint16_t& size, uint8_t* data) {
+    if (!m_kernelQueueEmpty) {
+        // The kernel gives us anything it queued before moving on to the ring,
+        // so once it has nothing left neither does the ring
+        if (long ret = EndpointDequeue(endpoint, &id, &size, data); ret) {
+            return ret;
+        }
+
+        m_kernelQueueEmpty = true;
+        return 0;
+    }
+
+    lemon_endpoint_ring_t* r = Ring(m_info.rx);
+    AcquireRingLock(&r->consumerLock);
+
+    uint64_t head = r->head;
+
+    // Everything written before the peer closed is visible once we see it closed
+    bool closed = __atomic_load_n(&r->producerClosed, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head) {
+        ReleaseRingLock(&r->consumerLock);
+        return closed ? -ENOTCONN : 0;
+    }
+
+    // The peer can write to the slot at any time, so only read each field once
+    lemon_endpoint_ring_slot_t* slot = Slot(m_info.rx, head);
+    uint16_t msgSize = __atomic_load_n(&slot->size, __ATOMIC_RELAXED);
+    if (msgSize > m_info.msgSize) {
+        msgSize = m_info.msgSize;
+    }
+
+    id = slot->id;
+    size = msgSize;
+    memcpy(data, slot->data, msgSize);
+
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    ReleaseRingLock(&r->consumerLock);
+    return 1;
+}
+} // namespace Lemon
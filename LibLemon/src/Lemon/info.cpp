@@ -4,7 +4,14 @@
 namespace Lemon {
 lemon_sysinfo_t SysInfo() {
     lemon_sysinfo_t info;
-    syscall(SYS_INFO, &info);
+    syscall(SYS_INFO, &info, nullptr);
     return info;
 }
+
+lemon_meminfo_t MemoryInfo() {
+    lemon_sysinfo_t info;
+    lemon_meminfo_t memInfo;
+    syscall(SYS_INFO, &info, &memInfo);
+    return memInfo;
+}
 } // namespace Lemon
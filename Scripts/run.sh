@@ -8,6 +8,10 @@ qemu(){
 	qemu-system-x86_64 --enable-kvm -cpu host $LEMOND/Disks/Lemon.img -no-reboot -no-shutdown -m 1024M -M q35 -smp 2 -serial stdio -netdev user,id=net0 -device e1000,netdev=net0,mac=DE:AD:69:BE:EF:42 -device ac97
 }
 
+qemuvirtio(){
+	qemu-system-x86_64 --enable-kvm -cpu host $LEMOND/Disks/Lemon.img -no-reboot -no-shutdown -m 1024M -M q35 -smp 2 -serial stdio -netdev user,id=net0 -device virtio-net-pci,netdev=net0,mac=DE:AD:69:BE:EF:42,rx_queue_size=1024 -device ac97
+}
+
 qemuefi(){
 	qemu-system-x86_64 --enable-kvm -cpu host --bios /usr/share/edk2-ovmf/x64/OVMF.fd -M q35 -m 512M -drive file=$LEMOND/Disks/Lemon.img,id=nvme0 -device nvme,serial=deadbeef69,id=nvme0 -serial stdio
 }
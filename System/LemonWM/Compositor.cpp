@@ -5,10 +5,32 @@
 #include <Lemon/Core/Logger.h>
 #include <Lemon/Graphics/Graphics.h>
 
+#include <algorithm>
+
 //#define COMPOSITOR_DEBUG
 
 using namespace Lemon;
 
+// Unlike Rect::Intersects, rects sharing a single row or column of pixels overlap
+static inline bool Overlaps(const Rect& a, const Rect& b) {
+    return a.x < b.x + b.width && b.x < a.x + a.width && a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+static inline long Area(const Rect& r) { return static_cast<long>(r.width) * r.height; }
+
+// Get the part of a inside b, false if they do not overlap
+static inline bool Intersection(const Rect& a, const Rect& b, Rect& result) {
+    if (!Overlaps(a, b)) {
+        return false;
+    }
+
+    result.x = std::max(a.x, b.x);
+    result.y = std::max(a.y, b.y);
+    result.width = std::min(a.x + a.width, b.x + b.width) - result.x;
+    result.height = std::min(a.y + a.height, b.y + b.height) - result.y;
+    return true;
+}
+
 Compositor::Compositor(const Surface& displaySurface) : m_displaySurface(displaySurface) {
     // Create a backbuffer surface for rendering
     m_renderSurface = displaySurface;
@@ -28,6 +50,11 @@ Compositor::Compositor(const Surface& displaySurface) : m_displaySurface(display
         m_cursorResize = m_cursorNormal;
     }
 
+    // Big enough for either cursor
+    m_cursorSurface.width = std::max(m_cursorNormal.width, m_cursorResize.width);
+    m_cursorSurface.height = std::max(m_cursorNormal.height, m_cursorResize.height);
+    m_cursorSurface.buffer = new uint8_t[m_cursorSurface.width * m_cursorSurface.height * 4];
+
     clock_gettime(CLOCK_BOOTTIME, &m_lastRender);
 }
 
@@ -50,14 +77,17 @@ void Compositor::Render() {
         }
     }
 
+    // The cursor is drawn straight to the display surface,
+    // moving it does not invalidate anything
     Vector2i mousePos = WM::Instance().Input().mouse.pos;
-    if (mousePos != m_lastMousePos) {
-        Invalidate({m_lastMousePos, m_cursorCurrent->width, m_cursorCurrent->height});
-        m_lastMousePos = mousePos;
-    }
 
     m_renderMutex.lock();
 
+    if (m_contextMenuShown && !WM::Instance().m_showContextMenu) {
+        Invalidate(m_contextMenuBounds); // Redraw whatever was underneath
+        m_contextMenuShown = false;
+    }
+
     if (m_wallpaperThread.joinable() && m_wallpaperStatus) {
         m_wallpaperThread.join();
     }
@@ -65,7 +95,14 @@ void Compositor::Render() {
     if (m_invalidateAll) {
         RecalculateBackgroundClipping();
         RecalculateWindowClipping();
-        RecalculateRenderClipping();
+
+        m_damage.clear();
+        AddDamage({0, 0, m_renderSurface.width, m_renderSurface.height});
+
+        // Everything gets redrawn anyway
+        for (WMWindow* win : WM::Instance().m_windows) {
+            win->TakeDamage(m_windowDamage);
+        }
 
         // We fill the areas of the screen being redrawn in debug mode
         // This happens before the render surface is blitted to the display surface
@@ -85,30 +122,34 @@ void Compositor::Render() {
         }
     } else {
         for (WMWindow* win : WM::Instance().m_windows) {
-            if (win->IsDirtyAndClear()) {
-                // If the window is transparent, we will need to invalidate
-                // any rects underneath the window
+            if (!win->TakeDamage(m_windowDamage)) {
+                continue;
+            }
 
-                // If the window is occluded, we will need to invalidate any rects
-                // above the clip
+            // If the window is transparent, we will need to invalidate
+            // any rects underneath the damage
 
-                // Otherwise, just set the window rect as invalid
-                // and move on
+            // If the clip is occluded, we will need to invalidate any rects
+            // above the damage
 
-                if(win->IsTransparent()) for(auto& r : m_windowClipRects) {
-                    if(r.win == win) {
-                        Invalidate(r.rect);
+            // Otherwise only the damaged part of the clip gets copied
+            for (auto& r : m_windowClipRects) {
+                if (r.win != win || r.type != WindowClipRect::TypeWindow) {
+                    continue;
+                }
+
+                for (const Rect& damage : m_windowDamage) {
+                    Rect clip;
+                    if (!Intersection(r.rect, damage, clip)) {
+                        continue;
                     }
-                } else for(auto& r : m_windowClipRects) {
-                    if(r.win == win) {
-                        if(r.occluded) {
-                            Invalidate(r.rect);
-                        } else {
-                            r.invalid = true;
-                        }
+
+                    if (win->IsTransparent() || r.occluded) {
+                        Invalidate(clip);
+                    } else {
+                        r.damage.push_back(clip);
                     }
                 }
-                
             }
         }
     }
@@ -120,6 +161,7 @@ void Compositor::Render() {
             }
 
             m_renderSurface.Blit(&m_wallpaper, rect.rect.pos, rect.rect);
+            AddDamage(rect.rect);
 
 #ifdef COMPOSITOR_DEBUG
             Lemon::Graphics::DrawRectOutline(rect.rect, {255, 0, 0, 255}, &m_renderSurface);
@@ -132,12 +174,13 @@ void Compositor::Render() {
     for (auto it = m_windowClipRects.begin(); it != m_windowClipRects.end();) {
         WMWindow* win = it->win;
 
-        if (m_invalidateAll || it->invalid) { // Window buffer not dirty, only draw invalid clips
+        if (m_invalidateAll || it->invalid) { // Redraw the whole clip
             if (it->type == WindowClipRect::TypeWindowDecoration) {
                 win->DrawDecorationClip(it->rect, &m_renderSurface);
             } else {
                 win->DrawClip(it->rect, &m_renderSurface);
             }
+            AddDamage(it->rect);
 
 #ifdef COMPOSITOR_DEBUG
             Lemon::Graphics::DrawRect(it->rect, {255, 0, 0, 255}, &m_displaySurface);
@@ -148,32 +191,46 @@ void Compositor::Render() {
 #endif
 
             it->invalid = false;
-            it++;
         } else {
-            it++;
+            for (const Rect& damage : it->damage) {
+                win->DrawClip(damage, &m_renderSurface);
+                AddDamage(damage);
+            }
         }
+
+        it->damage.clear();
+        it++;
     }
 
     if (WM::Instance().m_showContextMenu) {
-        Lemon::Graphics::DrawRoundedRect(WM::Instance().m_contextMenu.bounds, WMWindow::theme.titlebarColour, 5, 5, 5,
+        const Rect& bounds = WM::Instance().m_contextMenu.bounds;
+        Lemon::Graphics::DrawRoundedRect(bounds, WMWindow::theme.titlebarColour, 5, 5, 5,
                                          5, &m_renderSurface);
         for (const auto& ent : WM::Instance().m_contextMenu.entries) {
             const Vector2i& pos = ent.bounds.pos;
             Lemon::Graphics::DrawString(ent.text.c_str(), pos.x, pos.y, GUI::Theme::Current().ColourText(),
                                         &m_renderSurface);
         }
-    }
 
-    m_renderSurface.AlphaBlit(m_cursorCurrent, mousePos);
+        // Anything redrawn underneath is already damaged, so only a new menu has to be copied
+        if (!m_contextMenuShown || bounds.pos != m_contextMenuBounds.pos || bounds.size != m_contextMenuBounds.size) {
+            AddDamage(bounds);
+        }
+
+        m_contextMenuShown = true;
+        m_contextMenuBounds = bounds;
+    }
 
     if (m_displayFramerate) {
-        Lemon::Graphics::DrawRect(0, 0, 80, 18, 0, 0, 0, &m_renderSurface);
-        Lemon::Graphics::DrawString(std::to_string(m_fRate).c_str(), 0, 0, 255, 255, 255, &m_renderSurface);
+        Lemon::Graphics::DrawRect(0, 0, 120, 18, 0, 0, 0, &m_renderSurface);
+        Lemon::Graphics::DrawString((std::to_string(m_fRate) + " fps " + std::to_string(m_frameBytes / 1024) + " KiB").c_str(), 0, 0, 255, 255, 255, &m_renderSurface);
+        AddDamage({0, 0, 120, 18});
     }
 
-    // Copy the render surface to the display surface
-    // Generally actually faster than copying each individual clip region
-    m_displaySurface.Blit(&m_renderSurface);
+    FlushDamage();
+    UpdateCursor(mousePos);
+
+    m_damage.clear();
     m_invalidateAll = false;
 
     m_renderMutex.unlock();
@@ -193,11 +250,11 @@ void Compositor::Invalidate(const Rect& rect) {
 
         if (bgRect.rect.Intersects(rect)) {
             bgRect.invalid = true; // Set bg rect as invalid
-        }
 
-        for (auto& wRect : m_windowClipRects) {
-            if (wRect.rect.Intersects(bgRect.rect)) {
-                wRect.invalid = true;
+            for (auto& wRect : m_windowClipRects) {
+                if (wRect.rect.Intersects(bgRect.rect)) {
+                    wRect.invalid = true;
+                }
             }
         }
     }
@@ -225,12 +282,6 @@ void Compositor::Invalidate(const Rect& rect) {
             }
         }
     }
-
-    for(auto& rRect : m_renderClipRects) {
-        if(rRect.rect.Intersects(rect)) {
-            rRect.invalid = true;
-        }
-    }
 }
 
 void Compositor::InvalidateWindow(class WMWindow* window) { Invalidate(window->GetContentRect()); }
@@ -373,16 +424,89 @@ void Compositor::RecalculateBackgroundClipping() {
     }
 }
 
-void Compositor::RecalculateRenderClipping() {
-    m_renderClipRects.clear();
-    for(auto& rect : m_backgroundRects) {
-        m_renderClipRects.push_back({rect.rect, true});
+void Compositor::AddDamage(const Rect& rect) {
+    if (rect.width <= 0 || rect.height <= 0) {
+        return;
+    }
+
+    m_damage.push_back(rect);
+}
+
+void Compositor::CoalesceDamage() {
+    // Overlapping rects, and rects which waste nothing by merging, are replaced by their bounding box
+    bool merged;
+    do {
+        merged = false;
+        for (size_t i = 0; i < m_damage.size(); i++) {
+            for (size_t j = i + 1; j < m_damage.size();) {
+                Rect& a = m_damage[i];
+                const Rect& b = m_damage[j];
+
+                Rect bounds;
+                bounds.x = std::min(a.x, b.x);
+                bounds.y = std::min(a.y, b.y);
+                bounds.width = std::max(a.x + a.width, b.x + b.width) - bounds.x;
+                bounds.height = std::max(a.y + a.height, b.y + b.height) - bounds.y;
+
+                if (Overlaps(a, b) || Area(bounds) <= Area(a) + Area(b)) {
+                    a = bounds;
+
+                    m_damage[j] = m_damage.back();
+                    m_damage.pop_back();
+                    merged = true;
+                } else {
+                    j++;
+                }
+            }
+        }
+    } while (merged);
+}
+
+void Compositor::FlushDamage() {
+    CoalesceDamage();
+
+    m_frameBytes = 0;
+    for (const Rect& rect : m_damage) {
+        m_displaySurface.Blit(&m_renderSurface, rect.pos, rect);
+
+        int width = std::min(rect.x + rect.width, m_displaySurface.width) - std::max(rect.x, 0);
+        int height = std::min(rect.y + rect.height, m_displaySurface.height) - std::max(rect.y, 0);
+        if (width > 0 && height > 0) {
+            m_frameBytes += width * height * 4;
+        }
     }
+}
+
+void Compositor::UpdateCursor(const Vector2i& mousePos) {
+    Rect cursorRect = {mousePos, {m_cursorCurrent->width, m_cursorCurrent->height}};
+    bool moved = m_cursorDrawn != m_cursorCurrent || cursorRect.pos != m_cursorRect.pos;
 
-    for(auto& rect : m_windowClipRects) {
-        // Ignore transparent clip rects
-        if(rect.type == WindowClipRect::TypeWindow && !rect.win->IsTransparent()) {
-            m_renderClipRects.push_back({rect.rect, true});
+    bool drawnOver = false;
+    for (const Rect& rect : m_damage) {
+        if (Overlaps(rect, cursorRect)) {
+            drawnOver = true;
+            break;
         }
     }
+
+    if (!moved && !drawnOver) {
+        return;
+    }
+
+    if (moved && m_cursorDrawn) {
+        // Put back what was underneath the old cursor
+        m_displaySurface.Blit(&m_renderSurface, m_cursorRect.pos, m_cursorRect);
+        m_frameBytes += Area(m_cursorRect) * 4;
+    }
+
+    m_cursorSurface.width = m_cursorCurrent->width;
+    m_cursorSurface.height = m_cursorCurrent->height;
+    m_cursorSurface.Blit(&m_renderSurface, {0, 0}, cursorRect);
+    m_cursorSurface.AlphaBlit(m_cursorCurrent, {0, 0});
+
+    m_displaySurface.Blit(&m_cursorSurface, mousePos);
+    m_frameBytes += Area(cursorRect) * 4;
+
+    m_cursorDrawn = m_cursorCurrent;
+    m_cursorRect = cursorRect;
 }
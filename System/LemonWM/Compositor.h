@@ -7,6 +7,7 @@
 #include <ctime>
 #include <list>
 #include <thread>
+#include <vector>
 
 template <typename T, class... D> std::list<T> SplitModify(Rect& victim, const Rect& cut, D... extraData) {
     std::list<T> clips;
@@ -84,6 +85,9 @@ struct WindowClipRect {
     bool invalid = true;
     bool occluded = false;
 
+    // Committed parts of the window to copy, when the whole clip is not invalid
+    std::vector<Rect> damage;
+
     std::list<WindowClipRect> SplitModify(const Rect& cut) { return ::SplitModify<WindowClipRect>(rect, cut, win, type, true, occluded); }
     std::list<WindowClipRect> Split(const Rect& cut) { return ::Split<WindowClipRect>(rect, cut, win, type, true, occluded); }
 };
@@ -117,7 +121,15 @@ public:
 private:
     void RecalculateWindowClipping();
     void RecalculateBackgroundClipping();
-    void RecalculateRenderClipping();
+
+    // Mark part of the render surface as changed this frame
+    void AddDamage(const Rect& rect);
+    // Merge overlapping damage rects so no pixel gets copied twice
+    void CoalesceDamage();
+    // Copy the damaged parts of the render surface to the display surface
+    void FlushDamage();
+    // Redraw the cursor on the display surface if it moved or was drawn over
+    void UpdateCursor(const Vector2i& mousePos);
 
     void InvalidateBackgroundRect(BackgroundClipRect& bgRect);
     void InvalidateWindowRect(WindowClipRect& wRect);
@@ -126,16 +138,25 @@ private:
     bool m_invalidateAll = true;
     bool m_displayFramerate = false;
 
-    Vector2i m_lastMousePos = {0, 0};
     Surface m_cursorNormal; // Normal mouse cursor
     Surface m_cursorResize; // Window resize mouse cursor
     Surface* m_cursorCurrent = &m_cursorNormal; // Current mouse cursor
 
+    // The cursor never touches the render surface, it is blended over a copy
+    // of what is underneath and only that small surface goes to the display
+    Surface m_cursorSurface;
+    Surface* m_cursorDrawn = nullptr; // Cursor on the display surface
+    Rect m_cursorRect = {0, 0, 0, 0}; // Where it was drawn
+
+    bool m_contextMenuShown = false;
+    Rect m_contextMenuBounds = {0, 0, 0, 0};
+
     // Used for framerate counter
     timespec m_lastRender;
     long m_avgFrametime = 0;
     long m_fCount = 0;
     int m_fRate = 0;
+    size_t m_frameBytes = 0; // Bytes copied to the display surface last frame
 
     Surface m_renderSurface;  // Backbuffer to render to
     Surface m_displaySurface; // Display mapped surface
@@ -148,7 +169,9 @@ private:
 
     std::list<BackgroundClipRect> m_backgroundRects;
     std::list<WindowClipRect> m_windowClipRects;
-    // Clip rects used when determining which parts of the screen
-    // to copy to the framebuffer
-    std::list<BackgroundClipRect> m_renderClipRects;
+    // Parts of the render surface redrawn this frame,
+    // only these get copied to the display surface
+    std::vector<Rect> m_damage;
+    // Damage committed by the window being processed, in screen coordinates
+    std::vector<Rect> m_windowDamage;
 };
@@ -525,3 +525,14 @@ void WM::OnSubscribeToWindowEvents(const Lemon::Handle& client) {
 
     m_wmEventSubscribers.push_back(std::move(endp));
 }
+
+void WM::OnCommitBuffer(const Lemon::Handle&, int64_t windowID, uint32_t bufferIndex, uint64_t serial,
+                        const std::string& damage) {
+    WMWindow* win = GetWindowFromID(windowID);
+    if (!win) {
+        Lemon::Logger::Warning("OnCommitBuffer: Invalid Window ID: {}", windowID);
+        return;
+    }
+
+    win->Commit(bufferIndex, serial, damage);
+}
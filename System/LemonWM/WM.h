@@ -88,6 +88,8 @@ private:
     void OnGetScreenBounds(const Lemon::Handle& client) override;
     void OnReloadConfig(const Lemon::Handle& client) override;
     void OnSubscribeToWindowEvents(const Lemon::Handle& client) override;
+    void OnCommitBuffer(const Lemon::Handle& client, int64_t windowID, uint32_t bufferIndex, uint64_t serial,
+                        const std::string& damage) override;
 
     timespec m_lastUpdate;
     long m_targetFramerate = 0;              // Used for framerate limiter
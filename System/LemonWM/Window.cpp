@@ -57,7 +57,6 @@ void WMWindow::DrawDecorationClip(const Rect& clip, Surface* surface) {
 }
 
 void WMWindow::DrawClip(const Rect& clip, Surface* surface) {
-    m_buffer->drawing = 1;
     m_windowSurface.buffer = m_buffer->currentBuffer ? (m_buffer2) : (m_buffer1);
 
     Rect clipCopy = clip;
@@ -68,8 +67,59 @@ void WMWindow::DrawClip(const Rect& clip, Surface* surface) {
     } else {
         surface->Blit(&m_windowSurface, clip.pos, clipCopy);
     }
+}
+
+void WMWindow::Commit(uint32_t bufferIndex, uint64_t serial, const std::string& damage) {
+    // Window buffers are only read whilst rendering on this thread,
+    // so the buffer previously on screen is free as soon as we switch
+    m_buffer->currentBuffer = bufferIndex ? 1 : 0;
+
+    Rect bounds = {{0, 0}, m_size};
+    size_t count = std::min<size_t>(damage.length() / sizeof(Rect), WINDOW_MAX_DAMAGE_RECTS);
+    if (!count) {
+        m_damage.clear();
+        m_damage.push_back(bounds);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        Rect rect;
+        memcpy(&rect, damage.data() + i * sizeof(Rect), sizeof(Rect));
+
+        // Clamp to the window contents
+        int left = std::max(rect.x, 0);
+        int top = std::max(rect.y, 0);
+        int right = std::min(rect.x + rect.width, bounds.width);
+        int bottom = std::min(rect.y + rect.height, bounds.height);
+        if (right > left && bottom > top) {
+            m_damage.push_back({left, top, right - left, bottom - top});
+        }
+    }
+
+    // Several commits between frames, just redraw everything
+    if (m_damage.size() > WINDOW_MAX_DAMAGE_RECTS * 2) {
+        m_damage.clear();
+        m_damage.push_back(bounds);
+    }
+
+    // A serial of 0 means the client is not waiting on the old buffer
+    if (serial) {
+        BufferReleased(m_id, serial);
+    }
+}
+
+bool WMWindow::TakeDamage(std::vector<Rect>& damage) {
+    damage.clear();
+    if (m_damage.empty()) {
+        return false;
+    }
+
+    for (Rect rect : m_damage) {
+        rect.pos += m_contentRect.pos;
+        damage.push_back(rect);
+    }
 
-    m_buffer->drawing = 0;
+    m_damage.clear();
+    return true;
 }
 
 int WMWindow::GetResizePoint(Vector2i absolutePosition) const {
@@ -113,6 +163,7 @@ void WMWindow::Resize(int width, int height) {
     assert(!e);
 
     m_size = {width, height};
+    m_damage.clear();
 
     CreateWindowBuffer();
     Queue(Lemon::Message(LemonWMServer::ResponseResize, LemonWMServer::ResizeResponse{m_bufferKey}));
@@ -199,6 +250,7 @@ void WMWindow::CreateWindowBuffer() {
     m_buffer = reinterpret_cast<GUI::WindowBuffer*>(Lemon::MapSharedMemory(m_bufferKey));
 
     memset(m_buffer, 0, sizeof(GUI::WindowBuffer));
+    m_buffer->currentBuffer = 1; // Clients draw to buffer 1 first
     m_buffer->buffer1Offset = ((sizeof(GUI::WindowBuffer) + 0x1F) & (~0x1FULL));
     m_buffer->buffer2Offset = ((sizeof(GUI::WindowBuffer) + 0x1F) & (~0x1FULL)) + bufferSize;
 
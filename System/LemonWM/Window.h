@@ -4,6 +4,7 @@
 #include <Lemon/Graphics/Types.h>
 
 #include <string>
+#include <vector>
 
 #define RESIZE_HANDLE_SIZE 7
 #define MIN_WINDOW_RESIZE_WIDTH 50
@@ -81,12 +82,13 @@ public:
     // This will get the window content size accounting for the window decorations
     Vector2i NewWindowSizeFromRect(const Rect& rect) const;
 
-    // Get whether the window buffer is dirty and regardless clear it
-    inline bool IsDirtyAndClear() {
-        bool isDirty = m_buffer->dirty;
-        m_buffer->dirty = 0;
-        return isDirty;
-    }
+    // Display a buffer drawn by the client, damage is a packed array of rects in content coordinates.
+    // An empty damage list covers the whole window.
+    void Commit(uint32_t bufferIndex, uint64_t serial, const std::string& damage);
+
+    // Take the damage from any commits since the last call in screen coordinates,
+    // returns false if nothing has been committed
+    bool TakeDamage(std::vector<Rect>& damage);
 
     inline void SendEvent(const Lemon::LemonEvent& event) {
         LemonWMClientEndpoint::SendEvent(m_id, event.event, event.data);
@@ -119,6 +121,8 @@ private:
     uint8_t* m_buffer2;
     Surface m_windowSurface;
 
+    std::vector<Rect> m_damage; // Committed damage in content coordinates
+
     int64_t m_id;
 
     std::string m_title;
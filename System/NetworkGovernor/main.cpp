@@ -295,6 +295,10 @@ int main() {
             continue; // Ignore . and ..
         }
 
+        if (strcmp(entry->d_name, "lo") == 0 || strcmp(entry->d_name, "stats") == 0) {
+            continue; // The loopback adapter is configured by the kernel and stats is not an adapter
+        }
+
         int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
         if (sock < 0) {
             perror("Error creating UDP socket");
@@ -1,44 +1,93 @@
+#include <lemon/syscall.h>
+
+#include <Lemon/System/ABI/Pipe.h>
+
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <vector>
 
-std::vector<FILE*> files;
+#define CAT_BUFFER_SIZE 0x10000
+
+std::vector<int> files;
+
+// When stdout is a pipe the kernel can move the data for us without copying it through userspace,
+// returns 0 on success, 1 when it has to be copied instead and -1 on error
+int SpliceFile(int fd){
+    long ret;
+    bool moved = false;
+    while((ret = syscall(SYS_SPLICE, fd, nullptr, STDOUT_FILENO, nullptr, CAT_BUFFER_SIZE, 0)) > 0){
+        moved = true;
+    }
+
+    if(ret == 0){
+        return 0;
+    } else if(!moved){
+        return 1;
+    }
+
+    errno = -ret;
+    return -1;
+}
+
+int CopyFile(int fd){
+    static char buffer[CAT_BUFFER_SIZE];
+
+    ssize_t len;
+    while((len = read(fd, buffer, CAT_BUFFER_SIZE)) > 0){
+        ssize_t written = 0;
+        while(written < len){
+            ssize_t ret = write(STDOUT_FILENO, buffer + written, len - written);
+            if(ret < 0){
+                return -1;
+            }
+
+            written += ret;
+        }
+    }
+
+    return len < 0 ? -1 : 0;
+}
 
 int main(int argc, char** argv){
     if(argc < 2){
-        files.push_back(stdin);
+        files.push_back(STDIN_FILENO);
     } else {
         for(int i = 1; i < argc; i++){
             if(strcmp(argv[i], "-") == 0){
-                files.push_back(stdin);
+                files.push_back(STDIN_FILENO);
                 continue;
             }
 
-            FILE* f = fopen(argv[i], "r");
+            int fd = open(argv[i], O_RDONLY);
 
-            if(!f){
+            if(fd < 0){
                 fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], strerror(errno));
                 continue;
             }
 
-            files.push_back(f);
+            files.push_back(fd);
         }
     }
 
-    for(FILE*& f : files){
-        while(char c = fgetc(f)){
-            if(int e = ferror(f); e){
-                printf("%s: %s", argv[0], strerror(errno));
-                return errno;
-            } else if(feof(f) || c == EOF){
-                return 0;
-            }
+    struct stat st;
+    bool splice = !fstat(STDOUT_FILENO, &st) && S_ISFIFO(st.st_mode);
+
+    for(int fd : files){
+        int ret = splice ? SpliceFile(fd) : 1;
+        if(ret > 0){
+            ret = CopyFile(fd);
+        }
 
-            fputc(c, stdout);
+        if(ret < 0){
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            return 1;
         }
     }
 
     return 0;
-}
\ No newline at end of file
+}
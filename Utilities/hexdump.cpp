@@ -8,6 +8,48 @@
 size_t limit = __UINT64_MAX__;
 size_t offset = 0;
 
+void Dump(FILE* f){
+    setvbuf(f, nullptr, _IONBF, 0);
+
+    unsigned char buf[512];
+
+    // Pipes cannot seek so skip by reading instead
+    if(fseek(f, offset, SEEK_SET)){
+        size_t skipped = 0;
+        while(skipped < offset){
+            size_t len = fread(buf, 1, ((offset - skipped) < 512) ? (offset - skipped) : 512, f);
+            if(!len){
+                return;
+            }
+
+            skipped += len;
+        }
+    }
+
+    size_t len;
+    while((len = fread(buf, 1, (((limit - offset) < 512) ? (limit - offset) : 512), f)) && offset < limit){
+        for(unsigned j = 0; j < (len + 15) / 16; j++){
+            printf("%08lx", offset);
+            for(size_t i = 0; i < 16; i++){
+                printf(" %02x", buf[j * 16 + i]);
+            }
+
+            printf(" | ");
+
+            for(size_t i = 0; i < 16; i++){
+                if(isprint(buf[j * 16 + i]))
+                    printf("%c", buf[j * 16 + i]);
+                else
+                    printf(".");
+            }
+
+            printf("\n");
+
+            offset += 16;
+        }
+    }
+}
+
 int main(int argc, char** argv){
     size_t lengthopt = __UINT64_MAX__;
     int opt;
@@ -25,14 +67,13 @@ int main(int argc, char** argv){
         }
     }
 
-    if(argc - optind < 1){
-        printf("Usage: %s [-n length] [-s skip] <file> [file2 ...]", argv[0]);
-        return 1;
-    }
-
     if(lengthopt != __UINT64_MAX__)
         limit = offset + lengthopt;
 
+    if(argc - optind < 1){
+        Dump(stdin); // Read from a pipe, e.g. cat file | hexdump
+    }
+
     for(int i = optind; i < argc; i++){
         FILE* f = fopen(argv[i], "rb");
 
@@ -41,33 +82,7 @@ int main(int argc, char** argv){
             return 1;
         }
 
-        setvbuf(f, nullptr, _IONBF, 0);
-        fseek(f, offset, SEEK_SET);
-
-        unsigned char buf[512];
-
-        size_t len;
-        while((len = fread(buf, 1, (((limit - offset) < 512) ? (limit - offset) : 512), f)) && offset < limit){
-            for(unsigned j = 0; j < (len + 15) / 16; j++){
-                printf("%08lx", offset);
-                for(size_t i = 0; i < 16; i++){
-                    printf(" %02x", buf[j * 16 + i]);
-                }
-
-                printf(" | ");
-
-                for(size_t i = 0; i < 16; i++){
-                    if(isprint(buf[j * 16 + i]))
-                        printf("%c", buf[j * 16 + i]);
-                    else
-                        printf(".");
-                }
-
-                printf("\n");
-
-                offset += 16;
-            }
-        }
+        Dump(f);
     }
 
     return 0;
@@ -0,0 +1,432 @@
+#include <Lemon/System/ABI/Profiler.h>
+#include <Lemon/System/Util.h>
+
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// The kernel always loads the dynamic linker here
+const uintptr_t linkerBase = 0x7FC0000000;
+const char* linkerPath = "/lib/ld.so";
+const char* kernelSymbolPath = "/initrd/kernel.map";
+
+const char* libraryDirs[] = {"/system/lib", "/lib", "/usr/lib"};
+
+int profilerFd = -1;
+
+struct Symbol {
+    uintptr_t address;
+    uintptr_t size; // 0 if unknown, the symbol then ends at the next one
+    std::string name;
+};
+
+struct Module {
+    std::string name;
+    uintptr_t base = 0; // Added to each symbol, 0 for executables
+    uintptr_t start = 0;
+    uintptr_t end = 0;
+    std::vector<Symbol> symbols; // Sorted by address
+
+    void Sort() {
+        std::sort(symbols.begin(), symbols.end(), [](const Symbol& l, const Symbol& r) { return l.address < r.address; });
+    }
+
+    const Symbol* Lookup(uintptr_t address) const {
+        auto it = std::upper_bound(symbols.begin(), symbols.end(), address,
+                                   [](uintptr_t a, const Symbol& s) { return a < s.address; });
+        if (it == symbols.begin()) {
+            return nullptr;
+        }
+
+        const Symbol& sym = *(--it);
+        if (sym.size && address >= sym.address + sym.size) {
+            return nullptr;
+        }
+
+        return &sym;
+    }
+};
+
+struct ProcessSymbols {
+    std::string name;
+    std::vector<std::shared_ptr<Module>> modules;
+};
+
+static std::string Demangle(const char* name) {
+    int status;
+    char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (!demangled) {
+        return name;
+    }
+
+    std::string result = demangled;
+    free(demangled);
+    return result;
+}
+
+static bool ReadFile(const char* path, std::vector<uint8_t>& data) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    data.resize(size);
+    bool ok = size > 0 && fread(data.data(), 1, size, f) == static_cast<size_t>(size);
+
+    fclose(f);
+    return ok;
+}
+
+// Load the function symbols of an ELF, preferring the full symbol table over the dynamic one.
+// dynamicAddress is set to the address of the dynamic section if there is one
+static std::shared_ptr<Module> LoadELF(const char* path, uintptr_t base, uintptr_t* dynamicAddress = nullptr) {
+    std::vector<uint8_t> data;
+    if (!ReadFile(path, data) || data.size() < sizeof(Elf64_Ehdr)) {
+        return nullptr;
+    }
+
+    const Elf64_Ehdr* header = reinterpret_cast<const Elf64_Ehdr*>(data.data());
+    if (memcmp(header->e_ident, ELFMAG, SELFMAG) || header->e_ident[EI_CLASS] != ELFCLASS64 ||
+        header->e_phoff + header->e_phnum * sizeof(Elf64_Phdr) > data.size() ||
+        header->e_shoff + header->e_shnum * sizeof(Elf64_Shdr) > data.size()) {
+        return nullptr;
+    }
+
+    auto module = std::make_shared<Module>();
+    module->name = path;
+    module->base = base;
+    module->start = UINTPTR_MAX;
+
+    const Elf64_Phdr* phdrs = reinterpret_cast<const Elf64_Phdr*>(data.data() + header->e_phoff);
+    for (unsigned i = 0; i < header->e_phnum; i++) {
+        if (phdrs[i].p_type == PT_LOAD) {
+            module->start = std::min<uintptr_t>(module->start, base + phdrs[i].p_vaddr);
+            module->end = std::max<uintptr_t>(module->end, base + phdrs[i].p_vaddr + phdrs[i].p_memsz);
+        } else if (phdrs[i].p_type == PT_DYNAMIC && dynamicAddress) {
+            *dynamicAddress = base + phdrs[i].p_vaddr;
+        }
+    }
+
+    const Elf64_Shdr* shdrs = reinterpret_cast<const Elf64_Shdr*>(data.data() + header->e_shoff);
+    const Elf64_Shdr* symtab = nullptr;
+    for (unsigned i = 0; i < header->e_shnum; i++) {
+        if (shdrs[i].sh_type == SHT_SYMTAB || (shdrs[i].sh_type == SHT_DYNSYM && !symtab)) {
+            symtab = &shdrs[i];
+        }
+    }
+
+    if (!symtab || symtab->sh_link >= header->e_shnum || symtab->sh_offset + symtab->sh_size > data.size()) {
+        return module;
+    }
+
+    const Elf64_Shdr& strtab = shdrs[symtab->sh_link];
+    if (strtab.sh_offset + strtab.sh_size > data.size()) {
+        return module;
+    }
+
+    const char* strings = reinterpret_cast<const char*>(data.data() + strtab.sh_offset);
+    const Elf64_Sym* syms = reinterpret_cast<const Elf64_Sym*>(data.data() + symtab->sh_offset);
+    for (unsigned i = 0; i < symtab->sh_size / sizeof(Elf64_Sym); i++) {
+        if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC || !syms[i].st_value || syms[i].st_name >= strtab.sh_size) {
+            continue;
+        }
+
+        module->symbols.push_back({base + syms[i].st_value, syms[i].st_size, Demangle(strings + syms[i].st_name)});
+    }
+
+    module->Sort();
+    return module;
+}
+
+// Lines are in the format <address> <type> <name>, the same file the kernel reads
+static std::shared_ptr<Module> LoadKernelSymbols() {
+    FILE* f = fopen(kernelSymbolPath, "r");
+    if (!f) {
+        return nullptr;
+    }
+
+    auto module = std::make_shared<Module>();
+    module->name = "kernel";
+    module->start = UINTPTR_MAX;
+
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        char type;
+        char name[400];
+        unsigned long address;
+        if (sscanf(line, "%lx %c %399s", &address, &type, name) != 3) {
+            continue;
+        }
+
+        if (type != 'T' && type != 't' && type != 'W' && type != 'w') {
+            continue;
+        }
+
+        module->symbols.push_back({address, 0, Demangle(name)});
+        module->start = std::min<uintptr_t>(module->start, address);
+        module->end = std::max<uintptr_t>(module->end, address + 1);
+    }
+
+    fclose(f);
+
+    module->Sort();
+    return module;
+}
+
+static long ReadProcess(pid_t pid, uintptr_t address, void* buffer, size_t size) {
+    lemon_profiler_read_t req = {.pid = pid, .reserved = 0, .address = address, .buffer = buffer, .size = size};
+    return ioctl(profilerFd, IoCtlProfilerReadMemory, &req);
+}
+
+static std::string FindLibrary(const std::string& name) {
+    if (name.find('/') != std::string::npos) {
+        return name;
+    }
+
+    for (const char* dir : libraryDirs) {
+        std::string path = std::string(dir) + "/" + name;
+        if (!access(path.c_str(), R_OK)) {
+            return path;
+        }
+    }
+
+    return name;
+}
+
+// Shared libraries are loaded by ld.so, so follow the link map it leaves in DT_DEBUG
+static void LoadSharedLibraries(pid_t pid, uintptr_t dynamic, ProcessSymbols& proc) {
+    Elf64_Dyn entries[64];
+    long read = ReadProcess(pid, dynamic, entries, sizeof(entries));
+    if (read <= 0) {
+        return;
+    }
+
+    uint64_t debug = 0;
+    for (unsigned i = 0; i < read / sizeof(Elf64_Dyn) && entries[i].d_tag != DT_NULL; i++) {
+        if (entries[i].d_tag == DT_DEBUG) {
+            debug = entries[i].d_un.d_ptr;
+        }
+    }
+
+    // struct r_debug { int r_version; struct link_map* r_map; ... }
+    uint64_t linkMap = 0;
+    if (!debug || ReadProcess(pid, debug + 8, &linkMap, sizeof(linkMap)) != sizeof(linkMap)) {
+        return;
+    }
+
+    // struct link_map { l_addr, l_name, l_ld, l_next, l_prev }
+    for (int count = 0; linkMap && count < 256; count++) {
+        uint64_t entry[4];
+        if (ReadProcess(pid, linkMap, entry, sizeof(entry)) != sizeof(entry)) {
+            break;
+        }
+
+        char name[256] = {};
+        if (entry[0] && entry[0] != linkerBase && entry[1] && ReadProcess(pid, entry[1], name, sizeof(name) - 1) > 0 &&
+            name[0]) {
+            if (auto module = LoadELF(FindLibrary(name).c_str(), entry[0]); module) {
+                proc.modules.push_back(module);
+            }
+        }
+
+        linkMap = entry[3];
+    }
+}
+
+static ProcessSymbols LoadProcessSymbols(pid_t pid) {
+    ProcessSymbols proc;
+
+    lemon_process_info_t info;
+    if (!Lemon::GetProcessInfo(pid, info)) {
+        proc.name = info.name;
+    } else {
+        proc.name = "pid " + std::to_string(pid);
+    }
+
+    char path[PATH_MAX];
+    lemon_profiler_read_t req = {.pid = pid, .reserved = 0, .address = 0, .buffer = path, .size = sizeof(path)};
+    if (ioctl(profilerFd, IoCtlProfilerGetExecutable, &req) || !path[0]) {
+        return proc; // Exited or a kernel process
+    }
+
+    uintptr_t dynamic = 0;
+    if (auto module = LoadELF(path, 0, &dynamic); module) {
+        proc.modules.push_back(module);
+    }
+
+    if (auto module = LoadELF(linkerPath, linkerBase); module) {
+        proc.modules.push_back(module);
+    }
+
+    if (dynamic) {
+        LoadSharedLibraries(pid, dynamic, proc);
+    }
+
+    return proc;
+}
+
+static std::string FrameName(const std::vector<std::shared_ptr<Module>>& modules, uintptr_t address) {
+    for (const auto& module : modules) {
+        if (address < module->start || address >= module->end) {
+            continue;
+        }
+
+        if (const Symbol* sym = module->Lookup(address); sym) {
+            return sym->name;
+        }
+
+        const char* file = strrchr(module->name.c_str(), '/');
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%s+%#lx", file ? file + 1 : module->name.c_str(), address - module->base);
+        return buffer;
+    }
+
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%#lx", address);
+    return buffer;
+}
+
+static void Drain(std::vector<lemon_profile_sample_t>& samples) {
+    lemon_profile_sample_t buffer[64];
+    ssize_t r;
+    while ((r = read(profilerFd, buffer, sizeof(buffer))) > 0) {
+        samples.insert(samples.end(), buffer, buffer + r / sizeof(lemon_profile_sample_t));
+    }
+}
+
+static void Usage() {
+    printf("Usage: lemonprof [-p pid] [-f frequency] [-o file] [seconds]\n"
+           "Samples every process (or just pid) for a few seconds and prints\n"
+           "the stacks in the folded format taken by flamegraph.pl\n"
+           "Sampling every process needs root, otherwise pid must belong to the same user\n"
+           "  -p pid        Only sample pid\n"
+           "  -f frequency  Samples per second on each CPU (default %d, at most %d)\n"
+           "  -o file       Write the stacks to file instead of stdout\n",
+           LEMON_PROFILER_DEFAULT_FREQUENCY, LEMON_PROFILER_MAX_FREQUENCY);
+}
+
+int main(int argc, char** argv) {
+    lemon_profiler_config_t config = {.pid = -1, .frequency = LEMON_PROFILER_DEFAULT_FREQUENCY};
+    const char* outPath = nullptr;
+    int seconds = 5;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:f:o:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            config.pid = atoi(optarg);
+            break;
+        case 'f':
+            config.frequency = atoi(optarg);
+            break;
+        case 'o':
+            outPath = optarg;
+            break;
+        default:
+            Usage();
+            return opt != 'h';
+        }
+    }
+
+    if (optind < argc) {
+        seconds = atoi(argv[optind]);
+    }
+
+    if (seconds <= 0 || !config.frequency || config.frequency > LEMON_PROFILER_MAX_FREQUENCY) {
+        Usage();
+        return 1;
+    }
+
+    profilerFd = open("/dev/profiler", O_RDONLY);
+    if (profilerFd < 0) {
+        perror("lemonprof: /dev/profiler");
+        return 1;
+    }
+
+    if (ioctl(profilerFd, IoCtlProfilerStart, &config)) {
+        perror("lemonprof: failed to start profiler");
+        return 1;
+    }
+
+    fprintf(stderr, "lemonprof: sampling %s at %u Hz for %ds...\n", config.pid < 0 ? "all processes" : "one process",
+            config.frequency, seconds);
+
+    // Keep draining so the buffers do not wrap
+    std::vector<lemon_profile_sample_t> samples;
+    for (int i = 0; i < seconds * 4; i++) {
+        usleep(250000);
+        Drain(samples);
+    }
+
+    ioctl(profilerFd, IoCtlProfilerStop);
+    Drain(samples);
+
+    lemon_profiler_info_t info;
+    if (!ioctl(profilerFd, IoCtlProfilerGetInfo, &info) && info.lost) {
+        fprintf(stderr, "lemonprof: %lu samples were lost\n", info.lost);
+    }
+
+    std::vector<std::shared_ptr<Module>> kernelModules;
+    if (auto kernel = LoadKernelSymbols(); kernel) {
+        kernelModules.push_back(kernel);
+    } else {
+        fprintf(stderr, "lemonprof: failed to load kernel symbols from %s\n", kernelSymbolPath);
+    }
+
+    std::map<pid_t, ProcessSymbols> processes;
+    std::map<std::string, unsigned> stacks;
+    for (const lemon_profile_sample_t& sample : samples) {
+        auto it = processes.find(sample.pid);
+        if (it == processes.end()) {
+            it = processes.insert({sample.pid, LoadProcessSymbols(sample.pid)}).first;
+        }
+
+        // Outermost frame first, everything but the innermost frame of each
+        // stack is a return address so look up the call instruction before it
+        std::string stack = it->second.name;
+        const uint64_t* userFrames = sample.frames + sample.kernelFrames;
+        for (int i = sample.userFrames - 1; i >= 0; i--) {
+            stack += ";" + FrameName(it->second.modules, i ? userFrames[i] - 1 : userFrames[i]);
+        }
+
+        for (int i = sample.kernelFrames - 1; i >= 0; i--) {
+            stack += ";" + FrameName(kernelModules, i ? sample.frames[i] - 1 : sample.frames[i]) + "_[k]";
+        }
+
+        stacks[stack]++;
+    }
+
+    FILE* out = stdout;
+    if (outPath && !(out = fopen(outPath, "w"))) {
+        perror("lemonprof: fopen");
+        return 1;
+    }
+
+    for (auto& [stack, count] : stacks) {
+        fprintf(out, "%s %u\n", stack.c_str(), count);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    fprintf(stderr, "lemonprof: %lu samples, %lu unique stacks\n", samples.size(), stacks.size());
+    return 0;
+}
@@ -0,0 +1,463 @@
+#include <Lemon/System/ABI/Net.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// The first byte of a TCP connection, or of each UDP datagram, tells the server what to do
+enum Mode : uint8_t {
+    ModeEcho = 'E', // Send everything back, used for latency
+    ModeSink = 'S', // Count and drop everything, used for throughput
+    ModeDone = 'D', // UDP only, end of a throughput run, the server replies with what it received
+};
+
+const int defaultPort = 5201;
+const size_t maxDatagram = 1472; // Largest UDP payload which fits in one Ethernet frame
+
+bool udp = false;
+bool showBuffers = false;
+int seconds = 5;
+int pings = 1000;
+size_t pingSize = 64;
+size_t writeSize = 65536;
+
+static uint64_t Now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static double Rate(uint64_t bytes, uint64_t us) { return us ? (bytes * 8.0) / us : 0; } // Mbit/s
+
+static bool WriteAll(int fd, const void* data, size_t len) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    while (len) {
+        ssize_t r = write(fd, p, len);
+        if (r <= 0) {
+            return false;
+        }
+
+        p += r;
+        len -= r;
+    }
+
+    return true;
+}
+
+static bool ReadAll(int fd, void* data, size_t len) {
+    uint8_t* p = reinterpret_cast<uint8_t*>(data);
+    while (len) {
+        ssize_t r = read(fd, p, len);
+        if (r <= 0) {
+            return false;
+        }
+
+        p += r;
+        len -= r;
+    }
+
+    return true;
+}
+
+static void HandleConnection(int fd) {
+    uint8_t mode;
+    if (!ReadAll(fd, &mode, 1)) {
+        return;
+    }
+
+    std::vector<uint8_t> buffer(writeSize);
+    if (mode == ModeEcho) {
+        ssize_t r;
+        while ((r = read(fd, buffer.data(), buffer.size())) > 0) {
+            if (!WriteAll(fd, buffer.data(), r)) {
+                break;
+            }
+        }
+    } else if (mode == ModeSink) {
+        uint64_t received = 0;
+        uint64_t start = 0;
+
+        ssize_t r;
+        while ((r = read(fd, buffer.data(), buffer.size())) > 0) {
+            if (!start) {
+                start = Now();
+            }
+            received += r;
+        }
+
+        uint64_t elapsed = Now() - start;
+        printf("netbench: [server] received %lu bytes in %lu.%03lus, %.1f Mbit/s\n", received, elapsed / 1000000,
+               (elapsed / 1000) % 1000, Rate(received, elapsed));
+    }
+}
+
+static void ServeUDP(int fd) {
+    std::vector<uint8_t> buffer(maxDatagram);
+    uint64_t received = 0;
+
+    for (;;) {
+        sockaddr_in peer;
+        socklen_t peerLen = sizeof(peer);
+
+        ssize_t r = recvfrom(fd, buffer.data(), buffer.size(), 0, reinterpret_cast<sockaddr*>(&peer), &peerLen);
+        if (r <= 0) {
+            continue;
+        }
+
+        if (buffer[0] == ModeEcho) {
+            sendto(fd, buffer.data(), r, 0, reinterpret_cast<sockaddr*>(&peer), peerLen);
+        } else if (buffer[0] == ModeSink) {
+            received += r;
+        } else if (buffer[0] == ModeDone) {
+            sendto(fd, &received, sizeof(received), 0, reinterpret_cast<sockaddr*>(&peer), peerLen);
+            received = 0;
+        }
+    }
+}
+
+static int Listen(const sockaddr_in& address) {
+    int fd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("netbench: socket");
+        return -1;
+    }
+
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address))) {
+        perror("netbench: bind");
+        close(fd);
+        return -1;
+    }
+
+    if (!udp && listen(fd, 4)) {
+        perror("netbench: listen");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void Serve(int fd) {
+    if (udp) {
+        ServeUDP(fd);
+        return;
+    }
+
+    for (;;) {
+        int client = accept(fd, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+
+        HandleConnection(client);
+        close(client);
+    }
+}
+
+static int Connect(const sockaddr_in& address, Mode mode) {
+    int fd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("netbench: socket");
+        return -1;
+    }
+
+    if (udp) {
+        return fd; // Datagrams are sent with sendto, each one carries its mode
+    }
+
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address))) {
+        perror("netbench: connect");
+        close(fd);
+        return -1;
+    }
+
+    int noDelay = (mode == ModeEcho); // Nagle would hold back every ping
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    uint8_t m = mode;
+    if (!WriteAll(fd, &m, 1)) {
+        perror("netbench: write");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static ssize_t Send(int fd, const void* data, size_t len, const sockaddr_in& address) {
+    if (udp) {
+        return sendto(fd, data, len, 0, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    }
+
+    return send(fd, data, len, 0);
+}
+
+// Wait up to a second for a datagram, false if it never came
+static bool ReceiveTimeout(int fd, void* buffer, size_t len) {
+    pollfd p = {.fd = fd, .events = POLLIN, .revents = 0};
+    if (poll(&p, 1, 1000) <= 0) {
+        return false;
+    }
+
+    return recv(fd, buffer, len, 0) > 0;
+}
+
+static int RunLatency(const sockaddr_in& address) {
+    int fd = Connect(address, ModeEcho);
+    if (fd < 0) {
+        return 1;
+    }
+
+    std::vector<uint8_t> message(pingSize, 0);
+    std::vector<uint8_t> reply(pingSize);
+    message[0] = ModeEcho;
+
+    std::vector<uint64_t> times;
+    int lost = 0;
+    for (int i = 0; i < pings; i++) {
+        uint64_t start = Now();
+        if (udp) {
+            Send(fd, message.data(), message.size(), address);
+            if (!ReceiveTimeout(fd, reply.data(), reply.size())) {
+                lost++;
+                continue;
+            }
+        } else if (!WriteAll(fd, message.data(), message.size()) || !ReadAll(fd, reply.data(), reply.size())) {
+            perror("netbench: connection lost");
+            close(fd);
+            return 1;
+        }
+
+        times.push_back(Now() - start);
+    }
+    close(fd);
+
+    if (times.empty()) {
+        printf("netbench: no replies\n");
+        return 1;
+    }
+
+    std::sort(times.begin(), times.end());
+
+    uint64_t total = 0;
+    for (uint64_t t : times) {
+        total += t;
+    }
+
+    printf("netbench: %zu byte round trips: min %lu us, avg %lu us, p99 %lu us, max %lu us", pingSize, times.front(),
+           total / times.size(), times[(times.size() * 99) / 100], times.back());
+    if (lost) {
+        printf(", %d lost", lost);
+    }
+    printf("\n");
+
+    return 0;
+}
+
+static int RunThroughput(const sockaddr_in& address) {
+    int fd = Connect(address, ModeSink);
+    if (fd < 0) {
+        return 1;
+    }
+
+    size_t size = udp ? std::min(writeSize, maxDatagram) : writeSize;
+    std::vector<uint8_t> buffer(size, 0);
+    buffer[0] = ModeSink;
+
+    uint64_t sent = 0;
+    uint64_t start = Now();
+    uint64_t end = start + seconds * 1000000ULL;
+
+    uint64_t now = start;
+    while ((now = Now()) < end) {
+        ssize_t r = Send(fd, buffer.data(), buffer.size(), address);
+        if (r < 0) {
+            perror("netbench: send");
+            break;
+        }
+        sent += r;
+    }
+
+    uint64_t elapsed = now - start;
+    printf("netbench: [client] sent %lu bytes in %lu.%03lus, %.1f Mbit/s\n", sent, elapsed / 1000000,
+           (elapsed / 1000) % 1000, Rate(sent, elapsed));
+
+    if (udp) {
+        uint8_t done = ModeDone;
+        uint64_t received;
+
+        Send(fd, &done, 1, address);
+        if (ReceiveTimeout(fd, &received, sizeof(received))) {
+            printf("netbench: [server] received %lu bytes (%.1f%% lost), %.1f Mbit/s\n", received,
+                   sent ? 100.0 * (sent - std::min(sent, received)) / sent : 0.0, Rate(received, elapsed));
+        } else {
+            printf("netbench: no reply from the server\n");
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+static bool ReadBufferStats(lemon_net_stats_t& stats) {
+    int fd = open("/dev/net/stats", O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool read = ReadAll(fd, &stats, sizeof(stats));
+    close(fd);
+    return read;
+}
+
+// Run a test, with -b also print how the kernel's packet buffer counters moved whilst it ran
+static int Run(int (*test)(const sockaddr_in&), const sockaddr_in& address) {
+    lemon_net_stats_t before;
+    bool stats = showBuffers && ReadBufferStats(before);
+    if (showBuffers && !stats) {
+        fprintf(stderr, "netbench: could not read /dev/net/stats\n");
+    }
+
+    int ret = test(address);
+
+    lemon_net_stats_t after;
+    if (!stats || !ReadBufferStats(after)) {
+        return ret;
+    }
+
+    const char* layers[NetLayerCount] = {"driver", "ethernet", "ipv4", "udp", "tcp", "socket"};
+    printf("netbench: %-8s %12s %12s %14s %10s\n", "layer", "allocations", "copies", "bytes copied", "drops");
+    for (int i = 0; i < NetLayerCount; i++) {
+        const lemon_net_layer_stats_t& b = before.layers[i];
+        const lemon_net_layer_stats_t& a = after.layers[i];
+        printf("netbench: %-8s %12lu %12lu %14lu %10lu\n", layers[i], a.allocations - b.allocations,
+               a.copies - b.copies, a.bytesCopied - b.bytesCopied, a.drops - b.drops);
+    }
+    printf("netbench: %u packet buffers, %u free\n", after.buffers, after.freeBuffers);
+
+    return ret;
+}
+
+static void Usage() {
+    printf("Usage: netbench [-u] [-b] [-l | -c host] [-p port] [-t seconds] [-n pings] [-s size] [-w size]\n"
+           "Measures round trip latency and throughput. With neither -l nor -c the server\n"
+           "and client both run in this process over the loopback adapter (127.0.0.1)\n"
+           "  -u          Use UDP instead of TCP\n"
+           "  -b          Show packet buffer allocations, copies and drops for each layer\n"
+           "  -l          Only run the server\n"
+           "  -c host     Only run the client, connecting to host\n"
+           "  -p port     Port to use (default %d)\n"
+           "  -t seconds  Length of the throughput test (default 5)\n"
+           "  -n pings    Round trips in the latency test (default 1000)\n"
+           "  -s size     Size of each ping (default 64)\n"
+           "  -w size     Size of each write in the throughput test (default 65536)\n",
+           defaultPort);
+}
+
+int main(int argc, char** argv) {
+    bool server = true;
+    bool client = true;
+    const char* host = "127.0.0.1";
+    int port = defaultPort;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "ublc:p:t:n:s:w:h")) != -1) {
+        switch (opt) {
+        case 'u':
+            udp = true;
+            break;
+        case 'b':
+            showBuffers = true;
+            break;
+        case 'l':
+            client = false;
+            break;
+        case 'c':
+            server = false;
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'n':
+            pings = atoi(optarg);
+            break;
+        case 's':
+            pingSize = strtoul(optarg, nullptr, 10);
+            break;
+        case 'w':
+            writeSize = strtoul(optarg, nullptr, 10);
+            break;
+        default:
+            Usage();
+            return opt != 'h';
+        }
+    }
+
+    if (!server && !client) {
+        Usage();
+        return 1;
+    }
+
+    if (port <= 0 || port > UINT16_MAX || seconds <= 0 || pings <= 0 || !pingSize || !writeSize ||
+        (udp && pingSize > maxDatagram)) {
+        Usage();
+        return 1;
+    }
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (!inet_aton(host, &address.sin_addr)) {
+        fprintf(stderr, "netbench: invalid address '%s'\n", host);
+        return 1;
+    }
+
+    if (server) {
+        sockaddr_in bindAddress = address;
+        if (!client) {
+            bindAddress.sin_addr.s_addr = INADDR_ANY;
+        }
+
+        int fd = Listen(bindAddress);
+        if (fd < 0) {
+            return 1;
+        }
+
+        if (!client) {
+            printf("netbench: listening on port %d (%s)\n", port, udp ? "UDP" : "TCP");
+            Serve(fd);
+            return 0;
+        }
+
+        std::thread(Serve, fd).detach();
+    }
+
+    if (Run(RunLatency, address)) {
+        return 1;
+    }
+
+    int ret = Run(RunThroughput, address);
+    if (server && !udp) {
+        usleep(100000); // Give the server a moment to print what it received
+    }
+
+    return ret;
+}
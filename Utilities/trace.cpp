@@ -0,0 +1,293 @@
+#include <Lemon/System/ABI/Trace.h>
+#include <Lemon/System/Util.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+// Tracks for things which do not belong to a thread
+const int cpuTrackPid = 1000000;
+const int diskTrackPid = 1000001;
+
+int traceFd = -1;
+
+struct CPUState {
+    bool running = false; // Whether we know which thread is on the CPU
+    uint64_t since = 0;
+    int pid = 0;
+    int tid = 0;
+    int irqDepth = 0;
+};
+
+class TraceWriter {
+public:
+    TraceWriter(FILE* out) : m_out(out) { fprintf(m_out, "{\"traceEvents\":[\n"); }
+
+    ~TraceWriter() { fprintf(m_out, "\n],\"displayTimeUnit\":\"ns\"}\n"); }
+
+    // Begins an event, the caller finishes the object
+    void Event(const char* ph, uint64_t timestamp, int pid, int tid) {
+        fprintf(m_out, "%s{\"ph\":\"%s\",\"ts\":%lu.%03lu,\"pid\":%d,\"tid\":%d", m_first ? "" : ",\n", ph,
+                timestamp / 1000, timestamp % 1000, pid, tid);
+        m_first = false;
+    }
+
+    void ProcessName(int pid, const char* name) {
+        Event("M", 0, pid, 0);
+        fprintf(m_out, ",\"name\":\"process_name\",\"args\":{\"name\":\"%s\"}}", name);
+    }
+
+    void ThreadName(int pid, int tid, const char* name) {
+        Event("M", 0, pid, tid);
+        fprintf(m_out, ",\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}", name);
+    }
+
+    FILE* Out() { return m_out; }
+
+private:
+    FILE* m_out;
+    bool m_first = true;
+};
+
+// Events on the thread which was running, or the CPU if there was none
+static void ThreadTrack(const lemon_trace_record_t& r, int& pid, int& tid) {
+    if (r.pid < 0) {
+        pid = cpuTrackPid;
+        tid = r.cpu;
+    } else {
+        pid = r.pid;
+        tid = r.tid;
+    }
+}
+
+static void WriteChromeTrace(std::vector<lemon_trace_record_t>& records, FILE* out) {
+    std::stable_sort(records.begin(), records.end(),
+                     [](const lemon_trace_record_t& l, const lemon_trace_record_t& r) { return l.timestamp < r.timestamp; });
+
+    TraceWriter writer(out);
+    FILE* f = writer.Out();
+
+    std::map<int, CPUState> cpus;
+    std::map<std::pair<int, int>, int> openSlices; // Syscalls and page faults open on each thread
+    std::set<int> pids;
+
+    auto closeSlice = [&](int pid, int tid, uint64_t timestamp) -> bool {
+        int& depth = openSlices[{pid, tid}];
+        if (!depth) {
+            return false; // Began before tracing started
+        }
+
+        depth--;
+        writer.Event("E", timestamp, pid, tid);
+        return true;
+    };
+
+    for (const lemon_trace_record_t& r : records) {
+        int pid, tid;
+        ThreadTrack(r, pid, tid);
+        if (r.pid >= 0) {
+            pids.insert(r.pid);
+        }
+
+        CPUState& cpu = cpus[r.cpu];
+        switch (r.type) {
+        case TraceEventSchedSwitch:
+            // Interrupts which switched threads never see their exit
+            for (; cpu.irqDepth > 0; cpu.irqDepth--) {
+                writer.Event("E", r.timestamp, cpuTrackPid, r.cpu);
+                fprintf(f, "}");
+            }
+
+            if (cpu.running) {
+                writer.Event("X", cpu.since, cpuTrackPid, r.cpu);
+                fprintf(f, ",\"dur\":%lu.%03lu,\"name\":\"%d:%d\"}", (r.timestamp - cpu.since) / 1000,
+                        (r.timestamp - cpu.since) % 1000, cpu.pid, cpu.tid);
+            }
+
+            cpu = {.running = true, .since = r.timestamp, .pid = r.pid, .tid = r.tid, .irqDepth = 0};
+            break;
+        case TraceEventSyscallEntry:
+            openSlices[{pid, tid}]++;
+            writer.Event("B", r.timestamp, pid, tid);
+            fprintf(f, ",\"cat\":\"syscall\",\"name\":\"syscall %lu\"}", r.args[0]);
+            break;
+        case TraceEventSyscallExit:
+            if (closeSlice(pid, tid, r.timestamp)) {
+                fprintf(f, ",\"args\":{\"result\":%ld}}", static_cast<int64_t>(r.args[1]));
+            }
+            break;
+        case TraceEventPageFault:
+            openSlices[{pid, tid}]++;
+            writer.Event("B", r.timestamp, pid, tid);
+            fprintf(f, ",\"cat\":\"mm\",\"name\":\"page fault\",\"args\":{\"address\":\"%#lx\",\"error\":%lu,\"rip\":\"%#lx\"}}",
+                    r.args[0], r.args[1], r.args[2]);
+            break;
+        case TraceEventPageFaultEnd:
+            if (closeSlice(pid, tid, r.timestamp)) {
+                fprintf(f, "}");
+            }
+            break;
+        case TraceEventBlockSubmit:
+            writer.Event("b", r.timestamp, diskTrackPid, 0);
+            fprintf(f, ",\"cat\":\"block\",\"id\":\"%#lx\",\"name\":\"%s\",\"args\":{\"lba\":%lu,\"size\":%lu,\"pid\":%d}}",
+                    r.args[0], (r.args[2] & LEMON_TRACE_BLOCK_WRITE) ? "write" : "read", r.args[1],
+                    r.args[2] & ~LEMON_TRACE_BLOCK_WRITE, r.pid);
+            break;
+        case TraceEventBlockComplete:
+            // Async events are matched by id, category and name
+            writer.Event("e", r.timestamp, diskTrackPid, 0);
+            fprintf(f, ",\"cat\":\"block\",\"id\":\"%#lx\",\"args\":{\"status\":%ld}}", r.args[0],
+                    static_cast<int64_t>(r.args[2]));
+            break;
+        case TraceEventIPCSend:
+        case TraceEventIPCReceive:
+            writer.Event("i", r.timestamp, pid, tid);
+            fprintf(f, ",\"cat\":\"ipc\",\"s\":\"t\",\"name\":\"%s\",\"args\":{\"endpoint\":\"%#lx\",\"id\":%lu,\"size\":%lu}}",
+                    r.type == TraceEventIPCSend ? "send" : "receive", r.args[0], r.args[1], r.args[2]);
+            break;
+        case TraceEventIRQEntry:
+            cpu.irqDepth++;
+            writer.Event("B", r.timestamp, cpuTrackPid, r.cpu);
+            fprintf(f, ",\"cat\":\"irq\",\"name\":\"irq %lu\"}", r.args[0]);
+            break;
+        case TraceEventIRQExit:
+            if (cpu.irqDepth > 0) {
+                cpu.irqDepth--;
+                writer.Event("E", r.timestamp, cpuTrackPid, r.cpu);
+                fprintf(f, "}");
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Close whatever was still running when tracing stopped
+    uint64_t end = records.size() ? records.back().timestamp : 0;
+    for (auto& [id, cpu] : cpus) {
+        if (cpu.running) {
+            writer.Event("X", cpu.since, cpuTrackPid, id);
+            fprintf(f, ",\"dur\":%lu.%03lu,\"name\":\"%d:%d\"}", (end - cpu.since) / 1000, (end - cpu.since) % 1000,
+                    cpu.pid, cpu.tid);
+        }
+
+        char name[16];
+        snprintf(name, sizeof(name), "CPU %d", id);
+        writer.ThreadName(cpuTrackPid, id, name);
+    }
+
+    writer.ProcessName(cpuTrackPid, "CPUs");
+    writer.ProcessName(diskTrackPid, "Disk I/O");
+
+    // Processes may have exited since
+    for (int pid : pids) {
+        lemon_process_info_t info;
+        if (!Lemon::GetProcessInfo(pid, info)) {
+            writer.ProcessName(pid, info.name);
+        }
+    }
+}
+
+static int Dump(const char* path) {
+    std::vector<lemon_trace_record_t> records;
+
+    lemon_trace_record_t buffer[256];
+    ssize_t r;
+    while ((r = read(traceFd, buffer, sizeof(buffer))) > 0) {
+        records.insert(records.end(), buffer, buffer + r / sizeof(lemon_trace_record_t));
+    }
+
+    if (r < 0) {
+        perror("trace: read");
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if (path && !(out = fopen(path, "w"))) {
+        perror("trace: fopen");
+        return 1;
+    }
+
+    WriteChromeTrace(records, out);
+
+    if (out != stdout) {
+        fclose(out);
+        printf("Wrote %lu events to %s\n", records.size(), path);
+    }
+
+    return 0;
+}
+
+static int Info() {
+    lemon_trace_info_t info;
+    if (ioctl(traceFd, IoCtlTraceGetInfo, &info)) {
+        perror("trace: ioctl");
+        return 1;
+    }
+
+    printf("Tracing: %s\nCPUs: %u (%u records each)\nPending: %lu\nLost: %lu\n", info.enabled ? "on" : "off",
+           info.cpuCount, info.recordsPerCPU, info.pending, info.lost);
+    return 0;
+}
+
+static void Usage() {
+    printf("Usage: trace <command>\n"
+           "  start                   Clear the trace buffers and start recording\n"
+           "  stop                    Stop recording\n"
+           "  info                    Show whether tracing is on and how many records are waiting\n"
+           "  dump [file]             Write unread records as Chrome trace JSON, for chrome://tracing or Perfetto\n"
+           "  record <seconds> [file] Record for a while then dump\n"
+           "Tracing needs root\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        Usage();
+        return 1;
+    }
+
+    traceFd = open("/dev/trace", O_RDONLY);
+    if (traceFd < 0) {
+        perror("trace: /dev/trace");
+        return 1;
+    }
+
+    const char* cmd = argv[1];
+    if (!strcmp(cmd, "start")) {
+        if (ioctl(traceFd, IoCtlTraceClear) || ioctl(traceFd, IoCtlTraceEnable)) {
+            perror("trace: ioctl");
+            return 1;
+        }
+    } else if (!strcmp(cmd, "stop")) {
+        if (ioctl(traceFd, IoCtlTraceDisable)) {
+            perror("trace: ioctl");
+            return 1;
+        }
+    } else if (!strcmp(cmd, "info")) {
+        return Info();
+    } else if (!strcmp(cmd, "dump")) {
+        return Dump(argc > 2 ? argv[2] : nullptr);
+    } else if (!strcmp(cmd, "record") && argc > 2) {
+        if (ioctl(traceFd, IoCtlTraceClear) || ioctl(traceFd, IoCtlTraceEnable)) {
+            perror("trace: ioctl");
+            return 1;
+        }
+
+        sleep(atoi(argv[2]));
+        ioctl(traceFd, IoCtlTraceDisable);
+        return Dump(argc > 3 ? argv[3] : nullptr);
+    } else {
+        Usage();
+        return 1;
+    }
+
+    return 0;
+}